@@ -1,7 +1,10 @@
 # Copyright (c) Lexfo
 # SPDX-License-Identifier: BSD-3-Clause
 
+import collections
 import contextlib
+import select
+import socket
 import threading
 import time
 import weakref
@@ -13,24 +16,66 @@ from . import utils
 from .utils import logging
 from .utils import tcpserver
 
-__all__ = ("BridgeThread", )
+__all__ = ("BridgeThread", "SocksSessionInfo")
 
 logger = logging.get_internal_logger(__name__)
 
+# SOCKS data sent to server-side kept per SOCKS link, to be sent again once the
+# session resumed (see proto.ChannelSetupFlag.RESUME)
+REPLAY_MAX = 256 * 1024
+
+# a snapshot of a local SOCKS session, see BridgeThread.socks_sessions()
+# * *age* and *idle* are in seconds, *idle* being the time since data last
+#   went through it, either way
+# * *bytes_in* went from server-side to the SOCKS client, *bytes_out* the other
+#   way, both cumulative
+# * *output_queue* is the number of bytes received from server-side but not
+#   sent to the SOCKS client yet
+SocksSessionInfo = collections.namedtuple(
+    "SocksSessionInfo", (
+        "socks_token", "peer", "age", "idle", "bytes_in", "bytes_out",
+        "output_queue", "resuming"))
+
 
 class _SocksClient(utils.NoDict):
-    __slots__ = ("socks_token", "tcp_token", "_tcp_client_weak")
+    __slots__ = (
+        "socks_token", "tcp_token", "channel", "udp_relay", "tx_offset",
+        "rx_offset", "replay", "replay_offset", "resuming", "created",
+        "last_active", "bytes_in", "bytes_out", "_tcp_client_weak")
 
-    def __init__(self, socks_token, tcp_client):
+    def __init__(self, socks_token, tcp_client, channel):
         assert isinstance(tcp_client, tcpserver.TcpServerClient)
 
         super().__init__()
 
         self.socks_token = socks_token
         self.tcp_token = tcp_client.token
+        self.channel = channel  # the WRITE channel all its packets go to
+        self.udp_relay = None  # see _UdpRelay
+
+        # see proto.SocksResumePacket; *replay* holds the SOCKS data sent from
+        # *replay_offset* up to *tx_offset*, including the data held back
+        # while *resuming*
+        self.tx_offset = 0
+        self.rx_offset = 0
+        self.replay = bytearray()
+        self.replay_offset = 0
+        self.resuming = False
+
+        # see SocksSessionInfo
+        self.created = time.monotonic()
+        self.last_active = self.created
+        self.bytes_in = 0
+        self.bytes_out = 0
 
         self._tcp_client_weak = weakref.ref(tcp_client)
 
+    def trim_replay(self):
+        excess = len(self.replay) - REPLAY_MAX
+        if excess > 0 and not self.resuming:
+            del self.replay[:excess]
+            self.replay_offset += excess
+
     @property
     def tcp_client(self):
         return self._tcp_client_weak()
@@ -41,10 +86,111 @@ class _SocksClient(utils.NoDict):
     #     return tcp_client is None or tcp_client.is_closed
 
 
+class _UdpRelay(threading.Thread):
+    """
+    The local end of a UDP association (SOCKS5 UDP ASSOCIATE).
+
+    Server-side runs the UDP socket that talks to the targets, this one is the
+    address the local SOCKS client is told to send its datagrams to. They are
+    relayed as is, SOCKS5 UDP request header included, several of them per
+    SOCKS_UDP packet when they come in a row. The first datagram tells where
+    the local SOCKS client sends from, the ones from anywhere else are dropped,
+    and this is where the datagrams from server-side go.
+    """
+
+    BATCH_MAX = 32  # datagrams per SOCKS_UDP packet
+
+    def __init__(self, socks_token, bind_host, proto_client, channel):
+        super().__init__(daemon=True, name=f"udp-relay-{socks_token:x}")
+
+        family = socket.AF_INET6 if ":" in bind_host else socket.AF_INET
+
+        self._socks_token = socks_token
+        self._proto_client = proto_client
+        self._channel = channel
+        self._client_addr = None
+        self._stop_event = threading.Event()
+
+        self._sock = socket.socket(family, socket.SOCK_DGRAM)
+        try:
+            self._sock.bind((bind_host, 0))
+            self._sock.setblocking(False)
+        except Exception:
+            self._sock.close()
+            raise
+
+    @property
+    def bind_addr(self):
+        return self._sock.getsockname()
+
+    def request_termination(self):
+        self._stop_event.set()
+
+    def deliver(self, datagrams):
+        # nowhere to send them until the local SOCKS client sent one
+        client_addr = self._client_addr
+        if client_addr is None:
+            return
+
+        for datagram in datagrams:
+            try:
+                self._sock.sendto(datagram, client_addr)
+            except OSError:
+                # lost, as a datagram may be
+                pass
+
+    def run(self):
+        try:
+            while not self._stop_event.is_set():
+                readable, _, _ = select.select([self._sock], [], [], 0.5)
+                if readable:
+                    self._relay_pending()
+        except Exception:
+            if not self._stop_event.is_set():
+                logger.exception("UDP relay terminated with an error")
+        finally:
+            with contextlib.suppress(OSError):
+                self._sock.close()
+
+    def _relay_pending(self):
+        datagrams = []
+        size = (
+            proto.HEADER_STRUCT.size + proto.SocksUdpPacket.PAYLOAD_STRUCT.size)
+
+        # stop early enough for the packet to fit in a capped frame whatever
+        # the size of the next datagram (see proto.ChannelSetupFlag.FRAME_CAP)
+        while (len(datagrams) < self.BATCH_MAX and
+                size + proto.SocksUdpPacket.RECORD_STRUCT.size + 0xffff <=
+                proto.MAX_FRAME_SIZE):
+            try:
+                datagram, addr = self._sock.recvfrom(0xffff)
+            except BlockingIOError:
+                break
+            except ConnectionResetError:
+                # ICMP port unreachable of a previous sendto() on Windows
+                continue
+
+            if self._client_addr is None:
+                self._client_addr = addr
+            elif addr != self._client_addr:
+                continue
+
+            if datagram:
+                datagrams.append(datagram)
+                size += proto.SocksUdpPacket.RECORD_STRUCT.size + len(datagram)
+
+        if datagrams:
+            packet = proto.SocksUdpPacket(self._socks_token, datagrams)
+            with contextlib.suppress(Exception):
+                self._proto_client.send(
+                    packet.serialize(), channel=self._channel)
+
+
 class BridgeThread(namedpipeclient.ProtoClientObserver,
                    tcpserver.TcpServerObserver):
     def __init__(self, *, smb_config, pipe_name, socks_bind_addrs,
-                 proto_keep_alive=None, observers=()):
+                 channel_tcp_port=None, channels=1, proto_keep_alive=None,
+                 observers=()):
         assert isinstance(smb_config, smb.SmbConfig)
 
         namedpipeclient.ProtoClientObserver.__init__(self)
@@ -62,6 +208,8 @@ class BridgeThread(namedpipeclient.ProtoClientObserver,
         self._proto_client = namedpipeclient.ProtoClientThread(
             smb_config=smb_config,
             pipe_name=pipe_name,
+            tcp_port=channel_tcp_port,
+            channels=channels,
             observers=self,
             keep_alive=proto_keep_alive)
 
@@ -116,6 +264,32 @@ class BridgeThread(namedpipeclient.ProtoClientObserver,
         self._proto_client.unregister_all_observers(observer)
         self._socks_tcp_server.unregister_all_observers(observer)
 
+    def socks_sessions(self):
+        """
+        Return a list of `SocksSessionInfo`, one per local SOCKS session
+        """
+        now = time.monotonic()
+        sessions = []
+
+        with self._lock:
+            for socks_client in self._socks_clients_by_socks.values():
+                tcp_client = socks_client.tcp_client
+                if tcp_client is None:
+                    peer = None
+                    output_queue = 0
+                else:
+                    peer = str(tcp_client.remote_addr)
+                    output_queue = tcp_client.output_queue_size
+
+                sessions.append(SocksSessionInfo(
+                    socks_client.socks_token, peer,
+                    now - socks_client.created,
+                    now - socks_client.last_active,
+                    socks_client.bytes_in, socks_client.bytes_out,
+                    output_queue, socks_client.resuming))
+
+        return sessions
+
     def protoclient_wait_for_connection(self, **kwargs):
         return self._proto_client.wait_for_connection(**kwargs)
 
@@ -165,7 +339,8 @@ class BridgeThread(namedpipeclient.ProtoClientObserver,
         if tcp_server is self._socks_tcp_server:
             with self._lock:
                 socks_client = _SocksClient(
-                    self._generate_socks_token(), tcp_client)
+                    self._generate_socks_token(), tcp_client,
+                    self._pick_channel())
 
                 # register SOCKS client locally
                 self._socks_clients_by_socks[socks_client.socks_token] = socks_client
@@ -183,16 +358,44 @@ class BridgeThread(namedpipeclient.ProtoClientObserver,
             # fetch packet(s) from this TCP client
             socks_packets = tcp_client.recv()
 
-            # relay every packet to the server-side
-            for socks_packet in socks_packets:
+            with self._lock:
+                socks_client.bytes_out += sum(map(len, socks_packets))
+                socks_client.last_active = time.monotonic()
+
+            # kept in case it has to be sent again, and held back while
+            # resuming
+            if self._proto_client.resumable:
+                with self._lock:
+                    for socks_packet in socks_packets:
+                        socks_client.replay += socks_packet
+                        socks_client.tx_offset += len(socks_packet)
+
+                    if socks_client.resuming:
+                        return
+
+                    socks_client.trim_replay()
+
+            self._send_socks_data(socks_client, socks_packets)
+
+    def _send_socks_data(self, socks_client, socks_packets):
+        # relay every packet to the server-side, split so that it fits in a
+        # capped frame (see proto.ChannelSetupFlag.FRAME_CAP)
+        max_data = (
+            proto.MAX_FRAME_SIZE - proto.HEADER_STRUCT.size -
+            proto.SocksPacket.PAYLOAD_STRUCT.size)
+
+        for socks_packet in socks_packets:
+            for offset in range(0, len(socks_packet), max_data):
                 packet = proto.SocksPacket(
-                    socks_client.socks_token, socks_packet)
+                    socks_client.socks_token,
+                    socks_packet[offset:offset+max_data])
                 packet = packet.serialize()
 
                 # logger.debug(
-                #     f"forwarding {len(packet)} bytes SOCKS from TCP to server")
+                #     f"forwarding {len(packet)} bytes SOCKS from TCP to "
+                #     f"server")
 
-                self._proto_client.send(packet)
+                self._proto_client.send(packet, channel=socks_client.channel)
 
     def _on_tcp_disconnected(self, tcp_server, tcp_client_token):
         if tcp_server is self._socks_tcp_server:
@@ -203,7 +406,8 @@ class BridgeThread(namedpipeclient.ProtoClientObserver,
             # notify server-side so that it can disconnect and remove the
             # related SOCKS link
             packet = proto.SocksDisconnectedPacket(socks_client.socks_token)
-            self._proto_client.send(packet.serialize())
+            self._proto_client.send(
+                packet.serialize(), channel=socks_client.channel)
 
             with self._lock:
                 self._pending_socks_disconnect_uids.add(packet.uid)
@@ -224,10 +428,28 @@ class BridgeThread(namedpipeclient.ProtoClientObserver,
             self.request_termination()
 
     def _on_proto_connected(self, np_client):
-        pass
+        if np_client is not self._proto_client or np_client.resumed:
+            return
+
+        # the session they belonged to could not be resumed
+        with self._lock:
+            stale = [
+                socks_client
+                for socks_client in self._socks_clients_by_socks.values()
+                if socks_client.resuming]
+
+        for socks_client in stale:
+            self._close_socks_client(socks_client)
 
     def _on_proto_disconnected(self, np_client):
-        pass
+        if np_client is not self._proto_client or not np_client.resumable:
+            return
+
+        # held until server-side tells where it is at, see
+        # _on_proto_recv_SOCKS_RESUME()
+        with self._lock:
+            for socks_client in self._socks_clients_by_socks.values():
+                socks_client.resuming = True
 
     def _on_proto_recv_CHANNEL_SETUP(self, np_client, packet):
         logger.debug(
@@ -253,7 +475,15 @@ class BridgeThread(namedpipeclient.ProtoClientObserver,
                 f"{np_client.addr_str} (uid: {packet.uid})")
 
     def _on_proto_recv_PING(self, np_client, packet):
-        packet = proto.StatusPacket(proto.Status.OK, uid=packet.uid)
+        if packet.stamp is None:
+            packet = proto.StatusPacket(proto.Status.OK, uid=packet.uid)
+        elif packet.kind == proto.PingKind.REQUEST:
+            # measures the RTT of the channel, see ChannelSetupFlag.PING_RTT
+            packet = proto.PingPacket(
+                packet.stamp, proto.PingKind.REPLY, uid=packet.uid)
+        else:
+            return
+
         packet = packet.serialize()
         np_client.send(packet)
 
@@ -261,30 +491,102 @@ class BridgeThread(namedpipeclient.ProtoClientObserver,
         assert isinstance(packet, proto.SocksPacket)
 
         if np_client is self._proto_client:
-            socks_client = self._find_socks_client_by_socks(packet.socks_id)
-            if socks_client is None:
-                # logger.debug(
-                #     f"server-side notified about unregistered SOCKS "
-                #     f"link ID {packet.socks_id}; ignoring...")
-                return
+            self._relay_socks_packet(packet.socks_id, packet.socks_packet)
 
-            # IMPORTANT: keep a ref to tcp_client since *socks_client* holds a
-            # weakref only
-            tcp_client = socks_client.tcp_client
-            if tcp_client is None:
-                return
+    def _on_proto_recv_SOCKS_BATCH(self, np_client, packet):
+        assert isinstance(packet, proto.SocksBatchPacket)
+
+        if np_client is self._proto_client:
+            for socks_id, socks_packet in packet.records:
+                self._relay_socks_packet(socks_id, socks_packet)
 
+    def _relay_socks_packet(self, socks_id, socks_packet):
+        socks_client = self._find_socks_client_by_socks(socks_id)
+        if socks_client is None:
             # logger.debug(
-            #     f"forwarding {len(packet.socks_packet)} bytes SOCKS back to "
-            #     f"TCP client")
+            #     f"server-side notified about unregistered SOCKS "
+            #     f"link ID {socks_id}; ignoring...")
+            return
 
-            try:
-                tcp_client.send(packet.socks_packet)
-            except Exception:
-                # if logger.isEnabledFor(logging.DEBUG):
-                logger.exception("failed to relay SOCKS packet to TCP side")
+        with self._lock:
+            socks_client.rx_offset += len(socks_packet)
+            socks_client.bytes_in += len(socks_packet)
+            socks_client.last_active = time.monotonic()
+
+        # IMPORTANT: keep a ref to tcp_client since *socks_client* holds a
+        # weakref only
+        tcp_client = socks_client.tcp_client
+        if tcp_client is None:
+            return
+
+        # logger.debug(
+        #     f"forwarding {len(socks_packet)} bytes SOCKS back to "
+        #     f"TCP client")
+
+        try:
+            tcp_client.send(socks_packet)
+        except Exception:
+            # if logger.isEnabledFor(logging.DEBUG):
+            logger.exception("failed to relay SOCKS packet to TCP side")
+            return
+
+    def _on_proto_recv_SOCKS_UDP_ASSOCIATED(self, np_client, packet):
+        assert isinstance(packet, proto.SocksUdpAssociatedPacket)
+
+        if np_client is not self._proto_client:
+            return
+
+        socks_client = self._find_socks_client_by_socks(packet.socks_id)
+        if socks_client is None or socks_client.udp_relay is not None:
+            return
+
+        tcp_client = socks_client.tcp_client
+        if tcp_client is None:
+            return
+
+        # server-side does not reply to UDP ASSOCIATE, since BND.ADDR and
+        # BND.PORT are the ones of the local relay, on the address the SOCKS
+        # client reached us at
+        try:
+            bind_host = tcp_client.sock.getsockname()[0]
+            relay = _UdpRelay(
+                socks_client.socks_token, bind_host, self._proto_client,
+                socks_client.channel)
+            bind_addr = relay.bind_addr
+        except Exception as exc:
+            logger.warning(f"failed to set up UDP relay: {exc}")
+            with contextlib.suppress(Exception):
+                tcp_client.send(b"\x05\x01\x00\x01\x00\x00\x00\x00\x00\x00")
+            return
+
+        if ":" in bind_addr[0]:
+            reply = b"\x05\x00\x00\x04"
+            reply += socket.inet_pton(socket.AF_INET6, bind_addr[0])
+        else:
+            reply = b"\x05\x00\x00\x01"
+            reply += socket.inet_aton(bind_addr[0])
+        reply += bind_addr[1].to_bytes(2, "big")
+
+        with self._lock:
+            socks_client.udp_relay = relay
+
+        relay.start()
+
+        try:
+            tcp_client.send(reply)
+        except Exception:
+            logger.exception("failed to relay SOCKS packet to TCP side")
+
+    def _on_proto_recv_SOCKS_UDP(self, np_client, packet):
+        assert isinstance(packet, proto.SocksUdpPacket)
+
+        if np_client is self._proto_client:
+            socks_client = self._find_socks_client_by_socks(packet.socks_id)
+            if socks_client is None or socks_client.udp_relay is None:
                 return
 
+            socks_client.udp_relay.deliver(packet.datagrams)
+
     def _on_proto_recv_SOCKS_CLOSE(self, np_client, packet):
         assert isinstance(packet, (
             proto.SocksClosePacket, proto.SocksDisconnectedPacket))
@@ -303,6 +605,89 @@ class BridgeThread(namedpipeclient.ProtoClientObserver,
         assert isinstance(packet, proto.SocksDisconnectedPacket)
         self._on_proto_recv_SOCKS_CLOSE(np_client, packet)
 
+    def _on_proto_recv_SOCKS_RESUME(self, np_client, packet):
+        assert isinstance(packet, proto.SocksResumePacket)
+
+        if np_client is not self._proto_client:
+            return
+
+        # end of server's list: the SOCKS links it did not mention are not
+        # known to it anymore
+        if packet.socks_id == proto.INVALID_SOCKS_ID:
+            with self._lock:
+                stale = [
+                    socks_client
+                    for socks_client in self._socks_clients_by_socks.values()
+                    if socks_client.resuming]
+
+            for socks_client in stale:
+                self._close_socks_client(socks_client)
+
+            self._proto_client.send(
+                proto.SocksResumePacket(proto.INVALID_SOCKS_ID, 0).serialize())
+            return
+
+        socks_client = self._find_socks_client_by_socks(packet.socks_id)
+
+        with self._lock:
+            if socks_client is None:
+                lost = True
+            else:
+                start = packet.offset - socks_client.replay_offset
+                lost = (
+                    packet.offset < socks_client.replay_offset or
+                    packet.offset > socks_client.tx_offset)
+
+            if not lost:
+                rx_offset = socks_client.rx_offset
+                data = bytes(socks_client.replay[start:])
+                socks_client.resuming = False
+                socks_client.trim_replay()
+
+        # what server missed is not held anymore, or the link is closed already
+        if lost:
+            if socks_client is not None:
+                self._close_socks_client(socks_client)
+
+            reply = proto.SocksDisconnectedPacket(packet.socks_id)
+            self._proto_client.send(
+                reply.serialize(),
+                channel=0 if socks_client is None else socks_client.channel)
+
+            with self._lock:
+                self._pending_socks_disconnect_uids.add(reply.uid)
+            return
+
+        # server does not replay SOCKS_FLOW packets, the RESUME that would end
+        # a pause may have been lost
+        tcp_client = socks_client.tcp_client
+        if tcp_client is not None:
+            tcp_client.set_recv_paused(False)
+
+        # ahead of the data sent again, on the same channel
+        self._proto_client.send(
+            proto.SocksResumePacket(packet.socks_id, rx_offset).serialize(),
+            channel=socks_client.channel)
+
+        if data:
+            self._send_socks_data(socks_client, (data, ))
+
+    def _on_proto_recv_SOCKS_FLOW(self, np_client, packet):
+        assert isinstance(packet, proto.SocksFlowPacket)
+
+        if np_client is not self._proto_client:
+            return
+
+        # server's SOCKS target does not keep up: stop reading from the local
+        # SOCKS client meanwhile
+        socks_client = self._find_socks_client_by_socks(packet.socks_id)
+        if socks_client is None:
+            return
+
+        tcp_client = socks_client.tcp_client
+        if tcp_client is not None:
+            tcp_client.set_recv_paused(packet.flow == proto.SocksFlow.PAUSE)
+
     def _on_proto_recv_UNINSTALL_SELF(self, np_client, packet):
         logger.debug(
             f"weird, received a {packet.opcode.name} packet from named pipe "
@@ -315,6 +700,24 @@ class BridgeThread(namedpipeclient.ProtoClientObserver,
                 if socks_token not in self._socks_clients_by_socks:
                     return socks_token
 
+    def _pick_channel(self):
+        # the least loaded WRITE channel for a new SOCKS link: the one with
+        # the least data waiting to be written, then the fewest SOCKS links
+        channels = self._proto_client.channels
+        if channels == 1:
+            return 0
+
+        queued = self._proto_client.write_queue_sizes()
+        links = [0] * channels
+
+        with self._lock:
+            for socks_client in self._socks_clients_by_socks.values():
+                links[socks_client.channel] += 1
+
+        return min(
+            range(channels),
+            key=lambda channel: (queued[channel], links[channel]))
+
     def _find_socks_client_by_socks(self, socks_token):
         with self._lock:
             try:
@@ -329,6 +732,12 @@ class BridgeThread(namedpipeclient.ProtoClientObserver,
             except KeyError:
                 return None
 
+    def _close_socks_client(self, socks_client):
+        with contextlib.suppress(KeyError):
+            self._socks_tcp_server.close_client(socks_client.tcp_token)
+
+        self._unregister_socks_client(socks_client)
+
     def _unregister_socks_client(self, socks_client):
         with self._lock:
             with contextlib.suppress(KeyError):
@@ -336,3 +745,10 @@ class BridgeThread(namedpipeclient.ProtoClientObserver,
 
             with contextlib.suppress(KeyError):
                 del self._socks_clients_by_tcp[socks_client.tcp_token]
+
+            udp_relay = socks_client.udp_relay
+            socks_client.udp_relay = None
+
+        # the relay closes its socket on its way out
+        if udp_relay is not None:
+            udp_relay.request_termination()
@@ -3,7 +3,9 @@
 
 import cmd
 import contextlib
+import io
 import sys
+import threading
 import time
 
 from . import bridge as mod_bridge
@@ -14,6 +16,7 @@ from . import proto
 from . import smb
 from . import svcmgr as mod_svcmgr
 from . import wmi
+from . import utils
 from .utils import cmdkeyint
 from .utils import dispatcher
 from .utils import logging
@@ -23,6 +26,14 @@ __all__ = ("BridgeCli", )
 
 logger = logging.get_internal_logger(__name__)
 
+# "top" command: default refresh interval (seconds) and number of refreshes,
+# how long to wait for a STATS reply (seconds), and how many SOCKS sessions to
+# list at most
+TOP_INTERVAL = 2.0
+TOP_COUNT = 10
+TOP_STATS_TIMEOUT = 5.0
+TOP_MAX_SESSIONS = 20
+
 _USAGE = """
 standalone commands:
 
@@ -77,6 +88,19 @@ rpc2socks related:
   ping
     send an application-layer PING request to named pipe's server-side
 
+  stats
+    query and print the counters of named pipe's server-side
+
+  top [interval] [count]
+    * default: "top 2 10"
+    * print a view of the tunnel every [interval] seconds, [count] times; on
+      Unix, Ctrl-C stops it early
+    * throughput, queues, RTT and connect latency of named pipe's server-side,
+      then local SOCKS sessions, busiest first: throughput, bytes not sent to
+      the SOCKS client yet (QUEUE), and time since data last went through
+      (IDLE); "*" marks the ones held until the tunnel resumes
+    * synchronous command
+
   st
     print connectivity status
 
@@ -88,7 +112,8 @@ class BridgeCli(cmdkeyint.Cmd,
                 tcpserver.TcpServerObserver):
     def __init__(self, *,
                  smb_config, pipe_name, rshare_name, rexe_name,
-                 proto_keep_alive=None, socks_bind_addrs, start_cmds=()):
+                 channel_tcp_port=None, channels=1, proto_keep_alive=None,
+                 socks_bind_addrs, start_cmds=()):
         tcpserver.TcpServerObserver.__init__(self)
         namedpipeclient.ProtoClientObserver.__init__(self)
 
@@ -102,6 +127,8 @@ class BridgeCli(cmdkeyint.Cmd,
         self._pipe_name = pipe_name
         self._rshare_name = rshare_name
         self._rexe_name = rexe_name
+        self._channel_tcp_port = channel_tcp_port
+        self._channels = channels
         self._proto_keep_alive = proto_keep_alive
         self._socks_bind_addrs = socks_bind_addrs
 
@@ -111,6 +138,10 @@ class BridgeCli(cmdkeyint.Cmd,
         self._bridge = None
         self._service_installed = None
 
+        # STATS replies awaited by the "top" command; {uid: stats or None}
+        self._stats_cond = threading.Condition()
+        self._stats_pending = {}
+
         # for cmd in start_cmds:
         #     self.cmdqueue.append(cmd)
 
@@ -211,6 +242,51 @@ class BridgeCli(cmdkeyint.Cmd,
             if not self._bridge.protoclient_send(packet):
                 print("ERROR: failed to send PING request")
 
+    def do_stats(self, argsline):
+        if self._quit:
+            return True
+
+        if self._bridge is None:
+            print("bridge not connected")
+        else:
+            packet = proto.StatsPacket()
+            packet = packet.serialize()
+            if not self._bridge.protoclient_send(packet):
+                print("ERROR: failed to send STATS request")
+
+    def do_top(self, argsline):
+        if self._quit:
+            return True
+
+        if self._bridge is None:
+            print("bridge not connected")
+            return
+
+        args = argsline.split()
+        try:
+            if len(args) > 2:
+                raise ValueError
+            interval = float(args[0]) if len(args) >= 1 else TOP_INTERVAL
+            count = int(args[1]) if len(args) >= 2 else TOP_COUNT
+            if interval <= 0 or count <= 0:
+                raise ValueError
+        except ValueError:
+            print(f'ERROR: invalid args "{argsline}"')
+            return
+
+        # rates are computed between two samples
+        try:
+            sample = self._sample_top()
+            for _ in range(count):
+                time.sleep(interval)
+                if self._quit or self._bridge is None:
+                    break
+
+                prev_sample, sample = sample, self._sample_top()
+                self._print_top(prev_sample, sample)
+        except KeyboardInterrupt:
+            print()
+
     def do_quit(self, argsline):
         self._quit = True
         self._disconnect_bridge()
@@ -323,13 +399,153 @@ class BridgeCli(cmdkeyint.Cmd,
                 np_client.reconnect()
 
     def _on_proto_recv_PING(self, np_client, packet):
-        logger.info(
-            f"replied to a PING request from named pipe {np_client.addr_str}")
+        # the periodic ones that measure RTT are not worth a log line
+        if packet.stamp is None:
+            logger.info(
+                f"replied to a PING request from named pipe "
+                f"{np_client.addr_str}")
+
+    def _on_proto_recv_STATS(self, np_client, packet):
+        if packet.stats is None:
+            return  # a request, not for us
+
+        # awaited by the "top" command, see _query_stats()
+        with self._stats_cond:
+            if packet.uid in self._stats_pending:
+                self._stats_pending[packet.uid] = packet.stats
+                self._stats_cond.notify_all()
+                return
+
+        lines = [f"stats of named pipe {np_client.addr_str}:"]
+        for name in proto.StatsPacket.FIELDS:
+            value = packet.stats[name]
+            # allocations are null unless server-side is a profiling build
+            if value or not name.startswith(("proto_errors_", "alloc_")):
+                lines.append(f"  {name}: {value}")
+
+        logger.info("\n".join(lines))
 
     #
     # private methods below
     #
 
+    def _query_stats(self):
+        # None if server-side did not reply in time
+        packet = proto.StatsPacket()
+
+        with self._stats_cond:
+            self._stats_pending[packet.uid] = None
+
+        try:
+            if not self._bridge.protoclient_send(packet.serialize()):
+                return None
+
+            with self._stats_cond:
+                self._stats_cond.wait_for(
+                    lambda: self._stats_pending[packet.uid] is not None,
+                    timeout=TOP_STATS_TIMEOUT)
+                return self._stats_pending[packet.uid]
+        finally:
+            with self._stats_cond:
+                self._stats_pending.pop(packet.uid, None)
+
+    def _sample_top(self):
+        bridge = self._bridge
+        if bridge is None:
+            return (time.monotonic(), None, {})
+
+        stats = self._query_stats()
+        sessions = {
+            session.socks_token: session
+            for session in bridge.socks_sessions()}
+
+        return (time.monotonic(), stats, sessions)
+
+    def _print_top(self, prev_sample, sample):
+        prev_time, prev_stats, prev_sessions = prev_sample
+        now, stats, sessions = sample
+        elapsed = max(now - prev_time, 0.001)
+        hbytes = utils.humanize_bytes
+
+        lines = [f"{time.strftime('%H:%M:%S')} tunnel via {self._pipe_name}"]
+
+        if stats is None:
+            lines.append("  no STATS reply from server-side")
+        else:
+            # server-side time, so that pipe latency does not skew rates
+            if prev_stats is None:
+                stats_elapsed = 0
+            else:
+                stats_elapsed = (
+                    stats["uptime_ms"] - prev_stats["uptime_ms"]) / 1000
+
+            def rate(name):
+                if stats_elapsed <= 0:
+                    return 0
+                return (stats[name] - prev_stats[name]) / stats_elapsed
+
+            def ms(name):
+                return f"{stats[name] / 1000:.1f} ms"
+
+            connects = rate("connects_ok") + rate("connects_failed")
+
+            lines.extend((
+                f"  {stats['clients']} clients, {stats['channels']} "
+                f"channels, {stats['socks_sessions']} SOCKS sessions, "
+                f"{stats['socks_pending_requests']} pending requests",
+                f"  channels  in {hbytes(rate('pipe_bytes_in'))}/s, "
+                f"out {hbytes(rate('pipe_bytes_out'))}/s, "
+                f"queued {stats['pipe_output_queue']} packets, "
+                f"{hbytes(stats['pipe_bytes_in_flight'])} in flight",
+                f"  targets   in {hbytes(rate('target_bytes_in'))}/s, "
+                f"out {hbytes(rate('target_bytes_out'))}/s, "
+                f"write queue {hbytes(stats['target_write_queue_bytes'])}",
+                f"  rtt       srtt {ms('rtt_srtt_avg_us')} "
+                f"(max {ms('rtt_srtt_max_us')}), min {ms('rtt_min_us')}",
+                f"  connects  {connects:.1f}/s, "
+                f"{rate('connects_failed'):.1f} failed/s, "
+                f"{stats['connects_queued']} queued; "
+                f"p50 {ms('latency_connect_p50')}, "
+                f"p99 {ms('latency_connect_p99')}",
+                f"  memory    {hbytes(stats['mem_used'])} used",
+                f"  threads   {rate('wakeups'):.1f} wakeups/s"))
+
+        def session_rates(session):
+            prev_session = prev_sessions.get(session.socks_token)
+            if prev_session is None:
+                return (session.bytes_in / elapsed,
+                        session.bytes_out / elapsed)
+            return ((session.bytes_in - prev_session.bytes_in) / elapsed,
+                    (session.bytes_out - prev_session.bytes_out) / elapsed)
+
+        rows = sorted(
+            ((session, *session_rates(session))
+                for session in sessions.values()),
+            key=lambda row: row[1] + row[2], reverse=True)
+
+        lines.append("")
+        lines.append(
+            f"  {'SESSION':<17} {'PEER':<22} {'AGE':>8} {'IDLE':>7} "
+            f"{'IN':>12} {'OUT':>12} {'QUEUE':>10}")
+
+        for session, rate_in, rate_out in rows[:TOP_MAX_SESSIONS]:
+            age = utils.humanize_elapsed_seconds(int(session.age))
+            flag = "*" if session.resuming else " "
+
+            lines.append(
+                f"  {session.socks_token:016x}{flag} "
+                f"{session.peer or '?':<22} {age:>8} "
+                f"{session.idle:>6.1f}s "
+                f"{hbytes(rate_in) + '/s':>12} {hbytes(rate_out) + '/s':>12} "
+                f"{hbytes(session.output_queue):>10}")
+
+        if len(rows) > TOP_MAX_SESSIONS:
+            lines.append(f"  ... and {len(rows) - TOP_MAX_SESSIONS} more")
+        elif not rows:
+            lines.append("  no SOCKS session")
+
+        print("\n".join(lines), flush=True)
+
     def _disconnect_bridge(self, *, log=True):
         if self._bridge is not None:
             if log:
@@ -355,6 +571,8 @@ class BridgeCli(cmdkeyint.Cmd,
         self._bridge = mod_bridge.BridgeThread(
             smb_config=self._smbconfig,
             pipe_name=self._pipe_name,
+            channel_tcp_port=self._channel_tcp_port,
+            channels=self._channels,
             proto_keep_alive=self._proto_keep_alive,
             socks_bind_addrs=self._socks_bind_addrs,
             observers=(self, ))
@@ -430,30 +648,43 @@ class BridgeCli(cmdkeyint.Cmd,
 
         exe_display_name = "64-bit" if use64bit else "32-bit"
         exe_display_name += " service" if winservice else " console"
-
-        # extract embedded exe and get a file object
-        logger.hinfo(f"extracting embedded {exe_display_name} exe")
-        embedded_file = embexe.stream_embedded_svc_exe(
+        rpath = RPATH_FMT.format(
+            host=self._smbconfig.addr_str, share=RSHARE, exename=REXENAME)
+
+        # a previous deployment may have left the very same exe, in which case
+        # there is nothing to extract nor to upload
+        # embexe_data is imported once, for both the comparison and the
+        # extraction
+        embedded_exe = embexe.load_embedded_svc_exe(
             sixty_four=use64bit, winservice=winservice)
+        remote_md5 = smb.file_md5(
+            smbconfig=self._smbconfig, share=RSHARE, destname=REXENAME,
+            expected_size=embedded_exe.size)
 
-        # remote copy embedded exe
-        logger.info(
-            f"dropping {exe_display_name} exe to " +
-            RPATH_FMT.format(
-                host=self._smbconfig.addr_str, share=RSHARE, exename=REXENAME))
-        try:
-            res = smb.put_file(
-                fileish=embedded_file, smbconfig=self._smbconfig,
-                share=RSHARE, destname=REXENAME)
-            if not res:
+        if remote_md5 == embedded_exe.md5:
+            logger.info(
+                f"identical {exe_display_name} exe already at {rpath}; "
+                f"not dropping it again")
+        else:
+            # extract embedded exe and get a file object
+            logger.hinfo(f"extracting embedded {exe_display_name} exe")
+            embedded_file = io.BytesIO(embedded_exe.extract())
+
+            # remote copy embedded exe
+            logger.info(f"dropping {exe_display_name} exe to {rpath}")
+            try:
+                res = smb.put_file(
+                    fileish=embedded_file, smbconfig=self._smbconfig,
+                    share=RSHARE, destname=REXENAME)
+                if not res:
+                    return False
+            except Exception:
+                logger.exception("failed to remote copy exe file")
                 return False
-        except Exception:
-            logger.exception("failed to remote copy exe file")
-            return False
-        finally:
-            # free resources
-            embedded_file.close()
-            del embedded_file
+            finally:
+                # free resources
+                embedded_file.close()
+                del embedded_file
 
         # remote exec dropped file
         if winservice:
@@ -494,6 +725,10 @@ class BridgeCli(cmdkeyint.Cmd,
         SVCDISPNAME = constants.DEFAULT_SERVICE_DISPLAY_NAME
         RPATH = f"\\\\localhost\\{rshare}\\{rexename}"
 
+        # service listens for TCP channels too
+        if self._channel_tcp_port:
+            RPATH += f" --channel-tcp-port={self._channel_tcp_port}"
+
         logger.hinfo(
             f'installing and starting service as "{SVCNAME}" '
             f'(displayed as "{SVCDISPNAME}")')
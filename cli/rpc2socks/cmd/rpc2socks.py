@@ -166,6 +166,32 @@ def parse_args(args):
         help=(
             "Destination port to connect to SMB Service "
             "(default: %(default)s)"))
+    group.add_argument(
+        "--tcpport", metavar="PORT",
+        default=None, type=int,
+        help=(
+            "Connect proto channels over plain TCP to this port of the target "
+            "instead of named pipes, which is much faster on flat networks. "
+            "The service is installed with the matching "
+            "--channel-tcp-port option. "
+            "CAUTION: unlike named pipes, TCP channels are not authenticated, "
+            "anyone who can reach the port can use the proxy"))
+    group.add_argument(
+        "--worker", metavar="INDEX",
+        default=0, type=int,
+        help=(
+            "Connect to this worker of a service installed with the "
+            "--workers option, i.e. to its pipe suffixed with \"-INDEX\" "
+            "(default: %(default)s, the first one). "
+            "With --tcpport, PORT is the one of the first worker plus INDEX"))
+    group.add_argument(
+        "--channels", metavar="COUNT",
+        default=1, type=int,
+        help=(
+            "Open COUNT pairs of proto channels, each over an SMB connection "
+            "of its own, and spread SOCKS sessions over them so that a single "
+            "connection does not cap the throughput of the tunnel "
+            "(default: %(default)s; 8 at most)"))
     # CAUTION: changing RPC port number from default is not well supported by
     # impacket. See rpc2socks.smb.SmbConfig.spawn_dcom_connection() for more
     # info.
@@ -255,6 +281,19 @@ def parse_args(args):
     context.pipe_name = os.path.basename(
         os.path.splitext(context.opts.exename)[0])
 
+    # see the --workers option of the service
+    if opts.worker < 0:
+        parser.error("--worker INDEX cannot be negative")
+    elif opts.worker > 0:
+        context.pipe_name += f"-{opts.worker}"
+        if opts.tcpport is not None:
+            opts.tcpport += opts.worker
+
+    if not 1 <= opts.channels <= rpc2socks.proto.MAX_CLIENT_CHANNELS:
+        parser.error(
+            f"--channels COUNT must be between 1 and "
+            f"{rpc2socks.proto.MAX_CLIENT_CHANNELS}")
+
     # smb config
     smbconfig_required = not opts.extractexe  # or any((opts.install, opts.connect, opts.uninstall))
     if not smbconfig_required:
@@ -321,6 +360,8 @@ def run_cli(context):
         pipe_name=context.pipe_name,
         rshare_name=context.opts.sharename,
         rexe_name=context.opts.exename,
+        channel_tcp_port=context.opts.tcpport,
+        channels=context.opts.channels,
         proto_keep_alive=proto_keep_alive,
         socks_bind_addrs=context.opts.socksbind)
 
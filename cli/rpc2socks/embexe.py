@@ -2,51 +2,105 @@
 # SPDX-License-Identifier: BSD-3-Clause
 
 import binascii
-import contextlib
 import bz2
 import hashlib
 import importlib
 import io
+import lzma
 import sys
+import types
 
-__all__ = ("stream_embedded_svc_exe", "extract_embedded_svc_exe", )
+__all__ = (
+    "EmbeddedSvcExe", "load_embedded_svc_exe", "stream_embedded_svc_exe",
+    "extract_embedded_svc_exe", "embedded_svc_exe_info", )
 
 
-def stream_embedded_svc_exe(*, sixty_four=False, winservice=False):
-    return io.BytesIO(extract_embedded_svc_exe(
-        sixty_four=sixty_four, winservice=winservice))
+class EmbeddedSvcExe:
+    """
+    An embedded exe, as recorded by ``embedsrv.py``: its size and md5 (hex),
+    so that it can be compared to a remote file without extracting it, and its
+    compressed data, see `extract`.
 
+    Created by `load_embedded_svc_exe`, which imports ``embexe_data`` once.
+    """
 
-def extract_embedded_svc_exe(*, sixty_four=False, winservice=False):
-    """Load data (`bytes`) from internal module ``embexe_data``"""
+    def __init__(self, display_name, size, md5, codec, data):
+        self.display_name = display_name
+        self.size = size
+        self.md5 = md5
+        self.codec = codec
+        self._data = data  # compressed, then encoded in base64
+
+    def extract(self):
+        """Decompress and check data, return it as a `bytes` object"""
+        data = binascii.a2b_base64(self._data)
+        if self.codec == "lzma":
+            data = lzma.decompress(data, format=lzma.FORMAT_XZ)
+        elif self.codec == "bz2":
+            data = bz2.decompress(data)
+        else:
+            raise RuntimeError(
+                f"unsupported codec of {self.display_name}: {self.codec}")
+
+        if len(data) != self.size:
+            raise RuntimeError(f"size of {self.display_name} mismatch")
+
+        if hashlib.md5(data).hexdigest() != self.md5:
+            raise RuntimeError(f"hash of {self.display_name} mismatch")
+
+        return data
+
+
+def load_embedded_svc_exe(*, sixty_four=False, winservice=False):
+    """
+    Load an `EmbeddedSvcExe` from internal module ``embexe_data``, which is
+    unloaded right after so that only the requested exe stays in memory
+    """
 
     # note: importlib.resources is 3.7+ only
 
     package_name = globals()["__name__"].rsplit(".", maxsplit=1)[0]
 
     embexe_data = importlib.import_module(package_name + ".embexe_data")
+    prefix = _embedded_name_prefix(sixty_four, winservice)
+
+    try:
+        return EmbeddedSvcExe(
+            display_name=f"{prefix}_DATA",
+            size=getattr(embexe_data, f"{prefix}_SIZE"),
+            md5=getattr(embexe_data, f"{prefix}_MD5"),
+            # files generated before codecs could be chosen are all bz2
+            codec=getattr(embexe_data, f"{prefix}_CODEC", "bz2"),
+            data=getattr(embexe_data, f"{prefix}_DATA"))
+    finally:
+        del embexe_data
+        del sys.modules[package_name + ".embexe_data"]
 
-    arch = "64" if sixty_four else "32"
-    exetype = "SVC" if winservice else "CON"
 
-    display_name = f"EXE{arch}{exetype}_DATA"
+def stream_embedded_svc_exe(*, sixty_four=False, winservice=False):
+    return io.BytesIO(extract_embedded_svc_exe(
+        sixty_four=sixty_four, winservice=winservice))
 
-    data = getattr(embexe_data, f"EXE{arch}{exetype}_DATA")
-    expected_size = getattr(embexe_data, f"EXE{arch}{exetype}_SIZE")
-    expected_md5 = getattr(embexe_data, f"EXE{arch}{exetype}_MD5")
 
-    data = binascii.a2b_base64(data)
-    data = bz2.decompress(data)
+def embedded_svc_exe_info(*, sixty_four=False, winservice=False):
+    """
+    Size and md5 (hex) of an embedded exe; use `load_embedded_svc_exe`
+    instead if it may have to be extracted as well
+    """
+    embedded = load_embedded_svc_exe(
+        sixty_four=sixty_four, winservice=winservice)
 
-    if len(data) != expected_size:
-        raise RuntimeError(f"size of {display_name} mismatch")
+    return types.SimpleNamespace(size=embedded.size, md5=embedded.md5)
 
-    if hashlib.md5(data).hexdigest() != expected_md5:
-        raise RuntimeError(f"hash of {display_name} mismatch")
 
-    del expected_size
-    del expected_md5
-    del embexe_data
-    del sys.modules[package_name + ".embexe_data"]
+def extract_embedded_svc_exe(*, sixty_four=False, winservice=False):
+    """Load data (`bytes`) from internal module ``embexe_data``"""
+    return load_embedded_svc_exe(
+        sixty_four=sixty_four, winservice=winservice).extract()
+
+
+def _embedded_name_prefix(sixty_four, winservice):
+    arch = "64" if sixty_four else "32"
+    exetype = "SVC" if winservice else "CON"
 
-    return data
+    return f"EXE{arch}{exetype}"
@@ -1,12 +1,14 @@
 # Copyright (c) Lexfo
 # SPDX-License-Identifier: BSD-3-Clause
 
+import collections
 import contextlib
 import threading
 import time
 
 from . import smb
 from . import proto
+from . import tcpchannel
 from .utils import dispatcher
 from .utils import logging
 
@@ -15,6 +17,11 @@ __all__ = ("ProtoClientThread", "ProtoClientObserver")
 
 logger = logging.get_internal_logger(__name__)
 
+# queued packets get written to a channel together, up to this many bytes per
+# write (a single packet may be bigger), unless the pipe tells the most a
+# single write of its own carries (max_write_size, e.g. as negotiated by SMB)
+WRITE_BATCH_MAX = proto.MAX_FRAME_SIZE
+
 
 class NamedPipeClientObserver(dispatcher.Observer):
     def __init__(self):
@@ -54,9 +61,23 @@ class NamedPipeClientThread(dispatcher.Dispatcher):
     read-only or write-only mode by this class, technically they are in duplex
     mode. This is because the so-called "channel setup" feature described above
     is offered by the application layer, not the transport layer.
+
+    If *tcp_port* is specified, both channels are plain TCP connections to
+    this port of the remote host instead of pipe instances (see
+    `tcpchannel.TcpChannel`); everything else remains the same.
+
+    *channels* pairs of channels are opened, all attached to the same client
+    id, each with a thread per direction, so that the traffic is striped over
+    as many SMB connections. Each piece of data read is tagged with the index
+    of its READ channel, and each write goes to the WRITE channel of the
+    specified index. Server-side keeps a SOCKS link on one READ channel, and
+    users of this class are expected to do the same with WRITE ones, so that
+    the data of a SOCKS link remains ordered. Losing any channel loses them
+    all.
     """
 
-    def __init__(self, smbconfig, pipe_name, *, observers=()):
+    def __init__(self, smbconfig, pipe_name, *, tcp_port=None, channels=1,
+                 observers=()):
         super().__init__(
             dispatcher_raise_errors=False,
             dispatcher_logger=logger,
@@ -64,6 +85,9 @@ class NamedPipeClientThread(dispatcher.Dispatcher):
 
         assert isinstance(smbconfig, smb.SmbConfig)
         assert isinstance(pipe_name, str)
+        if (not isinstance(channels, int) or
+                not 1 <= channels <= proto.MAX_CLIENT_CHANNELS):
+            raise ValueError("channels")
 
         # cleanup and normalize pipe name
         pipe_name = pipe_name.replace("/", "\\")
@@ -75,33 +99,54 @@ class NamedPipeClientThread(dispatcher.Dispatcher):
 
         self._smbconfig = smbconfig
         self._pipe_name = pipe_name
+        self._tcp_port = tcp_port
+        self._channels = channels
 
         self._stop = False
         # self._read_event = threading.Event()
-        self._write_event = threading.Event()
-
-        self._read_queue = []
-        self._write_queue = []
-
-        self._pipe_read = None
-        self._pipe_write = None
-
-        self._thread_read = threading.Thread(
-            target=self._read_loop,
-            name=self.__class__.__name__ + "[READ]",
-            daemon=True)
-
-        self._thread_write = threading.Thread(
-            target=self._write_loop,
-            name=self.__class__.__name__ + "[WRITE]",
-            daemon=True)
-
-        self._thread_read.start()
-        self._thread_write.start()
+        self._write_events = [threading.Event() for _ in range(channels)]
+
+        self._read_queue = []  # [(channel, data), ...]
+        self._write_queues = [collections.deque() for _ in range(channels)]
+
+        # one per channel once connected, empty otherwise
+        self._pipes_read = []
+        self._pipes_write = []
+
+        # agreed with server-side, per channel
+        self._read_acks = [
+            proto.ChannelSetupAckPacket(0) for _ in range(channels)]
+        self._write_caps = [proto.ChannelSetupFlag(0)] * channels
+
+        self._client_id = 0  # as acked by server-side
+        self._resumed = False  # see ChannelSetupFlag.RESUME
+
+        self._threads_read = [
+            threading.Thread(
+                target=self._read_loop,
+                args=(channel, ),
+                name=self.__class__.__name__ + f"[READ:{channel}]",
+                daemon=True)
+            for channel in range(channels)]
+
+        self._threads_write = [
+            threading.Thread(
+                target=self._write_loop,
+                args=(channel, ),
+                name=self.__class__.__name__ + f"[WRITE:{channel}]",
+                daemon=True)
+            for channel in range(channels)]
+
+        for thread in self._threads_read + self._threads_write:
+            thread.start()
         time.sleep(0)  # yield
 
     @property
     def addr_str(self):
+        if self._tcp_port:
+            return "tcp://{}:{}".format(
+                self._smbconfig.rhost_str, self._tcp_port)
+
         return r"\\{}\pipe\{}".format(
             self._smbconfig.addr_str,
             self._pipe_name.lstrip("\\"))
@@ -110,18 +155,51 @@ class NamedPipeClientThread(dispatcher.Dispatcher):
     def rhost_str(self):
         return self._smbconfig.rhost_str
 
+    @property
+    def channels(self):
+        return self._channels
+
     @property
     def terminated(self):
         with self._lock:
-            return self._thread_read is None and self._thread_write is None
+            return not self._threads_read and not self._threads_write
 
     @property
     def connected(self):
         with self._lock:
-            return (
-                not self.terminated and
-                self._pipe_read is not None and
-                self._pipe_write is not None)
+            return not self.terminated and bool(self._pipes_read)
+
+    @property
+    def resumable(self):
+        with self._lock:
+            return bool(
+                self._read_acks[0].caps & proto.ChannelSetupFlag.RESUME)
+
+    @property
+    def resumed(self):
+        # whether the last connection resumed the session of the previous one
+        with self._lock:
+            return self._resumed
+
+    def read_crc_header_only(self, channel):
+        with self._lock:
+            return bool(
+                self._read_acks[channel].caps &
+                proto.ChannelSetupFlag.CRC_HEADER)
+
+    def read_max_packet_size(self, channel):
+        with self._lock:
+            ack = self._read_acks[channel]
+            if ack.caps & proto.ChannelSetupFlag.FRAME_CAP:
+                return ack.max_packet_size
+            return proto.MAX_PACKET_SIZE
+
+    def write_queue_sizes(self):
+        # bytes waiting to be written, per WRITE channel
+        with self._lock:
+            return [
+                sum(map(len, write_queue))
+                for write_queue in self._write_queues]
 
     def disconnect(self):
         self._disconnect(can_notify=True)
@@ -159,7 +237,7 @@ class NamedPipeClientThread(dispatcher.Dispatcher):
             else:
                 return [] if bulk else None
 
-    def write(self, data):
+    def write(self, data, *, channel=0):
         with self._lock:
             if self._stop:
                 # raise RuntimeError("termination requested")
@@ -168,8 +246,8 @@ class NamedPipeClientThread(dispatcher.Dispatcher):
             #     # raise RuntimeError("internal thread terminated")
             #     return False
 
-            self._write_queue.append(data)
-            self._write_event.set()
+            self._write_queues[channel].append(data)
+            self._write_events[channel].set()
 
         return True
 
@@ -187,24 +265,27 @@ class NamedPipeClientThread(dispatcher.Dispatcher):
         Return `True` if threads were joind successfully or `False` on timeout,
         in case *timeout* is not `None`.
         """
-        # if self._thread_read is None and self._thread_write is None:
+        # if not self._threads_read and not self._threads_write:
         #     return True
 
         # self._stop = True
         start = time.monotonic()
 
         while True:
-            # if self._pipe_read is not None or self._pipe_write is not None:
+            # if self._pipes_read or self._pipes_write:
             #     self._disconnect(can_notify=False)
 
-            if self._thread_read is not None and not self._thread_read.is_alive():
-                self._thread_read = None
+            with self._lock:
+                self._threads_read = [
+                    thread for thread in self._threads_read
+                    if thread.is_alive()]
 
-            if self._thread_write is not None and not self._thread_write.is_alive():
-                self._thread_write = None
+                self._threads_write = [
+                    thread for thread in self._threads_write
+                    if thread.is_alive()]
 
-            if self._thread_read is None and self._thread_write is None:
-                if not (self._pipe_read is None and self._pipe_write is None):
+            if not self._threads_read and not self._threads_write:
+                if self._pipes_read or self._pipes_write:
                     self._disconnect(can_notify=False)
                 break
 
@@ -224,12 +305,14 @@ class NamedPipeClientThread(dispatcher.Dispatcher):
 
         return True
 
-    def _read_loop(self):
+    def _read_loop(self, channel):
         cls_name = self.__class__.__name__
 
-        logger.debug(f"{cls_name}'s read thread started")
+        logger.debug(f"{cls_name}'s read thread #{channel} started")
 
-        self.reconnect()
+        # the other threads wait for this one to connect them all
+        if channel == 0:
+            self.reconnect()
 
         while True:
             with self._lock:
@@ -237,7 +320,7 @@ class NamedPipeClientThread(dispatcher.Dispatcher):
                     self._disconnect(can_notify=False)
                     break
 
-                rpipe = self._pipe_read
+                rpipe = self._pipes_read[channel] if self._pipes_read else None
 
             if rpipe is None or rpipe.closed:
                 if rpipe is not None:
@@ -264,57 +347,91 @@ class NamedPipeClientThread(dispatcher.Dispatcher):
                 continue
             else:
                 with self._lock:
-                    self._read_queue.append(data)
+                    self._read_queue.append((channel, data))
                     # self._read_event.set()
 
                 self.notify_observers("_on_namedpipe_recv", self)
 
-        logger.debug(f"{cls_name}'s read thread gracefully stopped")
+        logger.debug(f"{cls_name}'s read thread #{channel} gracefully stopped")
 
-    def _write_loop(self):
+    def _write_loop(self, channel):
         cls_name = self.__class__.__name__
 
-        logger.debug(f"{cls_name}'s write thread started")
+        logger.debug(f"{cls_name}'s write thread #{channel} started")
+
+        write_queue_event = self._write_events[channel]
 
         while True:
             with self._lock:
                 if self._stop:
                     break
 
-                connected = self._pipe_write is not None and not self._pipe_write.closed
-                has_data_to_write = len(self._write_queue) > 0
+                wpipe = (
+                    self._pipes_write[channel] if self._pipes_write else None)
+                connected = wpipe is not None and not wpipe.closed
+                has_data_to_write = len(self._write_queues[channel]) > 0
 
             if not connected:
-                if self._pipe_write is not None:
+                if wpipe is not None:
                     self._disconnect(can_notify=True)
                 time.sleep(0.5)
                 continue
 
-            if has_data_to_write or self._write_event.wait(timeout=1.0):
-                self._write_loop__flush_queue()
+            if has_data_to_write or write_queue_event.wait(timeout=1.0):
+                self._write_loop__flush_queue(channel)
 
-        logger.debug(f"{cls_name}'s write thread gracefully stopped")
+            wpipe = None  # release ref
 
-    def _write_loop__flush_queue(self):
+        logger.debug(
+            f"{cls_name}'s write thread #{channel} gracefully stopped")
+
+    def _write_loop__flush_queue(self, channel):
         while True:
             with self._lock:
                 if self._stop:
                     return
 
-                wpipe = self._pipe_write
-                if wpipe is None or wpipe.closed:
+                if not self._pipes_write:
                     return
 
-                if not self._write_queue:
-                    self._write_event.clear()
+                wpipe = self._pipes_write[channel]
+                if wpipe.closed:
+                    return
+
+                crc_header_only = bool(
+                    self._write_caps[channel] &
+                    proto.ChannelSetupFlag.CRC_HEADER)
+                message_frames = bool(
+                    self._write_caps[channel] &
+                    proto.ChannelSetupFlag.MESSAGE_FRAMES)
+
+                write_queue = self._write_queues[channel]
+                if not write_queue:
+                    self._write_events[channel].clear()
+                    return
+
+                # server-side reads channels as streams, so packets need not
+                # be written one by one, unless it agreed on MESSAGE_FRAMES
+                batch_max = wpipe.max_write_size or WRITE_BATCH_MAX
+                batch = [write_queue.popleft()]
+                batch_size = len(batch[0])
+                while (not message_frames and write_queue and
+                        batch_size + len(write_queue[0]) <= batch_max):
+                    batch_size += len(write_queue[0])
+                    batch.append(write_queue.popleft())
+
+                data = batch[0] if len(batch) == 1 else b"".join(batch)
+                if not data:
                     return
-                else:
-                    data = self._write_queue.pop(0)
-                    if not data:
-                        return
 
             try:
-                status = wpipe.write(data)
+                # packets are always serialized with a full crc32 so that
+                # queued ones remain valid across reconnections
+                if crc_header_only:
+                    status = wpipe.write(
+                        proto.reseal_packets(data, header_only=True))
+                else:
+                    status = wpipe.write(data)
             except smb.SmbTimeoutError:
                 status = False
                 logger.warning(
@@ -330,25 +447,22 @@ class NamedPipeClientThread(dispatcher.Dispatcher):
 
             if not status:
                 with self._lock:
-                    self._write_queue.insert(0, data)
+                    self._write_queues[channel].appendleft(data)
                 self._disconnect(can_notify=True)
                 return
 
     def _disconnect(self, *, can_notify):
+        # server-side closes all the channels of a client as soon as one of
+        # them is closed, so do the same
         with self._lock:
-            was_disconnected = (
-                self._pipe_read is None and
-                self._pipe_write is None)
+            was_disconnected = not self._pipes_read and not self._pipes_write
 
-            if self._pipe_read is not None:
+            for pipe in self._pipes_read + self._pipes_write:
                 with contextlib.suppress(Exception):
-                    self._pipe_read.close()
-                self._pipe_read = None
+                    pipe.close()
 
-            if self._pipe_write is not None:
-                with contextlib.suppress(Exception):
-                    self._pipe_write.close()
-                self._pipe_write = None
+            self._pipes_read = []
+            self._pipes_write = []
 
             # self._read_queue = []
             # self._write_queue = []
@@ -364,78 +478,147 @@ class NamedPipeClientThread(dispatcher.Dispatcher):
 
         logger.debug(f"connecting to {self.addr_str}...")
 
-        # connect
+        # connect; READ and WRITE channels alternate
+        pipes = []
         try:
-            rpipe = smb.SmbNamedPipeDedicated(self._smbconfig, self._pipe_name)
-            wpipe = smb.SmbNamedPipeDedicated(self._smbconfig, self._pipe_name)
+            for _ in range(2 * self._channels):
+                if self._tcp_port:
+                    pipes.append(tcpchannel.TcpChannel(
+                        self._smbconfig.rhost_str, self._tcp_port))
+                else:
+                    pipes.append(smb.SmbNamedPipeDedicated(
+                        self._smbconfig, self._pipe_name))
         except Exception as exc:
             logger.warning(f"connection failed to {self.addr_str}: {exc}")
             return False
 
-        # handshake (read-only pipe)
-        try:
-            client_id = self._reconnect__setup_channel(
-                rpipe, proto.ChannelSetupFlag.READ)
-        except Exception as exc:
-            logger.warning(
-                f"failed to setup read-only channel with {self.addr_str}: "
-                f"{exc}")
-            return False
+        rpipes = pipes[0::2]
+        wpipes = pipes[1::2]
 
-        # handshake (write-only pipe)
-        try:
-            self._reconnect__setup_channel(
-                wpipe, proto.ChannelSetupFlag.WRITE, client_id=client_id)
-        except Exception as exc:
-            logger.warning(
-                f"failed to setup write-only channel with {self.addr_str}: "
-                f"{exc}")
-            return False
+        # a resumable session is asked back on the first channel only, see
+        # ChannelSetupFlag.RESUME; the other ones attach to the client id it
+        # got
+        with self._lock:
+            client_id = self._client_id if self.resumable else 0
+        resume_id = client_id
+
+        read_acks = []
+        write_caps = []
+
+        for channel in range(self._channels):
+            read_flags = (
+                proto.ChannelSetupFlag.READ |
+                proto.ChannelSetupFlag.EXT_ACK |
+                proto.SUPPORTED_CAPS)
+            if channel > 0:
+                read_flags &= ~proto.ChannelSetupFlag.RESUME
+
+            # handshake (read-only pipe)
+            try:
+                ack = self._reconnect__setup_channel(
+                    rpipes[channel], read_flags,
+                    client_id=client_id,
+                    resume=channel == 0)
+                client_id = ack.client_id
+            except Exception as exc:
+                logger.warning(
+                    f"failed to setup read-only channel #{channel} with "
+                    f"{self.addr_str}: {exc}")
+                return False
+
+            # handshake (write-only pipe); a server in message mode parses
+            # one packet per write if the pipe can write a frame at once
+            write_flags = (
+                proto.ChannelSetupFlag.WRITE |
+                proto.ChannelSetupFlag.EXT_ACK |
+                proto.ChannelSetupFlag.CRC_HEADER |
+                proto.ChannelSetupFlag.FRAME_CAP)
+            max_write_size = wpipes[channel].max_write_size
+            if (max_write_size is not None and
+                    max_write_size >= proto.MAX_FRAME_SIZE):
+                write_flags |= proto.ChannelSetupFlag.MESSAGE_FRAMES
+            try:
+                write_ack = self._reconnect__setup_channel(
+                    wpipes[channel], write_flags, client_id=client_id)
+            except Exception as exc:
+                logger.warning(
+                    f"failed to setup write-only channel #{channel} with "
+                    f"{self.addr_str}: {exc}")
+                return False
+
+            read_acks.append(ack)
+            write_caps.append(write_ack.caps)
+
+        ack = read_acks[0]
+        if ack.version is None:
+            logger.debug(
+                f"{self.addr_str} does not support capabilities negotiation")
+        else:
+            logger.debug(
+                f"{self.addr_str} speaks protocol v{ack.version}; agreed "
+                f"capabilities: {ack.caps!r}")
 
         # everything went smoothly
         with self._lock:
-            # self._client_id = client_id
-            self._pipe_read = rpipe
-            self._pipe_write = wpipe
+            self._client_id = client_id
+            self._resumed = resume_id != 0 and client_id == resume_id
+            self._pipes_read = rpipes
+            self._pipes_write = wpipes
+            self._read_acks = read_acks
+            self._write_caps = write_caps
+
+            # was meant for the former channels; what still matters of it is
+            # sent again if resumed
+            self._write_queues = [
+                collections.deque() for _ in range(self._channels)]
 
         self.notify_observers("_on_namedpipe_connected", self)
 
         return True
 
     def _reconnect__setup_channel(self, pipe, flags, *,
-                                  client_id=0, io_timeout=3.0):
+                                  client_id=0, resume=False, io_timeout=3.0):
         # send setup request
         pipe.write(
             proto.ChannelSetupPacket(client_id, flags).serialize(),
             timeout=io_timeout)
 
-        # wait for response
-        read_size = (
-            proto.HEADER_STRUCT.size +
-            proto.ChannelSetupAckPacket.PAYLOAD_STRUCT.size)
+        # wait for response; its size depends on whether server-side knows
+        # about ChannelSetupFlag.EXT_ACK so read header first
         istream = proto.InputStream()
-        while len(istream) < read_size:
-            data = pipe.read(
-                num_bytes=read_size-len(istream),
-                timeout=io_timeout)
+        read_size = proto.HEADER_STRUCT.size
+        while True:
+            while len(istream) < read_size:
+                data = pipe.read(
+                    num_bytes=read_size-len(istream),
+                    timeout=io_timeout)
 
-            if not data:
-                raise Exception("pipe closed")
+                if not data:
+                    raise Exception("pipe closed")
 
-            istream.feed(data)
+                istream.feed(data)
+
+            packet = istream.flush_next_packet()
+            if packet is not None:
+                break
+
+            packet_len = istream.peek_packet_len()
+            if packet_len is None or packet_len <= read_size:
+                raise Exception("malformed connection handshake reply")
+            read_size = packet_len
 
         # parse response
-        packet = istream.flush_next_packet()
         if not isinstance(packet, proto.ChannelSetupAckPacket):
             raise Exception(
                 f"unexpected connection handshake reply type: {type(packet)}")
 
-        if client_id != 0 and packet.client_id != client_id:
+        # a session that could not be resumed gets a new client id
+        if client_id != 0 and packet.client_id != client_id and not resume:
             raise Exception(
                 f"unexpected channel client id received from server (expected "
                 f"{client_id}; got {packet.client_id}")
 
-        return packet.client_id
+        return packet
 
 
 class ProtoClientObserver(dispatcher.Observer):
@@ -473,7 +656,8 @@ class ProtoClientObserver(dispatcher.Observer):
 
 
 class ProtoClientThread(dispatcher.Dispatcher, NamedPipeClientObserver):
-    def __init__(self, *, smb_config, pipe_name, observers=(), keep_alive=None):
+    def __init__(self, *, smb_config, pipe_name, tcp_port=None, channels=1,
+                 observers=(), keep_alive=None):
         if keep_alive is None:
             pass
         elif isinstance(keep_alive, (int, float)):
@@ -495,8 +679,12 @@ class ProtoClientThread(dispatcher.Dispatcher, NamedPipeClientObserver):
 
         self._lock = threading.RLock()
 
-        self._conn = NamedPipeClientThread(smb_config, pipe_name, observers=self)
-        self._istream = proto.InputStream()
+        self._conn = NamedPipeClientThread(
+            smb_config, pipe_name, tcp_port=tcp_port, channels=channels,
+            observers=self)
+
+        # one per READ channel, packets do not span channels
+        self._istreams = [proto.InputStream() for _ in range(channels)]
 
         self._stop = False
         self._recv_event = threading.Event()
@@ -525,9 +713,24 @@ class ProtoClientThread(dispatcher.Dispatcher, NamedPipeClientObserver):
     def connected(self):
         return self._conn.connected
 
+    @property
+    def channels(self):
+        return self._conn.channels
+
+    @property
+    def resumable(self):
+        return self._conn.resumable
+
+    @property
+    def resumed(self):
+        return self._conn.resumed
+
     def wait_for_connection(self, *, timeout=6.0):
         return self._conn.wait_for_connection(timeout=timeout)
 
+    def write_queue_sizes(self):
+        return self._conn.write_queue_sizes()
+
     def disconnect(self):
         self._conn.disconnect()
 
@@ -572,10 +775,12 @@ class ProtoClientThread(dispatcher.Dispatcher, NamedPipeClientObserver):
 
         return True
 
-    def send(self, packet):
+    def send(self, packet, *, channel=0):
+        # the packets of a SOCKS link must all go to the same *channel*, see
+        # NamedPipeClientThread
         if not self._stop and not self._conn.terminated:
             try:
-                return self._conn.write(packet)
+                return self._conn.write(packet, channel=channel)
             except RuntimeError:
                 return False
 
@@ -583,7 +788,12 @@ class ProtoClientThread(dispatcher.Dispatcher, NamedPipeClientObserver):
 
     def _on_namedpipe_connected(self, np_client):
         with self._lock:
-            self._istream.clear()
+            for channel, istream in enumerate(self._istreams):
+                istream.clear()
+                istream.crc_header_only = \
+                    np_client.read_crc_header_only(channel)
+                istream.max_packet_size = \
+                    np_client.read_max_packet_size(channel)
 
         self.notify_observers("_on_proto_connected", self)
 
@@ -619,21 +829,25 @@ class ProtoClientThread(dispatcher.Dispatcher, NamedPipeClientObserver):
             if self._stop:
                 break
 
+            # cleared first so that data read meanwhile is not left behind
+            self._recv_event.clear()
+
             with self._lock:
                 bulk = self._conn.read(bulk=True)
 
             if not bulk:
                 continue
 
-            self._istream.feed(bulk)
+            for channel, data in bulk:
+                self._istreams[channel].feed(data)
 
-            while True:
-                packet = self._istream.flush_next_packet()
-                if packet is None:
-                    self._recv_event.clear()
-                    break
-                elif not self._handle_keepalive_response(packet):
-                    self.notify_observers("_on_proto_recv", self, packet)
+            for istream in self._istreams:
+                while True:
+                    packet = istream.flush_next_packet()
+                    if packet is None:
+                        break
+                    elif not self._handle_keepalive_response(packet):
+                        self.notify_observers("_on_proto_recv", self, packet)
 
     def _send_keepalive(self):
         if (self._keepalive_last_sent and
@@ -10,6 +10,11 @@ import zlib
 from .utils import logging
 from .utils import NoDict
 
+try:
+    import lz4.block as _lz4_block
+except ImportError:
+    _lz4_block = None
+
 MAGIC = b"\xe4\x85\xb4\xb2"
 ENDIANNESS = "<"  # little endian
 
@@ -17,15 +22,21 @@ HEADER_STRUCT = struct.Struct(
     ENDIANNESS +
     "4s"  # MAGIC
     "I"   # len; total packet length (bytes), incl. this header
-    "I"   # crc32; zlib-crc32 on the WHOLE packet (header + payload; this member being nulled)
+    "I"   # crc32; zlib-crc32 on the WHOLE packet (header + payload; this member being nulled), or on the header only (CRC_HEADER)
     "I"   # uid; unique 32-bit value per request-response pair; (uid == 0) only valid for a response
     "B")  # opcode; purpose of this packet
 
 HEADER_CRC32_OFFSET = 8
 MAX_PACKET_SIZE = 16 * 1024 * 1024
 MAX_PAYLOAD_SIZE = MAX_PACKET_SIZE - HEADER_STRUCT.size
+MAX_FRAME_SIZE = 256 * 1024  # see ChannelSetupFlag.FRAME_CAP
+MAX_CLIENT_CHANNELS = 8  # in each direction, see ChannelSetupPacket
 INVALID_SOCKS_ID = 0
 
+# protocol version, as advertised by the server-side in an extended
+# ChannelSetupAckPacket
+VERSION = 6
+
 logger = logging.get_internal_logger(__name__)
 
 
@@ -42,10 +53,17 @@ class OpCode(enum.IntEnum):
     CHANNEL_SETUP = 1
     CHANNEL_SETUP_ACK = 2
     STATUS = 5
+    STATS = 6
     PING = 10
     SOCKS = 150               # sent by client or server side
     SOCKS_CLOSE = 151         # sent by client or server side
     SOCKS_DISCONNECTED = 152  # sent by client or server side
+    SOCKS_FLOW = 153          # sent by client or server side
+    SOCKS_BATCH = 154         # sent by server side; see ChannelSetupFlag
+    SOCKS_LZ4 = 155           # sent by server side; see ChannelSetupFlag
+    SOCKS_UDP = 156           # sent by client or server side
+    SOCKS_UDP_ASSOCIATED = 157  # sent by server side; see ChannelSetupFlag
+    SOCKS_RESUME = 158        # sent by client or server side; see RESUME
     UNINSTALL_SELF = 240
 
 
@@ -55,12 +73,51 @@ class Status(enum.IntEnum):
     UNSUPPORTED = 1
 
 
+@enum.unique
+class PingKind(enum.IntEnum):
+    REQUEST = 0
+    REPLY = 1
+
+
+@enum.unique
+class SocksFlow(enum.IntEnum):
+    RESUME = 0
+    PAUSE = 1
+
+
 @enum.unique
 class ChannelSetupFlag(enum.IntFlag):
     READ = 0x01
     WRITE = 0x02
     DUPLEX = READ | WRITE
 
+    # capabilities; unknown ones are ignored by the server-side, which replies
+    # with the agreed ones if EXT_ACK is set
+    SOCKS_BATCH = 0x04  # client accepts SOCKS_BATCH packets on READ channel
+    SOCKS_LZ4 = 0x08    # client accepts SOCKS_LZ4 packets on READ channel
+    CRC_HEADER = 0x10   # header-only crc32 on this channel once acked
+    SOCKS_UDP = 0x20    # client relays the datagrams of UDP ASSOCIATE
+    FRAME_CAP = 0x40    # packets are kept to MAX_FRAME_SIZE on this channel
+    RESUME = 0x80       # session survives its channels; first channel only
+    PING_RTT = 0x100    # client replies to PING requests of READ channel
+    MESSAGE_FRAMES = 0x200  # one packet per write on WRITE channel
+    CAPS_MASK = 0x00ff_fffc
+
+    # client expects an extended ChannelSetupAckPacket
+    EXT_ACK = 0x8000_0000
+
+
+# the capabilities this implementation supports; MESSAGE_FRAMES only when the
+# pipe can carry a frame per write, see NamedPipeClientThread
+SUPPORTED_CAPS = (
+    ChannelSetupFlag.SOCKS_BATCH |
+    ChannelSetupFlag.SOCKS_LZ4 |
+    ChannelSetupFlag.CRC_HEADER |
+    ChannelSetupFlag.SOCKS_UDP |
+    ChannelSetupFlag.FRAME_CAP |
+    ChannelSetupFlag.RESUME |
+    ChannelSetupFlag.PING_RTT)
+
 
 class PacketBase:
     def __init__(self, opcode, *, uid=None):
@@ -99,6 +156,11 @@ class PacketBase:
 class ChannelSetupPacket(PacketBase):
     PAYLOAD_STRUCT = struct.Struct(ENDIANNESS + "QL")
 
+    # a non-null *client_id* attaches the channel to a client that is set up
+    # already, so that its traffic gets striped over several channels; server
+    # sends the data of a SOCKS link on one of its READ channels only, and
+    # expects the same on WRITE ones
+
     def __init__(self, client_id, flags, **kwargs):
         validate_client_id(client_id)
         if not isinstance(flags, ChannelSetupFlag):
@@ -135,27 +197,50 @@ class ChannelSetupPacket(PacketBase):
 
 class ChannelSetupAckPacket(PacketBase):
     PAYLOAD_STRUCT = struct.Struct(ENDIANNESS + "Q")
+    PAYLOAD_EXT_STRUCT = struct.Struct(ENDIANNESS + "QHHLL")
 
-    def __init__(self, client_id, **kwargs):
+    def __init__(self, client_id, *, version=None, caps=None,
+                 max_packet_size=None, **kwargs):
+        # *version* is None for the short flavor, sent by servers that do not
+        # know about ChannelSetupFlag.EXT_ACK
         validate_client_id(client_id)
 
         kwargs.setdefault("uid", generate_uid())
         super().__init__(OpCode.CHANNEL_SETUP_ACK, **kwargs)
 
         self.client_id = client_id
+        self.version = version
+        self.caps = ChannelSetupFlag(0) if caps is None else caps
+        self.max_packet_size = (
+            MAX_PACKET_SIZE if max_packet_size is None else max_packet_size)
 
     def _serialize_payload(self):
         validate_client_id(self.client_id)
 
-        return self.PAYLOAD_STRUCT.pack(self.client_id)
+        if self.version is None:
+            return self.PAYLOAD_STRUCT.pack(self.client_id)
+
+        return self.PAYLOAD_EXT_STRUCT.pack(
+            self.client_id, self.version, 0,
+            self.caps & ChannelSetupFlag.CAPS_MASK, self.max_packet_size)
 
     @classmethod
     def create_from_packet(cls, header, payload_view):
+        if len(payload_view) == cls.PAYLOAD_EXT_STRUCT.size:
+            client_id, version, _, caps, max_packet_size = \
+                cls.PAYLOAD_EXT_STRUCT.unpack(payload_view)
+
+            return cls(
+                client_id, version=version,
+                caps=ChannelSetupFlag(caps & ChannelSetupFlag.CAPS_MASK),
+                max_packet_size=max_packet_size, uid=header.uid)
+
         if len(payload_view) != cls.PAYLOAD_STRUCT.size:
             raise ProtoDecodeError(
                 f"malformed {header.opcode.name} packet: unexpected payload "
                 f"length (got {len(payload_view)}; expected "
-                f"{cls.PAYLOAD_STRUCT.size})")
+                f"{cls.PAYLOAD_STRUCT.size} or "
+                f"{cls.PAYLOAD_EXT_STRUCT.size})")
 
         client_id, = cls.PAYLOAD_STRUCT.unpack(payload_view)
 
@@ -195,27 +280,162 @@ class StatusPacket(PacketBase):
         return cls(status, uid=header.uid)
 
 
+class StatsPacket(PacketBase):
+    # request has an empty payload, reply is made of these counters, which
+    # may be followed by new ones in later versions of the server-side
+    SLOW_STAGES = (
+        "pipe_recv", "proxy_dequeue", "target_send", "target_recv",
+        "pipe_written")
+
+    FIELDS = (
+        "uptime_ms",
+        "channels",
+        "clients",
+        "pipe_bytes_in",
+        "pipe_bytes_out",
+        "pipe_packets_in",
+        "pipe_packets_out",
+        "pipe_output_queue",
+        "pipe_bytes_in_flight",
+        *(f"proto_errors_{idx}" for idx in range(8)),
+        "socks_sessions",
+        "socks_sessions_total",
+        "socks_pending_requests",
+        "connects_ok",
+        "connects_failed",
+        "connect_time_total_ms",
+        "connect_time_max_ms",
+        "target_sockets",
+        "target_bytes_in",
+        "target_bytes_out",
+        "target_write_queue_bytes",
+        *(f"latency_{stage}_{value}"
+            for stage in ("request_queue", "request_send", "response",
+                          "connect")
+            for value in ("count", "p50", "p90", "p99", "p999", "max")),
+        "mem_used",
+        "mem_peak",
+        "mem_global_budget",
+        "mem_exhausted",
+        "connects_refused",
+        "sessions_shed",
+        "rtt_samples",
+        "rtt_channels",
+        "rtt_srtt_avg_us",
+        "rtt_srtt_max_us",
+        "rtt_min_us",
+        "connects_fast_failed",
+        "connects_inflight",
+        "connects_queued",
+        "connects_throttled",
+        *(f"latency_connect_queue_{value}"
+            for value in ("count", "p50", "p90", "p99", "p999", "max")),
+        "connects_warm",
+        "warm_sockets",
+        *(f"alloc_count_{idx}" for idx in range(8)),
+        *(f"alloc_bytes_{idx}" for idx in range(8)),
+        "rate_throttles",
+        "rate_throttled",
+        "spool_files",
+        "spool_bytes",
+        "spool_bytes_total",
+        "spool_rejects",
+        "slow_threshold_ms",
+        "slow_sessions",
+        *(f"slow_events_{stage}" for stage in SLOW_STAGES),
+        "slow_worst_client_id",
+        "slow_worst_socks_id",
+        *(f"slow_worst_delay_us_{stage}" for stage in SLOW_STAGES),
+        "dns_queries",
+        "dns_timeouts",
+        "dns_cancelled",
+        "dns_fallbacks",
+        "wakeups")
+
+    PAYLOAD_STRUCT = struct.Struct(ENDIANNESS + "Q" * len(FIELDS))
+
+    def __init__(self, stats=None, **kwargs):
+        assert stats is None or isinstance(stats, dict)
+
+        kwargs.setdefault("uid", generate_uid())
+        super().__init__(OpCode.STATS, **kwargs)
+
+        self.stats = stats  # None for a request
+
+    def _serialize_payload(self):
+        if self.stats is None:
+            return b""
+
+        return self.PAYLOAD_STRUCT.pack(
+            *(self.stats.get(name, 0) for name in self.FIELDS))
+
+    @classmethod
+    def create_from_packet(cls, header, payload_view):
+        if len(payload_view) == 0:
+            return cls(uid=header.uid)
+
+        if len(payload_view) < cls.PAYLOAD_STRUCT.size:
+            raise ProtoDecodeError(
+                f"malformed {header.opcode.name} packet: unexpected payload "
+                f"length (got {len(payload_view)}; expected at least "
+                f"{cls.PAYLOAD_STRUCT.size})")
+
+        values = cls.PAYLOAD_STRUCT.unpack_from(payload_view)
+
+        return cls(dict(zip(cls.FIELDS, values)), uid=header.uid)
+
+
 class PingPacket(PacketBase):
-    def __init__(self, **kwargs):
+    PAYLOAD_STRUCT = struct.Struct(ENDIANNESS + "QB")
+
+    # payload is empty unless *stamp* is set, in which case a REQUEST is to be
+    # answered with a REPLY of the same uid and stamp instead of a STATUS (see
+    # ChannelSetupFlag.PING_RTT)
+    def __init__(self, stamp=None, kind=PingKind.REQUEST, **kwargs):
+        assert stamp is None or isinstance(stamp, int)
+        assert isinstance(kind, PingKind)
+
         kwargs.setdefault("uid", generate_uid())
         super().__init__(OpCode.PING, **kwargs)
 
+        self.stamp = stamp
+        self.kind = kind
+
+    def _serialize_payload(self):
+        if self.stamp is None:
+            return b""
+
+        return self.PAYLOAD_STRUCT.pack(self.stamp, self.kind)
+
     @classmethod
     def create_from_packet(cls, header, payload_view):
-        if len(payload_view) != 0:
+        if len(payload_view) == 0:
+            return cls(uid=header.uid)
+
+        if len(payload_view) != cls.PAYLOAD_STRUCT.size:
             raise ProtoDecodeError(
-                f"malformed {header.opcode.name} packet: expected empty "
-                f"payload")
+                f"malformed {header.opcode.name} packet: unexpected payload "
+                f"length (got {len(payload_view)}; expected 0 or "
+                f"{cls.PAYLOAD_STRUCT.size})")
 
-        return cls(uid=header.uid)
+        stamp, kind = cls.PAYLOAD_STRUCT.unpack(payload_view)
+
+        try:
+            kind = PingKind(kind)
+        except ValueError:
+            raise ProtoDecodeError(
+                f"malformed {header.opcode.name} packet: unknown kind {kind}")
+
+        return cls(stamp, kind, uid=header.uid)
 
 
 class SocksPacket(PacketBase):
     PAYLOAD_STRUCT = struct.Struct(ENDIANNESS + "Q")
 
     def __init__(self, socks_id, socks_packet, **kwargs):
+        # *socks_packet* is a memoryview if received, see InputStream
         validate_socks_id(socks_id)
-        if not isinstance(socks_packet, bytes):
+        if not isinstance(socks_packet, (bytes, memoryview)):
             raise ValueError("socks_packet")
 
         kwargs.setdefault("uid", generate_uid())
@@ -226,7 +446,7 @@ class SocksPacket(PacketBase):
 
     def _serialize_payload(self):
         validate_socks_id(self.socks_id)
-        if not isinstance(self.socks_packet, bytes):
+        if not isinstance(self.socks_packet, (bytes, memoryview)):
             raise ValueError("socks_packet")
 
         payload = self.PAYLOAD_STRUCT.pack(self.socks_id)
@@ -245,9 +465,8 @@ class SocksPacket(PacketBase):
         tail_view = payload_view[cls.PAYLOAD_STRUCT.size:]
 
         socks_id, = cls.PAYLOAD_STRUCT.unpack(head_view)
-        socks_packet = tail_view.tobytes()
 
-        return cls(socks_id, socks_packet, uid=header.uid)
+        return cls(socks_id, tail_view, uid=header.uid)
 
 
 class SocksClosePacket(PacketBase):
@@ -308,6 +527,264 @@ class SocksDisconnectedPacket(PacketBase):
         return cls(socks_id, uid=header.uid)
 
 
+class SocksFlowPacket(PacketBase):
+    PAYLOAD_STRUCT = struct.Struct(ENDIANNESS + "QB")
+
+    def __init__(self, socks_id, flow, **kwargs):
+        validate_socks_id(socks_id)
+        if not isinstance(flow, SocksFlow):
+            raise ValueError("flow")
+
+        kwargs.setdefault("uid", generate_uid())
+        super().__init__(OpCode.SOCKS_FLOW, **kwargs)
+
+        self.socks_id = socks_id
+        self.flow = flow
+
+    def _serialize_payload(self):
+        validate_socks_id(self.socks_id)
+        if not isinstance(self.flow, SocksFlow):
+            raise ValueError("flow")
+
+        return self.PAYLOAD_STRUCT.pack(self.socks_id, self.flow.value)
+
+    @classmethod
+    def create_from_packet(cls, header, payload_view):
+        if len(payload_view) != cls.PAYLOAD_STRUCT.size:
+            raise ProtoDecodeError(
+                f"malformed {header.opcode.name} packet: unexpected payload "
+                f"length (got {len(payload_view)}; expected "
+                f"{cls.PAYLOAD_STRUCT.size})")
+
+        socks_id, flow = cls.PAYLOAD_STRUCT.unpack(payload_view)
+
+        if flow not in SocksFlow.__members__.values():
+            raise ProtoDecodeError(
+                f"malformed {header.opcode.name} packet: unknown flow value "
+                f"{flow}")
+
+        return cls(socks_id, SocksFlow(flow), uid=header.uid)
+
+
+class SocksBatchPacket(PacketBase):
+    RECORD_STRUCT = struct.Struct(ENDIANNESS + "QI")
+
+    def __init__(self, records, **kwargs):
+        # *records* is a list of (socks_id, socks_packet) tuples;
+        # *socks_packet* is a memoryview if received, see InputStream
+        if not records:
+            raise ValueError("records")
+        for socks_id, socks_packet in records:
+            validate_socks_id(socks_id)
+            if (not isinstance(socks_packet, (bytes, memoryview)) or
+                    not socks_packet):
+                raise ValueError("socks_packet")
+
+        kwargs.setdefault("uid", generate_uid())
+        super().__init__(OpCode.SOCKS_BATCH, **kwargs)
+
+        self.records = records
+
+    def _serialize_payload(self):
+        payload = b""
+        for socks_id, socks_packet in self.records:
+            validate_socks_id(socks_id)
+            payload += self.RECORD_STRUCT.pack(socks_id, len(socks_packet))
+            payload += socks_packet
+
+        return payload
+
+    @classmethod
+    def create_from_packet(cls, header, payload_view):
+        records = []
+        offset = 0
+
+        while offset < len(payload_view):
+            if len(payload_view) - offset < cls.RECORD_STRUCT.size:
+                raise ProtoDecodeError(
+                    f"malformed {header.opcode.name} packet: truncated record "
+                    f"header at offset {offset}")
+
+            socks_id, length = cls.RECORD_STRUCT.unpack(
+                payload_view[offset:offset+cls.RECORD_STRUCT.size])
+            offset += cls.RECORD_STRUCT.size
+
+            if length == 0 or length > len(payload_view) - offset:
+                raise ProtoDecodeError(
+                    f"malformed {header.opcode.name} packet: unexpected "
+                    f"record length {length} at offset {offset}")
+
+            records.append((socks_id, payload_view[offset:offset+length]))
+            offset += length
+
+        if not records:
+            raise ProtoDecodeError(
+                f"malformed {header.opcode.name} packet: no record")
+
+        return cls(records, uid=header.uid)
+
+
+class SocksLz4Packet(PacketBase):
+    PAYLOAD_STRUCT = struct.Struct(ENDIANNESS + "QI")
+
+    # never instantiated: create_from_packet() decompresses SOCKS data and
+    # returns a plain SocksPacket so that this is transparent to the consumer
+
+    @classmethod
+    def create_from_packet(cls, header, payload_view):
+        if len(payload_view) <= cls.PAYLOAD_STRUCT.size:
+            raise ProtoDecodeError(
+                f"malformed {header.opcode.name} packet: unexpected payload "
+                f"length (got {len(payload_view)}; expected more than "
+                f"{cls.PAYLOAD_STRUCT.size})")
+
+        socks_id, raw_len = cls.PAYLOAD_STRUCT.unpack(
+            payload_view[0:cls.PAYLOAD_STRUCT.size])
+
+        if raw_len == 0 or raw_len > MAX_PAYLOAD_SIZE:
+            raise ProtoDecodeError(
+                f"malformed {header.opcode.name} packet: unexpected raw "
+                f"length {raw_len}")
+
+        try:
+            socks_packet = lz4_decompress_block(
+                payload_view[cls.PAYLOAD_STRUCT.size:], raw_len)
+        except ValueError as exc:
+            raise ProtoDecodeError(
+                f"malformed {header.opcode.name} packet: {exc}")
+
+        return SocksPacket(socks_id, socks_packet, uid=header.uid)
+
+
+class SocksUdpPacket(PacketBase):
+    PAYLOAD_STRUCT = struct.Struct(ENDIANNESS + "Q")
+    RECORD_STRUCT = struct.Struct(ENDIANNESS + "H")
+
+    def __init__(self, socks_id, datagrams, **kwargs):
+        # *datagrams* is a list of SOCKS5 UDP datagrams (RFC1928 section 7),
+        # request header included; memoryviews if received, see InputStream
+        validate_socks_id(socks_id)
+        if not datagrams:
+            raise ValueError("datagrams")
+        for datagram in datagrams:
+            if (not isinstance(datagram, (bytes, memoryview)) or
+                    not datagram or
+                    len(datagram) > 0xffff):
+                raise ValueError("datagram")
+
+        kwargs.setdefault("uid", generate_uid())
+        super().__init__(OpCode.SOCKS_UDP, **kwargs)
+
+        self.socks_id = socks_id
+        self.datagrams = datagrams
+
+    def _serialize_payload(self):
+        validate_socks_id(self.socks_id)
+
+        payload = self.PAYLOAD_STRUCT.pack(self.socks_id)
+        for datagram in self.datagrams:
+            payload += self.RECORD_STRUCT.pack(len(datagram))
+            payload += datagram
+
+        return payload
+
+    @classmethod
+    def create_from_packet(cls, header, payload_view):
+        if len(payload_view) <= cls.PAYLOAD_STRUCT.size:
+            raise ProtoDecodeError(
+                f"malformed {header.opcode.name} packet: unexpected payload "
+                f"length (got {len(payload_view)}; expected more than "
+                f"{cls.PAYLOAD_STRUCT.size})")
+
+        socks_id, = cls.PAYLOAD_STRUCT.unpack(
+            payload_view[0:cls.PAYLOAD_STRUCT.size])
+
+        datagrams = []
+        offset = cls.PAYLOAD_STRUCT.size
+
+        while offset < len(payload_view):
+            if len(payload_view) - offset < cls.RECORD_STRUCT.size:
+                raise ProtoDecodeError(
+                    f"malformed {header.opcode.name} packet: truncated record "
+                    f"header at offset {offset}")
+
+            length, = cls.RECORD_STRUCT.unpack(
+                payload_view[offset:offset+cls.RECORD_STRUCT.size])
+            offset += cls.RECORD_STRUCT.size
+
+            if length == 0 or length > len(payload_view) - offset:
+                raise ProtoDecodeError(
+                    f"malformed {header.opcode.name} packet: unexpected "
+                    f"record length {length} at offset {offset}")
+
+            datagrams.append(payload_view[offset:offset+length])
+            offset += length
+
+        return cls(socks_id, datagrams, uid=header.uid)
+
+
+class SocksUdpAssociatedPacket(PacketBase):
+    PAYLOAD_STRUCT = struct.Struct(ENDIANNESS + "Q")
+
+    def __init__(self, socks_id, **kwargs):
+        validate_socks_id(socks_id)
+
+        kwargs.setdefault("uid", generate_uid())
+        super().__init__(OpCode.SOCKS_UDP_ASSOCIATED, **kwargs)
+
+        self.socks_id = socks_id
+
+    def _serialize_payload(self):
+        validate_socks_id(self.socks_id)
+
+        return self.PAYLOAD_STRUCT.pack(self.socks_id)
+
+    @classmethod
+    def create_from_packet(cls, header, payload_view):
+        if len(payload_view) != cls.PAYLOAD_STRUCT.size:
+            raise ProtoDecodeError(
+                f"malformed {header.opcode.name} packet: unexpected payload "
+                f"length (got {len(payload_view)}; expected "
+                f"{cls.PAYLOAD_STRUCT.size})")
+
+        socks_id, = cls.PAYLOAD_STRUCT.unpack(payload_view)
+
+        return cls(socks_id, uid=header.uid)
+
+
+class SocksResumePacket(PacketBase):
+    PAYLOAD_STRUCT = struct.Struct(ENDIANNESS + "QQ")
+
+    # *offset* is the count of bytes of SOCKS data received so far on this
+    # SOCKS link by the sending side; INVALID_SOCKS_ID ends the list
+    def __init__(self, socks_id, offset, **kwargs):
+        if socks_id != INVALID_SOCKS_ID:
+            validate_socks_id(socks_id)
+        if not isinstance(offset, int) or offset < 0:
+            raise ValueError("offset")
+
+        kwargs.setdefault("uid", generate_uid())
+        super().__init__(OpCode.SOCKS_RESUME, **kwargs)
+
+        self.socks_id = socks_id
+        self.offset = offset
+
+    def _serialize_payload(self):
+        return self.PAYLOAD_STRUCT.pack(self.socks_id, self.offset)
+
+    @classmethod
+    def create_from_packet(cls, header, payload_view):
+        if len(payload_view) != cls.PAYLOAD_STRUCT.size:
+            raise ProtoDecodeError(
+                f"malformed {header.opcode.name} packet: unexpected payload "
+                f"length (got {len(payload_view)}; expected "
+                f"{cls.PAYLOAD_STRUCT.size})")
+
+        socks_id, offset = cls.PAYLOAD_STRUCT.unpack(payload_view)
+
+        return cls(socks_id, offset, uid=header.uid)
+
+
 class UninstallSelfPacket(PacketBase):
     __slots__ = ()
 
@@ -340,19 +817,38 @@ class _ExtractedHeader(NoDict):
 
 
 class InputStream:
+    # Input data is parsed in place: queued reads are merged into an immutable
+    # bytes buffer once per flush (the unconsumed tail of the previous one
+    # being the only data copied), packets are then read from a memoryview of
+    # it at *input_offset*, and their payload handed over as memoryview
+    # slices. That way neither extraction nor consumers copy data per packet,
+    # and the views they keep stay valid as the stream goes on.
+    #
+    # CAUTION: a view pins the whole buffer it comes from in memory, i.e.
+    # consumers should not hold onto payloads longer than needed.
+
     def __init__(self):
         self.feed_lock = threading.Lock()
         self.input_queue = []
         self.input_buffer = b""
+        self.input_offset = 0
         self.flush_lock = threading.Lock()
 
+        # see ChannelSetupFlag.CRC_HEADER
+        self.crc_header_only = False
+
+        # see ChannelSetupFlag.FRAME_CAP
+        self.max_packet_size = MAX_PACKET_SIZE
+
     def __bool__(self):
         with self.feed_lock:
-            return self.input_queue or self.input_buffer
+            return bool(
+                self.input_queue or
+                self.input_offset < len(self.input_buffer))
 
     def __len__(self):
         with self.feed_lock:
-            size = len(self.input_buffer)
+            size = len(self.input_buffer) - self.input_offset
             for data in self.input_queue:
                 size += len(data)
 
@@ -363,6 +859,7 @@ class InputStream:
             with self.feed_lock:
                 self.input_queue = []
                 self.input_buffer = b""
+                self.input_offset = 0
 
     def feed(self, data):
         with self.feed_lock:
@@ -377,36 +874,60 @@ class InputStream:
             else:
                 raise ValueError(f"unsupported data type: {type(data)}")
 
+    def peek_packet_len(self):
+        # header.packet_len of the next packet if its header is complete and
+        # starts the buffer, None otherwise
+        with self.feed_lock:
+            self._merge_input_queue()
+
+            if (len(self.input_buffer) - self.input_offset <
+                    HEADER_STRUCT.size or
+                    not self.input_buffer.startswith(
+                        MAGIC, self.input_offset)):
+                return None
+
+            return HEADER_STRUCT.unpack_from(
+                self.input_buffer, self.input_offset)[1]
+
     def flush_next_packet(self):
         with self.flush_lock:
             with self.feed_lock:
-                if self.input_queue:
-                    self.input_buffer += b"".join(self.input_queue)
-                    self.input_queue = []
+                self._merge_input_queue()
 
-                if not self.input_buffer:
+                if self.input_offset >= len(self.input_buffer):
                     return None
 
                 # find magic word
-                offset = self.input_buffer.find(MAGIC)
+                offset = self.input_buffer.find(MAGIC, self.input_offset)
                 if offset < 0:
-                    logger.warning(
-                        f"skipping {len(self.input_buffer)} bytes of garbage "
-                        f"input data")
+                    # keep what may be the start of a magic word cut by the
+                    # end of a read
+                    for keep in range(len(MAGIC) - 1, -1, -1):
+                        if self.input_buffer.endswith(MAGIC[:keep]):
+                            break
+
+                    garbage_len = (
+                        len(self.input_buffer) - self.input_offset - keep)
+                    if garbage_len > 0:
+                        logger.warning(
+                            f"skipping {garbage_len} bytes of garbage input "
+                            f"data")
+
+                        self.input_offset += garbage_len
 
-                    self.input_buffer = b""
                     return None
-                elif offset > 0:
+                elif offset > self.input_offset:
                     logger.warning(
-                        f"skipping {offset} bytes of garbage input data")
+                        f"skipping {offset - self.input_offset} bytes of "
+                        f"garbage input data")
 
-                    self.input_buffer = self.input_buffer[offset:]
-                    if not self.input_buffer:
-                        return None
+                    self.input_offset = offset
 
-                input_buffer_copy = self.input_buffer[:]  # copy
+                # only flush replaces the buffer, which flush_lock serializes
+                input_buffer = self.input_buffer
+                input_offset = self.input_offset
 
-            view = memoryview(input_buffer_copy)
+            view = memoryview(input_buffer)[input_offset:]
 
             header = self._read_header(view)
             if header is None:
@@ -419,11 +940,25 @@ class InputStream:
 
             # consume buffer data
             with self.feed_lock:
-                assert len(self.input_buffer) >= header.packet_len
-                self.input_buffer = self.input_buffer[header.packet_len:]
+                assert (len(self.input_buffer) - self.input_offset >=
+                        header.packet_len)
+                self.input_offset += header.packet_len
 
         return packet
 
+    def _merge_input_queue(self):
+        # CAUTION: feed_lock must be held
+        if not self.input_queue:
+            return
+
+        if self.input_offset < len(self.input_buffer):
+            self.input_queue.insert(
+                0, memoryview(self.input_buffer)[self.input_offset:])
+
+        self.input_buffer = b"".join(self.input_queue)
+        self.input_queue = []
+        self.input_offset = 0
+
     def _read_header(self, view):
         # enough data for the header?
         if len(view) < HEADER_STRUCT.size:
@@ -438,7 +973,7 @@ class InputStream:
                 f"malformed packet: incorrect magic word {repr(magic)}")
 
         # sanity check (packet_len)
-        if packet_len > MAX_PACKET_SIZE:
+        if packet_len > self.max_packet_size:
             raise ProtoDecodeError(
                 f"malformed packet: header.packet_len is {packet_len}")
 
@@ -452,7 +987,8 @@ class InputStream:
             return None
 
         # validate crc32
-        actual_crc32 = crc32_packet(view[0:packet_len])
+        actual_crc32 = crc32_packet(
+            view[0:packet_len], header_only=self.crc_header_only)
         if actual_crc32 != crc32:
             raise ProtoDecodeError(
                 f"malformed packet: crc32 mismatch "
@@ -518,12 +1054,113 @@ def validate_socks_id(socks_id):
         raise ValueError("socks_id")
 
 
-def crc32_packet(data):
+def crc32_packet(data, *, header_only=False):
+    end = HEADER_STRUCT.size if header_only else len(data)
     crc32 = zlib.crc32(data[0:HEADER_CRC32_OFFSET])
     crc32 = zlib.crc32(b"\x00\x00\x00\x00", crc32)
-    crc32 = zlib.crc32(data[HEADER_CRC32_OFFSET+4:], crc32)
+    crc32 = zlib.crc32(data[HEADER_CRC32_OFFSET+4:end], crc32)
     return crc32
 
 
+def reseal_packets(data, *, header_only):
+    """
+    Recompute the crc32 of the serialized packet(s) in *data*, according to
+    the mode agreed on the channel they are about to be written to.
+    """
+    data = bytearray(data)
+    offset = 0
+
+    while offset + HEADER_STRUCT.size <= len(data):
+        _, packet_len, _, _, _ = HEADER_STRUCT.unpack_from(data, offset)
+        if packet_len < HEADER_STRUCT.size or offset + packet_len > len(data):
+            raise ValueError("data")
+
+        view = memoryview(data)[offset:offset+packet_len]
+        struct.pack_into(
+            ENDIANNESS + "I", data, offset + HEADER_CRC32_OFFSET,
+            crc32_packet(view, header_only=header_only))
+        view.release()
+
+        offset += packet_len
+
+    if offset != len(data):
+        raise ValueError("data")
+
+    return bytes(data)
+
+
+def lz4_decompress_block(block, raw_len):
+    if _lz4_block is not None:
+        try:
+            return _lz4_block.decompress(block, uncompressed_size=raw_len)
+        except Exception as exc:
+            raise ValueError(f"LZ4 block: {exc}")
+
+    # pure-python fallback; see LZ4 block format specification
+    src = bytes(block)
+    src_len = len(src)
+    out = bytearray()
+    idx = 0
+
+    def _read_length(idx, length):
+        if length == 15:
+            while True:
+                if idx >= src_len:
+                    raise ValueError("truncated LZ4 block")
+                byte = src[idx]
+                idx += 1
+                length += byte
+                if byte != 255:
+                    break
+        return idx, length
+
+    while True:
+        if idx >= src_len:
+            raise ValueError("truncated LZ4 block")
+
+        token = src[idx]
+        idx += 1
+
+        # literals
+        idx, literals = _read_length(idx, token >> 4)
+        if idx + literals > src_len:
+            raise ValueError("truncated LZ4 block")
+        out += src[idx:idx+literals]
+        idx += literals
+
+        if idx == src_len:
+            break  # last sequence has no match
+
+        # match
+        if idx + 2 > src_len:
+            raise ValueError("truncated LZ4 block")
+        offset = src[idx] | (src[idx + 1] << 8)
+        idx += 2
+        if offset == 0 or offset > len(out):
+            raise ValueError("invalid LZ4 match offset")
+
+        idx, match = _read_length(idx, token & 0x0f)
+        match += 4
+
+        start = len(out) - offset
+        if match <= offset:
+            out += out[start:start+match]
+        else:
+            # overlapping copy
+            chunk = out[start:]
+            while match > 0:
+                out += chunk[:match]
+                match -= len(chunk)
+
+        if len(out) > raw_len:
+            break
+
+    if len(out) != raw_len:
+        raise ValueError(
+            f"LZ4 block decompressed to {len(out)} bytes instead of {raw_len}")
+
+    return bytes(out)
+
+
 def bytes_to_hexstr(data):
     return f"[{len(data)} bytes]: " + " ".join("{:02X}".format(b) for b in data)
@@ -1,7 +1,9 @@
 # Copyright (c) Lexfo
 # SPDX-License-Identifier: BSD-3-Clause
 
+import collections
 import contextlib
+import hashlib
 import io
 import os
 import socket
@@ -56,7 +58,10 @@ from impacket.smb3structs import (
     FILE_WRITE_EA, FILE_EXECUTE, FILE_READ_ATTRIBUTES, FILE_WRITE_ATTRIBUTES,
     DELETE, READ_CONTROL, WRITE_DAC, WRITE_OWNER, SYNCHRONIZE,
     ACCESS_SYSTEM_SECURITY, MAXIMUM_ALLOWED, GENERIC_ALL, GENERIC_EXECUTE,
-    GENERIC_WRITE, GENERIC_READ)
+    GENERIC_WRITE, GENERIC_READ,
+
+    # pipelined reads, see SmbNamedPipeHandle.read()
+    SMB2_READ, SMB2Read, SMB2Read_Response)
 
 from .utils import logging
 
@@ -68,6 +73,17 @@ __all__ = (
 
 logger = logging.get_internal_logger(__name__)
 
+# SMB2 READ requests kept outstanding by a pipe read in a loop, so that a
+# high-latency link is not bound to one round trip per read; single-credit ones
+# since impacket does not keep the sequence window right with several
+# multi-credit requests in flight
+SMB_READ_DEPTH = 8
+SMB_READ_SIZE = 64 * 1024
+
+# the most data a single SMB WRITE is given, even if server-side allows more,
+# so that it costs 16 credits at most
+SMB_WRITE_SIZE_MAX = 1024 * 1024
+
 
 class SmbError(Exception):
     pass
@@ -346,7 +362,7 @@ class SmbConnection:
 
     def spawn_named_pipe(self, pipe_name, *,
                          access_mask=DEFAULT_PIPE_ACCESS_MASK,
-                         open_timeout=5.0):
+                         open_timeout=5.0, read_depth=SMB_READ_DEPTH):
         timeout_point = time.monotonic() + open_timeout
 
         # wait for the remote named pipe to exist
@@ -378,19 +394,33 @@ class SmbConnection:
             creationOption=FILE_NON_DIRECTORY_FILE,  # | FILE_SYNCHRONOUS_IO_ALERT,
             fileAttributes=FILE_ATTRIBUTE_NORMAL)
 
-        return SmbNamedPipeHandle(pipe_name, self, self.ipc_tree_id, file_id)
+        return SmbNamedPipeHandle(
+            pipe_name, self, self.ipc_tree_id, file_id, read_depth=read_depth)
 
 
 class SmbNamedPipeHandle:
-    """Must be instantiated with `SmbConnection.spawn_named_pipe`"""
+    """
+    Must be instantiated with `SmbConnection.spawn_named_pipe`
+
+    Over SMB2+, reads of unspecified size keep up to *read_depth* SMB2 READ
+    requests outstanding, each of them returning what the pipe holds when it
+    completes, so that data flows while the next replies are on their way.
+    CAUTION: data would get out of order if a read of a given size came after
+    such reads, which is why these are meant for a handshake only.
+    """
 
-    def __init__(self, name, smbconn, tree_id, file_id):
+    def __init__(self, name, smbconn, tree_id, file_id, *,
+                 read_depth=SMB_READ_DEPTH):
         assert isinstance(smbconn, SmbConnection)
 
         self.name = name
         self.smbconn_weak = weakref.ref(smbconn)
         self.tree_id = tree_id
         self.file_id = file_id
+        self.read_depth = read_depth
+
+        # message ids of the SMB2 READ requests in flight, oldest first
+        self._pending_reads = collections.deque()
 
     def __del__(self):
         with contextlib.suppress(Exception):
@@ -408,6 +438,24 @@ class SmbNamedPipeHandle:
     def closed(self):
         return self.file_id is None
 
+    @property
+    def max_write_size(self):
+        # the most a single SMB WRITE carries, as negotiated with server-side;
+        # None if unknown (SMB1)
+        try:
+            smb_server = self.smbconn.getSMBServer()
+            if not isinstance(smb_server, impkt_smb3.SMB3):
+                return None
+
+            conn = smb_server._Connection
+            if (conn["Dialect"] == SMB2_DIALECT_002 or
+                    not conn["SupportsMultiCredit"]):
+                return 64 * 1024
+
+            return min(conn["MaxWriteSize"], SMB_WRITE_SIZE_MAX)
+        except (AttributeError, KeyError, RuntimeError):
+            return None
+
     def close(self):
         if self.file_id is not None:
             try:
@@ -418,6 +466,7 @@ class SmbNamedPipeHandle:
                 pass
             finally:
                 self.file_id = None
+                self._pending_reads.clear()
 
     def read(self, num_bytes=None, *, timeout=None):
         if self.file_id is None:
@@ -427,6 +476,10 @@ class SmbNamedPipeHandle:
 
         try:
             with smbconn.use_timeout(timeout):
+                if num_bytes is None and self._can_pipeline_reads():
+                    return self._read_pipelined(smbconn)
+
+                assert not self._pending_reads
                 return smbconn.readNamedPipe(
                     self.tree_id, self.file_id, bytesToRead=num_bytes)
         except (impkt_nmb.NetBIOSTimeout, socket.timeout) as exc:
@@ -462,6 +515,46 @@ class SmbNamedPipeHandle:
             self.close()
             raise
 
+    def _can_pipeline_reads(self):
+        if self.read_depth < 2:
+            return False
+
+        return isinstance(self.smbconn.getSMBServer(), impkt_smb3.SMB3)
+
+    def _read_pipelined(self, smbconn):
+        # same request as the one of impacket's SMB3.read(), minus the wait
+        smb_server = smbconn.getSMBServer()
+
+        while len(self._pending_reads) < self.read_depth:
+            request = smb_server.SMB_PACKET()
+            request["Command"] = SMB2_READ
+            request["TreeID"] = self.tree_id
+            request["CreditCharge"] = 1
+
+            smb_read = SMB2Read()
+            smb_read["Padding"] = 0x50
+            smb_read["FileID"] = self.file_id
+            smb_read["Length"] = SMB_READ_SIZE
+            smb_read["Offset"] = 0
+            request["Data"] = smb_read
+
+            self._pending_reads.append(smb_server.sendSMB(request))
+
+        # on timeout, the request remains in flight and its reply is waited for
+        # again by the next call; impacket keeps the replies to the other ones
+        # that come meanwhile
+        reply = smb_server.recvSMB(self._pending_reads[0])
+        self._pending_reads.popleft()
+
+        try:
+            reply.isValidAnswer(impkt_nt_errors.STATUS_SUCCESS)
+        except impkt_smb3.SessionError as exc:
+            # as SMBConnection would raise it, see read()
+            raise impkt_smbconnection.SessionError(
+                exc.get_error_code(), exc.get_error_packet())
+
+        return SMB2Read_Response(reply["Data"])["Buffer"]
+
     def write(self, data, *, timeout=None):
         # CAUTION: we cannot even check the return value of the writeNamedPipe()
         # call because of impacket's inconsistency between `smb` and `smb3`
@@ -665,6 +758,49 @@ def put_file(*, fileish, smbconfig, share, destname):
     return True
 
 
+def file_md5(*, smbconfig, share, destname, expected_size=None):
+    """
+    md5 (hex) of a remote file, or `None` if it could not be read.
+
+    With *expected_size*, a file of another size is not read at all and
+    `None` is returned, so that comparing to a local file is cheap as long as
+    they differ.
+    """
+    share = share.replace("/", "\\")
+    share = share.strip("\\")
+
+    destname = destname.replace("/", "\\")
+
+    display_dest_addr = f"\\\\{smbconfig.addr_str}\\{share}\\{destname}"
+    smbconn = None
+    digest = hashlib.md5()
+
+    try:
+        smbconn = smbconfig.spawn_smb_connection()
+
+        if expected_size is not None:
+            entries = smbconn.listPath(share, destname)
+            if (len(entries) != 1 or
+                    entries[0].get_filesize() != expected_size):
+                return None
+
+        smbconn.getFile(share, destname, digest.update)
+    except impkt_smbconnection.SessionError as exc:
+        # typically, no such file
+        logger.debug(f"failed to read {display_dest_addr}: {exc}")
+        return None
+    except Exception:
+        logger.exception(f"failed to read {display_dest_addr}")
+        return None
+    finally:
+        if smbconn is not None:
+            with contextlib.suppress(Exception):
+                smbconn.close()
+            smbconn = None
+
+    return digest.hexdigest()
+
+
 def delete_file(*, smbconfig, share, destname):
     share = share.replace("/", "\\")
     share = share.strip("\\")
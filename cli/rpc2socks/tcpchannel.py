@@ -0,0 +1,95 @@
+# Copyright (c) Lexfo
+# SPDX-License-Identifier: BSD-3-Clause
+
+import contextlib
+import socket
+
+from . import smb
+
+__all__ = ("TcpChannel", )
+
+
+class TcpChannel:
+    """
+    A proto channel over a plain TCP connection, as an alternative to a named
+    pipe instance, where *rpc2socks-server* was started with its
+    ``--channel-tcp-port`` option.
+
+    Mimics the interface of `smb.SmbNamedPipeDedicated` - including timeouts
+    reported as `smb.SmbTimeoutError` - so that `NamedPipeClientThread` can use
+    either.
+
+    CAUTION: the connection is neither authenticated nor encrypted.
+    """
+
+    def __init__(self, rhost, rport, *, connect_timeout=6.0):
+        self._rhost = rhost
+        self._rport = rport
+
+        try:
+            self._sock = socket.create_connection(
+                (rhost, rport), timeout=connect_timeout)
+        except socket.timeout as exc:
+            raise smb.SmbTimeoutError(str(exc))
+
+        # proto does its own coalescing
+        self._sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+
+    def __del__(self):
+        with contextlib.suppress(Exception):
+            self.close()
+
+    @property
+    def addr_str(self):
+        return "tcp://{}:{}".format(self._rhost, self._rport)
+
+    @property
+    def closed(self):
+        return self._sock is None
+
+    @property
+    def max_write_size(self):
+        # no limit of its own, see (NamedPipeClientThread) WRITE_BATCH_MAX
+        return None
+
+    def close(self):
+        if self._sock is not None:
+            with contextlib.suppress(Exception):
+                self._sock.shutdown(socket.SHUT_RDWR)
+            with contextlib.suppress(Exception):
+                self._sock.close()
+            self._sock = None
+
+    def read(self, num_bytes=None, *, timeout=None):
+        sock = self._sock
+        if sock is None:
+            raise RuntimeError("channel closed")
+
+        try:
+            sock.settimeout(timeout)
+            data = sock.recv(num_bytes if num_bytes else 64 * 1024)
+        except socket.timeout as exc:
+            raise smb.SmbTimeoutError(str(exc))
+        except OSError:
+            data = b""
+
+        if not data:
+            self.close()
+
+        return data
+
+    def write(self, data, *, timeout=None):
+        sock = self._sock
+        if sock is None:
+            raise RuntimeError("channel closed")
+
+        try:
+            sock.settimeout(timeout)
+            sock.sendall(data)
+        except socket.timeout as exc:
+            raise smb.SmbTimeoutError(str(exc))
+        except OSError:
+            self.close()
+            return False
+
+        return True
@@ -8,8 +8,8 @@ import sys
 __all__ = (
     "UNSET",
     "NoDict",
-    "ask", "get_fullname", "get_fullnames", "humanize_elapsed_seconds",
-    "reconfigure_output_streams")
+    "ask", "get_fullname", "get_fullnames", "humanize_bytes",
+    "humanize_elapsed_seconds", "reconfigure_output_streams")
 
 
 #: Used to allow `None` to be a regular value in some cases
@@ -94,6 +94,21 @@ def get_fullnames(somethings):
     return [get_fullname(klass) for klass in somethings]
 
 
+def humanize_bytes(count):
+    """
+    Convert a number of bytes (`int` or `float`) and return a `str` of the form
+    ``123 B``, ``1.2 KiB``, ``12.3 MiB``...
+    """
+    for unit in ("B", "KiB", "MiB", "GiB"):
+        if count < 1024:
+            break
+        count /= 1024
+    else:
+        unit = "TiB"
+
+    return f"{count:.0f} {unit}" if unit == "B" else f"{count:.1f} {unit}"
+
+
 def humanize_elapsed_seconds(seconds):
     """
     Convert a value in *seconds* (`int` or `float`) and return a `str` of the
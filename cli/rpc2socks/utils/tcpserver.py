@@ -134,6 +134,7 @@ class TcpServerClient:
         self._output_queue = collections.deque()  # thread-safe
         self._input_queue = collections.deque()  # thread-safe
         self._must_update_selector = True
+        self._recv_paused = False
 
         self._parent_weak = weakref.ref(parent)
         self._parent_lock = parent_lock
@@ -169,6 +170,12 @@ class TcpServerClient:
     def remote_addr(self):
         return self._raddr
 
+    @property
+    def output_queue_size(self):
+        # approximate: a queue being flushed by the I/O thread is not counted
+        with self._queues_lock:
+            return sum(len(data) for data in self._output_queue)
+
     def recv(self):
         with self._queues_lock:
             if not self._input_queue:
@@ -183,16 +190,31 @@ class TcpServerClient:
             if self.is_closed:
                 return False
 
+            was_empty = not self._output_queue
+            self._output_queue.append(data)
+
             # output queue goes from empty to non-empty so the socket
-            # selector must be updated
-            if not self._output_queue:
+            # selector must be updated; CAUTION: only once *data* is queued,
+            # the I/O thread may wake up right away
+            if was_empty:
                 self._must_update_selector = True
                 self._notify_parent()
 
-            self._output_queue.append(data)
-
             return True
 
+    def set_recv_paused(self, paused):
+        """
+        Stop reading from the socket while *paused*, so that the remote peer
+        gets throttled by TCP instead. Output is still flushed.
+        """
+        with self._queues_lock:
+            if self.is_closed or paused == self._recv_paused:
+                return
+
+            self._recv_paused = paused
+            self._must_update_selector = True
+            self._notify_parent()
+
     def _update_selector(self, sel):
         if self._sock is None:
             self._must_update_selector = False
@@ -203,15 +225,20 @@ class TcpServerClient:
 
         with self._parent_lock:
             if self._must_update_selector:
-                flags = selectors.EVENT_READ
+                flags = 0 if self._recv_paused else selectors.EVENT_READ
 
                 if self._output_queue:
                     flags |= selectors.EVENT_WRITE
 
-                try:
-                    sel.modify(self._sock, flags, data=self)
-                except KeyError:
-                    sel.register(self._sock, flags, data=self)
+                if not flags:
+                    # nothing to wait for while paused
+                    with contextlib.suppress(KeyError):
+                        sel.unregister(self._sock)
+                else:
+                    try:
+                        sel.modify(self._sock, flags, data=self)
+                    except KeyError:
+                        sel.register(self._sock, flags, data=self)
 
                 self._must_update_selector = False
 
@@ -219,7 +246,7 @@ class TcpServerClient:
         parent = self.parent
         if parent is not None:
             try:
-                parent._ioint_event.set()
+                parent._interrupt_select()
             except Exception:
                 pass
 
@@ -390,7 +417,9 @@ class TcpServer(dispatcher.Dispatcher):
 
     Internally, a pair of connected sockets - called "monitor sockets" here - is
     created so that a ``select()`` call can be *interrupted* in case of data to
-    be sent on a socket.
+    be sent on a socket. The thread that queues the data writes to them
+    directly, once per turn of the I/O loop at most however many sends it
+    takes.
     """
 
     DEFAULT_BIND = (TcpNetAddr(AF_INET, ("localhost", 8888)), )
@@ -432,7 +461,7 @@ class TcpServer(dispatcher.Dispatcher):
         # low-level state
         self._lock = threading.RLock()
         self._stop = False
-        self._ioint_event = threading.Event()
+        self._interrupt_pending = False  # see _interrupt_select()
         self._sel = selectors.DefaultSelector()
         self._bind_addresses = final_bind_addresses
         self._listening_sockets = listening_sockets
@@ -445,14 +474,7 @@ class TcpServer(dispatcher.Dispatcher):
             name=self.__class__.__name__ + "[io]",
             daemon=True)
 
-        # "i/o interrupt" thread
-        self._thread_ioint = threading.Thread(
-            target=self._iointthread_entry,
-            name=self.__class__.__name__ + "[ioint]",
-            daemon=True)
-
         self._thread_io.start()
-        self._thread_ioint.start()
         time.sleep(0)  # yield
 
     def __del__(self):
@@ -467,7 +489,8 @@ class TcpServer(dispatcher.Dispatcher):
         """Request this server's own I/O handling thread to leave gracefully."""
         with self._lock:
             self._stop = True
-            self._ioint_event.set()
+
+        self._interrupt_select()
 
     def is_alive(self):
         """Check if this server's own I/O handling thread is still running."""
@@ -495,23 +518,15 @@ class TcpServer(dispatcher.Dispatcher):
         # self.request_termination()
 
         with self._lock:
-            if self._thread_io is None and self._thread_ioint is None:
+            if self._thread_io is None:
                 return True
 
             th_io = self._thread_io
-            th_ioint = self._thread_ioint
 
         while True:
-            if th_io is not None and not th_io.is_alive():
-                th_io = None
-
-            if th_ioint is not None and not th_ioint.is_alive():
-                th_ioint = None
-
-            if th_io is None and th_ioint is None:
+            if not th_io.is_alive():
                 with self._lock:
                     self._thread_io = None
-                    self._thread_ioint = None
 
                 return True
 
@@ -545,35 +560,6 @@ class TcpServer(dispatcher.Dispatcher):
         with self._lock:
             self._clients[client_token]._safe_close(self._sel)
 
-    def _iointthread_entry(self):
-        while True:
-            try:
-                self._iointthread_impl()
-                if self._stop:
-                    break
-            except Exception as exc:
-                logger.exception(
-                    f"exception raised in {self.__class__.__name__}'s "
-                    f"[i/o interrupt] thread")
-                time.sleep(2.0)
-
-    def _iointthread_impl(self):
-        while True:
-            with self._lock:
-                if self._stop:
-                    break
-
-            if self._ioint_event.wait():
-                if self._stop:
-                    break
-
-                time.sleep(0)  # yield
-
-                if self._interrupt_select():
-                    self._ioint_event.clear()
-                else:
-                    time.sleep(0.25)
-
     def _iothread_entry(self):
         try:
             self._iothread_impl()
@@ -606,6 +592,10 @@ class TcpServer(dispatcher.Dispatcher):
                 if self._monitor_sockets is None:
                     self._create_monitor_sockets()
 
+            # CAUTION: cleared before the clients get checked, so that a send
+            # that comes after interrupts the select() below
+            self._interrupt_pending = False
+
             # update the selector if needed
             for client in self._clients.values():
                 if client._must_update_selector:
@@ -656,7 +646,7 @@ class TcpServer(dispatcher.Dispatcher):
                 # if data and len(data) > 5:
                 #     logger.warning(f"monitor socket received {len(data)} bytes")
                 # TESTEND
-            except InterruptedError:
+            except (BlockingIOError, InterruptedError):
                 return
 
             if not data:
@@ -701,6 +691,7 @@ class TcpServer(dispatcher.Dispatcher):
                     f"monitor sockets pair")
 
             for sock in self._monitor_sockets:
+                sock.setblocking(False)
                 self._sel.register(
                     sock, selectors.EVENT_READ,
                     data=self.SELDATA_FOR_MONITORSOCK)
@@ -716,20 +707,29 @@ class TcpServer(dispatcher.Dispatcher):
             self._monitor_sockets = None
 
     def _interrupt_select(self):
-        with self._lock:
-            if self._monitor_sockets is None:
-                self._create_monitor_sockets()
+        # CAUTION: called with the lock of a client held, so this may not take
+        # self._lock (see TcpServerClient._safe_close() for the lock order)
+        #
+        # a single byte per turn of the I/O loop is enough, the loop checks
+        # every client once awaken
+        if self._interrupt_pending:
+            return
 
-            if self._monitor_sockets is not None:
-                try:
-                    self._monitor_sockets[0].send(b"\x00")
-                    return True
-                except InterruptedError:
-                    pass
-                except Exception:
-                    logger.exception("failed to write to monitor socket")
+        self._interrupt_pending = True
 
-            return False
+        # created by the I/O loop, which checks the clients before its first
+        # select() anyway
+        monitor_sockets = self._monitor_sockets
+        if monitor_sockets is None:
+            return
+
+        try:
+            monitor_sockets[0].send(b"\x00")
+        except (BlockingIOError, InterruptedError):
+            pass  # pending bytes will do
+        except Exception:
+            self._interrupt_pending = False
+            logger.exception("failed to write to monitor socket")
 
     def _close_all(self):
         with self._lock:
@@ -0,0 +1,162 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "main.h"
+
+namespace alloc_profile {
+
+#ifdef APP_ALLOC_PROFILE
+namespace detail
+{
+    // CAUTION: constant-initialized on purpose, operator new gets called
+    // before main(), and by threads that are about to exit
+    static std::atomic<std::uint64_t> counts[stage_count];
+    static std::atomic<std::uint64_t> bytes[stage_count];
+    static thread_local stage_t current_stage = stage_other;
+
+    static void account(std::size_t size) noexcept
+    {
+        const auto stage = current_stage;
+
+        counts[stage].fetch_add(1, std::memory_order_relaxed);
+        bytes[stage].fetch_add(size, std::memory_order_relaxed);
+    }
+
+    static void* allocate(std::size_t size)
+    {
+        detail::account(size);
+
+        // same as the default operator new
+        for (;;)
+        {
+            auto* ptr = std::malloc(size ? size : 1);
+            if (ptr)
+                return ptr;
+
+            const auto handler = std::get_new_handler();
+            if (!handler)
+                throw std::bad_alloc();
+
+            handler();
+        }
+    }
+}
+
+
+void set_thread_stage(stage_t stage)
+{
+    assert(stage < stage_count);
+    detail::current_stage = stage;
+}
+
+
+scope_t::scope_t(stage_t stage)
+    : m_previous{detail::current_stage}
+{
+    assert(stage < stage_count);
+    detail::current_stage = stage;
+}
+
+
+scope_t::~scope_t()
+{
+    detail::current_stage = m_previous;
+}
+#endif  // #ifdef APP_ALLOC_PROFILE
+
+
+stats_t stats()
+{
+    stats_t out{};
+
+#ifdef APP_ALLOC_PROFILE
+    for (std::size_t idx = 0; idx < stage_count; ++idx)
+    {
+        out.count[idx] = detail::counts[idx].load(std::memory_order_relaxed);
+        out.bytes[idx] = detail::bytes[idx].load(std::memory_order_relaxed);
+    }
+#endif
+
+    return out;
+}
+
+}  // namespace alloc_profile
+
+
+#ifdef APP_ALLOC_PROFILE
+// the replaceable global allocation functions, except the aligned ones which
+// are left to the runtime along with their matching deallocation functions
+
+void* operator new(std::size_t size)
+{
+    return alloc_profile::detail::allocate(size);
+}
+
+
+void* operator new[](std::size_t size)
+{
+    return alloc_profile::detail::allocate(size);
+}
+
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    try
+    {
+        return alloc_profile::detail::allocate(size);
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+    try
+    {
+        return alloc_profile::detail::allocate(size);
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+
+void operator delete[](void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+
+void operator delete[](void* ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+    std::free(ptr);
+}
+
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+    std::free(ptr);
+}
+#endif  // #ifdef APP_ALLOC_PROFILE
@@ -0,0 +1,75 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// Allocation counting of the profiling build (ConProfile configuration, which
+// defines APP_ALLOC_PROFILE), so that work on the allocations of the hot path
+// can be measured
+//
+// * the global operator new and delete get replaced by counting versions that
+//   forward to malloc() and free()
+// * an allocation is accounted to the stage of the innermost ALLOCSCOPE() of
+//   the calling thread, or to the stage of the thread if none (see
+//   set_thread_stage()), stage_other by default
+// * allocations and bytes requested, cumulative; reported by op_stats
+//   (alloc_count and alloc_bytes), which are null in the other builds
+// * an allocation costs two relaxed atomic increments on top of malloc(),
+//   which is why it is not in the release builds
+namespace alloc_profile
+{
+    // CAUTION: append-only, these are the indexes of the alloc_* arrays of
+    // proto::payload_stats_t
+    enum stage_t : std::size_t
+    {
+        stage_other,     // none of the below, e.g. setup and timers
+        stage_pipe,      // threads of the transports (e.g. I/O buffers)
+        stage_parse,     // packets received, as processed by the worker
+        stage_socks,     // SOCKS requests, by the threads of socks_proxy
+        stage_connect,   // connect jobs, resolve included
+        stage_socketio,  // threads of socketio, target I/O
+        stage_response,  // SOCKS responses and data, on their way to the pipe
+        stage_count,
+    };
+
+    struct stats_t
+    {
+        std::uint64_t count[stage_count];
+        std::uint64_t bytes[stage_count];
+    };
+
+#ifdef APP_ALLOC_PROFILE
+    // the stage of the calling thread out of any scope, typically set once
+    // when it starts
+    void set_thread_stage(stage_t stage);
+
+    class scope_t
+    {
+    public:
+        explicit scope_t(stage_t stage);
+        ~scope_t();
+
+        scope_t(const scope_t&) = delete;
+        scope_t& operator=(const scope_t&) = delete;
+
+    private:
+        const stage_t m_previous;
+    };
+#else
+    inline void set_thread_stage(stage_t) { }
+#endif
+
+    // all null unless APP_ALLOC_PROFILE
+    stats_t stats();
+}
+
+// account the allocations of the calling thread to *stage* (e.g.
+// stage_parse) until the end of the enclosing block
+#ifdef APP_ALLOC_PROFILE
+#define ALLOCSCOPE(stage) \
+    const alloc_profile::scope_t CIX_CONCAT(alloc_scope_, __LINE__)( \
+        alloc_profile::stage)
+#else
+#define ALLOCSCOPE(stage)  ((void)0)
+#endif
@@ -0,0 +1,84 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "../main.h"
+#include "common.h"
+#include "loopback.h"
+#include "microbench.h"
+#include "pipebench.h"
+#include "replay.h"
+#include "siobench.h"
+#include "storm.h"
+
+
+// Benchmarks of the service; the default mode is the loopback one, see
+// loopback.cpp
+//
+// usage: rpc2socks_bench [--clients=N] [--sessions=N] [--payload=BYTES]
+//                        [--duration=SECONDS] [service options...]
+//        rpc2socks_bench --micro [microbench options...], see microbench.h
+//        rpc2socks_bench --namedpipe [pipebench options...], see pipebench.h
+//        rpc2socks_bench --storm [storm options...], see storm.h
+//        rpc2socks_bench --replay [replay options...], see replay.h
+//        rpc2socks_bench --socketio [siobench options...], see siobench.h
+
+
+int wmain(int argc, wchar_t* argv[])
+{
+    bench::options_t options{1, 16, 16 * 1024, 10};
+    auto storm_options = storm::default_options();
+    auto replay_options = replay::default_options();
+    auto siobench_options = siobench::default_options();
+    config_t config;
+
+    const std::wstring_view mode((argc > 1) ? argv[1] : L"");
+
+    if (mode == L"--micro")
+        return microbench::main(argc, argv);
+
+    if (mode == L"--namedpipe")
+        return pipebench::main(argc, argv);
+
+    for (int idx = 1; idx < argc; ++idx)
+    {
+        const std::wstring_view arg(argv[idx]);
+        bool error = false;
+
+        if ((mode == L"--storm") ? storm::parse_arg(arg, storm_options) :
+            (mode == L"--replay") ? replay::parse_arg(arg, replay_options) :
+            (mode == L"--socketio") ?
+                siobench::parse_arg(arg, siobench_options) :
+            bench::parse_arg(arg, options))
+        {
+            continue;
+        }
+
+        if (config.parse_arg(arg, error) && !error)
+            continue;
+
+        fmt::print(stderr, L"invalid arg: {}\n", arg);
+        return APP_EXITCODE_ARG;
+    }
+
+#ifdef APP_LOGGING_ENABLED
+    logging::start_async();
+#endif
+
+    WSADATA wsadata{};
+    if (WSAStartup(MAKEWORD(2, 2), &wsadata) != 0)
+        return APP_EXITCODE_API;
+
+    const auto exit_code =
+        (mode == L"--storm") ? storm::run(storm_options, config) :
+        (mode == L"--replay") ? replay::run(replay_options, config) :
+        (mode == L"--socketio") ? siobench::run(siobench_options, config) :
+        bench::run(options, config);
+
+    WSACleanup();
+
+#ifdef APP_LOGGING_ENABLED
+    logging::stop_async();
+#endif
+
+    return exit_code;
+}
@@ -0,0 +1,333 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "../main.h"
+#include "common.h"
+
+namespace bench {
+
+proto::bytes_t make_socks_handshake(std::uint32_t ipv4, unsigned short port)
+{
+    return proto::bytes_t{
+        5, 1, 0,
+        5, 1, 0, 1,
+        static_cast<proto::byte_t>(ipv4 >> 24),
+        static_cast<proto::byte_t>((ipv4 >> 16) & 0xff),
+        static_cast<proto::byte_t>((ipv4 >> 8) & 0xff),
+        static_cast<proto::byte_t>(ipv4 & 0xff),
+        static_cast<proto::byte_t>(port >> 8),
+        static_cast<proto::byte_t>(port & 0xff)};
+}
+
+
+HANDLE pipe_open(const std::wstring& pipe_path)
+{
+    for (;;)
+    {
+        const auto pipe = CreateFileW(
+            pipe_path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+            OPEN_EXISTING, FILE_FLAG_OVERLAPPED, nullptr);
+
+        if (pipe != INVALID_HANDLE_VALUE)
+            return pipe;
+
+        if (GetLastError() != ERROR_PIPE_BUSY ||
+            !WaitNamedPipeW(pipe_path.c_str(), 5000))
+        {
+            return INVALID_HANDLE_VALUE;
+        }
+    }
+}
+
+
+bool pipe_write(HANDLE pipe, HANDLE event, const proto::bytes_t& packet)
+{
+    std::size_t offset = 0;
+
+    while (offset < packet.size())
+    {
+        OVERLAPPED ov{};
+        DWORD written = 0;
+
+        ov.hEvent = event;
+
+        if (!WriteFile(
+                pipe, packet.data() + offset,
+                static_cast<DWORD>(packet.size() - offset), nullptr, &ov) &&
+            GetLastError() != ERROR_IO_PENDING)
+        {
+            return false;
+        }
+
+        if (!GetOverlappedResult(pipe, &ov, &written, TRUE))
+            return false;
+
+        offset += written;
+    }
+
+    return true;
+}
+
+
+bool pipe_read(
+    HANDLE pipe, HANDLE event, proto::bytes_t& buffer, DWORD timeout,
+    std::size_t& out_size)
+{
+    OVERLAPPED ov{};
+    DWORD read = 0;
+
+    ov.hEvent = event;
+    out_size = 0;
+
+    if (!ReadFile(
+            pipe, buffer.data(), static_cast<DWORD>(buffer.size()), nullptr,
+            &ov) &&
+        GetLastError() != ERROR_IO_PENDING)
+    {
+        return false;
+    }
+
+    if (WaitForSingleObject(event, timeout) == WAIT_TIMEOUT)
+    {
+        CancelIo(pipe);
+
+        // the read may have completed in the meantime
+        if (!GetOverlappedResult(pipe, &ov, &read, TRUE))
+            return GetLastError() == ERROR_OPERATION_ABORTED;
+    }
+    else if (!GetOverlappedResult(pipe, &ov, &read, FALSE))
+    {
+        return false;
+    }
+
+    out_size = read;
+
+    return true;
+}
+
+
+
+//******************************************************************************
+
+
+
+channels_t::channels_t()
+    : m_client_id{proto::invalid_client_id}
+    , m_write_pipe{INVALID_HANDLE_VALUE}
+    , m_write_event{CreateEventW(nullptr, TRUE, FALSE, nullptr)}
+    , m_read_pipe{INVALID_HANDLE_VALUE}
+    , m_read_event{CreateEventW(nullptr, TRUE, FALSE, nullptr)}
+    , m_read_buffer(read_size)
+{
+}
+
+
+channels_t::~channels_t()
+{
+    this->close();
+
+    for (const auto handle : { m_write_event, m_read_event })
+    {
+        if (handle)
+            CloseHandle(handle);
+    }
+}
+
+
+bool channels_t::connect(const std::wstring& pipe_path)
+{
+    if (!m_write_event || !m_read_event)
+        return false;
+
+    // the server assigns the client id on the first channel
+    m_write_pipe = pipe_open(pipe_path);
+    if (m_write_pipe == INVALID_HANDLE_VALUE ||
+        !this->setup_channel(
+            m_write_pipe, m_write_event, proto::chansetup_write))
+    {
+        return false;
+    }
+
+    m_read_pipe = pipe_open(pipe_path);
+    if (m_read_pipe == INVALID_HANDLE_VALUE ||
+        !this->setup_channel(m_read_pipe, m_read_event, proto::chansetup_read))
+    {
+        return false;
+    }
+
+    return true;
+}
+
+
+void channels_t::close()
+{
+    for (auto* handle : { &m_write_pipe, &m_read_pipe })
+    {
+        if (*handle != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(*handle);
+            *handle = INVALID_HANDLE_VALUE;
+        }
+    }
+}
+
+
+bool channels_t::write(const proto::bytes_t& packet)
+{
+    return pipe_write(m_write_pipe, m_write_event, packet);
+}
+
+
+bool channels_t::receive(DWORD timeout)
+{
+    return this->receive(m_read_pipe, m_read_event, timeout);
+}
+
+
+proto::error_t channels_t::next_packet(proto::packet_view_t& out_packet)
+{
+    return proto::extract_next_packet(m_input, out_packet);
+}
+
+
+bool channels_t::setup_channel(
+    HANDLE pipe, HANDLE event, proto::channel_setup_flags_t flags)
+{
+    proto::packet_view_t packet;
+
+    if (!pipe_write(pipe, event, proto::make_channel_setup(m_client_id, flags)))
+        return false;
+
+    if (!this->read_packet(pipe, event, packet) ||
+        packet.header->opcode != proto::op_channel_setup_ack ||
+        packet.payload_size() < sizeof(proto::payload_channel_setup_ack_t))
+    {
+        return false;
+    }
+
+    m_client_id =
+        reinterpret_cast<const proto::payload_channel_setup_ack_t*>(
+            packet.payload())->client_id;
+
+    return true;
+}
+
+
+bool channels_t::read_packet(
+    HANDLE pipe, HANDLE event, proto::packet_view_t& packet)
+{
+    const auto deadline = cix::hrticks_now() + 5 * cix::hrticks_second;
+
+    for (;;)
+    {
+        const auto error = proto::extract_next_packet(m_input, packet);
+
+        if (error == proto::ok)
+            return true;
+
+        if (error != proto::error_incomplete ||
+            cix::hrticks_now() >= deadline ||
+            !this->receive(pipe, event, 100))
+        {
+            return false;
+        }
+    }
+}
+
+
+bool channels_t::receive(HANDLE pipe, HANDLE event, DWORD timeout)
+{
+    std::size_t size;
+
+    if (!pipe_read(pipe, event, m_read_buffer, timeout, size))
+        return false;
+
+    if (size > 0)
+    {
+        m_read_buffer.resize(size);
+        m_read_buffer = m_input.feed(std::move(m_read_buffer));
+        m_read_buffer.resize(read_size);
+    }
+
+    return true;
+}
+
+
+
+//******************************************************************************
+
+
+
+service_host_t::service_host_t()
+    : m_pipe_path{}
+    , m_stop_event{nullptr}
+{
+}
+
+
+service_host_t::~service_host_t()
+{
+    this->stop();
+}
+
+
+exit_t service_host_t::start(const config_t& config)
+{
+    const auto pipe_name = xstr::fmt(
+        L"rpc2socks_bench_{}", GetCurrentProcessId());
+
+    m_pipe_path = L"\\\\.\\pipe\\" + pipe_name;
+
+    m_stop_event = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!m_stop_event)
+        return APP_EXITCODE_API;
+
+    m_worker = std::make_shared<svc_worker>();
+
+    const auto exit_code = m_worker->init(m_stop_event, pipe_name, config);
+    if (exit_code != APP_EXITCODE_OK)
+    {
+        m_worker.reset();
+        return exit_code;
+    }
+
+    m_thread = std::make_unique<std::thread>(
+        [worker = m_worker]() { worker->main_loop(); });
+
+    // wait for the pipe to be listening
+    for (std::size_t attempt = 0;
+        attempt < 50 && !WaitNamedPipeW(m_pipe_path.c_str(), 100);
+        ++attempt)
+    {
+        Sleep(100);
+    }
+
+    return APP_EXITCODE_OK;
+}
+
+
+void service_host_t::stop()
+{
+    if (m_thread)
+    {
+        SetEvent(m_stop_event);
+        m_thread->join();
+        m_thread.reset();
+    }
+
+    m_worker.reset();
+
+    if (m_stop_event)
+    {
+        CloseHandle(m_stop_event);
+        m_stop_event = nullptr;
+    }
+}
+
+
+const std::wstring& service_host_t::pipe_path() const
+{
+    return m_pipe_path;
+}
+
+}  // namespace bench
@@ -0,0 +1,107 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// What the benchmarks of the service have in common: a proto client with its
+// two channels, and the service itself, run in-process
+namespace bench {
+
+// method selection reply, then CONNECT reply with an IPv4 address
+static constexpr std::size_t socks_handshake_reply_size = 2 + 10;
+
+// offset of the REP field of the CONNECT reply in the above
+static constexpr std::size_t socks_handshake_reply_code_offset = 2 + 1;
+
+// SOCKS5 greeting (no auth) and CONNECT to an IPv4 address, sent in one go
+// * *ipv4* and *port* are in host byte order
+proto::bytes_t make_socks_handshake(std::uint32_t ipv4, unsigned short port);
+
+// overlapped, retried as long as all the instances are busy; returns
+// INVALID_HANDLE_VALUE on failure
+HANDLE pipe_open(const std::wstring& pipe_path);
+
+bool pipe_write(HANDLE pipe, HANDLE event, const proto::bytes_t& packet);
+
+// *out_size* is zero if nothing got read within *timeout* milliseconds
+bool pipe_read(
+    HANDLE pipe, HANDLE event, proto::bytes_t& buffer, DWORD timeout,
+    std::size_t& out_size);
+
+
+// a proto client, with a write channel and a read channel
+//
+// * write() and the reading methods may be called concurrently, by two
+//   different threads, as they do not share any state
+class channels_t
+{
+public:
+    channels_t();
+    ~channels_t();
+
+    channels_t(const channels_t&) = delete;
+    channels_t& operator=(const channels_t&) = delete;
+
+    bool connect(const std::wstring& pipe_path);
+    void close();
+
+    bool write(const proto::bytes_t& packet);
+
+    // read once from the read channel, waiting *timeout* milliseconds at most,
+    // then next_packet() is to be called until it returns error_incomplete
+    bool receive(DWORD timeout);
+    proto::error_t next_packet(proto::packet_view_t& out_packet);
+
+private:
+    enum : std::size_t
+    {
+        read_size = 64 * 1024,
+    };
+
+private:
+    bool setup_channel(
+        HANDLE pipe, HANDLE event, proto::channel_setup_flags_t flags);
+    bool read_packet(HANDLE pipe, HANDLE event, proto::packet_view_t& packet);
+    bool receive(HANDLE pipe, HANDLE event, DWORD timeout);
+
+private:
+    proto::clientid_t m_client_id;
+    HANDLE m_write_pipe;
+    HANDLE m_write_event;
+    HANDLE m_read_pipe;
+    HANDLE m_read_event;
+    input_stream_t m_input;
+    proto::bytes_t m_read_buffer;
+};
+
+
+
+//******************************************************************************
+
+
+
+// svc_worker, run in-process by a thread of its own, on a pipe of its own
+class service_host_t
+{
+public:
+    service_host_t();
+    ~service_host_t();
+
+    service_host_t(const service_host_t&) = delete;
+    service_host_t& operator=(const service_host_t&) = delete;
+
+    // returns once the pipe is listening
+    exit_t start(const config_t& config);
+    void stop();
+
+    const std::wstring& pipe_path() const;
+
+private:
+    std::wstring m_pipe_path;
+    HANDLE m_stop_event;
+    std::shared_ptr<svc_worker> m_worker;
+    std::unique_ptr<std::thread> m_thread;
+};
+
+}  // namespace bench
@@ -0,0 +1,650 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "../main.h"
+#include "common.h"
+#include "loopback.h"
+
+
+// Loopback benchmark of the service
+//
+// * svc_worker runs in-process, on a pipe of its own; synthetic proto clients
+//   connect to it, each with a write and a read channel, and their SOCKS
+//   sessions CONNECT to a local TCP echo sink
+// * every session keeps one payload in flight: it is sent, echoed by the sink
+//   back through the service, and the next one is sent once the whole echo
+//   got received; the round-trip time of every payload is recorded
+// * reports throughput (echoed payload bytes, one way), round-trip latency and
+//   the CPU time of the whole process (service, clients and sink) per byte
+
+namespace bench {
+
+namespace detail
+{
+    static std::uint64_t process_cpu_time()
+    {
+        FILETIME creation, exit, kernel, user;
+
+        if (!GetProcessTimes(
+                GetCurrentProcess(), &creation, &exit, &kernel, &user))
+        {
+            return 0;
+        }
+
+        // 100ns units
+        return
+            ((static_cast<std::uint64_t>(kernel.dwHighDateTime) << 32) |
+                kernel.dwLowDateTime) +
+            ((static_cast<std::uint64_t>(user.dwHighDateTime) << 32) |
+                user.dwLowDateTime);
+    }
+}
+
+
+
+
+//******************************************************************************
+
+
+
+// accepts any number of connections on 127.0.0.1 and echoes what it receives
+class echo_sink_t
+{
+public:
+    echo_sink_t();
+    ~echo_sink_t();
+
+    bool start();
+    void stop();
+
+    unsigned short port() const;
+
+private:
+    void accept_thread();
+    static void echo_thread(SOCKET conn);
+
+private:
+    SOCKET m_listen;
+    unsigned short m_port;
+    std::unique_ptr<std::thread> m_thread;
+
+    std::mutex m_mutex;
+    std::vector<SOCKET> m_conns;
+    std::vector<std::thread> m_echo_threads;
+};
+
+
+echo_sink_t::echo_sink_t()
+    : m_listen{INVALID_SOCKET}
+    , m_port{0}
+{
+}
+
+
+echo_sink_t::~echo_sink_t()
+{
+    this->stop();
+}
+
+
+bool echo_sink_t::start()
+{
+    sockaddr_in addr{};
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+
+    m_listen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (m_listen == INVALID_SOCKET)
+        return false;
+
+    int addr_len = static_cast<int>(sizeof(addr));
+
+    if (0 != bind(
+            m_listen, reinterpret_cast<const sockaddr*>(&addr),
+            static_cast<int>(sizeof(addr))) ||
+        0 != listen(m_listen, SOMAXCONN) ||
+        0 != getsockname(
+            m_listen, reinterpret_cast<sockaddr*>(&addr), &addr_len))
+    {
+        closesocket(m_listen);
+        m_listen = INVALID_SOCKET;
+        return false;
+    }
+
+    m_port = ntohs(addr.sin_port);
+    m_thread = std::make_unique<std::thread>(
+        &echo_sink_t::accept_thread, this);
+
+    return true;
+}
+
+
+void echo_sink_t::stop()
+{
+    // accept() fails once the socket is closed
+    if (m_listen != INVALID_SOCKET)
+    {
+        closesocket(m_listen);
+        m_listen = INVALID_SOCKET;
+    }
+
+    if (m_thread)
+    {
+        m_thread->join();
+        m_thread.reset();
+    }
+
+    std::vector<std::thread> threads;
+
+    {
+        std::scoped_lock lock(m_mutex);
+
+        for (const auto conn : m_conns)
+            shutdown(conn, SD_BOTH);
+
+        threads.swap(m_echo_threads);
+    }
+
+    for (auto& thread : threads)
+        thread.join();
+
+    for (const auto conn : m_conns)
+        closesocket(conn);
+
+    m_conns.clear();
+}
+
+
+unsigned short echo_sink_t::port() const
+{
+    return m_port;
+}
+
+
+void echo_sink_t::accept_thread()
+{
+    CIX_THREAD_SET_NAME_STATIC(GetCurrentThreadId(), "bench[accept]");
+
+    for (;;)
+    {
+        const auto conn = accept(m_listen, nullptr, nullptr);
+        if (conn == INVALID_SOCKET)
+            break;
+
+        const BOOL nodelay = TRUE;
+        setsockopt(
+            conn, IPPROTO_TCP, TCP_NODELAY,
+            reinterpret_cast<const char*>(&nodelay),
+            static_cast<int>(sizeof(nodelay)));
+
+        std::scoped_lock lock(m_mutex);
+
+        m_conns.push_back(conn);
+        m_echo_threads.emplace_back(&echo_sink_t::echo_thread, conn);
+    }
+}
+
+
+void echo_sink_t::echo_thread(SOCKET conn)
+{
+    CIX_THREAD_SET_NAME_STATIC(GetCurrentThreadId(), "bench[echo]");
+
+    std::vector<char> buffer(64 * 1024);
+
+    for (;;)
+    {
+        const auto received = recv(
+            conn, buffer.data(), static_cast<int>(buffer.size()), 0);
+        if (received <= 0)
+            break;
+
+        for (int offset = 0; offset < received; )
+        {
+            const auto sent = send(
+                conn, buffer.data() + offset, received - offset, 0);
+            if (sent <= 0)
+                return;
+
+            offset += sent;
+        }
+    }
+}
+
+
+
+//******************************************************************************
+
+
+
+// a proto client and its SOCKS sessions; all its I/O is done by the thread
+// that calls run()
+class client_t
+{
+public:
+    struct result_t
+    {
+        std::uint64_t bytes;        // payload bytes echoed
+        std::uint64_t round_trips;  // payloads echoed
+    };
+
+public:
+    client_t(
+        const options_t& options,
+        latency_histogram_t& latency,
+        proto::socksid_t first_socks_id,
+        std::size_t sessions_count);
+    ~client_t() = default;
+
+    bool connect(const std::wstring& pipe_path, unsigned short sink_port);
+    bool run(cix::hrticks_t deadline);
+
+    const result_t& result() const;
+
+private:
+    struct session_t
+    {
+        proto::socksid_t socks_id;
+        std::size_t handshake_left;  // bytes of reply still expected
+        std::size_t echo_left;       // bytes of echo still expected
+        cix::hrticks_t sent;         // when the current payload was sent
+    };
+
+private:
+    bool handle_packet(const proto::packet_view_t& packet, cix::hrticks_t now);
+    bool send_payload(session_t& session);
+
+private:
+    latency_histogram_t& m_latency;
+    std::vector<session_t> m_sessions;
+    proto::bytes_t m_handshake;
+    proto::bytes_t m_payload;
+
+    channels_t m_channels;
+
+    bool m_sending;  // deadline not reached yet
+    result_t m_result;
+};
+
+
+client_t::client_t(
+        const options_t& options,
+        latency_histogram_t& latency,
+        proto::socksid_t first_socks_id,
+        std::size_t sessions_count)
+    : m_latency(latency)
+    , m_payload(options.payload)
+    , m_sending{true}
+    , m_result{}
+{
+    for (std::size_t idx = 0; idx < sessions_count; ++idx)
+    {
+        m_sessions.push_back(session_t{
+            first_socks_id + idx, socks_handshake_reply_size, 0, 0});
+    }
+
+    // content does not matter, the service does not compress it unless the
+    // client asks for it
+    for (std::size_t idx = 0; idx < m_payload.size(); ++idx)
+        m_payload[idx] = static_cast<proto::byte_t>(idx * 31);
+}
+
+
+bool client_t::connect(
+    const std::wstring& pipe_path, unsigned short sink_port)
+{
+    m_handshake = make_socks_handshake(INADDR_LOOPBACK, sink_port);
+
+    return m_channels.connect(pipe_path);
+}
+
+
+bool client_t::run(cix::hrticks_t deadline)
+{
+    CIX_THREAD_SET_NAME_STATIC(GetCurrentThreadId(), "bench[client]");
+
+    for (const auto& session : m_sessions)
+    {
+        if (!m_channels.write(
+                proto::make_socks(session.socks_id, m_handshake)))
+        {
+            return false;
+        }
+    }
+
+    for (;;)
+    {
+        auto now = cix::hrticks_now();
+
+        if (now >= deadline)
+            break;
+
+        if (!m_channels.receive(100))
+            return false;
+
+        now = cix::hrticks_now();
+        m_sending = now < deadline;
+
+        for (;;)
+        {
+            proto::packet_view_t packet;
+
+            const auto error = m_channels.next_packet(packet);
+
+            if (error == proto::error_incomplete)
+                break;
+
+            if (error != proto::ok || !this->handle_packet(packet, now))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+
+const client_t::result_t& client_t::result() const
+{
+    return m_result;
+}
+
+
+bool client_t::handle_packet(
+    const proto::packet_view_t& packet, cix::hrticks_t now)
+{
+    switch (packet.header->opcode)
+    {
+        case proto::op_socks:
+            break;
+
+        case proto::op_socks_close:
+        case proto::op_socks_disconnected:
+            fmt::print(stderr, "SOCKS session closed by server\n");
+            return false;
+
+        default:
+            return true;  // not of interest
+    }
+
+    const auto socks_id =
+        reinterpret_cast<const proto::payload_socks_header_t*>(
+            packet.payload())->socks_id;
+    const auto first_socks_id = m_sessions.front().socks_id;
+
+    if (socks_id < first_socks_id ||
+        socks_id - first_socks_id >= m_sessions.size())
+    {
+        return false;
+    }
+
+    auto& session = m_sessions[socks_id - first_socks_id];
+    auto size = packet.payload_size() - sizeof(proto::payload_socks_header_t);
+
+    if (session.handshake_left > 0)
+    {
+        const auto consumed = std::min(size, session.handshake_left);
+
+        session.handshake_left -= consumed;
+        size -= consumed;
+
+        if (session.handshake_left == 0)
+            return this->send_payload(session);
+
+        return true;
+    }
+
+    if (size > session.echo_left)
+        return false;  // not supposed to happen, one payload in flight
+
+    session.echo_left -= size;
+
+    if (session.echo_left > 0)
+        return true;
+
+    m_latency.record(cix::hrticks_elapsed(session.sent, now));
+    m_result.bytes += m_payload.size();
+    ++m_result.round_trips;
+
+    return this->send_payload(session);
+}
+
+
+bool client_t::send_payload(session_t& session)
+{
+    if (!m_sending)
+        return true;
+
+    session.echo_left = m_payload.size();
+    session.sent = cix::hrticks_now();
+
+    return m_channels.write(proto::make_socks(session.socks_id, m_payload));
+}
+
+
+
+//******************************************************************************
+
+
+
+bool parse_arg(std::wstring_view arg, options_t& options)
+{
+    static const std::pair<const wchar_t*, std::size_t options_t::*> args[] = {
+        { L"--clients=", &options_t::clients },
+        { L"--sessions=", &options_t::sessions },
+        { L"--payload=", &options_t::payload },
+        { L"--duration=", &options_t::duration },
+    };
+
+    for (const auto& [prefix, member] : args)
+    {
+        const std::wstring_view name(prefix);
+
+        if (arg.compare(0, name.size(), name) != 0)
+            continue;
+
+        const std::wstring value(arg.substr(name.size()));
+        wchar_t* end = nullptr;
+
+        errno = 0;
+        const auto number = std::wcstoull(value.c_str(), &end, 0);
+
+        if (value.empty() || !end || *end || errno != 0 || number == 0)
+            return false;
+
+        options.*member = static_cast<std::size_t>(number);
+        return true;
+    }
+
+    return false;
+}
+
+
+
+
+exit_t measure(
+    const options_t& options, const config_t& config, result_t& out_result)
+{
+    out_result = result_t{};
+
+    echo_sink_t sink;
+    if (!sink.start())
+    {
+        fmt::print(stderr, "failed to start echo sink\n");
+        return APP_EXITCODE_API;
+    }
+
+    service_host_t service;
+
+    const auto exit_code = service.start(config);
+    if (exit_code != APP_EXITCODE_OK)
+        return exit_code;
+
+    latency_histogram_t latency;
+    std::vector<std::unique_ptr<client_t>> clients;
+    proto::socksid_t next_socks_id = 1;
+    bool ok = true;
+
+    for (std::size_t idx = 0; ok && idx < options.clients; ++idx)
+    {
+        const auto sessions_count =
+            (options.sessions / options.clients) +
+            (idx < options.sessions % options.clients ? 1 : 0);
+
+        if (sessions_count == 0)
+            break;
+
+        auto client = std::make_unique<client_t>(
+            options, latency, next_socks_id, sessions_count);
+
+        if (!client->connect(service.pipe_path(), sink.port()))
+        {
+            fmt::print(stderr, "client #{} failed to connect\n", idx + 1);
+            ok = false;
+        }
+
+        next_socks_id += sessions_count;
+        clients.push_back(std::move(client));
+    }
+
+    std::atomic<std::size_t> failures{0};
+    const auto cpu = detail::process_cpu_time();
+    const auto start = cix::hrticks_now();
+    const auto deadline = start + (options.duration * cix::hrticks_second);
+
+    if (ok)
+    {
+        std::vector<std::thread> threads;
+
+        for (auto& client : clients)
+        {
+            threads.emplace_back([&client, &failures, deadline]() {
+                if (!client->run(deadline))
+                    ++failures;
+            });
+        }
+
+        for (auto& thread : threads)
+            thread.join();
+
+        for (const auto& client : clients)
+        {
+            out_result.bytes += client->result().bytes;
+            out_result.round_trips += client->result().round_trips;
+        }
+    }
+
+    const auto elapsed = cix::hrticks_elapsed(start);
+    const auto cpu_time = detail::process_cpu_time() - cpu;
+    const auto clients_count = clients.size();
+
+    clients.clear();
+    service.stop();
+    sink.stop();
+
+    if (!ok)
+        return APP_EXITCODE_ERROR;
+
+    // CAUTION: run() relies on *seconds* being left to zero on failure to
+    // start, as opposed to failing clients
+    out_result.clients = clients_count;
+    out_result.cpu_time = cpu_time;
+    out_result.seconds =
+        static_cast<double>(elapsed) / static_cast<double>(cix::hrticks_second);
+    out_result.latency = latency.summary();
+
+    if (failures > 0)
+    {
+        fmt::print(stderr, "{} clients failed\n", failures.load());
+        return APP_EXITCODE_ERROR;
+    }
+
+    return APP_EXITCODE_OK;
+}
+
+
+exit_t run(const options_t& options, const config_t& config)
+{
+    result_t result;
+
+    const auto exit_code = measure(options, config, result);
+    if (exit_code != APP_EXITCODE_OK && result.seconds <= 0.0)
+        return exit_code;
+
+    const auto& summary = result.latency;
+    const auto bytes = std::max<double>(1.0, static_cast<double>(result.bytes));
+
+    fmt::print(
+        "{} clients, {} sessions, {} bytes payloads, {:.1f} sec\n"
+        "throughput: {:.2f} MB/s, {:.0f} payloads/s\n"
+        "round-trip latency: p50 {}us, p90 {}us, p99 {}us, p99.9 {}us, "
+        "max {}us\n"
+        "cpu: {:.1f} ns/B, {:.2f} cores\n",
+        result.clients, options.sessions, options.payload, result.seconds,
+        static_cast<double>(result.bytes) / result.seconds / 1e6,
+        static_cast<double>(result.round_trips) / result.seconds,
+        summary.p50, summary.p90, summary.p99, summary.p999, summary.max,
+        static_cast<double>(result.cpu_time) * 100.0 / bytes,
+        static_cast<double>(result.cpu_time) / 1e7 / result.seconds);
+
+    return exit_code;
+}
+
+
+exit_t host_benchmark(const config_t& config)
+{
+    static const struct
+    {
+        const char* name;
+        options_t options;
+    }
+    cases[] = {
+        { "latency", { 1, 1, 64, 3 } },
+        { "bulk", { 1, 16, 64 * 1024, 3 } },
+        { "fan-out", { 4, 1024, 1024, 3 } },
+    };
+
+    fmt::print(
+        "loopback through svc_worker, socks_proxy and socketio, "
+        "{} logical cpus\n\n",
+        std::thread::hardware_concurrency());
+
+    fmt::print(
+        "{:<8} {:>8} {:>9} {:>10} {:>12} {:>8} {:>8} {:>8} {:>10} {:>6}\n",
+        "case", "sessions", "payload", "MB/s", "payloads/s", "p50 us",
+        "p99 us", "p99.9 us", "cpu ns/B", "cores");
+
+    exit_t exit_code = APP_EXITCODE_OK;
+
+    for (const auto& [name, options] : cases)
+    {
+        result_t result;
+
+        const auto case_exit_code = measure(options, config, result);
+        if (case_exit_code != APP_EXITCODE_OK)
+        {
+            fmt::print(
+                "{:<8} failed (exit code {})\n",
+                name, static_cast<int>(case_exit_code));
+            exit_code = case_exit_code;
+            continue;
+        }
+
+        const auto bytes =
+            std::max<double>(1.0, static_cast<double>(result.bytes));
+
+        fmt::print(
+            "{:<8} {:>8} {:>9} {:>10.2f} {:>12.0f} {:>8} {:>8} {:>8} "
+            "{:>10.1f} {:>6.2f}\n",
+            name, options.sessions, options.payload,
+            static_cast<double>(result.bytes) / result.seconds / 1e6,
+            static_cast<double>(result.round_trips) / result.seconds,
+            result.latency.p50, result.latency.p99, result.latency.p999,
+            static_cast<double>(result.cpu_time) * 100.0 / bytes,
+            static_cast<double>(result.cpu_time) / 1e7 / result.seconds);
+    }
+
+    return exit_code;
+}
+
+}  // namespace bench
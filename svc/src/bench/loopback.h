@@ -0,0 +1,49 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// Loopback benchmark of the service, see loopback.cpp
+//
+// * shared by rpc2socks_bench (default mode) and by the --benchmark action of
+//   the service executable, so that the latter runs on the customer's host
+//   the exact same test as the former does in the lab
+namespace bench {
+
+struct options_t
+{
+    std::size_t clients;
+    std::size_t sessions;  // across all clients
+    std::size_t payload;   // bytes
+    std::size_t duration;  // seconds
+};
+
+struct result_t
+{
+    std::size_t clients;        // connected
+    std::uint64_t bytes;        // payload bytes echoed
+    std::uint64_t round_trips;  // payloads echoed
+    std::uint64_t cpu_time;     // 100ns units, whole process
+    double seconds;
+    latency_histogram_t::summary_t latency;  // round-trip, microseconds
+};
+
+bool parse_arg(std::wstring_view arg, options_t& options);
+
+// run one case and print its result
+// * WSAStartup() must have been called already
+exit_t run(const options_t& options, const config_t& config);
+
+// run one case silently
+// * WSAStartup() must have been called already
+exit_t measure(
+    const options_t& options, const config_t& config, result_t& out_result);
+
+// a short series of cases meant to size a deployment on the host it runs on:
+// latency of a lone session, throughput of a few bulk sessions, cost of many
+// small ones; prints a table
+// * WSAStartup() must have been called already
+exit_t host_benchmark(const config_t& config);
+
+}  // namespace bench
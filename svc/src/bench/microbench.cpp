@@ -0,0 +1,385 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "../main.h"
+#include "microbench.h"
+
+
+// Microbenchmarks of the proto framing primitives
+//
+// * cases: crc32() over a whole op_socks packet, the same over its header
+//   only (crc_header), make_socks() with a recycled storage, both flavors of
+//   extract_next_packet() (the one of the channel receive path also feeds its
+//   input_stream_t like svc_worker does), and the resync on the magic word
+//   after a chunk of garbage
+// * payload sizes range from 16 bytes to 16 MiB (clamped to the biggest
+//   op_socks payload where needed)
+// * extract and resync cases have to refill their stream on every iteration,
+//   which costs a copy of the stream; the "copy" case measures that copy alone
+//   so it can be subtracted
+// * for results to be comparable across commits: input data is generated from
+//   a fixed seed, the calling thread is pinned to a single CPU, and each case
+//   is calibrated then repeated, the median being reported
+namespace microbench {
+
+struct options_t
+{
+    std::wstring filter;
+    std::size_t repetitions;
+    std::size_t min_time;  // milliseconds, per repetition
+};
+
+
+struct case_t
+{
+    std::string name;
+    std::size_t size;  // bytes processed by one iteration
+
+    // runs *iterations* iterations, returns a value that depends on the work
+    // done so that the compiler cannot optimize it away
+    std::function<std::uint64_t(std::size_t iterations)> run;
+};
+
+
+static const std::size_t sizes[] = {
+    16, 256, 4 * 1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024 };
+
+static constexpr std::size_t max_socks_payload =
+    proto::max_payload_size - sizeof(proto::payload_socks_header_t);
+
+static volatile std::uint64_t sink;
+
+
+static proto::bytes_t make_random_bytes(std::size_t size, std::uint64_t seed)
+{
+    cix::random::fast gen(seed, ~seed);
+    proto::bytes_t out(size);
+
+    for (auto& byte : out)
+        byte = gen.next8();
+
+    return out;
+}
+
+
+// random bytes that do not contain proto::magic
+static proto::bytes_t make_garbage(std::size_t size, std::uint64_t seed)
+{
+    auto out = make_random_bytes(size, seed);
+
+    for (auto it = out.begin(); ; ++it)
+    {
+        it = std::search(
+            it, out.end(), proto::magic.begin(), proto::magic.end());
+
+        if (it == out.end())
+            break;
+
+        *it = static_cast<proto::byte_t>(~proto::magic[0]);
+    }
+
+    return out;
+}
+
+
+static std::vector<case_t> make_cases()
+{
+    std::vector<case_t> cases;
+
+    for (const auto size : sizes)
+    {
+        const auto payload_size = std::min(size, max_socks_payload);
+        const auto payload = std::make_shared<proto::bytes_t>(
+            make_random_bytes(payload_size, size));
+        const auto packet = std::make_shared<proto::bytes_t>(
+            proto::make_socks(1, *payload));
+
+        cases.push_back({
+            "copy", packet->size(),
+            [packet](std::size_t iterations) {
+                proto::bytes_t buffer;
+                std::uint64_t acc = 0;
+
+                for (std::size_t idx = 0; idx < iterations; ++idx)
+                {
+                    buffer.assign(packet->begin(), packet->end());
+                    acc += buffer.back();
+                }
+
+                return acc;
+            }});
+
+        cases.push_back({
+            "crc32", packet->size(),
+            [packet](std::size_t iterations) {
+                const auto& header =
+                    *reinterpret_cast<const proto::header_t*>(packet->data());
+                std::uint64_t acc = 0;
+
+                for (std::size_t idx = 0; idx < iterations; ++idx)
+                    acc += proto::crc32(header, proto::crc_full);
+
+                return acc;
+            }});
+
+        cases.push_back({
+            "make_socks", packet->size(),
+            [payload](std::size_t iterations) {
+                proto::bytes_t storage;
+                std::uint64_t acc = 0;
+
+                for (std::size_t idx = 0; idx < iterations; ++idx)
+                {
+                    auto out = proto::make_socks(
+                        1, *payload, std::move(storage));
+
+                    acc += out.size();
+                    storage = std::move(out);
+                }
+
+                return acc;
+            }});
+
+        cases.push_back({
+            "extract_copy", packet->size(),
+            [packet](std::size_t iterations) {
+                proto::bytes_t stream;
+                proto::bytes_t out;
+                std::uint64_t acc = 0;
+
+                for (std::size_t idx = 0; idx < iterations; ++idx)
+                {
+                    stream.assign(packet->begin(), packet->end());
+
+                    if (proto::extract_next_packet(stream, out) != proto::ok)
+                        CIX_THROW_RUNTIME("extract_next_packet failed");
+
+                    acc += out.size();
+                }
+
+                return acc;
+            }});
+
+        cases.push_back({
+            "feed_extract", packet->size(),
+            [packet](std::size_t iterations) {
+                input_stream_t stream;
+                proto::bytes_t buffer;
+                proto::packet_view_t view;
+                std::uint64_t acc = 0;
+
+                for (std::size_t idx = 0; idx < iterations; ++idx)
+                {
+                    buffer.assign(packet->begin(), packet->end());
+                    buffer = stream.feed(std::move(buffer));
+
+                    if (proto::extract_next_packet(stream, view) != proto::ok)
+                        CIX_THROW_RUNTIME("extract_next_packet failed");
+
+                    acc += view.size;
+                }
+
+                return acc;
+            }});
+
+        // garbage then a ping packet; *size* is not clamped here
+        auto resync_data = make_garbage(size, ~size);
+        const auto ping = proto::make_ping();
+        resync_data.insert(resync_data.end(), ping.begin(), ping.end());
+
+        const auto resync_stream =
+            std::make_shared<proto::bytes_t>(std::move(resync_data));
+
+        cases.push_back({
+            "resync", size,
+            [resync_stream](std::size_t iterations) {
+                input_stream_t stream;
+                proto::bytes_t buffer;
+                proto::packet_view_t view;
+                std::uint64_t acc = 0;
+
+                for (std::size_t idx = 0; idx < iterations; ++idx)
+                {
+                    buffer.assign(resync_stream->begin(), resync_stream->end());
+                    buffer = stream.feed(std::move(buffer));
+
+                    if (proto::extract_next_packet(stream, view) != proto::ok)
+                        CIX_THROW_RUNTIME("extract_next_packet failed");
+
+                    acc += view.size;
+                }
+
+                return acc;
+            }});
+    }
+
+    // cost does not depend on payload size
+    {
+        const auto packet = std::make_shared<proto::bytes_t>(
+            proto::make_socks(1, make_random_bytes(sizes[0], 0)));
+
+        cases.push_back({
+            "crc32_header", sizeof(proto::header_t),
+            [packet](std::size_t iterations) {
+                const auto& header =
+                    *reinterpret_cast<const proto::header_t*>(packet->data());
+                std::uint64_t acc = 0;
+
+                for (std::size_t idx = 0; idx < iterations; ++idx)
+                    acc += proto::crc32(header, proto::crc_header);
+
+                return acc;
+            }});
+    }
+
+    return cases;
+}
+
+
+static bool parse_arg(std::wstring_view arg, options_t& options)
+{
+    static const std::pair<const wchar_t*, std::size_t options_t::*> args[] = {
+        { L"--repetitions=", &options_t::repetitions },
+        { L"--min-time=", &options_t::min_time },
+    };
+
+    const std::wstring_view filter_prefix(L"--filter=");
+
+    if (arg.compare(0, filter_prefix.size(), filter_prefix) == 0)
+    {
+        options.filter = arg.substr(filter_prefix.size());
+        return true;
+    }
+
+    for (const auto& [prefix, member] : args)
+    {
+        const std::wstring_view name(prefix);
+
+        if (arg.compare(0, name.size(), name) != 0)
+            continue;
+
+        const std::wstring value(arg.substr(name.size()));
+        wchar_t* end = nullptr;
+
+        errno = 0;
+        const auto number = std::wcstoull(value.c_str(), &end, 0);
+
+        if (value.empty() || !end || *end || errno != 0 || number == 0)
+            return false;
+
+        options.*member = static_cast<std::size_t>(number);
+        return true;
+    }
+
+    return false;
+}
+
+
+// one repetition: nanoseconds per iteration
+static double measure(const case_t& bench_case, std::size_t iterations)
+{
+    const auto start = cix::hrticks_now();
+
+    sink = sink + bench_case.run(iterations);
+
+    const auto elapsed = cix::hrticks_elapsed(start);
+
+    return static_cast<double>(elapsed) * 1000.0 /
+        static_cast<double>(iterations);
+}
+
+
+// number of iterations for one repetition to last at least *min_time*
+// milliseconds
+static std::size_t calibrate(const case_t& bench_case, std::size_t min_time)
+{
+    const auto target = static_cast<double>(min_time) * 1e6;  // nanoseconds
+    std::size_t iterations = 1;
+
+    for (;;)
+    {
+        const auto ns = measure(bench_case, iterations);
+        const auto total = ns * static_cast<double>(iterations);
+
+        if (total >= target)
+            return iterations;
+
+        // aim a bit above target, grow 10x at most to not overshoot on noise
+        const auto estimate = (total > 0.0) ?
+            static_cast<std::size_t>(target * 1.2 / ns) :
+            iterations * 10;
+
+        iterations = std::clamp<std::size_t>(
+            estimate, iterations + 1, iterations * 10);
+    }
+}
+
+
+static void run_case(const case_t& bench_case, const options_t& options)
+{
+    const auto iterations = calibrate(bench_case, options.min_time);
+    std::vector<double> results;
+
+    results.reserve(options.repetitions);
+
+    for (std::size_t rep = 0; rep < options.repetitions; ++rep)
+        results.push_back(measure(bench_case, iterations));
+
+    std::sort(results.begin(), results.end());
+
+    const auto median = results[results.size() / 2];
+    const auto throughput = (median > 0.0) ?
+        static_cast<double>(bench_case.size) * 1e3 / median :  // MB/s
+        0.0;
+
+    fmt::print(
+        "{:<14} {:>10} {:>12} {:>14.1f} {:>14.1f} {:>10.1f}\n",
+        bench_case.name, bench_case.size, iterations, median, results.front(),
+        throughput);
+
+    std::fflush(stdout);
+}
+
+
+exit_t main(int argc, wchar_t* argv[])
+{
+    options_t options{std::wstring(), 5, 200};
+
+    for (int idx = 1; idx < argc; ++idx)
+    {
+        const std::wstring_view arg(argv[idx]);
+
+        if (arg == L"--micro")
+            continue;
+
+        if (!parse_arg(arg, options))
+        {
+            fmt::print(stderr, L"invalid arg: {}\n", arg);
+            return APP_EXITCODE_ARG;
+        }
+    }
+
+    // less noise from migrations and other threads
+    SetThreadAffinityMask(GetCurrentThread(), 1);
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
+
+    fmt::print(
+        "{:<14} {:>10} {:>12} {:>14} {:>14} {:>10}\n",
+        "case", "bytes", "iterations", "median ns/op", "min ns/op", "MB/s");
+
+    for (const auto& bench_case : make_cases())
+    {
+        if (!options.filter.empty() &&
+            xstr::widen_utf8_lenient(bench_case.name).find(options.filter) ==
+                std::wstring::npos)
+        {
+            continue;
+        }
+
+        run_case(bench_case, options);
+    }
+
+    return APP_EXITCODE_OK;
+}
+
+}  // namespace microbench
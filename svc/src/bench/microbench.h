@@ -0,0 +1,14 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// Microbenchmarks of the proto framing primitives, see microbench.cpp
+//
+// usage: rpc2socks_bench --micro [--filter=SUBSTRING] [--repetitions=N]
+//                        [--min-time=MILLISECONDS]
+namespace microbench
+{
+    exit_t main(int argc, wchar_t* argv[]);
+}
@@ -0,0 +1,659 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "../main.h"
+#include "common.h"
+#include "pipebench.h"
+
+
+// Benchmark of cix::win_namedpipe_server alone
+//
+// * the server runs with a listener that echoes whatever it receives, no proto
+//   nor SOCKS involved, so that the ceiling of the pipe layer can be measured
+//   apart from the rest of the service
+// * *clients* local client instances, one thread each, write packets of a
+//   given size and read the echo back, with up to *window* packets in flight
+// * every combination of packet size, max_pending_kernel_writes, I/O buffer
+//   size and mode (completion routines or IOCP) is run for *duration* seconds,
+//   on a server of its own
+// * reports, per case, the throughput (echoed bytes, one way), the rate of the
+//   I/O completions of the server (reads, and kernel level writes), and the
+//   CPU time per echoed byte, of the threads of the server and of the whole
+//   process (i.e. clients included)
+namespace pipebench {
+
+struct options_t
+{
+    std::vector<std::size_t> sizes;    // bytes per client write
+    std::vector<std::size_t> pending;  // max_pending_kernel_writes; 0: none
+    std::vector<std::size_t> buffers;  // I/O buffer sizes
+    std::vector<bool> iocp;            // modes, flag_iocp or not
+    std::size_t clients;
+    std::size_t window;    // packets in flight per client
+    std::size_t duration;  // seconds per case
+};
+
+struct case_t
+{
+    std::size_t size;
+    std::size_t pending;
+    std::size_t buffer;
+    bool iocp;
+};
+
+struct result_t
+{
+    std::uint64_t bytes;        // echoed, as received by clients
+    std::uint64_t completions;  // of the server, reads and writes
+    std::uint64_t server_cpu;   // 100ns units, threads of the server
+    std::uint64_t process_cpu;  // 100ns units
+    double seconds;
+};
+
+namespace detail
+{
+    static std::uint64_t filetime_to_u64(const FILETIME& ft)
+    {
+        return
+            (static_cast<std::uint64_t>(ft.dwHighDateTime) << 32) |
+            ft.dwLowDateTime;
+    }
+
+    static std::uint64_t process_cpu_time()
+    {
+        FILETIME creation, exit, kernel, user;
+
+        if (!GetProcessTimes(
+                GetCurrentProcess(), &creation, &exit, &kernel, &user))
+        {
+            return 0;
+        }
+
+        return filetime_to_u64(kernel) + filetime_to_u64(user);
+    }
+}
+
+
+
+//******************************************************************************
+
+
+
+// echoes every packet received back to its instance, and counts
+class echo_listener_t : public cix::win_namedpipe_server::listener_t
+{
+public:
+    explicit echo_listener_t(std::shared_ptr<cix::buffer_pool> pool);
+    ~echo_listener_t();
+
+    std::vector<cix::win_namedpipe_server::instance_token_t> tokens() const;
+    std::uint64_t reads() const;
+
+    // CPU time of the threads of the server so far, which register
+    // themselves with add_current_thread() (see set_thread_init())
+    void add_current_thread();
+    std::uint64_t threads_cpu_time() const;
+
+private:
+    void on_namedpipe_connected(
+        std::shared_ptr<cix::win_namedpipe_server> pipe,
+        cix::win_namedpipe_server::instance_token_t pipe_instance_token);
+    void on_namedpipe_recv(
+        std::shared_ptr<cix::win_namedpipe_server> pipe,
+        cix::win_namedpipe_server::instance_token_t pipe_instance_token,
+        cix::win_namedpipe_server::bytes_t&& packet);
+    void on_namedpipe_sent(
+        std::shared_ptr<cix::win_namedpipe_server> pipe,
+        cix::win_namedpipe_server::instance_token_t pipe_instance_token,
+        cix::win_namedpipe_server::bytes_t&& packet,
+        std::size_t output_queue_size);
+    void on_namedpipe_closed(
+        std::shared_ptr<cix::win_namedpipe_server> pipe,
+        cix::win_namedpipe_server::instance_token_t pipe_instance_token);
+
+private:
+    const std::shared_ptr<cix::buffer_pool> m_pool;
+    std::atomic<std::uint64_t> m_reads;
+
+    mutable std::mutex m_mutex;
+    std::vector<cix::win_namedpipe_server::instance_token_t> m_tokens;
+    std::vector<HANDLE> m_threads;
+};
+
+
+echo_listener_t::echo_listener_t(std::shared_ptr<cix::buffer_pool> pool)
+    : m_pool(std::move(pool))
+    , m_reads{0}
+{
+}
+
+
+echo_listener_t::~echo_listener_t()
+{
+    for (const auto thread : m_threads)
+        CloseHandle(thread);
+}
+
+
+std::vector<cix::win_namedpipe_server::instance_token_t>
+echo_listener_t::tokens() const
+{
+    std::scoped_lock lock(m_mutex);
+
+    return m_tokens;
+}
+
+
+std::uint64_t echo_listener_t::reads() const
+{
+    return m_reads.load(std::memory_order_relaxed);
+}
+
+
+void echo_listener_t::add_current_thread()
+{
+    HANDLE thread = nullptr;
+
+    if (!DuplicateHandle(
+            GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(),
+            &thread, THREAD_QUERY_INFORMATION, FALSE, 0))
+    {
+        return;
+    }
+
+    std::scoped_lock lock(m_mutex);
+
+    m_threads.push_back(thread);
+}
+
+
+std::uint64_t echo_listener_t::threads_cpu_time() const
+{
+    std::scoped_lock lock(m_mutex);
+
+    std::uint64_t total = 0;
+
+    for (const auto thread : m_threads)
+    {
+        FILETIME creation, exit, kernel, user;
+
+        if (GetThreadTimes(thread, &creation, &exit, &kernel, &user))
+        {
+            total +=
+                detail::filetime_to_u64(kernel) +
+                detail::filetime_to_u64(user);
+        }
+    }
+
+    return total;
+}
+
+
+void echo_listener_t::on_namedpipe_connected(
+    std::shared_ptr<cix::win_namedpipe_server> pipe,
+    cix::win_namedpipe_server::instance_token_t pipe_instance_token)
+{
+    CIX_UNVAR(pipe);
+
+    std::scoped_lock lock(m_mutex);
+
+    m_tokens.push_back(pipe_instance_token);
+}
+
+
+void echo_listener_t::on_namedpipe_recv(
+    std::shared_ptr<cix::win_namedpipe_server> pipe,
+    cix::win_namedpipe_server::instance_token_t pipe_instance_token,
+    cix::win_namedpipe_server::bytes_t&& packet)
+{
+    m_reads.fetch_add(1, std::memory_order_relaxed);
+
+    // the buffer is pooled, it goes back to the pool once written
+    pipe->send(pipe_instance_token, std::move(packet));
+}
+
+
+void echo_listener_t::on_namedpipe_sent(
+    std::shared_ptr<cix::win_namedpipe_server> pipe,
+    cix::win_namedpipe_server::instance_token_t pipe_instance_token,
+    cix::win_namedpipe_server::bytes_t&& packet,
+    std::size_t output_queue_size)
+{
+    CIX_UNVAR(pipe);
+    CIX_UNVAR(pipe_instance_token);
+    CIX_UNVAR(output_queue_size);
+
+    m_pool->release(std::move(packet));
+}
+
+
+void echo_listener_t::on_namedpipe_closed(
+    std::shared_ptr<cix::win_namedpipe_server> pipe,
+    cix::win_namedpipe_server::instance_token_t pipe_instance_token)
+{
+    CIX_UNVAR(pipe);
+    CIX_UNVAR(pipe_instance_token);
+}
+
+
+
+//******************************************************************************
+
+
+
+// a client instance of the pipe; all its I/O is done by the thread that calls
+// run()
+class client_t
+{
+public:
+    client_t(std::size_t size, std::size_t window);
+    ~client_t();
+
+    client_t(const client_t&) = delete;
+    client_t& operator=(const client_t&) = delete;
+
+    bool connect(const std::wstring& pipe_path);
+    bool run(cix::hrticks_t deadline);
+
+    std::uint64_t bytes_received() const;
+
+private:
+    enum : std::size_t
+    {
+        read_size = 64 * 1024,
+    };
+
+private:
+    const std::size_t m_window;  // bytes
+    HANDLE m_pipe;
+    HANDLE m_write_event;
+    HANDLE m_read_event;
+    proto::bytes_t m_packet;
+    proto::bytes_t m_read_buffer;
+    std::uint64_t m_sent;
+    std::uint64_t m_received;
+};
+
+
+client_t::client_t(std::size_t size, std::size_t window)
+    : m_window{size * window}
+    , m_pipe{INVALID_HANDLE_VALUE}
+    , m_write_event{CreateEventW(nullptr, TRUE, FALSE, nullptr)}
+    , m_read_event{CreateEventW(nullptr, TRUE, FALSE, nullptr)}
+    , m_packet(size)
+    , m_read_buffer(read_size)
+    , m_sent{0}
+    , m_received{0}
+{
+    for (std::size_t idx = 0; idx < m_packet.size(); ++idx)
+        m_packet[idx] = static_cast<proto::byte_t>(idx * 31);
+}
+
+
+client_t::~client_t()
+{
+    if (m_pipe != INVALID_HANDLE_VALUE)
+        CloseHandle(m_pipe);
+
+    for (const auto handle : { m_write_event, m_read_event })
+    {
+        if (handle)
+            CloseHandle(handle);
+    }
+}
+
+
+bool client_t::connect(const std::wstring& pipe_path)
+{
+    if (!m_write_event || !m_read_event)
+        return false;
+
+    m_pipe = bench::pipe_open(pipe_path);
+
+    return m_pipe != INVALID_HANDLE_VALUE;
+}
+
+
+bool client_t::run(cix::hrticks_t deadline)
+{
+    CIX_THREAD_SET_NAME_STATIC(GetCurrentThreadId(), "bench[pipe-client]");
+
+    // a write completes once the pipe got it, so that the window is what
+    // bounds the output queue of the server
+    while (cix::hrticks_now() < deadline)
+    {
+        while (m_sent - m_received < m_window)
+        {
+            if (!bench::pipe_write(m_pipe, m_write_event, m_packet))
+                return false;
+
+            m_sent += m_packet.size();
+        }
+
+        std::size_t size;
+
+        if (!bench::pipe_read(
+                m_pipe, m_read_event, m_read_buffer, 100, size))
+        {
+            return false;
+        }
+
+        m_received += size;
+    }
+
+    return true;
+}
+
+
+std::uint64_t client_t::bytes_received() const
+{
+    return m_received;
+}
+
+
+
+//******************************************************************************
+
+
+
+static bool parse_list(
+    std::wstring_view value,
+    bool zero_allowed,
+    std::vector<std::size_t>& out_list)
+{
+    out_list.clear();
+
+    while (!value.empty())
+    {
+        const auto comma = value.find(L',');
+        const std::wstring item(value.substr(0, comma));
+        wchar_t* end = nullptr;
+
+        errno = 0;
+        const auto number = std::wcstoull(item.c_str(), &end, 0);
+
+        if (item.empty() || !end || *end || errno != 0 ||
+            (number == 0 && !zero_allowed) ||
+            number > std::numeric_limits<DWORD>::max())
+        {
+            return false;
+        }
+
+        out_list.push_back(static_cast<std::size_t>(number));
+
+        if (comma == std::wstring_view::npos)
+            break;
+
+        value.remove_prefix(comma + 1);
+    }
+
+    return !out_list.empty();
+}
+
+
+static bool parse_arg(std::wstring_view arg, options_t& options)
+{
+    static const struct
+    {
+        const wchar_t* prefix;
+        std::vector<std::size_t> options_t::* member;
+        bool zero_allowed;
+    }
+    list_args[] = {
+        { L"--sizes=", &options_t::sizes, false },
+        { L"--pending=", &options_t::pending, true },
+        { L"--buffers=", &options_t::buffers, false },
+    };
+
+    static const std::pair<const wchar_t*, std::size_t options_t::*> args[] = {
+        { L"--clients=", &options_t::clients },
+        { L"--window=", &options_t::window },
+        { L"--duration=", &options_t::duration },
+    };
+
+    const std::wstring_view modes_prefix(L"--modes=");
+
+    if (arg.compare(0, modes_prefix.size(), modes_prefix) == 0)
+    {
+        auto value = arg.substr(modes_prefix.size());
+
+        options.iocp.clear();
+
+        while (!value.empty())
+        {
+            const auto comma = value.find(L',');
+            const auto item = value.substr(0, comma);
+
+            if (item == L"apc")
+                options.iocp.push_back(false);
+            else if (item == L"iocp")
+                options.iocp.push_back(true);
+            else
+                return false;
+
+            if (comma == std::wstring_view::npos)
+                break;
+
+            value.remove_prefix(comma + 1);
+        }
+
+        return !options.iocp.empty();
+    }
+
+    for (const auto& [prefix, member, zero_allowed] : list_args)
+    {
+        const std::wstring_view name(prefix);
+
+        if (arg.compare(0, name.size(), name) == 0)
+        {
+            return parse_list(
+                arg.substr(name.size()), zero_allowed, options.*member);
+        }
+    }
+
+    for (const auto& [prefix, member] : args)
+    {
+        const std::wstring_view name(prefix);
+
+        if (arg.compare(0, name.size(), name) != 0)
+            continue;
+
+        const std::wstring value(arg.substr(name.size()));
+        wchar_t* end = nullptr;
+
+        errno = 0;
+        const auto number = std::wcstoull(value.c_str(), &end, 0);
+
+        if (value.empty() || !end || *end || errno != 0 || number == 0)
+            return false;
+
+        options.*member = static_cast<std::size_t>(number);
+        return true;
+    }
+
+    return false;
+}
+
+
+static bool run_case(
+    const options_t& options,
+    const case_t& bench_case,
+    std::size_t case_index,
+    result_t& out_result)
+{
+    // a server per case, on a pipe of its own, so that no instance nor window
+    // state is carried over
+    const auto pipe_path = fmt::format(
+        L"\\\\.\\pipe\\rpc2socks_pipebench_{}_{}",
+        GetCurrentProcessId(), case_index);
+
+    auto pool = std::make_shared<cix::buffer_pool>();
+    auto listener = std::make_shared<echo_listener_t>(pool);
+    auto server = std::make_shared<cix::win_namedpipe_server>();
+
+    server->set_flags(bench_case.iocp ?
+        cix::win_namedpipe_server::flag_iocp :
+        cix::win_namedpipe_server::flag_default);
+    server->set_path(pipe_path);
+    server->set_listener(listener);
+    server->set_buffer_pool(pool);
+    server->set_io_buffer_size(static_cast<DWORD>(bench_case.buffer));
+    server->set_max_pending_writes(bench_case.pending);
+    server->set_listen_instances_count(options.clients);
+    server->set_thread_init([listener]() {
+        listener->add_current_thread();
+    });
+    server->launch();
+
+    if (!server->wait_listening(5000))
+        fmt::print(stderr, "pipe is not fully listening yet\n");
+
+    std::vector<std::unique_ptr<client_t>> clients;
+    bool ok = true;
+
+    for (std::size_t idx = 0; ok && idx < options.clients; ++idx)
+    {
+        auto client = std::make_unique<client_t>(
+            bench_case.size, options.window);
+
+        if (!client->connect(pipe_path))
+        {
+            fmt::print(stderr, "client #{} failed to connect\n", idx + 1);
+            ok = false;
+        }
+
+        clients.push_back(std::move(client));
+    }
+
+    std::atomic<std::size_t> failures{0};
+    const auto server_cpu = listener->threads_cpu_time();
+    const auto process_cpu = detail::process_cpu_time();
+    const auto reads = listener->reads();
+    const auto start = cix::hrticks_now();
+    const auto deadline = start + (options.duration * cix::hrticks_second);
+
+    if (ok)
+    {
+        std::vector<std::thread> threads;
+
+        for (auto& client : clients)
+        {
+            threads.emplace_back([&client, &failures, deadline]() {
+                if (!client->run(deadline))
+                    ++failures;
+            });
+        }
+
+        for (auto& thread : threads)
+            thread.join();
+    }
+
+    // before the clients disconnect, their instances go with them
+    out_result = result_t{};
+    out_result.seconds =
+        static_cast<double>(cix::hrticks_elapsed(start)) /
+        static_cast<double>(cix::hrticks_second);
+    out_result.server_cpu = listener->threads_cpu_time() - server_cpu;
+    out_result.process_cpu = detail::process_cpu_time() - process_cpu;
+    out_result.completions = listener->reads() - reads;
+
+    for (const auto token : listener->tokens())
+    {
+        cix::win_namedpipe_server::instance_stats_t stats;
+
+        if (server->get_instance_stats(token, stats))
+            out_result.completions += stats.writes_completed;
+    }
+
+    for (const auto& client : clients)
+        out_result.bytes += client->bytes_received();
+
+    clients.clear();
+    server->set_listener(nullptr);
+    server->stop();
+
+    if (failures > 0)
+    {
+        fmt::print(stderr, "{} clients failed\n", failures.load());
+        ok = false;
+    }
+
+    return ok;
+}
+
+
+exit_t main(int argc, wchar_t* argv[])
+{
+    options_t options{
+        { 512, 4 * 1024, 64 * 1024 },
+        { 1, cix::win_namedpipe_server::max_pending_kernel_writes, 64 },
+        { 4 * 1024, cix::win_namedpipe_server::io_buffer_default_size },
+        { false, true },
+        4, 8, 3 };
+
+    for (int idx = 1; idx < argc; ++idx)
+    {
+        const std::wstring_view arg(argv[idx]);
+
+        if (arg == L"--namedpipe")
+            continue;
+
+        if (!parse_arg(arg, options))
+        {
+            fmt::print(stderr, L"invalid arg: {}\n", arg);
+            return APP_EXITCODE_ARG;
+        }
+    }
+
+    fmt::print(
+        "{} clients, {} packets in flight each, {} sec per case\n"
+        "{:<5} {:>8} {:>8} {:>8} {:>10} {:>12} {:>10} {:>10}\n",
+        options.clients, options.window, options.duration,
+        "mode", "buffer", "pending", "size", "MB/s", "compl/s",
+        "srv ns/B", "all ns/B");
+
+    std::size_t case_index = 0;
+    bool failed = false;
+
+    for (const auto iocp : options.iocp)
+    {
+        for (const auto buffer : options.buffers)
+        {
+            for (const auto pending : options.pending)
+            {
+                for (const auto size : options.sizes)
+                {
+                    const case_t bench_case{size, pending, buffer, iocp};
+                    result_t result;
+
+                    if (!run_case(options, bench_case, ++case_index, result))
+                    {
+                        failed = true;
+                        continue;
+                    }
+
+                    // CPU times are in 100ns units
+                    const auto bytes = static_cast<double>(
+                        std::max<std::uint64_t>(result.bytes, 1));
+
+                    fmt::print(
+                        "{:<5} {:>8} {:>8} {:>8} {:>10.2f} {:>12.0f} "
+                        "{:>10.2f} {:>10.2f}\n",
+                        iocp ? "iocp" : "apc", buffer, pending, size,
+                        static_cast<double>(result.bytes) /
+                            result.seconds / 1e6,
+                        static_cast<double>(result.completions) /
+                            result.seconds,
+                        static_cast<double>(result.server_cpu) * 100.0 /
+                            bytes,
+                        static_cast<double>(result.process_cpu) * 100.0 /
+                            bytes);
+                }
+            }
+        }
+    }
+
+    return failed ? APP_EXITCODE_ERROR : APP_EXITCODE_OK;
+}
+
+}  // namespace pipebench
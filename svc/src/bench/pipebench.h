@@ -0,0 +1,16 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// Benchmark of cix::win_namedpipe_server alone, with an echo listener, see
+// pipebench.cpp
+//
+// usage: rpc2socks_bench --namedpipe [--sizes=BYTES,...] [--pending=N,...]
+//                        [--buffers=BYTES,...] [--modes=apc,iocp]
+//                        [--clients=N] [--window=N] [--duration=SECONDS]
+namespace pipebench
+{
+    exit_t main(int argc, wchar_t* argv[]);
+}
@@ -0,0 +1,1366 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "../main.h"
+#include "common.h"
+#include "replay.h"
+
+
+// Replay of a capture made with --capture
+//
+// * the service runs in-process; every pipe instance of the capture gets a
+//   pipe connection of its own, which writes what the capture recorded, at
+//   the time it got recorded (divided by *speed*)
+// * the recorded input is cut back into packets, so that the client ids of
+//   op_channel_setup can be patched with the ones the replayed service
+//   assigns, and so that SOCKS CONNECTs can be redirected
+// * every SOCKS session CONNECTs to a local replay target instead of its
+//   original target: session #N goes to 127.0.0.1 + N, the address the
+//   replay target got connected to tells which session it is, and the
+//   target sends what the original target sent, on time too
+// * the replay target listens on all interfaces (the whole 127/8 network is
+//   needed), connections from elsewhere are refused
+// * reports how late the replay got behind the capture timeline, which is
+//   how much the service pushed back, along with the volumes exchanged
+namespace replay {
+
+namespace detail
+{
+    struct record_t
+    {
+        cix::hrticks_t stamp;
+        std::uint64_t id;
+        capture::kind_t kind;
+        proto::bytes_t data;
+    };
+
+    // something to write to a pipe, or a pipe to close
+    struct pipe_event_t
+    {
+        cix::hrticks_t stamp;
+        std::size_t pipe;     // index in plan_t::pipe_client_ids
+        proto::bytes_t data;  // empty to close
+        bool setup_remap;     // op_channel_setup with a client id to patch
+    };
+
+    // something a target sends, or a target closing
+    struct target_event_t
+    {
+        cix::hrticks_t stamp;
+        std::size_t session;
+        proto::bytes_t data;  // empty to close
+    };
+
+    struct plan_t
+    {
+        std::vector<proto::clientid_t> pipe_client_ids;  // as captured
+        std::vector<pipe_event_t> pipe_events;      // chronological order
+        std::vector<target_event_t> target_events;  // chronological order
+        std::size_t sessions_count;
+        std::size_t unmatched_records;  // target records of unknown sessions
+        cix::hrticks_t duration;
+    };
+
+
+    static std::uint32_t read_le32(const proto::byte_t* data)
+    {
+        std::uint32_t value;
+        std::memcpy(&value, data, sizeof(value));
+        return cix::little_to_native(value);
+    }
+
+
+    static std::uint64_t read_le64(const proto::byte_t* data)
+    {
+        std::uint64_t value;
+        std::memcpy(&value, data, sizeof(value));
+        return cix::little_to_native(value);
+    }
+
+
+    static std::uint32_t session_addr(std::size_t session)
+    {
+        return INADDR_LOOPBACK + static_cast<std::uint32_t>(session);
+    }
+
+
+    // sessions are numbered from 127.0.0.1, so there are less than 2^24
+    enum : std::size_t { max_sessions = (std::size_t(1) << 24) - 2 };
+}
+
+
+
+//******************************************************************************
+
+
+
+static bool load_capture(
+    const std::wstring& path, std::vector<detail::record_t>& out_records)
+{
+    std::unique_ptr<std::FILE, decltype(&std::fclose)> file(
+        _wfopen(path.c_str(), L"rb"), &std::fclose);
+
+    if (!file)
+    {
+        fmt::print(stderr, L"failed to open {}\n", path);
+        return false;
+    }
+
+    capture::file_header_t header;
+
+    if (1 != std::fread(&header, sizeof(header), 1, file.get()) ||
+        header.magic != capture::magic ||
+        cix::little_to_native(header.version) != capture::version)
+    {
+        fmt::print(stderr, L"not a capture file: {}\n", path);
+        return false;
+    }
+
+    for (;;)
+    {
+        capture::record_header_t record_header;
+        detail::record_t record;
+
+        if (1 != std::fread(
+                &record_header, sizeof(record_header), 1, file.get()))
+        {
+            break;
+        }
+
+        record.stamp = cix::little_to_native(record_header.stamp);
+        record.id = cix::little_to_native(record_header.id);
+        record.kind = record_header.kind;
+        record.data.resize(cix::little_to_native(record_header.size));
+
+        if (!record.data.empty() &&
+            1 != std::fread(
+                record.data.data(), record.data.size(), 1, file.get()))
+        {
+            break;  // truncated capture, the service may have been killed
+        }
+
+        out_records.push_back(std::move(record));
+    }
+
+    return true;
+}
+
+
+
+//******************************************************************************
+
+
+
+// the SOCKS data a client sends, with its CONNECT request redirected
+class socks_rewriter_t
+{
+public:
+    socks_rewriter_t(std::uint32_t addr, unsigned short port);
+
+    // returns what is to be sent in place of *data*, possibly nothing if the
+    // rest of a handshake message is needed to rewrite it
+    proto::bytes_t feed(const proto::byte_t* data, std::size_t size);
+
+private:
+    enum stage_t
+    {
+        stage_greeting,  // VER NMETHODS METHODS
+        stage_auth,      // VER ULEN UNAME PLEN PASSWD
+        stage_request,   // VER CMD RSV ATYP DST.ADDR DST.PORT
+        stage_done,      // payload, or not SOCKS5
+    };
+
+private:
+    std::size_t message_size() const;
+
+private:
+    const std::uint32_t m_addr;
+    const unsigned short m_port;
+    stage_t m_stage;
+    proto::bytes_t m_pending;
+};
+
+
+socks_rewriter_t::socks_rewriter_t(std::uint32_t addr, unsigned short port)
+    : m_addr{addr}
+    , m_port{port}
+    , m_stage{stage_greeting}
+{
+}
+
+
+proto::bytes_t socks_rewriter_t::feed(
+    const proto::byte_t* data, std::size_t size)
+{
+    if (m_stage == stage_done)
+        return proto::bytes_t(data, data + size);
+
+    m_pending.insert(m_pending.end(), data, data + size);
+
+    proto::bytes_t out;
+
+    while (m_stage != stage_done)
+    {
+        // not SOCKS5, let the service deal with it
+        if (!m_pending.empty() &&
+            m_pending[0] != ((m_stage == stage_auth) ? 1 : 5))
+        {
+            m_stage = stage_done;
+            break;
+        }
+
+        const auto msg_size = this->message_size();
+
+        if (msg_size == 0 || msg_size > m_pending.size())
+            return out;
+
+        if (m_stage == stage_greeting)
+        {
+            // same choice as socks_proxy: no auth if offered, user+pass
+            // otherwise
+            const auto methods_begin = m_pending.begin() + 2;
+            const auto methods_end = m_pending.begin() + msg_size;
+            const auto has_method = [&](proto::byte_t method) {
+                return std::find(methods_begin, methods_end, method) !=
+                    methods_end;
+            };
+
+            m_stage =
+                (!has_method(socks_proxy::socks_noauth) &&
+                    has_method(socks_proxy::socks_auth_userpass)) ?
+                stage_auth :
+                stage_request;
+
+            out.insert(out.end(), m_pending.begin(), methods_end);
+        }
+        else if (m_stage == stage_auth)
+        {
+            m_stage = stage_request;
+            out.insert(
+                out.end(), m_pending.begin(), m_pending.begin() + msg_size);
+        }
+        else
+        {
+            m_stage = stage_done;
+            out.insert(out.end(), {
+                5, m_pending[1], 0, socks_proxy::socks_addr_ipv4,
+                static_cast<proto::byte_t>(m_addr >> 24),
+                static_cast<proto::byte_t>((m_addr >> 16) & 0xff),
+                static_cast<proto::byte_t>((m_addr >> 8) & 0xff),
+                static_cast<proto::byte_t>(m_addr & 0xff),
+                static_cast<proto::byte_t>(m_port >> 8),
+                static_cast<proto::byte_t>(m_port & 0xff) });
+        }
+
+        m_pending.erase(m_pending.begin(), m_pending.begin() + msg_size);
+    }
+
+    out.insert(out.end(), m_pending.begin(), m_pending.end());
+    m_pending.clear();
+
+    return out;
+}
+
+
+std::size_t socks_rewriter_t::message_size() const
+{
+    // 0 if more data is needed to tell
+    const auto size = m_pending.size();
+
+    switch (m_stage)
+    {
+        case stage_greeting:
+            return (size < 2) ? 0 : 2 + std::size_t(m_pending[1]);
+
+        case stage_auth:
+        {
+            if (size < 2)
+                return 0;
+
+            const auto ulen = std::size_t(m_pending[1]);
+
+            return (size < 3 + ulen) ? 0 : 3 + ulen + m_pending[2 + ulen];
+        }
+
+        case stage_request:
+        {
+            if (size < 5)
+                return 0;
+
+            switch (m_pending[3])
+            {
+                case socks_proxy::socks_addr_ipv4:
+                    return 4 + 4 + 2;
+                case socks_proxy::socks_addr_ipv6:
+                    return 4 + 16 + 2;
+                case socks_proxy::socks_addr_name:
+                    return 4 + 1 + std::size_t(m_pending[4]) + 2;
+                default:
+                    return size;  // invalid, forwarded as is
+            }
+        }
+
+        default:
+            return 0;
+    }
+}
+
+
+
+//******************************************************************************
+
+
+
+// turns the records of a capture into what the replay has to do
+class planner_t
+{
+public:
+    explicit planner_t(unsigned short target_port);
+
+    bool build(
+        const std::vector<detail::record_t>& records, detail::plan_t& plan);
+
+private:
+    std::size_t pipe_index(std::uint64_t pipe_token);
+    std::size_t session_index(
+        proto::clientid_t client_id, proto::socksid_t socks_id);
+    void cut_packets(std::size_t pipe, cix::hrticks_t stamp, bool flush);
+    void add_packet(std::size_t pipe, cix::hrticks_t stamp,
+        proto::bytes_t&& packet);
+
+private:
+    const unsigned short m_target_port;
+    detail::plan_t* m_plan;
+
+    std::unordered_map<std::uint64_t, std::size_t> m_pipes;  // by token
+    std::vector<proto::bytes_t> m_streams;   // by pipe index, not cut yet
+    std::map<std::pair<proto::clientid_t, proto::socksid_t>, std::size_t>
+        m_sessions;
+    std::unordered_map<std::uint64_t, std::size_t> m_socks_tokens;
+    std::vector<socks_rewriter_t> m_rewriters;  // by session index
+};
+
+
+planner_t::planner_t(unsigned short target_port)
+    : m_target_port{target_port}
+    , m_plan{nullptr}
+{
+}
+
+
+bool planner_t::build(
+    const std::vector<detail::record_t>& records, detail::plan_t& plan)
+{
+    m_plan = &plan;
+    plan = detail::plan_t{};
+
+    for (const auto& record : records)
+    {
+        plan.duration = std::max(plan.duration, record.stamp);
+
+        switch (record.kind)
+        {
+            case capture::kind_pipe_recv:
+            {
+                const auto pipe = this->pipe_index(record.id);
+                auto& stream = m_streams[pipe];
+
+                stream.insert(
+                    stream.end(), record.data.begin(), record.data.end());
+                this->cut_packets(pipe, record.stamp, false);
+                break;
+            }
+
+            case capture::kind_pipe_closed:
+            {
+                const auto pipe = this->pipe_index(record.id);
+
+                this->cut_packets(pipe, record.stamp, true);
+                plan.pipe_events.push_back({
+                    record.stamp, pipe, proto::bytes_t(), false});
+                break;
+            }
+
+            case capture::kind_channel_setup:
+            {
+                if (record.data.size() != sizeof(proto::clientid_t))
+                    return false;
+
+                plan.pipe_client_ids[this->pipe_index(record.id)] =
+                    detail::read_le64(record.data.data());
+                break;
+            }
+
+            case capture::kind_socks_mapped:
+            {
+                if (record.data.size() != sizeof(capture::socks_mapped_t))
+                    return false;
+
+                m_socks_tokens[record.id] = this->session_index(
+                    detail::read_le64(record.data.data()),
+                    detail::read_le64(record.data.data() + 8));
+                break;
+            }
+
+            case capture::kind_target_recv:
+            case capture::kind_target_closed:
+            {
+                const auto token_it = m_socks_tokens.find(record.id);
+
+                if (token_it == m_socks_tokens.end())
+                {
+                    ++plan.unmatched_records;
+                    break;
+                }
+
+                plan.target_events.push_back({
+                    record.stamp, token_it->second,
+                    (record.kind == capture::kind_target_recv) ?
+                        record.data : proto::bytes_t()});
+                break;
+            }
+
+            default:
+                break;  // from a newer version, not needed by this one
+        }
+    }
+
+    // pipes still open at the end of the capture
+    for (std::size_t pipe = 0; pipe < m_streams.size(); ++pipe)
+        this->cut_packets(pipe, plan.duration, true);
+
+    plan.sessions_count = m_rewriters.size();
+
+    return plan.sessions_count <= detail::max_sessions;
+}
+
+
+std::size_t planner_t::pipe_index(std::uint64_t pipe_token)
+{
+    const auto [pipe_it, inserted] =
+        m_pipes.try_emplace(pipe_token, m_streams.size());
+
+    if (inserted)
+    {
+        m_streams.emplace_back();
+        m_plan->pipe_client_ids.push_back(proto::invalid_client_id);
+    }
+
+    return pipe_it->second;
+}
+
+
+std::size_t planner_t::session_index(
+    proto::clientid_t client_id, proto::socksid_t socks_id)
+{
+    const auto [session_it, inserted] = m_sessions.try_emplace(
+        std::make_pair(client_id, socks_id), m_rewriters.size());
+
+    if (inserted)
+    {
+        m_rewriters.emplace_back(
+            detail::session_addr(session_it->second), m_target_port);
+    }
+
+    return session_it->second;
+}
+
+
+void planner_t::cut_packets(
+    std::size_t pipe, cix::hrticks_t stamp, bool flush)
+{
+    auto& stream = m_streams[pipe];
+
+    while (!stream.empty())
+    {
+        auto packet_it = std::search(
+            stream.begin(), stream.end(),
+            proto::magic.begin(), proto::magic.end());
+
+        // garbage is replayed as is, but the beginning of a magic word may be
+        // at the end
+        if (packet_it == stream.end() && !flush)
+        {
+            packet_it = stream.end() - std::min<std::size_t>(
+                stream.size(), proto::magic.size() - 1);
+        }
+
+        if (packet_it != stream.begin())
+        {
+            m_plan->pipe_events.push_back({
+                stamp, pipe, proto::bytes_t(stream.begin(), packet_it),
+                false});
+            stream.erase(stream.begin(), packet_it);
+            continue;
+        }
+
+        if (stream.size() < sizeof(proto::header_t))
+            break;
+
+        const auto len = static_cast<std::size_t>(detail::read_le32(
+            stream.data() + offsetof(proto::header_t, len)));
+
+        // the service skips the magic word of such a header, so does this
+        if (len < sizeof(proto::header_t) || len > proto::max_packet_size)
+        {
+            m_plan->pipe_events.push_back({
+                stamp, pipe,
+                proto::bytes_t(
+                    stream.begin(), stream.begin() + proto::magic.size()),
+                false});
+            stream.erase(stream.begin(), stream.begin() + proto::magic.size());
+            continue;
+        }
+
+        if (stream.size() < len)
+            break;
+
+        proto::bytes_t packet(stream.begin(), stream.begin() + len);
+
+        stream.erase(stream.begin(), stream.begin() + len);
+        this->add_packet(pipe, stamp, std::move(packet));
+    }
+
+    if (flush && !stream.empty())
+    {
+        m_plan->pipe_events.push_back({stamp, pipe, std::move(stream), false});
+        stream.clear();
+    }
+}
+
+
+void planner_t::add_packet(
+    std::size_t pipe, cix::hrticks_t stamp, proto::bytes_t&& packet)
+{
+    constexpr auto payload_offset = sizeof(proto::header_t);
+    const auto opcode = packet[offsetof(proto::header_t, opcode)];
+
+    if (opcode == proto::op_channel_setup &&
+        packet.size() ==
+            payload_offset + sizeof(proto::payload_channel_setup_t))
+    {
+        const auto client_id =
+            detail::read_le64(packet.data() + payload_offset);
+
+        m_plan->pipe_events.push_back({
+            stamp, pipe, std::move(packet),
+            client_id != proto::invalid_client_id});
+        return;
+    }
+
+    if (opcode != proto::op_socks ||
+        packet.size() <= payload_offset + sizeof(proto::payload_socks_header_t))
+    {
+        m_plan->pipe_events.push_back({stamp, pipe, std::move(packet), false});
+        return;
+    }
+
+    const auto socks_id = detail::read_le64(packet.data() + payload_offset);
+    const auto session = this->session_index(
+        m_plan->pipe_client_ids[pipe], socks_id);
+    const auto data_offset =
+        payload_offset + sizeof(proto::payload_socks_header_t);
+
+    auto data = m_rewriters[session].feed(
+        packet.data() + data_offset, packet.size() - data_offset);
+
+    if (data.empty())
+        return;  // rest of a handshake message to come
+
+    if (data.size() == packet.size() - data_offset &&
+        std::equal(data.begin(), data.end(), packet.begin() + data_offset))
+    {
+        m_plan->pipe_events.push_back({stamp, pipe, std::move(packet), false});
+        return;
+    }
+
+    // rebuilt, with the CRC flavor of the original packet
+    const auto& header = *reinterpret_cast<const proto::header_t*>(
+        packet.data());
+    const auto crc_mode =
+        (proto::crc32(header, proto::crc_full) ==
+            proto::net2host(header.crc32)) ?
+        proto::crc_full :
+        proto::crc_header;
+
+    m_plan->pipe_events.push_back({
+        stamp, pipe,
+        proto::make_socks(socks_id, data, proto::bytes_t(), crc_mode),
+        false});
+}
+
+
+
+//******************************************************************************
+
+
+
+// stands for the SOCKS targets of the capture
+class replay_target_t
+{
+public:
+    replay_target_t();
+    ~replay_target_t();
+
+    // the port is needed to plan the replay, which tells how many sessions
+    // there are
+    bool listen();
+    void start(std::size_t sessions_count);
+    void stop();
+
+    unsigned short port() const;
+
+    void play(const detail::target_event_t& event);
+
+    std::size_t connected() const;
+    std::uint64_t bytes_sent() const;
+
+private:
+    struct session_t
+    {
+        std::mutex mutex;
+        SOCKET conn = INVALID_SOCKET;
+        proto::bytes_t backlog;  // played before the session connected
+        bool close_pending = false;
+    };
+
+private:
+    void accept_thread();
+    static void drain_thread(SOCKET conn);
+    bool send_all(SOCKET conn, const proto::bytes_t& data);
+
+private:
+    SOCKET m_listen;
+    unsigned short m_port;
+    std::unique_ptr<std::thread> m_thread;
+    std::size_t m_sessions_count;
+    std::unique_ptr<session_t[]> m_sessions;
+    std::atomic<std::size_t> m_connected;
+    std::atomic<std::uint64_t> m_bytes_sent;
+
+    std::mutex m_threads_mutex;
+    std::vector<SOCKET> m_conns;
+    std::vector<std::thread> m_drain_threads;
+};
+
+
+replay_target_t::replay_target_t()
+    : m_listen{INVALID_SOCKET}
+    , m_port{0}
+    , m_sessions_count{0}
+    , m_connected{0}
+    , m_bytes_sent{0}
+{
+}
+
+
+replay_target_t::~replay_target_t()
+{
+    this->stop();
+}
+
+
+bool replay_target_t::listen()
+{
+    sockaddr_in addr{};
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = 0;
+
+    m_listen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (m_listen == INVALID_SOCKET)
+        return false;
+
+    int addr_len = static_cast<int>(sizeof(addr));
+
+    if (0 != bind(
+            m_listen, reinterpret_cast<const sockaddr*>(&addr),
+            static_cast<int>(sizeof(addr))) ||
+        0 != ::listen(m_listen, SOMAXCONN) ||
+        0 != getsockname(
+            m_listen, reinterpret_cast<sockaddr*>(&addr), &addr_len))
+    {
+        closesocket(m_listen);
+        m_listen = INVALID_SOCKET;
+        return false;
+    }
+
+    m_port = ntohs(addr.sin_port);
+
+    return true;
+}
+
+
+void replay_target_t::start(std::size_t sessions_count)
+{
+    assert(m_listen != INVALID_SOCKET);
+
+    m_sessions_count = sessions_count;
+    m_sessions = std::make_unique<session_t[]>(sessions_count);
+    m_thread = std::make_unique<std::thread>(
+        &replay_target_t::accept_thread, this);
+}
+
+
+void replay_target_t::stop()
+{
+    // accept() fails once the socket is closed
+    if (m_listen != INVALID_SOCKET)
+    {
+        closesocket(m_listen);
+        m_listen = INVALID_SOCKET;
+    }
+
+    if (m_thread)
+    {
+        m_thread->join();
+        m_thread.reset();
+    }
+
+    std::vector<std::thread> threads;
+
+    {
+        std::scoped_lock lock(m_threads_mutex);
+
+        for (const auto conn : m_conns)
+            shutdown(conn, SD_BOTH);
+
+        threads.swap(m_drain_threads);
+    }
+
+    for (auto& thread : threads)
+        thread.join();
+
+    for (const auto conn : m_conns)
+        closesocket(conn);
+
+    m_conns.clear();
+}
+
+
+unsigned short replay_target_t::port() const
+{
+    return m_port;
+}
+
+
+void replay_target_t::play(const detail::target_event_t& event)
+{
+    assert(event.session < m_sessions_count);
+
+    auto& session = m_sessions[event.session];
+    std::scoped_lock lock(session.mutex);
+
+    if (session.conn == INVALID_SOCKET)
+    {
+        if (event.data.empty())
+            session.close_pending = true;
+        else
+            session.backlog.insert(
+                session.backlog.end(), event.data.begin(), event.data.end());
+    }
+    else if (event.data.empty())
+    {
+        shutdown(session.conn, SD_SEND);
+    }
+    else
+    {
+        this->send_all(session.conn, event.data);
+    }
+}
+
+
+std::size_t replay_target_t::connected() const
+{
+    return m_connected;
+}
+
+
+std::uint64_t replay_target_t::bytes_sent() const
+{
+    return m_bytes_sent;
+}
+
+
+void replay_target_t::accept_thread()
+{
+    CIX_THREAD_SET_NAME_STATIC(GetCurrentThreadId(), "replay[accept]");
+
+    for (;;)
+    {
+        sockaddr_in peer{};
+        int peer_len = static_cast<int>(sizeof(peer));
+
+        const auto conn = accept(
+            m_listen, reinterpret_cast<sockaddr*>(&peer), &peer_len);
+        if (conn == INVALID_SOCKET)
+            break;
+
+        sockaddr_in local{};
+        int local_len = static_cast<int>(sizeof(local));
+        std::size_t session_idx = m_sessions_count;
+
+        if (peer.sin_family == AF_INET &&
+            (ntohl(peer.sin_addr.s_addr) >> 24) == 127 &&
+            0 == getsockname(
+                conn, reinterpret_cast<sockaddr*>(&local), &local_len))
+        {
+            session_idx = ntohl(local.sin_addr.s_addr) - INADDR_LOOPBACK;
+        }
+
+        if (session_idx >= m_sessions_count)
+        {
+            closesocket(conn);
+            continue;
+        }
+
+        const BOOL nodelay = TRUE;
+        setsockopt(
+            conn, IPPROTO_TCP, TCP_NODELAY,
+            reinterpret_cast<const char*>(&nodelay),
+            static_cast<int>(sizeof(nodelay)));
+
+        {
+            std::scoped_lock lock(m_threads_mutex);
+
+            m_conns.push_back(conn);
+            m_drain_threads.emplace_back(&replay_target_t::drain_thread, conn);
+        }
+
+        auto& session = m_sessions[session_idx];
+        std::scoped_lock lock(session.mutex);
+
+        if (session.conn != INVALID_SOCKET)
+            continue;  // connected twice, ignore the latter
+
+        ++m_connected;
+        session.conn = conn;
+
+        if (!session.backlog.empty())
+        {
+            this->send_all(conn, session.backlog);
+            session.backlog = proto::bytes_t();
+        }
+
+        if (session.close_pending)
+            shutdown(conn, SD_SEND);
+    }
+}
+
+
+// what the service sends to the targets is of no interest, but it has to be
+// read
+void replay_target_t::drain_thread(SOCKET conn)
+{
+    CIX_THREAD_SET_NAME_STATIC(GetCurrentThreadId(), "replay[drain]");
+
+    std::vector<char> buffer(64 * 1024);
+
+    while (recv(conn, buffer.data(), static_cast<int>(buffer.size()), 0) > 0)
+    { }
+}
+
+
+bool replay_target_t::send_all(SOCKET conn, const proto::bytes_t& data)
+{
+    for (std::size_t offset = 0; offset < data.size(); )
+    {
+        const auto sent = send(
+            conn, reinterpret_cast<const char*>(data.data() + offset),
+            static_cast<int>(std::min<std::size_t>(
+                data.size() - offset, 1024 * 1024)),
+            0);
+        if (sent <= 0)
+            return false;
+
+        offset += static_cast<std::size_t>(sent);
+        m_bytes_sent += static_cast<std::uint64_t>(sent);
+    }
+
+    return true;
+}
+
+
+
+//******************************************************************************
+
+
+
+// the pipe connections of the replay, one per pipe instance of the capture
+class replay_pipes_t
+{
+public:
+    replay_pipes_t(
+        const std::wstring& pipe_path,
+        const std::vector<proto::clientid_t>& captured_client_ids);
+    ~replay_pipes_t();
+
+    bool play(const detail::pipe_event_t& event);
+    void close_all();
+
+    std::uint64_t bytes_written() const;
+    std::uint64_t bytes_read() const;
+
+private:
+    struct pipe_t
+    {
+        HANDLE handle = INVALID_HANDLE_VALUE;
+        HANDLE write_event = nullptr;
+        HANDLE read_event = nullptr;
+        std::atomic<bool> closing{false};
+        std::unique_ptr<std::thread> reader;
+    };
+
+    enum : cix::hrticks_t { remap_timeout = 5 * cix::hrticks_second };
+
+private:
+    bool open(std::size_t pipe_idx);
+    void close(std::size_t pipe_idx);
+    void reader_thread(std::size_t pipe_idx);
+    bool remap_setup(proto::bytes_t& packet);
+
+private:
+    const std::wstring m_pipe_path;
+    const std::vector<proto::clientid_t>& m_captured_client_ids;
+    std::unique_ptr<pipe_t[]> m_pipes;
+    std::vector<bool> m_opened;  // player thread only
+
+    // captured client id -> replayed one
+    std::mutex m_mutex;
+    std::unordered_map<proto::clientid_t, proto::clientid_t> m_client_ids;
+
+    std::atomic<std::uint64_t> m_bytes_written;
+    std::atomic<std::uint64_t> m_bytes_read;
+};
+
+
+replay_pipes_t::replay_pipes_t(
+        const std::wstring& pipe_path,
+        const std::vector<proto::clientid_t>& captured_client_ids)
+    : m_pipe_path(pipe_path)
+    , m_captured_client_ids(captured_client_ids)
+    , m_pipes{std::make_unique<pipe_t[]>(captured_client_ids.size())}
+    , m_opened(captured_client_ids.size(), false)
+    , m_bytes_written{0}
+    , m_bytes_read{0}
+{
+}
+
+
+replay_pipes_t::~replay_pipes_t()
+{
+    this->close_all();
+}
+
+
+bool replay_pipes_t::play(const detail::pipe_event_t& event)
+{
+    auto& pipe = m_pipes[event.pipe];
+
+    if (!m_opened[event.pipe])
+    {
+        m_opened[event.pipe] = true;
+
+        if (event.data.empty())
+            return true;  // closed right away
+
+        if (!this->open(event.pipe))
+            return false;
+    }
+
+    if (pipe.handle == INVALID_HANDLE_VALUE || pipe.closing)
+        return true;  // failed to open, or closed by the service
+
+    if (event.data.empty())
+    {
+        this->close(event.pipe);
+        return true;
+    }
+
+    if (!event.setup_remap)
+    {
+        m_bytes_written += event.data.size();
+        return bench::pipe_write(pipe.handle, pipe.write_event, event.data);
+    }
+
+    auto packet = event.data;
+
+    if (!this->remap_setup(packet))
+        return false;
+
+    m_bytes_written += packet.size();
+
+    return bench::pipe_write(pipe.handle, pipe.write_event, packet);
+}
+
+
+void replay_pipes_t::close_all()
+{
+    for (std::size_t idx = 0; idx < m_opened.size(); ++idx)
+        this->close(idx);
+}
+
+
+std::uint64_t replay_pipes_t::bytes_written() const
+{
+    return m_bytes_written;
+}
+
+
+std::uint64_t replay_pipes_t::bytes_read() const
+{
+    return m_bytes_read;
+}
+
+
+bool replay_pipes_t::open(std::size_t pipe_idx)
+{
+    auto& pipe = m_pipes[pipe_idx];
+
+    pipe.write_event = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    pipe.read_event = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+
+    if (!pipe.write_event || !pipe.read_event)
+        return false;
+
+    for (;;)
+    {
+        pipe.handle = CreateFileW(
+            m_pipe_path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+            OPEN_EXISTING, FILE_FLAG_OVERLAPPED, nullptr);
+
+        if (pipe.handle != INVALID_HANDLE_VALUE)
+            break;
+
+        if (GetLastError() != ERROR_PIPE_BUSY ||
+            !WaitNamedPipeW(m_pipe_path.c_str(), 5000))
+        {
+            return false;
+        }
+    }
+
+    pipe.reader = std::make_unique<std::thread>(
+        &replay_pipes_t::reader_thread, this, pipe_idx);
+
+    return true;
+}
+
+
+void replay_pipes_t::close(std::size_t pipe_idx)
+{
+    auto& pipe = m_pipes[pipe_idx];
+
+    // the reader is the only one to wait on the handle, it has to be done
+    // with it first
+    pipe.closing = true;
+
+    if (pipe.reader)
+    {
+        pipe.reader->join();
+        pipe.reader.reset();
+    }
+
+    if (pipe.handle != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(pipe.handle);
+        pipe.handle = INVALID_HANDLE_VALUE;
+    }
+
+    for (auto* event : { &pipe.write_event, &pipe.read_event })
+    {
+        if (*event)
+        {
+            CloseHandle(*event);
+            *event = nullptr;
+        }
+    }
+}
+
+
+void replay_pipes_t::reader_thread(std::size_t pipe_idx)
+{
+    CIX_THREAD_SET_NAME_STATIC(GetCurrentThreadId(), "replay[pipe]");
+
+    auto& pipe = m_pipes[pipe_idx];
+    input_stream_t input;
+    proto::bytes_t buffer(64 * 1024);
+
+    while (!pipe.closing)
+    {
+        std::size_t size;
+
+        if (!bench::pipe_read(
+                pipe.handle, pipe.read_event, buffer, 100, size))
+        {
+            break;  // closed by the service
+        }
+
+        if (size == 0)
+            continue;
+
+        m_bytes_read += size;
+
+        buffer.resize(size);
+        buffer = input.feed(std::move(buffer));
+        buffer.resize(64 * 1024);
+
+        for (;;)
+        {
+            proto::packet_view_t packet;
+
+            const auto error = proto::extract_next_packet(input, packet);
+
+            if (error == proto::error_incomplete)
+                break;
+
+            if (error != proto::ok ||
+                packet.header->opcode != proto::op_channel_setup_ack ||
+                packet.payload_size() <
+                    sizeof(proto::payload_channel_setup_ack_t))
+            {
+                continue;
+            }
+
+            const auto client_id =
+                reinterpret_cast<const proto::payload_channel_setup_ack_t*>(
+                    packet.payload())->client_id;
+
+            std::scoped_lock lock(m_mutex);
+            m_client_ids[m_captured_client_ids[pipe_idx]] = client_id;
+        }
+    }
+
+    // CAUTION: the handle is closed by close()
+}
+
+
+bool replay_pipes_t::remap_setup(proto::bytes_t& packet)
+{
+    constexpr auto offset = sizeof(proto::header_t);
+
+    proto::clientid_t captured_id;
+    std::memcpy(&captured_id, packet.data() + offset, sizeof(captured_id));
+    captured_id = proto::net2host(captured_id);
+
+    // the ack of the channel that got the client id assigned may not be read
+    // yet; this is rare enough to poll for it
+    const auto start = cix::hrticks_now();
+    proto::clientid_t client_id = proto::invalid_client_id;
+
+    for (;;)
+    {
+        {
+            std::scoped_lock lock(m_mutex);
+            const auto id_it = m_client_ids.find(captured_id);
+
+            if (id_it != m_client_ids.end())
+            {
+                client_id = proto::host2net(id_it->second);
+                break;
+            }
+        }
+
+        if (cix::hrticks_elapsed(start) >= remap_timeout)
+        {
+            fmt::print(
+                stderr, "client {:#x} never got set up, replay is stuck\n",
+                captured_id);
+            return false;
+        }
+
+        Sleep(1);
+    }
+
+    std::memcpy(packet.data() + offset, &client_id, sizeof(client_id));
+    proto::update_crc(packet, proto::crc_full);
+
+    return true;
+}
+
+
+
+//******************************************************************************
+
+
+
+options_t default_options()
+{
+    return options_t{std::wstring(), 1, 2};
+}
+
+
+bool parse_arg(std::wstring_view arg, options_t& options)
+{
+    static const std::pair<const wchar_t*, std::size_t options_t::*> args[] = {
+        { L"--speed=", &options_t::speed },
+        { L"--linger=", &options_t::linger },
+    };
+
+    const std::wstring_view file_prefix(L"--file=");
+
+    if (arg == L"--replay")
+        return true;
+
+    if (arg.compare(0, file_prefix.size(), file_prefix) == 0)
+    {
+        options.file = arg.substr(file_prefix.size());
+        return !options.file.empty();
+    }
+
+    for (const auto& [prefix, member] : args)
+    {
+        const std::wstring_view name(prefix);
+
+        if (arg.compare(0, name.size(), name) != 0)
+            continue;
+
+        const std::wstring value(arg.substr(name.size()));
+        wchar_t* end = nullptr;
+
+        errno = 0;
+        const auto number = std::wcstoull(value.c_str(), &end, 0);
+
+        if (value.empty() || !end || *end || errno != 0)
+            return false;
+
+        options.*member = static_cast<std::size_t>(number);
+        return true;
+    }
+
+    return false;
+}
+
+
+// sleeps until *stamp* of the capture timeline is due, returns how late it is
+static cix::hrticks_t wait_due(
+    cix::hrticks_t start, cix::hrticks_t stamp, std::size_t speed)
+{
+    if (speed == 0)
+        return 0;
+
+    const auto due = start + stamp / speed;
+
+    for (auto now = cix::hrticks_now(); ; now = cix::hrticks_now())
+    {
+        if (now >= due)
+            return now - due;
+
+        Sleep(static_cast<DWORD>(
+            std::min<cix::hrticks_t>(
+                (due - now) / cix::hrticks_millisecond, 100)));
+    }
+}
+
+
+exit_t run(const options_t& options, const config_t& config)
+{
+    if (options.file.empty())
+    {
+        fmt::print(stderr, "--file is required\n");
+        return APP_EXITCODE_ARG;
+    }
+
+    std::vector<detail::record_t> records;
+
+    if (!load_capture(options.file, records))
+        return APP_EXITCODE_ERROR;
+
+    replay_target_t target;
+    detail::plan_t plan;
+
+    if (!target.listen())
+    {
+        fmt::print(stderr, "failed to start replay target\n");
+        return APP_EXITCODE_API;
+    }
+
+    if (!planner_t(target.port()).build(records, plan))
+    {
+        fmt::print(stderr, "malformed or oversized capture\n");
+        return APP_EXITCODE_ERROR;
+    }
+
+    records.clear();
+    records.shrink_to_fit();
+
+    target.start(plan.sessions_count);
+
+    bench::service_host_t service;
+
+    const auto exit_code = service.start(config);
+    if (exit_code != APP_EXITCODE_OK)
+        return exit_code;
+
+    replay_pipes_t pipes(service.pipe_path(), plan.pipe_client_ids);
+    latency_histogram_t pipe_lag;
+    latency_histogram_t target_lag;
+    std::atomic<bool> failed{false};
+    const auto start = cix::hrticks_now();
+
+    std::thread target_thread([&]() {
+        CIX_THREAD_SET_NAME_STATIC(GetCurrentThreadId(), "replay[target]");
+
+        for (const auto& event : plan.target_events)
+        {
+            if (failed)
+                break;
+
+            target_lag.record(wait_due(start, event.stamp, options.speed));
+            target.play(event);
+        }
+    });
+
+    for (const auto& event : plan.pipe_events)
+    {
+        pipe_lag.record(wait_due(start, event.stamp, options.speed));
+
+        if (!pipes.play(event))
+        {
+            failed = true;
+            break;
+        }
+    }
+
+    target_thread.join();
+
+    const auto elapsed = cix::hrticks_elapsed(start);
+
+    Sleep(static_cast<DWORD>(options.linger * 1000));
+
+    pipes.close_all();
+    service.stop();
+    target.stop();
+
+    const auto captured =
+        static_cast<double>(plan.duration) /
+        static_cast<double>(cix::hrticks_second);
+    const auto replayed =
+        static_cast<double>(elapsed) / static_cast<double>(cix::hrticks_second);
+
+    fmt::print(
+        "{} pipe instances, {} SOCKS sessions ({} connected), "
+        "{} target records of unknown sessions\n"
+        "captured {:.1f} sec, replayed in {:.1f} sec (speed {})\n"
+        "pipes: {} bytes written, {} bytes read; targets: {} bytes sent\n",
+        plan.pipe_client_ids.size(), plan.sessions_count, target.connected(),
+        plan.unmatched_records, captured, replayed, options.speed,
+        pipes.bytes_written(), pipes.bytes_read(), target.bytes_sent());
+
+    for (const auto& [name, histogram] : {
+            std::make_pair("pipe", &pipe_lag),
+            std::make_pair("target", &target_lag) })
+    {
+        const auto summary = histogram->summary();
+
+        fmt::print(
+            "{} lag behind capture: p50 {}us, p90 {}us, p99 {}us, "
+            "p99.9 {}us, max {}us\n",
+            name, summary.p50, summary.p90, summary.p99, summary.p999,
+            summary.max);
+    }
+
+    return failed ? APP_EXITCODE_ERROR : APP_EXITCODE_OK;
+}
+
+}  // namespace replay
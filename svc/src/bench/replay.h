@@ -0,0 +1,27 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// Replay of a capture made with --capture, see replay.cpp
+//
+// usage: rpc2socks_bench --replay --file=CAPTURE [--speed=FACTOR]
+//                        [--linger=SECONDS] [service options...]
+namespace replay
+{
+    struct options_t
+    {
+        std::wstring file;
+
+        // time is divided by this factor; 0 replays as fast as possible
+        std::size_t speed;
+
+        // how long to let the service flush once everything got replayed
+        std::size_t linger;  // seconds
+    };
+
+    options_t default_options();
+    bool parse_arg(std::wstring_view arg, options_t& options);
+    exit_t run(const options_t& options, const config_t& config);
+}
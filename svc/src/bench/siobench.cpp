@@ -0,0 +1,721 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "../main.h"
+#include "common.h"
+#include "siobench.h"
+
+
+// Comparison of the engines of socketio
+//
+// * *pairs* connected loopback TCP socket pairs are registered, both ends,
+//   with a socketio instance of the engine under test; data goes one way per
+//   pair, sent to one end with socketio::send() and received from the other
+//   by listener_t::on_socketio_recv()
+// * a message is a header (its size, and the time it was sent) followed by
+//   filler bytes; it is either tiny or bulk, *bulk_ratio* percent of them
+//   being bulk, interleaved the same way on every run
+// * every pair keeps *depth* messages in flight: the next one is sent from the
+//   thread of the engine as soon as one got entirely received, so that the
+//   load follows what the engine can take
+// * every engine is run for every number of pairs, *duration* seconds each,
+//   with a socketio instance and sockets of its own
+// * reports, per case, the throughput (message bytes), the rate of the
+//   messages, their delivery latency, and the CPU time of the process per
+//   byte, and in cores (i.e. CPU time over wall time)
+//
+// CAUTION: a run with thousands of pairs needs as many ephemeral ports; they
+// are closed with a reset so that none lingers in TIME_WAIT between cases
+namespace siobench {
+
+namespace detail
+{
+    static const std::pair<const wchar_t*, socketio::engine_t> engines[] = {
+        { L"select", socketio::engine_select },
+        { L"event", socketio::engine_event },
+        { L"iocp", socketio::engine_iocp },
+        { L"rio", socketio::engine_rio },
+    };
+
+    static const wchar_t* engine_name(socketio::engine_t engine)
+    {
+        for (const auto& [name, value] : engines)
+        {
+            if (value == engine)
+                return name;
+        }
+
+        return L"?";
+    }
+
+    static std::uint64_t process_cpu_time()
+    {
+        FILETIME creation, exit, kernel, user;
+
+        if (!GetProcessTimes(
+                GetCurrentProcess(), &creation, &exit, &kernel, &user))
+        {
+            return 0;
+        }
+
+        // 100ns units
+        return
+            ((static_cast<std::uint64_t>(kernel.dwHighDateTime) << 32) |
+                kernel.dwLowDateTime) +
+            ((static_cast<std::uint64_t>(user.dwHighDateTime) << 32) |
+                user.dwLowDateTime);
+    }
+
+    static void close_abortively(SOCKET socket)
+    {
+        const linger opt{1, 0};
+
+        setsockopt(
+            socket, SOL_SOCKET, SO_LINGER,
+            reinterpret_cast<const char*>(&opt),
+            static_cast<int>(sizeof(opt)));
+        closesocket(socket);
+    }
+}
+
+
+
+//******************************************************************************
+
+
+
+// the socket pairs of a case, and the listener of its socketio instance
+class harness_t : public socketio::listener_t
+{
+public:
+    struct result_t
+    {
+        std::uint64_t bytes;     // of the messages received entirely
+        std::uint64_t messages;
+        std::uint64_t failures;  // send() refused, or pair disconnected
+    };
+
+public:
+    harness_t(
+        const options_t& options,
+        std::shared_ptr<socketio> sio,
+        latency_histogram_t& latency);
+    ~harness_t();
+
+    bool connect(std::size_t pairs_count, const config_t& config);
+    bool start();
+    void stop();
+
+    result_t result() const;
+
+private:
+    // u32 size of the message, u64 cix::hrticks_now() when it was sent
+    enum : std::size_t
+    {
+        header_size = 4 + 8,
+    };
+
+    struct pair_t
+    {
+        SOCKET tx{INVALID_SOCKET};  // socketio::send() end
+        SOCKET rx{INVALID_SOCKET};  // on_socketio_recv() end
+        std::size_t index{0};
+        std::atomic<std::uint64_t> sent{0};  // messages
+
+        // parsing of what *rx* receives; the engines call back for a given
+        // socket from one thread at a time
+        std::array<socketio::byte_t, header_size> header{};
+        std::size_t header_len{0};
+        std::size_t size{0};  // of the current message
+        std::size_t left{0};  // bytes of it not received yet
+        std::uint64_t stamp{0};
+    };
+
+private:
+    SOCKET make_socket(const config_t& config) const;
+    bool connect_pair(
+        SOCKET listen_socket,
+        const sockaddr_in& addr,
+        const config_t& config,
+        pair_t& pair);
+    bool send_message(pair_t& pair);
+
+    // socketio::listener_t
+    void on_socketio_recv(SOCKET socket, socketio::bytes_t&& packet);
+    void on_socketio_recvfrom(
+        SOCKET socket, std::vector<socketio::datagram_t>&& datagrams);
+    void on_socketio_disconnected(SOCKET socket);
+    void on_socketio_write_drained(SOCKET socket);
+
+private:
+    const options_t& m_options;
+    const std::shared_ptr<socketio> m_sio;
+    latency_histogram_t& m_latency;
+
+    // constant once connect() returned
+    std::vector<pair_t> m_pairs;
+    cix::flat_hash_map<SOCKET, std::size_t> m_rx_index;
+
+    std::atomic<bool> m_sending;
+    std::atomic<std::uint64_t> m_bytes;
+    std::atomic<std::uint64_t> m_messages;
+    std::atomic<std::uint64_t> m_failures;
+};
+
+
+harness_t::harness_t(
+        const options_t& options,
+        std::shared_ptr<socketio> sio,
+        latency_histogram_t& latency)
+    : m_options(options)
+    , m_sio(std::move(sio))
+    , m_latency(latency)
+    , m_sending{false}
+    , m_bytes{0}
+    , m_messages{0}
+    , m_failures{0}
+{
+}
+
+
+harness_t::~harness_t()
+{
+    this->stop();
+}
+
+
+bool harness_t::connect(std::size_t pairs_count, const config_t& config)
+{
+    // accepted sockets inherit the flags of the listening one, which matters
+    // to engine_rio
+    const auto listen_socket = this->make_socket(config);
+    if (listen_socket == INVALID_SOCKET)
+        return false;
+
+    sockaddr_in addr{};
+    int addr_len = static_cast<int>(sizeof(addr));
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+
+    if (0 != bind(
+            listen_socket, reinterpret_cast<const sockaddr*>(&addr),
+            static_cast<int>(sizeof(addr))) ||
+        0 != listen(listen_socket, SOMAXCONN) ||
+        0 != getsockname(
+            listen_socket, reinterpret_cast<sockaddr*>(&addr), &addr_len))
+    {
+        closesocket(listen_socket);
+        return false;
+    }
+
+    m_pairs = std::vector<pair_t>(pairs_count);
+
+    bool ok = true;
+
+    for (std::size_t idx = 0; ok && idx < m_pairs.size(); ++idx)
+    {
+        m_pairs[idx].index = idx;
+        ok = this->connect_pair(listen_socket, addr, config, m_pairs[idx]);
+
+        if (!ok)
+        {
+            fmt::print(
+                stderr, "pair #{} failed to connect (error {})\n",
+                idx + 1, WSAGetLastError());
+        }
+    }
+
+    closesocket(listen_socket);
+
+    if (!ok)
+        return false;
+
+    for (const auto& pair : m_pairs)
+        m_rx_index.insert(std::make_pair(pair.rx, pair.index));
+
+    for (const auto& pair : m_pairs)
+    {
+        m_sio->register_socket(pair.tx);
+        m_sio->register_socket(pair.rx);
+    }
+
+    return true;
+}
+
+
+bool harness_t::start()
+{
+    m_sending = true;
+
+    for (auto& pair : m_pairs)
+    {
+        for (std::size_t idx = 0; idx < m_options.depth; ++idx)
+        {
+            if (!this->send_message(pair))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+
+void harness_t::stop()
+{
+    // no callback from now on; the sockets are reset so that the engine is
+    // not left with data to send
+    m_sending = false;
+    m_sio->set_listener(nullptr);
+
+    for (auto& pair : m_pairs)
+    {
+        for (auto* socket : { &pair.tx, &pair.rx })
+        {
+            if (*socket == INVALID_SOCKET)
+                continue;
+
+            m_sio->unregister_socket(*socket);
+            detail::close_abortively(*socket);
+            *socket = INVALID_SOCKET;
+        }
+    }
+}
+
+
+harness_t::result_t harness_t::result() const
+{
+    return result_t{
+        m_bytes.load(std::memory_order_relaxed),
+        m_messages.load(std::memory_order_relaxed),
+        m_failures.load(std::memory_order_relaxed)};
+}
+
+
+SOCKET harness_t::make_socket(const config_t& config) const
+{
+    const auto socket = WSASocketW(
+        AF_INET, SOCK_STREAM, IPPROTO_TCP, nullptr, 0,
+        m_sio->socket_flags());
+
+    if (socket == INVALID_SOCKET)
+        return INVALID_SOCKET;
+
+    const BOOL nodelay = TRUE;
+    setsockopt(
+        socket, IPPROTO_TCP, TCP_NODELAY,
+        reinterpret_cast<const char*>(&nodelay),
+        static_cast<int>(sizeof(nodelay)));
+
+    // same as the sockets of socks_proxy
+    for (const auto& [option, value] : {
+            std::make_pair(SO_RCVBUF, config.socket_rcvbuf),
+            std::make_pair(SO_SNDBUF, config.socket_sndbuf) })
+    {
+        if (value == 0)
+            continue;
+
+        const int size = static_cast<int>(value);
+
+        setsockopt(
+            socket, SOL_SOCKET, option,
+            reinterpret_cast<const char*>(&size),
+            static_cast<int>(sizeof(size)));
+    }
+
+    return socket;
+}
+
+
+bool harness_t::connect_pair(
+    SOCKET listen_socket,
+    const sockaddr_in& addr,
+    const config_t& config,
+    pair_t& pair)
+{
+    // loopback connects complete as soon as they are in the backlog, so that
+    // one accept() per connect() keeps the backlog short
+    pair.tx = this->make_socket(config);
+    if (pair.tx == INVALID_SOCKET)
+        return false;
+
+    if (0 != ::connect(
+            pair.tx, reinterpret_cast<const sockaddr*>(&addr),
+            static_cast<int>(sizeof(addr))))
+    {
+        return false;
+    }
+
+    pair.rx = accept(listen_socket, nullptr, nullptr);
+
+    return pair.rx != INVALID_SOCKET;
+}
+
+
+bool harness_t::send_message(pair_t& pair)
+{
+    if (!m_sending)
+        return true;
+
+    const auto count = pair.sent.fetch_add(1, std::memory_order_relaxed);
+
+    // spread evenly, and differently from one pair to the other
+    const bool bulk =
+        ((count * 37) + pair.index) % 100 < m_options.bulk_ratio;
+    const auto size = bulk ? m_options.bulk : m_options.tiny;
+
+    socketio::bytes_t message(size);
+    const auto size32 = static_cast<std::uint32_t>(size);
+    const std::uint64_t stamp = cix::hrticks_now();
+
+    std::memcpy(message.data(), &size32, sizeof(size32));
+    std::memcpy(message.data() + sizeof(size32), &stamp, sizeof(stamp));
+
+    if (!m_sio->send(pair.tx, cix::shared_buffer(std::move(message))))
+    {
+        m_failures.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    return true;
+}
+
+
+void harness_t::on_socketio_recv(SOCKET socket, socketio::bytes_t&& packet)
+{
+    const auto it = m_rx_index.find(socket);
+    if (it == m_rx_index.end())
+        return;
+
+    auto& pair = m_pairs[it->second];
+    const auto* data = packet.data();
+    auto size = packet.size();
+
+    while (size > 0)
+    {
+        if (pair.header_len < header_size)
+        {
+            const auto len = std::min(size, header_size - pair.header_len);
+
+            std::memcpy(pair.header.data() + pair.header_len, data, len);
+            pair.header_len += len;
+            data += len;
+            size -= len;
+
+            if (pair.header_len < header_size)
+                break;
+
+            std::uint32_t message_size;
+
+            std::memcpy(&message_size, pair.header.data(), 4);
+            std::memcpy(&pair.stamp, pair.header.data() + 4, 8);
+
+            if (message_size < header_size)
+            {
+                // not supposed to happen, the stream is lost
+                m_failures.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+
+            pair.size = message_size;
+            pair.left = message_size - header_size;
+        }
+
+        const auto len = std::min(size, pair.left);
+
+        data += len;
+        size -= len;
+        pair.left -= len;
+
+        if (pair.left > 0)
+            break;
+
+        // received entirely
+        m_latency.record(cix::hrticks_elapsed(pair.stamp));
+        m_bytes.fetch_add(pair.size, std::memory_order_relaxed);
+        m_messages.fetch_add(1, std::memory_order_relaxed);
+        pair.header_len = 0;
+
+        this->send_message(pair);
+    }
+}
+
+
+void harness_t::on_socketio_recvfrom(
+    SOCKET socket, std::vector<socketio::datagram_t>&& datagrams)
+{
+    CIX_UNVAR(socket);
+    CIX_UNVAR(datagrams);
+}
+
+
+void harness_t::on_socketio_disconnected(SOCKET socket)
+{
+    CIX_UNVAR(socket);
+
+    if (m_sending)
+        m_failures.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+void harness_t::on_socketio_write_drained(SOCKET socket)
+{
+    CIX_UNVAR(socket);
+}
+
+
+
+//******************************************************************************
+
+
+
+options_t default_options()
+{
+    return options_t{
+        { socketio::engine_select, socketio::engine_event,
+            socketio::engine_iocp, socketio::engine_rio },
+        { 10, 100, 1000, 10000 },
+        64, 64 * 1024, 10, 1, 5 };
+}
+
+
+bool parse_arg(std::wstring_view arg, options_t& options)
+{
+    static const struct
+    {
+        const wchar_t* prefix;
+        std::size_t options_t::* member;
+        bool zero_allowed;
+    }
+    args[] = {
+        { L"--tiny=", &options_t::tiny, false },
+        { L"--bulk=", &options_t::bulk, false },
+        { L"--bulk-ratio=", &options_t::bulk_ratio, true },
+        { L"--depth=", &options_t::depth, false },
+        { L"--duration=", &options_t::duration, false },
+    };
+
+    const std::wstring_view engines_prefix(L"--engines=");
+    const std::wstring_view pairs_prefix(L"--pairs=");
+
+    if (arg == L"--socketio")
+        return true;
+
+    if (arg.compare(0, engines_prefix.size(), engines_prefix) == 0)
+    {
+        auto value = arg.substr(engines_prefix.size());
+
+        options.engines.clear();
+
+        while (!value.empty())
+        {
+            const auto comma = value.find(L',');
+            const auto item = value.substr(0, comma);
+            bool found = false;
+
+            for (const auto& [name, engine] : detail::engines)
+            {
+                if (item == name)
+                {
+                    options.engines.push_back(engine);
+                    found = true;
+                    break;
+                }
+            }
+
+            if (!found)
+                return false;
+
+            if (comma == std::wstring_view::npos)
+                break;
+
+            value.remove_prefix(comma + 1);
+        }
+
+        return !options.engines.empty();
+    }
+
+    if (arg.compare(0, pairs_prefix.size(), pairs_prefix) == 0)
+    {
+        auto value = arg.substr(pairs_prefix.size());
+
+        options.pairs.clear();
+
+        while (!value.empty())
+        {
+            const auto comma = value.find(L',');
+            const std::wstring item(value.substr(0, comma));
+            wchar_t* end = nullptr;
+
+            errno = 0;
+            const auto number = std::wcstoull(item.c_str(), &end, 0);
+
+            if (item.empty() || !end || *end || errno != 0 || number == 0)
+                return false;
+
+            options.pairs.push_back(static_cast<std::size_t>(number));
+
+            if (comma == std::wstring_view::npos)
+                break;
+
+            value.remove_prefix(comma + 1);
+        }
+
+        return !options.pairs.empty();
+    }
+
+    for (const auto& [prefix, member, zero_allowed] : args)
+    {
+        const std::wstring_view name(prefix);
+
+        if (arg.compare(0, name.size(), name) != 0)
+            continue;
+
+        const std::wstring value(arg.substr(name.size()));
+        wchar_t* end = nullptr;
+
+        errno = 0;
+        const auto number = std::wcstoull(value.c_str(), &end, 0);
+
+        if (value.empty() || !end || *end || errno != 0 ||
+            (number == 0 && !zero_allowed))
+        {
+            return false;
+        }
+
+        options.*member = static_cast<std::size_t>(number);
+        return true;
+    }
+
+    return false;
+}
+
+
+static bool run_case(
+    const options_t& options,
+    const config_t& config,
+    socketio::engine_t engine,
+    std::size_t pairs_count)
+{
+    auto sio = std::make_shared<socketio>(engine);
+
+    // e.g. no RIO on this host
+    if (sio->engine() != engine)
+    {
+        fmt::print(
+            L"{:<7} {:>6}  engine not available\n",
+            detail::engine_name(engine), pairs_count);
+        return true;
+    }
+
+    const auto stop_event = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!stop_event)
+        return false;
+
+    latency_histogram_t latency;
+    auto harness = std::make_shared<harness_t>(options, sio, latency);
+
+    sio->set_stop_event(stop_event);
+    sio->set_listener(harness);
+    sio->set_input_buffer_size(config.socket_input_buffer_size);
+    sio->launch();
+
+    bool ok = harness->connect(pairs_count, config);
+
+    const auto cpu = detail::process_cpu_time();
+    const auto start = cix::hrticks_now();
+
+    if (ok)
+    {
+        ok = harness->start();
+
+        if (ok)
+        {
+            Sleep(static_cast<DWORD>(options.duration * 1000));
+        }
+        else
+        {
+            fmt::print(stderr, "failed to send first messages\n");
+        }
+    }
+
+    // before sockets get closed, on which the engine burns CPU too
+    const auto result = harness->result();
+    const auto cpu_time = detail::process_cpu_time() - cpu;  // 100ns units
+    const auto seconds =
+        static_cast<double>(cix::hrticks_elapsed(start)) /
+        static_cast<double>(cix::hrticks_second);
+
+    harness->stop();
+    SetEvent(stop_event);
+    sio->join();
+    CloseHandle(stop_event);
+
+    if (!ok)
+        return false;
+
+    if (result.failures > 0)
+    {
+        fmt::print(
+            stderr, L"{} pairs: {} failures\n",
+            detail::engine_name(engine), result.failures);
+        return false;
+    }
+
+    const auto summary = latency.summary();
+    const auto bytes = static_cast<double>(
+        std::max<std::uint64_t>(result.bytes, 1));
+
+    fmt::print(
+        L"{:<7} {:>6} {:>10.2f} {:>12.0f} {:>9} {:>9} {:>10.2f} {:>6.2f}\n",
+        detail::engine_name(engine), pairs_count,
+        static_cast<double>(result.bytes) / seconds / 1e6,
+        static_cast<double>(result.messages) / seconds,
+        summary.p50, summary.p99,
+        static_cast<double>(cpu_time) * 100.0 / bytes,
+        static_cast<double>(cpu_time) / 1e7 / seconds);
+
+    return true;
+}
+
+
+exit_t run(const options_t& options, const config_t& config)
+{
+    // see harness_t::header_size
+    if (options.tiny < 12 || options.bulk < 12)
+    {
+        fmt::print(stderr, "messages must be at least 12 bytes\n");
+        return APP_EXITCODE_ARG;
+    }
+
+    if (options.bulk_ratio > 100)
+    {
+        fmt::print(stderr, "bulk ratio is a percentage\n");
+        return APP_EXITCODE_ARG;
+    }
+
+    fmt::print(
+        "tiny {} bytes, bulk {} bytes ({}%), {} in flight per pair, "
+        "{} sec per case\n"
+        "{:<7} {:>6} {:>10} {:>12} {:>9} {:>9} {:>10} {:>6}\n",
+        options.tiny, options.bulk, options.bulk_ratio, options.depth,
+        options.duration,
+        "engine", "pairs", "MB/s", "messages/s", "p50 us", "p99 us",
+        "cpu ns/B", "cores");
+
+    bool failed = false;
+
+    for (const auto engine : options.engines)
+    {
+        for (const auto pairs_count : options.pairs)
+        {
+            if (!run_case(options, config, engine, pairs_count))
+                failed = true;
+        }
+    }
+
+    return failed ? APP_EXITCODE_ERROR : APP_EXITCODE_OK;
+}
+
+}  // namespace siobench
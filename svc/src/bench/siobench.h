@@ -0,0 +1,33 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// Comparison of the engines of socketio on loopback socket pairs, see
+// siobench.cpp
+//
+// usage: rpc2socks_bench --socketio [--engines=select,event,iocp,rio]
+//                        [--pairs=N,...] [--tiny=BYTES] [--bulk=BYTES]
+//                        [--bulk-ratio=PERCENT] [--depth=N]
+//                        [--duration=SECONDS] [service options...]
+namespace siobench
+{
+    struct options_t
+    {
+        std::vector<socketio::engine_t> engines;
+        std::vector<std::size_t> pairs;  // socket pairs, one case each
+
+        // messages, sizes include their header (see siobench.cpp)
+        std::size_t tiny;        // bytes
+        std::size_t bulk;        // bytes
+        std::size_t bulk_ratio;  // percentage of the messages that are bulk
+
+        std::size_t depth;     // messages in flight per pair
+        std::size_t duration;  // seconds per case
+    };
+
+    options_t default_options();
+    bool parse_arg(std::wstring_view arg, options_t& options);
+    exit_t run(const options_t& options, const config_t& config);
+}
@@ -0,0 +1,727 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "../main.h"
+#include "common.h"
+#include "storm.h"
+
+
+// Connection storm: SOCKS CONNECTs at a given rate
+//
+// * CONNECTs are paced at *rate* per second, spread over *clients* proto
+//   clients, each with a sender thread and a receiver thread
+// * targets are a mix of reachable ones (a local sink that accepts and holds
+//   connections), refused ones (a local port bound but not listening), and
+//   blackholed ones (192.0.2.1, from TEST-NET-1, that is not supposed to
+//   answer so that the service has to time out)
+// * target kinds are picked randomly according to their weights, from a fixed
+//   seed so that two runs send the same sequence
+// * established sessions are kept open until the end of the run, so that the
+//   peak of established sessions gives the session capacity of the service
+// * reports, by kind of target, the outcome of the CONNECTs and the
+//   distribution of the latency of their replies
+namespace storm {
+
+namespace detail
+{
+    enum target_t : std::size_t
+    {
+        target_reachable = 0,
+        target_refused,
+        target_blackholed,
+
+        targets_count,
+    };
+
+    static const char* const target_names[targets_count] = {
+        "reachable", "refused", "blackholed" };
+
+    // 192.0.2.1
+    static constexpr std::uint32_t blackhole_addr = 0xc0000201;
+    static constexpr unsigned short blackhole_port = 9;
+
+
+    struct target_stats_t
+    {
+        std::atomic<std::uint64_t> sent{0};
+        std::atomic<std::uint64_t> succeeded{0};
+        std::atomic<std::uint64_t> failed{0};     // error reply
+        std::atomic<std::uint64_t> no_reply{0};   // closed before replying
+        latency_histogram_t latency;              // of the replies
+    };
+
+
+    struct stats_t
+    {
+        std::array<target_stats_t, targets_count> targets;
+        std::atomic<std::uint64_t> established{0};
+        std::atomic<std::uint64_t> established_peak{0};
+        std::atomic<std::uint64_t> closed_after_success{0};
+    };
+
+
+    struct target_addrs_t
+    {
+        std::array<proto::bytes_t, targets_count> handshakes;
+    };
+}
+
+
+
+//******************************************************************************
+
+
+
+// accepts any number of connections on 127.0.0.1 and holds them, without
+// ever reading nor writing
+class hold_sink_t
+{
+public:
+    hold_sink_t();
+    ~hold_sink_t();
+
+    bool start();
+    void stop();
+
+    unsigned short port() const;
+
+private:
+    void accept_thread();
+
+private:
+    SOCKET m_listen;
+    unsigned short m_port;
+    std::unique_ptr<std::thread> m_thread;
+    std::vector<SOCKET> m_conns;  // accept thread only, until stop()
+};
+
+
+hold_sink_t::hold_sink_t()
+    : m_listen{INVALID_SOCKET}
+    , m_port{0}
+{
+}
+
+
+hold_sink_t::~hold_sink_t()
+{
+    this->stop();
+}
+
+
+bool hold_sink_t::start()
+{
+    sockaddr_in addr{};
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+
+    m_listen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (m_listen == INVALID_SOCKET)
+        return false;
+
+    int addr_len = static_cast<int>(sizeof(addr));
+
+    if (0 != bind(
+            m_listen, reinterpret_cast<const sockaddr*>(&addr),
+            static_cast<int>(sizeof(addr))) ||
+        0 != listen(m_listen, SOMAXCONN) ||
+        0 != getsockname(
+            m_listen, reinterpret_cast<sockaddr*>(&addr), &addr_len))
+    {
+        closesocket(m_listen);
+        m_listen = INVALID_SOCKET;
+        return false;
+    }
+
+    m_port = ntohs(addr.sin_port);
+    m_thread = std::make_unique<std::thread>(
+        &hold_sink_t::accept_thread, this);
+
+    return true;
+}
+
+
+void hold_sink_t::stop()
+{
+    // accept() fails once the socket is closed
+    if (m_listen != INVALID_SOCKET)
+    {
+        closesocket(m_listen);
+        m_listen = INVALID_SOCKET;
+    }
+
+    if (m_thread)
+    {
+        m_thread->join();
+        m_thread.reset();
+    }
+
+    for (const auto conn : m_conns)
+        closesocket(conn);
+
+    m_conns.clear();
+}
+
+
+unsigned short hold_sink_t::port() const
+{
+    return m_port;
+}
+
+
+void hold_sink_t::accept_thread()
+{
+    CIX_THREAD_SET_NAME_STATIC(GetCurrentThreadId(), "storm[accept]");
+
+    for (;;)
+    {
+        const auto conn = accept(m_listen, nullptr, nullptr);
+        if (conn == INVALID_SOCKET)
+            break;
+
+        m_conns.push_back(conn);
+    }
+}
+
+
+
+//******************************************************************************
+
+
+
+// a proto client and its share of the CONNECTs; send_thread() and
+// recv_thread() are to be run concurrently
+class client_t
+{
+public:
+    client_t(
+        const options_t& options,
+        const detail::target_addrs_t& targets,
+        detail::stats_t& stats,
+        proto::socksid_t first_socks_id,
+        std::size_t sessions_count,
+        std::uint64_t seed);
+    ~client_t() = default;
+
+    bool connect(const std::wstring& pipe_path);
+
+    bool send_thread(cix::hrticks_t start, cix::hrticks_t interval);
+    // *deadline* is 0 until all the CONNECTs got sent
+    bool recv_thread(const std::atomic<cix::hrticks_t>& deadline);
+
+    std::size_t pending() const;
+
+private:
+    struct session_t
+    {
+        detail::target_t target;
+        std::atomic<cix::hrticks_t> sent;  // 0 until sent
+        std::size_t reply_left;            // bytes of reply still expected
+        proto::byte_t reply_code;
+        bool replied;
+        bool closed;
+    };
+
+private:
+    bool handle_packet(const proto::packet_view_t& packet, cix::hrticks_t now);
+    static void handle_reply(
+        session_t& session, const proto::byte_t* data, std::size_t size);
+
+private:
+    const detail::target_addrs_t& m_targets;
+    detail::stats_t& m_stats;
+    const proto::socksid_t m_first_socks_id;
+    const std::size_t m_sessions_count;
+    std::unique_ptr<session_t[]> m_sessions;
+    std::size_t m_pending;  // recv thread only
+
+    bench::channels_t m_channels;
+};
+
+
+client_t::client_t(
+        const options_t& options,
+        const detail::target_addrs_t& targets,
+        detail::stats_t& stats,
+        proto::socksid_t first_socks_id,
+        std::size_t sessions_count,
+        std::uint64_t seed)
+    : m_targets(targets)
+    , m_stats(stats)
+    , m_first_socks_id{first_socks_id}
+    , m_sessions_count{sessions_count}
+    , m_sessions{std::make_unique<session_t[]>(sessions_count)}
+    , m_pending{sessions_count}
+{
+    const auto weights_sum =
+        options.reachable + options.refused + options.blackholed;
+    cix::random::fast gen(seed, ~seed);
+
+    for (std::size_t idx = 0; idx < sessions_count; ++idx)
+    {
+        auto& session = m_sessions[idx];
+        const auto pick = gen.next64() % weights_sum;
+
+        session.target =
+            (pick < options.reachable) ? detail::target_reachable :
+            (pick < options.reachable + options.refused) ?
+                detail::target_refused :
+                detail::target_blackholed;
+        session.sent = 0;
+        session.reply_left = bench::socks_handshake_reply_size;
+        session.reply_code = 0;
+        session.replied = false;
+        session.closed = false;
+    }
+}
+
+
+bool client_t::connect(const std::wstring& pipe_path)
+{
+    return m_channels.connect(pipe_path);
+}
+
+
+bool client_t::send_thread(cix::hrticks_t start, cix::hrticks_t interval)
+{
+    CIX_THREAD_SET_NAME_STATIC(GetCurrentThreadId(), "storm[send]");
+
+    for (std::size_t idx = 0; idx < m_sessions_count; ++idx)
+    {
+        const auto due = start + idx * interval;
+
+        // Sleep() is too coarse for a high rate, so CONNECTs that got late
+        // are sent in a burst
+        for (auto now = cix::hrticks_now(); now < due;
+            now = cix::hrticks_now())
+        {
+            Sleep(static_cast<DWORD>(
+                std::min<cix::hrticks_t>(
+                    (due - now) / cix::hrticks_millisecond, 100)));
+        }
+
+        auto& session = m_sessions[idx];
+
+        ++m_stats.targets[session.target].sent;
+        session.sent.store(cix::hrticks_now(), std::memory_order_release);
+
+        if (!m_channels.write(
+                proto::make_socks(
+                    m_first_socks_id + idx,
+                    m_targets.handshakes[session.target])))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+bool client_t::recv_thread(const std::atomic<cix::hrticks_t>& deadline)
+{
+    CIX_THREAD_SET_NAME_STATIC(GetCurrentThreadId(), "storm[recv]");
+
+    while (m_pending > 0)
+    {
+        const auto deadline_value = deadline.load();
+
+        if (deadline_value != 0 && cix::hrticks_now() >= deadline_value)
+            break;
+
+        if (!m_channels.receive(100))
+            return false;
+
+        const auto now = cix::hrticks_now();
+
+        for (;;)
+        {
+            proto::packet_view_t packet;
+
+            const auto error = m_channels.next_packet(packet);
+
+            if (error == proto::error_incomplete)
+                break;
+
+            if (error != proto::ok || !this->handle_packet(packet, now))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+
+std::size_t client_t::pending() const
+{
+    return m_pending;
+}
+
+
+bool client_t::handle_packet(
+    const proto::packet_view_t& packet, cix::hrticks_t now)
+{
+    switch (packet.header->opcode)
+    {
+        case proto::op_socks:
+        case proto::op_socks_close:
+        case proto::op_socks_disconnected:
+            break;
+
+        default:
+            return true;  // not of interest
+    }
+
+    const auto socks_id =
+        reinterpret_cast<const proto::payload_socks_header_t*>(
+            packet.payload())->socks_id;
+
+    if (socks_id < m_first_socks_id ||
+        socks_id - m_first_socks_id >= m_sessions_count)
+    {
+        return false;
+    }
+
+    auto& session = m_sessions[socks_id - m_first_socks_id];
+    auto& stats = m_stats.targets[session.target];
+
+    if (session.closed)
+        return true;
+
+    if (packet.header->opcode != proto::op_socks)
+    {
+        session.closed = true;
+
+        if (!session.replied)
+        {
+            --m_pending;
+            ++stats.no_reply;
+        }
+        else if (session.reply_code == 0)
+        {
+            --m_stats.established;
+            ++m_stats.closed_after_success;
+        }
+
+        return true;
+    }
+
+    if (session.replied)
+        return true;  // not supposed to happen, the sink does not write
+
+    client_t::handle_reply(
+        session,
+        packet.payload() + sizeof(proto::payload_socks_header_t),
+        packet.payload_size() - sizeof(proto::payload_socks_header_t));
+
+    if (session.reply_left > 0)
+        return true;
+
+    --m_pending;
+    session.replied = true;
+
+    stats.latency.record(cix::hrticks_elapsed(
+        session.sent.load(std::memory_order_acquire), now));
+
+    if (session.reply_code != 0)
+    {
+        ++stats.failed;
+        return true;
+    }
+
+    ++stats.succeeded;
+
+    const auto established = ++m_stats.established;
+    auto peak = m_stats.established_peak.load();
+
+    while (peak < established &&
+        !m_stats.established_peak.compare_exchange_weak(peak, established))
+    { }
+
+    return true;
+}
+
+
+// the reply may be split over several packets, only its length and its code
+// are of interest here
+void client_t::handle_reply(
+    session_t& session, const proto::byte_t* data, std::size_t size)
+{
+    const auto received =
+        bench::socks_handshake_reply_size - session.reply_left;
+    const auto consumed = std::min(size, session.reply_left);
+
+    if (received <= bench::socks_handshake_reply_code_offset &&
+        received + consumed > bench::socks_handshake_reply_code_offset)
+    {
+        session.reply_code =
+            data[bench::socks_handshake_reply_code_offset - received];
+    }
+
+    session.reply_left -= consumed;
+}
+
+
+
+//******************************************************************************
+
+
+
+options_t default_options()
+{
+    return options_t{1000, 10000, 4, 90, 5, 5, 10, std::wstring()};
+}
+
+
+bool parse_arg(std::wstring_view arg, options_t& options)
+{
+    static const struct
+    {
+        const wchar_t* prefix;
+        std::size_t options_t::* member;
+        bool zero_allowed;
+    }
+    args[] = {
+        { L"--rate=", &options_t::rate, false },
+        { L"--count=", &options_t::count, false },
+        { L"--clients=", &options_t::clients, false },
+        { L"--reachable=", &options_t::reachable, true },
+        { L"--refused=", &options_t::refused, true },
+        { L"--blackholed=", &options_t::blackholed, true },
+        { L"--linger=", &options_t::linger, true },
+    };
+
+    const std::wstring_view pipe_prefix(L"--pipe=");
+
+    if (arg == L"--storm")
+        return true;
+
+    if (arg.compare(0, pipe_prefix.size(), pipe_prefix) == 0)
+    {
+        options.pipe = arg.substr(pipe_prefix.size());
+        return !options.pipe.empty();
+    }
+
+    for (const auto& [prefix, member, zero_allowed] : args)
+    {
+        const std::wstring_view name(prefix);
+
+        if (arg.compare(0, name.size(), name) != 0)
+            continue;
+
+        const std::wstring value(arg.substr(name.size()));
+        wchar_t* end = nullptr;
+
+        errno = 0;
+        const auto number = std::wcstoull(value.c_str(), &end, 0);
+
+        if (value.empty() || !end || *end || errno != 0 ||
+            (number == 0 && !zero_allowed))
+        {
+            return false;
+        }
+
+        options.*member = static_cast<std::size_t>(number);
+        return true;
+    }
+
+    return false;
+}
+
+
+exit_t run(const options_t& options, const config_t& config)
+{
+    if (options.reachable + options.refused + options.blackholed == 0)
+    {
+        fmt::print(stderr, "all target weights are null\n");
+        return APP_EXITCODE_ARG;
+    }
+
+    hold_sink_t sink;
+    if (!sink.start())
+    {
+        fmt::print(stderr, "failed to start sink\n");
+        return APP_EXITCODE_API;
+    }
+
+    // a port that is bound but does not listen, for the refused targets
+    const auto refusing = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    sockaddr_in refusing_addr{};
+    int refusing_addr_len = static_cast<int>(sizeof(refusing_addr));
+
+    refusing_addr.sin_family = AF_INET;
+    refusing_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (refusing == INVALID_SOCKET ||
+        0 != bind(
+            refusing, reinterpret_cast<const sockaddr*>(&refusing_addr),
+            static_cast<int>(sizeof(refusing_addr))) ||
+        0 != getsockname(
+            refusing, reinterpret_cast<sockaddr*>(&refusing_addr),
+            &refusing_addr_len))
+    {
+        if (refusing != INVALID_SOCKET)
+            closesocket(refusing);
+
+        fmt::print(stderr, "failed to bind a refusing port\n");
+        return APP_EXITCODE_API;
+    }
+
+    detail::target_addrs_t targets;
+
+    targets.handshakes[detail::target_reachable] =
+        bench::make_socks_handshake(INADDR_LOOPBACK, sink.port());
+    targets.handshakes[detail::target_refused] =
+        bench::make_socks_handshake(
+            INADDR_LOOPBACK, ntohs(refusing_addr.sin_port));
+    targets.handshakes[detail::target_blackholed] =
+        bench::make_socks_handshake(
+            detail::blackhole_addr, detail::blackhole_port);
+
+    bench::service_host_t service;
+    auto pipe_path = L"\\\\.\\pipe\\" + options.pipe;
+
+    if (options.pipe.empty())
+    {
+        const auto exit_code = service.start(config);
+        if (exit_code != APP_EXITCODE_OK)
+        {
+            closesocket(refusing);
+            return exit_code;
+        }
+
+        pipe_path = service.pipe_path();
+    }
+
+    detail::stats_t stats;
+    std::vector<std::unique_ptr<client_t>> clients;
+    proto::socksid_t next_socks_id = 1;
+    bool ok = true;
+
+    for (std::size_t idx = 0; ok && idx < options.clients; ++idx)
+    {
+        const auto sessions_count =
+            (options.count / options.clients) +
+            (idx < options.count % options.clients ? 1 : 0);
+
+        if (sessions_count == 0)
+            break;
+
+        auto client = std::make_unique<client_t>(
+            options, targets, stats, next_socks_id, sessions_count, idx + 1);
+
+        if (!client->connect(pipe_path))
+        {
+            fmt::print(stderr, "client #{} failed to connect\n", idx + 1);
+            ok = false;
+        }
+
+        next_socks_id += sessions_count;
+        clients.push_back(std::move(client));
+    }
+
+    std::atomic<std::size_t> failures{0};
+    std::size_t pending = 0;
+    cix::hrticks_t sending_time = 0;
+
+    if (ok)
+    {
+        // each client sends every *interval* so that the overall rate is met;
+        // clients are shifted from each other to spread the CONNECTs evenly
+        const auto interval = std::max<cix::hrticks_t>(
+            1, cix::hrticks_second * clients.size() / options.rate);
+        const auto start = cix::hrticks_now();
+        std::atomic<cix::hrticks_t> deadline{0};
+        std::vector<std::thread> send_threads;
+        std::vector<std::thread> recv_threads;
+
+        for (std::size_t idx = 0; idx < clients.size(); ++idx)
+        {
+            auto* const client = clients[idx].get();
+            const auto client_start = start + idx * interval / clients.size();
+
+            send_threads.emplace_back(
+                [client, client_start, interval, &failures]() {
+                    if (!client->send_thread(client_start, interval))
+                        ++failures;
+                });
+
+            recv_threads.emplace_back(
+                [client, &deadline, &failures]() {
+                    if (!client->recv_thread(deadline))
+                        ++failures;
+                });
+        }
+
+        for (auto& thread : send_threads)
+            thread.join();
+
+        sending_time = cix::hrticks_elapsed(start);
+        deadline = cix::hrticks_now() + options.linger * cix::hrticks_second;
+
+        for (auto& thread : recv_threads)
+            thread.join();
+
+        for (const auto& client : clients)
+            pending += client->pending();
+    }
+
+    const auto established = stats.established.load();
+
+    clients.clear();
+    service.stop();
+    sink.stop();
+    closesocket(refusing);
+
+    if (!ok)
+        return APP_EXITCODE_ERROR;
+
+    const auto seconds =
+        static_cast<double>(sending_time) /
+        static_cast<double>(cix::hrticks_second);
+
+    fmt::print(
+        "{} CONNECTs over {} clients in {:.1f} sec, {:.0f}/s "
+        "(asked for {}/s), {} without a reply after {} sec\n",
+        options.count, options.clients, seconds,
+        static_cast<double>(options.count) / seconds, options.rate,
+        pending, options.linger);
+
+    fmt::print(
+        "{:<12} {:>8} {:>8} {:>8} {:>8}  reply latency (us): "
+        "{:>8} {:>8} {:>8} {:>8} {:>9}\n",
+        "target", "sent", "ok", "failed", "closed",
+        "p50", "p90", "p99", "p99.9", "max");
+
+    for (std::size_t idx = 0; idx < detail::targets_count; ++idx)
+    {
+        const auto& target = stats.targets[idx];
+        const auto summary = target.latency.summary();
+
+        fmt::print(
+            "{:<12} {:>8} {:>8} {:>8} {:>8}                      "
+            "{:>8} {:>8} {:>8} {:>8} {:>9}\n",
+            detail::target_names[idx], target.sent.load(),
+            target.succeeded.load(), target.failed.load(),
+            target.no_reply.load(),
+            summary.p50, summary.p90, summary.p99, summary.p999, summary.max);
+    }
+
+    fmt::print(
+        "established sessions: peak {}, {} at the end, {} closed by the "
+        "service\n",
+        stats.established_peak.load(), established,
+        stats.closed_after_success.load());
+
+    if (failures > 0)
+    {
+        fmt::print(stderr, "{} client threads failed\n", failures.load());
+        return APP_EXITCODE_ERROR;
+    }
+
+    return APP_EXITCODE_OK;
+}
+
+}  // namespace storm
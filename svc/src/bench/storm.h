@@ -0,0 +1,38 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// Connection storm: SOCKS CONNECTs at a given rate, see storm.cpp
+//
+// usage: rpc2socks_bench --storm [--rate=PER_SECOND] [--count=N]
+//                        [--clients=N] [--reachable=WEIGHT]
+//                        [--refused=WEIGHT] [--blackholed=WEIGHT]
+//                        [--linger=SECONDS] [--pipe=NAME]
+//                        [service options...]
+namespace storm
+{
+    struct options_t
+    {
+        std::size_t rate;     // CONNECTs per second, across all clients
+        std::size_t count;    // CONNECTs overall
+        std::size_t clients;  // proto clients the CONNECTs are spread over
+
+        // relative weights of the kinds of targets
+        std::size_t reachable;
+        std::size_t refused;
+        std::size_t blackholed;
+
+        // how long to wait for pending replies once the last CONNECT is sent
+        std::size_t linger;  // seconds
+
+        // name of the pipe of a running service; the service is run
+        // in-process if empty
+        std::wstring pipe;
+    };
+
+    options_t default_options();
+    bool parse_arg(std::wstring_view arg, options_t& options);
+    exit_t run(const options_t& options, const config_t& config);
+}
@@ -0,0 +1,112 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "main.h"
+
+namespace capture {
+
+namespace detail
+{
+    enum : std::size_t { file_buffer_size = 1024 * 1024 };
+
+    std::atomic<bool> enabled{false};
+
+    static std::mutex mutex;
+    static std::FILE* file = nullptr;  // protected by *mutex*
+    static cix::hrticks_t start_stamp = 0;
+}
+
+
+bool start(const std::wstring& path)
+{
+    std::scoped_lock lock(detail::mutex);
+
+    if (detail::file)
+        return false;
+
+    detail::file = _wfopen(path.c_str(), L"wb");
+    if (!detail::file)
+    {
+        LOGERROR(L"failed to create capture file {} (errno {})", path, errno);
+        return false;
+    }
+
+    std::setvbuf(detail::file, nullptr, _IOFBF, detail::file_buffer_size);
+
+    file_header_t header{};
+    FILETIME now;
+
+    GetSystemTimeAsFileTime(&now);
+
+    header.magic = capture::magic;
+    header.version = cix::native_to_little(capture::version);
+    header.start_time = cix::native_to_little(
+        (std::uint64_t(now.dwHighDateTime) << 32) | now.dwLowDateTime);
+
+    if (1 != std::fwrite(&header, sizeof(header), 1, detail::file))
+    {
+        LOGERROR(L"failed to write capture file {}", path);
+        std::fclose(detail::file);
+        detail::file = nullptr;
+        return false;
+    }
+
+    detail::start_stamp = cix::hrticks_now();
+    detail::enabled.store(true, std::memory_order_relaxed);
+
+    LOGINFO(L"capturing traffic to {}", path);
+
+    return true;
+}
+
+
+void stop()
+{
+    std::scoped_lock lock(detail::mutex);
+
+    detail::enabled.store(false, std::memory_order_relaxed);
+
+    if (detail::file)
+    {
+        std::fclose(detail::file);
+        detail::file = nullptr;
+    }
+}
+
+
+void record(kind_t kind, std::uint64_t id, const void* data, std::size_t size)
+{
+    if (!capture::is_enabled())
+        return;
+
+    assert(size <= std::numeric_limits<std::uint32_t>::max());
+    assert(data || size == 0);
+
+    record_header_t header{};
+
+    header.id = cix::native_to_little(id);
+    header.size = cix::native_to_little(static_cast<std::uint32_t>(size));
+    header.kind = kind;
+
+    std::scoped_lock lock(detail::mutex);
+
+    // stopped in the meantime
+    if (!detail::file)
+        return;
+
+    // stamped with the lock held so that records are in chronological order
+    header.stamp = cix::native_to_little(
+        cix::hrticks_elapsed(detail::start_stamp));
+
+    if (1 != std::fwrite(&header, sizeof(header), 1, detail::file) ||
+        (size > 0 && 1 != std::fwrite(data, size, 1, detail::file)))
+    {
+        // disk full or the like, a truncated capture is still usable
+        LOGERROR("failed to write capture file, capture stopped");
+        detail::enabled.store(false, std::memory_order_relaxed);
+        std::fclose(detail::file);
+        detail::file = nullptr;
+    }
+}
+
+}  // namespace capture
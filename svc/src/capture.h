@@ -0,0 +1,89 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// Capture of the traffic of the service, for offline replay (see the --replay
+// mode of rpc2socks_bench)
+//
+// * enabled by the --capture=<path> command line option; the file is
+//   overwritten
+// * records what on_transport_recv() got from the channels (pipe or TCP), and
+//   what the SOCKS targets sent, each with a timestamp; what the service
+//   writes is not recorded, it is what a replay reproduces
+// * also records what a replay needs to map things together: the client id
+//   assigned at channel setup and the SOCKS id a socks_proxy token stands for
+// * record() takes a lock and writes to a buffered file, so the capture slows
+//   the service down a bit; when not capturing it costs the test of a flag
+//
+// File format, all integers are little-endian:
+// * file_header_t
+// * then any number of records, each made of a record_header_t immediately
+//   followed by *size* bytes of data
+namespace capture
+{
+    enum kind_t : std::uint8_t
+    {
+        kind_pipe_recv = 1,      // id: pipe token; data: as received
+        kind_pipe_closed = 2,    // id: pipe token
+        kind_channel_setup = 3,  // id: pipe token; data: client id (u64)
+        kind_socks_mapped = 4,   // id: socks token; data: client id, socks id
+        kind_target_recv = 5,    // id: socks token; data: as received
+        kind_target_closed = 6,  // id: socks token
+    };
+
+    static constexpr std::array<char, 8> magic = {
+        'R', '2', 'S', 'C', 'A', 'P', '\r', '\n' };
+
+    enum : std::uint32_t { version = 1 };
+
+#pragma pack(push, 1)
+    struct file_header_t
+    {
+        std::array<char, 8> magic;
+        std::uint32_t version;
+        std::uint32_t reserved;
+        std::uint64_t start_time;  // FILETIME (UTC) of the first record
+    };
+    static_assert(sizeof(file_header_t) == 24, "size mismatch");
+
+    struct record_header_t
+    {
+        std::uint64_t stamp;  // microseconds since the start of the capture
+        std::uint64_t id;
+        std::uint32_t size;   // of the data that follows
+        kind_t kind;
+        std::uint8_t reserved[3];
+    };
+    static_assert(sizeof(record_header_t) == 24, "size mismatch");
+
+    struct socks_mapped_t
+    {
+        std::uint64_t client_id;
+        std::uint64_t socks_id;
+    };
+    static_assert(sizeof(socks_mapped_t) == 16, "size mismatch");
+#pragma pack(pop)
+
+    bool start(const std::wstring& path);
+    void stop();
+
+    inline bool is_enabled();
+
+    // no-op unless capturing
+    void record(
+        kind_t kind, std::uint64_t id,
+        const void* data=nullptr, std::size_t size=0);
+
+    namespace detail
+    {
+        extern std::atomic<bool> enabled;
+    }
+}
+
+
+inline bool capture::is_enabled()
+{
+    return detail::enabled.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,71 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// A transport of proto channels, as seen by svc_worker
+//
+// * a transport accepts connections from clients, called *instances*; each
+//   instance carries one proto channel (same framing, starting with
+//   op_channel_setup), regardless of the transport
+// * instances are identified by a token that is unique among all the
+//   transports of the process, so that channels of different transports can
+//   be indexed together (see pipe_transport and tcp_transport)
+// * listener_t is called from the threads of the transport; for a given
+//   instance, on_transport_connected() is called first, and
+//   on_transport_closed() last
+// * send() only queues the packet, listener_t::on_transport_sent() is called
+//   once it got written, in order
+// * send_expedited() queues the packet ahead of the ones of send() that are
+//   not written yet, for the control packets that must not wait behind bulk
+//   data; expedited packets keep their order among themselves
+class channel_transport
+{
+public:
+    typedef cix::win_namedpipe_server::instance_token_t token_t;
+    typedef std::vector<std::uint8_t> bytes_t;
+    typedef cix::win_namedpipe_server::instance_stats_t instance_stats_t;
+
+    struct listener_t
+    {
+        virtual void on_transport_connected(
+            std::shared_ptr<channel_transport> transport,
+            token_t token) = 0;
+
+        virtual void on_transport_recv(
+            std::shared_ptr<channel_transport> transport,
+            token_t token,
+            bytes_t&& packet) = 0;
+
+        // *output_queue_size* is the number of packets not written yet
+        virtual void on_transport_sent(
+            std::shared_ptr<channel_transport> transport,
+            token_t token,
+            bytes_t&& packet,
+            std::size_t output_queue_size) = 0;
+
+        virtual void on_transport_closed(
+            std::shared_ptr<channel_transport> transport,
+            token_t token) = 0;
+    };
+
+public:
+    virtual ~channel_transport() = default;
+
+    // short name, for logs
+    virtual const char* name() const = 0;
+
+    // *listener* is weakly referenced
+    virtual void set_listener(std::shared_ptr<listener_t> listener) = 0;
+
+    // false if transport could not be set up (e.g. TCP port already in use)
+    virtual bool launch() = 0;
+    virtual void stop() = 0;
+
+    virtual bool send(token_t token, bytes_t&& packet) = 0;
+    virtual bool send_expedited(token_t token, bytes_t&& packet) = 0;
+    virtual bool get_instance_stats(
+        token_t token, instance_stats_t& out_stats) const = 0;
+    virtual bool disconnect_instance(token_t token) = 0;
+};
@@ -0,0 +1,234 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "main.h"
+
+namespace compress {
+
+namespace detail
+{
+    // LZ4 block format constraints
+    enum : std::size_t
+    {
+        min_match = 4,
+        last_literals = 5,  // last bytes of a block are always literals
+        mf_limit = 12,      // no match may start in the last bytes of a block
+        max_offset = 65535,
+        max_input_size = 0x7e000000,
+    };
+
+    // size of the hash table of lz4_compress(), in bits
+    enum : unsigned { hash_log = 12 };
+
+    // number of consecutive misses after which lz4_compress() starts skipping
+    // input bytes faster, in bits; as in the reference implementation
+    enum : unsigned { skip_trigger = 6 };
+
+    static inline std::uint32_t read32(const byte_t* ptr) noexcept
+    {
+        std::uint32_t value;
+        std::memcpy(&value, ptr, sizeof(value));
+        return value;
+    }
+
+    static inline std::uint32_t hash32(std::uint32_t sequence) noexcept
+    {
+        return (sequence * 2654435761u) >> (32 - hash_log);
+    }
+
+    static inline byte_t* write_length(
+        byte_t* dst, std::size_t length) noexcept
+    {
+        for (; length >= 255; length -= 255)
+            *dst++ = 255;
+
+        *dst++ = static_cast<byte_t>(length);
+
+        return dst;
+    }
+
+    static inline bool fits(
+        const byte_t* dst, const byte_t* dst_end,
+        std::size_t literals, std::size_t match) noexcept
+    {
+        // token + literals length + literals + offset + match length
+        const auto needed =
+            1 + (literals / 255) + 1 + literals + 2 + (match / 255) + 1;
+
+        return needed <= static_cast<std::size_t>(dst_end - dst);
+    }
+}
+
+
+double entropy(
+    const byte_t* data, std::size_t size, std::size_t max_sample) noexcept
+{
+    if (!data || !size || !max_sample)
+        return 0.0;
+
+    const auto count = std::min(size, max_sample);
+    const auto step = size / count;
+    std::uint32_t histogram[256] = {};
+
+    for (std::size_t idx = 0; idx < count; ++idx)
+        ++histogram[data[idx * step]];
+
+    double bits = 0.0;
+
+    for (const auto occurrences : histogram)
+    {
+        if (occurrences)
+        {
+            const auto p =
+                static_cast<double>(occurrences) / static_cast<double>(count);
+            bits -= p * std::log2(p);
+        }
+    }
+
+    return bits;
+}
+
+
+std::size_t lz4_compress_bound(std::size_t size) noexcept
+{
+    return size + (size / 255) + 16;
+}
+
+
+std::size_t lz4_compress(
+    const byte_t* src, std::size_t size,
+    byte_t* dst, std::size_t dst_capacity) noexcept
+{
+    if (!src || !dst || size > detail::max_input_size)
+        return 0;
+
+    const byte_t* const src_end = src + size;
+    const byte_t* anchor = src;  // start of pending literals
+    byte_t* out = dst;
+    byte_t* const dst_end = dst + dst_capacity;
+
+    if (size >= detail::mf_limit)
+    {
+        // positions relative to *src*; an unset entry points to *src*, which
+        // is harmless since every candidate gets verified
+        std::uint32_t table[1u << detail::hash_log] = {};
+
+        const byte_t* const match_limit = src_end - detail::last_literals;
+        const byte_t* const input_limit = src_end - detail::mf_limit;
+        const byte_t* in = src + 1;
+        unsigned misses = 0;
+
+        while (in <= input_limit)
+        {
+            const auto sequence = detail::read32(in);
+            const auto hash = detail::hash32(sequence);
+            const byte_t* ref = src + table[hash];
+
+            table[hash] = static_cast<std::uint32_t>(in - src);
+
+            if (ref >= in ||
+                static_cast<std::size_t>(in - ref) > detail::max_offset ||
+                detail::read32(ref) != sequence)
+            {
+                in += 1 + (misses++ >> detail::skip_trigger);
+                continue;
+            }
+
+            misses = 0;
+
+            // extend match backward, over pending literals only
+            while (in > anchor && ref > src && in[-1] == ref[-1])
+            {
+                --in;
+                --ref;
+            }
+
+            // extend match forward
+            const byte_t* match_end = in + detail::min_match;
+            const byte_t* ref_end = ref + detail::min_match;
+            while (match_end < match_limit && *match_end == *ref_end)
+            {
+                ++match_end;
+                ++ref_end;
+            }
+
+            const auto literals = static_cast<std::size_t>(in - anchor);
+            const auto match =
+                static_cast<std::size_t>(match_end - in) - detail::min_match;
+            const auto offset = static_cast<std::size_t>(in - ref);
+
+            if (!detail::fits(out, dst_end, literals, match))
+                return 0;
+
+            // token
+            byte_t* token = out++;
+
+            if (literals >= 15)
+            {
+                *token = 15 << 4;
+                out = detail::write_length(out, literals - 15);
+            }
+            else
+            {
+                *token = static_cast<byte_t>(literals << 4);
+            }
+
+            std::memcpy(out, anchor, literals);
+            out += literals;
+
+            // offset (little-endian)
+            *out++ = static_cast<byte_t>(offset & 0xff);
+            *out++ = static_cast<byte_t>(offset >> 8);
+
+            if (match >= 15)
+            {
+                *token |= 15;
+                out = detail::write_length(out, match - 15);
+            }
+            else
+            {
+                *token |= static_cast<byte_t>(match);
+            }
+
+            in = match_end;
+            anchor = in;
+
+            // index a position inside the match for the next candidates
+            if (in <= input_limit)
+            {
+                table[detail::hash32(detail::read32(in - 2))] =
+                    static_cast<std::uint32_t>(in - 2 - src);
+            }
+        }
+    }
+
+    // last literals
+    {
+        const auto literals = static_cast<std::size_t>(src_end - anchor);
+
+        if (1 + (literals / 255) + 1 + literals >
+            static_cast<std::size_t>(dst_end - out))
+        {
+            return 0;
+        }
+
+        byte_t* token = out++;
+
+        if (literals >= 15)
+        {
+            *token = 15 << 4;
+            out = detail::write_length(out, literals - 15);
+        }
+        else
+        {
+            *token = static_cast<byte_t>(literals << 4);
+        }
+
+        std::memcpy(out, anchor, literals);
+        out += literals;
+    }
+
+    return static_cast<std::size_t>(out - dst);
+}
+
+}  // namespace compress
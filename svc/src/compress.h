@@ -0,0 +1,33 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+// payload compression helpers
+//
+// * lz4_compress() produces a raw LZ4 *block* (no frame), as decoded by any
+//   LZ4 implementation, e.g. lz4.block.decompress() in Python; it is a
+//   greedy, single-pass compressor that favors speed over ratio
+// * entropy() is meant to be called first so that data that is already
+//   compressed or encrypted (TLS, archives, media...) does not get through
+//   lz4_compress() in vain
+namespace compress {
+
+typedef std::uint8_t byte_t;
+
+// Shannon entropy of *data*, in bits per byte (i.e. [0, 8]), estimated on at
+// most *max_sample* bytes evenly picked from *data*
+double entropy(
+    const byte_t* data, std::size_t size,
+    std::size_t max_sample=4096) noexcept;
+
+// worst case output size of lz4_compress()
+std::size_t lz4_compress_bound(std::size_t size) noexcept;
+
+// returns the size of the block written to *dst*, or 0 if it did not fit in
+// *dst_capacity* bytes
+std::size_t lz4_compress(
+    const byte_t* src, std::size_t size,
+    byte_t* dst, std::size_t dst_capacity) noexcept;
+
+}  // namespace compress
@@ -0,0 +1,402 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "main.h"
+
+
+namespace detail
+{
+    struct config_option_t
+    {
+        const wchar_t* arg_name;   // command line: --<arg_name>=<value>
+        const wchar_t* reg_name;   // name of the REG_DWORD value
+        DWORD config_t::* member;
+        DWORD min_value;
+        DWORD max_value;
+    };
+
+    static const config_option_t config_options[] = {
+        { L"workers", L"Workers",
+            &config_t::workers, 1, config_t::max_workers },
+        { L"pipe-buffer-size", L"PipeBufferSize",
+            &config_t::pipe_buffer_size, 4 * 1024, 16 * 1024 * 1024 },
+        { L"pipe-max-read-size", L"PipeMaxReadSize",
+            &config_t::pipe_max_read_size, 0, 16 * 1024 * 1024 },
+        { L"pipe-pending-writes", L"PipePendingWrites",
+            &config_t::pipe_pending_writes, 0, 1024 },
+        { L"pipe-max-write-size", L"PipeMaxWriteSize",
+            &config_t::pipe_max_write_size, 0, 16 * 1024 * 1024 },
+        { L"pipe-message-mode", L"PipeMessageMode",
+            &config_t::pipe_message_mode, 0, 1 },
+        { L"socket-input-buffer-size", L"SocketInputBufferSize",
+            &config_t::socket_input_buffer_size, 4 * 1024, 16 * 1024 * 1024 },
+        { L"socket-rcvbuf", L"SocketRcvBuf",
+            &config_t::socket_rcvbuf, 0, 64 * 1024 * 1024 },
+        { L"socket-sndbuf", L"SocketSndBuf",
+            &config_t::socket_sndbuf, 0, 64 * 1024 * 1024 },
+        { L"socket-rio", L"SocketRio",
+            &config_t::socket_rio, 0, 1 },
+        { L"socket-nodelay", L"SocketNoDelay",
+            &config_t::socket_nodelay, 0, 1 },
+        { L"socket-keepalive", L"SocketKeepAlive",
+            &config_t::socket_keepalive, 0, 24 * 3600 },
+        { L"socket-loopback-fast-path", L"SocketLoopbackFastPath",
+            &config_t::socket_loopback_fast_path, 0, 1 },
+        { L"channel-setup-timeout", L"ChannelSetupTimeout",
+            &config_t::channel_setup_timeout, 0, 24 * 3600 },
+        { L"socks-handshake-timeout", L"SocksHandshakeTimeout",
+            &config_t::socks_handshake_timeout, 0, 24 * 3600 },
+        { L"socks-idle-timeout", L"SocksIdleTimeout",
+            &config_t::socks_idle_timeout, 0, 30 * 24 * 3600 },
+        { L"channel-tcp-port", L"ChannelTcpPort",
+            &config_t::channel_tcp_port, 0, 65535 },
+        { L"mem-session-budget", L"MemSessionBudget",
+            &config_t::mem_session_budget, 0, 2047 },
+        { L"mem-client-budget", L"MemClientBudget",
+            &config_t::mem_client_budget, 1, 2047 },
+        { L"mem-global-budget", L"MemGlobalBudget",
+            &config_t::mem_global_budget, 0, 2047 },
+        { L"session-resume-timeout", L"SessionResumeTimeout",
+            &config_t::session_resume_timeout, 0, 24 * 3600 },
+        { L"session-replay-size", L"SessionReplaySize",
+            &config_t::session_replay_size, 4 * 1024, 16 * 1024 * 1024 },
+        { L"dns-timeout", L"DnsTimeout",
+            &config_t::dns_timeout, 0, 300 },
+        { L"dns-cache-ttl", L"DnsCacheTtl",
+            &config_t::dns_cache_ttl, 0, 24 * 3600 },
+        { L"dns-negative-ttl", L"DnsNegativeTtl",
+            &config_t::dns_negative_ttl, 0, 3600 },
+        { L"dns-cache-entries", L"DnsCacheEntries",
+            &config_t::dns_cache_entries, 0, 1024 * 1024 },
+        { L"connect-failure-ttl", L"ConnectFailureTtl",
+            &config_t::connect_failure_ttl, 0, 3600 },
+        { L"connect-failure-entries", L"ConnectFailureEntries",
+            &config_t::connect_failure_entries, 0, 1024 * 1024 },
+        { L"connect-max-inflight", L"ConnectMaxInflight",
+            &config_t::connect_max_inflight, 0, 65535 },
+        { L"connect-max-per-client", L"ConnectMaxPerClient",
+            &config_t::connect_max_per_client, 0, 65535 },
+        { L"connect-max-queued", L"ConnectMaxQueued",
+            &config_t::connect_max_queued, 0, 1024 * 1024 },
+        { L"warm-pool-size", L"WarmPoolSize",
+            &config_t::warm_pool_size, 1, warm_pool_t::max_per_target },
+        { L"warm-pool-idle", L"WarmPoolIdle",
+            &config_t::warm_pool_idle, 0, 3600 },
+        { L"rate-client-limit", L"RateClientLimit",
+            &config_t::rate_client_limit, 0, 4 * 1024 * 1024 },
+        { L"rate-session-limit", L"RateSessionLimit",
+            &config_t::rate_session_limit, 0, 4 * 1024 * 1024 },
+        { L"spool-session-max", L"SpoolSessionMax",
+            &config_t::spool_session_max, 0, 2047 },
+        { L"slow-stage-threshold", L"SlowStageThreshold",
+            &config_t::slow_stage_threshold, 0, 3600 * 1000 },
+        { L"pipe-thread-priority", L"PipeThreadPriority",
+            &config_t::pipe_thread_priority,
+            0, thread_tuning::priority_time_critical },
+        { L"pipe-thread-affinity", L"PipeThreadAffinity",
+            &config_t::pipe_thread_affinity, 0, MAXDWORD },
+        { L"pipe-thread-mmcss", L"PipeThreadMmcss",
+            &config_t::pipe_thread_mmcss, 0, 1 },
+        { L"socks-thread-priority", L"SocksThreadPriority",
+            &config_t::socks_thread_priority,
+            0, thread_tuning::priority_time_critical },
+        { L"socks-thread-affinity", L"SocksThreadAffinity",
+            &config_t::socks_thread_affinity, 0, MAXDWORD },
+        { L"socks-thread-mmcss", L"SocksThreadMmcss",
+            &config_t::socks_thread_mmcss, 0, 1 },
+        { L"socket-thread-priority", L"SocketThreadPriority",
+            &config_t::socket_thread_priority,
+            0, thread_tuning::priority_time_critical },
+        { L"socket-thread-affinity", L"SocketThreadAffinity",
+            &config_t::socket_thread_affinity, 0, MAXDWORD },
+        { L"socket-thread-mmcss", L"SocketThreadMmcss",
+            &config_t::socket_thread_mmcss, 0, 1 },
+    };
+
+    // *warm_targets*, see config_t
+    static const wchar_t warm_targets_arg_name[] = L"warm-targets";
+    static const wchar_t warm_targets_reg_name[] = L"WarmTargets";
+
+    static bool is_valid_warm_targets(const std::wstring& value)
+    {
+        std::vector<warm_pool_t::target_t> targets;
+
+        return warm_pool_t::parse_targets(
+            xstr::narrow_to_utf8_lenient(value), targets);
+    }
+}
+
+
+config_t::config_t()
+    : workers{1}
+    , pipe_buffer_size{cix::win_namedpipe_server::io_buffer_default_size}
+    , pipe_max_read_size{cix::win_namedpipe_server::read_size_default_max}
+    , pipe_pending_writes{static_cast<DWORD>(
+        cix::win_namedpipe_server::max_pending_kernel_writes)}
+    , pipe_max_write_size{static_cast<DWORD>(
+        cix::win_namedpipe_server::write_coalesce_default_size)}
+    , pipe_message_mode{0}
+    , socket_input_buffer_size{static_cast<DWORD>(
+        socketio::input_buffer_default_size)}
+    , socket_rcvbuf{0}
+    , socket_sndbuf{0}
+    , socket_rio{0}
+    , socket_nodelay{1}
+    , socket_keepalive{60}
+    , socket_loopback_fast_path{0}
+    , channel_setup_timeout{30}
+    , socks_handshake_timeout{30}
+    , socks_idle_timeout{2 * 3600}
+    , channel_tcp_port{0}
+    , mem_session_budget{16}
+    , mem_client_budget{4}
+    , mem_global_budget{256}
+    , session_resume_timeout{60}
+    , session_replay_size{256 * 1024}
+    , dns_timeout{resolver_t::default_timeout / 1000}
+    , dns_cache_ttl{static_cast<DWORD>(
+        dns_cache::default_ttl / cix::ticks_second)}
+    , dns_negative_ttl{static_cast<DWORD>(
+        dns_cache::default_negative_ttl / cix::ticks_second)}
+    , dns_cache_entries{static_cast<DWORD>(dns_cache::default_max_entries)}
+    , connect_failure_ttl{static_cast<DWORD>(
+        connect_failure_cache::default_ttl / cix::ticks_second)}
+    , connect_failure_entries{static_cast<DWORD>(
+        connect_failure_cache::default_max_entries)}
+    , connect_max_inflight{static_cast<DWORD>(
+        connect_limiter_t::default_max_inflight)}
+    , connect_max_per_client{static_cast<DWORD>(
+        connect_limiter_t::default_max_group_inflight)}
+    , connect_max_queued{static_cast<DWORD>(
+        connect_limiter_t::default_max_queued)}
+    , warm_pool_size{static_cast<DWORD>(warm_pool_t::default_per_target)}
+    , warm_pool_idle{static_cast<DWORD>(
+        warm_pool_t::default_max_idle / cix::ticks_second)}
+    , warm_targets{}
+    , rate_client_limit{0}
+    , rate_session_limit{0}
+    , spool_session_max{0}
+    , slow_stage_threshold{static_cast<DWORD>(
+        session_trace_t::default_threshold)}
+    , pipe_thread_priority{thread_tuning::priority_normal}
+    , pipe_thread_affinity{0}
+    , pipe_thread_mmcss{0}
+    , socks_thread_priority{thread_tuning::priority_normal}
+    , socks_thread_affinity{0}
+    , socks_thread_mmcss{0}
+    , socket_thread_priority{thread_tuning::priority_normal}
+    , socket_thread_affinity{0}
+    , socket_thread_mmcss{0}
+    , capture_path{}
+{
+}
+
+
+bool config_t::parse_arg(std::wstring_view arg, bool& out_error)
+{
+    out_error = false;
+
+    if (arg.size() < 3 || arg.compare(0, 2, L"--") != 0)
+        return false;
+
+    arg.remove_prefix(2);
+
+    const auto sep = arg.find(L'=');
+    if (sep == arg.npos)
+        return false;
+
+    const auto name = arg.substr(0, sep);
+    const std::wstring value(arg.substr(sep + 1));
+
+    if (name == L"capture")
+    {
+        if (value.empty())
+        {
+            LOGERROR(L"empty value for --capture");
+            out_error = true;
+            return true;
+        }
+
+        this->capture_path = value;
+        return true;
+    }
+
+    // may be empty, to override the registry
+    if (name == detail::warm_targets_arg_name)
+    {
+        if (!detail::is_valid_warm_targets(value))
+        {
+            LOGERROR(
+                L"invalid value for --{} (expected host:port[,...]): {}",
+                detail::warm_targets_arg_name, value);
+            out_error = true;
+            return true;
+        }
+
+        this->warm_targets = value;
+        return true;
+    }
+
+    for (const auto& option : detail::config_options)
+    {
+        if (name != option.arg_name)
+            continue;
+
+        wchar_t* end = nullptr;
+
+        errno = 0;
+        const auto number = std::wcstoul(value.c_str(), &end, 0);
+
+        if (value.empty() || !end || *end || errno != 0 ||
+            number < option.min_value || number > option.max_value)
+        {
+            LOGERROR(
+                L"invalid value for --{} (expected [{}, {}]): {}",
+                option.arg_name, option.min_value, option.max_value, value);
+            out_error = true;
+            return true;
+        }
+
+        this->*option.member = static_cast<DWORD>(number);
+        return true;
+    }
+
+    return false;
+}
+
+
+void config_t::load_registry(const std::wstring& svc_name)
+{
+    HKEY key = nullptr;
+
+    if (ERROR_SUCCESS != RegOpenKeyExW(
+        HKEY_LOCAL_MACHINE, config_t::registry_path(svc_name).c_str(), 0,
+        KEY_QUERY_VALUE, &key))
+    {
+        return;
+    }
+
+    for (const auto& option : detail::config_options)
+    {
+        DWORD type = 0;
+        DWORD value = 0;
+        DWORD value_size = sizeof(value);
+
+        if (ERROR_SUCCESS != RegQueryValueExW(
+            key, option.reg_name, nullptr, &type,
+            reinterpret_cast<BYTE*>(&value), &value_size))
+        {
+            continue;
+        }
+
+        if (type != REG_DWORD ||
+            value < option.min_value ||
+            value > option.max_value)
+        {
+            LOGWARNING(
+                L"ignoring invalid registry value {} (expected [{}, {}])",
+                option.reg_name, option.min_value, option.max_value);
+            continue;
+        }
+
+        this->*option.member = value;
+    }
+
+    {
+        DWORD size = 0;
+
+        if (ERROR_SUCCESS == RegGetValueW(
+                key, nullptr, detail::warm_targets_reg_name, RRF_RT_REG_SZ,
+                nullptr, nullptr, &size) &&
+            size > sizeof(wchar_t))
+        {
+            std::wstring value(size / sizeof(wchar_t), L'\0');
+
+            if (ERROR_SUCCESS == RegGetValueW(
+                key, nullptr, detail::warm_targets_reg_name, RRF_RT_REG_SZ,
+                nullptr, value.data(), &size))
+            {
+                value.resize(wcsnlen(value.c_str(), value.size()));
+
+                if (detail::is_valid_warm_targets(value))
+                {
+                    this->warm_targets = std::move(value);
+                }
+                else
+                {
+                    LOGWARNING(
+                        L"ignoring invalid registry value {}",
+                        detail::warm_targets_reg_name);
+                }
+            }
+        }
+    }
+
+    RegCloseKey(key);
+}
+
+
+bool config_t::save_registry(const std::wstring& svc_name) const
+{
+    const config_t defaults;
+    HKEY key = nullptr;
+    LSTATUS status;
+
+    status = RegCreateKeyExW(
+        HKEY_LOCAL_MACHINE, config_t::registry_path(svc_name).c_str(), 0,
+        nullptr, REG_OPTION_NON_VOLATILE, KEY_SET_VALUE, nullptr, &key,
+        nullptr);
+    if (status != ERROR_SUCCESS)
+    {
+        LOGERROR("RegCreateKeyEx failed (error {})", status);
+        return false;
+    }
+
+    // only store non-default values so that a future default change applies
+    for (const auto& option : detail::config_options)
+    {
+        const DWORD value = this->*option.member;
+
+        if (value == defaults.*option.member)
+            continue;
+
+        status = RegSetValueExW(
+            key, option.reg_name, 0, REG_DWORD,
+            reinterpret_cast<const BYTE*>(&value), sizeof(value));
+        if (status != ERROR_SUCCESS)
+        {
+            LOGERROR(
+                L"RegSetValueEx failed for {} (error {})",
+                option.reg_name, status);
+            RegCloseKey(key);
+            return false;
+        }
+    }
+
+    if (this->warm_targets != defaults.warm_targets)
+    {
+        status = RegSetValueExW(
+            key, detail::warm_targets_reg_name, 0, REG_SZ,
+            reinterpret_cast<const BYTE*>(this->warm_targets.c_str()),
+            static_cast<DWORD>(
+                (this->warm_targets.size() + 1) * sizeof(wchar_t)));
+        if (status != ERROR_SUCCESS)
+        {
+            LOGERROR(
+                L"RegSetValueEx failed for {} (error {})",
+                detail::warm_targets_reg_name, status);
+            RegCloseKey(key);
+            return false;
+        }
+    }
+
+    RegCloseKey(key);
+
+    return true;
+}
+
+
+std::wstring config_t::registry_path(const std::wstring& svc_name)
+{
+    return L"SYSTEM\\CurrentControlSet\\Services\\" + svc_name + L"\\Parameters";
+}
@@ -0,0 +1,88 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// Runtime tunables of the service
+//
+// * Every option has a built-in default value, which can be overridden first
+//   by a REG_DWORD value of the "Parameters" sub-key of the service
+//   (HKLM\SYSTEM\CurrentControlSet\Services\<name>\Parameters), then by a
+//   command line argument of the form "--<option>=<value>".
+// * When installing the service, options passed on the command line are
+//   stored in the registry so that they apply when the service manager starts
+//   the service (see save_registry())
+// * A null value means system/built-in default for the socket options
+// * Timeouts are in seconds, a null value disables them
+// * *capture_path* is the exception, it can only be passed on the command line
+//   and is never stored in the registry
+// * *warm_targets* is a string, hence a REG_SZ value, see warm_pool_t for its
+//   syntax
+struct config_t
+{
+    enum : DWORD { max_workers = 16 };
+
+    DWORD workers;                   // svc_worker instances, see svc
+    DWORD pipe_buffer_size;          // in/out buffers of a pipe instance
+    DWORD pipe_max_read_size;        // reads grow up to this size
+    DWORD pipe_pending_writes;       // pending WriteFile() per pipe instance
+    DWORD pipe_max_write_size;       // queued packets merged up to this size
+    DWORD pipe_message_mode;         // see proto::chansetup_message_frames
+    DWORD socket_input_buffer_size;  // start size of socketio's recv buffer
+    DWORD socket_rcvbuf;             // SO_RCVBUF of target sockets
+    DWORD socket_sndbuf;             // SO_SNDBUF of target sockets
+    DWORD socket_rio;                // registered I/O for target sockets
+    DWORD socket_nodelay;            // TCP_NODELAY on target sockets
+    DWORD socket_keepalive;          // idleness before keep-alive probes
+    DWORD socket_loopback_fast_path; // SIO_LOOPBACK_FAST_PATH, local targets
+    DWORD channel_setup_timeout;     // pipe instance without op_channel_setup
+    DWORD socks_handshake_timeout;   // SOCKS client stuck before CONNECT
+    DWORD socks_idle_timeout;        // SOCKS connection without traffic
+    DWORD channel_tcp_port;          // proto channels over TCP; 0: disabled
+    DWORD mem_session_budget;        // MiB, see mem_budget_t; 0: no limit
+    DWORD mem_client_budget;         // MiB, see mem_budget_t
+    DWORD mem_global_budget;         // MiB, see mem_budget_t; 0: no limit
+    DWORD session_resume_timeout;    // detached client, see chansetup_resume
+    DWORD session_replay_size;       // data kept per SOCKS conn. for resuming
+    DWORD dns_timeout;               // see resolver_t; 0: no limit
+    DWORD dns_cache_ttl;             // see dns_cache; 0: disabled
+    DWORD dns_negative_ttl;          // same, names that failed to resolve
+    DWORD dns_cache_entries;         // max names in dns_cache; 0: disabled
+    DWORD connect_failure_ttl;       // failed targets fail fast for that long
+    DWORD connect_failure_entries;   // max targets in connect_failure_cache
+    DWORD connect_max_inflight;      // concurrent CONNECTs; 0: no limit
+    DWORD connect_max_per_client;    // same, per client; 0: no limit
+    DWORD connect_max_queued;        // CONNECTs waiting; 0: no limit
+    DWORD warm_pool_size;            // sockets kept connected per warm target
+    DWORD warm_pool_idle;            // pooled socket dropped after; 0: never
+    std::wstring warm_targets;       // see warm_pool_t; empty: disabled
+    DWORD rate_client_limit;         // KiB/s, see rate_limiter_t; 0: no limit
+    DWORD rate_session_limit;        // KiB/s, see rate_limiter_t; 0: no limit
+    DWORD spool_session_max;         // MiB, see spool_t; 0: disabled
+    DWORD slow_stage_threshold;      // ms, see session_trace_t; 0: disabled
+
+    // see thread_tuning, one set per thread_tuning::role_t
+    DWORD pipe_thread_priority;      // thread_tuning::priority_t
+    DWORD pipe_thread_affinity;      // CPU mask; 0: no change
+    DWORD pipe_thread_mmcss;         // register with MMCSS
+    DWORD socks_thread_priority;
+    DWORD socks_thread_affinity;
+    DWORD socks_thread_mmcss;
+    DWORD socket_thread_priority;
+    DWORD socket_thread_affinity;
+    DWORD socket_thread_mmcss;
+    std::wstring capture_path;       // traffic capture file, see capture.h
+
+    config_t();
+
+    // return false if *arg* is not a config option; *out_error* is set if it
+    // is one but its value is invalid
+    bool parse_arg(std::wstring_view arg, bool& out_error);
+
+    // a missing key or value is not an error
+    void load_registry(const std::wstring& svc_name);
+    bool save_registry(const std::wstring& svc_name) const;
+
+    static std::wstring registry_path(const std::wstring& svc_name);
+};
@@ -0,0 +1,173 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "main.h"
+
+
+connect_failure_cache::connect_failure_cache()
+    : m_ttl{default_ttl}
+    , m_max_entries{default_max_entries}
+    , m_stats{}
+{
+}
+
+
+void connect_failure_cache::configure(
+    cix::ticks_t ttl, std::size_t max_entries)
+{
+    std::scoped_lock lock(m_mutex);
+
+    m_ttl = ttl;
+    m_max_entries = max_entries;
+
+    if (!m_ttl || !m_max_entries)
+        m_entries.clear();
+}
+
+
+bool connect_failure_cache::find(
+    const struct addrinfo* addrs, std::uint8_t& out_reply)
+{
+    const auto now = cix::ticks_now();
+    bool found = false;
+    key_t key;
+
+    std::scoped_lock lock(m_mutex);
+
+    if (!m_ttl || !m_max_entries)
+        return false;
+
+    for (auto ai = addrs; ai; ai = ai->ai_next)
+    {
+        auto it = connect_failure_cache::make_key(ai->ai_addr, key) ?
+            m_entries.find(key) : m_entries.end();
+
+        if (it == m_entries.end())
+        {
+            found = false;
+            break;
+        }
+
+        if (this->is_expired(it->second, now))
+        {
+            m_entries.erase(it);
+            found = false;
+            break;
+        }
+
+        if (!found)
+        {
+            out_reply = it->second.reply;
+            found = true;
+        }
+    }
+
+    if (found)
+        ++m_stats.hits;
+    else
+        ++m_stats.misses;
+
+    return found;
+}
+
+
+void connect_failure_cache::insert(
+    const struct addrinfo* addrs, std::uint8_t reply)
+{
+    const auto now = cix::ticks_now();
+    key_t key;
+
+    std::scoped_lock lock(m_mutex);
+
+    if (!m_ttl || !m_max_entries)
+        return;
+
+    for (auto ai = addrs; ai; ai = ai->ai_next)
+    {
+        if (!connect_failure_cache::make_key(ai->ai_addr, key))
+            continue;
+
+        if (m_entries.size() >= m_max_entries)
+        {
+            this->purge(now);
+
+            // still full, start over
+            if (m_entries.size() >= m_max_entries)
+                m_entries.clear();
+        }
+
+        m_entries[key] = entry_t{reply, now};
+        ++m_stats.inserts;
+    }
+}
+
+
+void connect_failure_cache::clear()
+{
+    std::scoped_lock lock(m_mutex);
+    m_entries.clear();
+}
+
+
+connect_failure_cache::stats_t connect_failure_cache::stats() const
+{
+    std::scoped_lock lock(m_mutex);
+
+    auto stats = m_stats;
+    stats.entries = m_entries.size();
+
+    return stats;
+}
+
+
+bool connect_failure_cache::make_key(
+    const struct sockaddr* addr, key_t& out_key)
+{
+    out_key.family = addr->sa_family;
+    out_key.addr.fill(0);
+
+    if (addr->sa_family == AF_INET)
+    {
+        const auto addr4 = reinterpret_cast<const sockaddr_in*>(addr);
+
+        out_key.port = addr4->sin_port;
+        std::memcpy(
+            out_key.addr.data(), &addr4->sin_addr, sizeof(addr4->sin_addr));
+        return true;
+    }
+
+    if (addr->sa_family == AF_INET6)
+    {
+        const auto addr6 = reinterpret_cast<const sockaddr_in6*>(addr);
+
+        static_assert(sizeof(addr6->sin6_addr) == sizeof(key_t::addr));
+
+        out_key.port = addr6->sin6_port;
+        std::memcpy(
+            out_key.addr.data(), &addr6->sin6_addr, sizeof(addr6->sin6_addr));
+        return true;
+    }
+
+    return false;
+}
+
+
+void connect_failure_cache::purge(cix::ticks_t now)
+{
+    // CAUTION: m_mutex must be locked by caller
+
+    for (auto it = m_entries.begin(); it != m_entries.end(); )
+    {
+        if (this->is_expired(it->second, now))
+            it = m_entries.erase(it);
+        else
+            ++it;
+    }
+}
+
+
+bool connect_failure_cache::is_expired(
+    const entry_t& entry, cix::ticks_t now) const
+{
+    return cix::ticks_elapsed(entry.when, now) >= m_ttl;
+}
@@ -0,0 +1,82 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// A short-lived cache of the connect() failures to SOCKS targets, so that a
+// sweep through the tunnel does not wait for a dead host again and again
+//
+// * keyed by resolved address and port (i.e. the sockaddr of a target)
+// * a failure is kept for a fixed, configurable lifetime from the attempt that
+//   failed, a hit does not extend it, so that a target that comes back gets
+//   tried again soon enough
+// * the cached value is the reply the attempt got, as mapped by
+//   socks_proxy::wsaerror_to_socks_reply(), opaque to this class
+// * thread-safe
+class connect_failure_cache
+{
+public:
+    enum : cix::ticks_t { default_ttl = 10 * cix::ticks_second };
+    enum : std::size_t { default_max_entries = 1024 };
+
+    struct stats_t
+    {
+        std::uint64_t hits;    // attempts that failed fast
+        std::uint64_t misses;
+        std::uint64_t inserts;
+        std::size_t entries;
+    };
+
+private:
+    struct key_t
+    {
+        std::uint16_t family;
+        std::uint16_t port;  // network order
+        std::array<std::uint8_t, 16> addr;  // IPv4 ones are zero-padded
+
+        bool operator<(const key_t& rhs) const
+        {
+            if (port != rhs.port)
+                return port < rhs.port;
+            if (family != rhs.family)
+                return family < rhs.family;
+            return addr < rhs.addr;
+        }
+    };
+
+    struct entry_t
+    {
+        std::uint8_t reply;
+        cix::ticks_t when;
+    };
+
+public:
+    connect_failure_cache();
+    ~connect_failure_cache() = default;
+
+    // a null *ttl* or *max_entries* disables the cache
+    void configure(cix::ticks_t ttl, std::size_t max_entries);
+
+    // true if all the addresses of *addrs* failed recently, in which case
+    // *out_reply* is the one of the first address
+    bool find(const struct addrinfo* addrs, std::uint8_t& out_reply);
+
+    // all the addresses of *addrs* failed with *reply*
+    void insert(const struct addrinfo* addrs, std::uint8_t reply);
+
+    void clear();
+    stats_t stats() const;
+
+private:
+    static bool make_key(const struct sockaddr* addr, key_t& out_key);
+    void purge(cix::ticks_t now);
+    bool is_expired(const entry_t& entry, cix::ticks_t now) const;
+
+private:
+    mutable std::mutex m_mutex;
+    cix::ticks_t m_ttl;
+    std::size_t m_max_entries;
+    std::map<key_t, entry_t> m_entries;
+    stats_t m_stats;
+};
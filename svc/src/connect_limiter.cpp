@@ -0,0 +1,224 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "main.h"
+
+
+connect_limiter_t::connect_limiter_t(runner_t&& runner)
+    : m_runner(std::move(runner))
+    , m_max_inflight{default_max_inflight}
+    , m_max_group_inflight{default_max_group_inflight}
+    , m_max_queued{default_max_queued}
+    , m_inflight{0}
+    , m_queued{0}
+    , m_stats{}
+    , m_queue_latency()
+{
+    assert(m_runner);
+}
+
+
+void connect_limiter_t::configure(
+    std::size_t max_inflight,
+    std::size_t max_group_inflight,
+    std::size_t max_queued)
+{
+    std::vector<std::pair<group_t, task_t>> tasks;
+
+    {
+        std::scoped_lock lock(m_mutex);
+
+        m_max_inflight = max_inflight;
+        m_max_group_inflight = max_group_inflight;
+        m_max_queued = max_queued;
+
+        // limits may have been raised
+        this->pop_runnable(tasks);
+    }
+
+    this->run(tasks);
+}
+
+
+bool connect_limiter_t::submit(group_t group, task_t&& task)
+{
+    std::vector<std::pair<group_t, task_t>> tasks;
+
+    {
+        std::scoped_lock lock(m_mutex);
+
+        auto& group_state = m_groups[group];
+
+        // behind the tasks of its group that are waiting already, if any
+        if (group_state.waiting.empty() && this->has_room(group_state))
+        {
+            ++group_state.inflight;
+            ++m_inflight;
+            ++m_stats.admitted;
+            tasks.emplace_back(group, std::move(task));
+        }
+        else if (m_max_queued != 0 && m_queued >= m_max_queued)
+        {
+            ++m_stats.rejected;
+
+            if (group_state.inflight == 0 && group_state.waiting.empty())
+                m_groups.erase(group);
+
+            return false;
+        }
+        else
+        {
+            if (group_state.waiting.empty())
+                m_ready.push_back(group);
+
+            group_state.waiting.push_back(
+                waiting_t{std::move(task), cix::hrticks_now()});
+            ++m_queued;
+            return true;
+        }
+    }
+
+    m_queue_latency.record(0);
+    this->run(tasks);
+
+    return true;
+}
+
+
+void connect_limiter_t::release(group_t group)
+{
+    std::vector<std::pair<group_t, task_t>> tasks;
+
+    {
+        std::scoped_lock lock(m_mutex);
+
+        this->release_locked(group);
+        this->pop_runnable(tasks);
+    }
+
+    this->run(tasks);
+}
+
+
+void connect_limiter_t::clear()
+{
+    std::scoped_lock lock(m_mutex);
+
+    m_groups.clear();
+    m_ready.clear();
+    m_inflight = 0;
+    m_queued = 0;
+}
+
+
+connect_limiter_t::stats_t connect_limiter_t::stats() const
+{
+    cix::lock_guard lock(m_mutex);
+
+    auto stats = m_stats;
+
+    stats.inflight = m_inflight;
+    stats.queued = m_queued;
+
+    lock.unlock();
+
+    stats.queue_latency = m_queue_latency.summary();
+
+    return stats;
+}
+
+
+void connect_limiter_t::release_locked(group_t group)
+{
+    // CAUTION: m_mutex must be locked by caller
+
+    auto group_it = m_groups.find(group);
+    if (group_it == m_groups.end())
+        return;  // cleared in the meantime
+
+    assert(group_it->second.inflight > 0);
+    assert(m_inflight > 0);
+
+    --group_it->second.inflight;
+    --m_inflight;
+
+    if (group_it->second.inflight == 0 && group_it->second.waiting.empty())
+        m_groups.erase(group_it);
+}
+
+
+bool connect_limiter_t::has_room(const group_state_t& group_state) const
+{
+    // CAUTION: m_mutex must be locked by caller
+
+    return
+        (m_max_inflight == 0 || m_inflight < m_max_inflight) &&
+        (m_max_group_inflight == 0 ||
+            group_state.inflight < m_max_group_inflight);
+}
+
+
+void connect_limiter_t::pop_runnable(
+    std::vector<std::pair<group_t, task_t>>& out_tasks)
+{
+    // CAUTION: m_mutex must be locked by caller
+    // one task per group per round, until a whole round could not start any
+
+    std::size_t skipped = 0;
+
+    while (!m_ready.empty() && skipped < m_ready.size() &&
+        (m_max_inflight == 0 || m_inflight < m_max_inflight))
+    {
+        const auto group = m_ready.front();
+        auto& group_state = m_groups[group];
+
+        m_ready.pop_front();
+
+        if (!this->has_room(group_state))
+        {
+            m_ready.push_back(group);
+            ++skipped;
+            continue;
+        }
+
+        auto waiting = std::move(group_state.waiting.front());
+
+        group_state.waiting.pop_front();
+        if (!group_state.waiting.empty())
+            m_ready.push_back(group);
+
+        ++group_state.inflight;
+        ++m_inflight;
+        --m_queued;
+        ++m_stats.admitted;
+        ++m_stats.waited;
+        skipped = 0;
+
+        m_queue_latency.record(cix::hrticks_elapsed(waiting.stamp));
+        out_tasks.emplace_back(group, std::move(waiting.task));
+    }
+}
+
+
+void connect_limiter_t::run(std::vector<std::pair<group_t, task_t>>& tasks)
+{
+    // CAUTION: m_mutex must not be locked by caller
+    // *tasks* may grow meanwhile, see below
+
+    for (std::size_t idx = 0; idx < tasks.size(); ++idx)
+    {
+        const auto group = tasks[idx].first;
+        auto task = std::move(tasks[idx].second);
+
+        if (m_runner(std::move(task)))
+            continue;
+
+        // dropped by runner (e.g. being stopped), so it will not release
+        // itself; the ones it lets go are run by this loop instead of a
+        // recursive call, there may be a lot of them
+        std::scoped_lock lock(m_mutex);
+
+        this->release_locked(group);
+        this->pop_runnable(tasks);
+    }
+}
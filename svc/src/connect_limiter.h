@@ -0,0 +1,101 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// Admission control of the connect jobs of socks_proxy, so that a burst of
+// CONNECT commands does not turn into as many concurrent connect() calls
+//
+// * a task is run through *runner* (e.g. cix::thread_pool::submit()) as long
+//   as fewer than *max_inflight* tasks are running overall, and fewer than
+//   *max_group_inflight* for its group; it must call release() once done
+// * otherwise it waits in the queue of its group, FIFO; groups that have
+//   tasks waiting are served round-robin as running tasks get released, so
+//   that a group that queued a lot does not delay the others
+// * submit() rejects the task if *max_queued* tasks are waiting already
+// * a null limit means no limit
+// * time spent in the queue is recorded, including a null one for the tasks
+//   that did not have to wait
+// * thread-safe; *runner* is never called with the lock held
+class connect_limiter_t
+{
+public:
+    typedef std::uint64_t group_t;
+    typedef std::function<void()> task_t;
+    typedef std::function<bool(task_t&&)> runner_t;  // false if dropped
+
+    enum : std::size_t
+    {
+        default_max_inflight = 32,
+        default_max_group_inflight = 16,
+        default_max_queued = 4096,
+    };
+
+    struct stats_t
+    {
+        std::size_t inflight;     // running
+        std::size_t queued;       // waiting
+        std::uint64_t admitted;   // run so far, queued first or not
+        std::uint64_t waited;     // run so far, queued first
+        std::uint64_t rejected;   // queue was full
+        latency_histogram_t::summary_t queue_latency;
+    };
+
+public:
+    explicit connect_limiter_t(runner_t&& runner);
+    ~connect_limiter_t() = default;
+
+    connect_limiter_t(const connect_limiter_t&) = delete;
+    connect_limiter_t& operator=(const connect_limiter_t&) = delete;
+
+    void configure(
+        std::size_t max_inflight,
+        std::size_t max_group_inflight,
+        std::size_t max_queued);
+
+    // false if rejected, in which case *task* is dropped
+    bool submit(group_t group, task_t&& task);
+
+    // a task of *group* that got run is done, the next ones may go
+    void release(group_t group);
+
+    // forget the tasks waiting, and the ones running
+    void clear();
+
+    stats_t stats() const;
+
+private:
+    struct waiting_t
+    {
+        task_t task;
+        cix::hrticks_t stamp;  // when queued
+    };
+
+    struct group_state_t
+    {
+        std::size_t inflight;
+        std::deque<waiting_t> waiting;
+    };
+
+private:
+    void release_locked(group_t group);
+    bool has_room(const group_state_t& group_state) const;
+    void pop_runnable(std::vector<std::pair<group_t, task_t>>& out_tasks);
+    void run(std::vector<std::pair<group_t, task_t>>& tasks);
+
+private:
+    const runner_t m_runner;
+
+    mutable std::mutex m_mutex;
+    std::size_t m_max_inflight;
+    std::size_t m_max_group_inflight;
+    std::size_t m_max_queued;
+    std::size_t m_inflight;
+    std::size_t m_queued;
+    std::unordered_map<group_t, group_state_t> m_groups;
+    std::deque<group_t> m_ready;  // groups with tasks waiting, round-robin
+    stats_t m_stats;  // counters only, see stats()
+
+    latency_histogram_t m_queue_latency;  // lock-free
+};
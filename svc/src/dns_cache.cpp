@@ -0,0 +1,140 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "main.h"
+
+
+dns_cache::dns_cache()
+    : m_ttl{default_ttl}
+    , m_negative_ttl{default_negative_ttl}
+    , m_max_entries{default_max_entries}
+    , m_stats{}
+{
+}
+
+
+void dns_cache::configure(
+    cix::ticks_t ttl, cix::ticks_t negative_ttl, std::size_t max_entries)
+{
+    std::scoped_lock lock(m_mutex);
+
+    m_ttl = ttl;
+    m_negative_ttl = negative_ttl;
+    m_max_entries = max_entries;
+
+    if (!m_ttl || !m_max_entries)
+        m_entries.clear();
+}
+
+
+bool dns_cache::find(
+    const std::string& host, unsigned short port, int family,
+    addrinfo_ptr& out_addr, int& out_error)
+{
+    const auto now = cix::ticks_now();
+    const key_t key{host, port, family};
+
+    std::scoped_lock lock(m_mutex);
+
+    auto it = m_entries.find(key);
+    if (it != m_entries.end())
+    {
+        if (!this->is_expired(it->second, now))
+        {
+            out_addr = it->second.addr;
+            out_error = it->second.error;
+
+            if (out_error == 0)
+                ++m_stats.hits;
+            else
+                ++m_stats.negative_hits;
+
+            return true;
+        }
+
+        m_entries.erase(it);
+    }
+
+    ++m_stats.misses;
+
+    return false;
+}
+
+
+void dns_cache::insert(
+    const std::string& host, unsigned short port, int family,
+    addrinfo_ptr addr, int error)
+{
+    const auto now = cix::ticks_now();
+
+    assert((error == 0) == static_cast<bool>(addr));
+
+    // only cache definitive failures
+    if (error != 0 && error != EAI_NONAME && error != EAI_FAIL)
+        return;
+
+    std::scoped_lock lock(m_mutex);
+
+    if (!m_max_entries || !(error == 0 ? m_ttl : m_negative_ttl))
+        return;
+
+    if (m_entries.size() >= m_max_entries)
+    {
+        this->purge(now);
+
+        // still full, start over
+        if (m_entries.size() >= m_max_entries)
+            m_entries.clear();
+    }
+
+    m_entries[key_t{host, port, family}] = entry_t{addr, error, now};
+}
+
+
+void dns_cache::clear()
+{
+    std::scoped_lock lock(m_mutex);
+    m_entries.clear();
+}
+
+
+dns_cache::stats_t dns_cache::stats() const
+{
+    std::scoped_lock lock(m_mutex);
+
+    auto stats = m_stats;
+    stats.entries = m_entries.size();
+
+    return stats;
+}
+
+
+dns_cache::addrinfo_ptr dns_cache::make_addrinfo_ptr(struct addrinfo* addr)
+{
+    if (!addr)
+        return nullptr;
+
+    return addrinfo_ptr(addr, [](struct addrinfo* ai) { freeaddrinfo(ai); });
+}
+
+
+void dns_cache::purge(cix::ticks_t now)
+{
+    // CAUTION: m_mutex must be locked by caller
+
+    for (auto it = m_entries.begin(); it != m_entries.end(); )
+    {
+        if (this->is_expired(it->second, now))
+            it = m_entries.erase(it);
+        else
+            ++it;
+    }
+}
+
+
+bool dns_cache::is_expired(const entry_t& entry, cix::ticks_t now) const
+{
+    const auto ttl = entry.error == 0 ? m_ttl : m_negative_ttl;
+
+    return cix::ticks_elapsed(entry.when, now) >= ttl;
+}
@@ -0,0 +1,97 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// An in-process cache of getaddrinfo() results
+//
+// * keyed by (host, port, family)
+// * getaddrinfo() does not give the TTL of a record so a fixed, configurable
+//   lifetime is applied to every entry
+// * definitive failures (i.e. EAI_NONAME, EAI_FAIL) are cached too, with their
+//   own lifetime; transient ones (e.g. EAI_AGAIN) are not
+// * thread-safe
+class dns_cache
+{
+public:
+    typedef std::shared_ptr<struct addrinfo> addrinfo_ptr;
+
+    enum : cix::ticks_t
+    {
+        default_ttl = 60 * cix::ticks_second,
+        default_negative_ttl = 5 * cix::ticks_second,
+    };
+
+    enum : std::size_t { default_max_entries = 1024 };
+
+    struct stats_t
+    {
+        std::uint64_t hits;
+        std::uint64_t negative_hits;
+        std::uint64_t misses;
+        std::size_t entries;
+    };
+
+private:
+    struct key_t
+    {
+        std::string host;
+        unsigned short port;
+        int family;
+
+        bool operator<(const key_t& rhs) const
+        {
+            if (port != rhs.port)
+                return port < rhs.port;
+            if (family != rhs.family)
+                return family < rhs.family;
+            return host < rhs.host;
+        }
+    };
+
+    struct entry_t
+    {
+        addrinfo_ptr addr;  // null if negative entry
+        int error;          // getaddrinfo() result
+        cix::ticks_t when;
+    };
+
+public:
+    dns_cache();
+    ~dns_cache() = default;
+
+    void configure(
+        cix::ticks_t ttl,
+        cix::ticks_t negative_ttl,
+        std::size_t max_entries=default_max_entries);
+
+    // return true on cache hit, in which case *out_error* gets the cached
+    // getaddrinfo() result, and *out_addr* is non-null unless negative entry
+    bool find(
+        const std::string& host, unsigned short port, int family,
+        addrinfo_ptr& out_addr, int& out_error);
+
+    // *addr* is expected to be null if *error* is non-zero
+    void insert(
+        const std::string& host, unsigned short port, int family,
+        addrinfo_ptr addr, int error);
+
+    void clear();
+    stats_t stats() const;
+
+    // take ownership of a getaddrinfo() result
+    static addrinfo_ptr make_addrinfo_ptr(struct addrinfo* addr);
+
+private:
+    void purge(cix::ticks_t now);
+    bool is_expired(const entry_t& entry, cix::ticks_t now) const;
+
+private:
+    mutable std::mutex m_mutex;
+    cix::ticks_t m_ttl;
+    cix::ticks_t m_negative_ttl;
+    std::size_t m_max_entries;
+    std::map<key_t, entry_t> m_entries;
+    stats_t m_stats;
+};
@@ -0,0 +1,269 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "main.h"
+
+#ifdef APP_ETW_ENABLED
+
+namespace detail
+{
+    // a98c38f9-3e85-55e6-7d77-70ef8ad977b0, derived from the provider name
+    static constexpr GUID provider_guid = {
+        0xa98c38f9, 0x3e85, 0x55e6,
+        { 0x7d, 0x77, 0x70, 0xef, 0x8a, 0xd9, 0x77, 0xb0 } };
+
+    // TraceLogging provider traits: UINT16 size, then the nul-terminated name
+    static constexpr char provider_traits[] = "\x12\0Lexfo.Rpc2socks";
+    static_assert(sizeof(provider_traits) == 0x12, "traits size mismatch");
+
+    // channel of TraceLogging events, and the level of all of ours
+    static constexpr UCHAR channel_tracelogging = 11;
+    static constexpr UCHAR level_verbose = 5;  // WINEVENT_LEVEL_VERBOSE
+
+    // EVENT_DATA_DESCRIPTOR_TYPE_*
+    static constexpr UCHAR data_type_user = 0;
+    static constexpr UCHAR data_type_event_metadata = 1;
+    static constexpr UCHAR data_type_provider_metadata = 2;
+
+    static constexpr std::size_t max_fields = 16;
+
+    typedef ULONGLONG reghandle_t;
+
+    // CAUTION: the layout must match the SDK's EVENT_DESCRIPTOR
+    struct event_descriptor_t
+    {
+        USHORT Id;
+        UCHAR Version;
+        UCHAR Channel;
+        UCHAR Level;
+        UCHAR Opcode;
+        USHORT Task;
+        ULONGLONG Keyword;
+    };
+
+    // CAUTION: the layout must match the SDK's EVENT_DATA_DESCRIPTOR
+    struct event_data_descriptor_t
+    {
+        ULONGLONG Ptr;
+        ULONG Size;
+        UCHAR Type;
+        UCHAR Reserved1;
+        USHORT Reserved2;
+    };
+
+    static_assert(sizeof(event_descriptor_t) == 16, "layout mismatch");
+    static_assert(sizeof(event_data_descriptor_t) == 16, "layout mismatch");
+
+    // the filter descriptor is never used, hence void*
+    typedef void (NTAPI* enable_callback_t)(
+        LPCGUID, ULONG, UCHAR, ULONGLONG, ULONGLONG, void*, PVOID);
+    typedef ULONG (WINAPI* event_register_t)(
+        LPCGUID, enable_callback_t, PVOID, reghandle_t*);
+    typedef ULONG (WINAPI* event_unregister_t)(reghandle_t);
+    typedef ULONG (WINAPI* event_write_transfer_t)(
+        reghandle_t, const event_descriptor_t*, LPCGUID, LPCGUID,
+        ULONG, event_data_descriptor_t*);
+
+    // Vista and above
+    struct advapi_t
+    {
+        event_register_t reg;
+        event_unregister_t unreg;
+        event_write_transfer_t write;
+    };
+
+    static std::atomic<reghandle_t> handle{0};
+
+    static const advapi_t& advapi()
+    {
+        // never unloaded, linked to the executable anyway
+        static const auto table = []() -> advapi_t
+        {
+            advapi_t out{nullptr, nullptr, nullptr};
+            const auto module = LoadLibraryW(L"advapi32.dll");
+
+            if (!module)
+                return out;
+
+            out.reg = reinterpret_cast<event_register_t>(
+                GetProcAddress(module, "EventRegister"));
+            out.unreg = reinterpret_cast<event_unregister_t>(
+                GetProcAddress(module, "EventUnregister"));
+            out.write = reinterpret_cast<event_write_transfer_t>(
+                GetProcAddress(module, "EventWriteTransfer"));
+
+            if (!out.reg || !out.unreg || !out.write)
+                out = advapi_t{nullptr, nullptr, nullptr};
+
+            return out;
+        }();
+
+        return table;
+    }
+
+    // called by ETW as sessions enable or disable the provider, with the
+    // level and keywords combined across sessions
+    static void NTAPI enable_callback(
+        LPCGUID source_id, ULONG is_enabled, UCHAR level,
+        ULONGLONG match_any_keyword, ULONGLONG match_all_keyword,
+        void* filter_data, PVOID context)
+    {
+        CIX_UNVAR(source_id);
+        CIX_UNVAR(filter_data);
+        CIX_UNVAR(context);
+
+        // 2 is EVENT_CONTROL_CODE_CAPTURE_STATE, nothing to capture
+        if (is_enabled > 1)
+            return;
+
+        if (!is_enabled || (level != 0 && level < level_verbose))
+        {
+            etw::match_any.store(0, std::memory_order_relaxed);
+            return;
+        }
+
+        // no keyword means all of them
+        etw::match_all.store(match_all_keyword, std::memory_order_relaxed);
+        etw::match_any.store(
+            match_any_keyword ? match_any_keyword : ~ULONGLONG(0),
+            std::memory_order_relaxed);
+    }
+
+    // append the nul-terminated *str* to *meta*, false if it does not fit
+    template <std::size_t N>
+    static bool append(char (&meta)[N], std::size_t& len, const char* str)
+    {
+        const auto size = std::strlen(str) + 1;
+
+        if (size > N - len)
+            return false;
+
+        std::memcpy(&meta[len], str, size);
+        len += size;
+
+        return true;
+    }
+
+    static event_data_descriptor_t data_descriptor(
+        const void* ptr, std::size_t size, UCHAR type)
+    {
+        event_data_descriptor_t out{};
+
+        out.Ptr = reinterpret_cast<ULONGLONG>(ptr);
+        out.Size = static_cast<ULONG>(size);
+        out.Type = type;
+
+        return out;
+    }
+}
+
+
+namespace etw {
+
+std::atomic<ULONGLONG> match_any{0};
+std::atomic<ULONGLONG> match_all{0};
+
+
+void register_provider()
+{
+    const auto& api = detail::advapi();
+    detail::reghandle_t handle = 0;
+
+    // failure is not fatal, events are just never enabled then
+    if (!api.reg ||
+        api.reg(
+            &detail::provider_guid, &detail::enable_callback, nullptr,
+            &handle) != ERROR_SUCCESS)
+    {
+        return;
+    }
+
+    detail::handle.store(handle, std::memory_order_release);
+}
+
+
+void unregister_provider()
+{
+    match_any.store(0, std::memory_order_relaxed);
+
+    const auto handle = detail::handle.exchange(0, std::memory_order_acq_rel);
+
+    if (handle)
+        detail::advapi().unreg(handle);
+}
+
+
+void write(
+    const char* event, ULONGLONG keyword,
+    std::initializer_list<field_t> fields) noexcept
+{
+    assert(fields.size() <= detail::max_fields);
+
+    const auto handle = detail::handle.load(std::memory_order_acquire);
+
+    if (!handle || fields.size() > detail::max_fields)
+        return;
+
+    // TraceLogging event metadata: UINT16 size, UINT8 tags (none), the event
+    // name, then the name and TDH_INTYPE_* of each field
+    char meta[512];
+    std::size_t meta_len = 3;
+
+    meta[2] = 0;
+
+    if (!detail::append(meta, meta_len, event))
+        return;
+
+    for (const auto& field : fields)
+    {
+        if (!detail::append(meta, meta_len, field.name) ||
+            meta_len >= sizeof(meta))
+        {
+            assert(0);
+            return;
+        }
+
+        meta[meta_len++] = static_cast<char>(field.type);
+    }
+
+    const auto meta_size = static_cast<std::uint16_t>(meta_len);
+    std::memcpy(meta, &meta_size, sizeof(meta_size));
+
+    detail::event_data_descriptor_t data[2 + detail::max_fields];
+    ULONG count = 0;
+
+    data[count++] = detail::data_descriptor(
+        detail::provider_traits, sizeof(detail::provider_traits),
+        detail::data_type_provider_metadata);
+    data[count++] = detail::data_descriptor(
+        meta, meta_len, detail::data_type_event_metadata);
+
+    // values are little-endian, so the low bytes of field_t::value come first
+    for (const auto& field : fields)
+    {
+        if (field.type == type_ansistring)
+        {
+            data[count++] = detail::data_descriptor(
+                field.str, std::strlen(field.str) + 1,
+                detail::data_type_user);
+        }
+        else
+        {
+            data[count++] = detail::data_descriptor(
+                &field.value, field.size, detail::data_type_user);
+        }
+    }
+
+    detail::event_descriptor_t desc{};
+
+    desc.Channel = detail::channel_tracelogging;
+    desc.Level = detail::level_verbose;
+    desc.Keyword = keyword;
+
+    detail::advapi().write(handle, &desc, nullptr, nullptr, count, data);
+}
+
+}  // namespace etw
+
+
+#endif  // #ifdef APP_ETW_ENABLED
@@ -0,0 +1,106 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// ETW tracing, through a TraceLogging provider (no manifest to register)
+//
+// * provider name is "Lexfo.Rpc2socks", its GUID is derived from the name the
+//   usual way, so a session can enable it by name, e.g. with
+//   xperf -start rpc2socks -on *Lexfo.Rpc2socks -f rpc2socks.etl
+//   then open the .etl file with WPA
+// * unlike LOGTRACE(), events are compiled in release builds; an event costs
+//   a test of the keywords enabled, its fields are not even evaluated unless
+//   a session listens to its level and keyword
+// * the ETW API is a Vista feature, not visible to our WINVER 0x0500 target;
+//   etw.cpp loads it at runtime and writes the TraceLogging event layout
+//   itself, so that on older systems events are just never enabled
+// * define APP_ETW_DISABLED to compile the provider out
+#ifdef APP_ETW_ENABLED
+
+namespace etw
+{
+    // event keywords, to select the events of interest
+    enum : ULONGLONG
+    {
+        keyword_pipe = 0x1,     // named pipe I/O
+        keyword_proto = 0x2,    // proto packets parsed
+        keyword_socks = 0x4,    // SOCKS requests
+        keyword_target = 0x8,   // SOCKS target I/O
+        keyword_session = 0x10, // SOCKS sessions lifecycle
+    };
+
+    // field types, the TDH_INTYPE_* values of the SDK
+    enum : std::uint8_t
+    {
+        type_ansistring = 2,
+        type_uint8 = 4,
+        type_uint32 = 8,
+        type_uint64 = 10,
+    };
+
+    // a field of an event, see ETWTRACE()
+    struct field_t
+    {
+        const char* name;
+        std::uint8_t type;
+        std::uint8_t size;  // of *value*, 0 for a string
+        std::uint64_t value;
+        const char* str;
+    };
+
+    // keywords of the listening sessions, see the enable callback of etw.cpp
+    extern std::atomic<ULONGLONG> match_any;  // 0 if none listens
+    extern std::atomic<ULONGLONG> match_all;
+
+    void register_provider();
+    void unregister_provider();
+
+    inline bool enabled(ULONGLONG keyword) noexcept
+    {
+        const auto all = match_all.load(std::memory_order_relaxed);
+
+        return
+            (match_any.load(std::memory_order_relaxed) & keyword) != 0 &&
+            (keyword & all) == all;
+    }
+
+    void write(
+        const char* event, ULONGLONG keyword,
+        std::initializer_list<field_t> fields) noexcept;
+
+    inline field_t u8(std::uint8_t value, const char* name) noexcept
+    {
+        return field_t{name, type_uint8, 1, value, nullptr};
+    }
+
+    inline field_t u32(std::uint32_t value, const char* name) noexcept
+    {
+        return field_t{name, type_uint32, 4, value, nullptr};
+    }
+
+    inline field_t u64(std::uint64_t value, const char* name) noexcept
+    {
+        return field_t{name, type_uint64, 8, value, nullptr};
+    }
+
+    inline field_t str(const char* value, const char* name) noexcept
+    {
+        return field_t{name, type_ansistring, 0, 0, value ? value : ""};
+    }
+}
+
+// *event* is a string literal, the variadic part is made of etw field
+// helpers, e.g. etw::u64(value, "Name")
+#define ETWTRACE(event, keyword, ...) \
+    do { \
+        if (etw::enabled(keyword)) \
+            etw::write(event, keyword, { __VA_ARGS__ }); \
+    } while (0)
+
+#else
+
+#define ETWTRACE(event, keyword, ...)  ((void)0)
+
+#endif  // #ifdef APP_ETW_ENABLED
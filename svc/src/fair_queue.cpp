@@ -0,0 +1,137 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "main.h"
+
+
+fair_queue_t::fair_queue_t(std::size_t quantum, bool new_flows_first)
+    : m_quantum{quantum}
+    , m_new_flows_first{new_flows_first}
+    , m_size{0}
+{
+    assert(quantum > 0);
+}
+
+
+bool fair_queue_t::empty() const
+{
+    return m_size == 0;
+}
+
+
+std::size_t fair_queue_t::size() const
+{
+    return m_size;
+}
+
+
+std::size_t fair_queue_t::flow_size(flowid_t flow) const
+{
+    const auto it = m_flows.find(flow);
+
+    return (it == m_flows.end()) ? 0 : it->second.size;
+}
+
+
+void fair_queue_t::push(
+    flowid_t flow, bytes_t&& data, std::uint32_t tag, std::uint64_t stamp)
+{
+    if (data.empty())
+        return;  // would count for nothing
+
+    auto [flow_it, inserted] = m_flows.try_emplace(flow);
+    auto& entry = flow_it->second;
+
+    if (inserted)
+    {
+        entry.size = 0;
+        entry.deficit = static_cast<std::ptrdiff_t>(m_quantum);
+        entry.is_new = m_new_flows_first;
+
+        if (entry.is_new)
+            m_new_flows.push_back(flow);
+        else
+            m_old_flows.push_back(flow);
+    }
+
+    entry.size += data.size();
+    m_size += data.size();
+
+    entry.items.push_back(item_t{std::move(data), tag, stamp});
+}
+
+
+bool fair_queue_t::pop(flowid_t& out_flow, item_t& out_item)
+{
+    for (;;)
+    {
+        const bool from_new = !m_new_flows.empty();
+        auto& list = from_new ? m_new_flows : m_old_flows;
+
+        if (list.empty())
+            return false;
+
+        const auto flow = list.front();
+        auto flow_it = m_flows.find(flow);
+
+        if (flow_it == m_flows.end())
+        {
+            assert(0);
+            list.pop_front();
+            continue;
+        }
+
+        auto& entry = flow_it->second;
+
+        // quantum used up, wait for next round
+        if (entry.deficit <= 0)
+        {
+            entry.deficit += static_cast<std::ptrdiff_t>(m_quantum);
+            entry.is_new = false;
+            list.pop_front();
+            m_old_flows.push_back(flow);
+            continue;
+        }
+
+        if (entry.items.empty())
+        {
+            list.pop_front();
+
+            if (from_new && !m_old_flows.empty())
+            {
+                entry.is_new = false;
+                m_old_flows.push_back(flow);
+            }
+            else
+            {
+                m_flows.erase(flow_it);
+            }
+
+            continue;
+        }
+
+        out_flow = flow;
+        out_item = std::move(entry.items.front());
+        entry.items.pop_front();
+
+        const auto size = out_item.data.size();
+
+        assert(entry.size >= size);
+        assert(m_size >= size);
+
+        entry.size -= size;
+        entry.deficit -= static_cast<std::ptrdiff_t>(size);
+        m_size -= size;
+
+        return true;
+    }
+}
+
+
+void fair_queue_t::clear()
+{
+    m_flows.clear();
+    m_new_flows.clear();
+    m_old_flows.clear();
+    m_size = 0;
+}
@@ -0,0 +1,65 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// A deficit round robin (DRR) scheduler of buffers among flows
+//
+// * buffers of a same flow are popped in the order they were pushed
+// * every backlogged flow is granted *quantum* bytes per round; a buffer is
+//   always popped as a whole so a flow may overdraw its deficit, which it
+//   pays back on the next rounds
+// * if *new_flows_first* is set, a flow that becomes backlogged after having
+//   been idle is served before the others for one quantum, as in FQ-CoDel, so
+//   that sparse interactive flows are not delayed by bulk ones; an emptied
+//   flow goes through the back of the queue once before being forgotten so
+//   that a bulk flow cannot keep being considered new
+// * queued buffers are not copied, only moved
+class fair_queue_t
+{
+public:
+    typedef std::uint8_t byte_t;
+    typedef std::vector<byte_t> bytes_t;
+    typedef std::uint64_t flowid_t;
+
+    struct item_t
+    {
+        bytes_t data;
+        std::uint32_t tag;    // caller-defined
+        std::uint64_t stamp;  // caller-defined
+    };
+
+public:
+    fair_queue_t(std::size_t quantum, bool new_flows_first);
+    ~fair_queue_t() = default;
+
+    bool empty() const;
+    std::size_t size() const;  // bytes queued, all flows
+    std::size_t flow_size(flowid_t flow) const;  // bytes queued
+
+    void push(
+        flowid_t flow, bytes_t&& data,
+        std::uint32_t tag=0, std::uint64_t stamp=0);
+    bool pop(flowid_t& out_flow, item_t& out_item);
+    void clear();
+
+private:
+    struct flow_t
+    {
+        std::deque<item_t> items;
+        std::size_t size;
+        std::ptrdiff_t deficit;
+        bool is_new;  // in m_new_flows, m_old_flows otherwise
+    };
+
+private:
+    std::size_t m_quantum;
+    bool m_new_flows_first;
+    std::size_t m_size;
+
+    // a flow is in one of the lists as long as it is in m_flows
+    std::unordered_map<flowid_t, flow_t> m_flows;
+    std::deque<flowid_t> m_new_flows;
+    std::deque<flowid_t> m_old_flows;
+};
@@ -59,7 +59,7 @@ void fdset_t::unregister_all()
 }
 
 
-fd_set* fdset_t::build_native()
+fd_set* fdset_t::build_native(SOCKET extra)
 {
     // select() alters the content of m_struct's buffer so rebuild its content
     // unconditionally.
@@ -76,10 +76,9 @@ fd_set* fdset_t::build_native()
 
     if (m_size_changed)
     {
+        // room for *extra* too
         const std::size_t required_size =
-            m_set.empty() ?
-            sizeof(_fdset_t) :
-            (sizeof(_fdset_t) + ((m_set.size() - 1) * sizeof(SOCKET)));
+            sizeof(_fdset_t) + (m_set.size() * sizeof(SOCKET));
 
         m_struct.resize(required_size);
 
@@ -100,5 +99,8 @@ fd_set* fdset_t::build_native()
             fds->fd_array[fds->fd_count++] = socket;
     }
 
+    if (extra != INVALID_SOCKET)
+        fds->fd_array[fds->fd_count++] = extra;
+
     return reinterpret_cast<fd_set*>(fds);
 }
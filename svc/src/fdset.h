@@ -29,7 +29,9 @@ public:
     void unregister_socket(SOCKET socket);
     void unregister_all();
 
-    fd_set* build_native();
+    // *extra*, if valid, is appended to the registered sockets, e.g. a socket
+    // meant to wake up a select() call, see socketio::select_wake_t
+    fd_set* build_native(SOCKET extra=INVALID_SOCKET);
 
 private:
     std::set<SOCKET> m_set;
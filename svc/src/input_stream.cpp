@@ -0,0 +1,203 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "main.h"
+
+
+input_stream_t::input_stream_t()
+    : m_block{cix::shared_buffer::make_block(bytes_t())}
+    , m_rpos{0}
+    , m_peak_size{0}
+    , m_feeds{0}
+{
+}
+
+
+input_stream_t::input_stream_t(bytes_t&& data)
+    : m_block{cix::shared_buffer::make_block(std::move(data))}
+    , m_rpos{0}
+    , m_peak_size{0}
+    , m_feeds{0}
+{
+}
+
+
+void input_stream_t::set_buffer_pool(std::shared_ptr<cix::buffer_pool> pool)
+{
+    m_pool = pool;
+
+    // so that the current block goes back to the pool too
+    if (m_pool && !this->is_shared())
+    {
+        m_block = cix::shared_buffer::make_block(
+            std::move(*m_block), m_pool);
+    }
+}
+
+
+bool input_stream_t::empty() const
+{
+    return m_rpos >= m_block->size();
+}
+
+
+std::size_t input_stream_t::size() const
+{
+    assert(m_rpos <= m_block->size());
+    return m_block->size() - m_rpos;
+}
+
+
+const input_stream_t::byte_t* input_stream_t::data() const
+{
+    return m_block->data() + m_rpos;
+}
+
+
+input_stream_t::byte_t* input_stream_t::data()
+{
+    return m_block->data() + m_rpos;
+}
+
+
+input_stream_t::bytes_t input_stream_t::feed(bytes_t&& data)
+{
+    if (data.empty())
+        return std::move(data);
+
+    if (this->empty())
+    {
+        // the current block lives on with its slices, it goes back to the pool
+        // along with the last of them
+        if (this->is_shared())
+        {
+            m_block = cix::shared_buffer::make_block(std::move(data), m_pool);
+            m_rpos = 0;
+            return bytes_t();
+        }
+
+        // nothing left to read, adopt *data* instead of copying it
+        data.swap(*m_block);
+        m_rpos = 0;
+        data.clear();
+        return std::move(data);
+    }
+
+    if (this->is_shared())
+    {
+        // CAUTION: a sliced block must not be modified, unread data goes to a
+        // new one
+        const auto unread_size = this->size();
+        auto merged = m_pool ?
+            m_pool->acquire(unread_size + data.size()) :
+            bytes_t(unread_size + data.size());
+
+        std::memcpy(merged.data(), this->data(), unread_size);
+        std::memcpy(merged.data() + unread_size, data.data(), data.size());
+
+        m_block = cix::shared_buffer::make_block(std::move(merged), m_pool);
+        m_rpos = 0;
+
+        return std::move(data);
+    }
+
+    this->compact();
+
+    m_block->insert(m_block->end(), data.begin(), data.end());
+    this->decay();
+
+    return std::move(data);
+}
+
+
+void input_stream_t::consume(std::size_t size)
+{
+    assert(size <= this->size());
+
+    m_rpos += std::min(size, this->size());
+
+    // CAUTION: clear() does not release memory, this is important for data()
+    if (m_rpos >= m_block->size())
+        this->clear();
+}
+
+
+void input_stream_t::clear()
+{
+    // a sliced block must not be modified, feed() moves on to a new one
+    if (this->is_shared())
+    {
+        m_rpos = m_block->size();
+        return;
+    }
+
+    m_block->clear();
+    m_rpos = 0;
+}
+
+
+cix::shared_buffer input_stream_t::slice(
+    const byte_t* data, std::size_t size) const
+{
+    assert(data >= m_block->data());
+    assert(data + size <= m_block->data() + m_block->size());
+
+    return cix::shared_buffer(
+        m_block, static_cast<std::size_t>(data - m_block->data()), size);
+}
+
+
+bool input_stream_t::is_shared() const
+{
+    // slices are only made by the owner of the stream, so the count may only
+    // be outdated by slices released in the meantime, which is harmless
+    return m_block.use_count() > 1;
+}
+
+
+void input_stream_t::compact()
+{
+    // only move unread data once it occupies less than half of the buffer so
+    // that the cost of the move gets amortized over multiple consume() calls
+    if (m_rpos == 0 || m_rpos < m_block->size() / 2)
+        return;
+
+    m_block->erase(
+        m_block->begin(),
+        std::next(m_block->begin(), static_cast<std::ptrdiff_t>(m_rpos)));
+
+    m_rpos = 0;
+}
+
+
+void input_stream_t::decay()
+{
+    // CAUTION: the block must not be shared; only called by feed(), which is
+    // the only one allowed to invalidate data() pointers
+
+    m_peak_size = std::max(m_peak_size, this->size());
+
+    if (++m_feeds < input_stream_t::shrink_period)
+        return;
+
+    const auto peak_size = std::exchange(m_peak_size, 0);
+    const auto capacity = m_block->capacity();
+
+    m_feeds = 0;
+
+    if (capacity <= input_stream_t::shrink_min_capacity ||
+        peak_size >= capacity / 4)
+    {
+        return;
+    }
+
+    bytes_t shrunk;
+
+    shrunk.reserve(std::max<std::size_t>(
+        peak_size * 2, input_stream_t::shrink_min_capacity));
+    shrunk.assign(this->data(), this->data() + this->size());
+
+    // the old buffer gets freed with *shrunk*
+    m_block->swap(shrunk);
+    m_rpos = 0;
+}
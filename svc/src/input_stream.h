@@ -0,0 +1,72 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// A growable input buffer with a read position
+//
+// * consume() only moves the read position forward so that consuming data from
+//   the front of the buffer is O(1)
+// * unread data is moved back to the front of the buffer lazily, only by
+//   feed() and only once more than half of the buffer has been consumed, so
+//   that the cost of the move is amortized
+// * feed() adopts the fed buffer instead of copying it whenever there is no
+//   unread data left; either way it returns the buffer it does not use anymore
+//   so that caller can recycle it
+// * a pointer returned by data() remains valid until the next call to feed()
+//   (i.e. consume() and clear() never release nor move memory)
+// * slice() returns a view to data read already (e.g. the payload of a packet)
+//   that remains valid regardless of what happens to the stream: the buffer is
+//   a cix::shared_buffer block, which is not modified anymore once sliced;
+//   feed() moves on to a new block instead, copying unread data if any
+// * blocks made by feed() go back to the pool passed to set_buffer_pool(), if
+//   any, once released by the stream and its slices
+// * capacity decays: a buffer that grew for a big packet would otherwise be
+//   kept for the lifetime of the stream, as long as feed() never finds it
+//   empty; so once every *shrink_period* calls to feed(), the buffer gets
+//   reallocated to twice the biggest size it had in the meantime if that is
+//   less than a quarter of its capacity (see decay())
+class input_stream_t
+{
+public:
+    typedef std::uint8_t byte_t;
+    typedef std::vector<byte_t> bytes_t;
+
+    enum : std::size_t
+    {
+        shrink_period = 64,  // feed() calls
+        shrink_min_capacity = 256 * 1024,  // never shrunk below this
+    };
+
+public:
+    input_stream_t();
+    explicit input_stream_t(bytes_t&& data);
+    ~input_stream_t() = default;
+
+    void set_buffer_pool(std::shared_ptr<cix::buffer_pool> pool);
+
+    bool empty() const;
+    std::size_t size() const;
+    const byte_t* data() const;
+    byte_t* data();
+
+    bytes_t feed(bytes_t&& data);
+    void consume(std::size_t size);
+    void clear();
+
+    // *data* must point to the buffer of this stream, read or not
+    cix::shared_buffer slice(const byte_t* data, std::size_t size) const;
+
+private:
+    bool is_shared() const;
+    void compact();
+    void decay();
+
+private:
+    cix::shared_buffer::block_t m_block;  // never null
+    std::size_t m_rpos;
+    std::shared_ptr<cix::buffer_pool> m_pool;
+    std::size_t m_peak_size;  // since the last decay() pass
+    std::size_t m_feeds;  // since the last decay() pass
+};
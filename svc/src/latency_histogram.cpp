@@ -0,0 +1,122 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "main.h"
+
+
+latency_histogram_t::latency_histogram_t()
+    : m_buckets{}
+    , m_count{0}
+    , m_max{0}
+{
+}
+
+
+void latency_histogram_t::record(std::uint64_t value)
+{
+    m_buckets[latency_histogram_t::bucket_of(value)].fetch_add(
+        1, std::memory_order_relaxed);
+
+    m_count.fetch_add(1, std::memory_order_relaxed);
+
+    auto max = m_max.load(std::memory_order_relaxed);
+
+    while (value > max &&
+        !m_max.compare_exchange_weak(max, value, std::memory_order_relaxed))
+    { }
+}
+
+
+latency_histogram_t::summary_t latency_histogram_t::summary() const
+{
+    std::array<std::uint64_t, buckets_count> counts;
+    std::uint64_t total = 0;
+    summary_t summary{};
+
+    // recompute the total from the snapshot so that percentiles are
+    // consistent with it, regardless of concurrent record() calls
+    for (std::size_t idx = 0; idx < buckets_count; ++idx)
+    {
+        counts[idx] = m_buckets[idx].load(std::memory_order_relaxed);
+        total += counts[idx];
+    }
+
+    if (total == 0)
+        return summary;
+
+    // a percentile is the first bucket that reaches its rank, rounded up
+    const std::pair<std::uint64_t*, double> percentiles[] = {
+        { &summary.p50, 0.5 },
+        { &summary.p90, 0.9 },
+        { &summary.p99, 0.99 },
+        { &summary.p999, 0.999 },
+    };
+
+    std::uint64_t seen = 0;
+    std::size_t next = 0;
+
+    for (std::size_t idx = 0;
+        idx < buckets_count && next < cix::countof(percentiles);
+        ++idx)
+    {
+        seen += counts[idx];
+
+        while (next < cix::countof(percentiles))
+        {
+            const auto rank = static_cast<std::uint64_t>(std::ceil(
+                percentiles[next].second * static_cast<double>(total)));
+
+            if (seen < rank)
+                break;
+
+            *percentiles[next].first =
+                latency_histogram_t::bucket_upper_bound(idx);
+            ++next;
+        }
+    }
+
+    summary.count = total;
+    summary.max = m_max.load(std::memory_order_relaxed);
+
+    // the upper bound of a bucket may be above the actual max
+    summary.p50 = std::min(summary.p50, summary.max);
+    summary.p90 = std::min(summary.p90, summary.max);
+    summary.p99 = std::min(summary.p99, summary.max);
+    summary.p999 = std::min(summary.p999, summary.max);
+
+    return summary;
+}
+
+
+std::size_t latency_histogram_t::bucket_of(std::uint64_t value)
+{
+    if (value < sub_buckets_count)
+        return static_cast<std::size_t>(value);
+
+    value = std::min(value, max_value);
+
+    // position of the highest bit set, *sub_bucket_bits* at least
+    std::size_t msb = 0;
+    for (auto tmp = value; tmp > 1; tmp >>= 1)
+        ++msb;
+
+    // the highest *sub_bucket_bits* + 1 bits select the bucket
+    const auto shift = msb - sub_bucket_bits;
+
+    return
+        ((shift + 1) * sub_buckets_count) +
+        static_cast<std::size_t>((value >> shift) - sub_buckets_count);
+}
+
+
+std::uint64_t latency_histogram_t::bucket_upper_bound(std::size_t bucket)
+{
+    if (bucket < sub_buckets_count)
+        return bucket;
+
+    const auto shift = (bucket / sub_buckets_count) - 1;
+    const auto sub = static_cast<std::uint64_t>(
+        (bucket % sub_buckets_count) + sub_buckets_count);
+
+    return ((sub + 1) << shift) - 1;
+}
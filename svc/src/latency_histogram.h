@@ -0,0 +1,66 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// A latency histogram with a bounded relative error, in the spirit of
+// HdrHistogram
+//
+// * values are microseconds; each power of two is split in
+//   *sub_buckets_count* linear buckets, so that a value is known within about
+//   6% whatever its magnitude, for a fixed memory footprint
+// * values above *max_value* are counted in the last bucket
+// * record() is lock-free and can be called concurrently from any thread;
+//   summary() is only a snapshot, it may miss the records made in the
+//   meantime
+class latency_histogram_t
+{
+public:
+    enum : std::size_t
+    {
+        sub_bucket_bits = 4,
+        sub_buckets_count = std::size_t(1) << sub_bucket_bits,
+
+        // highest bit of the highest value, 2^39us is about 6 days
+        max_value_bit = 39,
+
+        buckets_count =
+            (max_value_bit - sub_bucket_bits + 2) * sub_buckets_count,
+    };
+
+    static constexpr std::uint64_t max_value =
+        (std::uint64_t(1) << (max_value_bit + 1)) - 1;
+
+    // values are the upper bound of their bucket, i.e. never below the actual
+    // value they stand for; all zeroes if nothing was recorded
+    struct summary_t
+    {
+        std::uint64_t count;
+        std::uint64_t p50;
+        std::uint64_t p90;
+        std::uint64_t p99;
+        std::uint64_t p999;
+        std::uint64_t max;
+    };
+
+public:
+    latency_histogram_t();
+    ~latency_histogram_t() = default;
+
+    latency_histogram_t(const latency_histogram_t&) = delete;
+    latency_histogram_t& operator=(const latency_histogram_t&) = delete;
+
+    // microseconds, as measured with cix::hrticks_now()
+    void record(std::uint64_t value);
+    summary_t summary() const;
+
+private:
+    static std::size_t bucket_of(std::uint64_t value);
+    static std::uint64_t bucket_upper_bound(std::size_t bucket);
+
+private:
+    std::array<std::atomic<std::uint64_t>, buckets_count> m_buckets;
+    std::atomic<std::uint64_t> m_count;
+    std::atomic<std::uint64_t> m_max;
+};
@@ -9,8 +9,52 @@ namespace logging {
 
 namespace detail
 {
+    struct record_t
+    {
+        level_t level;
+        SYSTEMTIME time;
+        std::wstring msg;
+        std::wstring source;  // "file(line): " prefix of traces
+    };
+
+    // the message written last by async_thread(), in case it gets repeated
+    struct repeat_t
+    {
+        level_t level;
+        std::wstring msg;
+        std::size_t count;      // repeats not reported yet
+        ::cix::ticks_t since;   // when *count* got reported last
+    };
+
+    struct async_t
+    {
+        async_t()
+            : queue(async_t::queue_capacity)
+            , stop{false}
+            , idle{false}
+            , dropped{0}
+            , event{nullptr}
+            { }
+
+        enum : std::size_t
+        {
+            queue_capacity = 4096,  // messages
+        };
+
+        // how often a message repeated in a row gets its count written
+        static constexpr ::cix::ticks_t repeat_interval = ::cix::ticks_second;
+
+        ::cix::mpsc_queue<record_t> queue;
+        std::atomic<bool> stop;
+        std::atomic<bool> idle;  // thread waits for *event*
+        std::atomic<std::uint64_t> dropped;  // queue was full
+        HANDLE event;  // auto-reset
+        std::unique_ptr<std::thread> thread;
+    };
+
     static std::mutex log_mutex;
     static bool enable_dbgout = false;
+    static std::atomic<async_t*> async_backend{nullptr};  // see start_async()
 
     static const wchar_t* level_to_string(level_t level)
     {
@@ -45,6 +89,150 @@ namespace detail
                 return ::cix::wincon::fg_grey;
         }
     }
+
+    static void emit(const record_t& record)
+    {
+        auto output = xstr::fmt(
+            L"{:02}:{:02}:{:02}.{:03} [{}] {}\n",
+            record.time.wHour, record.time.wMinute, record.time.wSecond,
+            record.time.wMilliseconds,
+            level_to_string(record.level), record.msg);
+
+        std::scoped_lock guard(log_mutex);
+
+        // traces always go to debug output, along with their source location
+        if (!record.source.empty())
+            OutputDebugStringW((record.source + output).c_str());
+        else if (enable_dbgout)
+            OutputDebugStringW(output.c_str());
+
+        if (stderr)
+        {
+            ::cix::wincon::write(
+                stderr, output, level_to_wincon_style(record.level));
+        }
+    }
+
+    static void emit_note(level_t level, std::wstring&& msg)
+    {
+        record_t record{level, {}, std::move(msg), {}};
+
+        GetLocalTime(&record.time);
+        emit(record);
+    }
+
+    static void flush_repeat(repeat_t& repeat)
+    {
+        if (repeat.count > 0)
+        {
+            emit_note(
+                repeat.level,
+                xstr::fmt(
+                    L"(last message repeated {} more times)", repeat.count));
+        }
+
+        repeat.count = 0;
+        repeat.since = ::cix::ticks_now();
+    }
+
+    static void async_thread(async_t& async)
+    {
+        record_t record;
+        repeat_t repeat{level_info, {}, 0, 0};
+
+        for (;;)
+        {
+            while (async.queue.try_pop(record))
+            {
+                if (record.level == repeat.level &&
+                    record.source.empty() &&
+                    record.msg == repeat.msg)
+                {
+                    ++repeat.count;
+                    continue;
+                }
+
+                flush_repeat(repeat);
+                emit(record);
+
+                repeat.level = record.level;
+                repeat.msg = record.source.empty() ?
+                    std::move(record.msg) : std::wstring();
+            }
+
+            const auto dropped = async.dropped.exchange(0);
+            if (dropped > 0)
+            {
+                flush_repeat(repeat);
+                repeat.msg.clear();
+                emit_note(
+                    level_warning,
+                    xstr::fmt(L"{} log messages dropped", dropped));
+            }
+
+            // a storm of the same message gets its count once in a while
+            if (repeat.count > 0 &&
+                ::cix::ticks_elapsed(repeat.since) >= async_t::repeat_interval)
+            {
+                flush_repeat(repeat);
+            }
+
+            if (async.stop.load())
+            {
+                if (async.queue.size_approx() > 0)
+                    continue;
+
+                flush_repeat(repeat);
+                break;
+            }
+
+            // see push(); a producer may have published a record before
+            // *idle* got raised, hence the check; one that is still halfway
+            // through try_push() checks *idle* once done
+            // * no timeout unless a repeated message has its count to write
+            async.idle.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            if (async.queue.size_approx() == 0)
+            {
+                DWORD timeout = INFINITE;
+
+                if (repeat.count > 0)
+                {
+                    timeout = static_cast<DWORD>(::cix::ticks_to_go(
+                        repeat.since,
+                        repeat.since + async_t::repeat_interval));
+                }
+
+                WaitForSingleObject(async.event, timeout);
+                wakeups::count();
+            }
+
+            async.idle.store(false);
+        }
+    }
+
+    static void push(record_t&& record)
+    {
+        auto* const async =
+            detail::async_backend.load(std::memory_order_acquire);
+
+        if (!async)
+        {
+            emit(record);
+        }
+        else if (!async->queue.try_push(std::move(record)))
+        {
+            async->dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+        else
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            if (async->idle.exchange(false))
+                SetEvent(async->event);
+        }
+    }
 }
 
 
@@ -55,33 +243,52 @@ void enable_dbgout(bool enable)
 }
 
 
-void write(level_t level, std::string&& msg)
+void start_async()
 {
-    logging::write(level, std::move(xstr::widen_utf8_lenient(msg)));
+    if (detail::async_backend.load())
+        return;
+
+    auto async = std::make_unique<detail::async_t>();
+
+    async->event = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+    if (!async->event)
+        return;  // keep writing synchronously
+
+    async->thread = std::make_unique<std::thread>(
+        detail::async_thread, std::ref(*async));
+
+    detail::async_backend.store(async.release(), std::memory_order_release);
 }
 
 
-void write(level_t level, std::wstring&& msg)
+void stop_async()
 {
-    SYSTEMTIME st;
+    std::unique_ptr<detail::async_t> async(
+        detail::async_backend.exchange(nullptr));
 
-    GetLocalTime(&st);
+    if (!async)
+        return;
 
-    auto output = xstr::fmt(
-        L"{:02}:{:02}:{:02}.{:03} [{}] {}\n",
-        st.wHour, st.wMinute, st.wSecond, st.wMilliseconds,
-        detail::level_to_string(level), std::move(msg));
+    async->stop.store(true);
+    SetEvent(async->event);
 
-    std::scoped_lock guard(detail::log_mutex);
+    async->thread->join();
+    CloseHandle(async->event);
+}
 
-    if (detail::enable_dbgout)
-        OutputDebugStringW(output.c_str());
 
-    if (stderr)
-    {
-        ::cix::wincon::write(
-            stderr, output, detail::level_to_wincon_style(level));
-    }
+void write(level_t level, std::string&& msg)
+{
+    logging::write(level, std::move(xstr::widen_utf8_lenient(msg)));
+}
+
+
+void write(level_t level, std::wstring&& msg)
+{
+    detail::record_t record{level, {}, std::move(msg), {}};
+
+    GetLocalTime(&record.time);
+    detail::push(std::move(record));
 }
 
 
@@ -98,34 +305,14 @@ void trace(const char* src_file, unsigned src_line, std::string&& msg)
 #ifdef _DEBUG
 void trace(const char* src_file, unsigned src_line, std::wstring&& msg)
 {
-    SYSTEMTIME st;
-
-    GetLocalTime(&st);
-
     // CAUTION: widen_utf8_lenient() assumes src_file is utf8-encoded
 
-    auto prefix = xstr::fmt(
-        L"{}({}): ",
-        xstr::widen_utf8_lenient(src_file), src_line);
-
-    auto output = xstr::fmt(
-        L"{}{:02}:{:02}:{:02}.{:03} [{}] {}\n",
-        prefix,
-        st.wHour, st.wMinute, st.wSecond, st.wMilliseconds,
-        detail::level_to_string(level_trace), std::move(msg));
+    detail::record_t record{
+        level_trace, {}, std::move(msg),
+        xstr::fmt(L"{}({}): ", xstr::widen_utf8_lenient(src_file), src_line)};
 
-    // TODO / FIXME: guarantee call order
-
-    std::scoped_lock guard(detail::log_mutex);
-
-    OutputDebugStringW(output.c_str());
-
-    if (stderr)
-    {
-        output.erase(0, prefix.length());
-        ::cix::wincon::write(
-            stderr, output, detail::level_to_wincon_style(level_trace));
-    }
+    GetLocalTime(&record.time);
+    detail::push(std::move(record));
 }
 #endif
 
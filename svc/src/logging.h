@@ -47,6 +47,16 @@ namespace logging
 
     void enable_dbgout(bool enable);
 
+    // once started, messages are still formatted by the calling thread, but
+    // written by a background one, so that callers never wait for the console
+    // * messages are dropped, and counted, if the background thread does not
+    //   keep up
+    // * a message repeated in a row is written once, followed by a count
+    // * stop_async() writes what is pending; CAUTION: it must be called once
+    //   the other threads are done logging
+    void start_async();
+    void stop_async();
+
     template <
         typename String,
         typename... Args,
@@ -2,13 +2,16 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
 #include "main.h"
+#include "bench/loopback.h"
 
 
-static exit_t main_stub_default()
+static exit_t main_stub_default(const config_t& config)
 {
     exit_t exit_code;
     auto service = std::make_shared<svc>();
 
+    service->set_config(config);
+
     exit_code = service->init();
     if (exit_code != APP_EXITCODE_OK)
         return exit_code;
@@ -24,16 +27,51 @@ static exit_t main_stub_default()
 }
 
 
+// loopback test through the real stack, to size a deployment on the very host
+// it is meant for (see bench::host_benchmark())
+static exit_t main_stub_benchmark(const config_t& config)
+{
+    WSADATA wsadata{};
+    if (WSAStartup(MAKEWORD(2, 2), &wsadata) != 0)
+    {
+        LOGERROR("WSAStartup failed");
+        return APP_EXITCODE_API;
+    }
+
+    const auto exit_code = bench::host_benchmark(config);
+
+    WSACleanup();
+
+    return exit_code;
+}
+
+
+static bool parse_config_arg(std::wstring_view arg, config_t& config)
+{
+    bool error = false;
+    return config.parse_arg(arg, error) && !error;
+}
+
+
 #ifdef APP_ENABLE_SERVICE
 static exit_t main_stub_service(std::vector<std::wstring_view>& args)
 {
-    enum action_t { action_default, action_install, action_uninstall };
+    enum action_t {
+        action_default, action_install, action_uninstall, action_benchmark };
 
     action_t action = action_default;
+    config_t args_config;  // defaults + command line only
 
     for (std::size_t idx = 1; idx < args.size(); ++idx)
     {
-        if (args[idx] == L"--install")
+        bool error = false;
+
+        if (args_config.parse_arg(args[idx], error))
+        {
+            if (error)
+                return APP_EXITCODE_ARG;
+        }
+        else if (args[idx] == L"--install")
         {
             if (action != action_default)
             {
@@ -53,6 +91,16 @@ static exit_t main_stub_service(std::vector<std::wstring_view>& args)
 
             action = action_uninstall;
         }
+        else if (args[idx] == L"--benchmark")
+        {
+            if (action != action_default)
+            {
+                LOGERROR("one action allowed per call");
+                return APP_EXITCODE_ARG;
+            }
+
+            action = action_benchmark;
+        }
         else
         {
             LOGERROR(L"unknown arg: {}", args[idx]);
@@ -61,11 +109,32 @@ static exit_t main_stub_service(std::vector<std::wstring_view>& args)
     }
 
     if (action == action_install)
-        return svc::install(true);
+    {
+        return svc::install(true, args_config);
+    }
     else if (action == action_uninstall)
+    {
         return svc::uninstall(std::wstring(), true);
+    }
+    else if (action == action_benchmark)
+    {
+        return main_stub_benchmark(args_config);
+    }
     else if (action == action_default)
-        return main_stub_default();
+    {
+        // registry first, then command line
+        config_t config;
+        std::wstring svc_path;
+        std::wstring svc_name;
+
+        if (svc::auto_name(svc_path, svc_name))
+            config.load_registry(svc_name);
+
+        for (std::size_t idx = 1; idx < args.size(); ++idx)
+            parse_config_arg(args[idx], config);
+
+        return main_stub_default(config);
+    }
 
     assert(0);
     return APP_EXITCODE_ERROR;
@@ -88,6 +157,18 @@ int wmain(int argc, wchar_t* argv[])
     logging::enable_dbgout(true);
 #endif
 
+#ifdef APP_LOGGING_ENABLED
+    logging::start_async();
+#endif
+
+#ifdef APP_ETW_ENABLED
+    etw::register_provider();
+#endif
+
+#ifdef APP_PERF_ENABLED
+    perf_counters::start_provider();
+#endif
+
     int exit_code = APP_EXITCODE_OK;
 
     try
@@ -96,7 +177,6 @@ int wmain(int argc, wchar_t* argv[])
         cix::wincon::set_title(
             xstr::to_string(xpath::title(utils::module_path(nullptr))));
 
-#ifdef APP_ENABLE_SERVICE
         std::vector<std::wstring_view> args;
 
         if (argc > 0)
@@ -106,11 +186,32 @@ int wmain(int argc, wchar_t* argv[])
                 args[idx] = std::wstring_view(argv[idx]);
         }
 
+#ifdef APP_ENABLE_SERVICE
         exit_code = main_stub_service(args);
 #else
-        CIX_UNVAR(argc);
-        CIX_UNVAR(argv);
-        exit_code = main_stub_default();
+        config_t config;
+        bool benchmark = false;
+
+        for (std::size_t idx = 1; idx < args.size(); ++idx)
+        {
+            if (args[idx] == L"--benchmark")
+            {
+                benchmark = true;
+            }
+            else if (!parse_config_arg(args[idx], config))
+            {
+                LOGERROR(L"invalid arg: {}", args[idx]);
+                exit_code = APP_EXITCODE_ARG;
+                break;
+            }
+        }
+
+        if (exit_code == APP_EXITCODE_OK)
+        {
+            exit_code = benchmark ?
+                main_stub_benchmark(config) :
+                main_stub_default(config);
+        }
 #endif
     }
     catch (const std::exception& exc)
@@ -127,8 +228,20 @@ int wmain(int argc, wchar_t* argv[])
         exit_code = APP_EXITCODE_ERROR;
     }
 
+#ifdef APP_LOGGING_ENABLED
+    logging::stop_async();
+#endif
+
     cix::wincon::release();
     // logging::enable_sysevent(false);
 
+#ifdef APP_PERF_ENABLED
+    perf_counters::stop_provider();
+#endif
+
+#ifdef APP_ETW_ENABLED
+    etw::unregister_provider();
+#endif
+
     return exit_code;
 }
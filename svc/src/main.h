@@ -7,6 +7,16 @@
 #define APP_LOGGING_ENABLED
 #endif
 
+#if !defined(APP_ETW_DISABLED) && !defined(APP_ETW_ENABLED) && \
+    defined(_WIN32)
+#define APP_ETW_ENABLED
+#endif
+
+#if !defined(APP_PERF_DISABLED) && !defined(APP_PERF_ENABLED) && \
+    defined(_WIN32)
+#define APP_PERF_ENABLED
+#endif
+
 // bootstrap
 #include "pch/pch.h"
 
@@ -16,16 +26,43 @@ namespace xstr = ::cix::string;
 
 // base
 #include "constants.h"
+#include "config.h"
 
 // utils
 #include "utils.h"
 #include "logging.h"
+#include "etw.h"
+#include "perf_counters.h"
+#include "capture.h"
+#include "thread_tuning.h"
+#include "alloc_profile.h"
+#include "wakeups.h"
 #include "inet_ntop.h"
+#include "input_stream.h"
+#include "compress.h"
+#include "fair_queue.h"
+#include "timer_wheel.h"
+#include "latency_histogram.h"
+#include "rtt_estimator.h"
+#include "mem_budget.h"
+#include "replay_buffer.h"
+#include "spool.h"
+#include "session_trace.h"
 
 // features
 #include "protocol.h"
 #include "fdset.h"
+#include "dns_cache.h"
+#include "resolver.h"
+#include "connect_failure_cache.h"
+#include "connect_limiter.h"
+#include "rate_limiter.h"
+#include "warm_pool.h"
+#include "rio.h"
 #include "socketio.h"
 #include "socks_proxy.h"
+#include "channel_transport.h"
+#include "pipe_transport.h"
+#include "tcp_transport.h"
 #include "svc.h"
 #include "svc_worker.h"
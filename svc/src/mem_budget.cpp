@@ -0,0 +1,87 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "main.h"
+
+
+mem_budget_t::mem_budget_t()
+    : m_session_budget{0}
+    , m_client_budget{0}
+    , m_global_budget{0}
+    , m_resume_mark{0}
+    , m_used{0}
+    , m_peak{0}
+    , m_exhausted{false}
+{
+}
+
+
+void mem_budget_t::set_budgets(
+    std::size_t session, std::size_t client, std::size_t global)
+{
+    m_session_budget = session;
+    m_client_budget = client;
+    m_global_budget = global;
+    m_resume_mark = global / 100 * mem_budget_t::resume_percent;
+}
+
+
+void mem_budget_t::charge(std::size_t bytes)
+{
+    if (bytes == 0)
+        return;
+
+    const auto used =
+        m_used.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+
+    auto peak = m_peak.load(std::memory_order_relaxed);
+
+    while (used > peak &&
+        !m_peak.compare_exchange_weak(peak, used, std::memory_order_relaxed))
+    { }
+
+    if (m_global_budget != 0 &&
+        used > m_global_budget &&
+        !m_exhausted.load(std::memory_order_relaxed) &&
+        !m_exhausted.exchange(true, std::memory_order_relaxed))
+    {
+        LOGWARNING(
+            "memory budget exhausted ({} bytes queued), shedding load", used);
+    }
+}
+
+
+void mem_budget_t::discharge(std::size_t bytes)
+{
+    if (bytes == 0)
+        return;
+
+    const auto used = m_used.fetch_sub(bytes, std::memory_order_relaxed);
+
+    assert(used >= bytes);
+
+    if (used - bytes <= m_resume_mark &&
+        m_exhausted.load(std::memory_order_relaxed) &&
+        m_exhausted.exchange(false, std::memory_order_relaxed))
+    {
+        LOGINFO("memory budget back to normal ({} bytes queued)", used - bytes);
+    }
+}
+
+
+std::size_t mem_budget_t::used() const
+{
+    return m_used.load(std::memory_order_relaxed);
+}
+
+
+std::size_t mem_budget_t::peak() const
+{
+    return m_peak.load(std::memory_order_relaxed);
+}
+
+
+bool mem_budget_t::is_exhausted() const
+{
+    return m_exhausted.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,62 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// Accounting of the memory held by queued data, against budgets
+//
+// * a single instance is shared by the components that queue data, which
+//   charge() the bytes they hold and discharge() them once released: socketio
+//   (write queues of the SOCKS targets) and svc_worker (the received data
+//   not handed to the worker thread yet, and the output not written yet, of
+//   the channels)
+// * budgets are in bytes, 0 for no limit:
+//   * *session*: max size of the write queue of a SOCKS target; client side
+//     cannot be asked to stop sending to a single session, so that a session
+//     going above it gets shed (see socketio::set_write_queue_max_size())
+//   * *client*: reading from the SOCKS targets assigned to a write channel of
+//     a client is paused once its pending output goes above it, and resumed
+//     below a quarter of it (see svc_worker::channel_t::is_flow_change_due())
+//   * *global*: above it, the budget is exhausted: new CONNECT commands are
+//     refused, and write channels stop reading from their SOCKS targets as
+//     soon as they are above a quarter of the client budget; the state is
+//     left once usage went back below *resume_percent* of it
+// * lock-free, counters are relaxed so that budgets are soft limits
+class mem_budget_t
+{
+public:
+    enum : std::size_t { resume_percent = 75 };
+
+public:
+    mem_budget_t();
+    ~mem_budget_t() = default;
+
+    mem_budget_t(const mem_budget_t&) = delete;
+    mem_budget_t& operator=(const mem_budget_t&) = delete;
+
+    // must be called before anything gets charged
+    void set_budgets(
+        std::size_t session, std::size_t client, std::size_t global);
+
+    std::size_t session_budget() const { return m_session_budget; }
+    std::size_t client_budget() const { return m_client_budget; }
+    std::size_t global_budget() const { return m_global_budget; }
+
+    void charge(std::size_t bytes);
+    void discharge(std::size_t bytes);
+
+    std::size_t used() const;  // bytes charged
+    std::size_t peak() const;  // highest used() so far
+    bool is_exhausted() const;
+
+private:
+    std::size_t m_session_budget;
+    std::size_t m_client_budget;
+    std::size_t m_global_budget;
+    std::size_t m_resume_mark;  // see resume_percent
+
+    std::atomic<std::size_t> m_used;
+    std::atomic<std::size_t> m_peak;
+    std::atomic<bool> m_exhausted;
+};
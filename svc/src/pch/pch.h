@@ -20,6 +20,7 @@
     // defaults to windsock1 unless WIN32_LEAN_AND_MEAN is defined
     #include <winsock2.h>
     #include <ws2tcpip.h>
+    #include <mstcpip.h>
     #include <iphlpapi.h>
 
     #if defined(__DEBUG) || defined(_DEBUG) || defined(DEBUG)
@@ -85,13 +86,23 @@
 
 // c++ threading
 #include <atomic>
+#include <condition_variable>
 #include <mutex>
+#include <shared_mutex>
 #include <thread>
 
 // windows extra headers
 #ifdef _WIN32
     #include <io.h>
     #include <shellapi.h>
+    #include <winperf.h>
+#endif
+
+// SSE2 intrinsics: baseline of x64, and of x86 since VS2012 (/arch:SSE2)
+#if defined(_M_X64) || defined(__SSE2__) || \
+    (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+    #define APP_SSE2_ENABLED
+    #include <emmintrin.h>
 #endif
 
 // unix extra headers
@@ -0,0 +1,693 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "main.h"
+
+#ifdef APP_PERF_ENABLED
+
+namespace perf_counters {
+
+namespace detail
+{
+    // 7a646683-26de-485b-8bef-12a61b3fe6ad
+    static const GUID provider_guid = {
+        0x7a646683, 0x26de, 0x485b,
+        { 0x8b, 0xef, 0x12, 0xa6, 0x1b, 0x3f, 0xe6, 0xad } };
+
+    // ff7cea43-a7de-43f8-9acf-da81a40a7dcb
+    static const GUID counterset_guid = {
+        0xff7cea43, 0xa7de, 0x43f8,
+        { 0x9a, 0xcf, 0xda, 0x81, 0xa4, 0x0a, 0x7d, 0xcb } };
+
+    static const char* const provider_guid_str =
+        "{7a646683-26de-485b-8bef-12a61b3fe6ad}";
+    static const char* const counterset_guid_str =
+        "{ff7cea43-a7de-43f8-9acf-da81a40a7dcb}";
+
+    // PERF_COLLECT_START, Windows 7 and above
+    enum : ULONG { request_collect_start = 5 };
+
+    // the <perflib.h> values we use
+    enum : ULONG
+    {
+        counterset_multi_instances = 2,  // PERF_COUNTERSET_MULTI_INSTANCES
+        detail_novice = 100,             // PERF_DETAIL_NOVICE
+    };
+    enum : ULONGLONG { attrib_no_displayable = 0x2 };
+
+    typedef ULONG (WINAPI* control_callback_t)(ULONG, PVOID, ULONG);
+
+    // CAUTION: the layout must match the SDK's PERF_PROVIDER_CONTEXT; the
+    // memory routines are never used, hence void*
+    struct provider_context_t
+    {
+        DWORD ContextSize;
+        DWORD Reserved;
+        control_callback_t ControlCallback;
+        void* MemAllocRoutine;
+        void* MemFreeRoutine;
+        LPVOID pMemContext;
+    };
+
+    // CAUTION: the layout must match the SDK's PERF_COUNTERSET_INFO
+    struct counterset_info_t
+    {
+        GUID CounterSetGuid;
+        GUID ProviderGuid;
+        ULONG NumCounters;
+        ULONG InstanceType;
+    };
+
+    // CAUTION: the layout must match the SDK's PERF_COUNTER_INFO
+    struct counter_info_t
+    {
+        ULONG CounterId;
+        ULONG Type;
+        ULONGLONG Attrib;
+        ULONG Size;
+        ULONG DetailLevel;
+        LONG Scale;
+        ULONG Offset;
+    };
+
+    // the block of an instance, PERF_COUNTERSET_INSTANCE, opaque to us
+    struct counterset_instance_t;
+
+    typedef ULONG (WINAPI* start_provider_t)(
+        LPGUID, provider_context_t*, PHANDLE);
+    typedef ULONG (WINAPI* stop_provider_t)(HANDLE);
+    typedef ULONG (WINAPI* set_counterset_info_t)(
+        HANDLE, counterset_info_t*, ULONG);
+    typedef counterset_instance_t* (WINAPI* create_instance_t)(
+        HANDLE, LPCGUID, PCWSTR, ULONG);
+    typedef ULONG (WINAPI* delete_instance_t)(
+        HANDLE, counterset_instance_t*);
+    typedef ULONG (WINAPI* set_ulong_t)(
+        HANDLE, counterset_instance_t*, ULONG, ULONG);
+    typedef ULONG (WINAPI* set_ulonglong_t)(
+        HANDLE, counterset_instance_t*, ULONG, ULONGLONG);
+
+    typedef DWORD (WINAPI* load_text_strings_t)(LPWSTR, BOOL);
+    typedef DWORD (WINAPI* unload_text_strings_t)(LPWSTR, BOOL);
+
+    // Vista and above
+    struct perflib_t
+    {
+        start_provider_t start;
+        stop_provider_t stop;
+        set_counterset_info_t set_info;
+        create_instance_t create;
+        delete_instance_t remove;
+        set_ulong_t set_ulong;
+        set_ulonglong_t set_ulonglong;
+    };
+
+    struct loadperf_t
+    {
+        load_text_strings_t load;
+        unload_text_strings_t unload;
+    };
+
+    enum kind_t
+    {
+        kind_gauge,     // as is
+        kind_rate,      // per second, from a total
+        kind_fraction,  // percentage over the sample, of the base that follows
+        kind_base,      // denominator of the fraction right before it
+    };
+
+    struct counter_t
+    {
+        kind_t kind;
+        std::uint64_t values_t::* value;
+        const char* uri;  // unique within the counter set
+        const char* name;
+        const char* description;
+    };
+
+    // CAUTION: the ID of a counter is its index + 1, which is what consumers
+    // and the registered manifest know it by, so this table is append-only
+    static const counter_t counters[] = {
+        { kind_gauge, &values_t::clients, "Clients",
+            "Clients",
+            "Clients connected to the worker" },
+        { kind_gauge, &values_t::channels, "Channels",
+            "Channels",
+            "Channels open, pipe instances and TCP connections" },
+        { kind_gauge, &values_t::sessions, "Sessions",
+            "SOCKS Sessions",
+            "SOCKS connections open" },
+        { kind_rate, &values_t::pipe_bytes_in, "PipeBytesIn",
+            "Channel Bytes Received/sec",
+            "Rate of the bytes received from clients" },
+        { kind_rate, &values_t::pipe_bytes_out, "PipeBytesOut",
+            "Channel Bytes Sent/sec",
+            "Rate of the bytes sent to clients" },
+        { kind_rate, &values_t::target_bytes_in, "TargetBytesIn",
+            "Target Bytes Received/sec",
+            "Rate of the bytes received from SOCKS targets" },
+        { kind_rate, &values_t::target_bytes_out, "TargetBytesOut",
+            "Target Bytes Sent/sec",
+            "Rate of the bytes sent to SOCKS targets" },
+        { kind_gauge, &values_t::pipe_output_queue, "PipeOutputQueue",
+            "Channel Output Queue Bytes",
+            "Bytes waiting to be written to clients" },
+        { kind_gauge, &values_t::target_write_queue, "TargetWriteQueue",
+            "Target Write Queue Bytes",
+            "Bytes waiting to be written to SOCKS targets" },
+        { kind_gauge, &values_t::pending_requests, "PendingRequests",
+            "Pending SOCKS Requests",
+            "SOCKS requests waiting to be handled" },
+        { kind_gauge, &values_t::connects_queued, "ConnectsQueued",
+            "Queued Connects",
+            "CONNECT commands waiting for admission" },
+        { kind_rate, &values_t::connects, "Connects",
+            "Connects/sec",
+            "Rate of the CONNECT commands completed, failed or not" },
+        { kind_rate, &values_t::connects_failed, "ConnectsFailed",
+            "Connect Failures/sec",
+            "Rate of the CONNECT commands that failed" },
+        { kind_fraction, &values_t::buffer_pool_hits, "BufferPoolHits",
+            "Buffer Pool Hit %",
+            "I/O buffers recycled from the pool, over the sample" },
+        { kind_base, &values_t::buffer_pool_lookups, "BufferPoolLookups",
+            "Buffer Pool Lookups",
+            "Base of Buffer Pool Hit %" },
+        { kind_fraction, &values_t::warm_pool_hits, "WarmPoolHits",
+            "Warm Pool Hit %",
+            "CONNECT to a warm target served a pre-connected socket" },
+        { kind_base, &values_t::warm_pool_lookups, "WarmPoolLookups",
+            "Warm Pool Lookups",
+            "Base of Warm Pool Hit %" },
+        { kind_fraction, &values_t::dns_cache_hits, "DnsCacheHits",
+            "DNS Cache Hit %",
+            "Resolutions served from the DNS cache, over the sample" },
+        { kind_base, &values_t::dns_cache_lookups, "DnsCacheLookups",
+            "DNS Cache Lookups",
+            "Base of DNS Cache Hit %" },
+        { kind_gauge, &values_t::mem_used, "MemUsed",
+            "Memory Used Bytes",
+            "Bytes buffered, as accounted by the memory budget" },
+    };
+
+    struct instance_state_t
+    {
+        counterset_instance_t* block;
+        collector_t collector;
+    };
+
+    // protects all of the below, and serializes the collectors
+    static std::mutex mutex;
+    static HANDLE provider = nullptr;
+    static instance_t last_instance = 0;
+    static std::map<instance_t, instance_state_t> instances;
+
+    static const perflib_t& perflib()
+    {
+        // never unloaded, advapi32 is linked to the executable anyway
+        static const auto table = []() -> perflib_t
+        {
+            perflib_t out{};
+            const auto module = LoadLibraryW(L"advapi32.dll");
+
+            if (!module)
+                return out;
+
+            out.start = reinterpret_cast<start_provider_t>(
+                GetProcAddress(module, "PerfStartProviderEx"));
+            out.stop = reinterpret_cast<stop_provider_t>(
+                GetProcAddress(module, "PerfStopProvider"));
+            out.set_info = reinterpret_cast<set_counterset_info_t>(
+                GetProcAddress(module, "PerfSetCounterSetInfo"));
+            out.create = reinterpret_cast<create_instance_t>(
+                GetProcAddress(module, "PerfCreateInstance"));
+            out.remove = reinterpret_cast<delete_instance_t>(
+                GetProcAddress(module, "PerfDeleteInstance"));
+            out.set_ulong = reinterpret_cast<set_ulong_t>(
+                GetProcAddress(module, "PerfSetULongCounterValue"));
+            out.set_ulonglong = reinterpret_cast<set_ulonglong_t>(
+                GetProcAddress(module, "PerfSetULongLongCounterValue"));
+
+            if (!out.start || !out.stop || !out.set_info || !out.create ||
+                !out.remove || !out.set_ulong || !out.set_ulonglong)
+            {
+                out = perflib_t{};
+            }
+
+            return out;
+        }();
+
+        return table;
+    }
+
+    static const loadperf_t& loadperf()
+    {
+        // never unloaded, only used by install() and uninstall()
+        static const auto table = []() -> loadperf_t
+        {
+            loadperf_t out{};
+            const auto module = LoadLibraryW(L"loadperf.dll");
+
+            if (!module)
+                return out;
+
+            out.load = reinterpret_cast<load_text_strings_t>(
+                GetProcAddress(module, "LoadPerfCounterTextStringsW"));
+            out.unload = reinterpret_cast<unload_text_strings_t>(
+                GetProcAddress(module, "UnloadPerfCounterTextStringsW"));
+
+            if (!out.load || !out.unload)
+                out = loadperf_t{};
+
+            return out;
+        }();
+
+        return table;
+    }
+
+    static ULONG to_perf_type(kind_t kind)
+    {
+        switch (kind)
+        {
+            case kind_rate:
+                return PERF_COUNTER_BULK_COUNT;
+            case kind_fraction:
+                return PERF_SAMPLE_FRACTION;
+            case kind_base:
+                return PERF_SAMPLE_BASE;
+            case kind_gauge:
+            default:
+                return PERF_COUNTER_LARGE_RAWCOUNT;
+        }
+    }
+
+    static const char* to_manifest_type(kind_t kind)
+    {
+        switch (kind)
+        {
+            case kind_rate:
+                return "perf_counter_bulk_count";
+            case kind_fraction:
+                return "perf_sample_fraction";
+            case kind_base:
+                return "perf_sample_base";
+            case kind_gauge:
+            default:
+                return "perf_counter_large_rawcount";
+        }
+    }
+
+    // fractions and their base are 32-bit counters; consumers only look at
+    // the difference between two samples, so wrapping is harmless
+    static bool is_dword(kind_t kind)
+    {
+        return kind == kind_fraction || kind == kind_base;
+    }
+
+    static std::string xml_escape(std::string_view str)
+    {
+        std::string out;
+
+        out.reserve(str.size());
+
+        for (const auto c : str)
+        {
+            switch (c)
+            {
+                case '&': out += "&amp;"; break;
+                case '<': out += "&lt;"; break;
+                case '>': out += "&gt;"; break;
+                case '"': out += "&quot;"; break;
+                default: out.push_back(c); break;
+            }
+        }
+
+        return out;
+    }
+
+    static std::wstring manifest_path(const std::wstring& exe_path)
+    {
+        return std::wstring(xpath::strip_ext(exe_path)) + L".man";
+    }
+
+    static std::wstring exe_dir(const std::wstring& exe_path)
+    {
+        auto dir = exe_path.substr(
+            0, exe_path.size() - xpath::name(exe_path).size());
+
+        // a trailing backslash would escape the closing quote, see install()
+        while (!dir.empty() && xpath::is_sep(dir.back()))
+            dir.pop_back();
+
+        return dir;
+    }
+
+    static bool write_manifest(
+        const std::wstring& path, const std::wstring& exe_path)
+    {
+        std::string xml;
+
+        xml +=
+            "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+            "<instrumentationManifest"
+            " xmlns=\"http://schemas.microsoft.com/win/2004/08/events\">\n"
+            "  <instrumentation>\n"
+            "    <counters"
+            " xmlns=\"http://schemas.microsoft.com/win/2005/12/counters\""
+            " schemaVersion=\"2.0\">\n";
+
+        xml += "      <provider providerName=\"Lexfo.Rpc2socks\"";
+        xml += " providerGuid=\"";
+        xml += provider_guid_str;
+        xml += "\" applicationIdentity=\"";
+        xml += xml_escape(xstr::narrow_to_utf8_lenient(
+            std::wstring(xpath::name(exe_path))));
+        xml += "\" providerType=\"userMode\" callback=\"custom\">\n";
+
+        xml += "        <counterSet guid=\"";
+        xml += counterset_guid_str;
+        xml +=
+            "\" uri=\"Lexfo.Rpc2socks.Worker\" name=\"rpc2socks\""
+            " description=\"Workers of the rpc2socks service\""
+            " instances=\"multiple\">\n";
+
+        for (std::size_t idx = 0; idx < std::size(counters); ++idx)
+        {
+            const auto& counter = counters[idx];
+
+            xml += "          <counter id=\"";
+            xml += std::to_string(idx + 1);
+            xml += "\" uri=\"Lexfo.Rpc2socks.Worker.";
+            xml += counter.uri;
+            xml += "\" name=\"";
+            xml += xml_escape(counter.name);
+            xml += "\" description=\"";
+            xml += xml_escape(counter.description);
+            xml += "\" type=\"";
+            xml += to_manifest_type(counter.kind);
+            xml += "\" detailLevel=\"standard\"";
+
+            if (counter.kind == kind_fraction)
+            {
+                xml += " baseID=\"";
+                xml += std::to_string(idx + 2);
+                xml += "\"";
+            }
+
+            if (counter.kind == kind_base)
+            {
+                xml +=
+                    ">\n"
+                    "            <counterAttributes>\n"
+                    "              <counterAttribute name=\"noDisplay\"/>\n"
+                    "            </counterAttributes>\n"
+                    "          </counter>\n";
+            }
+            else
+            {
+                xml += "/>\n";
+            }
+        }
+
+        xml +=
+            "        </counterSet>\n"
+            "      </provider>\n"
+            "    </counters>\n"
+            "  </instrumentation>\n"
+            "</instrumentationManifest>\n";
+
+        auto* file = _wfopen(path.c_str(), L"wb");
+        if (!file)
+        {
+            LOGERROR(L"failed to create manifest {} (errno {})", path, errno);
+            return false;
+        }
+
+        const bool written =
+            std::fwrite(xml.data(), 1, xml.size(), file) == xml.size();
+
+        if (std::fclose(file) != 0 || !written)
+        {
+            LOGERROR(L"failed to write manifest {}", path);
+            return false;
+        }
+
+        return true;
+    }
+
+    // *command* is a lodctr or unlodctr command line
+    static DWORD run_loadperf(bool load, std::wstring command)
+    {
+        const auto& api = loadperf();
+
+        if (!api.load)
+            return ERROR_PROC_NOT_FOUND;
+
+        return load ?
+            api.load(command.data(), TRUE) :
+            api.unload(command.data(), TRUE);
+    }
+
+    static void collect()
+    {
+        std::scoped_lock lock(mutex);
+
+        if (!provider)
+            return;
+
+        for (auto& inst_it : instances)
+        {
+            auto& inst = inst_it.second;
+            values_t values{};
+
+            inst.collector(values);
+
+            for (std::size_t idx = 0; idx < std::size(counters); ++idx)
+            {
+                const auto& counter = counters[idx];
+                const auto id = static_cast<ULONG>(idx + 1);
+                const auto value = values.*counter.value;
+
+                if (is_dword(counter.kind))
+                {
+                    perflib().set_ulong(
+                        provider, inst.block, id, static_cast<ULONG>(value));
+                }
+                else
+                {
+                    perflib().set_ulonglong(
+                        provider, inst.block, id, value);
+                }
+            }
+        }
+    }
+
+    static ULONG WINAPI control_callback(
+        ULONG request, PVOID buffer, ULONG buffer_size)
+    {
+        CIX_UNVAR(buffer);
+        CIX_UNVAR(buffer_size);
+
+        // a consumer is about to read the counters
+        if (request == request_collect_start)
+            collect();
+
+        return ERROR_SUCCESS;
+    }
+}
+
+
+bool install(const std::wstring& exe_path)
+{
+    const auto manifest_path = detail::manifest_path(exe_path);
+
+    if (!detail::write_manifest(manifest_path, exe_path))
+        return false;
+
+    // the counter set of a former install may differ
+    detail::run_loadperf(false, L"unlodctr /m:\"" + manifest_path + L"\"");
+
+    const auto error = detail::run_loadperf(
+        true,
+        L"lodctr /m:\"" + manifest_path + L"\" \"" +
+            detail::exe_dir(exe_path) + L"\"");
+
+    if (error != ERROR_SUCCESS)
+    {
+        LOGERROR(
+            L"failed to register performance counters from {} (error {})",
+            manifest_path, error);
+        return false;
+    }
+
+    return true;
+}
+
+
+bool uninstall(const std::wstring& exe_path)
+{
+    // unlodctr needs the manifest too, which may be gone already
+    const auto manifest_path = detail::manifest_path(exe_path);
+
+    if (!detail::write_manifest(manifest_path, exe_path))
+        return false;
+
+    const auto error = detail::run_loadperf(
+        false, L"unlodctr /m:\"" + manifest_path + L"\"");
+
+    DeleteFileW(manifest_path.c_str());
+
+    if (error != ERROR_SUCCESS)
+    {
+        LOGERROR(
+            "failed to unregister performance counters (error {})", error);
+        return false;
+    }
+
+    return true;
+}
+
+
+void start_provider()
+{
+    std::scoped_lock lock(detail::mutex);
+
+    if (detail::provider)
+        return;
+
+    const auto& api = detail::perflib();
+
+    if (!api.start)
+    {
+        LOGDEBUG("performance counters not supported by the system");
+        return;
+    }
+
+    auto provider_guid = detail::provider_guid;
+    detail::provider_context_t context{};
+    HANDLE provider = nullptr;
+
+    context.ContextSize = sizeof(context);
+    context.ControlCallback = &detail::control_callback;
+
+    auto error = api.start(&provider_guid, &context, &provider);
+    if (error != ERROR_SUCCESS)
+    {
+        LOGDEBUG("performance counters not available (error {})", error);
+        return;
+    }
+
+    constexpr auto counters_count = std::size(detail::counters);
+    std::vector<std::uint8_t> info_buffer(
+        sizeof(detail::counterset_info_t) +
+        (counters_count * sizeof(detail::counter_info_t)));
+
+    auto* info =
+        reinterpret_cast<detail::counterset_info_t*>(info_buffer.data());
+    auto* counter_info = reinterpret_cast<detail::counter_info_t*>(info + 1);
+
+    info->CounterSetGuid = detail::counterset_guid;
+    info->ProviderGuid = detail::provider_guid;
+    info->NumCounters = static_cast<ULONG>(counters_count);
+    info->InstanceType = detail::counterset_multi_instances;
+
+    // one 64-bit slot per counter in the block of an instance, whatever its
+    // size
+    for (std::size_t idx = 0; idx < counters_count; ++idx)
+    {
+        const auto kind = detail::counters[idx].kind;
+        auto& counter = counter_info[idx];
+
+        counter.CounterId = static_cast<ULONG>(idx + 1);
+        counter.Type = detail::to_perf_type(kind);
+        counter.Attrib = (kind == detail::kind_base) ?
+            detail::attrib_no_displayable : 0;
+        counter.Size = detail::is_dword(kind) ?
+            sizeof(ULONG) : sizeof(ULONGLONG);
+        counter.DetailLevel = detail::detail_novice;
+        counter.Scale = 0;
+        counter.Offset = static_cast<ULONG>(idx * sizeof(ULONGLONG));
+    }
+
+    // fails if the counter set is not registered, see install()
+    error = api.set_info(
+        provider, info, static_cast<ULONG>(info_buffer.size()));
+    if (error != ERROR_SUCCESS)
+    {
+        LOGDEBUG("performance counters not registered (error {})", error);
+        api.stop(provider);
+        return;
+    }
+
+    detail::provider = provider;
+}
+
+
+void stop_provider()
+{
+    cix::lock_guard lock(detail::mutex);
+
+    const auto provider = detail::provider;
+
+    if (!provider)
+        return;
+
+    for (auto& inst_it : detail::instances)
+        detail::perflib().remove(provider, inst_it.second.block);
+
+    detail::instances.clear();
+    detail::provider = nullptr;
+
+    // a collect may be waiting for the lock, it must not block the stop
+    lock.unlock();
+
+    detail::perflib().stop(provider);
+}
+
+
+instance_t add_instance(const std::wstring& name, collector_t&& collector)
+{
+    assert(collector);
+
+    std::scoped_lock lock(detail::mutex);
+
+    if (!detail::provider)
+        return 0;
+
+    const auto instance = ++detail::last_instance;
+    const auto block = detail::perflib().create(
+        detail::provider, &detail::counterset_guid, name.c_str(), instance);
+
+    if (!block)
+    {
+        LOGWARNING(
+            L"failed to create performance counters instance {} (error {})",
+            name, GetLastError());
+        return 0;
+    }
+
+    detail::instances.emplace(
+        instance, detail::instance_state_t{block, std::move(collector)});
+
+    return instance;
+}
+
+
+void remove_instance(instance_t instance)
+{
+    if (instance == 0)
+        return;
+
+    std::scoped_lock lock(detail::mutex);
+
+    const auto inst_it = detail::instances.find(instance);
+    if (inst_it == detail::instances.end())
+        return;  // provider stopped meanwhile
+
+    detail::perflib().remove(detail::provider, inst_it->second.block);
+    detail::instances.erase(inst_it);
+}
+
+}  // namespace perf_counters
+
+#endif  // #ifdef APP_PERF_ENABLED
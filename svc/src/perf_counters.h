@@ -0,0 +1,80 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// Windows performance counters, through a PerfLib v2 provider, so that the
+// metrics of the service show in PerfMon and the like without having to
+// connect a client (unlike op_stats)
+//
+// * one "rpc2socks" counter set, with one instance per worker named after the
+//   pipe it serves (e.g. "rpc2socks", "rpc2socks-1")
+// * the provider is registered with the system by install(), i.e. lodctr /m
+//   with a manifest generated next to the executable from the same table as
+//   the counter set, so both cannot get out of sync; see svc::install()
+// * pull model: the values of an instance are collected only when a consumer
+//   queries them (PERF_COLLECT_START, Windows 7+), by its collector, so that
+//   nothing runs as long as nobody looks
+// * rates (per second) and hit ratios are computed by consumers from the
+//   cumulative values, i.e. collectors only report totals and gauges
+// * best effort: the service runs the same without the counters, failures
+//   are only logged
+// * the PerfLib v2 API is a Vista feature, not visible to our WINVER 0x0500
+//   target; it is loaded at runtime, as is loadperf.dll, so that on older
+//   systems the provider just does not start
+// * define APP_PERF_DISABLED to compile the provider out
+#ifdef APP_PERF_ENABLED
+
+namespace perf_counters
+{
+    struct values_t
+    {
+        // gauges
+        std::uint64_t clients;
+        std::uint64_t channels;
+        std::uint64_t sessions;             // SOCKS
+        std::uint64_t pipe_output_queue;    // bytes
+        std::uint64_t target_write_queue;   // bytes
+        std::uint64_t pending_requests;     // SOCKS, see socks_proxy
+        std::uint64_t connects_queued;      // see connect_limiter_t
+        std::uint64_t mem_used;             // see mem_budget_t
+
+        // totals
+        std::uint64_t pipe_bytes_in;
+        std::uint64_t pipe_bytes_out;
+        std::uint64_t target_bytes_in;
+        std::uint64_t target_bytes_out;
+        std::uint64_t connects;             // completed, failed or not
+        std::uint64_t connects_failed;
+        std::uint64_t buffer_pool_hits;
+        std::uint64_t buffer_pool_lookups;  // hits and misses
+        std::uint64_t warm_pool_hits;       // see warm_pool_t
+        std::uint64_t warm_pool_lookups;
+        std::uint64_t dns_cache_hits;       // see dns_cache
+        std::uint64_t dns_cache_lookups;
+    };
+
+    // CAUTION: called from a thread of PerfLib, with the lock of the instances
+    // held, i.e. it may not add or remove an instance
+    typedef std::function<void(values_t&)> collector_t;
+
+    typedef std::uint32_t instance_t;  // 0 if none
+
+    // register the counter set with the system, or unregister it, for the
+    // service whose executable is *exe_path*; requires admin rights
+    bool install(const std::wstring& exe_path);
+    bool uninstall(const std::wstring& exe_path);
+
+    void start_provider();
+    void stop_provider();
+
+    // 0 if the provider is not running, or failed to create the instance
+    instance_t add_instance(const std::wstring& name, collector_t&& collector);
+
+    // once returned, the collector of *instance* is not running anymore, and
+    // will not be called again; null *instance* is a no-op
+    void remove_instance(instance_t instance);
+}
+
+#endif  // #ifdef APP_PERF_ENABLED
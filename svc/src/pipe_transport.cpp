@@ -0,0 +1,146 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "main.h"
+
+
+pipe_transport::pipe_transport()
+    : m_server(std::make_shared<cix::win_namedpipe_server>())
+{
+}
+
+
+pipe_transport::~pipe_transport()
+{
+    m_server->set_listener(nullptr);
+    m_server->stop();
+}
+
+
+void pipe_transport::set_listener(
+    std::shared_ptr<channel_transport::listener_t> listener)
+{
+    std::scoped_lock lock(m_mutex);
+    m_listener = listener;
+}
+
+
+bool pipe_transport::launch()
+{
+    // not done by the constructor, shared_from_this() is not usable yet
+    m_server->set_listener(this->shared_from_this());
+    m_server->launch();
+
+    return true;
+}
+
+
+void pipe_transport::stop()
+{
+    m_server->set_listener(nullptr);
+    m_server->stop();
+}
+
+
+bool pipe_transport::send(token_t token, bytes_t&& packet)
+{
+    return m_server->send(token, std::move(packet));
+}
+
+
+bool pipe_transport::send_expedited(token_t token, bytes_t&& packet)
+{
+    return m_server->send_expedited(token, std::move(packet));
+}
+
+
+bool pipe_transport::get_instance_stats(
+    token_t token, instance_stats_t& out_stats) const
+{
+    return m_server->get_instance_stats(token, out_stats);
+}
+
+
+bool pipe_transport::disconnect_instance(token_t token)
+{
+    return m_server->disconnect_instance(token);
+}
+
+
+std::shared_ptr<channel_transport::listener_t> pipe_transport::listener() const
+{
+    std::scoped_lock lock(m_mutex);
+    return m_listener.lock();
+}
+
+
+void pipe_transport::on_namedpipe_connected(
+    std::shared_ptr<cix::win_namedpipe_server> pipe,
+    cix::win_namedpipe_server::instance_token_t pipe_instance_token)
+{
+    CIX_UNVAR(pipe);
+    assert(pipe == m_server);
+
+    auto listener = this->listener();
+
+    if (listener)
+    {
+        listener->on_transport_connected(
+            this->shared_from_this(), pipe_instance_token);
+    }
+}
+
+
+void pipe_transport::on_namedpipe_recv(
+    std::shared_ptr<cix::win_namedpipe_server> pipe,
+    cix::win_namedpipe_server::instance_token_t pipe_instance_token,
+    cix::win_namedpipe_server::bytes_t&& packet)
+{
+    CIX_UNVAR(pipe);
+    assert(pipe == m_server);
+
+    auto listener = this->listener();
+
+    if (listener)
+    {
+        listener->on_transport_recv(
+            this->shared_from_this(), pipe_instance_token, std::move(packet));
+    }
+}
+
+
+void pipe_transport::on_namedpipe_sent(
+    std::shared_ptr<cix::win_namedpipe_server> pipe,
+    cix::win_namedpipe_server::instance_token_t pipe_instance_token,
+    cix::win_namedpipe_server::bytes_t&& packet,
+    std::size_t output_queue_size)
+{
+    CIX_UNVAR(pipe);
+    assert(pipe == m_server);
+
+    auto listener = this->listener();
+
+    if (listener)
+    {
+        listener->on_transport_sent(
+            this->shared_from_this(), pipe_instance_token, std::move(packet),
+            output_queue_size);
+    }
+}
+
+
+void pipe_transport::on_namedpipe_closed(
+    std::shared_ptr<cix::win_namedpipe_server> pipe,
+    cix::win_namedpipe_server::instance_token_t pipe_instance_token)
+{
+    CIX_UNVAR(pipe);
+    assert(pipe == m_server);
+
+    auto listener = this->listener();
+
+    if (listener)
+    {
+        listener->on_transport_closed(
+            this->shared_from_this(), pipe_instance_token);
+    }
+}
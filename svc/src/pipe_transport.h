@@ -0,0 +1,60 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// Proto channels over named pipe instances, see channel_transport
+//
+// * a thin adapter to cix::win_namedpipe_server, which is to be configured
+//   through server() before launch()
+// * tokens are the instance tokens of the pipe server, i.e. handle values
+class pipe_transport :
+    public channel_transport,
+    public cix::win_namedpipe_server::listener_t,
+    public std::enable_shared_from_this<pipe_transport>
+{
+public:
+    pipe_transport();
+    ~pipe_transport();
+
+    const std::shared_ptr<cix::win_namedpipe_server>& server() const
+        { return m_server; }
+
+    // channel_transport
+    const char* name() const { return "pipe"; }
+    void set_listener(
+        std::shared_ptr<channel_transport::listener_t> listener);
+    bool launch();
+    void stop();
+    bool send(token_t token, bytes_t&& packet);
+    bool send_expedited(token_t token, bytes_t&& packet);
+    bool get_instance_stats(
+        token_t token, instance_stats_t& out_stats) const;
+    bool disconnect_instance(token_t token);
+
+private:
+    std::shared_ptr<channel_transport::listener_t> listener() const;
+
+    // cix::win_namedpipe_server::listener_t
+    void on_namedpipe_connected(
+        std::shared_ptr<cix::win_namedpipe_server> pipe,
+        cix::win_namedpipe_server::instance_token_t pipe_instance_token);
+    void on_namedpipe_recv(
+        std::shared_ptr<cix::win_namedpipe_server> pipe,
+        cix::win_namedpipe_server::instance_token_t pipe_instance_token,
+        cix::win_namedpipe_server::bytes_t&& packet);
+    void on_namedpipe_sent(
+        std::shared_ptr<cix::win_namedpipe_server> pipe,
+        cix::win_namedpipe_server::instance_token_t pipe_instance_token,
+        cix::win_namedpipe_server::bytes_t&& packet,
+        std::size_t output_queue_size);
+    void on_namedpipe_closed(
+        std::shared_ptr<cix::win_namedpipe_server> pipe,
+        cix::win_namedpipe_server::instance_token_t pipe_instance_token);
+
+private:
+    mutable std::mutex m_mutex;
+    std::weak_ptr<channel_transport::listener_t> m_listener;
+    std::shared_ptr<cix::win_namedpipe_server> m_server;
+};
@@ -11,13 +11,133 @@ namespace detail
     // static std::mt19937_64 rand_gen64((std::random_device())());
     // static std::uniform_int_distribution<std::uint32_t> rand_dist32;
     // static std::uniform_int_distribution<std::uint64_t> rand_dist64;
-    static cix::random::fast rand_gen;
-    static std::mutex rand_mutex;
+    // one per thread so that make_packet() callers never contend; each one
+    // gets seeded with its thread id (see cix::random::fast)
+    static thread_local cix::random::fast rand_gen;
 
 
-    static error_t extract_packet(
-        bytes_t& out_packet, std::uint32_t* out_uid,
-        const proto::header_t& header, std::size_t remaining_size) noexcept
+    // first occurrence of proto::magic in [begin, end) or, if there is none,
+    // the beginning of the longest tail of the range that is also a prefix of
+    // proto::magic (i.e. a magic word split across two reads), or *end*
+    static const byte_t* find_magic(
+        const byte_t* begin, const byte_t* end) noexcept
+    {
+        constexpr auto magic_size = proto::magic.size();
+        auto* ptr = begin;
+
+        // the common case: a packet right at the front
+        if (static_cast<std::size_t>(end - ptr) >= magic_size &&
+            0 == std::memcmp(ptr, proto::magic.data(), magic_size))
+        {
+            return ptr;
+        }
+
+#ifdef APP_SSE2_ENABLED
+        // 16 positions at a time; one compare per byte of the magic word, each
+        // on a load shifted by one byte, so that the bits left set in the
+        // mask are exact matches
+        const __m128i magic0 = _mm_set1_epi8(static_cast<char>(magic[0]));
+        const __m128i magic1 = _mm_set1_epi8(static_cast<char>(magic[1]));
+        const __m128i magic2 = _mm_set1_epi8(static_cast<char>(magic[2]));
+        const __m128i magic3 = _mm_set1_epi8(static_cast<char>(magic[3]));
+
+        static_assert(magic_size == 4, "magic size mismatch");
+
+        for (; static_cast<std::size_t>(end - ptr) >= 16 + magic_size - 1;
+            ptr += 16)
+        {
+            const auto* const vec = reinterpret_cast<const __m128i*>(ptr);
+
+            __m128i match = _mm_cmpeq_epi8(_mm_loadu_si128(vec), magic0);
+            match = _mm_and_si128(match, _mm_cmpeq_epi8(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + 1)),
+                magic1));
+            match = _mm_and_si128(match, _mm_cmpeq_epi8(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + 2)),
+                magic2));
+            match = _mm_and_si128(match, _mm_cmpeq_epi8(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + 3)),
+                magic3));
+
+            const auto mask = static_cast<unsigned>(_mm_movemask_epi8(match));
+
+            if (mask != 0)
+            {
+#ifdef _MSC_VER
+                unsigned long index;
+                _BitScanForward(&index, mask);
+                return ptr + index;
+#else
+                return ptr + __builtin_ctz(mask);
+#endif
+            }
+        }
+#endif  // APP_SSE2_ENABLED
+
+        for (; static_cast<std::size_t>(end - ptr) >= magic_size; ++ptr)
+        {
+            if (*ptr == magic[0] &&
+                0 == std::memcmp(ptr, proto::magic.data(), magic_size))
+            {
+                return ptr;
+            }
+        }
+
+        // no magic word, but what is left may be the beginning of one
+        for (; ptr < end; ++ptr)
+        {
+            if (std::equal(ptr, end, proto::magic.begin()))
+                return ptr;
+        }
+
+        return end;
+    }
+
+
+    // update *crc_ctx* with the first *size* bytes of the packet of *header*,
+    // header_t::crc32 being zeroed (see proto::crc32()), and copy them to *out*
+    // on the way if it is not null, so that they are read only once
+    static void crc32_packet(
+        cix::crc32::hash_t& crc_ctx, const header_t& header, std::size_t size,
+        byte_t* out=nullptr) noexcept
+    {
+        constexpr auto crc_offset = offsetof(header_t, crc32);
+        constexpr auto tail_offset = crc_offset + sizeof(header_t::crc32);
+        const cix::crc32::hash_t zero32 = 0;
+
+        static_assert(
+            sizeof(zero32) == sizeof(header_t::crc32),
+            "size mismatch");
+
+        assert(size >= tail_offset);
+
+        const auto* const packet = reinterpret_cast<const byte_t*>(&header);
+
+        if (!out)
+        {
+            cix::crc32::update(crc_ctx, packet, crc_offset);
+            cix::crc32::update(crc_ctx, &zero32, sizeof(zero32));
+            cix::crc32::update(
+                crc_ctx, packet + tail_offset, size - tail_offset);
+        }
+        else
+        {
+            cix::crc32::update_copy(crc_ctx, out, packet, crc_offset);
+            cix::crc32::update(crc_ctx, &zero32, sizeof(zero32));
+            std::memcpy(
+                out + crc_offset, packet + crc_offset, sizeof(zero32));
+            cix::crc32::update_copy(
+                crc_ctx, out + tail_offset, packet + tail_offset,
+                size - tail_offset);
+        }
+    }
+
+
+    // validate_packet() minus the crc32
+    static error_t validate_packet_size(
+        std::uint32_t* out_uid,
+        const proto::header_t& header, std::size_t remaining_size,
+        std::size_t max_size=proto::max_packet_size) noexcept
     {
         const auto declared_len =
             static_cast<std::size_t>(net2host(header.len));
@@ -25,137 +145,360 @@ namespace detail
         if (out_uid)
             *out_uid = net2host(header.uid);
 
-        // can header.len be considered "safe"?
-        if (declared_len > proto::max_packet_size)
+        // can header.len be considered "safe"? it must at least cover the
+        // header so that the crc32 can be computed
+        if (declared_len > max_size || declared_len < sizeof(header_t))
             return error_toobig;
 
         // enough data for the whole packet?
         if (declared_len > remaining_size)
             return error_incomplete;
 
+        return proto::ok;
+    }
+
+
+    static error_t validate_packet(
+        std::uint32_t* out_uid,
+        const proto::header_t& header, std::size_t remaining_size,
+        crc_mode_t crc_mode=crc_full,
+        std::size_t max_size=proto::max_packet_size) noexcept
+    {
+        const auto error = validate_packet_size(
+            out_uid, header, remaining_size, max_size);
+        if (error != proto::ok)
+            return error;
+
         // crc32
-        const auto crc = proto::crc32(header);
+        const auto crc = proto::crc32(header, crc_mode);
         if (crc != net2host(header.crc32))
             return error_crc;
 
-        // copy bytes
-        out_packet.clear();
-        out_packet.reserve(declared_len);
-        std::copy(
-            reinterpret_cast<const proto::byte_t*>(&header),
-            reinterpret_cast<const proto::byte_t*>(&header) + declared_len,
-            std::back_inserter(out_packet));
+        return proto::ok;
+    }
 
-        // convert header
-        auto out_header = reinterpret_cast<proto::header_t*>(out_packet.data());
-        out_header->len = proto::net2host(out_header->len);
-        out_header->crc32 = proto::net2host(out_header->crc32);
-        out_header->uid = proto::net2host(out_header->uid);
-        out_header->opcode = proto::net2host(out_header->opcode);
 
-        // match packet length against expected size and convert payload
-        switch (out_header->opcode)
+    // host2net() or net2host() every field of *stats*, which are all
+    // std::uint64_t
+    static void convert_stats(payload_stats_t& stats, bool to_net) noexcept
+    {
+        static_assert(
+            sizeof(payload_stats_t) % sizeof(std::uint64_t) == 0,
+            "payload_stats_t is expected to be made of std::uint64_t only");
+
+        auto* const data = reinterpret_cast<byte_t*>(&stats);
+
+        for (std::size_t offset = 0; offset < sizeof(payload_stats_t);
+            offset += sizeof(std::uint64_t))
         {
-            case op_channel_setup:
-            {
-                if (out_header->len !=
-                        sizeof(header_t) +
-                        sizeof(payload_channel_setup_t))
-                {
-                    return error_malformed;
-                }
-
-                auto payload = reinterpret_cast<payload_channel_setup_t*>(
-                    out_packet.data() + sizeof(header_t));
-
-                payload->client_id = proto::net2host(payload->client_id);
-                payload->flags = proto::net2host(payload->flags);
-                break;
-            }
+            std::uint64_t value;
+
+            std::memcpy(&value, data + offset, sizeof(value));
+            value = to_net ? host2net(value) : net2host(value);
+            std::memcpy(data + offset, &value, sizeof(value));
+        }
+    }
+
+
+    // payload converters of opcode_descs, see convert_packet()
+    // * called once the size of the payload has been checked against the
+    //   descriptor of its opcode
+    // * convert in place, and validate whatever a descriptor cannot express
+    typedef error_t (*payload_converter_t)(
+        byte_t* payload, std::size_t size) noexcept;
+
+    static error_t convert_channel_setup(byte_t* payload, std::size_t) noexcept
+    {
+        auto setup = reinterpret_cast<payload_channel_setup_t*>(payload);
 
-            case op_channel_setup_ack:
+        setup->client_id = proto::net2host(setup->client_id);
+        setup->flags = proto::net2host(setup->flags);
+        return proto::ok;
+    }
+
+
+    static error_t convert_channel_setup_ack(
+        byte_t* payload, std::size_t size) noexcept
+    {
+        // either flavor, see opcode_desc_t::alt_size
+        if (size == sizeof(payload_channel_setup_ack_ext_t))
+        {
+            auto ack = reinterpret_cast<payload_channel_setup_ack_ext_t*>(
+                payload);
+
+            ack->client_id = proto::net2host(ack->client_id);
+            ack->version = proto::net2host(ack->version);
+            ack->reserved = proto::net2host(ack->reserved);
+            ack->caps = proto::net2host(ack->caps);
+            ack->max_packet_size = proto::net2host(ack->max_packet_size);
+        }
+        else
+        {
+            auto ack = reinterpret_cast<payload_channel_setup_ack_t*>(payload);
+
+            ack->client_id = proto::net2host(ack->client_id);
+        }
+
+        return proto::ok;
+    }
+
+
+    static error_t convert_status(byte_t* payload, std::size_t) noexcept
+    {
+        auto status = reinterpret_cast<payload_status_t*>(payload);
+
+        status->status = proto::net2host(status->status);
+        return proto::ok;
+    }
+
+
+    static error_t convert_stats_payload(
+        byte_t* payload, std::size_t size) noexcept
+    {
+        // empty if a request; fields appended by a later version are left
+        // as-is
+        if (size != 0)
+        {
+            detail::convert_stats(
+                *reinterpret_cast<payload_stats_t*>(payload), false);
+        }
+
+        return proto::ok;
+    }
+
+
+    // op_socks, op_socks_close, op_socks_disconnected and
+    // op_socks_udp_associated
+    static error_t convert_socks_header(byte_t* payload, std::size_t) noexcept
+    {
+        auto socks = reinterpret_cast<payload_socks_header_t*>(payload);
+
+        socks->socks_id = proto::net2host(socks->socks_id);
+        return proto::ok;
+    }
+
+
+    static error_t convert_ping(byte_t* payload, std::size_t size) noexcept
+    {
+        // either empty or a payload_ping_t, see opcode_desc_t::alt_size
+        if (size == 0)
+            return proto::ok;
+
+        auto ping = reinterpret_cast<payload_ping_t*>(payload);
+
+        ping->stamp = proto::net2host(ping->stamp);
+        ping->kind = proto::net2host(ping->kind);
+
+        if (ping->kind != ping_request && ping->kind != ping_reply)
+            return error_malformed;
+
+        return proto::ok;
+    }
+
+
+    static error_t convert_socks_flow(byte_t* payload, std::size_t) noexcept
+    {
+        auto flow = reinterpret_cast<payload_socks_flow_t*>(payload);
+
+        flow->socks_id = proto::net2host(flow->socks_id);
+        flow->flow = proto::net2host(flow->flow);
+
+        if (flow->flow != socks_flow_resume && flow->flow != socks_flow_pause)
+            return error_malformed;
+
+        return proto::ok;
+    }
+
+
+    static error_t convert_socks_resume(byte_t* payload, std::size_t) noexcept
+    {
+        auto resume = reinterpret_cast<payload_socks_resume_t*>(payload);
+
+        resume->socks_id = proto::net2host(resume->socks_id);
+        resume->offset = proto::net2host(resume->offset);
+        return proto::ok;
+    }
+
+
+    static error_t convert_socks_batch(
+        byte_t* payload, std::size_t size) noexcept
+    {
+        const auto* const end = payload + size;
+        auto* record_ptr = payload;
+
+        while (record_ptr < end)
+        {
+            if (static_cast<std::size_t>(end - record_ptr) <
+                sizeof(payload_socks_batch_record_t))
             {
-                if (out_header->len !=
-                        sizeof(header_t) +
-                        sizeof(payload_channel_setup_ack_t))
-                {
-                    return error_malformed;
-                }
-
-                auto payload = reinterpret_cast<payload_channel_setup_ack_t*>(
-                    out_packet.data() + sizeof(header_t));
-
-                payload->client_id = proto::net2host(payload->client_id);
-                break;
+                return error_malformed;
             }
 
-            case op_status:
+            auto record =
+                reinterpret_cast<payload_socks_batch_record_t*>(record_ptr);
+
+            record->socks_id = proto::net2host(record->socks_id);
+            record->len = proto::net2host(record->len);
+
+            record_ptr += sizeof(payload_socks_batch_record_t);
+
+            if (record->len == 0 ||
+                record->len > static_cast<std::size_t>(end - record_ptr))
             {
-                if (out_header->len !=
-                        sizeof(header_t) +
-                        sizeof(payload_status_t))
-                {
-                    return error_malformed;
-                }
-
-                auto payload = reinterpret_cast<payload_status_t*>(
-                    out_packet.data() + sizeof(header_t));
-
-                payload->status = proto::net2host(payload->status);
-                break;
+                return error_malformed;
             }
 
-            case op_ping:
-            case op_uninstall_self:
-                if (out_header->len != sizeof(proto::header_t))
-                    return error_malformed;
-                break;
+            record_ptr += record->len;
+        }
+
+        return proto::ok;
+    }
+
+
+    static error_t convert_socks_udp(
+        byte_t* payload, std::size_t size) noexcept
+    {
+        const auto* const end = payload + size;
+        auto* record_ptr = payload + sizeof(payload_socks_header_t);
+
+        convert_socks_header(payload, size);
 
-            case op_socks:
+        while (record_ptr < end)
+        {
+            if (static_cast<std::size_t>(end - record_ptr) <
+                sizeof(payload_socks_udp_record_t))
             {
-                if (out_header->len <
-                    sizeof(header_t) +
-                    sizeof(payload_socks_header_t) +
-                    1)
-                {
-                    return error_malformed;
-                }
-
-                auto payload = reinterpret_cast<payload_socks_header_t*>(
-                    out_packet.data() + sizeof(header_t));
-
-                payload->socks_id = proto::net2host(payload->socks_id);
-                break;
+                return error_malformed;
             }
 
-            case op_socks_close:
-            case op_socks_disconnected:
+            auto record =
+                reinterpret_cast<payload_socks_udp_record_t*>(record_ptr);
+
+            record->len = proto::net2host(record->len);
+
+            record_ptr += sizeof(payload_socks_udp_record_t);
+
+            if (record->len == 0 ||
+                record->len > static_cast<std::size_t>(end - record_ptr))
             {
-                if (out_header->len !=
-                    sizeof(header_t) +
-                    sizeof(payload_socks_header_t))
-                {
-                    return error_malformed;
-                }
-
-                auto payload = reinterpret_cast<payload_socks_header_t*>(
-                    out_packet.data() + sizeof(header_t));
-
-                payload->socks_id = proto::net2host(payload->socks_id);
-                break;
+                return error_malformed;
             }
 
-            default:
-                assert(0);  // opcode should be taken into account
-                break;
+            record_ptr += record->len;
         }
 
         return proto::ok;
     }
 
 
+    static error_t convert_socks_lz4(byte_t* payload, std::size_t) noexcept
+    {
+        auto lz4 = reinterpret_cast<payload_socks_lz4_header_t*>(payload);
+
+        lz4->socks_id = proto::net2host(lz4->socks_id);
+        lz4->raw_len = proto::net2host(lz4->raw_len);
+
+        if (lz4->raw_len == 0 || lz4->raw_len > proto::max_payload_size)
+            return error_malformed;
+
+        return proto::ok;
+    }
+
+
+    // indexed by opcode, same as proto::opcode_descs; nullptr if the payload,
+    // if any, has nothing to convert
+    static constexpr std::array<payload_converter_t, 256>
+    make_payload_converters() noexcept
+    {
+        std::array<payload_converter_t, 256> converters{};
+
+        converters[op_channel_setup] = &convert_channel_setup;
+        converters[op_channel_setup_ack] = &convert_channel_setup_ack;
+        converters[op_status] = &convert_status;
+        converters[op_stats] = &convert_stats_payload;
+        converters[op_ping] = &convert_ping;
+        converters[op_socks] = &convert_socks_header;
+        converters[op_socks_close] = &convert_socks_header;
+        converters[op_socks_disconnected] = &convert_socks_header;
+        converters[op_socks_flow] = &convert_socks_flow;
+        converters[op_socks_batch] = &convert_socks_batch;
+        converters[op_socks_lz4] = &convert_socks_lz4;
+        converters[op_socks_udp] = &convert_socks_udp;
+        converters[op_socks_udp_associated] = &convert_socks_header;
+        converters[op_socks_resume] = &convert_socks_resume;
+
+        return converters;
+    }
+
+    static constexpr auto payload_converters = make_payload_converters();
+
+
+    static error_t convert_packet(proto::byte_t* packet) noexcept
+    {
+        // CAUTION: *packet* is expected to have been validate_packet()'ed
+
+        // convert header
+        auto out_header = reinterpret_cast<proto::header_t*>(packet);
+        out_header->len = proto::net2host(out_header->len);
+        out_header->crc32 = proto::net2host(out_header->crc32);
+        out_header->uid = proto::net2host(out_header->uid);
+        out_header->opcode = proto::net2host(out_header->opcode);
+
+        if (out_header->len < sizeof(header_t))
+            return error_malformed;
+
+        // an unknown opcode is left to the caller, which may reply
+        // status_unsupported
+        const auto& desc = proto::opcode_descs[out_header->opcode];
+        const auto payload_size = out_header->len - sizeof(header_t);
+
+        if (!proto::is_payload_size_valid(desc, payload_size))
+            return error_malformed;
+
+        const auto converter = payload_converters[out_header->opcode];
+
+        return
+            converter ?
+            converter(packet + sizeof(header_t), payload_size) :
+            proto::ok;
+    }
+
+
+    static error_t extract_packet(
+        bytes_t& out_packet, std::uint32_t* out_uid,
+        const proto::header_t& header, std::size_t remaining_size) noexcept
+    {
+        const auto error = validate_packet_size(
+            out_uid, header, remaining_size);
+        if (error != proto::ok)
+            return error;
+
+        const auto declared_len =
+            static_cast<std::size_t>(net2host(header.len));
+
+        // copy bytes, the crc32 is computed on the way instead of by
+        // validate_packet()
+        auto crc32ctx = cix::crc32::create();
+
+        out_packet.clear();
+        out_packet.resize(declared_len);
+        crc32_packet(crc32ctx, header, declared_len, out_packet.data());
+
+        if (cix::crc32::finalize(crc32ctx) != net2host(header.crc32))
+        {
+            out_packet.clear();
+            return error_crc;
+        }
+
+        return convert_packet(out_packet.data());
+    }
+
+
     static bytes_t make_packet(
-        std::uint32_t uid, proto::opcode_t opcode, std::size_t payload_size=0)
+        std::uint32_t uid,
+        proto::opcode_t opcode,
+        std::size_t payload_size=0,
+        bytes_t&& storage=bytes_t())
     {
         const auto packet_len = sizeof(header_t) + payload_size;
 
@@ -165,7 +508,10 @@ namespace detail
             CIX_THROW_LENGTH("new packet too big");
         }
 
-        bytes_t out(packet_len);
+        // CAUTION: only the header is zeroed, payload is left to the caller
+        bytes_t out(std::move(storage));
+        out.resize(packet_len);
+        std::memset(out.data(), 0, sizeof(header_t));
 
         auto header = reinterpret_cast<header_t*>(out.data());
 
@@ -180,25 +526,60 @@ namespace detail
     }
 
 
-    static void consolidate_packet(bytes_t& packet)
+    static void consolidate_packet(
+        bytes_t& packet, crc_mode_t crc_mode=crc_full)
+    {
+        if (packet.size() > std::numeric_limits<decltype(header_t::len)>::max())
+            CIX_THROW_LENGTH("new packet too big");
+
+        auto header = reinterpret_cast<header_t*>(packet.data());
+
+        assert(header->opcode);
+
+        header->len = static_cast<decltype(header_t::len)>(packet.size());
+        header->crc32 = proto::crc32(*header, crc_mode);
+    }
+
+
+    // same as above, but first copies the *size* bytes of *tail* at the end of
+    // *packet*, computing the crc32 on the way so that they are read only once
+    static void consolidate_packet(
+        bytes_t& packet, crc_mode_t crc_mode,
+        const byte_t* tail, std::size_t size)
     {
         if (packet.size() > std::numeric_limits<decltype(header_t::len)>::max())
             CIX_THROW_LENGTH("new packet too big");
 
+        assert(packet.size() >= sizeof(header_t) + size);
+
         auto header = reinterpret_cast<header_t*>(packet.data());
+        const auto offset = packet.size() - size;
 
         assert(header->opcode);
 
         header->len = static_cast<decltype(header_t::len)>(packet.size());
-        header->crc32 = proto::crc32(*header);
+
+        if (crc_mode == crc_header)
+        {
+            std::memcpy(packet.data() + offset, tail, size);
+            header->crc32 = proto::crc32(*header, crc_mode);
+        }
+        else
+        {
+            auto crc32ctx = cix::crc32::create();
+
+            crc32_packet(crc32ctx, *header, offset);
+            cix::crc32::update_copy(
+                crc32ctx, packet.data() + offset, tail, size);
+
+            header->crc32 = cix::crc32::finalize(crc32ctx);
+        }
     }
 }
 
 
 std::uint32_t generate_uid() noexcept
 {
-    std::scoped_lock lock(detail::rand_mutex);
-
     for (;;)
     {
         const auto now = static_cast<uint32_t>(cix::ticks_now());
@@ -214,7 +595,6 @@ std::uint32_t generate_uid() noexcept
 
 clientid_t generate_client_id() noexcept
 {
-    std::scoped_lock lock(detail::rand_mutex);
     proto::clientid_t id;
 
     // do { id = detail::rand_dist64(detail::rand_gen64); }
@@ -225,35 +605,32 @@ clientid_t generate_client_id() noexcept
 }
 
 
-std::uint32_t crc32(const proto::header_t& header) noexcept
+std::uint32_t crc32(
+    const proto::header_t& header, crc_mode_t crc_mode) noexcept
 {
-    const cix::crc32::hash_t zero32 = 0;
+    auto crc32ctx = cix::crc32::create();
 
-    static_assert(
-        sizeof(zero32) == sizeof(proto::header_t::crc32),
-        "size mismatch");
+    // header, with a zeroed header.crc32, and payload
+    detail::crc32_packet(
+        crc32ctx, header,
+        (crc_mode == crc_header) ?
+            sizeof(proto::header_t) :
+            static_cast<std::size_t>(net2host(header.len)));
 
-    auto crc32ctx = cix::crc32::create();
+    return cix::crc32::finalize(crc32ctx);
+}
 
-    std::size_t offset = offsetof(proto::header_t, crc32);
 
-    // up to header.crc32
-    cix::crc32::update(crc32ctx, &header, offset);
+void update_crc(bytes_t& packet, crc_mode_t crc_mode)
+{
+    if (packet.size() < sizeof(header_t))
+        CIX_THROW_BADARG("not a packet");
 
-    // zeroed header.crc32
-    cix::crc32::update(crc32ctx, &zero32, sizeof(zero32));
+    auto header = reinterpret_cast<header_t*>(packet.data());
 
-    // header tail + payload
-    offset += sizeof(zero32);
-    const auto tail_size =
-        static_cast<std::size_t>(net2host(header.len)) -
-        offset;
-    cix::crc32::update(
-        crc32ctx,
-        reinterpret_cast<const proto::byte_t*>(&header) + offset,
-        tail_size);
+    assert(static_cast<std::size_t>(net2host(header->len)) == packet.size());
 
-    return cix::crc32::finalize(crc32ctx);
+    header->crc32 = proto::crc32(*header, crc_mode);
 }
 
 
@@ -268,22 +645,26 @@ error_t extract_next_packet(
         return error_incomplete;
 
     // search for magic word
-    auto stream_it = std::search(
-        stream.begin(), stream.end(),
-        proto::magic.begin(), proto::magic.end());
-
-    // found it?
-    if (stream_it == stream.end())
-    {
-        stream.clear();
-        return error_garbage;
-    }
+    const auto offset = static_cast<std::size_t>(
+        detail::find_magic(stream.data(), stream.data() + stream.size()) -
+        stream.data());
+    auto stream_it = std::next(stream.begin(), offset);
 
     // remaining data size in stream
-    // static_cast is ok here since (it < end)
+    // static_cast is ok here since (it <= end)
     const auto remaining_size = static_cast<std::size_t>(
         std::distance(stream_it, stream.end()));
 
+    // found it? only the beginning of a magic word may be left otherwise
+    if (remaining_size < proto::magic.size())
+    {
+        if (offset == 0)
+            return error_incomplete;
+
+        stream.erase(stream.begin(), stream_it);
+        return error_garbage;
+    }
+
     // enough data for the header?
     if (remaining_size < sizeof(proto::header_t))
     {
@@ -342,49 +723,219 @@ error_t extract_next_packet(
 }
 
 
-bytes_t make_channel_setup(clientid_t client_id, channel_setup_flags_t flags)
+error_t extract_next_packet(
+    input_stream_t& stream,
+    packet_view_t& out_packet,
+    std::uint32_t* out_uid,
+    crc_mode_t crc_mode,
+    std::size_t max_size) noexcept
 {
-    auto packet = detail::make_packet(
-        generate_uid(),
-        proto::op_channel_setup,
-        sizeof(payload_channel_setup_t));
-
-    auto payload = reinterpret_cast<payload_channel_setup_t*>(
-        packet.data() + sizeof(header_t));
-
-    payload->client_id = host2net(client_id);
-    payload->flags = host2net(flags);
+    out_packet.header = nullptr;
+    out_packet.data = nullptr;
+    out_packet.size = 0;
+    if (out_uid)
+        *out_uid = 0;
 
-    detail::consolidate_packet(packet);
+    if (stream.empty())
+        return error_incomplete;
 
-    return packet;
-}
+    auto* const stream_begin = stream.data();
+    auto* const stream_end = stream_begin + stream.size();
 
+    // search for magic word
+    auto* const packet = const_cast<proto::byte_t*>(
+        detail::find_magic(stream_begin, stream_end));
 
-bytes_t make_channel_setup_ack(std::uint32_t uid, clientid_t client_id)
-{
-    auto packet = detail::make_packet(
-        uid,
-        proto::op_channel_setup_ack,
-        sizeof(payload_channel_setup_ack_t));
+    // static_cast is ok here since (packet <= end)
+    const auto offset = static_cast<std::size_t>(packet - stream_begin);
+    const auto remaining_size = static_cast<std::size_t>(stream_end - packet);
 
-    auto payload = reinterpret_cast<payload_channel_setup_ack_t*>(
-        packet.data() + sizeof(header_t));
+    // found it? only the beginning of a magic word may be left otherwise
+    if (remaining_size < proto::magic.size())
+    {
+        if (offset == 0)
+            return error_incomplete;
 
-    payload->client_id = host2net(client_id);
+        stream.consume(offset);
+        return error_garbage;
+    }
 
-    detail::consolidate_packet(packet);
+    // enough data for the header?
+    if (remaining_size < sizeof(proto::header_t))
+    {
+        stream.consume(offset);
+        return error_incomplete;
+    }
+
+    auto& header = *reinterpret_cast<proto::header_t*>(packet);
+    const auto declared_len = static_cast<std::size_t>(net2host(header.len));
+
+    auto error = detail::validate_packet(
+        out_uid, header, remaining_size, crc_mode,
+        std::min(max_size, proto::max_packet_size));
+    if (error == proto::ok)
+        error = detail::convert_packet(packet);
+
+    switch (error)
+    {
+        case proto::ok:
+            // CAUTION: consume() does not release memory so this view remains
+            // valid until the next feed()
+            out_packet.header = &header;
+            out_packet.data = packet;
+            out_packet.size = declared_len;
+            stream.consume(offset + declared_len);
+            break;
+
+        case error_incomplete:
+            stream.consume(offset);
+            break;
+
+        case error_malformed:
+        case error_crc:
+            stream.consume(offset + declared_len);
+            break;
+
+        case error_garbage:
+            stream.clear();
+            break;
+
+        case error_toobig:
+        default:
+            assert(error == error_toobig);
+            stream.consume(offset + proto::magic.size());
+            break;
+    }
+
+    return error;
+}
+
+
+error_t extract_whole_packet(
+    input_stream_t& stream,
+    packet_view_t& out_packet,
+    std::uint32_t* out_uid,
+    crc_mode_t crc_mode,
+    std::size_t max_size) noexcept
+{
+    out_packet.header = nullptr;
+    out_packet.data = nullptr;
+    out_packet.size = 0;
+    if (out_uid)
+        *out_uid = 0;
+
+    if (stream.empty())
+        return error_incomplete;
+
+    auto* const packet = stream.data();
+    const auto size = stream.size();
+
+    // CAUTION: consume() does not release memory so the view made below
+    // remains valid until the next feed()
+    stream.consume(size);
+
+    if (size < sizeof(proto::header_t) ||
+        !std::equal(proto::magic.begin(), proto::magic.end(), packet))
+    {
+        return error_garbage;
+    }
+
+    auto& header = *reinterpret_cast<proto::header_t*>(packet);
+
+    auto error = detail::validate_packet(
+        out_uid, header, size, crc_mode,
+        std::min(max_size, proto::max_packet_size));
+    if (error == error_incomplete ||
+        (error == proto::ok && net2host(header.len) != size))
+    {
+        error = error_malformed;
+    }
+    if (error == proto::ok)
+        error = detail::convert_packet(packet);
+
+    if (error == proto::ok)
+    {
+        out_packet.header = &header;
+        out_packet.data = packet;
+        out_packet.size = size;
+    }
+
+    return error;
+}
+
+
+bytes_t make_channel_setup(clientid_t client_id, channel_setup_flags_t flags)
+{
+    auto packet = detail::make_packet(
+        generate_uid(),
+        proto::op_channel_setup,
+        sizeof(payload_channel_setup_t));
+
+    auto payload = reinterpret_cast<payload_channel_setup_t*>(
+        packet.data() + sizeof(header_t));
+
+    payload->client_id = host2net(client_id);
+    payload->flags = host2net(flags);
+
+    detail::consolidate_packet(packet);
+
+    return packet;
+}
+
+
+bytes_t make_channel_setup_ack(
+    std::uint32_t uid, clientid_t client_id, bytes_t&& storage)
+{
+    auto packet = detail::make_packet(
+        uid,
+        proto::op_channel_setup_ack,
+        sizeof(payload_channel_setup_ack_t),
+        std::move(storage));
+
+    auto payload = reinterpret_cast<payload_channel_setup_ack_t*>(
+        packet.data() + sizeof(header_t));
+
+    payload->client_id = host2net(client_id);
+
+    detail::consolidate_packet(packet);
 
     return packet;
 }
 
 
-bytes_t make_status(std::uint32_t uid, status_t status)
+bytes_t make_channel_setup_ack_ext(
+    std::uint32_t uid, clientid_t client_id, channel_setup_flags_t caps,
+    bytes_t&& storage)
+{
+    auto packet = detail::make_packet(
+        uid,
+        proto::op_channel_setup_ack,
+        sizeof(payload_channel_setup_ack_ext_t),
+        std::move(storage));
+
+    auto payload = reinterpret_cast<payload_channel_setup_ack_ext_t*>(
+        packet.data() + sizeof(header_t));
+
+    payload->client_id = host2net(client_id);
+    payload->version = host2net(proto::version);
+    payload->reserved = 0;
+    payload->caps = host2net(caps & chansetup_caps_mask);
+    payload->max_packet_size = host2net(
+        static_cast<std::uint32_t>(proto::max_packet_size_of(caps)));
+
+    detail::consolidate_packet(packet);
+
+    return packet;
+}
+
+
+bytes_t make_status(std::uint32_t uid, status_t status, bytes_t&& storage)
 {
     auto packet = detail::make_packet(
         uid,
         proto::op_status,
-        sizeof(payload_status_t));
+        sizeof(payload_status_t),
+        std::move(storage));
 
     auto payload = reinterpret_cast<payload_status_t*>(
         packet.data() + sizeof(header_t));
@@ -397,6 +948,25 @@ bytes_t make_status(std::uint32_t uid, status_t status)
 }
 
 
+bytes_t make_stats(std::uint32_t uid, const payload_stats_t& stats)
+{
+    auto packet = detail::make_packet(
+        uid,
+        proto::op_stats,
+        sizeof(payload_stats_t));
+
+    auto payload = reinterpret_cast<payload_stats_t*>(
+        packet.data() + sizeof(header_t));
+
+    *payload = stats;
+    detail::convert_stats(*payload, true);
+
+    detail::consolidate_packet(packet);
+
+    return packet;
+}
+
+
 bytes_t make_ping()
 {
     auto packet = detail::make_packet(generate_uid(), proto::op_ping);
@@ -405,7 +975,37 @@ bytes_t make_ping()
 }
 
 
+bytes_t make_ping(
+    std::uint32_t uid, std::uint64_t stamp, ping_kind_t kind,
+    bytes_t&& storage)
+{
+    auto packet = detail::make_packet(
+        uid,
+        proto::op_ping,
+        sizeof(payload_ping_t),
+        std::move(storage));
+
+    auto payload = reinterpret_cast<payload_ping_t*>(
+        packet.data() + sizeof(header_t));
+
+    payload->stamp = host2net(stamp);
+    payload->kind = host2net(static_cast<std::uint8_t>(kind));
+
+    detail::consolidate_packet(packet);
+
+    return packet;
+}
+
+
 bytes_t make_socks(socksid_t socks_id, const bytes_t& socks_packet)
+{
+    return make_socks(socks_id, socks_packet, bytes_t());
+}
+
+
+bytes_t make_socks(
+    socksid_t socks_id, const bytes_t& socks_packet, bytes_t&& storage,
+    crc_mode_t crc_mode)
 {
     if (socks_id == invalid_socks_id)
         CIX_THROW_BADARG("invalid SOCKS connection id");
@@ -416,7 +1016,8 @@ bytes_t make_socks(socksid_t socks_id, const bytes_t& socks_packet)
     auto packet = detail::make_packet(
         generate_uid(),
         proto::op_socks,
-        sizeof(payload_socks_header_t) + socks_packet.size());
+        sizeof(payload_socks_header_t) + socks_packet.size(),
+        std::move(storage));
 
     auto payload_header = reinterpret_cast<payload_socks_header_t*>(
         packet.data() + sizeof(header_t));
@@ -424,18 +1025,41 @@ bytes_t make_socks(socksid_t socks_id, const bytes_t& socks_packet)
     payload_header->socks_id = host2net(socks_id);
 
     // SOCKS packet
-    std::memcpy(
-        packet.data() + sizeof(header_t) + sizeof(payload_socks_header_t),
-        socks_packet.data(),
-        socks_packet.size());
+    detail::consolidate_packet(
+        packet, crc_mode, socks_packet.data(), socks_packet.size());
 
-    detail::consolidate_packet(packet);
+    return packet;
+}
+
+
+bytes_t frame_socks(socksid_t socks_id, bytes_t&& buffer, crc_mode_t crc_mode)
+{
+    if (socks_id == invalid_socks_id)
+        CIX_THROW_BADARG("invalid SOCKS connection id");
+
+    if (buffer.size() <= socks_headroom)
+        CIX_THROW_BADARG("empty SOCKS packet");
+
+    // CAUTION: make_packet() only resizes *storage*, which is already at the
+    // right size, so the SOCKS data is left as is
+    auto packet = detail::make_packet(
+        generate_uid(),
+        proto::op_socks,
+        buffer.size() - sizeof(header_t),
+        std::move(buffer));
+
+    auto payload_header = reinterpret_cast<payload_socks_header_t*>(
+        packet.data() + sizeof(header_t));
+
+    payload_header->socks_id = host2net(socks_id);
+
+    detail::consolidate_packet(packet, crc_mode);
 
     return packet;
 }
 
 
-bytes_t make_socks_close(socksid_t socks_id)
+bytes_t make_socks_close(socksid_t socks_id, bytes_t&& storage)
 {
     if (socks_id == invalid_socks_id)
         CIX_THROW_BADARG("invalid SOCKS connection id");
@@ -443,7 +1067,8 @@ bytes_t make_socks_close(socksid_t socks_id)
     auto packet = detail::make_packet(
         generate_uid(),
         proto::op_socks_close,
-        sizeof(payload_socks_header_t));
+        sizeof(payload_socks_header_t),
+        std::move(storage));
 
     auto payload = reinterpret_cast<payload_socks_header_t*>(
         packet.data() + sizeof(header_t));
@@ -456,7 +1081,7 @@ bytes_t make_socks_close(socksid_t socks_id)
 }
 
 
-bytes_t make_socks_disconnected(socksid_t socks_id)
+bytes_t make_socks_disconnected(socksid_t socks_id, bytes_t&& storage)
 {
     if (socks_id == invalid_socks_id)
         CIX_THROW_BADARG("invalid SOCKS connection id");
@@ -464,6 +1089,266 @@ bytes_t make_socks_disconnected(socksid_t socks_id)
     auto packet = detail::make_packet(
         generate_uid(),
         proto::op_socks_disconnected,
+        sizeof(payload_socks_header_t),
+        std::move(storage));
+
+    auto payload = reinterpret_cast<payload_socks_header_t*>(
+        packet.data() + sizeof(header_t));
+
+    payload->socks_id = host2net(socks_id);
+
+    detail::consolidate_packet(packet);
+
+    return packet;
+}
+
+
+bytes_t make_socks_flow(socksid_t socks_id, socks_flow_t flow)
+{
+    if (socks_id == invalid_socks_id)
+        CIX_THROW_BADARG("invalid SOCKS connection id");
+
+    auto packet = detail::make_packet(
+        generate_uid(),
+        proto::op_socks_flow,
+        sizeof(payload_socks_flow_t));
+
+    auto payload = reinterpret_cast<payload_socks_flow_t*>(
+        packet.data() + sizeof(header_t));
+
+    payload->socks_id = host2net(socks_id);
+    payload->flow = host2net(static_cast<std::uint8_t>(flow));
+
+    detail::consolidate_packet(packet);
+
+    return packet;
+}
+
+
+bool append_socks_batch_record(
+    bytes_t& batch, socksid_t socks_id, const bytes_t& socks_packet)
+{
+    return append_socks_batch_record(
+        batch, socks_id, socks_packet.data(), socks_packet.size());
+}
+
+
+bool append_socks_batch_record(
+    bytes_t& batch, socksid_t socks_id, const byte_t* data, std::size_t size)
+{
+    if (socks_id == invalid_socks_id)
+        CIX_THROW_BADARG("invalid SOCKS connection id");
+
+    if (size == 0)
+        CIX_THROW_BADARG("empty SOCKS packet");
+
+    const auto offset = std::max(batch.size(), sizeof(header_t));
+    const auto new_size =
+        offset + sizeof(payload_socks_batch_record_t) + size;
+
+    if (new_size > proto::max_packet_size)
+        return false;
+
+    // header is initialized by make_socks_batch()
+    batch.resize(new_size);
+
+    auto record = reinterpret_cast<payload_socks_batch_record_t*>(
+        batch.data() + offset);
+
+    record->socks_id = host2net(socks_id);
+    record->len = host2net(static_cast<std::uint32_t>(size));
+
+    std::memcpy(
+        batch.data() + offset + sizeof(payload_socks_batch_record_t),
+        data,
+        size);
+
+    return true;
+}
+
+
+bytes_t make_socks_batch(bytes_t&& batch, crc_mode_t crc_mode)
+{
+    if (batch.size() <= sizeof(header_t))
+        CIX_THROW_BADARG("empty SOCKS batch");
+
+    bytes_t packet(std::move(batch));
+
+    // same as detail::make_packet() except payload is already there
+    std::memset(packet.data(), 0, sizeof(header_t));
+
+    auto header = reinterpret_cast<header_t*>(packet.data());
+
+    std::memcpy(&header->magic, &proto::magic, sizeof(header->magic));
+    header->uid = host2net(proto::generate_uid());
+    header->opcode = host2net(proto::op_socks_batch);
+
+    detail::consolidate_packet(packet, crc_mode);
+
+    return packet;
+}
+
+
+bytes_t make_socks_lz4(
+    socksid_t socks_id, const bytes_t& socks_packet, bytes_t& storage,
+    crc_mode_t crc_mode)
+{
+    return make_socks_lz4(
+        socks_id, socks_packet.data(), socks_packet.size(), storage,
+        crc_mode);
+}
+
+
+bytes_t make_socks_lz4(
+    socksid_t socks_id, const byte_t* data, std::size_t size,
+    bytes_t& storage, crc_mode_t crc_mode)
+{
+    if (socks_id == invalid_socks_id)
+        CIX_THROW_BADARG("invalid SOCKS connection id");
+
+    if (size == 0)
+        CIX_THROW_BADARG("empty SOCKS packet");
+
+    if (size > std::numeric_limits<std::uint32_t>::max() ||
+        size <= sizeof(payload_socks_lz4_header_t))
+    {
+        return bytes_t();
+    }
+
+    const auto overhead =
+        sizeof(header_t) + sizeof(payload_socks_lz4_header_t);
+
+    // only worth it if smaller than the op_socks counterpart
+    const auto max_block_size =
+        sizeof(payload_socks_header_t) + size -
+        sizeof(payload_socks_lz4_header_t) - 1;
+
+    bytes_t packet(std::move(storage));
+    packet.resize(overhead + max_block_size);
+
+    const auto block_size = compress::lz4_compress(
+        data, size, packet.data() + overhead, max_block_size);
+
+    if (block_size == 0)
+    {
+        storage.swap(packet);  // give it back
+        return bytes_t();
+    }
+
+    packet.resize(overhead + block_size);
+
+    // same as detail::make_packet() except payload is already there
+    std::memset(packet.data(), 0, sizeof(header_t));
+
+    auto header = reinterpret_cast<header_t*>(packet.data());
+
+    std::memcpy(&header->magic, &proto::magic, sizeof(header->magic));
+    header->uid = host2net(proto::generate_uid());
+    header->opcode = host2net(proto::op_socks_lz4);
+
+    auto payload_header = reinterpret_cast<payload_socks_lz4_header_t*>(
+        packet.data() + sizeof(header_t));
+
+    payload_header->socks_id = host2net(socks_id);
+    payload_header->raw_len = host2net(static_cast<std::uint32_t>(size));
+
+    detail::consolidate_packet(packet, crc_mode);
+
+    return packet;
+}
+
+
+bytes_t make_socks_udp(
+    socksid_t socks_id, const std::vector<bytes_t>& datagrams,
+    crc_mode_t crc_mode)
+{
+    if (socks_id == invalid_socks_id)
+        CIX_THROW_BADARG("invalid SOCKS connection id");
+
+    std::size_t payload_size = sizeof(payload_socks_header_t);
+
+    for (const auto& datagram : datagrams)
+    {
+        if (datagram.size() > std::numeric_limits<std::uint16_t>::max())
+            CIX_THROW_LENGTH("SOCKS datagram too big");
+
+        if (!datagram.empty())
+        {
+            payload_size +=
+                sizeof(payload_socks_udp_record_t) + datagram.size();
+        }
+    }
+
+    if (payload_size == sizeof(payload_socks_header_t))
+        CIX_THROW_BADARG("no SOCKS datagram");
+
+    auto packet = detail::make_packet(
+        generate_uid(), proto::op_socks_udp, payload_size);
+
+    auto header = reinterpret_cast<header_t*>(packet.data());
+    auto payload = reinterpret_cast<payload_socks_header_t*>(
+        packet.data() + sizeof(header_t));
+
+    payload->socks_id = host2net(socks_id);
+
+    auto* record_ptr =
+        packet.data() + sizeof(header_t) + sizeof(payload_socks_header_t);
+
+    // crc_full: the crc32 is computed while copying the datagrams, so that
+    // they are read only once, the header being ready already (see
+    // detail::make_packet())
+    const bool crc_on_copy = (crc_mode != crc_header);
+    auto crc32ctx = cix::crc32::create();
+
+    if (crc_on_copy)
+    {
+        detail::crc32_packet(
+            crc32ctx, *header,
+            static_cast<std::size_t>(record_ptr - packet.data()));
+    }
+
+    for (const auto& datagram : datagrams)
+    {
+        if (datagram.empty())
+            continue;
+
+        auto record =
+            reinterpret_cast<payload_socks_udp_record_t*>(record_ptr);
+
+        record->len = host2net(static_cast<std::uint16_t>(datagram.size()));
+        record_ptr += sizeof(payload_socks_udp_record_t);
+
+        if (crc_on_copy)
+        {
+            cix::crc32::update(crc32ctx, record, sizeof(*record));
+            cix::crc32::update_copy(
+                crc32ctx, record_ptr, datagram.data(), datagram.size());
+        }
+        else
+        {
+            std::memcpy(record_ptr, datagram.data(), datagram.size());
+        }
+
+        record_ptr += datagram.size();
+    }
+
+    if (crc_on_copy)
+        header->crc32 = cix::crc32::finalize(crc32ctx);
+    else
+        detail::consolidate_packet(packet, crc_mode);
+
+    return packet;
+}
+
+
+bytes_t make_socks_udp_associated(socksid_t socks_id)
+{
+    if (socks_id == invalid_socks_id)
+        CIX_THROW_BADARG("invalid SOCKS connection id");
+
+    auto packet = detail::make_packet(
+        generate_uid(),
+        proto::op_socks_udp_associated,
         sizeof(payload_socks_header_t));
 
     auto payload = reinterpret_cast<payload_socks_header_t*>(
@@ -477,6 +1362,25 @@ bytes_t make_socks_disconnected(socksid_t socks_id)
 }
 
 
+bytes_t make_socks_resume(socksid_t socks_id, std::uint64_t offset)
+{
+    auto packet = detail::make_packet(
+        generate_uid(),
+        proto::op_socks_resume,
+        sizeof(payload_socks_resume_t));
+
+    auto payload = reinterpret_cast<payload_socks_resume_t*>(
+        packet.data() + sizeof(header_t));
+
+    payload->socks_id = host2net(socks_id);
+    payload->offset = host2net(offset);
+
+    detail::consolidate_packet(packet);
+
+    return packet;
+}
+
+
 bytes_t make_uninstall_self()
 {
     auto packet = detail::make_packet(generate_uid(), proto::op_uninstall_self);
@@ -31,6 +31,146 @@
 // write-only mode, so that a client with limited asynchronous I/O support can
 // connect twice to a pipe and have two threads running, respectively for
 // read-only and write-only operations.
+//
+// A client may attach even more channels, in either direction, by sending an
+// *op_channel_setup* with its client id on further connections, so that its
+// traffic gets striped over several pipe instances. Server-side sends all the
+// data of a given SOCKS connection (including *op_socks_close* and
+// *op_socks_disconnected*) on the same channel, so that it is received in
+// order; client-side is expected to do the same with its own write channels.
+// Closing any of the channels of a client closes them all.
+//
+// Note on capabilities:
+//
+// Beside the *chansetup_read* and *chansetup_write* roles, the flags of
+// *op_channel_setup* carry the optional features the client-side would like
+// to use on that channel (*chansetup_caps_mask*). A server that does not know
+// a capability ignores it, so that a newer client can always talk to an older
+// server, and vice versa.
+//
+// A client that also sets *chansetup_ext_ack* gets a
+// *payload_channel_setup_ack_ext_t* in reply instead of a
+// *payload_channel_setup_ack_t*, which tells the protocol *version* of the
+// server, and the capabilities it agreed on - the ones requested by the client
+// that server-side supports (*chansetup_caps_supported*). An older server
+// replies with a *payload_channel_setup_ack_t* regardless, meaning no
+// capability.
+//
+// Note on *op_socks_batch* opcode:
+//
+// A client that sets the *chansetup_socks_batch* flag along with
+// *chansetup_read* tells the server it understands *op_socks_batch* packets on
+// that channel. Server-side may then coalesce the data of several SOCKS
+// connections in a single packet while the previous writes to the channel are
+// still pending, instead of sending one *op_socks* packet per chunk of data
+// received from a SOCKS target. Records of a same SOCKS connection are always
+// kept in order, including relative to other packets like *op_socks_close*.
+//
+// Note on *op_socks_lz4* opcode:
+//
+// Same as *op_socks* except that SOCKS data is a raw LZ4 block, as produced by
+// compress::lz4_compress(). A client opts in with the *chansetup_socks_lz4*
+// flag along with *chansetup_read*, in which case server-side compresses the
+// data it forwards whenever it is worth it - data that looks already
+// compressed or encrypted is sent as *op_socks*.
+//
+// Note on *op_socks_udp* opcode:
+//
+// UDP ASSOCIATE support (RFC 1928 section 7), for a client that sets the
+// *chansetup_socks_udp* flag on its channels; otherwise the command is refused
+// as not supported. Server-side opens one UDP socket per association, then
+// sends an *op_socks_udp_associated* packet instead of the SOCKS reply, which
+// is left to client-side since it is the one that relays the datagrams of the
+// local SOCKS client, on an address of its own. The datagrams of an
+// association go through *op_socks_udp* packets in either direction, several
+// of them per packet whenever they come in a row. Each one is a SOCKS5 UDP
+// request header (RSV FRAG ATYP DST.ADDR DST.PORT) followed by the data;
+// DST is the target when sent by client-side, and the source of the datagram
+// when sent by server-side. Fragmented datagrams (FRAG != 0) are dropped.
+//
+// Note on *chansetup_frame_cap* capability:
+//
+// Once a channel set up with this flag has been acked with it, every packet
+// exchanged on that channel in either direction is at most *max_frame_size*
+// bytes, which is also the *max_packet_size* of the
+// *payload_channel_setup_ack_ext_t*. A bigger packet is a protocol error.
+// SOCKS data is a stream, so a bigger chunk is simply sent as several
+// consecutive *op_socks* packets, that server-side does not necessarily write
+// in a row, so that the packets of other SOCKS connections get interleaved
+// instead of waiting for a single big one to be written; datagrams of an
+// association get spread over several *op_socks_udp* packets the same way.
+// This also bounds the memory a receiving side needs per packet.
+//
+// Note on *op_stats* opcode:
+//
+// Sent by the client side with an empty payload, to which the server side
+// replies with an *op_stats* packet of the same uid, made of a
+// *payload_stats_t*. Counters are cumulative since the service started, except
+// the ones marked as gauges. Fields may be appended to *payload_stats_t* in
+// later versions so a longer payload must be accepted.
+//
+// Note on *chansetup_crc_header* capability:
+//
+// The named pipe is a local or SMB transport that already guarantees the
+// integrity of its data, so that the CRC32 of the packets is only really
+// useful to resynchronize on the header of the next packet. Once a channel
+// set up with this flag has been acked with it, every packet exchanged on that
+// channel in either direction has its *header_t::crc32* computed over the
+// header only (see crc_header), instead of the whole packet. The
+// *op_channel_setup* and *op_channel_setup_ack* packets themselves always have
+// a full CRC.
+//
+// Note on *chansetup_resume* capability:
+//
+// A client that sets the *chansetup_resume* flag on the first channel it sets
+// up keeps its session alive across a loss of its channels: server-side holds
+// the client, its SOCKS connections and their targets for a grace period
+// instead of closing them as soon as one of its channels closes. The client
+// then recovers it by sending *op_channel_setup* with its former client id
+// and *chansetup_resume* again, on the first channel it reconnects only; its
+// other channels are set up as usual afterwards. An ack with a different
+// client id means the session could not be resumed (e.g. it expired), in
+// which case the client has to drop the SOCKS connections it still has.
+//
+// Each side counts the bytes of SOCKS data it received on every SOCKS
+// connection, and keeps the tail of the data it sent, up to a bounded size.
+// Once resumed, server-side sends an *op_socks_resume* packet per SOCKS
+// connection it still has on its first write channel, with the count of bytes
+// it received, followed by one with a null *socks_id* to end the list. For
+// each of them, client-side replies with its own *op_socks_resume*, then
+// sends again what the server missed; server-side does the same with what
+// the client missed, followed by the *op_socks_close*, *op_socks_disconnected*
+// and *op_socks_udp_associated* packets of the connection, which the client
+// must tolerate twice. The client also ends its list with a null *socks_id*,
+// closing the connections it did not reply for. A side that does not hold the
+// data asked for anymore closes the connection instead. SOCKS data is held
+// back by both sides until the connection resumed, while datagrams sent
+// through *op_socks_udp* in the meantime are dropped.
+//
+// Note on *chansetup_ping_rtt* capability:
+//
+// An *op_ping* packet may carry a *payload_ping_t*, in which case it is
+// answered with an *op_ping* of the same uid and *stamp*, of kind
+// *ping_reply*, instead of an *op_status*. A client that sets the
+// *chansetup_ping_rtt* flag along with *chansetup_read* gets such pings from
+// server-side on that channel at regular intervals, and must reply to them on
+// any of its write channels as soon as possible, since their round-trip time
+// sizes the windows server-side keeps in flight on that channel. *stamp* is
+// opaque to the replying side. An empty *op_ping* is still answered with an
+// *op_status*.
+//
+// Note on *chansetup_message_frames* capability:
+//
+// Only agreed on a named pipe channel, when server-side runs its pipes in
+// message mode (see config_t::pipe_message_mode), and along with
+// *chansetup_frame_cap*. Once acked, every write of client-side to that
+// channel is exactly one packet, which server-side then parses in place from
+// the message it read, instead of reassembling a stream: a message that is
+// not a whole packet, or that is followed by anything, is a protocol error.
+// Client-side must not request it unless a single write of its own can carry
+// *max_frame_size* bytes (e.g. as negotiated by SMB). Messages written by
+// server-side are whole packets as well, with or without this capability,
+// while a client that reads the pipe as a stream is not affected.
 namespace proto {
 
 typedef std::uint8_t byte_t;
@@ -40,6 +180,10 @@ typedef std::vector<byte_t> bytes_t;
 typedef std::uint64_t clientid_t;
 static constexpr clientid_t invalid_client_id = 0;
 
+// protocol version, as advertised in payload_channel_setup_ack_ext_t; bumped
+// whenever a capability gets added
+static constexpr std::uint16_t version = 6;
+
 // SOCKS connection identifier
 typedef std::uint64_t socksid_t;
 static constexpr socksid_t invalid_socks_id = 0;
@@ -50,19 +194,33 @@ enum error_t : unsigned
     error_garbage = 1,     // no packet found in buffer
     error_incomplete = 2,  // packet incomplete
     error_malformed = 3,   // unexpected packet content and/or size
-    error_toobig = 4,      // header.len too big
+    error_toobig = 4,      // header.len too big, or smaller than a header
     error_crc = 5,         // header crc32 mismatch
 };
 
+// coverage of header_t::crc32 (see chansetup_crc_header)
+enum crc_mode_t : std::uint8_t
+{
+    crc_full = 0,    // header + payload
+    crc_header = 1,  // header only
+};
+
 enum opcode_t : std::uint8_t
 {
     op_channel_setup = 1,
     op_channel_setup_ack = 2,
     op_status = 5,
+    op_stats = 6,
     op_ping = 10,
     op_socks = 150,               // sent by client or server side
     op_socks_close = 151,         // sent by client or server side
     op_socks_disconnected = 152,  // sent by client or server side
+    op_socks_flow = 153,          // sent by client or server side
+    op_socks_batch = 154,         // sent by server side
+    op_socks_lz4 = 155,           // sent by server side
+    op_socks_udp = 156,           // sent by client or server side
+    op_socks_udp_associated = 157,  // sent by server side
+    op_socks_resume = 158,        // sent by client or server side
     op_uninstall_self = 240,
 };
 
@@ -72,11 +230,54 @@ enum status_t : std::uint8_t
     status_unsupported = 1,  // e.g. unsupported opcode
 };
 
+// op_ping: see chansetup_ping_rtt
+enum ping_kind_t : std::uint8_t
+{
+    ping_request = 0,
+    ping_reply = 1,
+};
+
+// op_socks_flow: whether the peer may send data of a SOCKS connection
+//
+// Server-side pauses reading from the SOCKS targets of a client by itself
+// while the output queue of its write channel is above a watermark. This
+// opcode allows the client side to do the same for a given SOCKS connection,
+// typically when its local consumer is slower than the SOCKS target.
+//
+// Conversely, server side sends it when the write queue of a SOCKS target goes
+// above a watermark (pause), then once it drained back down (resume), so that
+// the client side stops reading from the local SOCKS client in the meantime.
+enum socks_flow_t : std::uint8_t
+{
+    socks_flow_resume = 0,
+    socks_flow_pause = 1,
+};
+
 enum channel_setup_flags_t : std::uint32_t
 {
     chansetup_read   = 0x01,  // client uses this channel to read data
     chansetup_write  = 0x02,  // client uses this channel to write data
     chansetup_duplex = chansetup_read | chansetup_write,
+
+    // capabilities
+    chansetup_socks_batch = 0x04,  // client accepts op_socks_batch packets
+    chansetup_socks_lz4   = 0x08,  // client accepts op_socks_lz4 packets
+    chansetup_crc_header  = 0x10,  // crc_header mode once acked
+    chansetup_socks_udp   = 0x20,  // client relays UDP ASSOCIATE datagrams
+    chansetup_frame_cap   = 0x40,  // packets are kept to max_frame_size
+    chansetup_resume      = 0x80,  // session survives its channels
+    chansetup_ping_rtt    = 0x100,  // client replies to op_ping requests
+    chansetup_message_frames = 0x200,  // one packet per pipe message
+    chansetup_caps_mask   = 0x00fffffc,
+
+    // the ones implemented by this side
+    chansetup_caps_supported =
+        chansetup_socks_batch | chansetup_socks_lz4 | chansetup_crc_header |
+        chansetup_socks_udp | chansetup_frame_cap | chansetup_resume |
+        chansetup_ping_rtt | chansetup_message_frames,
+
+    // client expects a payload_channel_setup_ack_ext_t
+    chansetup_ext_ack = 0x80000000,
 };
 CIX_IMPLEMENT_ENUM_BITOPS(channel_setup_flags_t)
 
@@ -84,6 +285,13 @@ CIX_IMPLEMENT_ENUM_BITOPS(channel_setup_flags_t)
 // xkcd221 section
 static constexpr std::array<byte_t, 4> magic = { 0xe4, 0x85, 0xb4, 0xb2 };
 static constexpr std::size_t max_packet_size = 16 * 1024 * 1024;  // see also max_payload_size defined below
+static constexpr std::size_t max_frame_size = 256 * 1024;  // chansetup_frame_cap
+
+// max size of the packets of a channel that agreed on *caps*
+inline std::size_t max_packet_size_of(channel_setup_flags_t caps) noexcept
+{
+    return (caps & chansetup_frame_cap) ? max_frame_size : max_packet_size;
+}
 
 
 #pragma pack(push, 1)
@@ -91,7 +299,7 @@ struct header_t
 {
     byte_t magic[proto::magic.size()];  // proto::magic
     std::uint32_t len;    // total packet length (bytes), incl. this header
-    std::uint32_t crc32;  // zlib-crc32 on the WHOLE packet (header + payload; this member being nulled)
+    std::uint32_t crc32;  // zlib-crc32 on the WHOLE packet (header + payload; this member being nulled), or on the header only (crc_header)
     std::uint32_t uid;    // unique 32-bit value per request-response pair; (uid == 0) only valid for a response
     opcode_t opcode;      // purpose of this packet
 };
@@ -118,6 +326,20 @@ static_assert(sizeof(payload_channel_setup_ack_t) == 8, "size mismatch");
 #pragma pack(pop)
 
 
+// reply to an op_channel_setup that has the chansetup_ext_ack flag
+#pragma pack(push, 1)
+struct payload_channel_setup_ack_ext_t
+{
+    clientid_t client_id;
+    std::uint16_t version;           // proto::version
+    std::uint16_t reserved;          // zero
+    channel_setup_flags_t caps;      // agreed capabilities
+    std::uint32_t max_packet_size;   // see max_packet_size_of()
+};
+static_assert(sizeof(payload_channel_setup_ack_ext_t) == 20, "size mismatch");
+#pragma pack(pop)
+
+
 #pragma pack(push, 1)
 struct payload_status_t
 {
@@ -127,7 +349,132 @@ static_assert(sizeof(payload_status_t) == 1, "size mismatch");
 #pragma pack(pop)
 
 
-// used by op_socks, op_socks_close and op_socks_disconnected
+// op_stats: latency of a stage, in microseconds, see latency_histogram_t
+#pragma pack(push, 1)
+struct payload_stats_latency_t
+{
+    std::uint64_t count;  // number of samples
+    std::uint64_t p50;
+    std::uint64_t p90;
+    std::uint64_t p99;
+    std::uint64_t p999;
+    std::uint64_t max;
+};
+static_assert(sizeof(payload_stats_latency_t) == 48, "size mismatch");
+#pragma pack(pop)
+
+
+#pragma pack(push, 1)
+struct payload_stats_t
+{
+    std::uint64_t uptime_ms;
+
+    // named pipe side
+    std::uint64_t channels;              // gauge
+    std::uint64_t clients;               // gauge
+    std::uint64_t pipe_bytes_in;
+    std::uint64_t pipe_bytes_out;
+    std::uint64_t pipe_packets_in;
+    std::uint64_t pipe_packets_out;
+    std::uint64_t pipe_output_queue;     // gauge; packets not written yet
+    std::uint64_t pipe_bytes_in_flight;  // gauge; pending writes
+    std::uint64_t proto_errors[8];       // by error_t
+
+    // SOCKS side
+    std::uint64_t socks_sessions;        // gauge
+    std::uint64_t socks_sessions_total;
+    std::uint64_t socks_pending_requests;  // gauge; not handled yet
+    std::uint64_t connects_ok;
+    std::uint64_t connects_failed;
+    std::uint64_t connect_time_total_ms;   // of *connects_ok*
+    std::uint64_t connect_time_max_ms;
+    std::uint64_t target_sockets;          // gauge
+    std::uint64_t target_bytes_in;
+    std::uint64_t target_bytes_out;
+    std::uint64_t target_write_queue_bytes;  // gauge
+
+    // latency of the data path, by stage
+    payload_stats_latency_t latency_request_queue;  // pipe -> SOCKS worker
+    payload_stats_latency_t latency_request_send;   // pipe -> SOCKS target
+    payload_stats_latency_t latency_response;       // SOCKS target -> written
+    payload_stats_latency_t latency_connect;        // CONNECT to target
+
+    // memory budget, see mem_budget_t
+    std::uint64_t mem_used;           // gauge; bytes queued, all accounted
+    std::uint64_t mem_peak;           // highest *mem_used* so far
+    std::uint64_t mem_global_budget;  // 0 for no limit
+    std::uint64_t mem_exhausted;      // gauge; 1 while load gets shed
+    std::uint64_t connects_refused;   // while exhausted
+    std::uint64_t sessions_shed;      // closed, above the session budget
+
+    // round-trip time of the write channels, see chansetup_ping_rtt
+    std::uint64_t rtt_samples;      // op_ping replies received
+    std::uint64_t rtt_channels;     // gauge; channels with a sample
+    std::uint64_t rtt_srtt_avg_us;  // gauge; smoothed RTT, average
+    std::uint64_t rtt_srtt_max_us;  // gauge; smoothed RTT, highest
+    std::uint64_t rtt_min_us;       // gauge; lowest sample, all channels
+
+    std::uint64_t connects_fast_failed;  // see connect_failure_cache
+
+    // admission of CONNECT commands, see connect_limiter_t
+    std::uint64_t connects_inflight;   // gauge
+    std::uint64_t connects_queued;     // gauge
+    std::uint64_t connects_throttled;  // queue was full
+    payload_stats_latency_t latency_connect_queue;  // time waiting
+
+    std::uint64_t connects_warm;  // got a pooled socket, see warm_pool_t
+    std::uint64_t warm_sockets;   // gauge
+
+    // allocations by stage, see alloc_profile; null unless profiling build
+    std::uint64_t alloc_count[8];
+    std::uint64_t alloc_bytes[8];  // requested
+
+    // rate limits of the SOCKS targets, see rate_limiter_t
+    std::uint64_t rate_throttles;  // reads paused for going over
+    std::uint64_t rate_throttled;  // gauge; sessions paused right now
+
+    // disk spools of the SOCKS connections, see spool_t
+    std::uint64_t spool_files;        // gauge
+    std::uint64_t spool_bytes;        // gauge; waiting to be sent
+    std::uint64_t spool_bytes_total;  // ever spooled
+    std::uint64_t spool_rejects;      // spool full or failed, kept in memory
+
+    // slow SOCKS connections, see session_trace_t; arrays are indexed by
+    // session_trace_t::stage_t (pipe recv, proxy dequeue, target send, target
+    // recv, pipe written), each the delay since the stage before
+    std::uint64_t slow_threshold_ms;     // 0: disabled
+    std::uint64_t slow_sessions;         // flagged so far
+    std::uint64_t slow_events[5];        // delays above the threshold
+    std::uint64_t slow_worst_client_id;  // open connection with the highest
+    std::uint64_t slow_worst_socks_id;   // delay; both null if none
+    std::uint64_t slow_worst_delay_us[5];  // its highest delays
+
+    // names resolved by the connect jobs, see resolver_t
+    std::uint64_t dns_queries;    // not found in the DNS cache
+    std::uint64_t dns_timeouts;
+    std::uint64_t dns_cancelled;  // session closed meanwhile
+    std::uint64_t dns_fallbacks;  // blocking, GetAddrInfoExW() not available
+
+    // threads woken up from a wait, whatever the cause, see wakeups
+    std::uint64_t wakeups;
+};
+static_assert(sizeof(payload_stats_t) == 928, "size mismatch");
+#pragma pack(pop)
+
+
+// op_ping: optional, an empty payload is a request too
+#pragma pack(push, 1)
+struct payload_ping_t
+{
+    std::uint64_t stamp;  // opaque, echoed by the reply
+    std::uint8_t kind;    // ping_kind_t
+};
+static_assert(sizeof(payload_ping_t) == 9, "size mismatch");
+#pragma pack(pop)
+
+
+// used by op_socks, op_socks_close, op_socks_disconnected, op_socks_udp and
+// op_socks_udp_associated
 #pragma pack(push, 1)
 struct payload_socks_header_t
 {
@@ -137,8 +484,211 @@ static_assert(sizeof(payload_socks_header_t) == 8, "size mismatch");
 #pragma pack(pop)
 
 
+#pragma pack(push, 1)
+struct payload_socks_flow_t
+{
+    socksid_t socks_id;
+    std::uint8_t flow;  // socks_flow_t
+};
+static_assert(sizeof(payload_socks_flow_t) == 9, "size mismatch");
+#pragma pack(pop)
+
+
+// op_socks_resume: *offset* is the count of bytes of SOCKS data received so
+// far on this connection by the sending side; a null *socks_id* ends the list
+// (see chansetup_resume)
+#pragma pack(push, 1)
+struct payload_socks_resume_t
+{
+    socksid_t socks_id;
+    std::uint64_t offset;
+};
+static_assert(sizeof(payload_socks_resume_t) == 16, "size mismatch");
+#pragma pack(pop)
+
+
+// op_socks_batch: payload is a non-empty sequence of records, each being this
+// header immediately followed by *len* bytes of SOCKS data (len > 0)
+#pragma pack(push, 1)
+struct payload_socks_batch_record_t
+{
+    socksid_t socks_id;
+    std::uint32_t len;
+};
+static_assert(sizeof(payload_socks_batch_record_t) == 12, "size mismatch");
+#pragma pack(pop)
+
+
+// op_socks_lz4: this header is immediately followed by the LZ4 block, which
+// decompresses to *raw_len* bytes (raw_len > 0)
+#pragma pack(push, 1)
+struct payload_socks_lz4_header_t
+{
+    socksid_t socks_id;
+    std::uint32_t raw_len;
+};
+static_assert(sizeof(payload_socks_lz4_header_t) == 12, "size mismatch");
+#pragma pack(pop)
+
+
+// op_socks_udp: payload is a payload_socks_header_t followed by a non-empty
+// sequence of records, each being this header immediately followed by *len*
+// bytes of SOCKS5 UDP datagram (len > 0), see the notes at the top
+#pragma pack(push, 1)
+struct payload_socks_udp_record_t
+{
+    std::uint16_t len;
+};
+static_assert(sizeof(payload_socks_udp_record_t) == 2, "size mismatch");
+#pragma pack(pop)
+
+
 static constexpr std::size_t max_payload_size = max_packet_size - sizeof(header_t);
 
+// room to leave in front of SOCKS data so that frame_socks() turns its buffer
+// into an op_socks packet in place
+static constexpr std::size_t socks_headroom =
+    sizeof(header_t) + sizeof(payload_socks_header_t);
+
+// control packets (op_status, op_ping, op_socks_close, ...) are this big at
+// most, so that their *storage* (see make_status() and al.) always comes from
+// the small class of cix::buffer_pool
+static constexpr std::size_t control_packet_max_size =
+    cix::buffer_pool::small_class_size;
+static_assert(
+    sizeof(header_t) + sizeof(payload_channel_setup_ack_ext_t) <=
+        control_packet_max_size,
+    "control packet too big");
+
+
+// how the payload size of a packet is checked against its opcode_desc_t, by
+// is_payload_size_valid()
+enum payload_rule_t : std::uint8_t
+{
+    payload_unknown = 0,   // not an opcode of this protocol, any size
+    payload_exact = 1,     // *size* or *alt_size* bytes
+    payload_min = 2,       // at least *size* bytes
+    payload_empty_or_min = 3,  // empty, or at least *size* bytes
+};
+
+// static description of the payload of an opcode, see opcode_descs
+// * only the checks that do not depend on the content of the payload; the
+//   ones that do (e.g. records) are done while converting it
+struct opcode_desc_t
+{
+    payload_rule_t rule;
+    std::uint32_t size;
+    std::uint32_t alt_size;  // an alternate exact size; same as *size* if none
+};
+
+namespace detail
+{
+    constexpr opcode_desc_t opcode_desc(
+        payload_rule_t rule, std::size_t size, std::size_t alt_size) noexcept
+    {
+        return {
+            rule,
+            static_cast<std::uint32_t>(size),
+            static_cast<std::uint32_t>(alt_size) };
+    }
+
+    constexpr opcode_desc_t opcode_desc(
+        payload_rule_t rule, std::size_t size) noexcept
+    {
+        return opcode_desc(rule, size, size);
+    }
+
+    constexpr std::array<opcode_desc_t, 256> make_opcode_descs() noexcept
+    {
+        std::array<opcode_desc_t, 256> descs{};
+
+        descs[op_channel_setup] =
+            opcode_desc(payload_exact, sizeof(payload_channel_setup_t));
+        descs[op_channel_setup_ack] = opcode_desc(
+            payload_exact,
+            sizeof(payload_channel_setup_ack_t),
+            sizeof(payload_channel_setup_ack_ext_t));
+        descs[op_status] =
+            opcode_desc(payload_exact, sizeof(payload_status_t));
+        descs[op_stats] =
+            opcode_desc(payload_empty_or_min, sizeof(payload_stats_t));
+        descs[op_ping] =
+            opcode_desc(payload_exact, 0, sizeof(payload_ping_t));
+        descs[op_socks] =
+            opcode_desc(payload_min, sizeof(payload_socks_header_t) + 1);
+        descs[op_socks_close] =
+            opcode_desc(payload_exact, sizeof(payload_socks_header_t));
+        descs[op_socks_disconnected] =
+            opcode_desc(payload_exact, sizeof(payload_socks_header_t));
+        descs[op_socks_flow] =
+            opcode_desc(payload_exact, sizeof(payload_socks_flow_t));
+        descs[op_socks_batch] =
+            opcode_desc(payload_min, sizeof(payload_socks_batch_record_t) + 1);
+        descs[op_socks_lz4] =
+            opcode_desc(payload_min, sizeof(payload_socks_lz4_header_t) + 1);
+        descs[op_socks_udp] = opcode_desc(
+            payload_min,
+            sizeof(payload_socks_header_t) +
+            sizeof(payload_socks_udp_record_t) + 1);
+        descs[op_socks_udp_associated] =
+            opcode_desc(payload_exact, sizeof(payload_socks_header_t));
+        descs[op_socks_resume] =
+            opcode_desc(payload_exact, sizeof(payload_socks_resume_t));
+        descs[op_uninstall_self] = opcode_desc(payload_exact, 0);
+
+        return descs;
+    }
+}  // namespace detail
+
+// indexed by opcode_t; must be updated along with it
+static constexpr std::array<opcode_desc_t, 256> opcode_descs =
+    detail::make_opcode_descs();
+
+static_assert(opcode_descs[op_socks_flow].size == 9, "opcode_descs mismatch");
+static_assert(opcode_descs[op_uninstall_self].rule == payload_exact,
+    "opcode_descs mismatch");
+
+inline constexpr bool is_payload_size_valid(
+    const opcode_desc_t& desc, std::size_t size) noexcept
+{
+    switch (desc.rule)
+    {
+        case payload_exact:
+            return size == desc.size || size == desc.alt_size;
+        case payload_min:
+            return size >= desc.size;
+        case payload_empty_or_min:
+            return size == 0 || size >= desc.size;
+        default:
+            return true;
+    }
+}
+
+
+// a view to a packet extracted from an input_stream_t
+//
+// * header and payload values are already net2host()'ed
+// * only valid until the next call to input_stream_t::feed()
+// * payload_as() is a typed read-only access to the payload; its size has been
+//   checked against opcode_descs already, so that *T* can be the struct the
+//   payload of header->opcode starts with
+struct packet_view_t
+{
+    const header_t* header;
+    const byte_t* data;  // whole packet, starting with header
+    std::size_t size;    // whole packet size (i.e. header->len)
+
+    const byte_t* payload() const { return data + sizeof(header_t); }
+    std::size_t payload_size() const { return size - sizeof(header_t); }
+
+    template <typename T>
+    const T& payload_as(std::size_t offset=0) const
+    {
+        assert(offset + sizeof(T) <= this->payload_size());
+        return *reinterpret_cast<const T*>(this->payload() + offset);
+    }
+};
+
 
 template <typename T>
 inline constexpr T host2net(T value) noexcept
@@ -151,20 +701,104 @@ inline constexpr T net2host(T value) noexcept
 
 std::uint32_t generate_uid() noexcept;
 clientid_t generate_client_id() noexcept;
-std::uint32_t crc32(const proto::header_t& header) noexcept;
+std::uint32_t crc32(
+    const proto::header_t& header, crc_mode_t crc_mode=crc_full) noexcept;
 
+// recompute the CRC32 of a packet made by one of the make_* functions below
+void update_crc(bytes_t& packet, crc_mode_t crc_mode);
+
+// the packet is copied to *out_packet*, its CRC32 being checked on the way
+// (see cix::crc32::update_copy()) so that it is read only once
 error_t extract_next_packet(
     bytes_t& stream,
     bytes_t& out_packet,
     std::uint32_t* out_uid=nullptr) noexcept;
 
+// zero-copy flavor of extract_next_packet(): packet is converted in place and
+// consumed from *stream* (see packet_view_t); a packet longer than *max_size*
+// is error_toobig
+error_t extract_next_packet(
+    input_stream_t& stream,
+    packet_view_t& out_packet,
+    std::uint32_t* out_uid=nullptr,
+    crc_mode_t crc_mode=crc_full,
+    std::size_t max_size=max_packet_size) noexcept;
+
+// message flavor of the above: *stream* is expected to hold exactly one packet,
+// from its very first byte (see chansetup_message_frames), so that the magic
+// word is not searched for, and no incomplete packet waited for; the stream is
+// consumed whole either way, and a packet that is incomplete or followed by
+// data is error_malformed
+error_t extract_whole_packet(
+    input_stream_t& stream,
+    packet_view_t& out_packet,
+    std::uint32_t* out_uid=nullptr,
+    crc_mode_t crc_mode=crc_full,
+    std::size_t max_size=max_packet_size) noexcept;
+
 bytes_t make_channel_setup(clientid_t client_id, channel_setup_flags_t flags);
-bytes_t make_channel_setup_ack(std::uint32_t uid, clientid_t client_id);
-bytes_t make_status(std::uint32_t uid, status_t status);
+
+// control packets: like make_socks() below, *storage* is reused if not empty,
+// e.g. a pooled buffer (see control_packet_max_size), so that the frames that
+// go back and forth the most do not allocate
+bytes_t make_channel_setup_ack(
+    std::uint32_t uid, clientid_t client_id, bytes_t&& storage=bytes_t());
+bytes_t make_channel_setup_ack_ext(
+    std::uint32_t uid, clientid_t client_id, channel_setup_flags_t caps,
+    bytes_t&& storage=bytes_t());
+bytes_t make_status(
+    std::uint32_t uid, status_t status, bytes_t&& storage=bytes_t());
+bytes_t make_stats(std::uint32_t uid, const payload_stats_t& stats);
 bytes_t make_ping();
+bytes_t make_ping(
+    std::uint32_t uid, std::uint64_t stamp, ping_kind_t kind,
+    bytes_t&& storage=bytes_t());
 bytes_t make_socks(socksid_t socks_id, const bytes_t& socks_packet);
-bytes_t make_socks_close(socksid_t socks_id);
-bytes_t make_socks_disconnected(socksid_t socks_id);
+
+// same as above but reuses the memory of *storage* (e.g. a pooled buffer); with
+// crc_full, the CRC32 is computed while copying the SOCKS data
+bytes_t make_socks(
+    socksid_t socks_id, const bytes_t& socks_packet, bytes_t&& storage,
+    crc_mode_t crc_mode=crc_full);
+
+// same as above but *buffer* is made of *socks_headroom* leading bytes, whose
+// value does not matter, followed by the SOCKS data, so that the packet is
+// built in place without copying the data
+bytes_t frame_socks(
+    socksid_t socks_id, bytes_t&& buffer, crc_mode_t crc_mode=crc_full);
+bytes_t make_socks_close(socksid_t socks_id, bytes_t&& storage=bytes_t());
+bytes_t make_socks_disconnected(
+    socksid_t socks_id, bytes_t&& storage=bytes_t());
+bytes_t make_socks_flow(socksid_t socks_id, socks_flow_t flow);
+
+// op_socks_batch: records are appended one by one to *batch*, which may come
+// from a pooled buffer, then make_socks_batch() turns it into a packet
+// * returns false if the record would not fit in a packet
+// * append_socks_batch_record() leaves room for the header in an empty *batch*
+bool append_socks_batch_record(
+    bytes_t& batch, socksid_t socks_id, const bytes_t& socks_packet);
+bool append_socks_batch_record(
+    bytes_t& batch, socksid_t socks_id, const byte_t* data, std::size_t size);
+bytes_t make_socks_batch(bytes_t&& batch, crc_mode_t crc_mode=crc_full);
+
+// returns an empty packet if compressed data would not be smaller than
+// *socks_packet*, in which case *storage* is left untouched
+bytes_t make_socks_lz4(
+    socksid_t socks_id, const bytes_t& socks_packet, bytes_t& storage,
+    crc_mode_t crc_mode=crc_full);
+bytes_t make_socks_lz4(
+    socksid_t socks_id, const byte_t* data, std::size_t size,
+    bytes_t& storage, crc_mode_t crc_mode=crc_full);
+
+// op_socks_udp: *datagrams* are all sent at once, so that they must fit in a
+// single packet (CIX_THROW_LENGTH otherwise); empty ones are skipped
+bytes_t make_socks_udp(
+    socksid_t socks_id, const std::vector<bytes_t>& datagrams,
+    crc_mode_t crc_mode=crc_full);
+bytes_t make_socks_udp_associated(socksid_t socks_id);
+
+// *socks_id* may be invalid_socks_id, to end the list
+bytes_t make_socks_resume(socksid_t socks_id, std::uint64_t offset);
 bytes_t make_uninstall_self();
 
 }  // namespace proto
@@ -0,0 +1,245 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "main.h"
+
+namespace detail
+{
+    // bounds the refill of a bucket that has been idle for long, so that the
+    // product cannot overflow
+    static constexpr cix::ticks_t rate_max_elapsed = 3600 * 1000;
+}
+
+
+rate_limiter_t::rate_limiter_t()
+    : m_group_rate{0}
+    , m_session_rate{0}
+    , m_burst{default_burst}
+    , m_aggregate{0, 0}
+    , m_throttles{0}
+{
+}
+
+
+void rate_limiter_t::configure(
+    std::uint64_t group_rate,
+    std::uint64_t session_rate,
+    cix::ticks_t burst)
+{
+    std::scoped_lock lock(m_mutex);
+
+    assert(m_sessions.empty());
+
+    m_group_rate = group_rate;
+    m_session_rate = session_rate;
+    m_burst = std::max<cix::ticks_t>(burst, 1);
+    m_aggregate = bucket_t{0, cix::ticks_now()};
+}
+
+
+void rate_limiter_t::add_session(group_t group, key_t session)
+{
+    if (!this->enabled())
+        return;
+
+    const auto now = cix::ticks_now();
+
+    std::scoped_lock lock(m_mutex);
+
+    if (m_sessions.find(session) != m_sessions.end())
+    {
+        assert(0);
+        return;
+    }
+
+    m_sessions.insert(std::make_pair(
+        session, session_t{group, this->full_bucket(m_session_rate, now)}));
+
+    auto group_it = m_groups.find(group);
+
+    if (group_it != m_groups.end())
+    {
+        ++group_it->second.sessions;
+        return;
+    }
+
+    // the aggregate gets the share of the new group too, from now on
+    this->refill_aggregate(now);
+
+    m_groups.insert(std::make_pair(
+        group, group_state_t{this->full_bucket(m_group_rate, now), 1}));
+
+    m_aggregate.tokens = std::min(
+        m_aggregate.tokens + this->capacity(m_group_rate),
+        this->capacity(m_group_rate * m_groups.size()));
+}
+
+
+void rate_limiter_t::remove_session(key_t session)
+{
+    if (!this->enabled())
+        return;
+
+    std::scoped_lock lock(m_mutex);
+
+    auto session_it = m_sessions.find(session);
+    if (session_it == m_sessions.end())
+        return;
+
+    const auto group = session_it->second.group;
+
+    m_sessions.erase(session_it);
+
+    auto group_it = m_groups.find(group);
+    if (group_it == m_groups.end())
+    {
+        assert(0);
+        return;
+    }
+
+    if (--group_it->second.sessions > 0)
+        return;
+
+    // with the rate it had until now
+    this->refill_aggregate(cix::ticks_now());
+
+    m_groups.erase(group_it);
+
+    m_aggregate.tokens = std::min(
+        m_aggregate.tokens, this->capacity(m_group_rate * m_groups.size()));
+}
+
+
+cix::ticks_t rate_limiter_t::consume(key_t session, std::size_t bytes)
+{
+    if (!this->enabled() || bytes == 0)
+        return 0;
+
+    const auto now = cix::ticks_now();
+    const auto cost = static_cast<std::int64_t>(bytes) * 1000;
+    cix::ticks_t delay = 0;
+
+    std::scoped_lock lock(m_mutex);
+
+    auto session_it = m_sessions.find(session);
+    if (session_it == m_sessions.end())
+        return 0;
+
+    auto& state = session_it->second;
+
+    if (m_session_rate != 0)
+    {
+        this->refill(state.bucket, m_session_rate, now);
+        state.bucket.tokens -= cost;
+
+        if (state.bucket.tokens <= 0)
+            delay = rate_limiter_t::delay_of(state.bucket, m_session_rate);
+    }
+
+    if (m_group_rate != 0)
+    {
+        auto group_it = m_groups.find(state.group);
+        assert(group_it != m_groups.end());
+
+        if (group_it != m_groups.end())
+        {
+            auto& bucket = group_it->second.bucket;
+
+            this->refill(bucket, m_group_rate, now);
+            this->refill_aggregate(now);
+
+            // within its share, which counts against the aggregate too since
+            // the latter is refilled with it; borrowed otherwise, in which
+            // case the share of the group remains for itself
+            if (bucket.tokens > 0)
+                bucket.tokens -= cost;
+
+            m_aggregate.tokens -= cost;
+
+            if (bucket.tokens <= 0 && m_aggregate.tokens <= 0)
+            {
+                const auto aggregate_rate = m_group_rate * m_groups.size();
+
+                delay = std::max(delay, std::min(
+                    rate_limiter_t::delay_of(bucket, m_group_rate),
+                    rate_limiter_t::delay_of(m_aggregate, aggregate_rate)));
+            }
+        }
+    }
+
+    if (delay > 0)
+        ++m_throttles;
+
+    return delay;
+}
+
+
+rate_limiter_t::stats_t rate_limiter_t::stats() const
+{
+    std::scoped_lock lock(m_mutex);
+
+    stats_t stats;
+
+    stats.groups = m_groups.size();
+    stats.sessions = m_sessions.size();
+    stats.throttles = m_throttles;
+
+    return stats;
+}
+
+
+rate_limiter_t::bucket_t rate_limiter_t::full_bucket(
+    std::uint64_t rate, cix::ticks_t now) const
+{
+    return bucket_t{this->capacity(rate), now};
+}
+
+
+std::int64_t rate_limiter_t::capacity(std::uint64_t rate) const
+{
+    return static_cast<std::int64_t>(std::max<std::uint64_t>(
+        rate * m_burst, std::uint64_t(min_burst_size) * 1000));
+}
+
+
+void rate_limiter_t::refill(
+    bucket_t& bucket, std::uint64_t rate, cix::ticks_t now) const
+{
+    // CAUTION: m_mutex must be locked by caller
+
+    if (now <= bucket.refilled)
+        return;
+
+    const auto elapsed = std::min(
+        cix::ticks_elapsed(bucket.refilled, now), detail::rate_max_elapsed);
+
+    // a rate is bytes per second, i.e. thousandths of a byte per millisecond
+    bucket.tokens = std::min(
+        bucket.tokens + static_cast<std::int64_t>(elapsed * rate),
+        this->capacity(rate));
+    bucket.refilled = now;
+}
+
+
+void rate_limiter_t::refill_aggregate(cix::ticks_t now)
+{
+    // CAUTION: m_mutex must be locked by caller
+
+    this->refill(m_aggregate, m_group_rate * m_groups.size(), now);
+}
+
+
+cix::ticks_t rate_limiter_t::delay_of(
+    const bucket_t& bucket, std::uint64_t rate)
+{
+    // milliseconds until *bucket* holds tokens again
+
+    if (bucket.tokens > 0)
+        return 0;
+
+    if (rate == 0)
+        return std::numeric_limits<cix::ticks_t>::max();
+
+    return static_cast<cix::ticks_t>(
+        static_cast<std::uint64_t>(-bucket.tokens) / rate + 1);
+}
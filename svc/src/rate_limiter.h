@@ -0,0 +1,103 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// Token buckets that bound the rate at which socks_proxy reads its SOCKS
+// targets, per group of sessions (i.e. proto client, see
+// socks_proxy::create_client()) and per session, so that a client pulling
+// data at full speed does not take the whole link from the others
+//
+// * rates are in bytes per second, 0 for no limit; a bucket holds up to
+//   *burst* milliseconds of its rate, and at least *min_burst_size* bytes
+// * data is accounted once read (see consume()), so that a bucket may go into
+//   debt, in which case the session is to stop reading until the delay
+//   returned by consume() elapsed
+// * the rate of a group is its guaranteed share: it can always read at that
+//   rate; beyond it, it borrows from the aggregate bucket, which is refilled
+//   at the sum of the rates of all the groups, and drained by all of them, so
+//   that the share idle groups do not use goes to the busy ones while a group
+//   that becomes busy again gets its own share right away
+// * the rate of a session is a cap, it is never exceeded by borrowing
+// * a group exists as long as it has sessions, see add_session()
+// * thread-safe
+class rate_limiter_t
+{
+public:
+    typedef std::uint64_t group_t;
+    typedef std::uint64_t key_t;
+
+    enum : cix::ticks_t { default_burst = 100 };  // milliseconds
+    enum : std::size_t { min_burst_size = 64 * 1024 };
+
+    struct stats_t
+    {
+        std::size_t groups;
+        std::size_t sessions;
+        std::uint64_t throttles;  // consume() calls that returned a delay
+    };
+
+public:
+    rate_limiter_t();
+    ~rate_limiter_t() = default;
+
+    rate_limiter_t(const rate_limiter_t&) = delete;
+    rate_limiter_t& operator=(const rate_limiter_t&) = delete;
+
+    // must be called before any session gets added
+    void configure(
+        std::uint64_t group_rate,
+        std::uint64_t session_rate,
+        cix::ticks_t burst=default_burst);
+
+    // constant once configured, so that callers can skip the lock
+    bool enabled() const { return m_group_rate != 0 || m_session_rate != 0; }
+
+    void add_session(group_t group, key_t session);
+    void remove_session(key_t session);
+
+    // account *bytes* read by *session*; return 0 if it may go on reading,
+    // otherwise the milliseconds to wait until it may read again
+    cix::ticks_t consume(key_t session, std::size_t bytes);
+
+    stats_t stats() const;
+
+private:
+    // tokens are in thousandths of a byte, so that a bucket is refilled by its
+    // rate every millisecond without rounding
+    struct bucket_t
+    {
+        std::int64_t tokens;  // negative for a debt
+        cix::ticks_t refilled;
+    };
+
+    struct group_state_t
+    {
+        bucket_t bucket;
+        std::size_t sessions;
+    };
+
+    struct session_t
+    {
+        group_t group;
+        bucket_t bucket;
+    };
+
+private:
+    bucket_t full_bucket(std::uint64_t rate, cix::ticks_t now) const;
+    std::int64_t capacity(std::uint64_t rate) const;
+    void refill(bucket_t& bucket, std::uint64_t rate, cix::ticks_t now) const;
+    void refill_aggregate(cix::ticks_t now);
+    static cix::ticks_t delay_of(const bucket_t& bucket, std::uint64_t rate);
+
+private:
+    mutable std::mutex m_mutex;
+    std::uint64_t m_group_rate;
+    std::uint64_t m_session_rate;
+    cix::ticks_t m_burst;
+    bucket_t m_aggregate;  // at *m_group_rate* times the count of groups
+    std::unordered_map<group_t, group_state_t> m_groups;
+    cix::flat_hash_map<key_t, session_t> m_sessions;
+    std::uint64_t m_throttles;
+};
@@ -0,0 +1,105 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "main.h"
+
+
+replay_buffer_t::replay_buffer_t(
+        std::size_t max_size,
+        std::shared_ptr<cix::buffer_pool> pool,
+        std::shared_ptr<mem_budget_t> mem_budget)
+    : m_max_size{max_size}
+    , m_pool(std::move(pool))
+    , m_mem_budget(std::move(mem_budget))
+    , m_size{0}
+    , m_end{0}
+{
+    assert(m_pool);
+    assert(m_mem_budget);
+}
+
+
+replay_buffer_t::~replay_buffer_t()
+{
+    this->clear();
+}
+
+
+void replay_buffer_t::append(const byte_t* data, std::size_t size)
+{
+    if (size == 0)
+        return;
+
+    auto chunk = m_pool->acquire(size);
+    std::memcpy(chunk.data(), data, size);
+
+    m_chunks.push_back(std::move(chunk));
+    m_size += size;
+    m_end += size;
+    m_mem_budget->charge(size);
+}
+
+
+void replay_buffer_t::trim(std::uint64_t sent_offset)
+{
+    auto chunk_end = this->begin_offset();
+
+    while (!m_chunks.empty())
+    {
+        const auto chunk_size = m_chunks.front().size();
+
+        chunk_end += chunk_size;
+
+        if (m_size - chunk_size < m_max_size || chunk_end > sent_offset)
+            break;
+
+        m_pool->release(std::move(m_chunks.front()));
+        m_chunks.pop_front();
+        m_size -= chunk_size;
+        m_mem_budget->discharge(chunk_size);
+    }
+}
+
+
+bool replay_buffer_t::copy_from(
+    std::uint64_t offset,
+    std::size_t headroom,
+    std::vector<bytes_t>& out_buffers) const
+{
+    if (offset < this->begin_offset() || offset > m_end)
+        return false;
+
+    auto chunk_begin = this->begin_offset();
+
+    for (const auto& chunk : m_chunks)
+    {
+        const auto chunk_end = chunk_begin + chunk.size();
+
+        if (offset < chunk_end)
+        {
+            const auto skip = static_cast<std::size_t>(offset - chunk_begin);
+            const auto size = chunk.size() - skip;
+            auto buffer = m_pool->acquire(headroom + size);
+
+            std::memcpy(buffer.data() + headroom, chunk.data() + skip, size);
+            out_buffers.push_back(std::move(buffer));
+
+            offset = chunk_end;
+        }
+
+        chunk_begin = chunk_end;
+    }
+
+    return true;
+}
+
+
+void replay_buffer_t::clear()
+{
+    for (auto& chunk : m_chunks)
+        m_pool->release(std::move(chunk));
+
+    m_chunks.clear();
+    m_mem_budget->discharge(m_size);
+    m_size = 0;
+}
@@ -0,0 +1,60 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// The tail of the SOCKS data sent to a client on a given SOCKS connection,
+// kept so that whatever got lost along with a channel can be sent again once
+// the client resumed its session (see proto::chansetup_resume)
+//
+// * data is addressed by offset in the stream, from 0 for the first byte ever
+//   appended; only [begin_offset(), end_offset()) is still held
+// * data is appended as it is sent, then trim() drops the oldest chunks as
+//   long as at least *max_size* bytes remain; data that has not been sent
+//   yet (i.e. past *sent_offset*) is never dropped, so that the buffer goes
+//   above *max_size* while a session is on hold
+// * chunks are copies, from and back to a cix::buffer_pool, and are charged
+//   to a mem_budget_t
+// * not thread-safe
+class replay_buffer_t
+{
+public:
+    typedef std::uint8_t byte_t;
+    typedef std::vector<byte_t> bytes_t;
+
+public:
+    replay_buffer_t(
+        std::size_t max_size,
+        std::shared_ptr<cix::buffer_pool> pool,
+        std::shared_ptr<mem_budget_t> mem_budget);
+    ~replay_buffer_t();
+
+    replay_buffer_t(const replay_buffer_t&) = delete;
+    replay_buffer_t& operator=(const replay_buffer_t&) = delete;
+
+    std::uint64_t begin_offset() const { return m_end - m_size; }
+    std::uint64_t end_offset() const { return m_end; }
+    std::size_t size() const { return m_size; }
+
+    void append(const byte_t* data, std::size_t size);
+    void trim(std::uint64_t sent_offset);
+
+    // copy [offset, end_offset()) to *out_buffers*, each one starting with
+    // *headroom* bytes of undefined value; false if *offset* is not held
+    bool copy_from(
+        std::uint64_t offset,
+        std::size_t headroom,
+        std::vector<bytes_t>& out_buffers) const;
+
+    void clear();
+
+private:
+    const std::size_t m_max_size;
+    const std::shared_ptr<cix::buffer_pool> m_pool;
+    const std::shared_ptr<mem_budget_t> m_mem_budget;
+
+    std::deque<bytes_t> m_chunks;
+    std::size_t m_size;   // bytes held, all chunks
+    std::uint64_t m_end;  // offset of the next byte to be appended
+};
@@ -0,0 +1,543 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "main.h"
+
+namespace detail
+{
+    // AI_ADDRCONFIG, Vista and above
+    static constexpr int ai_addrconfig = 0x0400;
+
+    // CAUTION: the layout must match the SDK's ADDRINFOEXW
+    struct addrinfoexw_t
+    {
+        int ai_flags;
+        int ai_family;
+        int ai_socktype;
+        int ai_protocol;
+        std::size_t ai_addrlen;
+        PWSTR ai_canonname;
+        struct sockaddr* ai_addr;
+        void* ai_blob;
+        std::size_t ai_bloblen;
+        LPGUID ai_provider;
+        addrinfoexw_t* ai_next;
+    };
+
+    // CAUTION: the signature must match the SDK's
+    // LPLOOKUPSERVICE_COMPLETION_ROUTINE
+    typedef void (CALLBACK* lookup_completion_t)(
+        DWORD, DWORD, LPWSAOVERLAPPED);
+
+    typedef INT (WSAAPI* get_addrinfo_ex_t)(
+        PCWSTR, PCWSTR, DWORD, LPGUID, const addrinfoexw_t*,
+        addrinfoexw_t**, struct timeval*, LPOVERLAPPED, lookup_completion_t,
+        LPHANDLE);
+    typedef INT (WSAAPI* cancel_addrinfo_ex_t)(LPHANDLE);
+    typedef INT (WSAAPI* addrinfo_ex_result_t)(LPOVERLAPPED);
+    typedef void (WSAAPI* free_addrinfo_ex_t)(addrinfoexw_t*);
+
+    struct ws2_t
+    {
+        get_addrinfo_ex_t get;
+        cancel_addrinfo_ex_t cancel;   // Windows 8 and above
+        addrinfo_ex_result_t result;   // same
+        free_addrinfo_ex_t free;
+    };
+
+    struct event_t
+    {
+        HANDLE handle = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+
+        event_t() = default;
+        event_t(const event_t&) = delete;
+        event_t& operator=(const event_t&) = delete;
+
+        ~event_t()
+        {
+            if (handle)
+                CloseHandle(handle);
+        }
+    };
+
+    // the storage of a merged list, see merge()
+    struct addrinfo_list_t
+    {
+        std::vector<struct addrinfo> nodes;
+        std::vector<struct sockaddr_storage> addrs;
+    };
+
+    static const ws2_t& ws2()
+    {
+        // never unloaded, linked to the executable anyway
+        static const auto table = []() -> ws2_t
+        {
+            ws2_t out{nullptr, nullptr, nullptr, nullptr};
+            const auto module = LoadLibraryW(L"ws2_32.dll");
+
+            if (!module)
+                return out;
+
+            out.get = reinterpret_cast<get_addrinfo_ex_t>(
+                GetProcAddress(module, "GetAddrInfoExW"));
+            out.cancel = reinterpret_cast<cancel_addrinfo_ex_t>(
+                GetProcAddress(module, "GetAddrInfoExCancel"));
+            out.result = reinterpret_cast<addrinfo_ex_result_t>(
+                GetProcAddress(module, "GetAddrInfoExOverlappedResult"));
+            out.free = reinterpret_cast<free_addrinfo_ex_t>(
+                GetProcAddress(module, "FreeAddrInfoExW"));
+
+            if (!out.get || !out.cancel || !out.result || !out.free)
+                out = ws2_t{nullptr, nullptr, nullptr, nullptr};
+
+            return out;
+        }();
+
+        return table;
+    }
+
+    // AAAA then A, see merge()
+    static const int families[] = { AF_INET6, AF_INET };
+
+    // interleave the addresses of *first* and *second* into a getaddrinfo()
+    // like list, that owns a copy of them
+    static dns_cache::addrinfo_ptr merge(
+        const addrinfoexw_t* first, const addrinfoexw_t* second)
+    {
+        std::vector<const addrinfoexw_t*> picked;
+
+        while (first || second)
+        {
+            for (auto* ai : { &first, &second })
+            {
+                // skip what a connect cannot use
+                while (*ai &&
+                    (!(*ai)->ai_addr ||
+                    (*ai)->ai_addrlen > sizeof(struct sockaddr_storage)))
+                {
+                    *ai = (*ai)->ai_next;
+                }
+
+                if (*ai)
+                {
+                    picked.push_back(*ai);
+                    *ai = (*ai)->ai_next;
+                }
+            }
+        }
+
+        if (picked.empty())
+            return nullptr;
+
+        auto list = std::make_shared<addrinfo_list_t>();
+
+        list->nodes.resize(picked.size());
+        list->addrs.resize(picked.size());
+
+        for (std::size_t idx = 0; idx < picked.size(); ++idx)
+        {
+            const auto& src = *picked[idx];
+            auto& node = list->nodes[idx];
+
+            node = {};
+            node.ai_family = src.ai_family;
+            node.ai_socktype = SOCK_STREAM;
+            node.ai_protocol = src.ai_protocol;
+            node.ai_addrlen = src.ai_addrlen;
+            node.ai_addr =
+                reinterpret_cast<struct sockaddr*>(&list->addrs[idx]);
+            std::memcpy(node.ai_addr, src.ai_addr, src.ai_addrlen);
+
+            if (idx + 1 < picked.size())
+                node.ai_next = &list->nodes[idx + 1];
+        }
+
+        // aliasing constructor, the list owns the nodes
+        return dns_cache::addrinfo_ptr(list, list->nodes.data());
+    }
+}
+
+
+struct resolver_t::lookup_t
+{
+    // a single-family query
+    struct query_t
+    {
+        OVERLAPPED ol;  // see CONTAINING_RECORD() in on_query_complete()
+        lookup_t* owner;
+        HANDLE handle;  // see cancel_addrinfo_ex_t
+        detail::addrinfoexw_t* result;
+        int error;
+        bool pending;
+    };
+
+    resolver_t* resolver;
+    key_t key;
+    on_resolved_t on_resolved;
+    detail::event_t cancel_event;  // see cancel(), also set by finish()
+
+    // protected by *mutex*
+    std::mutex mutex;
+    HANDLE wait;  // on *cancel_event*, see on_wait()
+    query_t queries[std::size(detail::families)];
+    std::size_t pending;  // queries
+    int outcome;  // error_timeout or error_cancelled if not null
+    bool done;  // finish()ed
+
+    // held by the pending queries, and by *wait* until it fired
+    std::shared_ptr<lookup_t> queries_ref;
+    std::shared_ptr<lookup_t> wait_ref;
+};
+
+
+resolver_t::resolver_t()
+    : m_timeout{default_timeout}
+    , m_queries{0}
+    , m_timeouts{0}
+    , m_cancelled{0}
+    , m_fallbacks{0}
+{ }
+
+
+void resolver_t::configure(DWORD timeout)
+{
+    m_timeout = timeout;
+}
+
+
+bool resolver_t::available()
+{
+    return detail::ws2().get != nullptr;
+}
+
+
+int resolver_t::resolve(
+    key_t key, const std::string& host, unsigned short port,
+    const is_cancelled_t& is_cancelled,
+    dns_cache::addrinfo_ptr& out_addr)
+{
+    out_addr.reset();
+
+    if (resolver_t::available())
+    {
+        detail::event_t done_event;
+        int error = EAI_MEMORY;
+
+        if (!done_event.handle)
+            return error;
+
+        // called once, after which none of these is touched anymore
+        this->resolve_async(
+            key, host, port, is_cancelled,
+            [&](int error_, dns_cache::addrinfo_ptr&& addr) {
+                error = error_;
+                out_addr = std::move(addr);
+                SetEvent(done_event.handle);
+            });
+
+        WaitForSingleObject(done_event.handle, INFINITE);
+
+        return error;
+    }
+
+    m_queries.fetch_add(1, std::memory_order_relaxed);
+    m_fallbacks.fetch_add(1, std::memory_order_relaxed);
+
+    // cannot be cancelled once started, but no need to start at all
+    if (is_cancelled && is_cancelled())
+    {
+        m_cancelled.fetch_add(1, std::memory_order_relaxed);
+        return error_cancelled;
+    }
+
+    struct addrinfo hints;
+    struct addrinfo* ai = nullptr;
+    char port_str[8];
+
+    SecureZeroMemory(&hints, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    snprintf(port_str, sizeof(port_str), "%u", port);
+
+    const auto error = getaddrinfo(host.c_str(), port_str, &hints, &ai);
+    out_addr = dns_cache::make_addrinfo_ptr(error == 0 ? ai : nullptr);
+
+    return error;
+}
+
+
+void resolver_t::resolve_async(
+    key_t key, const std::string& host, unsigned short port,
+    const is_cancelled_t& is_cancelled,
+    on_resolved_t&& on_resolved)
+{
+    assert(resolver_t::available());
+
+    const auto& ws2 = detail::ws2();
+    const auto name = xstr::widen_utf8_lenient(host);
+    const auto service = std::to_wstring(port);
+    auto lookup = std::make_shared<lookup_t>();
+
+    m_queries.fetch_add(1, std::memory_order_relaxed);
+
+    lookup->resolver = this;
+    lookup->key = key;
+    lookup->on_resolved = std::move(on_resolved);
+    lookup->wait = nullptr;
+    std::memset(lookup->queries, 0, sizeof(lookup->queries));
+    lookup->pending = 0;
+    lookup->outcome = 0;
+    lookup->done = false;
+
+    if (!lookup->cancel_event.handle)
+    {
+        lookup->on_resolved(EAI_MEMORY, nullptr);
+        return;
+    }
+
+    {
+        std::scoped_lock lock(m_mutex);
+        m_pending.insert(std::make_pair(key, lookup->cancel_event.handle));
+    }
+
+    // from now on cancel() sets *cancel_event*; one that came before found
+    // nothing to cancel, in which case no query is started at all
+    if (is_cancelled && is_cancelled())
+    {
+        lookup->outcome = error_cancelled;
+        this->finish(*lookup);
+        return;
+    }
+
+    {
+        // the completions and the wait cannot go before the queries started
+        std::scoped_lock lookup_lock(lookup->mutex);
+
+        lookup->wait_ref = lookup;
+
+        if (!RegisterWaitForSingleObject(
+            &lookup->wait, lookup->cancel_event.handle,
+            &resolver_t::on_wait, lookup.get(),
+            (m_timeout != 0) ? m_timeout : INFINITE, WT_EXECUTEONLYONCE))
+        {
+            LOGERROR("failed to wait for DNS queries (error {})",
+                GetLastError());
+            lookup->wait = nullptr;
+            lookup->wait_ref.reset();
+            lookup->outcome = error_cancelled;
+        }
+
+        for (std::size_t idx = 0;
+            lookup->outcome == 0 && idx < std::size(detail::families);
+            ++idx)
+        {
+            detail::addrinfoexw_t hints{};
+            auto& query = lookup->queries[idx];
+
+            hints.ai_family = detail::families[idx];
+            hints.ai_socktype = SOCK_STREAM;
+            hints.ai_flags = detail::ai_addrconfig;
+
+            query.owner = lookup.get();
+
+            const auto res = ws2.get(
+                name.c_str(), service.c_str(), NS_ALL, nullptr, &hints,
+                &query.result, nullptr, &query.ol,
+                &resolver_t::on_query_complete, &query.handle);
+
+            // completed already otherwise, in which case the completion
+            // routine is not called
+            if (res == WSA_IO_PENDING)
+            {
+                query.pending = true;
+                ++lookup->pending;
+            }
+            else
+            {
+                query.error = res;
+            }
+        }
+
+        if (lookup->pending > 0)
+        {
+            lookup->queries_ref = lookup;
+            return;
+        }
+    }
+
+    this->finish(*lookup);
+}
+
+
+void resolver_t::cancel(key_t key)
+{
+    std::scoped_lock lock(m_mutex);
+
+    const auto range = m_pending.equal_range(key);
+
+    for (auto it = range.first; it != range.second; ++it)
+        SetEvent(it->second);
+}
+
+
+void resolver_t::cancel_all()
+{
+    std::scoped_lock lock(m_mutex);
+
+    for (const auto& pending : m_pending)
+        SetEvent(pending.second);
+}
+
+
+resolver_t::stats_t resolver_t::stats() const
+{
+    stats_t stats;
+
+    stats.queries = m_queries.load(std::memory_order_relaxed);
+    stats.timeouts = m_timeouts.load(std::memory_order_relaxed);
+    stats.cancelled = m_cancelled.load(std::memory_order_relaxed);
+    stats.fallbacks = m_fallbacks.load(std::memory_order_relaxed);
+
+    return stats;
+}
+
+
+void resolver_t::finish(lookup_t& lookup)
+{
+    // once the queries are over, or were never started; the caller holds a
+    // reference to *lookup*
+
+    const auto& ws2 = detail::ws2();
+    dns_cache::addrinfo_ptr addr;
+    int error = 0;
+
+    {
+        std::scoped_lock lock(m_mutex);
+
+        const auto range = m_pending.equal_range(lookup.key);
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            if (it->second == lookup.cancel_event.handle)
+            {
+                m_pending.erase(it);
+                break;
+            }
+        }
+    }
+
+    {
+        std::scoped_lock lookup_lock(lookup.mutex);
+
+        auto& queries = lookup.queries;
+
+        lookup.done = true;
+
+        if (lookup.outcome == 0)
+        {
+            addr = detail::merge(
+                (queries[0].error == 0) ? queries[0].result : nullptr,
+                (queries[1].error == 0) ? queries[1].result : nullptr);
+        }
+
+        for (auto& query : queries)
+        {
+            if (query.result)
+            {
+                ws2.free(query.result);
+                query.result = nullptr;
+            }
+        }
+
+        if (lookup.outcome == error_timeout)
+        {
+            m_timeouts.fetch_add(1, std::memory_order_relaxed);
+            error = lookup.outcome;
+        }
+        else if (lookup.outcome == error_cancelled)
+        {
+            m_cancelled.fetch_add(1, std::memory_order_relaxed);
+            error = lookup.outcome;
+        }
+        else if (!addr)
+        {
+            // none of the families; the A query tells the most, e.g. AAAA gets
+            // no answer where IPv6 is not configured
+            if (queries[1].error != 0)
+                error = queries[1].error;
+            else if (queries[0].error != 0)
+                error = queries[0].error;
+            else
+                error = EAI_NONAME;  // only unusable addresses
+        }
+    }
+
+    // lets the wait go, see on_wait()
+    SetEvent(lookup.cancel_event.handle);
+
+    lookup.on_resolved(error, std::move(addr));
+}
+
+
+void CALLBACK resolver_t::on_query_complete(
+    DWORD error, DWORD bytes, LPWSAOVERLAPPED ol)
+{
+    CIX_UNVAR(error);
+    CIX_UNVAR(bytes);
+
+    auto& query = *CONTAINING_RECORD(ol, lookup_t::query_t, ol);
+    auto& lookup = *query.owner;
+    std::shared_ptr<lookup_t> ref;
+
+    {
+        std::scoped_lock lock(lookup.mutex);
+
+        query.error = detail::ws2().result(ol);
+        query.pending = false;
+
+        if (--lookup.pending > 0)
+            return;
+
+        ref = std::move(lookup.queries_ref);
+    }
+
+    lookup.resolver->finish(lookup);
+}
+
+
+void CALLBACK resolver_t::on_wait(PVOID param, BOOLEAN timed_out)
+{
+    // the timeout, or *cancel_event*, which finish() sets too
+
+    const auto& ws2 = detail::ws2();
+    auto& lookup = *static_cast<lookup_t*>(param);
+    LPHANDLE handles[std::size(detail::families)];
+    std::size_t count = 0;
+    std::shared_ptr<lookup_t> ref;
+
+    {
+        std::scoped_lock lock(lookup.mutex);
+
+        if (!lookup.done && lookup.outcome == 0)
+        {
+            lookup.outcome = timed_out ? error_timeout : error_cancelled;
+
+            for (auto& query : lookup.queries)
+            {
+                if (query.pending)
+                    handles[count++] = &query.handle;
+            }
+        }
+
+        // from its own callback, this does not wait for it
+        UnregisterWait(lookup.wait);
+        lookup.wait = nullptr;
+
+        ref = std::move(lookup.wait_ref);
+    }
+
+    // their completions follow, with the lock released in case one is called
+    // right away; *ref* keeps the handles valid
+    for (std::size_t idx = 0; idx < count; ++idx)
+        ws2.cancel(handles[idx]);
+}
@@ -0,0 +1,118 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// Name resolution through the overlapped flavor of GetAddrInfoExW(), so that a
+// query can time out and be cancelled
+//
+// * GetAddrInfoExW() is a Vista feature and its overlapped flavor a Windows 8
+//   one, so that none of it is visible to our WINVER 0x0500 target; functions
+//   are loaded from ws2_32.dll by available(), and the structure mirrored
+//   (see detail::addrinfoexw_t in resolver.cpp); where they are not available,
+//   resolve() falls back to a blocking getaddrinfo(), which can neither time
+//   out nor be cancelled
+// * A and AAAA records are queried in parallel, as two queries of a single
+//   family each (AI_ADDRCONFIG, so that a host without IPv6 does not even
+//   query AAAA records), and merged: families are interleaved, IPv6 first, so
+//   that socks_proxy::connect_socket_racing() tries both of them early
+// * the result is a getaddrinfo()-like list, so that it can go through
+//   dns_cache and the connect functions of socks_proxy as is
+// * resolve_async() does not wait for the queries, their completion calls the
+//   caller back, so that no thread is held while a name resolves; the timeout
+//   and cancel() are caught by a wait of the system pool on the cancel event
+//   of the query (RegisterWaitForSingleObject())
+// * resolve() blocks its caller, but until the timeout at most, or until
+//   cancel() is called with the same *key* from another thread
+// * a cancel() that comes before either got to register *key* is caught by
+//   the caller's is_cancelled_t, called once registered
+// * thread-safe
+class resolver_t
+{
+public:
+    typedef std::uint64_t key_t;  // socks_proxy::token_t
+
+    // whether cancel() was called already for the key of a resolve() call;
+    // CAUTION: must be consistent with the calls to cancel(), e.g. read under
+    // the lock they are made with
+    typedef std::function<bool()> is_cancelled_t;
+
+    // outcome of resolve_async(), as returned by resolve()
+    typedef std::function<void(int error, dns_cache::addrinfo_ptr&& addr)>
+        on_resolved_t;
+
+    enum : DWORD { default_timeout = 5000 };  // milliseconds
+
+    // in addition to the getaddrinfo() ones
+    enum : int
+    {
+        error_timeout = WSATRY_AGAIN,  // i.e. EAI_AGAIN, not a definitive one
+        error_cancelled = WSA_E_CANCELLED,
+    };
+
+    struct stats_t
+    {
+        std::uint64_t queries;      // resolve() calls, fallbacks included
+        std::uint64_t timeouts;
+        std::uint64_t cancelled;
+        std::uint64_t fallbacks;    // blocking getaddrinfo() instead
+    };
+
+public:
+    resolver_t();
+    ~resolver_t() = default;
+
+    resolver_t(const resolver_t&) = delete;
+    resolver_t& operator=(const resolver_t&) = delete;
+
+    // *timeout* in milliseconds, 0 for none
+    void configure(DWORD timeout);
+
+    // whether GetAddrInfoExW() can be used asynchronously on this host
+    static bool available();
+
+    // return 0 or a getaddrinfo() error (e.g. EAI_NONAME), error_timeout or
+    // error_cancelled; *out_addr* is non-null on success only
+    int resolve(
+        key_t key, const std::string& host, unsigned short port,
+        const is_cancelled_t& is_cancelled,
+        dns_cache::addrinfo_ptr& out_addr);
+
+    // same as resolve() but without blocking, if available() only
+    // * *on_resolved* is called once, by a thread of the system pool, or by
+    //   the caller before this returns if it is over already (e.g. cancelled)
+    void resolve_async(
+        key_t key, const std::string& host, unsigned short port,
+        const is_cancelled_t& is_cancelled,
+        on_resolved_t&& on_resolved);
+
+    // cancel the resolve() calls of *key* in progress, if any
+    void cancel(key_t key);
+
+    // same, whatever their key (e.g. to stop)
+    void cancel_all();
+
+    stats_t stats() const;
+
+private:
+    struct lookup_t;  // a resolve_async() call, see resolver.cpp
+
+    void finish(lookup_t& lookup);
+
+    static void CALLBACK on_query_complete(
+        DWORD error, DWORD bytes, LPWSAOVERLAPPED ol);
+    static void CALLBACK on_wait(PVOID param, BOOLEAN timed_out);
+
+private:
+    DWORD m_timeout;  // milliseconds, 0: none
+
+    // cancel events of the lookups in progress
+    mutable std::mutex m_mutex;
+    std::unordered_multimap<key_t, HANDLE> m_pending;
+
+    std::atomic<std::uint64_t> m_queries;
+    std::atomic<std::uint64_t> m_timeouts;
+    std::atomic<std::uint64_t> m_cancelled;
+    std::atomic<std::uint64_t> m_fallbacks;
+};
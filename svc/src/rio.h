@@ -0,0 +1,99 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// Registered I/O (RIO) declarations, for socketio::engine_rio
+//
+// * RIO is a Windows 8 / Server 2012 feature, so its declarations in
+//   <mswsock.h> are not visible to our WINVER 0x0500 target; the subset we use
+//   is mirrored here, under names of our own so that it never collides with
+//   the SDK's
+// * functions are only reachable through the function_table_t returned by the
+//   WSAIoctl() call of socketio::rio_load(), which fails where RIO is not
+//   available
+// * CAUTION: the layout of the structures must match the SDK's
+namespace rio
+{
+    typedef struct bufferid_s* bufferid_t;
+    typedef struct cq_s* cq_t;
+    typedef struct rq_s* rq_t;
+
+    // WSASocket() flag, required for a socket to get a request queue
+    static constexpr DWORD wsa_flag_registered_io = 0x100;
+
+    enum : DWORD
+    {
+        sio_get_multiple_extension_function_pointer = _WSAIORW(IOC_WS2, 36),
+        max_cq_size = 0x8000000,
+        notification_iocp = 2,
+    };
+
+    // returned by function_table_t::dequeue_completion()
+    enum : ULONG { corrupt_cq = 0xffffffff };
+
+    // {8509e081-96dd-4005-b165-9e2ee8c79e3f}
+    static constexpr GUID wsaid_multiple_rio = {
+        0x8509e081, 0x96dd, 0x4005,
+        { 0xb1, 0x65, 0x9e, 0x2e, 0xe8, 0xc7, 0x9e, 0x3f } };
+
+    struct buf_t
+    {
+        bufferid_t buffer_id;
+        ULONG offset;
+        ULONG length;
+    };
+
+    struct result_t
+    {
+        LONG status;  // 0 or a WSA error code
+        ULONG bytes_transferred;
+        ULONGLONG socket_context;
+        ULONGLONG request_context;
+    };
+
+    // the iocp member of the SDK's union is also its biggest one, so that
+    // the layout is the same
+    struct notification_completion_t
+    {
+        DWORD type;  // notification_iocp
+        HANDLE iocp;
+        PVOID completion_key;
+        PVOID overlapped;
+    };
+
+    struct function_table_t
+    {
+        DWORD size;  // of this structure
+
+        BOOL (WINAPI* receive)(
+            rq_t rq, buf_t* data, ULONG data_count, DWORD flags,
+            PVOID request_context);
+        void* receive_ex;
+        BOOL (WINAPI* send)(
+            rq_t rq, buf_t* data, ULONG data_count, DWORD flags,
+            PVOID request_context);
+        void* send_ex;
+        void (WINAPI* close_completion_queue)(cq_t cq);
+        cq_t (WINAPI* create_completion_queue)(
+            DWORD queue_size, notification_completion_t* notification);
+        rq_t (WINAPI* create_request_queue)(
+            SOCKET socket, ULONG max_outstanding_recv, ULONG max_recv_buffers,
+            ULONG max_outstanding_send, ULONG max_send_buffers,
+            cq_t recv_cq, cq_t send_cq, PVOID socket_context);
+        ULONG (WINAPI* dequeue_completion)(
+            cq_t cq, result_t* results, ULONG results_count);
+        void (WINAPI* deregister_buffer)(bufferid_t buffer_id);
+        INT (WINAPI* notify)(cq_t cq);
+        bufferid_t (WINAPI* register_buffer)(PCHAR buffer, DWORD size);
+        BOOL (WINAPI* resize_completion_queue)(cq_t cq, DWORD queue_size);
+        BOOL (WINAPI* resize_request_queue)(
+            rq_t rq, DWORD max_outstanding_recv, DWORD max_outstanding_send);
+    };
+
+    inline bool is_valid(bufferid_t buffer_id)
+    {
+        return reinterpret_cast<ULONG_PTR>(buffer_id) != 0xffffffff;
+    }
+}
@@ -0,0 +1,57 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "main.h"
+
+
+rtt_estimator_t::rtt_estimator_t()
+    : m_samples{0}
+    , m_srtt{0}
+    , m_rttvar{0}
+    , m_min_rtt{0}
+    , m_rate{0}
+{
+}
+
+
+std::size_t rtt_estimator_t::bdp() const
+{
+    if (m_samples == 0)
+        return 0;
+
+    // CAUTION: both may be big, do not overflow
+    const auto bdp =
+        (m_rate / cix::hrticks_millisecond) * m_min_rtt /
+        (cix::hrticks_second / cix::hrticks_millisecond);
+
+    return static_cast<std::size_t>(
+        std::min<std::uint64_t>(bdp, std::numeric_limits<std::size_t>::max()));
+}
+
+
+void rtt_estimator_t::on_sample(std::uint64_t rtt, std::uint64_t delivered)
+{
+    // a sample below clock resolution still counts as one
+    rtt = std::max<std::uint64_t>(rtt, 1);
+
+    if (m_samples == 0)
+    {
+        m_srtt = rtt;
+        m_rttvar = rtt / 2;
+        m_min_rtt = rtt;
+    }
+    else
+    {
+        const auto delta = (rtt > m_srtt) ? rtt - m_srtt : m_srtt - rtt;
+
+        m_rttvar = (3 * m_rttvar + delta) / 4;
+        m_srtt = (7 * m_srtt + rtt) / 8;
+        m_min_rtt = std::min(m_min_rtt, rtt);
+    }
+
+    ++m_samples;
+
+    const auto rate = delivered * cix::hrticks_second / rtt;
+
+    m_rate = (rate >= m_rate) ? rate : m_rate - (m_rate - rate) / 4;
+}
@@ -0,0 +1,47 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// Round-trip time and delivery rate of a channel, as measured by op_ping (see
+// proto::chansetup_ping_rtt), to size its windows out of its bandwidth-delay
+// product (BDP) instead of fixed constants
+//
+// * values are microseconds, as measured with cix::hrticks_now()
+// * smoothed RTT and its variation as in RFC 6298 (gains of 1/8 and 1/4), and
+//   the lowest sample seen so far
+// * delivery rate is the bytes written to the channel while a ping was in
+//   flight, over its RTT; the highest rate is kept, decaying by a quarter
+//   with every sample that does not reach it, since an idle channel does not
+//   tell how fast it could go
+// * BDP is the delivery rate times the lowest RTT, since the others include
+//   the time the ping waited behind the data queued to the channel, which the
+//   windows sized out of it would only make longer
+// * not thread-safe
+class rtt_estimator_t
+{
+public:
+    rtt_estimator_t();
+    ~rtt_estimator_t() = default;
+
+    bool has_sample() const { return m_samples > 0; }
+    std::uint64_t samples() const { return m_samples; }
+    std::uint64_t srtt() const { return m_srtt; }
+    std::uint64_t rttvar() const { return m_rttvar; }
+    std::uint64_t min_rtt() const { return m_min_rtt; }
+    std::uint64_t delivery_rate() const { return m_rate; }  // bytes/second
+
+    // bytes in flight that keep the channel busy; 0 without a sample
+    std::size_t bdp() const;
+
+    // *delivered* is the number of bytes written while the ping was in flight
+    void on_sample(std::uint64_t rtt, std::uint64_t delivered);
+
+private:
+    std::uint64_t m_samples;
+    std::uint64_t m_srtt;
+    std::uint64_t m_rttvar;
+    std::uint64_t m_min_rtt;
+    std::uint64_t m_rate;
+};
@@ -0,0 +1,355 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "main.h"
+
+
+session_trace_t::session_trace_t()
+    : m_threshold{default_threshold * cix::hrticks_millisecond}
+    , m_slow_sessions{0}
+{
+    for (auto& count : m_slow_events)
+        count = 0;
+}
+
+
+void session_trace_t::configure(cix::ticks_t threshold)
+{
+    m_threshold =
+        std::max<cix::ticks_t>(threshold, 1) * cix::hrticks_millisecond;
+}
+
+
+cix::ticks_t session_trace_t::threshold() const
+{
+    return m_threshold / cix::hrticks_millisecond;
+}
+
+
+void session_trace_t::open(key_t token)
+{
+    auto& shard = this->shard_of(token);
+
+    timeline_t timeline{};
+    timeline.token = token;
+    timeline.opened = cix::hrticks_now();
+
+    std::scoped_lock lock(shard.mutex);
+
+    shard.timelines.insert(std::make_pair(token, timeline));
+}
+
+
+void session_trace_t::bind(
+    key_t token, std::uint64_t client_id, std::uint64_t socks_id)
+{
+    {
+        auto& shard = this->shard_of(token);
+        std::scoped_lock lock(shard.mutex);
+
+        auto it = shard.timelines.find(token);
+        if (it == shard.timelines.end())
+            return;  // closed already
+
+        it->second.client_id = client_id;
+        it->second.socks_id = socks_id;
+    }
+
+    std::scoped_lock lock(m_index_mutex);
+
+    m_index[index_key_t{client_id, socks_id}] = token;
+}
+
+
+void session_trace_t::close(key_t token)
+{
+    index_key_t key{0, 0};
+
+    {
+        auto& shard = this->shard_of(token);
+        std::scoped_lock lock(shard.mutex);
+
+        auto it = shard.timelines.find(token);
+        if (it == shard.timelines.end())
+            return;
+
+        key = index_key_t{it->second.client_id, it->second.socks_id};
+        shard.timelines.erase(it);
+    }
+
+    if (key.client_id == 0 && key.socks_id == 0)
+        return;  // never bound
+
+    std::scoped_lock lock(m_index_mutex);
+
+    // a SOCKS ID may have been reused by its client already
+    auto it = m_index.find(key);
+    if (it != m_index.end() && it->second == token)
+        m_index.erase(it);
+}
+
+
+void session_trace_t::record(key_t token, stage_t stage, cix::hrticks_t origin)
+{
+    assert(stage < stage_count);
+
+    const auto now = cix::hrticks_now();
+    auto& shard = this->shard_of(token);
+    bool flagged = false;
+    timeline_t flagged_timeline{};
+
+    {
+        std::scoped_lock lock(shard.mutex);
+
+        auto it = shard.timelines.find(token);
+        if (it == shard.timelines.end())
+            return;
+
+        auto& timeline = it->second;
+        cix::hrticks_t since = 0;
+
+        switch (stage)
+        {
+            case stage_proxy_dequeue:
+            case stage_pipe_written:
+                since = origin;
+                break;
+
+            case stage_target_send:
+                since = timeline.last[stage_proxy_dequeue];
+                break;
+
+            case stage_target_recv:
+                // only the first data that follows a send is an answer
+                if (timeline.last[stage_target_send] >
+                    timeline.last[stage_target_recv])
+                {
+                    since = timeline.last[stage_target_send];
+                }
+                break;
+
+            default:
+                break;
+        }
+
+        const auto delay =
+            (since != 0 && since < now) ? cix::hrticks_elapsed(since, now) : 0;
+
+        timeline.last[stage] = now;
+        timeline.max_delay[stage] = std::max(timeline.max_delay[stage], delay);
+
+        auto& event = timeline.events[timeline.next_event];
+        event = event_t{stage, now, delay};
+        timeline.next_event = (timeline.next_event + 1) % events_count;
+        timeline.events_size = std::min(timeline.events_size + 1, events_count);
+
+        if (delay > m_threshold)
+        {
+            m_slow_events[stage].fetch_add(1, std::memory_order_relaxed);
+
+            if (timeline.slow_events++ == 0)
+            {
+                m_slow_sessions.fetch_add(1, std::memory_order_relaxed);
+                flagged = true;
+                flagged_timeline = timeline;
+            }
+        }
+    }
+
+    // outside of the lock, logging allocates
+    if (flagged)
+        this->log_slow(flagged_timeline, stage);
+}
+
+
+void session_trace_t::record_written(
+    std::uint64_t client_id, std::uint64_t socks_id, cix::hrticks_t origin)
+{
+    key_t token;
+
+    {
+        std::scoped_lock lock(m_index_mutex);
+
+        auto it = m_index.find(index_key_t{client_id, socks_id});
+        if (it == m_index.end())
+            return;
+
+        token = it->second;
+    }
+
+    this->record(token, stage_pipe_written, origin);
+}
+
+
+session_trace_t::stats_t session_trace_t::stats() const
+{
+    stats_t stats{};
+    std::uint64_t worst = 0;
+
+    stats.slow_sessions = m_slow_sessions.load(std::memory_order_relaxed);
+
+    for (std::size_t idx = 0; idx < stage_count; ++idx)
+    {
+        stats.slow_events[idx] =
+            m_slow_events[idx].load(std::memory_order_relaxed);
+    }
+
+    for (const auto& shard : m_shards)
+    {
+        std::scoped_lock lock(shard.mutex);
+
+        for (const auto& it : shard.timelines)
+        {
+            const auto& timeline = it.second;
+
+            if (timeline.slow_events == 0)
+                continue;
+
+            const auto delay = session_trace_t::worst_delay_of(timeline);
+            if (delay <= worst)
+                continue;
+
+            worst = delay;
+            stats.worst_client_id = timeline.client_id;
+            stats.worst_socks_id = timeline.socks_id;
+            std::copy(
+                std::begin(timeline.max_delay), std::end(timeline.max_delay),
+                std::begin(stats.worst_delay));
+        }
+    }
+
+    return stats;
+}
+
+
+std::vector<session_trace_t::timeline_t>
+session_trace_t::slow_timelines(std::size_t max_count) const
+{
+    std::vector<timeline_t> timelines;
+
+    for (const auto& shard : m_shards)
+    {
+        std::scoped_lock lock(shard.mutex);
+
+        for (const auto& it : shard.timelines)
+        {
+            if (it.second.slow_events > 0)
+                timelines.push_back(it.second);
+        }
+    }
+
+    std::sort(
+        timelines.begin(), timelines.end(),
+        [](const timeline_t& a, const timeline_t& b) {
+            return
+                session_trace_t::worst_delay_of(a) >
+                session_trace_t::worst_delay_of(b);
+        });
+
+    if (timelines.size() > max_count)
+        timelines.resize(max_count);
+
+    return timelines;
+}
+
+
+const char* session_trace_t::stage_name(stage_t stage)
+{
+    switch (stage)
+    {
+        case stage_pipe_recv:
+            return "pipe recv";
+        case stage_proxy_dequeue:
+            return "proxy dequeue";
+        case stage_target_send:
+            return "target send";
+        case stage_target_recv:
+            return "target recv";
+        case stage_pipe_written:
+            return "pipe written";
+        default:
+            return "?";
+    }
+}
+
+
+std::string session_trace_t::format(const timeline_t& timeline)
+{
+    // e.g. "SOCKS #3 of client 0x1122334455667788 (token 42): max delays
+    // proxy dequeue 12us, target send 3us, target recv 2500123us, pipe
+    // written 40us; last events +0us pipe recv, +12us proxy dequeue (12us),
+    // ..." where event times are relative to the oldest one
+    std::string out = xstr::fmt(
+        "SOCKS #{} of client {:#x} (token {}): max delays",
+        timeline.socks_id, timeline.client_id, timeline.token);
+
+    for (std::size_t idx = stage_proxy_dequeue; idx < stage_count; ++idx)
+    {
+        out += xstr::fmt(
+            "{} {} {}us",
+            (idx == stage_proxy_dequeue) ? "" : ",",
+            session_trace_t::stage_name(static_cast<stage_t>(idx)),
+            timeline.max_delay[idx]);
+    }
+
+    out += "; last events";
+
+    const auto first =
+        (timeline.next_event + events_count - timeline.events_size) %
+        events_count;
+    const auto origin = timeline.events[first].at;
+
+    for (std::size_t idx = 0; idx < timeline.events_size; ++idx)
+    {
+        const auto& event = timeline.events[(first + idx) % events_count];
+
+        out += xstr::fmt(
+            "{} +{}us {}",
+            (idx == 0) ? "" : ",",
+            event.at - origin, session_trace_t::stage_name(event.stage));
+
+        if (event.delay > 0)
+            out += xstr::fmt(" ({}us)", event.delay);
+    }
+
+    return out;
+}
+
+
+session_trace_t::shard_t& session_trace_t::shard_of(key_t token)
+{
+    return m_shards[token % shards_count];
+}
+
+
+void session_trace_t::log_slow(const timeline_t& timeline, stage_t stage) const
+{
+    CIX_UNVAR(timeline);
+    CIX_UNVAR(stage);
+
+    LOGWARNING(
+        "slow {} (above {}ms): {}",
+        session_trace_t::stage_name(stage), this->threshold(),
+        session_trace_t::format(timeline));
+
+    ETWTRACE("SlowSession", etw::keyword_session,
+        etw::u64(timeline.token, "SocksToken"),
+        etw::u64(timeline.client_id, "ClientId"),
+        etw::u64(timeline.socks_id, "SocksId"),
+        etw::str(session_trace_t::stage_name(stage), "Stage"),
+        etw::u64(
+            timeline.max_delay[stage_proxy_dequeue], "ProxyDequeueUs"),
+        etw::u64(
+            timeline.max_delay[stage_target_send], "TargetSendUs"),
+        etw::u64(
+            timeline.max_delay[stage_target_recv], "TargetRecvUs"),
+        etw::u64(
+            timeline.max_delay[stage_pipe_written], "PipeWrittenUs"));
+}
+
+
+std::uint64_t session_trace_t::worst_delay_of(const timeline_t& timeline)
+{
+    return *std::max_element(
+        std::begin(timeline.max_delay), std::end(timeline.max_delay));
+}
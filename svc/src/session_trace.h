@@ -0,0 +1,161 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// A timeline of the last stages the data of every SOCKS session went through,
+// so that a session reported as slow can be told whether its client, the pipe,
+// socks_proxy or its target is to blame
+//
+// * sessions are keyed by their socks_proxy token, from open() to close();
+//   svc_worker binds them to their proto IDs (see bind()) since the pipe side
+//   only knows those
+// * the delay of a stage is measured from the stage that precedes it:
+//   - stage_proxy_dequeue: from stage_pipe_recv of the same request, i.e. the
+//     request queue of socks_proxy
+//   - stage_target_send: from the last stage_proxy_dequeue, i.e. socks_proxy
+//     handling the request; requests of a session are handled in order
+//   - stage_target_recv: from the last stage_target_send, for the first data
+//     received after it only, i.e. the target answering; a target that sends
+//     data unprompted after a while shows here as well
+//   - stage_pipe_written: from stage_target_recv of the same data, i.e. the
+//     output queues of the channel, the pipe, and the client reading it
+// * a session is flagged as slow the first time one of its delays goes above
+//   *threshold*, in which case its timeline is logged (LOGWARNING) and traced
+//   (ETW); flagged sessions can be dumped again on demand, see
+//   slow_timelines()
+// * thread-safe, sessions are sharded by token so that the threads recording
+//   their stages rarely contend
+class session_trace_t
+{
+public:
+    typedef std::uint64_t key_t;  // socks_proxy::token_t
+
+    enum stage_t : std::uint8_t
+    {
+        stage_pipe_recv,
+        stage_proxy_dequeue,
+        stage_target_send,
+        stage_target_recv,
+        stage_pipe_written,
+        stage_count,
+    };
+
+    enum : cix::ticks_t { default_threshold = 1000 };  // milliseconds
+
+    enum : std::size_t
+    {
+        events_count = 8,  // per session, most recent ones
+        shards_count = 16,
+        dump_max_count = 16,  // sessions logged per op_stats request
+    };
+
+    struct event_t
+    {
+        stage_t stage;
+        cix::hrticks_t at;
+        std::uint64_t delay;  // microseconds
+    };
+
+    struct timeline_t
+    {
+        key_t token;
+        std::uint64_t client_id;  // 0 until bound
+        std::uint64_t socks_id;   // 0 until bound
+        cix::hrticks_t opened;
+        cix::hrticks_t last[stage_count];        // 0 if none yet
+        std::uint64_t max_delay[stage_count];    // microseconds
+        std::uint64_t slow_events;  // delays above the threshold
+        event_t events[events_count];  // ring, oldest at *next_event*
+        std::size_t events_size;
+        std::size_t next_event;
+    };
+
+    struct stats_t
+    {
+        std::uint64_t slow_sessions;  // flagged so far
+        std::uint64_t slow_events[stage_count];  // delays above the threshold
+
+        // the open session with the highest delay; null if none got flagged
+        std::uint64_t worst_client_id;
+        std::uint64_t worst_socks_id;
+        std::uint64_t worst_delay[stage_count];  // microseconds
+    };
+
+public:
+    session_trace_t();
+    ~session_trace_t() = default;
+
+    session_trace_t(const session_trace_t&) = delete;
+    session_trace_t& operator=(const session_trace_t&) = delete;
+
+    // *threshold* in milliseconds; must be called before any session gets
+    // opened
+    void configure(cix::ticks_t threshold);
+    cix::ticks_t threshold() const;
+
+    void open(key_t token);
+    void bind(key_t token, std::uint64_t client_id, std::uint64_t socks_id);
+    void close(key_t token);
+
+    // *origin* is the time of the stage this one is measured from, for
+    // stage_proxy_dequeue and stage_pipe_written; unknown sessions are ignored
+    void record(key_t token, stage_t stage, cix::hrticks_t origin=0);
+
+    // same as record() with stage_pipe_written, for a bound session
+    void record_written(
+        std::uint64_t client_id, std::uint64_t socks_id,
+        cix::hrticks_t origin);
+
+    stats_t stats() const;
+
+    // the flagged sessions still open, highest delay first, *max_count* at most
+    std::vector<timeline_t> slow_timelines(std::size_t max_count) const;
+
+    static const char* stage_name(stage_t stage);
+    static std::string format(const timeline_t& timeline);
+
+private:
+    struct shard_t
+    {
+        mutable std::mutex mutex;
+        cix::flat_hash_map<key_t, timeline_t> timelines;
+    };
+
+    struct index_key_t
+    {
+        std::uint64_t client_id;
+        std::uint64_t socks_id;
+
+        bool operator==(const index_key_t& other) const
+        {
+            return client_id == other.client_id && socks_id == other.socks_id;
+        }
+    };
+
+    struct index_hash_t
+    {
+        std::size_t operator()(const index_key_t& key) const
+        {
+            return std::hash<std::uint64_t>()(
+                (key.client_id * 0x9e3779b97f4a7c15ull) ^ key.socks_id);
+        }
+    };
+
+private:
+    shard_t& shard_of(key_t token);
+    void log_slow(const timeline_t& timeline, stage_t stage) const;
+    static std::uint64_t worst_delay_of(const timeline_t& timeline);
+
+private:
+    std::uint64_t m_threshold;  // microseconds
+    std::array<shard_t, shards_count> m_shards;
+
+    // bound sessions, see record_written()
+    std::mutex m_index_mutex;
+    std::unordered_map<index_key_t, key_t, index_hash_t> m_index;
+
+    std::atomic<std::uint64_t> m_slow_sessions;
+    std::array<std::atomic<std::uint64_t>, stage_count> m_slow_events;
+};
@@ -6,24 +6,91 @@
 
 namespace detail
 {
-    static std::mutex _rand_mutex;
-    static cix::random::fast _rand_gen;
+    static thread_local cix::random::fast _rand_gen;
 
     inline static u_int fdset_rand(u_int elements)
     {
-        std::scoped_lock lock(_rand_mutex);
         return _rand_gen.next32() % elements;  // okay'ish
     }
 }
 
 
-socketio::socketio()
-    : m_stop_event{nullptr}
+socketio::socketio(engine_t engine)
+    : m_engine{socketio::resolve_engine(engine)}
+    , m_stop_event{nullptr}
     , m_write_event{nullptr}
+    , m_write_selecting{false}
+    , m_gather_max_size{gather_default_max_size}
+    , m_input_buffer_size{input_buffer_default_size}
+    , m_input_buffer_fits{0}
+    , m_recv_headroom{0}
+    , m_iocp{nullptr}
+    , m_iocp_pending{0}
+    , m_rio{nullptr}
+    , m_rio_cq{nullptr}
+    , m_rio_cq_size{0}
+    , m_rio_ol{}
+    , m_rio_slot_size{input_buffer_default_size}
+    , m_rio_slots_per_chunk{rio_chunk_size / input_buffer_default_size}
+    , m_event_launched{false}
+    , m_write_queue_max_size{0}
+    , m_write_queue_watermark{0}
+    , m_write_drained_pending{false}
+    , m_bytes_received{0}
+    , m_bytes_sent{0}
+    , m_write_queue_overflows{0}
+    , m_datagrams_dropped{0}
+    , m_connects_stopped{false}
+    , m_close_event{CreateEvent(nullptr, FALSE, FALSE, nullptr)}
 {
-    m_write_event = CreateEvent(nullptr, TRUE, FALSE, nullptr);  // manual reset
-    if (!m_write_event)
-        CIX_THROW_WINERR("failed to create sio stop event");
+    if (!m_close_event)
+        CIX_THROW_WINERR("failed to create sio close event");
+
+    if (m_engine == engine_iocp || m_engine == engine_rio)
+    {
+        m_iocp = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1);
+        if (!m_iocp)
+            CIX_THROW_WINERR("failed to create sio completion port");
+
+        if (m_engine == engine_rio)
+            this->rio_init();
+    }
+    else if (m_engine == engine_select)
+    {
+        m_write_event = CreateEvent(nullptr, TRUE, FALSE, nullptr);  // manual reset
+        if (!m_write_event)
+            CIX_THROW_WINERR("failed to create sio stop event");
+    }
+}
+
+
+socketio::~socketio()
+{
+    if (m_engine == engine_rio)
+        this->rio_release();
+
+    if (m_engine == engine_event)
+        this->event_release();
+
+    if (m_iocp)
+        CloseHandle(m_iocp);
+
+    if (m_write_event)
+        CloseHandle(m_write_event);
+
+    socketio::select_wake_close(m_read_wake);
+    socketio::select_wake_close(m_write_wake);
+
+    // join() not called?
+    this->close_due_sockets(true);
+    CloseHandle(m_close_event);
+}
+
+
+DWORD socketio::socket_flags() const
+{
+    return WSA_FLAG_OVERLAPPED |
+        (m_engine == engine_rio ? rio::wsa_flag_registered_io : 0);
 }
 
 
@@ -43,6 +110,64 @@ void socketio::set_listener(std::shared_ptr<listener_t> listener)
 }
 
 
+void socketio::set_buffer_pool(std::shared_ptr<cix::buffer_pool> pool)
+{
+    std::scoped_lock lock(m_mutex);
+
+    m_buffer_pool = pool;
+}
+
+
+void socketio::set_mem_budget(std::shared_ptr<mem_budget_t> budget)
+{
+    std::scoped_lock lock(m_mutex);
+
+    m_mem_budget = budget;
+}
+
+
+void socketio::set_write_queue_max_size(std::size_t max_size)
+{
+    std::scoped_lock lock(m_mutex);
+
+    m_write_queue_max_size = max_size;
+}
+
+
+void socketio::set_write_queue_watermark(std::size_t watermark)
+{
+    std::scoped_lock lock(m_mutex);
+
+    m_write_queue_watermark = watermark;
+}
+
+
+void socketio::set_gather_max_size(std::size_t max_size)
+{
+    std::scoped_lock lock(m_mutex);
+
+    assert(max_size > 0);
+    m_gather_max_size = std::max<std::size_t>(max_size, 1);
+}
+
+
+void socketio::set_input_buffer_size(std::size_t size)
+{
+    std::scoped_lock lock(m_mutex);
+
+    assert(size > 0);
+    m_input_buffer_size = std::max<std::size_t>(size, 1);
+}
+
+
+void socketio::set_recv_headroom(std::size_t size)
+{
+    std::scoped_lock lock(m_mutex);
+
+    m_recv_headroom = size;
+}
+
+
 void socketio::launch()
 {
     std::scoped_lock lock(m_mutex);
@@ -56,12 +181,68 @@ void socketio::launch()
     if (WAIT_TIMEOUT != WaitForSingleObject(m_stop_event, 0))
         return;
 
-    if (m_read_thread || m_write_thread)
+    if (m_read_thread || m_write_thread || m_iocp_thread || m_event_launched)
     {
         assert(0);
         return;
     }
 
+    {
+        std::scoped_lock connect_lock(m_connect_mutex);
+        m_connects_stopped = false;
+    }
+
+    {
+        std::scoped_lock close_lock(m_close_mutex);
+
+        m_close_thread = std::make_unique<std::thread>(
+            std::bind(&socketio::close_thread, this));
+    }
+
+    if (m_engine == engine_rio)
+    {
+        // slots are sized once, mapping a slot to its chunk depends on it
+        if (m_rio_chunks.empty())
+        {
+            m_rio_slot_size = m_input_buffer_size;
+            m_rio_slots_per_chunk = std::max<std::size_t>(
+                rio_chunk_size / m_rio_slot_size, 1);
+        }
+
+        // first notification, re-armed by rio_on_notify()
+        const auto error = m_rio->notify(m_rio_cq);
+        if (error != 0)
+            LOGERROR("failed to arm sio RIO notification (error {})", error);
+    }
+
+    if (m_engine == engine_iocp || m_engine == engine_rio)
+    {
+        m_iocp_thread = std::make_unique<std::thread>(
+            std::bind(&socketio::iocp_thread, this));
+        return;
+    }
+
+    if (m_engine == engine_event)
+    {
+        // groups of the sockets registered so far, if any; the other ones
+        // get launched by event_register_socket()
+        m_event_launched = true;
+
+        for (std::size_t group = 0; group < m_event_groups.size(); ++group)
+            this->event_launch(group);
+
+        return;
+    }
+
+    // both or none, see select_wake_t
+    if (m_read_wake.socket == INVALID_SOCKET &&
+        (!socketio::select_wake_open(m_read_wake) ||
+            !socketio::select_wake_open(m_write_wake)))
+    {
+        socketio::select_wake_close(m_read_wake);
+        socketio::select_wake_close(m_write_wake);
+    }
+
     m_write_thread = std::make_unique<std::thread>(
         std::bind(&socketio::write_thread, this));
 
@@ -72,10 +253,85 @@ void socketio::launch()
 
 void socketio::join()
 {
-    std::scoped_lock lock(m_mutex);
+    {
+        std::map<SOCKET, std::unique_ptr<connect_t>> connects;
+
+        {
+            std::scoped_lock connect_lock(m_connect_mutex);
+            connects.swap(m_connects);
+            m_connects_stopped = true;
+        }
+
+        for (auto& it : connects)
+        {
+            auto& ctx = *it.second;
+
+            // waits for a callback in progress, which finds nothing to do
+            UnregisterWaitEx(ctx.wait, INVALID_HANDLE_VALUE);
+            WSAEventSelect(ctx.socket, nullptr, 0);
+            WSACloseEvent(ctx.event);
+            closesocket(ctx.socket);
+        }
+    }
+
+    cix::lock_guard lock(m_mutex);
 
     assert(WAIT_TIMEOUT != WaitForSingleObject(m_stop_event, 0));
 
+    if (m_iocp_thread)
+    {
+        auto iocp_thread = std::move(m_iocp_thread);
+
+        // unlock since completion handlers acquire m_mutex
+        lock.unlock();
+
+        // the pending operations must complete before their contexts can be
+        // released, since the kernel may still write to their buffers; so the
+        // sockets go first, then iocp_thread() drains what is left, see
+        // iocp_drain()
+        this->iocp_close_registered();
+
+        // GetQueuedCompletionStatus() cannot wait for m_stop_event
+        PostQueuedCompletionStatus(m_iocp, 0, iocp_key_stop, nullptr);
+
+        if (iocp_thread->joinable())
+            iocp_thread->join();
+        iocp_thread.reset();
+        lock.lock();
+
+        assert(m_iocp_sockets.empty());
+        assert(m_rio_sockets.empty());
+    }
+
+    if (m_event_launched)
+    {
+        std::vector<std::unique_ptr<std::thread>> threads;
+
+        for (auto& group : m_event_groups)
+        {
+            if (group->thread)
+                threads.push_back(std::move(group->thread));
+        }
+
+        // unlock since the threads of the groups acquire m_mutex
+        lock.unlock();
+        for (auto& thread : threads)
+        {
+            if (thread->joinable())
+                thread->join();
+        }
+        threads.clear();
+        lock.lock();
+
+        // no thread waits for the events anymore
+        this->event_release();
+        m_event_launched = false;
+    }
+
+    // their select() calls cannot wait for m_stop_event
+    socketio::select_wake(m_read_wake);
+    socketio::select_wake(m_write_wake);
+
     if (m_read_thread)
     {
         if (m_read_thread->joinable())
@@ -91,6 +347,21 @@ void socketio::join()
 
         m_write_thread.reset();
     }
+
+    lock.unlock();
+
+    std::unique_ptr<std::thread> close_thread;
+
+    {
+        std::scoped_lock close_lock(m_close_mutex);
+        close_thread = std::move(m_close_thread);
+    }
+
+    if (close_thread && close_thread->joinable())
+        close_thread->join();
+
+    // no need to linger anymore
+    this->close_due_sockets(true);
 }
 
 
@@ -102,20 +373,62 @@ void socketio::register_socket(SOCKET socket)
         return;
     }
 
+    // never wait on a socket, a failure shows on the first recv() or send()
+    const int wsaerror =
+        socketio::enable_socket_nonblocking_mode(socket, true);
+    if (wsaerror != 0)
+    {
+        LOGDEBUG(
+            "failed to set socket in non-blocking mode (error {})", wsaerror);
+    }
+
     std::scoped_lock lock(m_mutex);
 
+    if (m_engine == engine_iocp)
+    {
+        this->iocp_register_socket(socket);
+        return;
+    }
+
+    if (m_engine == engine_rio)
+    {
+        this->rio_register_socket(socket);
+        return;
+    }
+
+    if (m_engine == engine_event)
+    {
+        this->event_register_socket(socket);
+        return;
+    }
+
     m_fdset_read.register_socket(socket);
+    m_fdset_recv.register_socket(socket);
     m_fdset_except.register_socket(socket);
+    socketio::select_wake(m_read_wake);
 }
 
 
-bool socketio::send(SOCKET socket, bytes_t&& packet)
+bool socketio::send(
+    SOCKET socket, cix::shared_buffer&& packet, bool* out_full)
 {
+    if (out_full)
+        *out_full = false;
+
     if (socket == INVALID_SOCKET)
         return false;
 
     std::scoped_lock lock(m_mutex);
 
+    if (m_engine == engine_iocp)
+        return this->iocp_send(socket, std::move(packet), out_full);
+
+    if (m_engine == engine_rio)
+        return this->rio_send(socket, std::move(packet), out_full);
+
+    if (m_engine == engine_event)
+        return this->event_send(socket, std::move(packet), out_full);
+
     if (!m_fdset_read.has(socket))
         return false;
 
@@ -128,24 +441,33 @@ bool socketio::send(SOCKET socket, bytes_t&& packet)
         return false;
     }
 
-    // cannot blindly try-insert() due to the use of std::move(), and we want
-    // to reserve() the output queue
+    if (packet.empty())
+        return true;
+
+    // cannot blindly try-insert() due to the use of std::move()
 
     auto it = m_write_queue.find(socket);
 
-    if (it != m_write_queue.end())
+    if (it == m_write_queue.end())
     {
-        it->second.push_back(std::move(packet));
+        it = m_write_queue.insert(
+            std::make_pair(socket, write_queue_t{{}, 0, 0, false})).first;
     }
-    else
+
+    // the queue being sent by write_thread__do(), if any, is not accounted
+    // for here
+    if (!this->queue_packet(it->second, std::move(packet), out_full))
     {
-        auto pair = m_write_queue.insert(
-            std::make_pair(socket, std::list<bytes_t>()));
+        if (it->second.packets.empty())
+            m_write_queue.erase(it);
 
-        // pair.first->second.reserve(10);
-        pair.first->second.push_back(std::move(packet));
+        return false;
     }
 
+    // a select() in progress does not wait for this socket yet
+    if (m_write_selecting && !m_fdset_write.has(socket))
+        socketio::select_wake(m_write_wake);
+
     m_fdset_write.register_socket(socket);
     SetEvent(m_write_event);
 
@@ -153,20 +475,186 @@ bool socketio::send(SOCKET socket, bytes_t&& packet)
 }
 
 
-void socketio::disconnect_and_unregister_socket(SOCKET socket)
+bool socketio::is_write_queue_full(SOCKET socket)
 {
-    cix::lock_guard lock(m_mutex);
+    std::scoped_lock lock(m_mutex);
 
-    this->unregister_socket(socket);
+    if (this->is_iocp_socket(socket))
+    {
+        const auto it = m_iocp_sockets.find(socket);
+        return it != m_iocp_sockets.end() && it->second->write_queue.full;
+    }
 
-    lock.unlock();
+    if (m_engine == engine_rio)
+    {
+        const auto it = m_rio_sockets.find(socket);
+        return it != m_rio_sockets.end() && it->second->write_queue.full;
+    }
+
+    if (m_engine == engine_event)
+    {
+        const auto it = m_event_sockets.find(socket);
+        return it != m_event_sockets.end() && it->second.write_queue.full;
+    }
+
+    // the queue being sent by write_thread__do(), if any, is not accounted
+    // for here, same as in send()
+    const auto it = m_write_queue.find(socket);
+    return it != m_write_queue.end() && it->second.full;
+}
+
+
+void socketio::register_datagram_socket(SOCKET socket)
+{
+    if (GetFileType(reinterpret_cast<HANDLE>(socket)) != FILE_TYPE_PIPE)
+    {
+        assert(0);
+        return;
+    }
+
+    // datagrams are drained, and sent by send_to(), without ever waiting
+    const int wsaerror =
+        socketio::enable_socket_nonblocking_mode(socket, true);
+    if (wsaerror != 0)
+    {
+        LOGDEBUG(
+            "failed to set socket in non-blocking mode (error {})", wsaerror);
+    }
+
+    std::scoped_lock lock(m_mutex);
+
+    // engine_rio: no request queue, the completion port is enough for the
+    // few datagram sockets there are
+    if (m_engine == engine_iocp || m_engine == engine_rio)
+    {
+        this->iocp_register_socket(socket, true);
+        return;
+    }
+
+    if (m_engine == engine_event)
+    {
+        this->event_register_socket(socket, true);
+        return;
+    }
 
-    // FIXME: dirty hack; shutdown is a blocking call so enable
-    // non-blocking mode. Ideally, this should be handled by a separate thread.
+    m_datagram_sockets.insert(socket);
+    m_fdset_read.register_socket(socket);
+    m_fdset_recv.register_socket(socket);
+    m_fdset_except.register_socket(socket);
+    socketio::select_wake(m_read_wake);
+}
+
+
+bool socketio::send_to(
+    SOCKET socket, const struct sockaddr* to, int to_len,
+    const byte_t* data, std::size_t size)
+{
+    if (socket == INVALID_SOCKET ||
+        size > static_cast<std::size_t>(std::numeric_limits<int>::max()))
+    {
+        return false;
+    }
+
+    // no write queue, see datagram_t; the socket is in non-blocking mode, and
+    // sendto() does not wait for a pending WSARecvFrom() either way
+    const int res = sendto(
+        socket, reinterpret_cast<const char*>(data), static_cast<int>(size),
+        0, to, to_len);
+
+    if (res == SOCKET_ERROR)
+    {
+        const auto wsaerror = WSAGetLastError();
+
+        if (wsaerror != WSAEWOULDBLOCK)
+            LOGDEBUG("sendto() failed (error {})", wsaerror);
+
+        m_datagrams_dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    m_bytes_sent.fetch_add(
+        static_cast<std::uint64_t>(res), std::memory_order_relaxed);
+
+    return true;
+}
+
+
+void socketio::set_recv_paused(SOCKET socket, bool paused)
+{
+    std::scoped_lock lock(m_mutex);
+
+    if (this->is_iocp_socket(socket))
+    {
+        this->iocp_set_recv_paused(socket, paused);
+        return;
+    }
+
+    if (m_engine == engine_rio)
+    {
+        this->rio_set_recv_paused(socket, paused);
+        return;
+    }
+
+    if (m_engine == engine_event)
+    {
+        this->event_set_recv_paused(socket, paused);
+        return;
+    }
+
+    if (!m_fdset_read.has(socket))
+        return;
+
+    // read_thread() only select()s the sockets of m_fdset_recv; a paused one
+    // it still waits for is skipped if readable, a resumed one must be added
+    if (paused)
+    {
+        m_fdset_recv.unregister_socket(socket);
+    }
+    else if (!m_fdset_recv.has(socket))
+    {
+        m_fdset_recv.register_socket(socket);
+        socketio::select_wake(m_read_wake);
+    }
+}
+
+
+void socketio::disconnect_and_unregister_socket(SOCKET socket)
+{
+    this->unregister_socket(socket);
+
+    // shutdown() does not block in non-blocking mode; the pending output and
+    // the FIN are given *close_linger_delay* to leave before closesocket(),
+    // which is close_thread()'s job so that this call never blocks
     socketio::enable_socket_nonblocking_mode(socket, true);
     shutdown(socket, SD_BOTH);
-    Sleep(50);
-    closesocket(socket);
+
+    this->close_later(&socket, 1);
+}
+
+
+void socketio::disconnect_and_unregister_sockets(
+    const std::vector<SOCKET>& sockets)
+{
+    if (sockets.empty())
+        return;
+
+    // m_mutex is recursive, held once for the whole batch rather than once per
+    // socket; a select() thread is woken up once at most, see select_wake()
+    {
+        std::scoped_lock lock(m_mutex);
+
+        for (const auto socket : sockets)
+            this->unregister_socket(socket);
+    }
+
+    // same as disconnect_and_unregister_socket()
+    for (const auto socket : sockets)
+    {
+        socketio::enable_socket_nonblocking_mode(socket, true);
+        shutdown(socket, SD_BOTH);
+    }
+
+    this->close_later(sockets.data(), sockets.size());
 }
 
 
@@ -174,16 +662,436 @@ void socketio::unregister_socket(SOCKET socket)
 {
     std::scoped_lock lock(m_mutex);
 
+    if (this->is_iocp_socket(socket))
+    {
+        this->iocp_unregister_socket(socket);
+        return;
+    }
+
+    if (m_engine == engine_rio)
+    {
+        this->rio_unregister_socket(socket);
+        return;
+    }
+
+    if (m_engine == engine_event)
+    {
+        this->event_unregister_socket(socket);
+        return;
+    }
+
+    // select() calls must not wait for it anymore, it is about to be closed
+    if (m_write_selecting && m_fdset_write.has(socket))
+        socketio::select_wake(m_write_wake);
+
+    if (m_fdset_read.has(socket))
+        socketio::select_wake(m_read_wake);
+
     m_fdset_read.unregister_socket(socket);
+    m_fdset_recv.unregister_socket(socket);
     m_fdset_write.unregister_socket(socket);
     m_fdset_except.unregister_socket(socket);
+    m_datagram_sockets.erase(socket);
+    m_recv_sizes.erase(socket);
+
+    auto queue_it = m_write_queue.find(socket);
+    if (queue_it != m_write_queue.end())
+    {
+        this->drop_queue(queue_it->second);
+        m_write_queue.erase(queue_it);
+    }
 
-    m_write_queue.erase(socket);
     if (m_write_queue.empty())
         ResetEvent(m_write_event);
 }
 
 
+int socketio::connect(
+    SOCKET socket, const struct sockaddr* addr, int addr_len,
+    DWORD timeout, DWORD pending_notify, connect_handler_t&& handler)
+{
+    auto ctx = std::make_unique<connect_t>();
+
+    ctx->owner = this;
+    ctx->socket = socket;
+    ctx->event = WSACreateEvent();
+    ctx->wait = nullptr;
+    ctx->handler = std::move(handler);
+    ctx->started = cix::ticks_now();
+    ctx->timeout = timeout;
+    ctx->pending_notify =
+        (timeout == INFINITE || pending_notify < timeout) ?
+        pending_notify : INFINITE;
+    ctx->connected = false;
+    ctx->cancelled = false;
+
+    if (ctx->event == WSA_INVALID_EVENT)
+        return WSAGetLastError();
+
+    const auto release = [&ctx]() {
+        WSAEventSelect(ctx->socket, nullptr, 0);
+        WSACloseEvent(ctx->event);
+    };
+
+    // switches *socket* to non-blocking mode as well
+    if (WSAEventSelect(socket, ctx->event, FD_CONNECT) == SOCKET_ERROR)
+    {
+        const auto error = WSAGetLastError();
+        release();
+        return error;
+    }
+
+    if (::connect(socket, addr, addr_len) == 0)
+    {
+        // at once (e.g. loopback), FD_CONNECT may never be recorded
+        ctx->connected = true;
+        WSASetEvent(ctx->event);
+    }
+    else
+    {
+        const auto error = WSAGetLastError();
+
+        if (error != WSAEWOULDBLOCK)
+        {
+            release();
+            return error;
+        }
+    }
+
+    std::unique_lock connect_lock(m_connect_mutex);
+
+    if (m_connects_stopped)
+    {
+        connect_lock.unlock();
+        release();
+        return WSAECANCELLED;
+    }
+
+    // the wait cannot fire before *ctx* is in m_connects, see
+    // connect_signaled()
+    if (!this->connect_arm(*ctx))
+    {
+        const auto error = static_cast<int>(GetLastError());
+        connect_lock.unlock();
+        release();
+        return error;
+    }
+
+    m_connects[socket] = std::move(ctx);
+
+    return 0;
+}
+
+
+void socketio::cancel_connect(SOCKET socket)
+{
+    std::scoped_lock connect_lock(m_connect_mutex);
+
+    const auto it = m_connects.find(socket);
+
+    if (it != m_connects.end())
+    {
+        it->second->cancelled = true;
+        WSASetEvent(it->second->event);
+    }
+}
+
+
+void socketio::cancel_connects()
+{
+    std::scoped_lock connect_lock(m_connect_mutex);
+
+    m_connects_stopped = true;
+
+    for (auto& it : m_connects)
+    {
+        it.second->cancelled = true;
+        WSASetEvent(it.second->event);
+    }
+}
+
+
+bool socketio::connect_arm(connect_t& ctx)
+{
+    // CAUTION: m_connect_mutex must be locked by caller
+
+    const auto elapsed = cix::ticks_elapsed(ctx.started);
+
+    const auto remaining = [elapsed](DWORD delay) -> DWORD {
+        if (delay == INFINITE)
+            return INFINITE;
+        return (elapsed < delay) ? static_cast<DWORD>(delay - elapsed) : 0;
+    };
+
+    const auto wait_ms = std::min(
+        remaining(ctx.timeout), remaining(ctx.pending_notify));
+
+    return RegisterWaitForSingleObject(
+        &ctx.wait, ctx.event, &socketio::connect_wait, &ctx,
+        wait_ms, WT_EXECUTEONLYONCE) != FALSE;
+}
+
+
+void CALLBACK socketio::connect_wait(PVOID param, BOOLEAN timed_out)
+{
+    auto* ctx = static_cast<connect_t*>(param);
+
+    ctx->owner->connect_signaled(ctx, timed_out != FALSE);
+}
+
+
+void socketio::connect_signaled(connect_t* ctx, bool timed_out)
+{
+    std::unique_ptr<connect_t> done;
+    connect_handler_t pending_handler;
+    SOCKET socket;
+    int error = 0;
+
+    {
+        std::scoped_lock connect_lock(m_connect_mutex);
+
+        const auto it = m_connects.find(ctx->socket);
+
+        // taken by join(), which waits for this call to return
+        if (it == m_connects.end() || it->second.get() != ctx)
+            return;
+
+        socket = ctx->socket;
+
+        if (ctx->cancelled)
+        {
+            error = WSAECANCELLED;
+        }
+        else if (ctx->connected)
+        {
+            error = 0;
+        }
+        else if (timed_out)
+        {
+            const auto elapsed = cix::ticks_elapsed(ctx->started);
+
+            if (ctx->timeout != INFINITE && elapsed >= ctx->timeout)
+            {
+                error = WSAETIMEDOUT;
+            }
+            else
+            {
+                // *pending_notify* elapsed, wait for the rest of *timeout*
+                ctx->pending_notify = INFINITE;
+
+                UnregisterWait(ctx->wait);
+                if (!this->connect_arm(*ctx))
+                    error = static_cast<int>(GetLastError());
+                else
+                    error = WSAEWOULDBLOCK;
+            }
+        }
+        else
+        {
+            WSANETWORKEVENTS events;
+
+            if (WSAEnumNetworkEvents(socket, ctx->event, &events) != 0)
+            {
+                error = WSAGetLastError();
+            }
+            else if (events.lNetworkEvents & FD_CONNECT)
+            {
+                error = events.iErrorCode[FD_CONNECT_BIT];
+            }
+            else
+            {
+                // nothing recorded, wait again
+                UnregisterWait(ctx->wait);
+                if (this->connect_arm(*ctx))
+                    return;
+
+                error = static_cast<int>(GetLastError());
+            }
+        }
+
+        if (error == WSAEWOULDBLOCK)
+        {
+            // called again once finished, possibly before this call returns,
+            // hence a copy: *ctx* may be gone by then
+            pending_handler = ctx->handler;
+        }
+        else
+        {
+            done = std::move(it->second);
+            m_connects.erase(it);
+        }
+    }
+
+    if (pending_handler)
+    {
+        pending_handler(socket, WSAEWOULDBLOCK);
+        return;
+    }
+
+    // from its own callback, this does not wait for it
+    UnregisterWait(done->wait);
+    WSAEventSelect(socket, nullptr, 0);
+    WSACloseEvent(done->event);
+
+    if (error != 0)
+        closesocket(socket);
+
+    done->handler(socket, error);
+}
+
+
+socketio::stats_t socketio::stats()
+{
+    stats_t stats{};
+
+    std::scoped_lock lock(m_mutex);
+
+    if (m_engine == engine_iocp)
+    {
+        for (const auto& it : m_iocp_sockets)
+        {
+            const auto& ctx = *it.second;
+
+            if (ctx.registered)
+                ++stats.sockets;
+
+            stats.write_queue_bytes += ctx.write_queue.size;
+        }
+    }
+    else if (m_engine == engine_rio)
+    {
+        for (const auto& it : m_rio_sockets)
+        {
+            const auto& ctx = *it.second;
+
+            if (ctx.registered)
+                ++stats.sockets;
+
+            stats.write_queue_bytes += ctx.write_queue.size;
+        }
+
+        // datagram sockets
+        for (const auto& it : m_iocp_sockets)
+        {
+            if (it.second->registered)
+                ++stats.sockets;
+        }
+    }
+    else if (m_engine == engine_event)
+    {
+        this->event_stats(stats);
+    }
+    else
+    {
+        stats.sockets = m_fdset_read.size();
+
+        // the queue being sent by write_thread__do(), if any, is not in
+        // m_write_queue
+        for (const auto& it : m_write_queue)
+            stats.write_queue_bytes += it.second.size;
+    }
+
+    stats.bytes_received = m_bytes_received.load(std::memory_order_relaxed);
+    stats.bytes_sent = m_bytes_sent.load(std::memory_order_relaxed);
+    stats.write_queue_overflows =
+        m_write_queue_overflows.load(std::memory_order_relaxed);
+    stats.datagrams_dropped =
+        m_datagrams_dropped.load(std::memory_order_relaxed);
+
+    return stats;
+}
+
+
+void socketio::close_thread()
+{
+    CIX_THREAD_SET_NAME_STATIC(GetCurrentThreadId(), "socketio[close]");
+
+    const HANDLE events[] = { m_stop_event, m_close_event };
+
+    for (;;)
+    {
+        DWORD timeout = INFINITE;
+
+        this->close_due_sockets(false);
+
+        {
+            std::scoped_lock close_lock(m_close_mutex);
+
+            if (!m_closing.empty())
+            {
+                const auto queued = m_closing.front().queued;
+
+                timeout = static_cast<DWORD>(cix::ticks_to_go(
+                    queued, queued + close_linger_delay));
+            }
+        }
+
+        const auto wait_res = WaitForMultipleObjects(
+            static_cast<DWORD>(cix::countof(events)), events, FALSE, timeout);
+
+        wakeups::count();
+
+        if (wait_res != WAIT_OBJECT_0 + 1 && wait_res != WAIT_TIMEOUT)
+            break;  // stop event, or failure
+    }
+}
+
+
+void socketio::close_later(const SOCKET* sockets, std::size_t count)
+{
+    // hand *sockets*, shutdown() already, over to close_thread()
+
+    std::unique_lock close_lock(m_close_mutex);
+
+    // not launched, or joined already
+    if (!m_close_thread)
+    {
+        close_lock.unlock();
+
+        for (std::size_t idx = 0; idx < count; ++idx)
+            closesocket(sockets[idx]);
+
+        return;
+    }
+
+    const bool was_empty = m_closing.empty();
+    const auto now = cix::ticks_now();
+
+    for (std::size_t idx = 0; idx < count; ++idx)
+        m_closing.push_back({sockets[idx], now});
+
+    close_lock.unlock();
+
+    // otherwise close_thread() is already waiting for the front one
+    if (was_empty && count > 0)
+        SetEvent(m_close_event);
+}
+
+
+void socketio::close_due_sockets(bool all)
+{
+    std::vector<SOCKET> sockets;
+
+    {
+        std::scoped_lock close_lock(m_close_mutex);
+        const auto now = cix::ticks_now();
+
+        // the delay is the same for all, so the queue is in closing order too
+        while (!m_closing.empty() &&
+            (all ||
+                cix::ticks_elapsed(m_closing.front().queued, now) >=
+                    close_linger_delay))
+        {
+            sockets.push_back(m_closing.front().socket);
+            m_closing.pop_front();
+        }
+    }
+
+    for (const auto socket : sockets)
+        closesocket(socket);
+}
+
+
 void socketio::read_thread()
 {
     fd_set* fds_read = nullptr;
@@ -191,20 +1099,26 @@ void socketio::read_thread()
     TIMEVAL tv;
     bytes_t input_buffer;
 
+    // no timeout needed, see select_wake_t
+    const bool waking = m_read_wake.socket != INVALID_SOCKET;
+
     auto check_stop =
         [this](DWORD wait_time) {
             return WaitForSingleObject(m_stop_event, wait_time) != WAIT_TIMEOUT;
         };
 
     CIX_THREAD_SET_NAME_STATIC(GetCurrentThreadId(), "socketio[read]");
+    thread_tuning::apply(thread_tuning::role_socketio);
+    alloc_profile::set_thread_stage(alloc_profile::stage_socketio);
 
-    // * one input buffer that will never shrink
+    // * one input buffer that only grows for a while, see
+    //   input_buffer_shrink_after
     // * it is the one passed to recv() calls
     // * we still have to allocate memory on a per-recv() call basis, but at
     //   least the right amount of memory per received packet is allocated
     //   (exact amount depends on std::vector implementation though)
     // * see read_thread__do() method for more info
-    input_buffer.resize(socketio::input_buffer_start_size);
+    input_buffer.resize(m_input_buffer_size);
 
     for (;;)
     {
@@ -218,13 +1132,17 @@ void socketio::read_thread()
         {
             std::scoped_lock lock(m_mutex);
 
-            fds_read = m_fdset_read.build_native();
+            fds_read = m_fdset_recv.build_native(m_read_wake.socket);
             fds_except = m_fdset_except.build_native();
 
-            assert(fds_read->fd_count == fds_except->fd_count);
+            // paused sockets are still monitored for exceptions
+            assert(
+                fds_read->fd_count <=
+                fds_except->fd_count + (waking ? 1 : 0));
         }
 
-        if (!fds_read->fd_count)
+        // never the case with a wake socket
+        if (!fds_read->fd_count && !fds_except->fd_count)
         {
             if (check_stop(200))
                 break;
@@ -235,7 +1153,9 @@ void socketio::read_thread()
 
         const int selres = select(
             static_cast<int>(fds_read->fd_count),  // "ignored"
-            fds_read, nullptr, fds_except, &tv);
+            fds_read, nullptr, fds_except, waking ? nullptr : &tv);
+
+        wakeups::count();
 
         if (selres == SOCKET_ERROR)
         {
@@ -260,6 +1180,13 @@ void socketio::read_thread()
         }
         else
         {
+            // sockets changed, nothing else to do
+            if (socketio::select_wake_take(m_read_wake, *fds_read) &&
+                selres == 1)
+            {
+                continue;
+            }
+
             this->read_thread__cleanup(*fds_except, *fds_read);
             this->read_thread__do(input_buffer, *fds_read);
         }
@@ -301,6 +1228,10 @@ void socketio::read_thread__do(bytes_t& buffer, fd_set& fds_read)
     u_int count = 0;
     u_int idx = detail::fdset_rand(fds_read.fd_count);
 
+    // evenly, so that a bulk flow does not delay the others; still one recv()
+    // at least per socket, see read_thread__do()
+    const auto budget = socketio::recv_cycle_budget / fds_read.fd_count;
+
     for (; count < fds_read.fd_count; ++count, ++idx)
     {
         if (idx >= fds_read.fd_count)
@@ -308,30 +1239,100 @@ void socketio::read_thread__do(bytes_t& buffer, fd_set& fds_read)
 
         const auto socket = fds_read.fd_array[idx];
 
-        // ensure socket has not been unregistered during the call to select()
-        if (!m_fdset_read.has(socket))
+        // ensure socket has not been unregistered nor paused during the call
+        // to select()
+        if (!m_fdset_recv.has(socket))
             continue;
 
         if (socket != INVALID_SOCKET)  // because of read_thread__cleanup()
-            this->read_thread__do(buffer, socket);
+            this->read_thread__do(buffer, socket, budget);
     }
 }
 
 
-void socketio::read_thread__do(bytes_t& buffer, SOCKET socket)
+void socketio::read_thread__do(
+    bytes_t& buffer, SOCKET socket, std::size_t budget)
 {
-    // paranoid check
-    if (buffer.size() < socketio::input_buffer_start_size)
-        buffer.resize(socketio::input_buffer_start_size);
+    std::size_t recv_size = m_input_buffer_size;
+
+    {
+        cix::lock_guard lock(m_mutex);
+
+        if (m_datagram_sockets.find(socket) != m_datagram_sockets.end())
+        {
+            lock.unlock();
+            this->read_thread__do_datagrams(buffer, socket);
+            return;
+        }
+
+        const auto size_it = m_recv_sizes.find(socket);
+        if (size_it != m_recv_sizes.end())
+            recv_size = size_it->second;
+    }
+
+    std::size_t drained = 0;
+    std::size_t received = 0;
+
+    // a recv() that fills its buffer means the kernel has more already, no
+    // need to wait for the next select() cycle
+    do
+    {
+        if (!this->read_thread__recv(buffer, socket, recv_size, received))
+            return;  // disconnected, unregistered already
+
+        drained += received;
+    }
+    while (received >= recv_size && drained < budget);
+
+    // bigger reads for a socket that has more than it got, smaller ones for
+    // one that only trickles
+    auto new_size = recv_size;
+
+    if (received >= recv_size)
+        new_size = std::min(recv_size * 2, socketio::recv_max_size);
+    else if (drained < recv_size / 4)
+        new_size = std::max(recv_size / 2, m_input_buffer_size);
+
+    if (new_size != recv_size)
+    {
+        std::scoped_lock lock(m_mutex);
+
+        // may have been unregistered by another thread in the meantime
+        if (!m_fdset_read.has(socket) &&
+            m_event_sockets.find(socket) == m_event_sockets.end())
+        {
+            return;
+        }
+
+        if (new_size == m_input_buffer_size)
+            m_recv_sizes.erase(socket);
+        else
+            m_recv_sizes[socket] = new_size;
+    }
+}
+
+
+bool socketio::read_thread__recv(
+    bytes_t& buffer, SOCKET socket, std::size_t size,
+    std::size_t& out_received)
+{
+    // * return false if *socket* got disconnected, in which case it got
+    //   unregistered
+    // * *out_received* is null if there was nothing to read (would block)
 
     std::size_t bytes_recv = 0;
 
+    out_received = 0;
+
+    if (buffer.size() < size)
+        buffer.resize(size);
+
     for (;;)
     {
-        assert(bytes_recv < buffer.size());
+        assert(bytes_recv < size);
 
         const int to_recv = static_cast<int>(std::min(
-            buffer.size() - bytes_recv,
+            size - bytes_recv,
             static_cast<std::size_t>(std::numeric_limits<int>::max())));
 
         WSASetLastError(0);
@@ -356,11 +1357,12 @@ void socketio::read_thread__do(bytes_t& buffer, SOCKET socket)
             {
                 this->notify_disconnected(socket);
                 this->unregister_socket(socket);
+                return false;
             }
 
             // SecureZeroMemory(buffer.data(), buffer.size());
 
-            return;
+            return true;  // e.g. WSAEWOULDBLOCK
         }
         else if (res == 0)  // connection shutdown
         {
@@ -369,7 +1371,7 @@ void socketio::read_thread__do(bytes_t& buffer, SOCKET socket)
 
             // SecureZeroMemory(buffer.data(), buffer.size());
 
-            return;
+            return false;
         }
         else if (res > 0)
         {
@@ -377,8 +1379,9 @@ void socketio::read_thread__do(bytes_t& buffer, SOCKET socket)
 
             if (wsaerror == WSAEMSGSIZE)
             {
-                buffer.resize(
-                    buffer.size() + socketio::input_buffer_start_size);
+                size += m_input_buffer_size;
+                if (buffer.size() < size)
+                    buffer.resize(size);
                 continue;
             }
 
@@ -393,14 +1396,48 @@ void socketio::read_thread__do(bytes_t& buffer, SOCKET socket)
 
     if (bytes_recv > 0)
     {
-        bytes_t packet(
-            buffer.begin(),
-            std::next(buffer.begin(), bytes_recv));
+        auto packet = this->make_packet(buffer.data(), bytes_recv);
 
         // SecureZeroMemory(buffer.data(), buffer.size());
 
         this->notify_recv(socket, std::move(packet));
     }
+
+    // give back the room a bigger recv() size or a WSAEMSGSIZE made for once
+    // it is not needed anymore
+    if (buffer.size() > m_input_buffer_size)
+    {
+        if (bytes_recv > m_input_buffer_size)
+        {
+            m_input_buffer_fits = 0;
+        }
+        else if (++m_input_buffer_fits >= socketio::input_buffer_shrink_after)
+        {
+            bytes_t(m_input_buffer_size).swap(buffer);
+            m_input_buffer_fits = 0;
+        }
+    }
+
+    out_received = bytes_recv;
+
+    return true;
+}
+
+
+void socketio::read_thread__do_datagrams(bytes_t& buffer, SOCKET socket)
+{
+    std::vector<datagram_t> datagrams;
+
+    const bool healthy = this->recv_datagrams(socket, buffer, datagrams);
+
+    if (!datagrams.empty())
+        this->notify_recvfrom(socket, std::move(datagrams));
+
+    if (!healthy)
+    {
+        this->notify_disconnected(socket);
+        this->unregister_socket(socket);
+    }
 }
 
 
@@ -409,6 +1446,8 @@ void socketio::write_thread()
     const HANDLE events[] = { m_stop_event, m_write_event };
 
     CIX_THREAD_SET_NAME_STATIC(GetCurrentThreadId(), "socketio[write]");
+    thread_tuning::apply(thread_tuning::role_socketio);
+    alloc_profile::set_thread_stage(alloc_profile::stage_socketio);
 
     for (;;)
     {
@@ -417,6 +1456,8 @@ void socketio::write_thread()
             reinterpret_cast<const HANDLE*>(&events),
             FALSE, INFINITE);
 
+        wakeups::count();
+
         if (wait_res == WAIT_OBJECT_0)  // stop event
         {
             break;
@@ -424,6 +1465,7 @@ void socketio::write_thread()
         else if (wait_res == WAIT_OBJECT_0 + 1)  // write event
         {
             this->write_thread__do();
+            this->notify_write_drained();
         }
         else
         {
@@ -445,8 +1487,12 @@ void socketio::write_thread()
 void socketio::write_thread__do()
 {
     fd_set* fds = nullptr;
+    fd_set fds_wake;
     TIMEVAL tv;
 
+    // no timeout needed, see select_wake_t
+    const bool waking = m_write_wake.socket != INVALID_SOCKET;
+
     auto check_stop =
         [this](DWORD wait_time) {
             return WaitForSingleObject(m_stop_event, wait_time) != WAIT_TIMEOUT;
@@ -464,20 +1510,31 @@ void socketio::write_thread__do()
         {
             std::scoped_lock lock(m_mutex);
             fds = m_fdset_write.build_native();
-        }
 
-        if (!fds->fd_count)
-        {
-            // ResetEvent(m_write_event);
-            check_stop(100);
-            return;
+            // every queued socket is in m_fdset_write, so nothing is left to
+            // write until send() sets m_write_event again
+            if (!fds->fd_count)
+            {
+                ResetEvent(m_write_event);
+                m_write_selecting = false;
+                return;
+            }
+
+            m_write_selecting = true;
         }
 
+        FD_ZERO(&fds_wake);
+        if (waking)
+            FD_SET(m_write_wake.socket, &fds_wake);
+
         socketio::milliseconds_to_timeval(100, tv);
 
         const int selres = select(
             static_cast<int>(fds->fd_count),  // "ignored"
-            nullptr, fds, nullptr, &tv);
+            waking ? &fds_wake : nullptr, fds, nullptr,
+            waking ? nullptr : &tv);
+
+        wakeups::count();
 
         if (selres == SOCKET_ERROR)
         {
@@ -498,6 +1555,13 @@ void socketio::write_thread__do()
         }
         else
         {
+            // sockets changed, nothing else to do
+            if (socketio::select_wake_take(m_write_wake, fds_wake) &&
+                selres == 1)
+            {
+                continue;
+            }
+
             u_int count = 0;
             u_int idx = detail::fdset_rand(fds->fd_count);
 
@@ -514,6 +1578,7 @@ void socketio::write_thread__do()
             if (m_write_queue.empty())
             {
                 ResetEvent(m_write_event);
+                m_write_selecting = false;
                 break;
             }
         }
@@ -524,7 +1589,8 @@ void socketio::write_thread__do()
 void socketio::write_thread__do(SOCKET socket)
 {
     cix::lock_guard lock(m_mutex);
-    std::list<bytes_t> packets;
+    write_queue_t queue{{}, 0, 0, false};
+    std::vector<WSABUF> wsabufs;
 
     // ensure socket has not been unregistered during the call to select()
     if (!m_fdset_read.has(socket))
@@ -537,37 +1603,54 @@ void socketio::write_thread__do(SOCKET socket)
         return;
     }
 
-    packets.swap(queue_it->second);
+    queue.packets.swap(queue_it->second.packets);
+    queue.offset = queue_it->second.offset;
+    queue.size = queue_it->second.size;
+    queue.full = queue_it->second.full;
     m_write_queue.erase(queue_it);
     queue_it = m_write_queue.end();
 
+    const auto max_size = m_gather_max_size;
+
     lock.unlock();
 
-    for (auto packet_it = packets.begin(); packet_it != packets.end(); )
+    while (!queue.packets.empty())
     {
-        const auto sent = socketio::send_impl(socket, *packet_it);
+        const auto to_send = socketio::gather(queue, max_size, wsabufs);
+        const auto sent = socketio::send_impl(socket, wsabufs, to_send);
 
-        if (sent >= (*packet_it).size())
-        {
-            packet_it = packets.erase(packet_it);
-        }
-        else if (sent > 0)
-        {
-            auto* pp = &(*packet_it);
-            pp->erase(pp->begin(), std::next(pp->begin(), sent));
-            break;
-        }
-        else if (sent == 0)
-        {
+        this->consume_sent(queue, sent);
+        m_bytes_sent.fetch_add(sent, std::memory_order_relaxed);
+
+        if (sent < to_send)
             break;
-        }
     }
 
     lock.lock();
 
-    if (packets.empty())
+    if (queue.packets.empty())
     {
-        m_fdset_write.unregister_socket(socket);
+        queue_it = m_write_queue.find(socket);
+
+        // unless send() queued more in the meantime, which then owns the
+        // flow state
+        if (queue_it == m_write_queue.end())
+        {
+            m_fdset_write.unregister_socket(socket);
+
+            if (m_fdset_read.has(socket))
+                this->check_drained(socket, queue);
+        }
+        else
+        {
+            queue_it->second.full |= queue.full;
+            this->check_drained(socket, queue_it->second);
+        }
+    }
+    else if (!m_fdset_read.has(socket))
+    {
+        // unregistered in the meantime, nobody would send the rest
+        this->drop_queue(queue);
     }
     else
     {
@@ -577,16 +1660,20 @@ void socketio::write_thread__do(SOCKET socket)
 
         if (queue_it == m_write_queue.end())
         {
-            m_write_queue.insert(std::make_pair(socket, packets));
+            queue_it = m_write_queue.insert(
+                std::make_pair(socket, std::move(queue))).first;
         }
         else
         {
-            std::move(
-                queue_it->second.begin(), queue_it->second.end(),
-                std::back_inserter(packets));
-
-            queue_it->second.swap(packets);
+            // packets queued in the meantime come after the unsent ones, and
+            // they have not been sent at all so *queue.offset* still applies
+            queue.packets.splice(queue.packets.end(), queue_it->second.packets);
+            queue.size += queue_it->second.size;
+            queue.full |= queue_it->second.full;
+            queue_it->second = std::move(queue);
         }
+
+        this->check_drained(socket, queue_it->second);
     }
 }
 
@@ -616,17 +1703,204 @@ void socketio::unregister_non_sockets(fd_set& fds)
 }
 
 
+bool socketio::select_wake_open(select_wake_t& wake)
+{
+    // an ephemeral port of the loopback, connected to itself so that it only
+    // ever receives its own datagrams
+    struct sockaddr_in addr;
+    int addr_len = static_cast<int>(sizeof(addr));
+
+    SecureZeroMemory(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    const auto sock = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock == INVALID_SOCKET)
+    {
+        LOGWARNING(
+            "failed to create sio wake socket (error {})", WSAGetLastError());
+        return false;
+    }
+
+    if (SOCKET_ERROR == bind(
+            sock, reinterpret_cast<const struct sockaddr*>(&addr), addr_len) ||
+        SOCKET_ERROR == getsockname(
+            sock, reinterpret_cast<struct sockaddr*>(&addr), &addr_len) ||
+        SOCKET_ERROR == connect(
+            sock, reinterpret_cast<const struct sockaddr*>(&addr), addr_len))
+    {
+        LOGWARNING(
+            "failed to set sio wake socket up (error {})", WSAGetLastError());
+        closesocket(sock);
+        return false;
+    }
+
+    // drained until it would block, see select_wake_take()
+    const int wsaerror = socketio::enable_socket_nonblocking_mode(sock, true);
+    if (wsaerror != 0)
+    {
+        LOGWARNING(
+            "failed to set sio wake socket in non-blocking mode (error {})",
+            wsaerror);
+        closesocket(sock);
+        return false;
+    }
+
+    wake.socket = sock;
+    wake.pending.store(false);
+
+    return true;
+}
+
+
+void socketio::select_wake_close(select_wake_t& wake)
+{
+    if (wake.socket != INVALID_SOCKET)
+    {
+        closesocket(wake.socket);
+        wake.socket = INVALID_SOCKET;
+    }
+}
+
+
+void socketio::select_wake(select_wake_t& wake)
+{
+    if (wake.socket == INVALID_SOCKET || wake.pending.exchange(true))
+        return;
+
+    const char byte = 0;
+
+    // *pending* keeps a single datagram in the buffer of the socket at most,
+    // so that the loopback has no reason to drop it
+    if (SOCKET_ERROR == ::send(wake.socket, &byte, 1, 0))
+    {
+        LOGDEBUG("failed to wake sio thread (error {})", WSAGetLastError());
+        wake.pending.store(false);
+    }
+}
+
+
+bool socketio::select_wake_take(select_wake_t& wake, fd_set& fds)
+{
+    if (wake.socket == INVALID_SOCKET)
+        return false;
+
+    for (u_int idx = 0; idx < fds.fd_count; ++idx)
+    {
+        if (fds.fd_array[idx] != wake.socket)
+            continue;
+
+        fds.fd_array[idx] = INVALID_SOCKET;
+
+        // cleared first: the changes of a select_wake() from now on may not
+        // be seen by the sets about to be built, so it sends a datagram again
+        wake.pending.store(false);
+
+        char buffer[16];
+        const auto size = static_cast<int>(sizeof(buffer));
+
+        while (recv(wake.socket, buffer, size, 0) > 0)
+        { ; }
+
+        return true;
+    }
+
+    return false;
+}
+
+
+socketio::bytes_t socketio::make_packet(const byte_t* data, std::size_t size)
+{
+    cix::lock_guard lock(m_mutex);
+    auto pool = m_buffer_pool;
+    const auto headroom = m_recv_headroom;
+    lock.unlock();
+
+    bytes_t packet;
+
+    if (pool)
+        packet = pool->acquire(headroom + size);
+    else
+        packet.resize(headroom + size);
+
+    std::memcpy(packet.data() + headroom, data, size);
+
+    return packet;
+}
+
+
 void socketio::notify_recv(SOCKET socket, bytes_t&& packet)
 {
     cix::lock_guard lock(m_mutex);
     auto listener = m_listener.lock();
+    const auto headroom = m_recv_headroom;
     lock.unlock();
 
+    m_bytes_received.fetch_add(
+        packet.size() - headroom, std::memory_order_relaxed);
+
     if (listener)
         listener->on_socketio_recv(socket, std::move(packet));
 }
 
 
+bool socketio::recv_datagrams(
+    SOCKET socket, bytes_t& buffer, std::vector<datagram_t>& out_datagrams)
+{
+    // append the datagrams queued by the kernel to *out_datagrams*, without
+    // waiting, until there is none left or *datagram_batch_max* of them;
+    // return false on an error that concerns the socket rather than a single
+    // datagram
+    // * WSAECONNRESET: the ICMP port unreachable of a previous send_to()
+    // * WSAEMSGSIZE: datagram bigger than *buffer*, truncated so dropped
+
+    while (out_datagrams.size() < socketio::datagram_batch_max)
+    {
+        datagram_t datagram;
+
+        datagram.from_len = static_cast<int>(sizeof(datagram.from));
+
+        const int res = recvfrom(
+            socket, reinterpret_cast<char*>(buffer.data()),
+            static_cast<int>(std::min(
+                buffer.size(),
+                static_cast<std::size_t>(std::numeric_limits<int>::max()))),
+            0, reinterpret_cast<struct sockaddr*>(&datagram.from),
+            &datagram.from_len);
+
+        if (res == SOCKET_ERROR)
+        {
+            const auto wsaerror = WSAGetLastError();
+
+            if (wsaerror == WSAECONNRESET || wsaerror == WSAEMSGSIZE)
+                continue;
+
+            return wsaerror == WSAEWOULDBLOCK;
+        }
+
+        datagram.data.assign(buffer.data(), buffer.data() + res);
+        out_datagrams.push_back(std::move(datagram));
+
+        m_bytes_received.fetch_add(
+            static_cast<std::uint64_t>(res), std::memory_order_relaxed);
+    }
+
+    return true;
+}
+
+
+void socketio::notify_recvfrom(
+    SOCKET socket, std::vector<datagram_t>&& datagrams)
+{
+    cix::lock_guard lock(m_mutex);
+    auto listener = m_listener.lock();
+    lock.unlock();
+
+    if (listener)
+        listener->on_socketio_recvfrom(socket, std::move(datagrams));
+}
+
+
 void socketio::notify_disconnected(SOCKET socket)
 {
     cix::lock_guard lock(m_mutex);
@@ -638,6 +1912,30 @@ void socketio::notify_disconnected(SOCKET socket)
 }
 
 
+void socketio::notify_write_drained()
+{
+    // called by the threads of the engines once done with their sockets, so
+    // that listener is never notified from within send()
+
+    if (!m_write_drained_pending.load(std::memory_order_acquire))
+        return;
+
+    std::vector<SOCKET> sockets;
+
+    cix::lock_guard lock(m_mutex);
+    sockets.swap(m_write_drained);
+    m_write_drained_pending.store(false, std::memory_order_release);
+    auto listener = m_listener.lock();
+    lock.unlock();
+
+    if (!listener)
+        return;
+
+    for (const auto socket : sockets)
+        listener->on_socketio_write_drained(socket);
+}
+
+
 void socketio::milliseconds_to_timeval(long milliseconds, TIMEVAL& tv)
 {
     if (milliseconds <= 0)
@@ -671,34 +1969,189 @@ int socketio::enable_socket_nonblocking_mode(SOCKET socket, bool enable)
 }
 
 
-std::size_t socketio::send_impl(SOCKET socket, const bytes_t& packet)
+std::size_t socketio::gather(
+    const write_queue_t& queue,
+    std::size_t max_size,
+    std::vector<WSABUF>& out_wsabufs)
 {
-    if (packet.empty())
+    // fill *out_wsabufs* with the front of *queue*, up to *max_size* bytes and
+    // gather_max_buffers buffers; return the amount of bytes gathered
+
+    std::size_t gathered = 0;
+    std::size_t offset = queue.offset;
+
+    out_wsabufs.clear();
+
+    for (const auto& packet : queue.packets)
+    {
+        if (out_wsabufs.size() >= socketio::gather_max_buffers ||
+            gathered >= max_size)
+        {
+            break;
+        }
+
+        assert(offset <= packet.size());
+
+        const auto len = std::min({
+            packet.size() - offset,
+            max_size - gathered,
+            static_cast<std::size_t>(std::numeric_limits<ULONG>::max())});
+
+        if (len > 0)
+        {
+            WSABUF wsabuf;
+
+            wsabuf.buf = const_cast<char*>(
+                reinterpret_cast<const char*>(packet.data() + offset));
+            wsabuf.len = static_cast<ULONG>(len);
+
+            out_wsabufs.push_back(wsabuf);
+            gathered += len;
+        }
+
+        offset = 0;
+    }
+
+    return gathered;
+}
+
+
+bool socketio::is_iocp_socket(SOCKET socket) const
+{
+    // CAUTION: m_mutex must be locked by caller
+
+    if (m_engine == engine_iocp)
+        return true;
+
+    return
+        m_engine == engine_rio &&
+        m_iocp_sockets.find(socket) != m_iocp_sockets.end();
+}
+
+
+bool socketio::queue_packet(
+    write_queue_t& queue, cix::shared_buffer&& packet, bool* out_full)
+{
+    // CAUTION: m_mutex must be locked by caller
+
+    const auto size = packet.size();
+
+    if (m_write_queue_max_size != 0 &&
+        queue.size + size > m_write_queue_max_size)
+    {
+        m_write_queue_overflows.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    queue.packets.push_back(std::move(packet));
+    queue.size += size;
+
+    if (m_mem_budget)
+        m_mem_budget->charge(size);
+
+    if (m_write_queue_watermark != 0 &&
+        !queue.full &&
+        queue.size > m_write_queue_watermark)
+    {
+        queue.full = true;
+
+        if (out_full)
+            *out_full = true;
+    }
+
+    return true;
+}
+
+
+void socketio::consume_sent(write_queue_t& queue, std::size_t sent)
+{
+    // pop fully sent (and empty) packets, then move offset forward
+
+    assert(sent <= queue.size);
+    queue.size -= sent;
+
+    // m_mem_budget is constant since launch()
+    if (m_mem_budget)
+        m_mem_budget->discharge(sent);
+
+    while (!queue.packets.empty())
+    {
+        const auto remaining = queue.packets.front().size() - queue.offset;
+
+        if (sent < remaining)
+        {
+            queue.offset += sent;
+            break;
+        }
+
+        sent -= remaining;
+        queue.packets.pop_front();
+        queue.offset = 0;
+    }
+
+    assert(sent == 0);
+}
+
+
+void socketio::drop_queue(write_queue_t& queue)
+{
+    // discharge what was not sent, without releasing the packets, which may
+    // be the buffers of a pending send; they go away with the queue
+
+    if (m_mem_budget)
+        m_mem_budget->discharge(queue.size);
+
+    queue.size = 0;
+    queue.full = false;  // socket is gone, nothing to notify
+}
+
+
+void socketio::check_drained(SOCKET socket, write_queue_t& queue)
+{
+    // CAUTION: m_mutex must be locked by caller
+
+    if (!queue.full ||
+        queue.size > m_write_queue_watermark / write_drained_ratio)
+    {
+        return;
+    }
+
+    queue.full = false;
+    m_write_drained.push_back(socket);
+    m_write_drained_pending.store(true, std::memory_order_release);
+}
+
+
+std::size_t socketio::send_impl(
+    SOCKET socket, std::vector<WSABUF>& wsabufs, std::size_t size)
+{
+    // CAUTION: *wsabufs* is modified in case of a partial send
+
+    if (size == 0 || wsabufs.empty())
     {
         WSASetLastError(0);
         return 0;
     }
 
     std::size_t sent = 0;
+    auto wsabuf_it = wsabufs.begin();
 
-    for (;;)
+    while (sent < size && wsabuf_it != wsabufs.end())
     {
-        const int to_send = static_cast<int>(std::min(
-            packet.size() - sent,
-            static_cast<std::size_t>(std::numeric_limits<int>::max())));
+        DWORD res = 0;
 
-        const int res = ::send(
+        if (SOCKET_ERROR == WSASend(
             socket,
-            reinterpret_cast<const char*>(packet.data() + sent),
-            to_send,
-            0);
-
-        if (res == SOCKET_ERROR)
+            &(*wsabuf_it),
+            static_cast<DWORD>(std::distance(wsabuf_it, wsabufs.end())),
+            &res, 0, nullptr, nullptr))
         {
+            // non-blocking socket is full, see register_socket(); caller waits
+            // for it to be writable again
 #ifdef _DEBUG
             const auto wsaerror = WSAGetLastError();
             CIX_UNVAR(wsaerror);
-            assert(0);
+            assert(wsaerror == WSAEWOULDBLOCK);
 #endif
             break;
         }
@@ -707,11 +2160,23 @@ std::size_t socketio::send_impl(SOCKET socket, const bytes_t& packet)
             WSASetLastError(0);
             break;
         }
-        else if (res > 0)
+
+        sent += static_cast<std::size_t>(res);
+
+        // skip fully sent buffers and adjust the partially sent one, if any
+        for (auto left = res; left > 0 && wsabuf_it != wsabufs.end(); )
         {
-            sent += static_cast<std::size_t>(res);
-            if (sent >= packet.size())
-                break;
+            if (left >= wsabuf_it->len)
+            {
+                left -= wsabuf_it->len;
+                ++wsabuf_it;
+            }
+            else
+            {
+                wsabuf_it->buf += left;
+                wsabuf_it->len -= left;
+                left = 0;
+            }
         }
     }
 
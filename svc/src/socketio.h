@@ -4,20 +4,86 @@
 #pragma once
 
 
-// An auto-sized i/o handler for SOCKET objects based on select()
+// An auto-sized i/o handler for SOCKET objects
 //
 // * SOCKET objects are "registered" once connected.
-// * Compatibility with win2k/3 was a major requirement, far before
-//   performances :)
-// * select() is used to poll sockets.
-// * Two threads are created instead of a single one so that we can wait for
-//   both SOCKET and EVENT objects concurrently - what select() does not allow.
-// * An EVENT object is used internally to trigger a write() call to a socket
-//   (see socketio::write_thread).
+// * Four engines are available, selected at construction time (see
+//   socketio::engine_t and socketio::default_engine):
+//   * engine_select: the original one. Compatibility with win2k/3 was a major
+//     requirement, far before performances :) select() is used to poll
+//     sockets. Two threads are created instead of a single one so that we can
+//     wait for both SOCKET and EVENT objects concurrently - what select() does
+//     not allow. An EVENT object is used internally to trigger a write() call
+//     to a socket (see socketio::write_thread). Each thread also select()s a
+//     loopback socket of its own, which gets a datagram whenever its sockets
+//     change or the stop is requested (see select_wake_t), so that neither
+//     needs a timeout, and an idle engine does not wake up at all.
+//   * engine_iocp: a single thread waits on an I/O completion port. One
+//     overlapped WSARecv() is kept pending per socket, and at most one
+//     overlapped WSASend() per socket at a time. No polling, no timeout.
+//   * engine_rio: Registered I/O, same model as engine_iocp but the requests
+//     are queued to the kernel without a system call each, and the buffers
+//     are pre-registered (locked once) instead of at every operation. One
+//     completion queue for all sockets, whose notifications are delivered to
+//     the completion port of engine_iocp. Windows 8 / Server 2012 and above
+//     only: the constructor falls back to engine_iocp if RIO is not
+//     available (see engine()); sockets must be created with socket_flags().
+//   * engine_event: the middle tier, for the hosts where the overlapped
+//     engines cannot be used. Every socket gets an event of its own
+//     (WSAEventSelect()), and a single thread waits for the events of up to
+//     *event_group_max* sockets along with a wake event of their group, so
+//     that readiness is handled as it happens, in both directions, without
+//     polling; sockets get spread over as many groups (threads) as needed.
+//     Available since win2k, like engine_select.
+// * All engines call the same listener_t methods.
+// * All engines gather the queued output buffers of a socket into a single
+//   send call, bounded by a configurable amount of bytes (see
+//   set_gather_max_size(); also by the size of a registered slot with
+//   engine_rio, see rio_chunk_size). Partially sent buffers are tracked by
+//   offset.
+// * Output buffers are cix::shared_buffer views, so that senders can queue a
+//   slice of a bigger buffer (e.g. the payload of a packet) without copying it
+// * The bytes held by the write queues can be charged to a mem_budget_t (see
+//   set_mem_budget()), and the write queue of a socket can be bounded, in
+//   which case send() fails instead of going past it (see
+//   set_write_queue_max_size()); a write queue can also have a watermark,
+//   that send() tells when it goes past, and listener_t is notified once the
+//   queue drained back down (see set_write_queue_watermark())
+// * Reading from a registered socket can be paused, so that data stays in the
+//   kernel's receive buffer and TCP flow control slows down the remote peer
+//   (see set_recv_paused())
+// * Datagram (UDP) sockets can be registered too, by all engines (see
+//   register_datagram_socket()): each datagram is notified along with its
+//   source address, and the ones the kernel queued already are drained at
+//   once, up to *datagram_batch_max* per notification. send_to() sends a
+//   datagram straight away: there is no write queue, a datagram the socket
+//   cannot take at once is dropped, as a congested network would do.
+// * disconnect_and_unregister_socket() only shutdown()s the socket; a thread
+//   of its own closes it once *close_linger_delay* elapsed, so that whichever
+//   thread disconnects a socket does not wait for its FIN to be sent;
+//   disconnect_and_unregister_sockets() does the same for a batch of them
+//   (e.g. all the SOCKS sessions of a client) with the locks taken once
+// * connect() starts a non-blocking connect and calls the caller back once
+//   it completed, failed or timed out, from a wait of the system pool on an
+//   event of the socket (WSAEventSelect(FD_CONNECT) and
+//   RegisterWaitForSingleObject()), so that no thread waits for a target;
+//   it works the same whatever the engine, the socket is registered by the
+//   caller once connected
+// * join() closes the sockets engine_iocp and engine_rio still have
+//   registered, and the ones waiting to be closed, so that all their
+//   operations complete before it returns (see iocp_drain())
+//
+// * SOCKET handles passed to register_socket() are switched to non-blocking
+//   mode (FIONBIO) if they are not already, so that a slow receiver never
+//   blocks the thread of engine_select, which only sends what the socket can
+//   take at once then waits for it to be writable again; the overlapped
+//   engines do not block either way
+// * engine_select and engine_event drain a readable socket with as many
+//   recv() calls as it fills, up to its share of *recv_cycle_budget* per
+//   cycle; the size of these calls adapts to the recent throughput of each
+//   socket, between *m_input_buffer_size* and *recv_max_size*
 //
 // CAUTION:
-// * SOCKET handles passed to register_socket() method are expected to be
-//   BLOCKING (that is, FIONBIO option set to 0)
 // * OOB data not supported
 class socketio
 {
@@ -25,36 +91,352 @@ public:
     typedef std::uint8_t byte_t;
     typedef std::vector<byte_t> bytes_t;
 
+    // a datagram received by a socket of register_datagram_socket()
+    struct datagram_t
+    {
+        SOCKADDR_STORAGE from;
+        int from_len;
+        bytes_t data;  // no headroom, see set_recv_headroom()
+    };
+
     struct listener_t
     {
         virtual void on_socketio_recv(SOCKET socket, bytes_t&& packet) = 0;
+        virtual void on_socketio_recvfrom(
+            SOCKET socket, std::vector<datagram_t>&& datagrams) = 0;
         virtual void on_socketio_disconnected(SOCKET socket) = 0;
+
+        // the write queue of *socket* went past the watermark, then back down
+        // to a quarter of it or less, see set_write_queue_watermark()
+        virtual void on_socketio_write_drained(SOCKET socket) = 0;
     };
 
-private:
-    // The start size of the common input buffer
+    enum engine_t
+    {
+        engine_select,
+        engine_iocp,
+        engine_rio,
+        engine_event,
+    };
+
+    // the engine used by default; APP_SOCKETIO_SELECT or APP_SOCKETIO_EVENT
+    // can be defined at build time to fall back to the select() or the
+    // WSAEventSelect() engine
+#if defined(APP_SOCKETIO_SELECT)
+    static constexpr engine_t default_engine = engine_select;
+#elif defined(APP_SOCKETIO_EVENT)
+    static constexpr engine_t default_engine = engine_event;
+#else
+    static constexpr engine_t default_engine = engine_iocp;
+#endif
+
+    struct stats_t
+    {
+        std::size_t sockets;            // registered
+        std::size_t write_queue_bytes;  // queued, not sent yet
+        std::uint64_t write_queue_overflows;  // send() calls refused
+        std::uint64_t datagrams_dropped;      // send_to() calls that failed
+        std::uint64_t bytes_received;
+        std::uint64_t bytes_sent;
+    };
+
+    // outcome of connect(): 0 once connected, WSAEWOULDBLOCK when still
+    // pending after its *pending_notify* delay, or the error of the connect
+    // (WSAETIMEDOUT, WSAECANCELLED, ...) in which case *socket* is closed
+    // already
+    typedef std::function<void(SOCKET socket, int error)> connect_handler_t;
+
+    // default max amount of bytes gathered into a single WSASend() call
+    static constexpr std::size_t gather_default_max_size = 256 * 1024;
+
+    // The default start size of the input buffer (see set_input_buffer_size())
     // * This class re-uses the same buffer for every socket-level recv()
-    //   operations. Once a recv() call returned, the received bytes are copied
-    //   into a newly allocated buffer with the exact required size.
+    //   operations (one per socket with engine_iocp, one slot of the
+    //   registered buffers per socket with engine_rio). Once a recv() call
+    //   returned, the received bytes are copied into a buffer with the exact
+    //   required size, acquired from the buffer pool if any (see
+    //   set_buffer_pool()).
     // * Note that recv() calls are not simultaneous.
     // * The common input buffer may grow over time in case a recv() call
-    //   indicates the buffer is too small (i.e. WSAEMSGSIZE error)
-    static constexpr std::size_t input_buffer_start_size = 64 * 1024;
+    //   indicates the buffer is too small (i.e. WSAEMSGSIZE error); not with
+    //   engine_rio, whose slots are sized once
+    // * It shrinks back to its start size once *input_buffer_shrink_after*
+    //   recv() calls in a row did not need the extra room
+    static constexpr std::size_t input_buffer_default_size = 64 * 1024;
+    static constexpr std::size_t input_buffer_shrink_after = 256;
+
+    // max number of datagrams passed to a single call to
+    // listener_t::on_socketio_recvfrom()
+    static constexpr std::size_t datagram_batch_max = 32;
+
+    // delay between the shutdown() and the closesocket() of a socket passed to
+    // disconnect_and_unregister_socket()
+    static constexpr cix::ticks_t close_linger_delay = 50;  // milliseconds
+
+private:
+
+    // max number of buffers gathered into a single WSASend() call
+    static constexpr std::size_t gather_max_buffers = 64;
+
+    // engine_select and engine_event: bytes read per cycle (select() call, or
+    // wait of a group), shared evenly by the sockets that are readable, each
+    // of which is read at least once; and the max size of a single recv()
+    static constexpr std::size_t recv_cycle_budget = 4 * 1024 * 1024;
+    static constexpr std::size_t recv_max_size = 1024 * 1024;
+
+    struct write_queue_t
+    {
+        std::list<cix::shared_buffer> packets;
+        std::size_t offset;  // bytes of packets.front() already sent
+        std::size_t size;  // bytes not sent yet, charged to m_mem_budget
+        bool full;  // went past m_write_queue_watermark, not drained yet
+    };
+
+    // a full write queue is drained once down to watermark / this
+    static constexpr std::size_t write_drained_ratio = 4;
+
+    // completion keys posted to m_iocp
+    enum : ULONG_PTR
+    {
+        iocp_key_socket = 0,
+        iocp_key_stop = 1,
+        iocp_key_rio = 2,  // m_rio_cq has completions
+    };
+
+    // completions dequeued at once, and how long join() lets the pending
+    // operations of engine_iocp and engine_rio complete, see iocp_drain()
+    static constexpr ULONG iocp_drain_batch = 64;
+    static constexpr cix::ticks_t iocp_drain_timeout = 5000;  // milliseconds
+
+    enum : std::size_t
+    {
+        // registered memory is allocated by chunks of about this size, as
+        // needed, then carved into slots of *m_input_buffer_size* bytes (at
+        // least one per chunk); a slot is lent to one operation at a time
+        rio_chunk_size = 4 * 1024 * 1024,
+
+        // completions dequeued at once from m_rio_cq
+        rio_dequeue_max = 128,
+
+        rio_no_slot = std::numeric_limits<std::size_t>::max(),
+    };
+
+    // initial size of m_rio_cq, grown as sockets get registered; two entries
+    // per socket
+    static constexpr DWORD rio_cq_initial_size = 1024;
+
+    struct iocp_socket_t;
+
+    struct iocp_op_t
+    {
+        OVERLAPPED ol;  // see CONTAINING_RECORD() in iocp_dispatch()
+        bool is_read;
+        bool is_datagram;  // constant, see register_datagram_socket()
+        std::vector<WSABUF> wsabufs;
+
+        // self-reference to the owning socket context, only set while the
+        // operation is pending so that its buffer outlives the overlapped call
+        std::shared_ptr<iocp_socket_t> owner;
+    };
+
+    struct iocp_socket_t
+    {
+        SOCKET socket;
+        bool registered;
+        iocp_op_t read_op;
+        iocp_op_t write_op;
+        bytes_t read_buffer;
+        write_queue_t write_queue;  // front packets are the ones being sent
+        bool recv_paused;
+        bool recv_parked;  // paused and no WSARecv() pending
+        SOCKADDR_STORAGE from;  // see WSARecvFrom(), datagram sockets only
+        INT from_len;
+    };
+
+    struct rio_socket_t;
+
+    struct rio_op_t
+    {
+        bool is_read;
+        std::size_t slot;  // lent to the kernel while pending
+        std::size_t size;  // bytes of the write queue copied to *slot*
+
+        // same as iocp_op_t::owner
+        std::shared_ptr<rio_socket_t> owner;
+    };
+
+    struct rio_socket_t
+    {
+        SOCKET socket;
+        bool registered;
+        rio::rq_t rq;
+        rio_op_t read_op;
+        rio_op_t write_op;
+        write_queue_t write_queue;  // front bytes are copied to write_op.slot
+        bool recv_paused;
+        bool recv_parked;  // paused and no RIOReceive() pending
+    };
+
+    struct rio_chunk_t
+    {
+        byte_t* data;
+        rio::bufferid_t id;
+    };
+
+    // engine_event: sockets per group, i.e. what a wait can take besides the
+    // stop event and the wake event of the group
+    static constexpr std::size_t event_group_max = MAXIMUM_WAIT_OBJECTS - 2;
+
+    struct event_socket_t
+    {
+        SOCKET socket;
+        WSAEVENT event;
+        std::size_t group;  // index in m_event_groups
+        write_queue_t write_queue;
+        bool writable;  // false once a send would block, until FD_WRITE
+        bool readable;  // FD_READ or FD_CLOSE, recv() not called yet
+        bool closed;  // FD_CLOSE
+        int close_error;  // of FD_CLOSE, 0 for a graceful one
+        bool recv_paused;
+    };
+
+    struct event_group_t
+    {
+        HANDLE wake_event;  // auto-reset, see event_wake()
+        std::vector<SOCKET> sockets;  // up to event_group_max
+
+        // events of the unregistered sockets, which its thread may still be
+        // waiting for; closed by it before its next wait
+        std::vector<WSAEVENT> retired;
+
+        std::unique_ptr<std::thread> thread;
+    };
+
+    // a connect() in progress, see connect_wait()
+    struct connect_t
+    {
+        socketio* owner;
+        SOCKET socket;
+        WSAEVENT event;  // FD_CONNECT, or cancel_connect()
+        HANDLE wait;  // RegisterWaitForSingleObject()
+        connect_handler_t handler;
+        cix::ticks_t started;
+        DWORD timeout;  // of connect(), from *started*
+        DWORD pending_notify;  // same, INFINITE once notified
+        bool connected;  // at once, by connect()
+        bool cancelled;
+    };
+
+    struct closing_t
+    {
+        SOCKET socket;
+        cix::ticks_t queued;  // shutdown() time
+    };
+
+    // engine_select: a UDP socket bound to the loopback and connected to
+    // itself, that the select() call of a thread waits for along with its
+    // sockets; one datagram at a time is enough since the woken thread builds
+    // its sets again; the threads fall back to polling with a timeout if it
+    // could not be opened
+    struct select_wake_t
+    {
+        SOCKET socket = INVALID_SOCKET;
+        std::atomic<bool> pending{false};  // a datagram is on its way
+    };
 
 public:
-    socketio();
-    ~socketio() = default;
+    explicit socketio(engine_t engine=default_engine);
+    ~socketio();
+
+    // may differ from the one passed to the constructor, see engine_rio
+    engine_t engine() const { return m_engine; }
+
+    // flags to pass to WSASocket() to create the sockets to register
+    // * datagram sockets only need WSA_FLAG_OVERLAPPED, whatever the engine:
+    //   engine_rio serves them like engine_iocp does
+    DWORD socket_flags() const;
 
     void set_stop_event(HANDLE stop_event);
     void set_listener(std::shared_ptr<listener_t> listener);
+    void set_gather_max_size(std::size_t max_size);
+
+    // must be called before launch() to apply to every socket
+    void set_input_buffer_size(std::size_t size);
+
+    // received packets start with *size* bytes left uninitialized, followed by
+    // the received data, so that listener can frame the data in place; 0 by
+    // default; must be called before launch()
+    void set_recv_headroom(std::size_t size);
+
+    // received packets are acquire()'d from *pool*, if any; listener may
+    // release() them
+    void set_buffer_pool(std::shared_ptr<cix::buffer_pool> pool);
+
+    // must be called before launch(); the bytes queued for sending are charged
+    // to *budget*, if any
+    void set_mem_budget(std::shared_ptr<mem_budget_t> budget);
+
+    // max amount of bytes queued for sending per socket, 0 for no limit (the
+    // default); send() fails if a packet does not fit, the socket is left
+    // registered; must be called before launch()
+    void set_write_queue_max_size(std::size_t max_size);
+
+    // bytes queued for sending past which the write queue of a socket is
+    // full, 0 for none (the default); must be called before launch()
+    // * send() sets *out_full*, if any, once a packet got the queue past it;
+    //   the packet is queued anyway, within the max size
+    // * listener_t::on_socketio_write_drained() is called, by a thread of
+    //   socketio, once a full queue is down to a quarter of it again
+    void set_write_queue_watermark(std::size_t watermark);
 
     void launch();
     void register_socket(SOCKET socket);
-    bool send(SOCKET socket, bytes_t&& packet);
+    bool send(
+        SOCKET socket, cix::shared_buffer&& packet, bool* out_full=nullptr);
+
+    // whether the write queue of *socket* went past the watermark and did not
+    // drain yet, see set_write_queue_watermark()
+    bool is_write_queue_full(SOCKET socket);
+
+    // datagram sockets, bound but not connected, see datagram_t; paused,
+    // unregistered and closed like the others
+    void register_datagram_socket(SOCKET socket);
+    bool send_to(
+        SOCKET socket, const struct sockaddr* to, int to_len,
+        const byte_t* data, std::size_t size);
+    void set_recv_paused(SOCKET socket, bool paused);
     void disconnect_and_unregister_socket(SOCKET socket);
+    void disconnect_and_unregister_sockets(const std::vector<SOCKET>& sockets);
     void unregister_socket(SOCKET socket);
+
+    // start connecting *socket*, switched to non-blocking mode, to *addr*
+    // * return 0 if started, or the error if not, in which case the caller
+    //   keeps *socket*; *handler* is called once finished otherwise, with
+    //   WSAETIMEDOUT after *timeout* milliseconds (INFINITE for none)
+    // * *handler* is also called with WSAEWOULDBLOCK, once, if the connect is
+    //   still pending after *pending_notify* milliseconds (INFINITE for never),
+    //   e.g. to start racing another address
+    // * *handler* is called by a thread of the system pool, never with
+    //   m_mutex held
+    int connect(
+        SOCKET socket, const struct sockaddr* addr, int addr_len,
+        DWORD timeout, DWORD pending_notify, connect_handler_t&& handler);
+
+    // have the connect() of *socket*, if still pending, fail with
+    // WSAECANCELLED
+    void cancel_connect(SOCKET socket);
+
+    // same for all of them, and for the ones that come afterwards until the
+    // next launch(), e.g. to stop
+    void cancel_connects();
+
+    // CAUTION: drops the connect() calls still in progress, if any, without
+    // calling their handler; see cancel_connects()
+
     void join();
 
+    stats_t stats();
+
     static void milliseconds_to_timeval(long milliseconds, TIMEVAL& tv);
     static int enable_socket_nonblocking_mode(SOCKET sock, bool enable);
 
@@ -62,7 +444,11 @@ private:
     void read_thread();
     void read_thread__cleanup(const fd_set& fds_except, fd_set& fds_read);
     void read_thread__do(bytes_t& buffer, fd_set& fds_read);
-    void read_thread__do(bytes_t& buffer, SOCKET socket);
+    void read_thread__do(bytes_t& buffer, SOCKET socket, std::size_t budget);
+    bool read_thread__recv(
+        bytes_t& buffer, SOCKET socket, std::size_t size,
+        std::size_t& out_received);
+    void read_thread__do_datagrams(bytes_t& buffer, SOCKET socket);
 
     void write_thread();
     void write_thread__do();
@@ -70,23 +456,174 @@ private:
 
     void unregister_non_sockets(fd_set& fds);
 
+    static bool select_wake_open(select_wake_t& wake);
+    static void select_wake_close(select_wake_t& wake);
+    static void select_wake(select_wake_t& wake);
+
+    // drain *wake* if it is in *fds*, and take it out of it; to be called once
+    // select() returned, before the sockets of *fds* get handled
+    static bool select_wake_take(select_wake_t& wake, fd_set& fds);
+
+    static void CALLBACK connect_wait(PVOID param, BOOLEAN timed_out);
+    bool connect_arm(connect_t& ctx);
+    void connect_signaled(connect_t* ctx, bool timed_out);
+
+    void close_thread();
+    void close_later(const SOCKET* sockets, std::size_t count);
+    void close_due_sockets(bool all);
+
+    // socketio_iocp.cpp
+    void iocp_thread();
+    void iocp_dispatch(ULONG_PTR key, OVERLAPPED* ol, DWORD bytes, DWORD error);
+    void iocp_close_registered();
+    void iocp_drain();
+    void iocp_register_socket(SOCKET socket, bool is_datagram=false);
+    bool iocp_send(
+        SOCKET socket, cix::shared_buffer&& packet, bool* out_full);
+    void iocp_unregister_socket(SOCKET socket);
+    void iocp_set_recv_paused(SOCKET socket, bool paused);
+    void iocp_on_recv(iocp_op_t& op, DWORD bytes, DWORD error);
+    void iocp_on_recvfrom(iocp_op_t& op, DWORD bytes, DWORD error);
+    void iocp_on_sent(iocp_op_t& op, DWORD bytes, DWORD error);
+    bool iocp_post_recv(std::shared_ptr<iocp_socket_t> ctx);
+    bool iocp_post_send(std::shared_ptr<iocp_socket_t> ctx);
+
+    // socketio_rio.cpp
+    static engine_t resolve_engine(engine_t engine);
+    static const rio::function_table_t* rio_load();
+    void rio_init();
+    void rio_release();
+    void rio_register_socket(SOCKET socket);
+    bool rio_send(SOCKET socket, cix::shared_buffer&& packet, bool* out_full);
+    void rio_unregister_socket(SOCKET socket);
+    void rio_set_recv_paused(SOCKET socket, bool paused);
+    void rio_on_notify();
+    void rio_on_recv(rio_op_t& op, DWORD bytes, LONG status);
+    void rio_on_sent(rio_op_t& op, DWORD bytes, LONG status);
+    bool rio_post_recv(std::shared_ptr<rio_socket_t> ctx);
+    bool rio_post_send(std::shared_ptr<rio_socket_t> ctx);
+    rio::rq_t rio_create_request_queue(SOCKET socket, rio_socket_t* ctx);
+    std::size_t rio_acquire_slot();
+    void rio_release_slot(std::size_t slot);
+    rio::buf_t rio_slot_buf(std::size_t slot, std::size_t size) const;
+    byte_t* rio_slot_data(std::size_t slot) const;
+
+    // socketio_event.cpp
+    void event_thread(std::size_t group);
+    void event_launch(std::size_t group);
+    void event_release();
+    void event_register_socket(SOCKET socket, bool is_datagram=false);
+    bool event_send(
+        SOCKET socket, cix::shared_buffer&& packet, bool* out_full);
+    void event_unregister_socket(SOCKET socket);
+    void event_set_recv_paused(SOCKET socket, bool paused);
+    void event_wake(const event_socket_t& ctx);
+    void event_on_signaled(SOCKET socket, WSAEVENT event);
+    void event_flush(event_socket_t& ctx, std::vector<WSABUF>& wsabufs);
+    void event_stats(stats_t& stats) const;
+
+    // engine_iocp, or a datagram socket of engine_rio
+    bool is_iocp_socket(SOCKET socket) const;
+
+    bool queue_packet(
+        write_queue_t& queue, cix::shared_buffer&& packet, bool* out_full);
+    void consume_sent(write_queue_t& queue, std::size_t sent);
+    void drop_queue(write_queue_t& queue);
+    void check_drained(SOCKET socket, write_queue_t& queue);
+
+    bytes_t make_packet(const byte_t* data, std::size_t size);
     void notify_recv(SOCKET socket, bytes_t&& packet);
+    bool recv_datagrams(
+        SOCKET socket, bytes_t& buffer,
+        std::vector<datagram_t>& out_datagrams);
+    void notify_recvfrom(SOCKET socket, std::vector<datagram_t>&& datagrams);
     void notify_disconnected(SOCKET socket);
+    void notify_write_drained();
 
-    static std::size_t send_impl(SOCKET socket, const bytes_t& packet);
+    static std::size_t gather(
+        const write_queue_t& queue,
+        std::size_t max_size,
+        std::vector<WSABUF>& out_wsabufs);
+    static std::size_t send_impl(
+        SOCKET socket, std::vector<WSABUF>& wsabufs, std::size_t size);
 
 private:
+    const engine_t m_engine;
     std::recursive_mutex m_mutex;
     std::unique_ptr<std::thread> m_read_thread;
     std::unique_ptr<std::thread> m_write_thread;
     HANDLE m_stop_event;
 
-    fdset_t m_fdset_read;
+    fdset_t m_fdset_read;  // registered sockets
+    fdset_t m_fdset_recv;  // m_fdset_read minus paused sockets
     fdset_t m_fdset_write;
     fdset_t m_fdset_except;
+    std::set<SOCKET> m_datagram_sockets;  // subset of m_fdset_read
 
-    std::map<SOCKET, std::list<bytes_t>> m_write_queue;
+    // recv() size of a socket, if not *m_input_buffer_size*; see
+    // read_thread__do()
+    cix::flat_hash_map<SOCKET, std::size_t> m_recv_sizes;
+
+    cix::flat_hash_map<SOCKET, write_queue_t> m_write_queue;
     HANDLE m_write_event;
+    select_wake_t m_read_wake;
+    select_wake_t m_write_wake;
+    bool m_write_selecting;  // write_thread__do() may be in select()
+    std::size_t m_gather_max_size;
+    std::size_t m_input_buffer_size;
+    std::atomic<std::size_t> m_input_buffer_fits;  // see read_thread__recv()
+    std::size_t m_recv_headroom;
+
+    HANDLE m_iocp;
+    std::unique_ptr<std::thread> m_iocp_thread;
+    std::map<SOCKET, std::shared_ptr<iocp_socket_t>> m_iocp_sockets;
+
+    // operations of engine_iocp and engine_rio that own their context (see
+    // iocp_op_t::owner), unregistered sockets included; see iocp_drain()
+    std::size_t m_iocp_pending;
+
+    // engine_rio; also uses m_iocp and m_iocp_thread
+    const rio::function_table_t* m_rio;
+    rio::cq_t m_rio_cq;
+    DWORD m_rio_cq_size;
+    OVERLAPPED m_rio_ol;  // of the notifications of m_rio_cq
+    std::size_t m_rio_slot_size;  // m_input_buffer_size as of launch()
+    std::size_t m_rio_slots_per_chunk;
+    std::vector<rio_chunk_t> m_rio_chunks;
+    std::vector<std::size_t> m_rio_free_slots;
+    std::map<SOCKET, std::shared_ptr<rio_socket_t>> m_rio_sockets;
+
+    // engine_event; also uses m_datagram_sockets and m_recv_sizes
+    bool m_event_launched;
+    std::vector<std::unique_ptr<event_group_t>> m_event_groups;
+    std::map<SOCKET, event_socket_t> m_event_sockets;
+
+    std::atomic<std::uint64_t> m_bytes_received;
+    std::atomic<std::uint64_t> m_bytes_sent;
+    std::atomic<std::uint64_t> m_write_queue_overflows;
+    std::atomic<std::uint64_t> m_datagrams_dropped;
+
+    // connect() calls in progress, owned by their wait until it fired
+    // CAUTION: m_connect_mutex is never held while acquiring m_mutex, nor
+    // while calling a connect_handler_t
+    std::mutex m_connect_mutex;
+    std::map<SOCKET, std::unique_ptr<connect_t>> m_connects;
+    bool m_connects_stopped;  // see cancel_connects()
+
+    // sockets to closesocket(), in *queued* order
+    // CAUTION: m_close_mutex is never held while acquiring m_mutex
+    std::mutex m_close_mutex;
+    std::deque<closing_t> m_closing;
+    HANDLE m_close_event;  // auto-reset, m_closing got a first entry
+    std::unique_ptr<std::thread> m_close_thread;
 
     std::weak_ptr<listener_t> m_listener;
+    std::shared_ptr<cix::buffer_pool> m_buffer_pool;
+    std::shared_ptr<mem_budget_t> m_mem_budget;
+    std::size_t m_write_queue_max_size;
+    std::size_t m_write_queue_watermark;
+
+    // sockets whose write queue drained, see notify_write_drained()
+    std::vector<SOCKET> m_write_drained;
+    std::atomic<bool> m_write_drained_pending;  // m_write_drained not empty
 };
@@ -0,0 +1,486 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "main.h"
+
+// socketio::engine_event implementation
+//
+// * every registered SOCKET gets an event of its own (WSAEventSelect()) and a
+//   context (event_socket_t) stored in m_event_sockets
+// * sockets are spread over groups of up to *event_group_max* of them, each
+//   served by a thread of its own that waits for the events of its sockets,
+//   the stop event and the wake event of the group, all at once; a group is
+//   created once the others are full, and lives until join()
+// * the wake event is set whenever a group has something to do that no
+//   network event would report: a packet queued to a socket that can take it
+//   (see event_send()), a paused socket that got data in the meantime being
+//   resumed, or a change of its sockets
+// * both directions are handled by the same thread: a network event or a
+//   wake makes it write the queue of every socket that is writable, then read
+//   every socket that is readable, so that neither waits for a timeout
+// * FD_READ and FD_WRITE are only recorded again by the next recv(), or once a
+//   send failed with WSAEWOULDBLOCK, which is why the context of a socket
+//   keeps track of them (see readable and writable)
+// * sends are non-blocking calls (WSAEventSelect() switched the socket to
+//   non-blocking mode), made with m_mutex locked like the overlapped engines
+//   post theirs; recv() calls are made with m_mutex unlocked, by
+//   read_thread__do(), the same as engine_select
+// * the event of an unregistered socket may still be waited for by its
+//   group, so it is closed by the thread of the group, before its next wait
+// * listener is always notified with m_mutex unlocked
+
+
+void socketio::event_thread(std::size_t group_idx)
+{
+    std::vector<SOCKET> sockets;  // in handles order, from the 3rd one
+    std::vector<HANDLE> handles;
+    std::vector<SOCKET> to_read;
+    std::vector<SOCKET> to_close;
+    std::vector<WSABUF> wsabufs;
+    bytes_t input_buffer;
+
+    CIX_THREAD_SET_NAME_STATIC(GetCurrentThreadId(), "socketio[event]");
+    thread_tuning::apply(thread_tuning::role_socketio);
+    alloc_profile::set_thread_stage(alloc_profile::stage_socketio);
+
+    // same as read_thread()
+    input_buffer.resize(m_input_buffer_size);
+
+    for (;;)
+    {
+        {
+            std::scoped_lock lock(m_mutex);
+            auto& group = *m_event_groups[group_idx];
+
+            // not waited for anymore
+            for (const auto event : group.retired)
+                WSACloseEvent(event);
+            group.retired.clear();
+
+            sockets = group.sockets;
+
+            handles.clear();
+            handles.push_back(m_stop_event);
+            handles.push_back(group.wake_event);
+
+            for (const auto socket : sockets)
+                handles.push_back(m_event_sockets.find(socket)->second.event);
+        }
+
+        const auto count = static_cast<DWORD>(handles.size());
+
+        auto wait_res = WaitForMultipleObjects(
+            count, handles.data(), FALSE, INFINITE);
+
+        wakeups::count();
+
+        if (wait_res == WAIT_OBJECT_0)  // stop event
+            break;
+
+        if (wait_res >= WAIT_OBJECT_0 + count)
+        {
+            LOGERROR(
+                "failed to wait for sio socket events (result {}; error {})",
+                wait_res, GetLastError());
+            assert(0);
+
+            // avoid consuming too much CPU in an infinite loop
+            if (WAIT_TIMEOUT != WaitForSingleObject(m_stop_event, 100))
+                break;
+
+            continue;
+        }
+
+        // WaitForMultipleObjects() only reports the first signaled handle, the
+        // next ones are found without waiting; the wake event needs nothing
+        // more than the pass below
+        for (auto idx = wait_res - WAIT_OBJECT_0; idx < count; )
+        {
+            if (idx >= 2)
+                this->event_on_signaled(sockets[idx - 2], handles[idx]);
+
+            if (++idx >= count)
+                break;
+
+            wait_res = WaitForMultipleObjects(
+                count - idx, handles.data() + idx, FALSE, 0);
+
+            if (wait_res >= WAIT_OBJECT_0 + (count - idx))
+                break;  // none left (or failure, the next wait tells)
+
+            idx += wait_res - WAIT_OBJECT_0;
+        }
+
+        to_read.clear();
+        to_close.clear();
+
+        {
+            std::scoped_lock lock(m_mutex);
+
+            for (const auto socket : sockets)
+            {
+                auto it = m_event_sockets.find(socket);
+                if (it == m_event_sockets.end())
+                    continue;  // unregistered in the meantime
+
+                auto& ctx = it->second;
+
+                // reset, whatever is left to read is lost anyway; notified
+                // even if paused, like engine_select does
+                if (ctx.closed && ctx.close_error != 0)
+                {
+                    to_close.push_back(socket);
+                    continue;
+                }
+
+                if (ctx.writable && !ctx.write_queue.packets.empty())
+                    this->event_flush(ctx, wsabufs);
+
+                if (ctx.readable && !ctx.recv_paused)
+                {
+                    ctx.readable = false;
+                    to_read.push_back(socket);
+                }
+            }
+        }
+
+        this->notify_write_drained();
+
+        // evenly, see read_thread__do()
+        const auto budget = to_read.empty() ?
+            0 : socketio::recv_cycle_budget / to_read.size();
+
+        for (const auto socket : to_read)
+        {
+            bool closed = false;
+
+            {
+                std::scoped_lock lock(m_mutex);
+
+                const auto it = m_event_sockets.find(socket);
+                if (it == m_event_sockets.end())
+                    continue;
+
+                closed = it->second.closed;
+            }
+
+            // FD_CLOSE is recorded once all the data arrived, so that there
+            // is no more FD_READ to wait for: read it all at once
+            this->read_thread__do(
+                input_buffer, socket,
+                closed ? std::numeric_limits<std::size_t>::max() : budget);
+
+            if (closed)
+                to_close.push_back(socket);
+        }
+
+        for (const auto socket : to_close)
+        {
+            {
+                std::scoped_lock lock(m_mutex);
+
+                // e.g. by read_thread__recv(), once the FIN got read
+                if (m_event_sockets.find(socket) == m_event_sockets.end())
+                    continue;
+            }
+
+            this->notify_disconnected(socket);
+            this->unregister_socket(socket);
+        }
+    }
+}
+
+
+void socketio::event_launch(std::size_t group_idx)
+{
+    // CAUTION: m_mutex must be locked by caller
+
+    auto& group = *m_event_groups[group_idx];
+
+    assert(!group.thread);
+
+    group.thread = std::make_unique<std::thread>(
+        std::bind(&socketio::event_thread, this, group_idx));
+}
+
+
+void socketio::event_release()
+{
+    // CAUTION: the threads of the groups must not be running, i.e. either
+    // joined or never launched
+
+    for (auto& it : m_event_sockets)
+    {
+        WSAEventSelect(it.first, nullptr, 0);
+        WSACloseEvent(it.second.event);
+        this->drop_queue(it.second.write_queue);
+    }
+
+    m_event_sockets.clear();
+
+    for (auto& group : m_event_groups)
+    {
+        assert(!group->thread);
+
+        for (const auto event : group->retired)
+            WSACloseEvent(event);
+
+        CloseHandle(group->wake_event);
+    }
+
+    m_event_groups.clear();
+    m_datagram_sockets.clear();
+    m_recv_sizes.clear();
+}
+
+
+void socketio::event_register_socket(SOCKET socket, bool is_datagram)
+{
+    std::scoped_lock lock(m_mutex);
+
+    if (m_event_sockets.find(socket) != m_event_sockets.end())
+    {
+        assert(0);
+        return;
+    }
+
+    const auto event = WSACreateEvent();
+    if (event == WSA_INVALID_EVENT)
+    {
+        LOGERROR(
+            "failed to create sio socket event (error {})", WSAGetLastError());
+        assert(0);
+        return;
+    }
+
+    // datagram sockets are never written by a group, see send_to()
+    const long network_events =
+        is_datagram ? FD_READ : (FD_READ | FD_WRITE | FD_CLOSE);
+
+    if (SOCKET_ERROR == WSAEventSelect(socket, event, network_events))
+    {
+        LOGERROR(
+            "failed to select sio socket events (error {})", WSAGetLastError());
+        WSACloseEvent(event);
+        assert(0);
+        return;
+    }
+
+    // the first group with room left, or a new one
+    std::size_t group_idx = 0;
+
+    while (group_idx < m_event_groups.size() &&
+        m_event_groups[group_idx]->sockets.size() >= event_group_max)
+    {
+        ++group_idx;
+    }
+
+    if (group_idx >= m_event_groups.size())
+    {
+        auto group = std::make_unique<event_group_t>();
+
+        group->wake_event = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+        if (!group->wake_event)
+        {
+            LOGERROR(
+                "failed to create sio wake event (error {})", GetLastError());
+            WSAEventSelect(socket, nullptr, 0);
+            WSACloseEvent(event);
+            assert(0);
+            return;
+        }
+
+        m_event_groups.push_back(std::move(group));
+
+        if (m_event_launched)
+            this->event_launch(group_idx);
+    }
+
+    event_socket_t ctx;
+
+    ctx.socket = socket;
+    ctx.event = event;
+    ctx.group = group_idx;
+    ctx.write_queue.offset = 0;
+    ctx.write_queue.size = 0;
+    ctx.write_queue.full = false;
+    ctx.writable = true;  // until a send would block
+    ctx.readable = true;  // data may have arrived before WSAEventSelect()
+    ctx.closed = false;
+    ctx.close_error = 0;
+    ctx.recv_paused = false;
+
+    m_event_sockets.insert(std::make_pair(socket, std::move(ctx)));
+    m_event_groups[group_idx]->sockets.push_back(socket);
+
+    if (is_datagram)
+        m_datagram_sockets.insert(socket);
+
+    // so that the group waits for its event too
+    this->event_wake(m_event_sockets.find(socket)->second);
+}
+
+
+bool socketio::event_send(
+    SOCKET socket, cix::shared_buffer&& packet, bool* out_full)
+{
+    std::scoped_lock lock(m_mutex);
+
+    auto it = m_event_sockets.find(socket);
+    if (it == m_event_sockets.end())
+        return false;
+
+    if (!m_event_launched)
+        return false;
+
+    if (packet.empty())
+        return true;
+
+    auto& ctx = it->second;
+    const bool was_empty = ctx.write_queue.packets.empty();
+
+    if (!this->queue_packet(ctx.write_queue, std::move(packet), out_full))
+        return false;
+
+    // otherwise the group is woken up already, or waits for FD_WRITE
+    if (was_empty && ctx.writable)
+        this->event_wake(ctx);
+
+    return true;
+}
+
+
+void socketio::event_unregister_socket(SOCKET socket)
+{
+    std::scoped_lock lock(m_mutex);
+
+    auto it = m_event_sockets.find(socket);
+    if (it == m_event_sockets.end())
+        return;
+
+    auto& ctx = it->second;
+    auto& group = *m_event_groups[ctx.group];
+
+    // the caller may keep using the socket; fails harmlessly if it got closed
+    // already
+    WSAEventSelect(socket, nullptr, 0);
+
+    // no pending operation, packets can go away with the context
+    this->drop_queue(ctx.write_queue);
+
+    // closed by the thread of the group (if any), see event_thread()
+    group.retired.push_back(ctx.event);
+    group.sockets.erase(
+        std::find(group.sockets.begin(), group.sockets.end(), socket));
+
+    this->event_wake(ctx);
+
+    m_event_sockets.erase(it);
+    m_datagram_sockets.erase(socket);
+    m_recv_sizes.erase(socket);
+}
+
+
+void socketio::event_set_recv_paused(SOCKET socket, bool paused)
+{
+    std::scoped_lock lock(m_mutex);
+
+    auto it = m_event_sockets.find(socket);
+    if (it == m_event_sockets.end())
+        return;
+
+    auto& ctx = it->second;
+
+    ctx.recv_paused = paused;
+
+    // FD_READ is not recorded again until the next recv(), which the group
+    // skipped while paused
+    if (!paused && ctx.readable)
+        this->event_wake(ctx);
+}
+
+
+void socketio::event_wake(const event_socket_t& ctx)
+{
+    // CAUTION: m_mutex must be locked by caller
+
+    // otherwise, the first wait of the group comes next anyway
+    if (m_event_launched)
+        SetEvent(m_event_groups[ctx.group]->wake_event);
+}
+
+
+void socketio::event_on_signaled(SOCKET socket, WSAEVENT event)
+{
+    std::scoped_lock lock(m_mutex);
+
+    // may have been unregistered in the meantime, and the handle re-used by
+    // a new socket
+    auto it = m_event_sockets.find(socket);
+    if (it == m_event_sockets.end() || it->second.event != event)
+        return;
+
+    auto& ctx = it->second;
+    WSANETWORKEVENTS network_events{};
+
+    // also resets *event*
+    if (SOCKET_ERROR == WSAEnumNetworkEvents(socket, event, &network_events))
+    {
+        const auto wsaerror = WSAGetLastError();
+
+        // e.g. WSAENOTSOCK; the event would keep being signaled otherwise
+        LOGDEBUG("WSAEnumNetworkEvents() failed (error {})", wsaerror);
+        ctx.closed = true;
+        ctx.close_error = wsaerror != 0 ? wsaerror : WSAENOTSOCK;
+        return;
+    }
+
+    if (network_events.lNetworkEvents & FD_READ)
+        ctx.readable = true;
+
+    if (network_events.lNetworkEvents & FD_WRITE)
+        ctx.writable = true;
+
+    if (network_events.lNetworkEvents & FD_CLOSE)
+    {
+        ctx.readable = true;
+        ctx.closed = true;
+        ctx.close_error = network_events.iErrorCode[FD_CLOSE_BIT];
+    }
+}
+
+
+void socketio::event_flush(event_socket_t& ctx, std::vector<WSABUF>& wsabufs)
+{
+    // CAUTION: m_mutex must be locked by caller
+
+    while (!ctx.write_queue.packets.empty())
+    {
+        const auto to_send =
+            socketio::gather(ctx.write_queue, m_gather_max_size, wsabufs);
+        const auto sent = socketio::send_impl(ctx.socket, wsabufs, to_send);
+
+        this->consume_sent(ctx.write_queue, sent);
+        this->check_drained(ctx.socket, ctx.write_queue);
+        m_bytes_sent.fetch_add(sent, std::memory_order_relaxed);
+
+        if (sent < to_send)
+        {
+            // FD_WRITE comes once the socket can take more; any other failure
+            // shows as FD_CLOSE, or on the next recv()
+            ctx.writable = false;
+            break;
+        }
+    }
+}
+
+
+void socketio::event_stats(stats_t& stats) const
+{
+    // CAUTION: m_mutex must be locked by caller
+
+    stats.sockets = m_event_sockets.size();
+
+    for (const auto& it : m_event_sockets)
+        stats.write_queue_bytes += it.second.write_queue.size;
+}
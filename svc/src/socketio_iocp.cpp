@@ -0,0 +1,652 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "main.h"
+
+// socketio::engine_iocp implementation
+//
+// * every registered SOCKET is associated to m_iocp, and gets its own context
+//   (iocp_socket_t) stored in m_iocp_sockets
+// * a context always has one pending overlapped WSARecv() - unless reading is
+//   paused (see iocp_set_recv_paused()) - and at most one pending overlapped
+//   WSASend()
+// * a pending operation holds a reference to its context (iocp_op_t::owner)
+//   so that an unregistered context remains valid until the kernel is done
+//   with it (closesocket() completes all pending operations)
+// * listener is always notified with m_mutex unlocked, and a new WSARecv() is
+//   posted only once listener has been notified so that received data is
+//   delivered in order
+// * datagram sockets have a WSARecvFrom() pending instead, and never a
+//   WSASend() (see send_to()); once it completes, the datagrams that arrived
+//   in the meantime are drained with non-blocking recvfrom() calls so that
+//   they are notified at once
+// * join() closes the registered sockets first, then has iocp_thread() drain
+//   the completions left (see iocp_drain()) until no operation owns a context
+//   anymore (see m_iocp_pending)
+
+
+namespace detail
+{
+    // CAUTION: the layout must match the SDK's OVERLAPPED_ENTRY
+    struct overlapped_entry_t
+    {
+        ULONG_PTR lpCompletionKey;
+        LPOVERLAPPED lpOverlapped;
+        ULONG_PTR Internal;
+        DWORD dwNumberOfBytesTransferred;
+    };
+
+    typedef BOOL (WINAPI* cancel_io_ex_t)(HANDLE, LPOVERLAPPED);
+    typedef BOOL (WINAPI* get_queued_completion_status_ex_t)(
+        HANDLE, overlapped_entry_t*, ULONG, PULONG, DWORD, BOOL);
+
+    // Vista and above, not visible to our WINVER target
+    struct kernel32_t
+    {
+        cancel_io_ex_t cancel_io_ex;
+        get_queued_completion_status_ex_t dequeue_ex;
+    };
+
+    static const kernel32_t& kernel32()
+    {
+        // never unloaded, loaded in every process anyway
+        static const auto table = []() -> kernel32_t
+        {
+            kernel32_t out{nullptr, nullptr};
+            const auto module = GetModuleHandleW(L"kernel32.dll");
+
+            if (!module)
+                return out;
+
+            out.cancel_io_ex = reinterpret_cast<cancel_io_ex_t>(
+                GetProcAddress(module, "CancelIoEx"));
+            out.dequeue_ex =
+                reinterpret_cast<get_queued_completion_status_ex_t>(
+                    GetProcAddress(module, "GetQueuedCompletionStatusEx"));
+
+            return out;
+        }();
+
+        return table;
+    }
+}
+
+
+void socketio::iocp_thread()
+{
+    CIX_THREAD_SET_NAME_STATIC(GetCurrentThreadId(), "socketio[iocp]");
+    thread_tuning::apply(thread_tuning::role_socketio);
+    alloc_profile::set_thread_stage(alloc_profile::stage_socketio);
+
+    for (;;)
+    {
+        DWORD bytes = 0;
+        ULONG_PTR key = iocp_key_socket;
+        OVERLAPPED* ol = nullptr;
+
+        const BOOL res = GetQueuedCompletionStatus(
+            m_iocp, &bytes, &key, &ol, INFINITE);
+        const DWORD error = res ? 0 : GetLastError();
+
+        wakeups::count();
+
+        if (key == iocp_key_stop)
+        {
+            this->iocp_drain();
+            break;
+        }
+
+        if (!ol && key != iocp_key_rio)
+        {
+            // GetQueuedCompletionStatus() itself failed
+            LOGERROR("failed to dequeue sio completion packet (error {})", error);
+            assert(0);
+
+            // avoid consuming too much CPU in an infinite loop
+            if (WAIT_TIMEOUT != WaitForSingleObject(m_stop_event, 100))
+                break;
+
+            continue;
+        }
+
+        this->iocp_dispatch(key, ol, bytes, error);
+        this->notify_write_drained();
+    }
+}
+
+
+void socketio::iocp_dispatch(
+    ULONG_PTR key, OVERLAPPED* ol, DWORD bytes, DWORD error)
+{
+    // engine_rio, see socketio_rio.cpp
+    if (key == iocp_key_rio)
+    {
+        this->rio_on_notify();
+        return;
+    }
+
+    if (key != iocp_key_socket || !ol)
+        return;
+
+    // iocp_op_t is not standard-layout, the offset of *ol* is not guaranteed
+    auto& op = *CONTAINING_RECORD(ol, iocp_op_t, ol);
+
+    if (op.is_read && op.is_datagram)
+        this->iocp_on_recvfrom(op, bytes, error);
+    else if (op.is_read)
+        this->iocp_on_recv(op, bytes, error);
+    else
+        this->iocp_on_sent(op, bytes, error);
+}
+
+
+void socketio::iocp_close_registered()
+{
+    // called by join(), before iocp_thread() is stopped; closesocket()
+    // completes the pending operations of a socket, CancelIoEx() only makes
+    // it quicker where available
+
+    std::vector<SOCKET> sockets;
+
+    {
+        std::scoped_lock lock(m_mutex);
+
+        for (const auto& entry : m_iocp_sockets)
+            sockets.push_back(entry.first);
+
+        for (const auto& entry : m_rio_sockets)
+            sockets.push_back(entry.first);
+
+        for (const auto socket : sockets)
+            this->unregister_socket(socket);
+    }
+
+    const auto& api = detail::kernel32();
+
+    for (const auto socket : sockets)
+    {
+        if (api.cancel_io_ex)
+            api.cancel_io_ex(reinterpret_cast<HANDLE>(socket), nullptr);
+
+        closesocket(socket);
+    }
+
+    // the ones that were unregistered already may have operations pending
+    // too, they are not given their linger delay anymore
+    this->close_due_sockets(true);
+}
+
+
+void socketio::iocp_drain()
+{
+    // CAUTION: iocp_thread() only, once stopped by join(); the sockets are
+    // all closed by now so that every operation completes, with an error,
+    // the contexts get released as the completions are dispatched
+
+    const auto& api = detail::kernel32();
+    const auto started = cix::ticks_now();
+    std::array<detail::overlapped_entry_t, iocp_drain_batch> entries;
+
+    for (;;)
+    {
+        std::size_t pending;
+
+        {
+            std::scoped_lock lock(m_mutex);
+            pending = m_iocp_pending;
+        }
+
+        if (pending == 0)
+            break;
+
+        const auto now = cix::ticks_now();
+
+        if (cix::ticks_elapsed(started, now) >= iocp_drain_timeout)
+        {
+            // their contexts are leaked, better than released under the feet
+            // of the kernel
+            LOGERROR("{} sio operations still pending after {}ms", pending,
+                static_cast<std::uint64_t>(iocp_drain_timeout));
+            assert(0);
+            break;
+        }
+
+        const auto timeout = static_cast<DWORD>(
+            cix::ticks_to_go(started, started + iocp_drain_timeout, now));
+
+        if (api.dequeue_ex)
+        {
+            ULONG count = 0;
+
+            if (!api.dequeue_ex(
+                m_iocp, entries.data(), static_cast<ULONG>(entries.size()),
+                &count, timeout, FALSE))
+            {
+                continue;  // timeout
+            }
+
+            // the status of each operation is in its OVERLAPPED, but every
+            // socket is closed and unregistered anyway, the handlers only
+            // release their context
+            for (ULONG idx = 0; idx < count; ++idx)
+            {
+                const auto& entry = entries[idx];
+
+                this->iocp_dispatch(
+                    entry.lpCompletionKey, entry.lpOverlapped,
+                    entry.dwNumberOfBytesTransferred,
+                    entry.Internal != 0 ? ERROR_OPERATION_ABORTED : 0);
+            }
+        }
+        else
+        {
+            DWORD bytes = 0;
+            ULONG_PTR key = iocp_key_socket;
+            OVERLAPPED* ol = nullptr;
+
+            const BOOL res = GetQueuedCompletionStatus(
+                m_iocp, &bytes, &key, &ol, timeout);
+
+            if (!ol && key != iocp_key_rio)
+                continue;  // timeout
+
+            this->iocp_dispatch(key, ol, bytes, res ? 0 : GetLastError());
+        }
+    }
+}
+
+
+void socketio::iocp_register_socket(SOCKET socket, bool is_datagram)
+{
+    std::scoped_lock lock(m_mutex);
+
+    if (m_iocp_sockets.find(socket) != m_iocp_sockets.end())
+    {
+        assert(0);
+        return;
+    }
+
+    if (!CreateIoCompletionPort(
+        reinterpret_cast<HANDLE>(socket), m_iocp, iocp_key_socket, 0))
+    {
+        LOGERROR(
+            "failed to associate socket with sio completion port (error {})",
+            GetLastError());
+        assert(0);
+        return;
+    }
+
+    auto ctx = std::make_shared<iocp_socket_t>();
+
+    ctx->socket = socket;
+    ctx->registered = true;
+    ctx->read_op.is_read = true;
+    ctx->read_op.is_datagram = is_datagram;
+    ctx->write_op.is_read = false;
+    ctx->write_op.is_datagram = is_datagram;
+    ctx->read_buffer.resize(m_input_buffer_size);
+    ctx->write_queue.offset = 0;
+    ctx->write_queue.size = 0;
+    ctx->write_queue.full = false;
+    ctx->recv_paused = false;
+    ctx->recv_parked = false;
+    ctx->from_len = 0;
+
+    m_iocp_sockets.insert(std::make_pair(socket, ctx));
+
+    if (!this->iocp_post_recv(ctx))
+    {
+        // CAUTION: do not notify listener here since it is likely to be the
+        // caller of register_socket(); it will get an error upon send()
+        this->iocp_unregister_socket(socket);
+    }
+}
+
+
+bool socketio::iocp_send(
+    SOCKET socket, cix::shared_buffer&& packet, bool* out_full)
+{
+    std::scoped_lock lock(m_mutex);
+
+    auto it = m_iocp_sockets.find(socket);
+    if (it == m_iocp_sockets.end())
+        return false;
+
+    if (!m_iocp_thread)
+        return false;
+
+    if (packet.empty())
+        return true;
+
+    auto ctx = it->second;
+
+    if (!this->queue_packet(ctx->write_queue, std::move(packet), out_full))
+        return false;
+
+    // a WSASend() is already pending, iocp_on_sent() will take care of it
+    if (ctx->write_op.owner)
+        return true;
+
+    if (!this->iocp_post_send(ctx))
+    {
+        this->iocp_unregister_socket(socket);
+        return false;
+    }
+
+    return true;
+}
+
+
+void socketio::iocp_unregister_socket(SOCKET socket)
+{
+    std::scoped_lock lock(m_mutex);
+
+    auto it = m_iocp_sockets.find(socket);
+    if (it == m_iocp_sockets.end())
+        return;
+
+    // pending operations (if any) still own a reference to the context
+    // CAUTION: do not clear write_queue here since its front packets may be
+    // the buffers of a pending WSASend()
+    it->second->registered = false;
+    this->drop_queue(it->second->write_queue);
+    m_iocp_sockets.erase(it);
+}
+
+
+void socketio::iocp_set_recv_paused(SOCKET socket, bool paused)
+{
+    cix::lock_guard lock(m_mutex);
+
+    auto it = m_iocp_sockets.find(socket);
+    if (it == m_iocp_sockets.end())
+        return;
+
+    auto ctx = it->second;
+
+    ctx->recv_paused = paused;
+
+    // a pending WSARecv() cannot be cancelled selectively, it just won't get
+    // re-posted by iocp_on_recv() (see recv_parked)
+    if (paused || !ctx->recv_parked)
+        return;
+
+    ctx->recv_parked = false;
+
+    if (!this->iocp_post_recv(ctx))
+    {
+        this->iocp_unregister_socket(socket);
+        lock.unlock();
+        this->notify_disconnected(socket);
+    }
+}
+
+
+void socketio::iocp_on_recv(iocp_op_t& op, DWORD bytes, DWORD error)
+{
+    cix::lock_guard lock(m_mutex);
+
+    // release the reference owned by the completed operation
+    auto ctx = std::move(op.owner);
+    assert(ctx);
+    assert(m_iocp_pending > 0);
+    --m_iocp_pending;
+
+    if (!ctx || !ctx->registered)
+        return;
+
+    const auto socket = ctx->socket;
+
+    // error, or connection shutdown
+    if (error != 0 || bytes == 0)
+    {
+        this->iocp_unregister_socket(socket);
+        lock.unlock();
+        this->notify_disconnected(socket);
+        return;
+    }
+
+    assert(static_cast<std::size_t>(bytes) <= ctx->read_buffer.size());
+
+    auto packet = this->make_packet(
+        ctx->read_buffer.data(), static_cast<std::size_t>(bytes));
+
+    lock.unlock();
+    this->notify_recv(socket, std::move(packet));
+    lock.lock();
+
+    // socket may have been unregistered by listener
+    if (!ctx->registered)
+        return;
+
+    // reading paused, WSARecv() gets posted by iocp_set_recv_paused()
+    if (ctx->recv_paused)
+    {
+        ctx->recv_parked = true;
+        return;
+    }
+
+    if (!this->iocp_post_recv(ctx))
+    {
+        this->iocp_unregister_socket(socket);
+        lock.unlock();
+        this->notify_disconnected(socket);
+    }
+}
+
+
+void socketio::iocp_on_recvfrom(iocp_op_t& op, DWORD bytes, DWORD error)
+{
+    cix::lock_guard lock(m_mutex);
+
+    // release the reference owned by the completed operation
+    auto ctx = std::move(op.owner);
+    assert(ctx);
+    assert(m_iocp_pending > 0);
+    --m_iocp_pending;
+
+    if (!ctx || !ctx->registered)
+        return;
+
+    const auto socket = ctx->socket;
+    std::vector<datagram_t> datagrams;
+    bool healthy = true;
+
+    // same as recv_datagrams(), as reported by the completion port: the
+    // errors that only concern the datagram are not fatal; 0 bytes is an
+    // empty datagram, not a shutdown
+    if (error == 0)
+    {
+        datagram_t datagram;
+
+        assert(static_cast<std::size_t>(bytes) <= ctx->read_buffer.size());
+        assert(ctx->from_len <= static_cast<INT>(sizeof(ctx->from)));
+
+        std::memcpy(&datagram.from, &ctx->from, sizeof(ctx->from));
+        datagram.from_len = ctx->from_len;
+        datagram.data.assign(
+            ctx->read_buffer.data(), ctx->read_buffer.data() + bytes);
+
+        datagrams.push_back(std::move(datagram));
+        m_bytes_received.fetch_add(bytes, std::memory_order_relaxed);
+    }
+    else if (
+        error != ERROR_PORT_UNREACHABLE &&
+        error != ERROR_MORE_DATA &&
+        error != WSAECONNRESET &&
+        error != WSAEMSGSIZE)
+    {
+        healthy = false;
+    }
+
+    // no operation pending, so *read_buffer* is ours until the next one
+    lock.unlock();
+
+    if (healthy)
+        healthy = this->recv_datagrams(socket, ctx->read_buffer, datagrams);
+
+    if (!datagrams.empty())
+        this->notify_recvfrom(socket, std::move(datagrams));
+
+    lock.lock();
+
+    // socket may have been unregistered by listener
+    if (!ctx->registered)
+        return;
+
+    if (healthy && ctx->recv_paused)
+    {
+        ctx->recv_parked = true;
+        return;
+    }
+
+    if (!healthy || !this->iocp_post_recv(ctx))
+    {
+        this->iocp_unregister_socket(socket);
+        lock.unlock();
+        this->notify_disconnected(socket);
+    }
+}
+
+
+void socketio::iocp_on_sent(iocp_op_t& op, DWORD bytes, DWORD error)
+{
+    cix::lock_guard lock(m_mutex);
+
+    // release the reference owned by the completed operation
+    auto ctx = std::move(op.owner);
+    assert(ctx);
+    assert(m_iocp_pending > 0);
+    --m_iocp_pending;
+
+    if (!ctx || !ctx->registered)
+        return;
+
+    const auto socket = ctx->socket;
+
+    if (error != 0)
+    {
+        this->iocp_unregister_socket(socket);
+        lock.unlock();
+        this->notify_disconnected(socket);
+        return;
+    }
+
+    this->consume_sent(ctx->write_queue, static_cast<std::size_t>(bytes));
+    this->check_drained(socket, ctx->write_queue);
+    m_bytes_sent.fetch_add(bytes, std::memory_order_relaxed);
+
+    if (ctx->write_queue.packets.empty())
+        return;
+
+    if (!this->iocp_post_send(ctx))
+    {
+        this->iocp_unregister_socket(socket);
+        lock.unlock();
+        this->notify_disconnected(socket);
+    }
+}
+
+
+bool socketio::iocp_post_recv(std::shared_ptr<iocp_socket_t> ctx)
+{
+    // CAUTION: m_mutex must be locked by caller
+
+    auto& op = ctx->read_op;
+    DWORD flags = 0;
+
+    assert(!op.owner);
+
+    SecureZeroMemory(&op.ol, sizeof(op.ol));
+    op.wsabufs.resize(1);
+    op.wsabufs[0].buf = reinterpret_cast<char*>(ctx->read_buffer.data());
+    op.wsabufs[0].len = static_cast<ULONG>(std::min(
+        ctx->read_buffer.size(),
+        static_cast<std::size_t>(std::numeric_limits<ULONG>::max())));
+    op.owner = ctx;
+    ++m_iocp_pending;
+
+    int res;
+
+    if (op.is_datagram)
+    {
+        ctx->from_len = static_cast<INT>(sizeof(ctx->from));
+
+        res = WSARecvFrom(
+            ctx->socket, op.wsabufs.data(), 1, nullptr, &flags,
+            reinterpret_cast<struct sockaddr*>(&ctx->from), &ctx->from_len,
+            &op.ol, nullptr);
+    }
+    else
+    {
+        res = WSARecv(
+            ctx->socket, op.wsabufs.data(), 1, nullptr, &flags, &op.ol,
+            nullptr);
+    }
+
+    if (res == SOCKET_ERROR)
+    {
+        const auto wsaerror = WSAGetLastError();
+
+        // the WSARecvFrom() of a datagram socket may fail straight away with
+        // the error of a previous datagram, which is not fatal
+        if (op.is_datagram &&
+            (wsaerror == WSAECONNRESET || wsaerror == WSAEMSGSIZE))
+        {
+            op.owner.reset();
+            --m_iocp_pending;
+            return this->iocp_post_recv(ctx);
+        }
+
+        if (wsaerror != WSA_IO_PENDING)
+        {
+            LOGDEBUG("WSARecv() failed (error {})", wsaerror);
+            op.owner.reset();
+            --m_iocp_pending;
+            return false;
+        }
+    }
+
+    // a completion packet is queued even if WSARecv() completed immediately
+    return true;
+}
+
+
+bool socketio::iocp_post_send(std::shared_ptr<iocp_socket_t> ctx)
+{
+    // CAUTION: m_mutex must be locked by caller
+
+    auto& op = ctx->write_op;
+
+    assert(!op.owner);
+    assert(!ctx->write_queue.packets.empty());
+
+    // gather as many queued packets as allowed into a single WSASend()
+    if (!socketio::gather(ctx->write_queue, m_gather_max_size, op.wsabufs))
+    {
+        assert(0);
+        return false;
+    }
+
+    SecureZeroMemory(&op.ol, sizeof(op.ol));
+    op.owner = ctx;
+    ++m_iocp_pending;
+
+    if (SOCKET_ERROR == WSASend(
+        ctx->socket, op.wsabufs.data(), static_cast<DWORD>(op.wsabufs.size()),
+        nullptr, 0, &op.ol, nullptr))
+    {
+        const auto wsaerror = WSAGetLastError();
+
+        if (wsaerror != WSA_IO_PENDING)
+        {
+            LOGDEBUG("WSASend() failed (error {})", wsaerror);
+            op.owner.reset();
+            --m_iocp_pending;
+            return false;
+        }
+    }
+
+    // a completion packet is queued even if WSASend() completed immediately
+    return true;
+}
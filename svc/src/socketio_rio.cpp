@@ -0,0 +1,593 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "main.h"
+
+// socketio::engine_rio implementation
+//
+// * same model as engine_iocp (see socketio_iocp.cpp): every registered SOCKET
+//   gets a context (rio_socket_t) stored in m_rio_sockets, with at most one
+//   pending receive and one pending send, each holding a reference to its
+//   context while pending (rio_op_t::owner)
+// * the request queues of all the sockets complete to m_rio_cq, which posts a
+//   notification to m_iocp (key iocp_key_rio) once armed and not empty, so
+//   that iocp_thread() serves this engine too; rio_on_notify() drains the
+//   queue, then re-arms it
+// * the memory lent to the kernel is made of slots of registered chunks,
+//   allocated as needed and only deregistered by the destructor; a receive
+//   copies its slot into a packet (see make_packet()), a send copies the
+//   front of the write queue into its slot
+// * RIO functions are not thread-safe for a given queue, so they are all
+//   called with m_mutex locked
+// * listener is always notified with m_mutex unlocked, and a new receive is
+//   posted only once listener has been notified so that received data is
+//   delivered in order
+
+
+socketio::engine_t socketio::resolve_engine(engine_t engine)
+{
+    if (engine == engine_rio && !socketio::rio_load())
+    {
+        LOGINFO("registered I/O not available, falling back to IOCP");
+        return engine_iocp;
+    }
+
+    return engine;
+}
+
+
+const rio::function_table_t* socketio::rio_load()
+{
+    // CAUTION: WSAStartup() must have been called already since the table is
+    // loaded only once
+    static const auto table = []() -> std::unique_ptr<rio::function_table_t>
+    {
+        // the flag is unknown before Windows 8 (WSAEINVAL)
+        const auto sock = WSASocket(
+            AF_INET, SOCK_STREAM, IPPROTO_TCP, nullptr, 0,
+            WSA_FLAG_OVERLAPPED | rio::wsa_flag_registered_io);
+        if (sock == INVALID_SOCKET)
+            return nullptr;
+
+        auto out = std::make_unique<rio::function_table_t>();
+        GUID guid = rio::wsaid_multiple_rio;
+        DWORD bytes = 0;
+
+        SecureZeroMemory(out.get(), sizeof(rio::function_table_t));
+
+        const auto res = WSAIoctl(
+            sock, rio::sio_get_multiple_extension_function_pointer,
+            &guid, static_cast<DWORD>(sizeof(guid)),
+            out.get(), static_cast<DWORD>(sizeof(rio::function_table_t)),
+            &bytes, nullptr, nullptr);
+
+        closesocket(sock);
+
+        if (res == SOCKET_ERROR)
+            return nullptr;
+
+        return out;
+    }();
+
+    return table.get();
+}
+
+
+void socketio::rio_init()
+{
+    // CAUTION: called by the constructor, once m_iocp is created
+
+    m_rio = socketio::rio_load();
+    assert(m_rio);
+
+    rio::notification_completion_t notification{};
+
+    notification.type = rio::notification_iocp;
+    notification.iocp = m_iocp;
+    notification.completion_key = reinterpret_cast<PVOID>(iocp_key_rio);
+    notification.overlapped = &m_rio_ol;
+
+    m_rio_cq = m_rio->create_completion_queue(
+        rio_cq_initial_size, &notification);
+    if (!m_rio_cq)
+        CIX_THROW_WINERR("failed to create sio RIO completion queue");
+
+    m_rio_cq_size = rio_cq_initial_size;
+}
+
+
+void socketio::rio_release()
+{
+    // CAUTION: called by the destructor; the sockets that have been registered
+    // are expected to be closed by now, so that the kernel is done with the
+    // slots
+
+    if (m_rio_cq)
+    {
+        m_rio->close_completion_queue(m_rio_cq);
+        m_rio_cq = nullptr;
+    }
+
+    for (auto& chunk : m_rio_chunks)
+    {
+        m_rio->deregister_buffer(chunk.id);
+        VirtualFree(chunk.data, 0, MEM_RELEASE);
+    }
+
+    m_rio_chunks.clear();
+    m_rio_free_slots.clear();
+}
+
+
+void socketio::rio_register_socket(SOCKET socket)
+{
+    std::scoped_lock lock(m_mutex);
+
+    if (m_rio_sockets.find(socket) != m_rio_sockets.end())
+    {
+        assert(0);
+        return;
+    }
+
+    auto ctx = std::make_shared<rio_socket_t>();
+
+    ctx->socket = socket;
+    ctx->registered = true;
+    ctx->rq = this->rio_create_request_queue(socket, ctx.get());
+    ctx->read_op.is_read = true;
+    ctx->read_op.slot = rio_no_slot;
+    ctx->read_op.size = 0;
+    ctx->write_op.is_read = false;
+    ctx->write_op.slot = rio_no_slot;
+    ctx->write_op.size = 0;
+    ctx->write_queue.offset = 0;
+    ctx->write_queue.size = 0;
+    ctx->write_queue.full = false;
+    ctx->recv_paused = false;
+    ctx->recv_parked = false;
+
+    // CAUTION: do not notify listener here since it is likely to be the caller
+    // of register_socket(); it will get an error upon send()
+    if (!ctx->rq)
+        return;
+
+    m_rio_sockets.insert(std::make_pair(socket, ctx));
+
+    if (!this->rio_post_recv(ctx))
+        this->rio_unregister_socket(socket);
+}
+
+
+bool socketio::rio_send(
+    SOCKET socket, cix::shared_buffer&& packet, bool* out_full)
+{
+    std::scoped_lock lock(m_mutex);
+
+    auto it = m_rio_sockets.find(socket);
+    if (it == m_rio_sockets.end())
+        return false;
+
+    if (!m_iocp_thread)
+        return false;
+
+    if (packet.empty())
+        return true;
+
+    auto ctx = it->second;
+
+    if (!this->queue_packet(ctx->write_queue, std::move(packet), out_full))
+        return false;
+
+    // a send is already pending, rio_on_sent() will take care of it
+    if (ctx->write_op.owner)
+        return true;
+
+    if (!this->rio_post_send(ctx))
+    {
+        this->rio_unregister_socket(socket);
+        return false;
+    }
+
+    return true;
+}
+
+
+void socketio::rio_unregister_socket(SOCKET socket)
+{
+    std::scoped_lock lock(m_mutex);
+
+    auto it = m_rio_sockets.find(socket);
+    if (it == m_rio_sockets.end())
+        return;
+
+    // pending operations (if any) still own a reference to the context and
+    // their slot; the request queue itself goes away with the socket
+    it->second->registered = false;
+    this->drop_queue(it->second->write_queue);
+    m_rio_sockets.erase(it);
+}
+
+
+void socketio::rio_set_recv_paused(SOCKET socket, bool paused)
+{
+    cix::lock_guard lock(m_mutex);
+
+    auto it = m_rio_sockets.find(socket);
+    if (it == m_rio_sockets.end())
+        return;
+
+    auto ctx = it->second;
+
+    ctx->recv_paused = paused;
+
+    // same as iocp_set_recv_paused()
+    if (paused || !ctx->recv_parked)
+        return;
+
+    ctx->recv_parked = false;
+
+    if (!this->rio_post_recv(ctx))
+    {
+        this->rio_unregister_socket(socket);
+        lock.unlock();
+        this->notify_disconnected(socket);
+    }
+}
+
+
+void socketio::rio_on_notify()
+{
+    std::array<rio::result_t, rio_dequeue_max> results;
+
+    for (;;)
+    {
+        cix::lock_guard lock(m_mutex);
+
+        const auto count = m_rio->dequeue_completion(
+            m_rio_cq, results.data(), static_cast<ULONG>(results.size()));
+
+        if (count == rio::corrupt_cq)
+        {
+            LOGERROR("sio RIO completion queue is corrupt");
+            assert(0);
+            return;
+        }
+
+        lock.unlock();
+
+        for (ULONG idx = 0; idx < count; ++idx)
+        {
+            const auto& result = results[idx];
+            auto& op = *reinterpret_cast<rio_op_t*>(
+                static_cast<ULONG_PTR>(result.request_context));
+
+            if (op.is_read)
+                this->rio_on_recv(op, result.bytes_transferred, result.status);
+            else
+                this->rio_on_sent(op, result.bytes_transferred, result.status);
+        }
+
+        if (count < results.size())
+            break;
+    }
+
+    // a notification is posted right away if completions got queued in the
+    // meantime
+    std::scoped_lock lock(m_mutex);
+
+    const auto error = m_rio->notify(m_rio_cq);
+    if (error != 0)
+        LOGERROR("failed to arm sio RIO notification (error {})", error);
+}
+
+
+void socketio::rio_on_recv(rio_op_t& op, DWORD bytes, LONG status)
+{
+    cix::lock_guard lock(m_mutex);
+
+    // release the reference owned by the completed operation; its slot is
+    // released once copied
+    auto ctx = std::move(op.owner);
+    const auto slot = std::exchange(op.slot, rio_no_slot);
+    assert(ctx);
+    assert(m_iocp_pending > 0);
+    --m_iocp_pending;
+
+    if (!ctx || !ctx->registered)
+    {
+        this->rio_release_slot(slot);
+        return;
+    }
+
+    const auto socket = ctx->socket;
+
+    // error, or connection shutdown
+    if (status != 0 || bytes == 0)
+    {
+        this->rio_release_slot(slot);
+        this->rio_unregister_socket(socket);
+        lock.unlock();
+        this->notify_disconnected(socket);
+        return;
+    }
+
+    assert(static_cast<std::size_t>(bytes) <= m_rio_slot_size);
+
+    auto packet = this->make_packet(
+        this->rio_slot_data(slot), static_cast<std::size_t>(bytes));
+
+    this->rio_release_slot(slot);
+
+    lock.unlock();
+    this->notify_recv(socket, std::move(packet));
+    lock.lock();
+
+    // socket may have been unregistered by listener
+    if (!ctx->registered)
+        return;
+
+    // reading paused, receive gets posted by rio_set_recv_paused()
+    if (ctx->recv_paused)
+    {
+        ctx->recv_parked = true;
+        return;
+    }
+
+    if (!this->rio_post_recv(ctx))
+    {
+        this->rio_unregister_socket(socket);
+        lock.unlock();
+        this->notify_disconnected(socket);
+    }
+}
+
+
+void socketio::rio_on_sent(rio_op_t& op, DWORD bytes, LONG status)
+{
+    cix::lock_guard lock(m_mutex);
+
+    // release the reference owned by the completed operation, and its slot
+    // since its content is still in the write queue anyway
+    auto ctx = std::move(op.owner);
+    this->rio_release_slot(std::exchange(op.slot, rio_no_slot));
+    assert(ctx);
+    assert(m_iocp_pending > 0);
+    --m_iocp_pending;
+
+    if (!ctx || !ctx->registered)
+        return;
+
+    const auto socket = ctx->socket;
+
+    if (status != 0)
+    {
+        this->rio_unregister_socket(socket);
+        lock.unlock();
+        this->notify_disconnected(socket);
+        return;
+    }
+
+    assert(static_cast<std::size_t>(bytes) <= op.size);
+
+    this->consume_sent(ctx->write_queue, static_cast<std::size_t>(bytes));
+    this->check_drained(socket, ctx->write_queue);
+    m_bytes_sent.fetch_add(bytes, std::memory_order_relaxed);
+    op.size = 0;
+
+    if (ctx->write_queue.packets.empty())
+        return;
+
+    if (!this->rio_post_send(ctx))
+    {
+        this->rio_unregister_socket(socket);
+        lock.unlock();
+        this->notify_disconnected(socket);
+    }
+}
+
+
+bool socketio::rio_post_recv(std::shared_ptr<rio_socket_t> ctx)
+{
+    // CAUTION: m_mutex must be locked by caller
+
+    auto& op = ctx->read_op;
+
+    assert(!op.owner);
+    assert(op.slot == rio_no_slot);
+
+    op.slot = this->rio_acquire_slot();
+    if (op.slot == rio_no_slot)
+        return false;
+
+    auto buf = this->rio_slot_buf(op.slot, m_rio_slot_size);
+
+    op.owner = ctx;
+    ++m_iocp_pending;
+
+    if (!m_rio->receive(ctx->rq, &buf, 1, 0, &op))
+    {
+        LOGDEBUG("RIOReceive() failed (error {})", WSAGetLastError());
+        op.owner.reset();
+        --m_iocp_pending;
+        this->rio_release_slot(std::exchange(op.slot, rio_no_slot));
+        return false;
+    }
+
+    return true;
+}
+
+
+bool socketio::rio_post_send(std::shared_ptr<rio_socket_t> ctx)
+{
+    // CAUTION: m_mutex must be locked by caller
+
+    auto& op = ctx->write_op;
+    const auto& queue = ctx->write_queue;
+
+    assert(!op.owner);
+    assert(op.slot == rio_no_slot);
+    assert(!queue.packets.empty());
+
+    op.slot = this->rio_acquire_slot();
+    if (op.slot == rio_no_slot)
+        return false;
+
+    // copy as much of the queue as a slot and the gather limit allow, from
+    // where the last send stopped
+    const auto max_size = std::min(m_rio_slot_size, m_gather_max_size);
+    auto* out = this->rio_slot_data(op.slot);
+    std::size_t offset = queue.offset;
+
+    op.size = 0;
+
+    for (const auto& packet : queue.packets)
+    {
+        assert(offset < packet.size());
+
+        const auto chunk = std::min(packet.size() - offset, max_size - op.size);
+
+        std::memcpy(out + op.size, packet.data() + offset, chunk);
+        op.size += chunk;
+        offset = 0;
+
+        if (op.size >= max_size)
+            break;
+    }
+
+    auto buf = this->rio_slot_buf(op.slot, op.size);
+
+    op.owner = ctx;
+    ++m_iocp_pending;
+
+    if (!m_rio->send(ctx->rq, &buf, 1, 0, &op))
+    {
+        LOGDEBUG("RIOSend() failed (error {})", WSAGetLastError());
+        op.owner.reset();
+        --m_iocp_pending;
+        op.size = 0;
+        this->rio_release_slot(std::exchange(op.slot, rio_no_slot));
+        return false;
+    }
+
+    return true;
+}
+
+
+rio::rq_t socketio::rio_create_request_queue(
+    SOCKET socket, rio_socket_t* ctx)
+{
+    // CAUTION: m_mutex must be locked by caller
+
+    for (;;)
+    {
+        // one outstanding receive and one outstanding send, of one slot each
+        const auto rq = m_rio->create_request_queue(
+            socket, 1, 1, 1, 1, m_rio_cq, m_rio_cq, ctx);
+
+        if (rq)
+            return rq;
+
+        const auto wsaerror = WSAGetLastError();
+
+        // m_rio_cq has no room left for the completions of one more socket;
+        // the room of a socket is given back once it is closed
+        if (wsaerror != WSAENOBUFS || m_rio_cq_size >= rio::max_cq_size)
+        {
+            LOGERROR(
+                "failed to create sio RIO request queue (error {})", wsaerror);
+            return nullptr;
+        }
+
+        const auto new_size = std::min<DWORD>(
+            m_rio_cq_size * 2, rio::max_cq_size);
+
+        if (!m_rio->resize_completion_queue(m_rio_cq, new_size))
+        {
+            LOGERROR(
+                "failed to resize sio RIO completion queue to {} (error {})",
+                new_size, WSAGetLastError());
+            return nullptr;
+        }
+
+        m_rio_cq_size = new_size;
+    }
+}
+
+
+std::size_t socketio::rio_acquire_slot()
+{
+    // CAUTION: m_mutex must be locked by caller
+
+    if (m_rio_free_slots.empty())
+    {
+        const auto chunk_size = m_rio_slot_size * m_rio_slots_per_chunk;
+
+        // pages of its own since the whole chunk gets locked
+        auto data = static_cast<byte_t*>(VirtualAlloc(
+            nullptr, chunk_size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+
+        if (!data)
+        {
+            LOGERROR(
+                "failed to allocate sio RIO buffers (error {})",
+                GetLastError());
+            return rio_no_slot;
+        }
+
+        const auto id = m_rio->register_buffer(
+            reinterpret_cast<PCHAR>(data), static_cast<DWORD>(chunk_size));
+
+        if (!rio::is_valid(id))
+        {
+            LOGERROR(
+                "failed to register sio RIO buffers (error {})",
+                WSAGetLastError());
+            VirtualFree(data, 0, MEM_RELEASE);
+            return rio_no_slot;
+        }
+
+        const auto first = m_rio_chunks.size() * m_rio_slots_per_chunk;
+
+        m_rio_chunks.push_back({data, id});
+
+        // lowest slots on top, so they are handed out first
+        for (auto idx = m_rio_slots_per_chunk; idx-- > 0; )
+            m_rio_free_slots.push_back(first + idx);
+    }
+
+    // most recently released first, its memory is likely to be cached
+    const auto slot = m_rio_free_slots.back();
+    m_rio_free_slots.pop_back();
+
+    return slot;
+}
+
+
+void socketio::rio_release_slot(std::size_t slot)
+{
+    // CAUTION: m_mutex must be locked by caller
+
+    if (slot != rio_no_slot)
+        m_rio_free_slots.push_back(slot);
+}
+
+
+rio::buf_t socketio::rio_slot_buf(std::size_t slot, std::size_t size) const
+{
+    rio::buf_t buf;
+
+    buf.buffer_id = m_rio_chunks[slot / m_rio_slots_per_chunk].id;
+    buf.offset = static_cast<ULONG>(
+        (slot % m_rio_slots_per_chunk) * m_rio_slot_size);
+    buf.length = static_cast<ULONG>(size);
+
+    return buf;
+}
+
+
+socketio::byte_t* socketio::rio_slot_data(std::size_t slot) const
+{
+    return
+        m_rio_chunks[slot / m_rio_slots_per_chunk].data +
+        (slot % m_rio_slots_per_chunk) * m_rio_slot_size;
+}
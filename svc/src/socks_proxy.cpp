@@ -4,17 +4,103 @@
 #include "main.h"
 
 
-socks_proxy::socks_proxy()
-    : m_stop_event{nullptr}
-    , m_request_event{nullptr}
+socks_proxy::shard_t::shard_t()
+    : request_queue(socks_proxy::request_queue_capacity)
+    , overflowing{false}
 {
+}
+
+
+socks_proxy::connect_op_t::connect_op_t(
+        socks_proxy& proxy_, const connect_job_t& job_)
+    : proxy(proxy_)
+    , job(job_)
+    , opts{}
+    , next_addr{0}
+    , status{socks_reply_success}
+    , done{false}
+{
+    std::scoped_lock lock(proxy.m_connect_ops_mutex);
+
+    if (proxy.m_connect_ops++ == 0)
+        ResetEvent(proxy.m_connect_ops_idle);
+}
+
+
+socks_proxy::connect_op_t::~connect_op_t()
+{
+    // the datagrams of a UDP association are not admitted, see
+    // queue_connect_job()
+    if (job.datagram_offset == 0)
+        proxy.m_connect_limiter.release(job.group);
+
+    std::scoped_lock lock(proxy.m_connect_ops_mutex);
+
+    assert(proxy.m_connect_ops > 0);
+
+    if (--proxy.m_connect_ops == 0)
+        SetEvent(proxy.m_connect_ops_idle);
+}
+
+
+socks_proxy::socks_proxy(std::size_t workers_count)
+    : m_last_token{invalid_token}
+    , m_stop_event{nullptr}
+    , m_pool(
+        std::max<std::size_t>(
+            cix::win_thread::hardware_concurrency(),
+            socks_proxy::connect_threads_count),
+        "socks_proxy[pool]")
+    , m_connect_limiter(
+        [this](connect_limiter_t::task_t&& task) -> bool {
+            return m_pool.submit(std::move(task));
+        })
+    , m_connect_ops{0}
+    , m_connect_ops_idle{nullptr}
+    , m_socketio_engine{socketio::default_engine}
+    , m_input_buffer_size{socketio::input_buffer_default_size}
+    , m_recv_headroom{0}
+    , m_socket_opts{0, 0, WSA_FLAG_OVERLAPPED, false, 0, false}
+    , m_warm_pool(
+        [this](const std::string& host, unsigned short port) -> SOCKET {
+            return this->connect_warm(host, port);
+        },
+        [this](warm_pool_t::task_t&& task) -> bool {
+            return m_pool.submit(std::move(task));
+        })
+    , m_warm_per_target{0}
+    , m_warm_max_idle{warm_pool_t::default_max_idle}
+    , m_handshake_timeout{0}
+    , m_idle_timeout{0}
+    , m_session_timers(socks_proxy::session_timer_resolution)
+    , m_throttle_timers(socks_proxy::throttle_timer_resolution)
+    , m_throttle_event{nullptr}
+    , m_throttled{0}
+    , m_stats{}
+    , m_request_queue_latency()
+    , m_request_send_latency()
+    , m_connect_latency()
+{
+    if (workers_count == 0)
+        workers_count = cix::win_thread::hardware_concurrency();
+
+    workers_count = std::clamp<std::size_t>(
+        workers_count, 1, socks_proxy::max_workers_count);
+
     m_stop_event = CreateEvent(nullptr, TRUE, FALSE, nullptr);  // manual reset
     if (!m_stop_event)
         CIX_THROW_WINERR("failed to create (S) stop event");
 
-    m_request_event = CreateEvent(nullptr, TRUE, FALSE, nullptr);  // manual reset
-    if (!m_request_event)
-        CIX_THROW_WINERR("failed to create requests event");
+    m_throttle_event = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    if (!m_throttle_event)
+        CIX_THROW_WINERR("failed to create (S) throttle event");
+
+    m_connect_ops_idle = CreateEvent(nullptr, TRUE, TRUE, nullptr);
+    if (!m_connect_ops_idle)
+        CIX_THROW_WINERR("failed to create (S) connect event");
+
+    for (std::size_t idx = 0; idx < workers_count; ++idx)
+        m_shards.push_back(std::make_unique<shard_t>());
 }
 
 
@@ -22,7 +108,10 @@ socks_proxy::~socks_proxy()
 {
     this->stop();
 
-    CloseHandle(m_request_event);
+    m_shards.clear();
+
+    CloseHandle(m_connect_ops_idle);
+    CloseHandle(m_throttle_event);
     CloseHandle(m_stop_event);
 }
 
@@ -34,23 +123,243 @@ void socks_proxy::set_listener(std::shared_ptr<listener_t> listener)
 }
 
 
+void socks_proxy::set_buffer_pool(std::shared_ptr<cix::buffer_pool> pool)
+{
+    std::scoped_lock lock(m_mutex);
+
+    m_buffer_pool = pool;
+
+    if (m_socketio)
+        m_socketio->set_buffer_pool(pool);
+}
+
+
+void socks_proxy::set_input_buffer_size(std::size_t size)
+{
+    std::scoped_lock lock(m_mutex);
+
+    m_input_buffer_size = size;
+
+    if (m_socketio)
+        m_socketio->set_input_buffer_size(size);
+}
+
+
+void socks_proxy::set_recv_headroom(std::size_t size)
+{
+    std::scoped_lock lock(m_mutex);
+
+    m_recv_headroom = size;
+
+    if (m_socketio)
+        m_socketio->set_recv_headroom(size);
+}
+
+
+void socks_proxy::set_socket_buffer_sizes(int rcvbuf, int sndbuf)
+{
+    std::scoped_lock lock(m_mutex);
+
+    m_socket_opts.rcvbuf = std::max(rcvbuf, 0);
+    m_socket_opts.sndbuf = std::max(sndbuf, 0);
+}
+
+
+void socks_proxy::set_socket_tcp_options(
+    bool nodelay, cix::ticks_t keepalive, bool loopback_fast_path)
+{
+    std::scoped_lock lock(m_mutex);
+
+    m_socket_opts.nodelay = nodelay;
+    m_socket_opts.keepalive = static_cast<DWORD>(std::min<cix::ticks_t>(
+        keepalive, std::numeric_limits<DWORD>::max()));
+    m_socket_opts.loopback_fast_path = loopback_fast_path;
+}
+
+
+void socks_proxy::set_socketio_engine(socketio::engine_t engine)
+{
+    std::scoped_lock lock(m_mutex);
+
+    m_socketio_engine = engine;
+}
+
+
+void socks_proxy::set_mem_budget(std::shared_ptr<mem_budget_t> budget)
+{
+    std::scoped_lock lock(m_mutex);
+
+    m_mem_budget = budget;
+}
+
+
+void socks_proxy::set_session_timeouts(
+    cix::ticks_t handshake, cix::ticks_t idle)
+{
+    std::scoped_lock lock(m_mutex);
+
+    m_handshake_timeout = handshake;
+    m_idle_timeout = idle;
+}
+
+
+void socks_proxy::set_connect_failure_cache(
+    cix::ticks_t ttl, std::size_t max_entries)
+{
+    m_connect_failures.configure(ttl, max_entries);
+}
+
+
+void socks_proxy::set_dns_cache(
+    cix::ticks_t ttl, cix::ticks_t negative_ttl, std::size_t max_entries)
+{
+    m_dns_cache.configure(ttl, negative_ttl, max_entries);
+}
+
+
+void socks_proxy::set_resolve_timeout(DWORD timeout)
+{
+    m_resolver.configure(timeout);
+}
+
+
+void socks_proxy::set_connect_limits(
+    std::size_t max_inflight,
+    std::size_t max_group_inflight,
+    std::size_t max_queued)
+{
+    m_connect_limiter.configure(max_inflight, max_group_inflight, max_queued);
+}
+
+
+void socks_proxy::set_warm_pool(
+    std::vector<warm_pool_t::target_t>&& targets,
+    std::size_t per_target,
+    cix::ticks_t max_idle)
+{
+    std::scoped_lock lock(m_mutex);
+
+    m_warm_targets = std::move(targets);
+    m_warm_per_target = per_target;
+    m_warm_max_idle = max_idle;
+}
+
+
+void socks_proxy::set_rate_limits(
+    std::uint64_t group_rate, std::uint64_t session_rate)
+{
+    m_rate_limiter.configure(group_rate, session_rate);
+}
+
+
+void socks_proxy::set_session_trace(std::shared_ptr<session_trace_t> trace)
+{
+    std::scoped_lock lock(m_mutex);
+
+    m_session_trace = trace;
+}
+
+
 void socks_proxy::stop()
 {
     cix::lock_guard lock(m_mutex);
 
     SetEvent(m_stop_event);
 
-    if (m_thread)
+    for (auto& shard : m_shards)
+    {
+        if (!shard->thread)
+            continue;
+
+        if (shard->thread->joinable())
+        {
+            lock.unlock();
+            shard->thread->join();
+            lock.lock();
+        }
+
+        shard->thread.reset();
+    }
+
+    if (m_throttle_thread)
     {
-        if (m_thread->joinable())
+        if (m_throttle_thread->joinable())
         {
             lock.unlock();
-            m_thread->join();
+            m_throttle_thread->join();
             lock.lock();
         }
 
-        m_thread.reset();
+        m_throttle_thread.reset();
+    }
+
+    // jobs not started yet are dropped, the ones that got admitted first so
+    // that a job completing meanwhile does not admit any; same goes for the
+    // pooled sockets and the refills of m_warm_pool
+    lock.unlock();
+    m_connect_limiter.clear();
+    m_warm_pool.clear();
+    m_pool.stop();
+
+    // the connect jobs in progress, which m_pool does not run anymore, then
+    // fail once their resolves and their attempts are cancelled
+    {
+        auto sockio = m_socketio;
+
+        m_resolver.cancel_all();
+        if (sockio)
+            sockio->cancel_connects();
+
+        WaitForSingleObject(m_connect_ops_idle, INFINITE);
+    }
+
+    lock.lock();
+
+    m_session_timers.clear();
+    m_throttle_timers.clear();
+
+#ifdef APP_LOGGING_ENABLED
+    {
+        const auto dns_stats = m_dns_cache.stats();
+
+        LOGDEBUG(
+            "DNS cache: {} hits, {} negative hits, {} misses, {} entries",
+            dns_stats.hits, dns_stats.negative_hits, dns_stats.misses,
+            dns_stats.entries);
+
+        const auto resolver_stats = m_resolver.stats();
+
+        LOGDEBUG(
+            "resolver: {} queries, {} timeouts, {} cancelled, {} fallbacks",
+            resolver_stats.queries, resolver_stats.timeouts,
+            resolver_stats.cancelled, resolver_stats.fallbacks);
+
+        const auto failures_stats = m_connect_failures.stats();
+
+        LOGDEBUG(
+            "connect failure cache: {} hits, {} misses, {} inserts, "
+            "{} entries",
+            failures_stats.hits, failures_stats.misses, failures_stats.inserts,
+            failures_stats.entries);
+
+        const auto limiter_stats = m_connect_limiter.stats();
+
+        LOGDEBUG(
+            "connect limiter: {} admitted, {} waited (p99 {}us, max {}us), "
+            "{} rejected",
+            limiter_stats.admitted, limiter_stats.waited,
+            limiter_stats.queue_latency.p99, limiter_stats.queue_latency.max,
+            limiter_stats.rejected);
+
+        const auto warm_stats = m_warm_pool.stats();
+
+        LOGDEBUG(
+            "warm pool: {} hits, {} misses, {} connects ({} failed), "
+            "{} dropped",
+            warm_stats.hits, warm_stats.misses, warm_stats.connects,
+            warm_stats.connect_failures, warm_stats.dropped);
     }
+#endif
 
     if (m_socketio)
     {
@@ -68,7 +377,7 @@ void socks_proxy::launch()
     if (WAIT_TIMEOUT != WaitForSingleObject(m_stop_event, 0))
         return;
 
-    if (m_thread && m_thread->joinable())
+    if (m_shards.front()->thread && m_shards.front()->thread->joinable())
         return;
 
     this->stop();  // cleanup internal state
@@ -77,61 +386,168 @@ void socks_proxy::launch()
 
     if (!m_socketio)
     {
-        m_socketio = std::make_shared<socketio>();
+        m_socketio = std::make_shared<socketio>(m_socketio_engine);
+        m_socket_opts.flags = m_socketio->socket_flags();
         m_socketio->set_stop_event(m_stop_event);
         m_socketio->set_listener(this->shared_from_this());
+        m_socketio->set_buffer_pool(m_buffer_pool);
+        m_socketio->set_input_buffer_size(m_input_buffer_size);
+        m_socketio->set_recv_headroom(m_recv_headroom);
+
+        // a session above its budget has its send_to_target() fail, hence
+        // gets closed; unless flow control got its client side to wait
+        // before, see update_target_flow()
+        auto watermark = target_write_watermark;
+
+        if (m_mem_budget)
+        {
+            m_socketio->set_mem_budget(m_mem_budget);
+            m_socketio->set_write_queue_max_size(
+                m_mem_budget->session_budget());
+
+            if (m_mem_budget->session_budget() != 0)
+            {
+                watermark = std::min(
+                    watermark, m_mem_budget->session_budget() / 2);
+            }
+        }
+
+        m_socketio->set_write_queue_watermark(watermark);
+
         m_socketio->launch();
     }
 
-    m_thread = std::make_unique<std::thread>(
-        std::bind(&socks_proxy::maintenance_thread, this));
+    for (auto& shard : m_shards)
+    {
+        shard->thread = std::make_unique<std::thread>(
+            std::bind(
+                &socks_proxy::maintenance_thread, this, std::ref(*shard)));
+    }
+
+    // constant since launch(), see set_rate_limits()
+    if (m_rate_limiter.enabled())
+    {
+        m_throttle_thread = std::make_unique<std::thread>(
+            std::bind(&socks_proxy::throttle_thread, this));
+    }
+
+    m_pool.launch();
+
+    // once m_pool runs and m_socket_opts is final
+    if (!m_warm_targets.empty() && m_warm_per_target > 0)
+    {
+        auto targets = m_warm_targets;
+
+        m_warm_pool.configure(
+            std::move(targets), m_warm_per_target, m_warm_max_idle);
+    }
 }
 
 
-socks_proxy::token_t socks_proxy::create_client()
+socks_proxy::token_t socks_proxy::create_client(
+    bool udp_allowed, connect_limiter_t::group_t group)
 {
     const auto now = cix::ticks_now();
-    token_t client_token;
+
+    // tokens are never reused, so that they need neither a lookup nor the
+    // lock to be unique; 64 bits do not wrap in the lifetime of the service
+    const auto client_token =
+        m_last_token.fetch_add(1, std::memory_order_relaxed) + 1;
+    assert(client_token != invalid_token);
 
     std::scoped_lock lock(m_mutex);
 
     // paranoid check
-    if (m_clients.size() == m_clients.max_size() ||
-        m_clients.size() >= std::numeric_limits<token_t>::max() - 2)
-    {
+    if (m_clients.size() == m_clients.max_size())
         return invalid_token;
-    }
-
-    do
-    {
-        client_token = m_rand.next64();
-    }
-    while (
-        client_token == 0 ||
-        client_token == std::numeric_limits<token_t>::max() ||
-        m_clients.find(client_token) != m_clients.end());
 
     auto client = std::make_shared<client_t>();
     client->token = client_token;
     client->socks_state = socks_state_newclient;
     client->conn = INVALID_SOCKET;
+    client->udp_allowed = udp_allowed;
+    client->group = group;
+    client->udp_family = AF_UNSPEC;
     client->last_activity = now;
+    client->recv_paused = false;
+    client->throttled = false;
+    client->target_full = false;
+    client->backlog_size = 0;
 
     m_clients[client_token] = client;
+    ++m_stats.sessions_total;
+
+    m_rate_limiter.add_session(group, client_token);
+
+    if (m_session_trace)
+        m_session_trace->open(client_token);
+
+    ETWTRACE("SessionCreated", etw::keyword_session,
+        etw::u64(client_token, "SocksToken"));
+
+    cix::ticks_t deadline;
+    if (this->session_deadline(*client, deadline))
+        m_session_timers.schedule(client_token, deadline);
 
     return client_token;
 }
 
 
-void socks_proxy::push_request(token_t client_token, bytes_t&& packet)
+void socks_proxy::push_request(token_t client_token, cix::shared_buffer&& data)
 {
-    auto request = std::make_shared<socks_packet_t>(
-        client_token, std::move(packet));
+    ETWTRACE("SocksRequest", etw::keyword_socks,
+        etw::u64(client_token, "SocksToken"),
+        etw::u64(data.size(), "Bytes"));
 
-    std::scoped_lock lock(m_mutex);
+    auto request = std::make_unique<socks_request_t>(
+        client_token, std::move(data));
+
+    // CAUTION: constant since launch()
+    if (m_session_trace)
+    {
+        m_session_trace->record(
+            client_token, session_trace_t::stage_pipe_recv);
+    }
+
+    this->queue_request(std::move(request));
+}
+
+
+void socks_proxy::push_datagram(
+    token_t client_token, cix::shared_buffer&& datagram)
+{
+    // same path as the stream so that the worker of the client is the only
+    // one to see its state, see handle_datagram()
+    auto request = std::make_unique<socks_request_t>(
+        client_token, std::move(datagram), true);
+
+    this->queue_request(std::move(request));
+}
+
+
+void socks_proxy::queue_request(std::unique_ptr<socks_request_t> request)
+{
+    auto& shard = this->shard_of(request->client_token);
+
+    // CAUTION: m_mutex must not be acquired here, this is the hot path of the
+    // parsing thread of svc_worker, shared by all the channels
+    if (!shard.overflowing.load(std::memory_order_acquire) &&
+        shard.request_queue.try_push(std::move(request)))
+    {
+        shard.request_event.notify();
+        return;
+    }
+
+    // queue is full, or was and the worker did not take the overflow yet; the
+    // caller never waits for the worker, see handle_requests()
+    {
+        std::scoped_lock overflow_lock(shard.overflow_mutex);
+
+        shard.overflow.push_back(std::move(request));
+        shard.overflowing.store(true, std::memory_order_release);
+    }
 
-    m_pending_requests.push_back(request);
-    SetEvent(m_request_event);
+    shard.request_event.notify();
 }
 
 
@@ -150,373 +566,1564 @@ void socks_proxy::disconnect_client(token_t client_token)
 }
 
 
-void socks_proxy::maintenance_thread()
+void socks_proxy::disconnect_clients(const std::vector<token_t>& client_tokens)
 {
-    const HANDLE events[] = { m_stop_event, m_request_event };
+    // CAUTION: same as disconnect_client(), the listener is not notified
+    this->erase_clients(client_tokens.data(), client_tokens.size());
+}
 
-    CIX_THREAD_SET_NAME_STATIC(GetCurrentThreadId(), "socks_proxy");
 
-    for (;;)
-    {
-        const auto wait_res = WaitForMultipleObjects(
-            static_cast<DWORD>(cix::countof(events)),
-            reinterpret_cast<const HANDLE*>(&events),
-            FALSE, INFINITE);
+void socks_proxy::pause_client(token_t client_token, bool paused)
+{
+    std::scoped_lock lock(m_mutex);
 
-        if (wait_res == WAIT_OBJECT_0)  // stop event
-        {
-            break;
-        }
-        else if (wait_res == WAIT_OBJECT_0 + 1)  // request event
-        {
-            this->handle_requests();
-        }
-        else
-        {
-#ifdef _DEBUG
-            const auto error = GetLastError();
-            // LOGERROR(
-            //     "named pipe server worker failed to enter into waiting mode "
-            //     "(result {}; error {})",
-            //     wait_res, error);
-            CIX_UNVAR(error);
-            assert(0);
-#endif
-            break;
-        }
+    auto client_it = m_clients.find(client_token);
+    if (client_it == m_clients.end())
+        return;
+
+    auto& client = *client_it->second;
+
+    if (client.recv_paused == paused)
+        return;
+
+    client.recv_paused = paused;
+
+    // reads get resumed by throttle_thread() once its delay elapsed
+    if (client.throttled)
+        return;
+
+    // otherwise, applied by finish_connect()
+    if ((client.socks_state == socks_state_connected ||
+            client.socks_state == socks_state_udp) &&
+        client.conn != INVALID_SOCKET &&
+        m_socketio)
+    {
+        m_socketio->set_recv_paused(client.conn, paused);
     }
 }
 
 
-void socks_proxy::handle_requests()
+bool socks_proxy::expire_sessions()
 {
-    decltype(m_pending_requests) requests;
-    std::shared_ptr<client_t> client;
+    const auto now = cix::ticks_now();
+    std::vector<timer_wheel_t::key_t> fired;
+    std::vector<token_t> expired;
 
     cix::lock_guard lock(m_mutex);
 
-    m_pending_requests.swap(requests);
-    ResetEvent(m_request_event);
+    m_session_timers.advance(now, fired);
 
-    lock.unlock();
+    // a client may just have been active, in which case its timer is re-armed
+    // from its last activity
+    for (const auto client_token : fired)
+    {
+        const auto client_it = m_clients.find(client_token);
+        if (client_it == m_clients.end())
+            continue;
 
-    // IMPORTANT: m_mutex must be unlocked here
+        cix::ticks_t deadline;
+
+        if (!this->session_deadline(*client_it->second, deadline))
+            continue;  // timeout disabled for its current state
+
+        if (deadline > now)
+            m_session_timers.schedule(client_token, deadline);
+        else
+            expired.push_back(client_token);
+    }
+
+    const auto has_timers = !m_session_timers.empty();
+
+    lock.unlock();
 
-    while (!requests.empty())
+    for (const auto client_token : expired)
     {
-        auto& request = requests.front();
+        LOGTRACE("SOCKS client {:#x} timed out", client_token);
 
-        lock.lock();
+        this->request_close(client_token);
+        this->erase_client(client_token);
+    }
 
-        // find client object
-        auto client_it = m_clients.find(request->client_token);
-        client =
-            client_it != m_clients.end() ?
-            client_it->second :
-            nullptr;
-        client_it = m_clients.end();
+    return has_timers;
+}
 
-        lock.unlock();
 
-        if (client)
-        {
-            this->handle_socks_request(client, *request);
-            client.reset();
-        }
-
-        requests.pop_front();
-    }
+cix::ticks_t socks_proxy::next_session_due() const
+{
+    std::scoped_lock lock(m_mutex);
+    return m_session_timers.next_due();
 }
 
 
-void socks_proxy::handle_socks_request(
-    std::shared_ptr<client_t> client,
-    socks_packet_t& request)
+socks_proxy::stats_t socks_proxy::stats() const
 {
-    const auto client_token = client->token;
-    const auto socks_state = client->socks_state;
+    cix::lock_guard lock(m_mutex);
 
-    switch (socks_state)
+    auto stats = m_stats;
+    auto sockio = m_socketio;
+
+    stats.sessions = m_clients.size();
+    stats.rate_throttled = m_throttled;
+
+    lock.unlock();
+
+    // the vector of shards is never modified, see m_shards
+    stats.pending_requests = 0;
+    for (const auto& shard : m_shards)
     {
-        case socks_state_newclient:
-            if (!handle_socks_request__newclient(*client, request))
-                goto __close_and_erase_client;
-            break;
+        stats.pending_requests += shard->request_queue.size_approx();
 
-        case socks_state_needauth:
-            if (!handle_socks_request__needauth(*client, request))
-                goto __close_and_erase_client;
-            break;
+        std::scoped_lock overflow_lock(shard->overflow_mutex);
+        stats.pending_requests += shard->overflow.size();
+    }
 
-        case socks_state_needcmd:
-            if (!handle_socks_request__needcmd(*client, request))
-                goto __close_and_erase_client;
-            break;
+    // socketio has its own lock
+    if (sockio)
+        stats.socketio = sockio->stats();
 
-        case socks_state_connected:
-            if (!handle_socks_request__connected(*client, request))
-                goto __close_and_erase_client;
-            break;
+    stats.request_queue_latency = m_request_queue_latency.summary();
+    stats.request_send_latency = m_request_send_latency.summary();
+    stats.connect_latency = m_connect_latency.summary();
 
-        default:
-            LOGDEBUG("unhandled SOCKS state #{}", socks_state);
-            assert(0);
-            goto __close_and_erase_client;
+    // these have their own lock
+    stats.connects_fast_failed = m_connect_failures.stats().hits;
+    stats.rate_throttles = m_rate_limiter.stats().throttles;
+
+    {
+        const auto limiter_stats = m_connect_limiter.stats();
+
+        stats.connects_inflight = limiter_stats.inflight;
+        stats.connects_queued = limiter_stats.queued;
+        stats.connects_throttled = limiter_stats.rejected;
+        stats.connect_queue_latency = limiter_stats.queue_latency;
     }
 
-    return;
+    {
+        const auto warm_stats = m_warm_pool.stats();
 
-__close_and_erase_client:
-    this->request_close(client_token);
-    this->erase_client(client_token);
+        stats.connects_warm = warm_stats.hits;
+        stats.warm_sockets = warm_stats.idle;
+        stats.warm_misses = warm_stats.misses;
+    }
+
+    {
+        const auto dns_stats = m_dns_cache.stats();
+
+        stats.dns_hits = dns_stats.hits + dns_stats.negative_hits;
+        stats.dns_misses = dns_stats.misses;
+    }
+
+    stats.resolver = m_resolver.stats();
+
+    return stats;
 }
 
 
-bool socks_proxy::handle_socks_request__newclient(
-    client_t& client,
-    const socks_packet_t& request)
+void socks_proxy::maintenance_thread(shard_t& shard)
 {
-    const auto& packet = request.packet;
+    const HANDLE events[] = { m_stop_event, shard.request_event.handle() };
 
-    // favor no_auth method, support user+pass method
-    if (packet.size() >= 3 && packet[0] == 5)  // SOCKS5 only
+    CIX_THREAD_SET_NAME_STATIC(GetCurrentThreadId(), "socks_proxy");
+    thread_tuning::apply(thread_tuning::role_socks);
+    alloc_profile::set_thread_stage(alloc_profile::stage_socks);
+
+    for (;;)
     {
-        const auto nauth = packet[1];
-        bool user_pass_auth_supported = false;
+        const auto wait_res = WaitForMultipleObjects(
+            static_cast<DWORD>(cix::countof(events)),
+            reinterpret_cast<const HANDLE*>(&events),
+            FALSE, INFINITE);
 
-        for (std::uint8_t idx = 0; idx < nauth; ++idx)
-        {
-            const auto auth_type = packet[2 + idx];
+        wakeups::count();
 
-            if (auth_type == socks_noauth)  // no auth
-            {
-                client.socks_state = socks_state_needcmd;
-                this->send_to_client(client, bytes_t{5, socks_noauth});
-                return true;
-            }
-            else if (auth_type == socks_auth_userpass)  // user+pass auth
-            {
-                user_pass_auth_supported = true;
-            }
+        if (wait_res == WAIT_OBJECT_0)  // stop event
+        {
+            break;
         }
-
-        if (user_pass_auth_supported)
+        else if (wait_res == WAIT_OBJECT_0 + 1)  // request event
         {
-            // go for user+pass auth
-            client.socks_state = socks_state_needauth;
-            this->send_to_client(client, bytes_t{5, socks_auth_userpass});
-            return true;
+            this->handle_requests(shard);
+        }
+        else
+        {
+#ifdef _DEBUG
+            const auto error = GetLastError();
+            // LOGERROR(
+            //     "named pipe server worker failed to enter into waiting mode "
+            //     "(result {}; error {})",
+            //     wait_res, error);
+            CIX_UNVAR(error);
+            assert(0);
+#endif
+            break;
         }
     }
-
-    // no acceptable auth method found
-    this->send_to_client(client, bytes_t{5, socks_auth_no_supported_method});
-    return false;
 }
 
 
-bool socks_proxy::handle_socks_request__needauth(
-    client_t& client,
-    const socks_packet_t& request)
+void socks_proxy::throttle_thread()
 {
-    // CAUTION: this assumes socks_auth_userpass auth scheme
+    const HANDLE events[] = { m_stop_event, m_throttle_event };
+    std::vector<timer_wheel_t::key_t> fired;
 
-    const auto& packet = request.packet;
+    CIX_THREAD_SET_NAME_STATIC(GetCurrentThreadId(), "socks_proxy[throttle]");
+    thread_tuning::apply(thread_tuning::role_socks);
+    alloc_profile::set_thread_stage(alloc_profile::stage_socks);
 
-    if (packet[0] == 1 && packet[1] >= 1 && packet.size() >= 5)
+    for (;;)
     {
-        const auto user_len = static_cast<std::size_t>(packet[1]);
+        DWORD timeout = INFINITE;
 
-        if (packet.size() >= 4 + user_len)
         {
-            const auto pass_len =
-                static_cast<std::size_t>(packet[2 + user_len]);
+            std::scoped_lock lock(m_mutex);
 
-            if (packet.size() == 3 + user_len + pass_len)
-            {
-                const std::string_view user(
-                    reinterpret_cast<const char*>(packet.data()) + 2,
-                    user_len);
+            // ticks only while there are timers, see rate_limit_client()
+            if (!m_throttle_timers.empty())
+                timeout = throttle_timer_resolution;
+        }
 
-                const std::string_view pass(
-                    reinterpret_cast<const char*>(packet.data()) +
-                        2 + user_len + 1,
-                    pass_len);
+        const auto wait_res = WaitForMultipleObjects(
+            static_cast<DWORD>(cix::countof(events)), events, FALSE, timeout);
 
-                LOGDEBUG("SOCKS: user [{}], pass [{}]", user, pass);
-                CIX_UNVAR(user);
-                CIX_UNVAR(pass);
+        wakeups::count();
 
-                // TODO: check username and password if needed
+        if (wait_res != WAIT_OBJECT_0 + 1 && wait_res != WAIT_TIMEOUT)
+            break;  // stop event, or failure
 
-                // auth successful
-                client.socks_state = socks_state_needcmd;
-                this->send_to_client(client, bytes_t{1, 0});
-                return true;
-            }
+        fired.clear();
 
-            assert(0);
-        }
+        std::scoped_lock lock(m_mutex);
 
-        assert(0);
-    }
+        m_throttle_timers.advance(cix::ticks_now(), fired);
 
-    // auth failed, or auth packet is malformed
-    this->send_to_client(client, bytes_t{1, 1});
-    return false;
+        for (const auto client_token : fired)
+        {
+            const auto client_it = m_clients.find(client_token);
+            if (client_it == m_clients.end())
+                continue;
+
+            auto& client = *client_it->second;
+
+            if (!client.throttled)
+                continue;
+
+            client.throttled = false;
+            --m_throttled;
+
+            // otherwise, it stays paused by pause_client()
+            if (!client.recv_paused &&
+                client.conn != INVALID_SOCKET &&
+                m_socketio)
+            {
+                m_socketio->set_recv_paused(client.conn, false);
+            }
+        }
+    }
 }
 
 
-bool socks_proxy::handle_socks_request__needcmd(
-    client_t& client,
-    const socks_packet_t& request)
+void socks_proxy::rate_limit_client(client_t& client, std::size_t bytes)
 {
-    const auto& packet = request.packet;
-    socks_addr_t addr_type = socks_addr_ipv4;  // default to IPv4
-    std::size_t required_min_len = 10;  // 10 bytes for IPv4 CONNECT command
-    int addr_family = AF_INET;
-    char addr_str[256];
-    unsigned short remote_port;
-    struct addrinfo* ai_remote = nullptr;
-    socks_reply_code_t reply_code = socks_reply_general_failure;
+    // account *bytes* read from the target of *client*, and pause its reads
+    // for as long as it went over its rate, if it did
 
-    if (packet.size() < 10 ||
-        packet[0] != 5 ||  // SOCKS5 only
-        packet[2] != 0)    // reserved value, expected to be null in SOCKS5
+    const auto delay = m_rate_limiter.consume(client.token, bytes);
+    if (delay == 0)
+        return;
+
+    std::scoped_lock lock(m_mutex);
+
+    // erased in the meantime
+    if (m_clients.find(client.token) == m_clients.end())
+        return;
+
+    const bool was_empty = m_throttle_timers.empty();
+
+    // replaces the timer of a client throttled already, the latest delay
+    // accounts for all its reads so far
+    m_throttle_timers.schedule(client.token, cix::ticks_now() + delay);
+
+    if (!client.throttled)
     {
-        assert(0);
-        reply_code = socks_reply_general_failure;
-        goto __send_status;
+        client.throttled = true;
+        ++m_throttled;
+
+        // otherwise, paused already
+        if (!client.recv_paused &&
+            client.conn != INVALID_SOCKET &&
+            m_socketio)
+        {
+            m_socketio->set_recv_paused(client.conn, true);
+        }
     }
 
-    // only CONNECT method supported
-    if (packet[1] != socks_cmd_connect)
+    if (was_empty)
+        SetEvent(m_throttle_event);
+}
+
+
+bool socks_proxy::queue_connect_job(connect_job_t&& job)
+{
+    // dropped if the pool is being stopped, as is the client then
+
+    // the destination of a datagram only needs to be resolved, it does not
+    // go through admission
+    if (job.datagram_offset != 0)
     {
-        assert(0);
-        reply_code = socks_reply_command_not_supported;
-        goto __send_status;
+        m_pool.submit([this, job = std::move(job)]() {
+            this->handle_connect_job(job);
+        });
+
+        return true;
     }
 
-    addr_type = static_cast<socks_addr_t>(packet[3]);
-    addr_str[0] = '\0';
+    const auto group = job.group;
 
-    switch (addr_type)
-    {
-        case socks_addr_ipv6:
-            required_min_len = 22;
-            addr_family = AF_INET6;
-            // fall through
+    // released by connect_op_t
+    return m_connect_limiter.submit(group, [this, job = std::move(job)]() {
+        this->handle_connect_job(job);
+    });
+}
 
-        case socks_addr_ipv4:
-            if (packet.size() < required_min_len)
-            {
-                assert(0);
-                reply_code = socks_reply_general_failure;
-                goto __send_status;
-            }
 
-            if (!wincompat::inet_ntop(
-                addr_family, packet.data() + 4,
-                reinterpret_cast<char*>(&addr_str), sizeof(addr_str)))
-            {
-                assert(0);
-                reply_code = socks_reply_general_failure;
-                goto __send_status;
-            }
-            break;
+void socks_proxy::handle_connect_job(const connect_job_t& job)
+{
+    // CAUTION: this is called by a thread of m_pool, with m_mutex unlocked;
+    // it only starts the connect job, see connect_op_t
 
-        case socks_addr_name:
+    ALLOCSCOPE(stage_connect);
+
+    auto op = std::make_shared<connect_op_t>(*this, job);
+
+    {
+        std::scoped_lock lock(m_mutex);
+        op->opts = m_socket_opts;
+        op->sockio = m_socketio;
+
+        // a CONNECT may have waited for admission, client may be gone by now
+        if (job.datagram_offset == 0)
         {
-            const auto name_len = static_cast<std::size_t>(packet[4]);
+            const auto client_it = m_clients.find(job.client_token);
 
-            required_min_len = 7 + name_len;
-            if (required_min_len <= 7 || packet.size() < required_min_len)
+            if (client_it == m_clients.end() ||
+                client_it->second->socks_state != socks_state_connecting)
             {
-                assert(0);
-                reply_code = socks_reply_general_failure;
-                goto __send_status;
+                return;
             }
-
-            memcpy_s(&addr_str, sizeof(addr_str), packet.data() + 5, name_len);
-            addr_str[name_len] = '\0';
-            break;
         }
-
-        default:
-            assert(0);
-            reply_code = socks_reply_addr_type_not_supported;
-            goto __send_status;
     }
 
-    if (!addr_str[0])
+    // an allowlisted target may have a socket connected already, in which
+    // case there is nothing to resolve either
+    if (job.datagram_offset == 0)
     {
-        reply_code = socks_reply_general_failure;
-        goto __send_status;
-    }
-
-    remote_port =
-        static_cast<unsigned short>(packet[required_min_len - 2] << 8) |
-        static_cast<unsigned short>(packet[required_min_len - 1]);
+        const auto conn = m_warm_pool.acquire(job.host, job.port);
 
-    if (0 != socks_proxy::resolve(
-        reinterpret_cast<const char*>(&addr_str), remote_port, &ai_remote))
-    {
-        assert(0);
-        reply_code = socks_reply_general_failure;
-        goto __send_status;
+        if (conn != INVALID_SOCKET)
+        {
+            this->finish_connect(job, socks_reply_success, conn);
+            return;
+        }
     }
 
-    reply_code = socks_proxy::connect_socket(client, ai_remote);
-    if (reply_code != socks_reply_success)
-        goto __send_status;
+    // only domain names go through the cache, there is no point in caching
+    // literal addresses
+    this->resolve_target_async(
+        job.host, job.port, job.addr_type == socks_addr_name,
+        job.client_token,
+        [this, op](int gai_error, dns_cache::addrinfo_ptr&& ai_remote) {
+            this->on_target_resolved(op, gai_error, std::move(ai_remote));
+        });
+}
 
-    assert(reply_code == socks_reply_success);
 
-    {
-        std::scoped_lock lock(m_mutex);
+dns_cache::addrinfo_ptr socks_proxy::resolve_target(
+    const std::string& host, unsigned short port, bool use_cache,
+    token_t client_token, int& out_gai_error)
+{
+    dns_cache::addrinfo_ptr ai_remote;
 
-        if (m_socketio)
-            m_socketio->register_socket(client.conn);
+    if (use_cache &&
+        m_dns_cache.find(host, port, AF_UNSPEC, ai_remote, out_gai_error))
+    {
+        return ai_remote;
     }
 
-
-__send_status:
-    if (reply_code == socks_reply_success)
-        client.socks_state = socks_state_connected;
-
-    if (ai_remote)
+    // a literal address does not query anything, no need to go through
+    // m_resolver
+    if (!use_cache)
     {
-        freeaddrinfo(ai_remote);
-        ai_remote = nullptr;
+        struct addrinfo* ai = nullptr;
+
+        out_gai_error = socks_proxy::resolve(host.c_str(), port, &ai);
+        return dns_cache::make_addrinfo_ptr(out_gai_error == 0 ? ai : nullptr);
     }
 
-    if (reply_code != socks_reply_success && client.conn != INVALID_SOCKET)
+    // erase_clients() cancels the resolve() of a client with m_mutex locked,
+    // once the client is erased; warm targets belong to no client
+    resolver_t::is_cancelled_t is_cancelled;
+
+    if (client_token != invalid_token)
     {
-        closesocket(client.conn);
-        client.conn = INVALID_SOCKET;
+        is_cancelled =
+            [this, client_token]() -> bool
+            {
+                std::scoped_lock lock(m_mutex);
+                return m_clients.find(client_token) == m_clients.end();
+            };
     }
 
-    this->send_reply_to_client(client, reply_code, addr_type);
+    // timeouts and cancellations are not definitive, hence not cached
+    out_gai_error = m_resolver.resolve(
+        client_token, host, port, is_cancelled, ai_remote);
+    m_dns_cache.insert(host, port, AF_UNSPEC, ai_remote, out_gai_error);
 
-    return reply_code == socks_reply_success;
+    return ai_remote;
 }
 
 
-bool socks_proxy::handle_socks_request__connected(
+void socks_proxy::resolve_target_async(
+    const std::string& host, unsigned short port, bool use_cache,
+    token_t client_token, resolver_t::on_resolved_t&& on_resolved)
+{
+    // same as resolve_target(), except that *on_resolved* gets the outcome,
+    // possibly before this returns
+
+    dns_cache::addrinfo_ptr ai_remote;
+    int gai_error = 0;
+
+    // a cached name, or a literal address, which does not query anything
+    if (!use_cache ||
+        m_dns_cache.find(host, port, AF_UNSPEC, ai_remote, gai_error))
+    {
+        if (!use_cache)
+        {
+            ai_remote = this->resolve_target(
+                host, port, false, client_token, gai_error);
+        }
+
+        on_resolved(gai_error, std::move(ai_remote));
+        return;
+    }
+
+    // a blocking getaddrinfo() then, on a thread of m_pool
+    if (!resolver_t::available())
+    {
+        auto task = [this, host, port, client_token, on_resolved]() {
+            int task_error = 0;
+            auto task_addr = this->resolve_target(
+                host, port, true, client_token, task_error);
+
+            on_resolved(task_error, std::move(task_addr));
+        };
+
+        // dropped if the pool is being stopped
+        if (!m_pool.submit(std::move(task)))
+            on_resolved(resolver_t::error_cancelled, nullptr);
+
+        return;
+    }
+
+    // erase_clients() cancels the resolve of a client with m_mutex locked,
+    // once the client is erased
+    resolver_t::is_cancelled_t is_cancelled;
+
+    if (client_token != invalid_token)
+    {
+        is_cancelled =
+            [this, client_token]() -> bool
+            {
+                std::scoped_lock lock(m_mutex);
+                return m_clients.find(client_token) == m_clients.end();
+            };
+    }
+
+    m_resolver.resolve_async(
+        client_token, host, port, is_cancelled,
+        [this, host, port, on_resolved = std::move(on_resolved)](
+            int error, dns_cache::addrinfo_ptr&& addr)
+        {
+            // timeouts and cancellations are not definitive, hence not cached
+            m_dns_cache.insert(host, port, AF_UNSPEC, addr, error);
+
+            on_resolved(error, std::move(addr));
+        });
+}
+
+
+void socks_proxy::on_target_resolved(
+    const std::shared_ptr<connect_op_t>& op,
+    int gai_error, dns_cache::addrinfo_ptr&& ai_remote)
+{
+    // CAUTION: this is called by a thread of the system pool (see
+    // resolver_t::resolve_async()) or of m_pool, with m_mutex unlocked
+
+    ALLOCSCOPE(stage_connect);
+
+    const auto& job = op->job;
+    socks_reply_code_t reply_code = socks_reply_general_failure;
+    std::uint8_t cached_reply;
+
+    // a datagram of a UDP association, see handle_datagram()
+    if (job.datagram_offset != 0)
+    {
+        std::shared_ptr<client_t> client;
+
+        if (gai_error == 0 && ai_remote)
+        {
+            std::scoped_lock lock(m_mutex);
+
+            auto client_it = m_clients.find(job.client_token);
+            if (client_it != m_clients.end() &&
+                client_it->second->socks_state == socks_state_udp)
+            {
+                client = client_it->second;
+            }
+        }
+
+        if (client)
+        {
+            this->send_datagram(
+                *client, ai_remote.get(), job.datagram, job.datagram_offset);
+        }
+
+        return;
+    }
+
+    if (gai_error != 0 || !ai_remote)
+    {
+        LOGDEBUG(
+            "failed to resolve SOCKS target {} (error {})",
+            job.host, gai_error);
+        reply_code = socks_reply_host_unreachable;
+    }
+    else if (m_connect_failures.find(ai_remote.get(), cached_reply))
+    {
+        LOGDEBUG(
+            "SOCKS target {} failed to connect recently (reply {})",
+            job.host, cached_reply);
+        reply_code = static_cast<socks_reply_code_t>(cached_reply);
+    }
+    else if (op->sockio &&
+        WAIT_TIMEOUT == WaitForSingleObject(m_stop_event, 0))
+    {
+        bool finished;
+
+        {
+            std::scoped_lock op_lock(op->mutex);
+
+            op->ai_remote = std::move(ai_remote);
+            socks_proxy::interleave_families(op->ai_remote.get(), op->addrs);
+
+            finished = this->connect_next(op);
+            reply_code = op->status;
+        }
+
+        // on_connect_attempt() concludes otherwise
+        if (finished)
+            this->conclude_connect(*op, reply_code, INVALID_SOCKET);
+
+        return;
+    }
+
+    this->finish_connect(job, reply_code, INVALID_SOCKET);
+}
+
+
+bool socks_proxy::connect_next(const std::shared_ptr<connect_op_t>& op)
+{
+    // CAUTION: op->mutex must be locked by caller
+    // start the connect attempt to the next address that can be tried, if
+    // any; true if none is pending anymore, in which case op->status is the
+    // failure to conclude with
+
+    auto& ctx = *op;
+
+    while (ctx.next_addr < ctx.addrs.size())
+    {
+        const auto ai = ctx.addrs[ctx.next_addr++];
+        const bool is_last = ctx.next_addr >= ctx.addrs.size();
+        SOCKET conn;
+
+        auto res = socks_proxy::create_target_socket(ai, ctx.opts, conn);
+
+        if (res == socks_reply_success)
+        {
+            // its completion cannot get op->mutex before *attempts* has it
+            const auto wsaerror = ctx.sockio->connect(
+                conn, ai->ai_addr, static_cast<int>(ai->ai_addrlen),
+                socks_proxy::socket_connect_timeout,
+                is_last ? INFINITE : socks_proxy::connect_attempt_delay,
+                [this, op](SOCKET socket, int error) {
+                    this->on_connect_attempt(op, socket, error);
+                });
+
+            if (wsaerror == 0)
+            {
+                ctx.attempts.push_back(conn);
+                return false;
+            }
+
+            LOGDEBUG(
+                "failed to connect to SOCKS target (error {})", wsaerror);
+
+            closesocket(conn);
+            res = socks_proxy::wsaerror_to_socks_reply(wsaerror);
+        }
+
+        if (ctx.status == socks_reply_success)
+            ctx.status = res;
+    }
+
+    if (!ctx.attempts.empty())
+        return false;
+
+    ctx.done = true;
+
+    if (ctx.status == socks_reply_success)
+        ctx.status = socks_reply_general_failure;
+
+    return true;
+}
+
+
+void socks_proxy::on_connect_attempt(
+    const std::shared_ptr<connect_op_t>& op, SOCKET conn, int error)
+{
+    // CAUTION: this is called by a thread of the system pool, see
+    // socketio::connect()
+
+    std::vector<SOCKET> losers;
+    socks_reply_code_t reply_code = socks_reply_success;
+
+    {
+        std::scoped_lock op_lock(op->mutex);
+
+        // WSAEWOULDBLOCK: still pending, raced with the next address
+        if (error != WSAEWOULDBLOCK)
+        {
+            const auto it = std::find(
+                op->attempts.begin(), op->attempts.end(), conn);
+
+            if (it != op->attempts.end())
+                op->attempts.erase(it);
+        }
+
+        if (op->done)
+        {
+            // lost the race, closed by socketio already otherwise
+            if (error == 0)
+                closesocket(conn);
+
+            return;
+        }
+
+        if (error == 0)
+        {
+            // the first to succeed wins
+            op->done = true;
+            losers = std::move(op->attempts);
+            op->attempts.clear();
+        }
+        else
+        {
+            if (error != WSAEWOULDBLOCK)
+            {
+                LOGDEBUG(
+                    "failed to connect to SOCKS target (error {})", error);
+
+                if (op->status == socks_reply_success)
+                {
+                    op->status = (error == WSAETIMEDOUT) ?
+                        socks_reply_ttl_expired :
+                        socks_proxy::wsaerror_to_socks_reply(error);
+                }
+            }
+
+            if (!this->connect_next(op))
+                return;
+
+            reply_code = op->status;
+            conn = INVALID_SOCKET;
+        }
+    }
+
+    // their completions find *op* done
+    for (const auto loser : losers)
+        op->sockio->cancel_connect(loser);
+
+    this->conclude_connect(*op, reply_code, conn);
+}
+
+
+void socks_proxy::conclude_connect(
+    const connect_op_t& op, socks_reply_code_t reply_code, SOCKET conn)
+{
+    // every address has been tried, so that the failure is the one of the
+    // target if it is one of these
+    if (reply_code == socks_reply_net_unreachable ||
+        reply_code == socks_reply_host_unreachable ||
+        reply_code == socks_reply_conn_refused ||
+        reply_code == socks_reply_ttl_expired)
+    {
+        m_connect_failures.insert(op.ai_remote.get(), reply_code);
+    }
+
+    this->finish_connect(op.job, reply_code, conn);
+}
+
+
+SOCKET socks_proxy::connect_warm(const std::string& host, unsigned short port)
+{
+    // CAUTION: this is called by a thread of m_pool, with m_mutex unlocked
+
+    SOCKET conn = INVALID_SOCKET;
+    int gai_error = 0;
+    socket_opts_t opts;
+
+    {
+        std::scoped_lock lock(m_mutex);
+        opts = m_socket_opts;
+    }
+
+    // the targets are few and connected again and again, worth caching even
+    // if literal; not tied to any session
+    auto ai_remote = this->resolve_target(
+        host, port, true, invalid_token, gai_error);
+
+    if (gai_error != 0 || !ai_remote)
+    {
+        LOGDEBUG(
+            "failed to resolve warm target {} (error {})", host, gai_error);
+        return INVALID_SOCKET;
+    }
+
+    const auto reply_code = ai_remote->ai_next ?
+        socks_proxy::connect_socket_racing(conn, ai_remote.get(), opts) :
+        socks_proxy::connect_socket(conn, ai_remote.get(), opts);
+
+    if (reply_code != socks_reply_success)
+    {
+        if (conn != INVALID_SOCKET)
+            closesocket(conn);
+
+        LOGDEBUG(
+            "failed to connect warm target {}:{} (reply {})",
+            host, port, static_cast<int>(reply_code));
+        return INVALID_SOCKET;
+    }
+
+    return conn;
+}
+
+
+void socks_proxy::finish_connect(
+    const connect_job_t& job, socks_reply_code_t reply_code, SOCKET conn)
+{
+    const auto connect_time = cix::ticks_now() - job.queued;
+
+    ETWTRACE("SessionConnected", etw::keyword_session,
+        etw::u64(job.client_token, "SocksToken"),
+        etw::u8(static_cast<std::uint8_t>(reply_code), "ReplyCode"),
+        etw::u64(
+            cix::hrticks_elapsed(job.queued_stamp), "ConnectTimeUs"));
+
+    cix::lock_guard lock(m_mutex);
+    std::shared_ptr<client_t> client;
+
+    if (reply_code == socks_reply_success)
+    {
+        ++m_stats.connects_ok;
+        m_stats.connect_time_total += connect_time;
+        m_connect_latency.record(cix::hrticks_elapsed(job.queued_stamp));
+        m_stats.connect_time_max = std::max<std::uint64_t>(
+            m_stats.connect_time_max, connect_time);
+    }
+    else
+    {
+        ++m_stats.connects_failed;
+    }
+
+    auto client_it = m_clients.find(job.client_token);
+    if (client_it != m_clients.end() &&
+        client_it->second->socks_state == socks_state_connecting)
+    {
+        client = client_it->second;
+    }
+    client_it = m_clients.end();
+
+    lock.unlock();
+
+    // client vanished while we were connecting
+    if (!client)
+    {
+        if (conn != INVALID_SOCKET)
+            closesocket(conn);
+        return;
+    }
+
+    // CAUTION: reply is sent *before* conn gets registered so that no data
+    // from SOCKS target can be forwarded to client before the reply
+    this->send_reply_to_client(*client, reply_code, job.addr_type);
+
+    if (reply_code != socks_reply_success)
+    {
+        this->request_close(job.client_token);
+        this->erase_client(job.client_token);
+        return;
+    }
+
+    lock.lock();
+
+    // client may have been erased while reply was being sent
+    if (m_clients.find(job.client_token) == m_clients.end())
+    {
+        lock.unlock();
+        closesocket(conn);
+        return;
+    }
+
+    client->conn = conn;
+    client->socks_state = socks_state_connected;
+
+    // indexed before being registered, so that its first recv finds it
+    {
+        std::unique_lock sockets_lock(m_sockets_mutex);
+        m_sockets[conn] = client;
+    }
+
+    bool flushed = true;
+    bool full = false;
+
+    if (m_socketio)
+    {
+        m_socketio->register_socket(conn);
+
+        if (client->recv_paused)
+            m_socketio->set_recv_paused(conn, true);
+
+        // payload received in the meantime goes first; m_mutex is still held
+        // so that the worker cannot send a newer request before it, see
+        // handle_socks_request()
+        for (auto& packet : client->backlog)
+        {
+            bool packet_full = false;
+
+            if (!m_socketio->send(conn, std::move(packet), &packet_full))
+            {
+                flushed = false;
+                break;
+            }
+
+            full |= packet_full;
+        }
+    }
+
+    client->backlog.clear();
+    client->backlog_size = 0;
+
+    lock.unlock();
+
+    if (!flushed)
+    {
+        this->request_close(job.client_token);
+        this->erase_client(job.client_token);
+    }
+    else if (full)
+    {
+        this->update_target_flow(job.client_token);
+    }
+}
+
+
+void socks_proxy::handle_requests(shard_t& shard)
+{
+    std::unique_ptr<socks_request_t> request;
+    std::shared_ptr<client_t> client;
+
+    // acknowledge the notification before draining the queue so that a request
+    // pushed in the meantime signals us again
+    shard.request_event.rearm();
+
+    cix::lock_guard lock(m_mutex, std::defer_lock);
+    std::deque<std::unique_ptr<socks_request_t>> overflow;
+
+    // IMPORTANT: m_mutex must be unlocked here
+
+    // queue_request() does not push to the queue while it is overflowing, so
+    // the overflow is taken once the queue is empty, and goes before whatever
+    // gets queued after that
+    for (;;)
+    {
+        if (!overflow.empty())
+        {
+            request = std::move(overflow.front());
+            overflow.pop_front();
+        }
+        else if (!shard.request_queue.try_pop(request))
+        {
+            if (!shard.overflowing.load(std::memory_order_acquire))
+                break;
+
+            std::scoped_lock overflow_lock(shard.overflow_mutex);
+
+            overflow.swap(shard.overflow);
+            shard.overflowing.store(false, std::memory_order_release);
+            continue;
+        }
+
+        m_request_queue_latency.record(
+            cix::hrticks_elapsed(request->stamp));
+
+        if (m_session_trace && !request->is_datagram)
+        {
+            m_session_trace->record(
+                request->client_token, session_trace_t::stage_proxy_dequeue,
+                request->stamp);
+        }
+
+        lock.lock();
+
+        // find client object
+        // requests of an erased client are dropped here, erase_client() cannot
+        // reach them in the request queue
+        auto client_it = m_clients.find(request->client_token);
+        client =
+            client_it != m_clients.end() ?
+            client_it->second :
+            nullptr;
+        client_it = m_clients.end();
+
+        lock.unlock();
+
+        if (client)
+        {
+            this->handle_socks_request(client, *request);
+            client.reset();
+        }
+
+        request.reset();
+    }
+}
+
+
+void socks_proxy::handle_socks_request(
+    std::shared_ptr<client_t> client,
+    socks_request_t& request)
+{
+    const auto client_token = client->token;
+    socks_state_t socks_state;
+
+    client->last_activity.store(request.when, std::memory_order_relaxed);
+
+    // not part of the stream
+    if (request.is_datagram)
+    {
+        this->handle_datagram(*client, request);
+        return;
+    }
+
+    // a single pass unless the handshake completes with data left in
+    // *request*, in which case it goes through again, in its new state
+    while (!request.data.empty())
+    {
+        {
+            std::scoped_lock lock(m_mutex);
+
+            socks_state = client->socks_state;
+
+            // on hold until the connect job is done
+            if (socks_state == socks_state_connecting)
+            {
+                const auto size = request.data.size();
+
+                if (client->backlog_size + size > connect_backlog_capacity)
+                {
+                    LOGDEBUG(
+                        "SOCKS client {:#x} sent more than {} bytes before "
+                        "being connected",
+                        client_token,
+                        static_cast<std::size_t>(connect_backlog_capacity));
+                    goto __close_and_erase_client;
+                }
+
+                client->backlog.push_back(std::move(request.data));
+                client->backlog_size += size;
+                return;
+            }
+        }
+
+        switch (socks_state)
+        {
+            case socks_state_newclient:
+            case socks_state_needauth:
+            case socks_state_needcmd:
+                if (!this->handle_socks_handshake(*client, request))
+                    goto __close_and_erase_client;
+                break;
+
+            case socks_state_connected:
+                if (!handle_socks_request__connected(*client, request))
+                    goto __close_and_erase_client;
+                return;
+
+            // the TCP connection only holds the association (RFC1928 section
+            // 7), whatever comes through it is ignored
+            case socks_state_udp:
+                return;
+
+            default:
+                LOGDEBUG("unhandled SOCKS state #{}", socks_state);
+                assert(0);
+                goto __close_and_erase_client;
+        }
+    }
+
+    return;
+
+__close_and_erase_client:
+    this->request_close(client_token);
+    this->erase_client(client_token);
+}
+
+
+bool socks_proxy::handle_socks_handshake(
+    client_t& client,
+    socks_request_t& request)
+{
+    // CAUTION: client must be in one of the handshake states, which are only
+    // ever changed by the worker thread, so that client.socks_state can be
+    // read without locking until the CONNECT command is handled
+
+    auto& buffer = client.handshake_buffer;
+    std::size_t offset = 0;
+    bool connect_queued = false;
+
+    // handshake messages are tiny, copying them is not an issue
+    buffer.insert(buffer.end(), request.data.begin(), request.data.end());
+    request.data.clear();
+
+    while (!connect_queued)
+    {
+        const auto msg_size = socks_proxy::handshake_message_size(
+            client.socks_state, buffer.data() + offset, buffer.size() - offset);
+
+        // incomplete, wait for more
+        if (msg_size == 0 || msg_size > buffer.size() - offset)
+            break;
+
+        bool success;
+        bytes_t message;
+
+        // most of the time, a packet is exactly one message
+        if (offset == 0 && msg_size == buffer.size())
+        {
+            message.swap(buffer);
+        }
+        else
+        {
+            message.assign(
+                std::next(buffer.begin(), static_cast<std::ptrdiff_t>(offset)),
+                std::next(
+                    buffer.begin(),
+                    static_cast<std::ptrdiff_t>(offset + msg_size)));
+
+            offset += msg_size;
+        }
+
+        switch (client.socks_state)
+        {
+            case socks_state_newclient:
+                success = this->handle_socks_request__newclient(
+                    client, message);
+                break;
+
+            case socks_state_needauth:
+                success = this->handle_socks_request__needauth(
+                    client, message);
+                break;
+
+            case socks_state_needcmd:
+                success = this->handle_socks_request__needcmd(client, message);
+                connect_queued = true;
+                break;
+
+            default:
+                assert(0);
+                success = false;
+                break;
+        }
+
+        if (!success)
+        {
+            buffer.clear();
+            return false;
+        }
+    }
+
+    if (offset >= buffer.size())
+    {
+        buffer.clear();
+    }
+    else if (offset > 0)
+    {
+        buffer.erase(
+            buffer.begin(),
+            std::next(buffer.begin(), static_cast<std::ptrdiff_t>(offset)));
+    }
+
+    // whatever follows the CONNECT command is payload, to be handled by caller
+    // as a regular request
+    if (connect_queued && !buffer.empty())
+    {
+        request.data = cix::shared_buffer(std::move(buffer));
+        buffer.clear();  // moved-from state is unspecified
+    }
+
+    // an incomplete message is always smaller than the largest one (user+pass
+    // authentication), there is no need to cap the buffer
+    assert(buffer.size() < 3 + 255 + 255);
+
+    return true;
+}
+
+
+bool socks_proxy::handle_socks_request__newclient(
+    client_t& client,
+    const bytes_t& packet)
+{
+    // favor no_auth method, support user+pass method
+    if (packet.size() >= 3 && packet[0] == 5)  // SOCKS5 only
+    {
+        const auto nauth = packet[1];
+        bool user_pass_auth_supported = false;
+
+        for (std::uint8_t idx = 0; idx < nauth; ++idx)
+        {
+            const auto auth_type = packet[2 + idx];
+
+            if (auth_type == socks_noauth)  // no auth
+            {
+                client.socks_state = socks_state_needcmd;
+                this->send_to_client(client, bytes_t{5, socks_noauth});
+                return true;
+            }
+            else if (auth_type == socks_auth_userpass)  // user+pass auth
+            {
+                user_pass_auth_supported = true;
+            }
+        }
+
+        if (user_pass_auth_supported)
+        {
+            // go for user+pass auth
+            client.socks_state = socks_state_needauth;
+            this->send_to_client(client, bytes_t{5, socks_auth_userpass});
+            return true;
+        }
+    }
+
+    // no acceptable auth method found
+    this->send_to_client(client, bytes_t{5, socks_auth_no_supported_method});
+    return false;
+}
+
+
+bool socks_proxy::handle_socks_request__needauth(
+    client_t& client,
+    const bytes_t& packet)
+{
+    // CAUTION: this assumes socks_auth_userpass auth scheme
+
+    if (packet.size() >= 5 && packet[0] == 1 && packet[1] >= 1)
+    {
+        const auto user_len = static_cast<std::size_t>(packet[1]);
+
+        if (packet.size() >= 4 + user_len)
+        {
+            const auto pass_len =
+                static_cast<std::size_t>(packet[2 + user_len]);
+
+            if (packet.size() == 3 + user_len + pass_len)
+            {
+                const std::string_view user(
+                    reinterpret_cast<const char*>(packet.data()) + 2,
+                    user_len);
+
+                const std::string_view pass(
+                    reinterpret_cast<const char*>(packet.data()) +
+                        2 + user_len + 1,
+                    pass_len);
+
+                LOGDEBUG("SOCKS: user [{}], pass [{}]", user, pass);
+                CIX_UNVAR(user);
+                CIX_UNVAR(pass);
+
+                // TODO: check username and password if needed
+
+                // auth successful
+                client.socks_state = socks_state_needcmd;
+                this->send_to_client(client, bytes_t{1, 0});
+                return true;
+            }
+
+            assert(0);
+        }
+
+        assert(0);
+    }
+
+    // auth failed, or auth packet is malformed
+    this->send_to_client(client, bytes_t{1, 1});
+    return false;
+}
+
+
+bool socks_proxy::handle_socks_request__needcmd(
+    client_t& client,
+    const bytes_t& packet)
+{
+    socks_addr_t addr_type = socks_addr_ipv4;  // default to IPv4
+    std::size_t required_min_len = 10;  // 10 bytes for IPv4 CONNECT command
+    int addr_family = AF_INET;
+    char addr_str[256];
+    unsigned short remote_port;
+    socks_reply_code_t reply_code = socks_reply_general_failure;
+
+    if (packet.size() < 4 ||
+        packet[0] != 5 ||  // SOCKS5 only
+        packet[2] != 0)    // reserved value, expected to be null in SOCKS5
+    {
+        assert(0);
+        reply_code = socks_reply_general_failure;
+        goto __send_status;
+    }
+
+    // only CONNECT method supported, and UDP ASSOCIATE if allowed
+    if (packet[1] != socks_cmd_connect &&
+        (packet[1] != socks_cmd_udp_associate || !client.udp_allowed))
+    {
+        assert(0);
+        reply_code = socks_reply_command_not_supported;
+        goto __send_status;
+    }
+
+    addr_type = static_cast<socks_addr_t>(packet[3]);
+    addr_str[0] = '\0';
+
+    switch (addr_type)
+    {
+        case socks_addr_ipv6:
+            required_min_len = 22;
+            addr_family = AF_INET6;
+            // fall through
+
+        case socks_addr_ipv4:
+            if (packet.size() < required_min_len)
+            {
+                assert(0);
+                reply_code = socks_reply_general_failure;
+                goto __send_status;
+            }
+
+            if (!wincompat::inet_ntop(
+                addr_family, packet.data() + 4,
+                reinterpret_cast<char*>(&addr_str), sizeof(addr_str)))
+            {
+                assert(0);
+                reply_code = socks_reply_general_failure;
+                goto __send_status;
+            }
+            break;
+
+        case socks_addr_name:
+        {
+            if (packet.size() < 5)
+            {
+                assert(0);
+                reply_code = socks_reply_general_failure;
+                goto __send_status;
+            }
+
+            const auto name_len = static_cast<std::size_t>(packet[4]);
+
+            required_min_len = 7 + name_len;
+            if (required_min_len <= 7 || packet.size() < required_min_len)
+            {
+                assert(0);
+                reply_code = socks_reply_general_failure;
+                goto __send_status;
+            }
+
+            memcpy_s(&addr_str, sizeof(addr_str), packet.data() + 5, name_len);
+            addr_str[name_len] = '\0';
+            break;
+        }
+
+        default:
+            assert(0);
+            reply_code = socks_reply_addr_type_not_supported;
+            goto __send_status;
+    }
+
+    if (!addr_str[0])
+    {
+        reply_code = socks_reply_general_failure;
+        goto __send_status;
+    }
+
+    remote_port =
+        static_cast<unsigned short>(packet[required_min_len - 2] << 8) |
+        static_cast<unsigned short>(packet[required_min_len - 1]);
+
+    // shed load rather than take on more; CAUTION: m_mem_budget is constant
+    // since launch()
+    if (m_mem_budget && m_mem_budget->is_exhausted())
+    {
+        LOGDEBUG(
+            "SOCKS client {:#x} CONNECT refused, memory budget exhausted",
+            client.token);
+
+        {
+            std::scoped_lock lock(m_mutex);
+            ++m_stats.connects_refused;
+        }
+
+        reply_code = socks_reply_general_failure;
+        goto __send_status;
+    }
+
+    // DST.ADDR and DST.PORT are the ones the SOCKS client expects to send its
+    // datagrams from, which is a concern of the listener, see
+    // on_socks_udp_associated()
+    if (packet[1] == socks_cmd_udp_associate)
+    {
+        reply_code = this->handle_socks_request__udp_associate(client);
+        if (reply_code != socks_reply_success)
+            goto __send_status;
+
+        return true;
+    }
+
+    // resolve and connect asynchronously; the reply is sent by
+    // finish_connect()
+    {
+        connect_job_t job;
+
+        job.client_token = client.token;
+        job.group = client.group;
+        job.addr_type = addr_type;
+        job.host = reinterpret_cast<const char*>(&addr_str);
+        job.port = remote_port;
+        job.queued = cix::ticks_now();
+        job.queued_stamp = cix::hrticks_now();
+        job.datagram_offset = 0;
+
+        std::scoped_lock lock(m_mutex);
+
+        client.socks_state = socks_state_connecting;
+        if (this->queue_connect_job(std::move(job)))
+            return true;
+
+        client.socks_state = socks_state_needcmd;
+    }
+
+    LOGDEBUG(
+        "SOCKS client {:#x} CONNECT refused, too many connects queued",
+        client.token);
+
+    reply_code = socks_reply_general_failure;
+
+__send_status:
+    assert(reply_code != socks_reply_success);
+    this->send_reply_to_client(client, reply_code, addr_type);
+    return false;
+}
+
+
+bool socks_proxy::handle_socks_request__connected(
     const client_t& client,
-    socks_packet_t& request)
+    socks_request_t& request)
 {
     if (client.conn == INVALID_SOCKET)
         return false;
 
-    return this->send_to_target(client, std::move(request.packet));
+    const auto stamp = request.stamp;
+
+    if (!this->send_to_target(client, std::move(request.data)))
+        return false;
+
+    m_request_send_latency.record(cix::hrticks_elapsed(stamp));
+
+    if (m_session_trace)
+    {
+        m_session_trace->record(
+            client.token, session_trace_t::stage_target_send);
+    }
+
+    return true;
+}
+
+
+socks_proxy::socks_reply_code_t
+socks_proxy::handle_socks_request__udp_associate(client_t& client)
+{
+    int family = AF_UNSPEC;
+    const auto conn = socks_proxy::create_udp_socket(family);
+
+    if (conn == INVALID_SOCKET)
+        return socks_reply_general_failure;
+
+    cix::lock_guard lock(m_mutex);
+
+    auto client_it = m_clients.find(client.token);
+    if (client_it == m_clients.end())
+    {
+        lock.unlock();
+        closesocket(conn);
+        return socks_reply_general_failure;
+    }
+
+    client.conn = conn;
+    client.udp_family = family;
+    client.socks_state = socks_state_udp;
+
+    // indexed before being registered, so that its first datagram finds it
+    {
+        std::unique_lock sockets_lock(m_sockets_mutex);
+        m_sockets[conn] = client_it->second;
+    }
+
+    if (m_socketio)
+    {
+        m_socketio->register_datagram_socket(conn);
+
+        if (client.recv_paused)
+            m_socketio->set_recv_paused(conn, true);
+    }
+
+    // the timer armed by create_client() switches to the idle timeout once
+    // it fires, see expire_sessions()
+    auto listener = m_listener.lock();
+    lock.unlock();
+
+    LOGTRACE("SOCKS client {:#x} UDP associated", client.token);
+
+    if (listener)
+    {
+        listener->on_socks_udp_associated(
+            this->shared_from_this(), client.token);
+    }
+
+    return socks_reply_success;
+}
+
+
+void socks_proxy::handle_datagram(
+    const client_t& client, socks_request_t& request)
+{
+    // CAUTION: called by the worker of the client, which is the one that
+    // changes its state to socks_state_udp, so no need to lock m_mutex
+
+    // sent before the association, or malformed, or fragmented (FRAG != 0,
+    // which RFC1928 allows not to support): dropped silently, as a datagram
+    // would get lost
+    const auto* data = request.data.data();
+    const auto size = request.data.size();
+    const auto header_size = socks_proxy::udp_header_size(data, size);
+
+    if (client.socks_state != socks_state_udp ||
+        header_size == 0 ||
+        data[2] != 0)
+    {
+        return;
+    }
+
+    const auto port = static_cast<unsigned short>(
+        (data[header_size - 2] << 8) | data[header_size - 1]);
+
+    switch (data[3])
+    {
+        case socks_addr_ipv4:
+        {
+            struct sockaddr_in to{};
+
+            to.sin_family = AF_INET;
+            to.sin_port = htons(port);
+            std::memcpy(&to.sin_addr, data + 4, sizeof(to.sin_addr));
+
+            this->send_datagram(
+                client, reinterpret_cast<const struct sockaddr*>(&to),
+                static_cast<int>(sizeof(to)), request.data, header_size);
+            break;
+        }
+
+        case socks_addr_ipv6:
+        {
+            struct sockaddr_in6 to{};
+
+            to.sin6_family = AF_INET6;
+            to.sin6_port = htons(port);
+            std::memcpy(&to.sin6_addr, data + 4, sizeof(to.sin6_addr));
+
+            this->send_datagram(
+                client, reinterpret_cast<const struct sockaddr*>(&to),
+                static_cast<int>(sizeof(to)), request.data, header_size);
+            break;
+        }
+
+        case socks_addr_name:
+        {
+            const std::string host(
+                reinterpret_cast<const char*>(data + 5),
+                static_cast<std::size_t>(data[4]));
+
+            dns_cache::addrinfo_ptr ai_remote;
+            int gai_error = 0;
+
+            if (m_dns_cache.find(host, port, AF_UNSPEC, ai_remote, gai_error))
+            {
+                if (gai_error == 0 && ai_remote)
+                {
+                    this->send_datagram(
+                        client, ai_remote.get(), request.data, header_size);
+                }
+
+                break;
+            }
+
+            // not cached yet: a connect job resolves it, so that this
+            // worker does not wait
+            connect_job_t job;
+
+            job.client_token = client.token;
+            job.group = client.group;
+            job.addr_type = socks_addr_name;
+            job.host = host;
+            job.port = port;
+            job.queued = cix::ticks_now();
+            job.queued_stamp = cix::hrticks_now();
+            job.datagram = std::move(request.data);
+            job.datagram_offset = header_size;
+
+            std::scoped_lock lock(m_mutex);
+
+            this->queue_connect_job(std::move(job));
+            break;
+        }
+
+        default:
+            assert(0);  // see udp_header_size()
+            break;
+    }
 }
 
 
-void socks_proxy::send_to_client(client_t& client, bytes_t&& packet)
+void socks_proxy::send_to_client(
+    client_t& client, bytes_t&& packet, std::size_t headroom)
 {
     auto response = std::make_shared<socks_packet_t>(
-        client.token, std::move(packet));
+        client.token, std::move(packet), headroom);
 
     this->notify_response(response);
 }
@@ -555,76 +2162,240 @@ void socks_proxy::send_reply_to_client(
             // TODO / FIXME: fill-in ADDR and PORT fields
             break;
 
-        case socks_addr_ipv6:
-            packet.resize(22);
-            // TODO / FIXME: fill-in ADDR and PORT fields
-            break;
+        case socks_addr_ipv6:
+            packet.resize(22);
+            // TODO / FIXME: fill-in ADDR and PORT fields
+            break;
+    }
+#else
+    CIX_UNVAR(addr_type);
+
+    bytes_t packet{
+        5, code, 0, socks_addr_ipv4,
+        0, 0, 0, 0,  // ipv4 addr
+        0, 0};       // port
+#endif
+
+    auto response = std::make_shared<socks_packet_t>(
+        client.token, std::move(packet));
+
+    this->notify_response(response);
+}
+
+
+bool socks_proxy::send_to_target(
+    const client_t& client, cix::shared_buffer&& data)
+{
+    // socketio has its own lock, do not serialize workers on m_mutex
+    cix::lock_guard lock(m_mutex);
+    auto sockio = m_socketio;
+    lock.unlock();
+
+    if (!sockio)
+        return false;
+
+    ETWTRACE("TargetSend", etw::keyword_target,
+        etw::u64(client.token, "SocksToken"),
+        etw::u64(data.size(), "Bytes"));
+
+    bool full = false;
+
+    if (!sockio->send(client.conn, std::move(data), &full))
+        return false;
+
+    if (full)
+        this->update_target_flow(client.token);
+
+    return true;
+}
+
+
+void socks_proxy::send_datagram(
+    const client_t& client, const struct addrinfo* ai,
+    const cix::shared_buffer& datagram, std::size_t data_offset)
+{
+    // first address of a family the UDP socket can reach
+    for (; ai; ai = ai->ai_next)
+    {
+        if (ai->ai_family == AF_INET ||
+            (ai->ai_family == AF_INET6 && client.udp_family == AF_INET6))
+        {
+            this->send_datagram(
+                client, ai->ai_addr, static_cast<int>(ai->ai_addrlen),
+                datagram, data_offset);
+            return;
+        }
+    }
+}
+
+
+void socks_proxy::send_datagram(
+    const client_t& client, const struct sockaddr* to, int to_len,
+    const cix::shared_buffer& datagram, std::size_t data_offset)
+{
+    struct sockaddr_in6 mapped{};
+
+    assert(data_offset <= datagram.size());
+
+    if (to->sa_family == AF_INET6 && client.udp_family != AF_INET6)
+        return;
+
+    // the UDP socket is dual-stack, where IPv4 addresses are mapped ones
+    if (to->sa_family == AF_INET && client.udp_family == AF_INET6)
+    {
+        const auto& to4 = *reinterpret_cast<const struct sockaddr_in*>(to);
+
+        mapped.sin6_family = AF_INET6;
+        mapped.sin6_port = to4.sin_port;
+        mapped.sin6_addr.s6_addr[10] = 0xff;
+        mapped.sin6_addr.s6_addr[11] = 0xff;
+        std::memcpy(&mapped.sin6_addr.s6_addr[12], &to4.sin_addr, 4);
+
+        to = reinterpret_cast<const struct sockaddr*>(&mapped);
+        to_len = static_cast<int>(sizeof(mapped));
     }
-#else
-    CIX_UNVAR(addr_type);
 
-    bytes_t packet{
-        5, code, 0, socks_addr_ipv4,
-        0, 0, 0, 0,  // ipv4 addr
-        0, 0};       // port
-#endif
+    // socketio has its own lock, see send_to_target()
+    cix::lock_guard lock(m_mutex);
+    auto sockio = m_socketio;
+    lock.unlock();
 
-    auto response = std::make_shared<socks_packet_t>(
-        client.token, std::move(packet));
+    if (!sockio)
+        return;
 
-    this->notify_response(response);
+    ETWTRACE("TargetSend", etw::keyword_target,
+        etw::u64(client.token, "SocksToken"),
+        etw::u64(datagram.size() - data_offset, "Bytes"));
+
+    sockio->send_to(
+        client.conn, to, to_len, datagram.data() + data_offset,
+        datagram.size() - data_offset);
 }
 
 
-bool socks_proxy::send_to_target(const client_t& client, bytes_t&& packet)
+bool socks_proxy::session_deadline(
+    const client_t& client, cix::ticks_t& out_deadline) const
 {
-    std::scoped_lock lock(m_mutex);
+    // CAUTION: m_mutex must be locked by caller
 
-    if (m_socketio)
-        return m_socketio->send(client.conn, std::move(packet));
+    cix::ticks_t timeout;
 
-    return false;
+    switch (client.socks_state)
+    {
+        case socks_state_connected:
+        case socks_state_udp:
+            timeout = m_idle_timeout;
+            break;
+
+        // connecting: bounded by the connect timeout already, still it is
+        // checked again with the handshake timeout once done
+        default:
+            timeout = m_handshake_timeout ? m_handshake_timeout : m_idle_timeout;
+            break;
+    }
+
+    if (timeout == 0)
+        return false;
+
+    out_deadline = client.last_activity.load(std::memory_order_relaxed);
+    out_deadline += timeout;
+
+    // a connect may take longer than the handshake timeout
+    if (client.socks_state == socks_state_connecting)
+        out_deadline = std::max(out_deadline, cix::ticks_now() + timeout);
+
+    return true;
 }
 
 
 std::shared_ptr<socks_proxy::client_t>
 socks_proxy::find_client(SOCKET socket) const
 {
-    std::scoped_lock lock(m_mutex);
+    // m_mutex not needed, see m_sockets
+    std::shared_lock sockets_lock(m_sockets_mutex);
 
-    auto it = std::find_if(
-        m_clients.cbegin(), m_clients.cend(),
-        [&socket](const auto& pair) { return pair.second->conn == socket; });
+    auto it = m_sockets.find(socket);
 
-    return it == m_clients.end() ? nullptr : it->second;
+    return it == m_sockets.end() ? nullptr : it->second;
 }
 
 
 void socks_proxy::erase_client(token_t client_token)
 {
-    std::scoped_lock lock(m_mutex);
+    this->erase_clients(&client_token, 1);
+}
+
+
+void socks_proxy::erase_clients(const token_t* client_tokens, std::size_t count)
+{
+    std::vector<SOCKET> conns;
 
-    auto client_it = m_clients.find(client_token);
-    if (client_it != m_clients.end())
     {
-        const auto conn = client_it->second->conn;
+        std::scoped_lock lock(m_mutex);
 
-        if (conn != INVALID_SOCKET)
+        for (std::size_t idx = 0; idx < count; ++idx)
         {
-            this->disconnect_socket(conn);
-            client_it->second->conn = INVALID_SOCKET;
+            const auto client_it = m_clients.find(client_tokens[idx]);
+
+            if (client_it != m_clients.end() &&
+                client_it->second->conn != INVALID_SOCKET)
+            {
+                conns.push_back(client_it->second->conn);
+            }
+        }
+
+        // unindexed first, the handle value may get reused as soon as the
+        // socket is closed
+        if (!conns.empty())
+        {
+            std::unique_lock sockets_lock(m_sockets_mutex);
+
+            for (const auto conn : conns)
+                m_sockets.erase(conn);
         }
 
-        m_clients.erase(client_it);
+        for (std::size_t idx = 0; idx < count; ++idx)
+        {
+            const auto client_token = client_tokens[idx];
+            const auto client_it = m_clients.find(client_token);
+
+            if (client_it == m_clients.end())
+                continue;
+
+            client_it->second->conn = INVALID_SOCKET;
+
+            if (client_it->second->throttled)
+            {
+                --m_throttled;
+                m_throttle_timers.cancel(client_token);
+            }
+
+            m_clients.erase(client_it);
+            m_session_timers.cancel(client_token);
+            m_rate_limiter.remove_session(client_token);
+
+            if (m_session_trace)
+                m_session_trace->close(client_token);
+
+            // a connect job may be waiting for its name still
+            m_resolver.cancel(client_token);
+
+            ETWTRACE("SessionClosed", etw::keyword_session,
+                etw::u64(client_token, "SocksToken"));
+        }
     }
 
-    for (auto request_it = m_pending_requests.begin();
-        request_it != m_pending_requests.end(); )
+    // no lock held, see disconnect_socket(); these sockets cannot be found by
+    // the socketio callbacks anymore
+    if (conns.size() == 1)
     {
-        if ((*request_it)->client_token == client_token)
-            request_it = m_pending_requests.erase(request_it);
-        else
-            ++request_it;
+        this->disconnect_socket(conns.front());
+    }
+    else if (!conns.empty())
+    {
+        auto sockio = m_socketio;
+        if (sockio)
+            sockio->disconnect_and_unregister_sockets(conns);
     }
 }
 
@@ -642,6 +2413,14 @@ void socks_proxy::disconnect_socket(SOCKET socket)
 }
 
 
+socks_proxy::shard_t& socks_proxy::shard_of(token_t client_token) const
+{
+    // tokens are sequential, so that consecutive clients land on different
+    // shards
+    return *m_shards[static_cast<std::size_t>(client_token % m_shards.size())];
+}
+
+
 void socks_proxy::notify_response(std::shared_ptr<socks_packet_t> response)
 {
     cix::lock_guard lock(m_mutex);
@@ -667,51 +2446,405 @@ void socks_proxy::request_close(token_t client_token)
 }
 
 
-void socks_proxy::notify_disconnected(token_t client_token)
+void socks_proxy::notify_disconnected(token_t client_token)
+{
+    cix::lock_guard lock(m_mutex);
+    auto listener = m_listener.lock();
+    lock.unlock();
+
+    if (listener)
+    {
+        listener->on_socks_disconnected(
+            this->shared_from_this(), client_token);
+    }
+}
+
+
+void socks_proxy::update_target_flow(token_t client_token)
+{
+    // the state is read again rather than passed by the caller, so that
+    // whichever thread comes last notifies the current one
+    std::scoped_lock flow_lock(m_flow_mutex);
+    cix::lock_guard lock(m_mutex);
+
+    auto client_it = m_clients.find(client_token);
+    if (client_it == m_clients.end())
+        return;
+
+    auto client = client_it->second;
+    auto sockio = m_socketio;
+    auto listener = m_listener.lock();
+
+    if (client->socks_state != socks_state_connected || !sockio || !listener)
+        return;
+
+    const auto conn = client->conn;
+
+    lock.unlock();
+
+    const bool full = sockio->is_write_queue_full(conn);
+
+    lock.lock();
+
+    if (client->target_full == full)
+        return;
+
+    client->target_full = full;
+
+    lock.unlock();
+
+    listener->on_socks_target_flow(
+        this->shared_from_this(), client_token, full);
+}
+
+
+void socks_proxy::on_socketio_recv(SOCKET socket, bytes_t&& packet)
+{
+    auto client = this->find_client(socket);
+
+    if (client)
+    {
+        // CAUTION: set before launch(), constant since then
+        const auto headroom = m_recv_headroom;
+
+        assert(packet.size() > headroom);
+
+        ETWTRACE("TargetRecv", etw::keyword_target,
+            etw::u64(client->token, "SocksToken"),
+            etw::u64(packet.size() - headroom, "Bytes"));
+
+        capture::record(
+            capture::kind_target_recv, client->token,
+            packet.data() + headroom, packet.size() - headroom);
+
+        client->last_activity.store(
+            cix::ticks_now(), std::memory_order_relaxed);
+
+        const auto size = packet.size() - headroom;
+
+        // CAUTION: constant since launch()
+        if (m_session_trace)
+        {
+            m_session_trace->record(
+                client->token, session_trace_t::stage_target_recv);
+        }
+
+        this->send_to_client(*client, std::move(packet), headroom);
+
+        // CAUTION: constant since launch()
+        if (m_rate_limiter.enabled())
+            this->rate_limit_client(*client, size);
+    }
+    else
+    {
+        // proxy client disconnected, so disconnect from SOCKS target
+        this->disconnect_socket(socket);
+    }
+}
+
+
+void socks_proxy::on_socketio_recvfrom(
+    SOCKET socket, std::vector<socketio::datagram_t>&& datagrams)
+{
+    auto client = this->find_client(socket);
+
+    if (!client)
+    {
+        // proxy client disconnected, same as on_socketio_recv()
+        this->disconnect_socket(socket);
+        return;
+    }
+
+    std::vector<bytes_t> packets;
+
+    packets.reserve(datagrams.size());
+
+    for (const auto& datagram : datagrams)
+    {
+        const std::uint8_t* addr = nullptr;
+        const void* port = nullptr;
+        std::size_t addr_size = 0;
+        socks_addr_t addr_type = socks_addr_ipv4;
+
+        if (datagram.from.ss_family == AF_INET)
+        {
+            const auto& from = reinterpret_cast<const struct sockaddr_in&>(
+                datagram.from);
+
+            addr = reinterpret_cast<const std::uint8_t*>(&from.sin_addr);
+            addr_size = 4;
+            port = &from.sin_port;
+        }
+        else if (datagram.from.ss_family == AF_INET6)
+        {
+            const auto& from = reinterpret_cast<const struct sockaddr_in6&>(
+                datagram.from);
+
+            addr = from.sin6_addr.s6_addr;
+            addr_size = 16;
+            addr_type = socks_addr_ipv6;
+            port = &from.sin6_port;
+
+            // from an IPv4 source, see send_datagram()
+            if (IN6_IS_ADDR_V4MAPPED(&from.sin6_addr))
+            {
+                addr += 12;
+                addr_size = 4;
+                addr_type = socks_addr_ipv4;
+            }
+        }
+        else
+        {
+            assert(0);
+            continue;
+        }
+
+        // RSV FRAG ATYP DST.ADDR DST.PORT DATA; the port is in network order
+        // already
+        bytes_t packet(4 + addr_size + 2 + datagram.data.size());
+
+        packet[0] = 0;
+        packet[1] = 0;
+        packet[2] = 0;
+        packet[3] = addr_type;
+        std::memcpy(packet.data() + 4, addr, addr_size);
+        std::memcpy(packet.data() + 4 + addr_size, port, 2);
+
+        if (!datagram.data.empty())
+        {
+            std::memcpy(
+                packet.data() + 4 + addr_size + 2,
+                datagram.data.data(),
+                datagram.data.size());
+        }
+
+        // does not fit in a record of op_socks_udp
+        if (packet.size() > std::numeric_limits<std::uint16_t>::max())
+            continue;
+
+        packets.push_back(std::move(packet));
+    }
+
+    if (packets.empty())
+        return;
+
+    ETWTRACE("TargetRecv", etw::keyword_target,
+        etw::u64(client->token, "SocksToken"),
+        etw::u64(packets.size(), "Datagrams"));
+
+    client->last_activity.store(cix::ticks_now(), std::memory_order_relaxed);
+
+    cix::lock_guard lock(m_mutex);
+    auto listener = m_listener.lock();
+    lock.unlock();
+
+    std::size_t size = 0;
+
+    if (m_rate_limiter.enabled())
+    {
+        for (const auto& packet : packets)
+            size += packet.size();
+    }
+
+    if (listener)
+    {
+        listener->on_socks_udp(
+            this->shared_from_this(), client->token, std::move(packets));
+    }
+
+    if (size > 0)
+        this->rate_limit_client(*client, size);
+}
+
+
+void socks_proxy::on_socketio_disconnected(SOCKET socket)
+{
+    auto client = this->find_client(socket);
+
+    if (client)
+    {
+        const auto client_token = client->token;
+        client.reset();
+        this->disconnect_client(client_token);
+    }
+}
+
+
+void socks_proxy::on_socketio_write_drained(SOCKET socket)
+{
+    auto client = this->find_client(socket);
+
+    if (client)
+    {
+        const auto client_token = client->token;
+        client.reset();
+        this->update_target_flow(client_token);
+    }
+}
+
+
+std::size_t socks_proxy::handshake_message_size(
+    socks_state_t socks_state, const std::uint8_t* data, std::size_t size)
+{
+    // return the size of the message at the front of *data*, or 0 if more
+    // data is needed to tell; values that a handler would reject anyway make
+    // the whole of *data* a message so that the error is reported without
+    // waiting
+    // IMPORTANT: no check beyond what is needed to get the size, this is up to
+    // the handlers
+
+    switch (socks_state)
+    {
+        case socks_state_newclient:  // VER NMETHODS METHODS
+            if (size < 1)
+                return 0;
+            if (data[0] != 5)
+                return size;
+            if (size < 2)
+                return 0;
+            return 2 + static_cast<std::size_t>(data[1]);
+
+        case socks_state_needauth:  // VER ULEN UNAME PLEN PASSWD
+        {
+            if (size < 1)
+                return 0;
+            if (data[0] != 1)
+                return size;
+            if (size < 2)
+                return 0;
+
+            const auto user_len = static_cast<std::size_t>(data[1]);
+
+            if (size < 3 + user_len)
+                return 0;
+
+            return 3 + user_len + static_cast<std::size_t>(data[2 + user_len]);
+        }
+
+        case socks_state_needcmd:  // VER CMD RSV ATYP DST.ADDR DST.PORT
+            if (size < 1)
+                return 0;
+            if (data[0] != 5)
+                return size;
+            if (size < 4)
+                return 0;
+
+            switch (data[3])
+            {
+                case socks_addr_ipv4:
+                    return 4 + 4 + 2;
+
+                case socks_addr_ipv6:
+                    return 4 + 16 + 2;
+
+                case socks_addr_name:
+                    if (size < 5)
+                        return 0;
+                    return 5 + static_cast<std::size_t>(data[4]) + 2;
+
+                default:
+                    return size;
+            }
+
+        default:
+            assert(0);
+            return size;
+    }
+}
+
+
+std::size_t socks_proxy::udp_header_size(
+    const std::uint8_t* data, std::size_t size)
+{
+    // size of the SOCKS5 UDP request header at the front of *data* (RSV FRAG
+    // ATYP DST.ADDR DST.PORT), or 0 if it is malformed or incomplete
+
+    std::size_t header_size;
+
+    if (size < 4 || data[0] != 0 || data[1] != 0)
+        return 0;
+
+    switch (data[3])
+    {
+        case socks_addr_ipv4:
+            header_size = 4 + 4 + 2;
+            break;
+
+        case socks_addr_ipv6:
+            header_size = 4 + 16 + 2;
+            break;
+
+        case socks_addr_name:
+            if (size < 5 || data[4] == 0)
+                return 0;
+            header_size = 5 + static_cast<std::size_t>(data[4]) + 2;
+            break;
+
+        default:
+            return 0;
+    }
+
+    return size < header_size ? 0 : header_size;
+}
+
+
+SOCKET socks_proxy::create_udp_socket(int& out_family)
 {
-    cix::lock_guard lock(m_mutex);
-    auto listener = m_listener.lock();
-    lock.unlock();
+    // dual-stack where possible so that a single socket reaches targets of
+    // both families; IPv4 only where there is no IPv6 stack
+    // * datagram sockets never need more than WSA_FLAG_OVERLAPPED, see
+    //   socketio::socket_flags()
+    static constexpr int families[] = { AF_INET6, AF_INET };
 
-    if (listener)
+    for (const auto family : families)
     {
-        listener->on_socks_disconnected(
-            this->shared_from_this(), client_token);
-    }
-}
+        const auto conn = WSASocket(
+            family, SOCK_DGRAM, IPPROTO_UDP, nullptr, 0, WSA_FLAG_OVERLAPPED);
 
+        if (conn == INVALID_SOCKET)
+            continue;
 
-void socks_proxy::on_socketio_recv(SOCKET socket, bytes_t&& packet)
-{
-    cix::lock_guard lock(m_mutex);
-    auto client = this->find_client(socket);
-    lock.unlock();
+        struct sockaddr_storage local{};
+        int local_len;
 
-    if (client)
-    {
-        this->send_to_client(*client, std::move(packet));
-    }
-    else
-    {
-        // proxy client disconnected, so disconnect from SOCKS target
-        lock.lock();
-        this->disconnect_socket(socket);
-    }
-}
+        local.ss_family = static_cast<decltype(local.ss_family)>(family);
 
+        if (family == AF_INET6)
+        {
+            const DWORD v6only = 0;
 
-void socks_proxy::on_socketio_disconnected(SOCKET socket)
-{
-    cix::lock_guard lock(m_mutex);
-    auto client = this->find_client(socket);
-    lock.unlock();
+            if (SOCKET_ERROR == setsockopt(
+                conn, IPPROTO_IPV6, IPV6_V6ONLY,
+                reinterpret_cast<const char*>(&v6only), sizeof(v6only)))
+            {
+                closesocket(conn);
+                continue;
+            }
 
-    if (client)
-    {
-        const auto client_token = client->token;
-        client.reset();
-        this->disconnect_client(client_token);
+            local_len = static_cast<int>(sizeof(struct sockaddr_in6));
+        }
+        else
+        {
+            local_len = static_cast<int>(sizeof(struct sockaddr_in));
+        }
+
+        // any address, ephemeral port
+        if (SOCKET_ERROR == bind(
+            conn, reinterpret_cast<const struct sockaddr*>(&local), local_len))
+        {
+            LOGDEBUG(
+                "failed to bind UDP socket (error {})", WSAGetLastError());
+            closesocket(conn);
+            continue;
+        }
+
+        out_family = family;
+        return conn;
     }
+
+    LOGDEBUG("failed to create UDP socket (error {})", WSAGetLastError());
+
+    return INVALID_SOCKET;
 }
 
 
@@ -763,188 +2896,519 @@ int socks_proxy::resolve(
 }
 
 
+bool socks_proxy::is_loopback(const struct sockaddr* addr)
+{
+    if (addr->sa_family == AF_INET)
+    {
+        const auto addr4 = reinterpret_cast<const sockaddr_in*>(addr);
+
+        // 127.0.0.0/8
+        return (ntohl(addr4->sin_addr.s_addr) >> 24) == 127;
+    }
+
+    if (addr->sa_family == AF_INET6)
+    {
+        const auto addr6 = reinterpret_cast<const sockaddr_in6*>(addr);
+
+        return IN6_IS_ADDR_LOOPBACK(&addr6->sin6_addr) != 0;
+    }
+
+    return false;
+}
+
+
+void socks_proxy::apply_tcp_options(
+    SOCKET conn, const socket_opts_t& opts, const struct sockaddr* remote_addr)
+{
+    // see set_socket_tcp_options(); must be called before connect(), none of
+    // these is fatal
+
+    DWORD bytes = 0;
+
+    if (opts.nodelay)
+    {
+        const BOOL nodelay = TRUE;
+
+        if (SOCKET_ERROR == setsockopt(
+            conn, IPPROTO_TCP, TCP_NODELAY,
+            reinterpret_cast<const char*>(&nodelay), sizeof(nodelay)))
+        {
+            LOGDEBUG(
+                "failed to set SOCKS socket's TCP_NODELAY (error {})",
+                WSAGetLastError());
+        }
+    }
+
+    if (opts.keepalive > 0)
+    {
+        tcp_keepalive keepalive{};
+
+        keepalive.onoff = 1;
+        keepalive.keepalivetime = opts.keepalive;
+        keepalive.keepaliveinterval = socks_proxy::keepalive_interval;
+
+        if (SOCKET_ERROR == WSAIoctl(
+            conn, SIO_KEEPALIVE_VALS, &keepalive, sizeof(keepalive),
+            nullptr, 0, &bytes, nullptr, nullptr))
+        {
+            LOGDEBUG(
+                "failed to set SOCKS socket's keep-alive (error {})",
+                WSAGetLastError());
+        }
+    }
+
+    // WSAEOPNOTSUPP before Windows 8
+    if (opts.loopback_fast_path && socks_proxy::is_loopback(remote_addr))
+    {
+        int enable = 1;
+
+        if (SOCKET_ERROR == WSAIoctl(
+            conn, socks_proxy::sio_loopback_fast_path,
+            &enable, sizeof(enable), nullptr, 0, &bytes, nullptr, nullptr))
+        {
+            LOGDEBUG(
+                "failed to set SOCKS socket's loopback fast path (error {})",
+                WSAGetLastError());
+        }
+    }
+}
+
+
 socks_proxy::socks_reply_code_t
-socks_proxy::connect_socket(
-    client_t& client, struct addrinfo* remote_addr)
+socks_proxy::create_target_socket(
+    const struct addrinfo* ai, const socket_opts_t& opts, SOCKET& out_conn)
 {
-    socks_reply_code_t status = socks_reply_success;
     int wsaerror;
 
-    assert(client.conn == INVALID_SOCKET);
+    out_conn = INVALID_SOCKET;
 
-    for (struct addrinfo* ai = remote_addr; ai; ai = ai->ai_next)
+    // CAUTION: we expect SOCK_STREAM and IPPROTO_TCP anyway so do not use
+    // values from ai for those
+
+    // same as socket(), plus what the engine of socketio may require
+    out_conn = WSASocket(
+        ai->ai_addr->sa_family, SOCK_STREAM, IPPROTO_TCP, nullptr, 0,
+        opts.flags);
+    if (out_conn == INVALID_SOCKET)
     {
-        // CAUTION: we expect SOCK_STREAM and IPPROTO_TCP anyway so do not use
-        // values from ai for those
+        wsaerror = WSAGetLastError();
+
+        LOGDEBUG(
+            "failed to create socket to SOCKS target (error {})",
+            wsaerror);
 
-        // client.conn = WSASocket(
-        //     ai->ai_addr->sa_family, SOCK_STREAM, IPPROTO_TCP, nullptr, 0,
-        //     WSA_FLAG_OVERLAPPED);
-        client.conn = socket(ai->ai_addr->sa_family, SOCK_STREAM, IPPROTO_TCP);
-        if (client.conn == INVALID_SOCKET)
+        return socks_proxy::wsaerror_to_socks_reply(wsaerror);
+    }
+
+    // socket buffers must be sized before connect() for SO_RCVBUF to be
+    // accounted for in the TCP window; failure is not fatal
+    for (const auto& [sockopt, size] : {
+        std::make_pair(SO_RCVBUF, opts.rcvbuf),
+        std::make_pair(SO_SNDBUF, opts.sndbuf) })
+    {
+        if (size > 0 && SOCKET_ERROR == setsockopt(
+            out_conn, SOL_SOCKET, sockopt,
+            reinterpret_cast<const char*>(&size), sizeof(int)))
         {
-            wsaerror = WSAGetLastError();
+            LOGDEBUG(
+                "failed to set SOCKS socket's buffer size "
+                "(error {}; sockopt {}; size {})",
+                WSAGetLastError(), sockopt, size);
+        }
+    }
+
+    socks_proxy::apply_tcp_options(out_conn, opts, ai->ai_addr);
+
+    return socks_reply_success;
+}
+
+
+socks_proxy::socks_reply_code_t
+socks_proxy::start_connect(
+    struct addrinfo* ai, const socket_opts_t& opts,
+    SOCKET& out_conn, bool& out_connected)
+{
+    int wsaerror;
+
+    out_connected = false;
 
+    const auto res = socks_proxy::create_target_socket(ai, opts, out_conn);
+    if (res != socks_reply_success)
+        return res;
+
+    // non-blocking mode so that we can connect() with a timeout; it is kept
+    // afterwards, socketio never blocks on a target socket
+    wsaerror = socketio::enable_socket_nonblocking_mode(out_conn, true);
+    if (wsaerror != 0)
+    {
+        closesocket(out_conn);
+        out_conn = INVALID_SOCKET;
+
+        LOGDEBUG(
+            "failed to set SOCKS socket in non-blocking mode (error {})",
+            wsaerror);
+
+        return socks_proxy::wsaerror_to_socks_reply(wsaerror);
+    }
+
+    // connect
+    // "With a nonblocking socket, the connection attempt cannot be
+    // completed immediately. In this case, connect will return
+    // SOCKET_ERROR, and WSAGetLastError will return WSAEWOULDBLOCK." - msdn
+    if (SOCKET_ERROR == connect(
+        out_conn, ai->ai_addr, static_cast<int>(ai->ai_addrlen)))
+    {
+        wsaerror = WSAGetLastError();
+
+        if (wsaerror != WSAEWOULDBLOCK)
+        {
             LOGDEBUG(
-                "failed to create socket to SOCKS target (error {})",
+                "failed to connect to SOCKS target (error {})",
                 wsaerror);
 
+            closesocket(out_conn);
+            out_conn = INVALID_SOCKET;
+
+            return socks_proxy::wsaerror_to_socks_reply(wsaerror);
+        }
+    }
+    else
+    {
+        // connected immediately (e.g. loopback)
+        out_connected = true;
+    }
+
+    return socks_reply_success;
+}
+
+
+void socks_proxy::interleave_families(
+    struct addrinfo* remote_addr, std::vector<struct addrinfo*>& out_addrs)
+{
+    // the first family being the one of the first address returned by
+    // getaddrinfo()
+
+    std::vector<struct addrinfo*> first_family;
+    std::vector<struct addrinfo*> other_families;
+
+    out_addrs.clear();
+
+    for (struct addrinfo* ai = remote_addr; ai; ai = ai->ai_next)
+    {
+        if (ai->ai_addr->sa_family == remote_addr->ai_addr->sa_family)
+            first_family.push_back(ai);
+        else
+            other_families.push_back(ai);
+    }
+
+    for (std::size_t idx = 0;
+        idx < std::max(first_family.size(), other_families.size());
+        ++idx)
+    {
+        if (idx < first_family.size())
+            out_addrs.push_back(first_family[idx]);
+        if (idx < other_families.size())
+            out_addrs.push_back(other_families[idx]);
+    }
+}
+
+
+socks_proxy::socks_reply_code_t
+socks_proxy::connect_socket(
+    SOCKET& out_conn, struct addrinfo* remote_addr,
+    const socket_opts_t& opts)
+{
+    socks_reply_code_t status = socks_reply_success;
+    socks_reply_code_t res;
+    bool connected;
+    int wsaerror;
+
+    assert(out_conn == INVALID_SOCKET);
+
+    for (struct addrinfo* ai = remote_addr; ai; ai = ai->ai_next)
+    {
+        res = socks_proxy::start_connect(ai, opts, out_conn, connected);
+        if (res != socks_reply_success)
+        {
             if (status == socks_reply_success)
-                status = socks_proxy::wsaerror_to_socks_reply(wsaerror);
+                status = res;
 
             continue;
         }
 
-        // setup socket
+        if (!connected)
         {
-            for (const int sockopt : { SO_RCVTIMEO, SO_SNDTIMEO })
+            fd_set fds_write;
+            fd_set fds_except;
+            TIMEVAL tv;
+            int selres;
+
+            FD_ZERO(&fds_write);
+            FD_ZERO(&fds_except);
+            FD_SET(out_conn, &fds_write);
+            FD_SET(out_conn, &fds_except);
+
+            socketio::milliseconds_to_timeval(
+                static_cast<long>(socks_proxy::socket_connect_timeout),
+                tv);
+
+            selres = select(0, nullptr, &fds_write, &fds_except, &tv);
+            if (selres == SOCKET_ERROR || selres == 0)
             {
-                DWORD timeout = socks_proxy::socket_io_timeout;
+                wsaerror = WSAGetLastError();
 
-                if (SOCKET_ERROR == setsockopt(
-                    client.conn, SOL_SOCKET, sockopt,
-                    reinterpret_cast<const char*>(&timeout), sizeof(DWORD)))
+                if (selres == 0)
                 {
-                    wsaerror = WSAGetLastError();
+                    wsaerror = WSAETIMEDOUT;
+                    WSASetLastError(wsaerror);
+                }
 
-                    closesocket(client.conn);
-                    client.conn = INVALID_SOCKET;
+                LOGDEBUG(
+                    "failed to connect to SOCKS target (error {})",
+                    wsaerror);
 
-                    LOGDEBUG(
-                        "failed to set SOCKS socket's recv/send timeout "
-                        "(error {}; sockopt {})",
-                        wsaerror, sockopt);
+                closesocket(out_conn);
+                out_conn = INVALID_SOCKET;
 
-                    if (status == socks_reply_success)
-                        status = socks_proxy::wsaerror_to_socks_reply(wsaerror);
+                if (status == socks_reply_success)
+                    status = socks_proxy::wsaerror_to_socks_reply(wsaerror);
 
-                    return status;
-                }
+                continue;
             }
-
-            // appy non-blocking mode so that we can connect() with a timeout
-            wsaerror = socketio::enable_socket_nonblocking_mode(
-                client.conn, true);
-            if (wsaerror != 0)
+            else if (FD_ISSET(out_conn, &fds_except))
             {
-                closesocket(client.conn);
-                client.conn = INVALID_SOCKET;
+                int optlen = sizeof(wsaerror);
 
-                LOGDEBUG(
-                    "failed to set SOCKS socket in non-blocking mode (error {})",
-                    wsaerror);
+                getsockopt(
+                    out_conn, SOL_SOCKET, SO_ERROR,
+                    reinterpret_cast<char*>(&wsaerror), &optlen);
+
+                closesocket(out_conn);
+                out_conn = INVALID_SOCKET;
+
+                WSASetLastError(wsaerror);
 
                 if (status == socks_reply_success)
                     status = socks_proxy::wsaerror_to_socks_reply(wsaerror);
 
-                return status;
+                continue;
             }
         }
 
-        // connect
-        // "With a nonblocking socket, the connection attempt cannot be
-        // completed immediately. In this case, connect will return
-        // SOCKET_ERROR, and WSAGetLastError will return WSAEWOULDBLOCK." - msdn
-        if (SOCKET_ERROR == connect(
-            client.conn, ai->ai_addr, static_cast<int>(ai->ai_addrlen)))
+        // left in non-blocking mode, see socketio::register_socket()
+        return socks_reply_success;
+    }
+
+    assert(out_conn == INVALID_SOCKET);
+
+    if (status == socks_reply_success)
+        status = socks_reply_general_failure;
+
+    return status;
+}
+
+
+socks_proxy::socks_reply_code_t
+socks_proxy::connect_socket_racing(
+    SOCKET& out_conn, struct addrinfo* remote_addr,
+    const socket_opts_t& opts)
+{
+    // A "Happy Eyeballs" (RFC 8305) flavored connect():
+    // * addresses are interleaved by family, the first family being the one of
+    //   the first address returned by getaddrinfo()
+    // * a new attempt is started every connect_attempt_delay milliseconds, or
+    //   as soon as a pending one fails, so that attempts run concurrently
+    // * every attempt has its own socket_connect_timeout
+    // * the first attempt to succeed wins, others are closed
+
+    struct attempt_t
+    {
+        SOCKET conn;
+        cix::ticks_t start;
+    };
+
+    std::vector<struct addrinfo*> addrs;
+    std::vector<attempt_t> attempts;
+    std::size_t next_addr = 0;
+    cix::ticks_t last_start = 0;
+    bool start_now = true;
+    SOCKET winner = INVALID_SOCKET;
+    socks_reply_code_t status = socks_reply_success;
+    socks_reply_code_t res;
+    int wsaerror;
+
+    assert(out_conn == INVALID_SOCKET);
+
+    socks_proxy::interleave_families(remote_addr, addrs);
+
+    for (;;)
+    {
+        const auto now = cix::ticks_now();
+
+        // start next attempt if it is time to
+        if (next_addr < addrs.size() &&
+            attempts.size() < FD_SETSIZE &&
+            (start_now ||
+                cix::ticks_elapsed(last_start, now) >=
+                socks_proxy::connect_attempt_delay))
         {
-            wsaerror = WSAGetLastError();
+            SOCKET conn;
+            bool connected;
+
+            res = socks_proxy::start_connect(
+                addrs[next_addr++], opts, conn, connected);
+            last_start = now;
+            start_now = false;
 
-            if (wsaerror != WSAEWOULDBLOCK)
+            if (res != socks_reply_success)
             {
-                LOGDEBUG(
-                    "failed to connect to SOCKS target (error {})",
-                    wsaerror);
+                if (status == socks_reply_success)
+                    status = res;
+
+                start_now = true;
+                continue;
+            }
+
+            if (connected)
+            {
+                winner = conn;
+                break;
+            }
 
-                closesocket(client.conn);
-                client.conn = INVALID_SOCKET;
+            attempts.push_back(attempt_t{conn, now});
+            continue;
+        }
+
+        // drop timed out attempts
+        for (auto it = attempts.begin(); it != attempts.end(); )
+        {
+            if (cix::ticks_elapsed(it->start, now) >=
+                socks_proxy::socket_connect_timeout)
+            {
+                closesocket(it->conn);
+                it = attempts.erase(it);
 
                 if (status == socks_reply_success)
-                    status = socks_proxy::wsaerror_to_socks_reply(wsaerror);
+                    status = socks_reply_ttl_expired;
 
-                continue;
+                start_now = true;
             }
             else
             {
-                fd_set fds_write;
-                fd_set fds_except;
-                TIMEVAL tv;
-                int selres;
-
-                FD_ZERO(&fds_write);
-                FD_ZERO(&fds_except);
-                FD_SET(client.conn, &fds_write);
-                FD_SET(client.conn, &fds_except);
+                ++it;
+            }
+        }
 
-                socketio::milliseconds_to_timeval(
-                    static_cast<long>(socks_proxy::socket_connect_timeout),
-                    tv);
+        if (attempts.empty())
+        {
+            if (next_addr >= addrs.size())
+                break;
 
-                selres = select(0, nullptr, &fds_write, &fds_except, &tv);
-                if (selres == SOCKET_ERROR || selres == 0)
-                {
-                    if (selres == 0)
-                    {
-                        wsaerror = WSAETIMEDOUT;
-                        WSASetLastError(wsaerror);
-                    }
+            start_now = true;
+            continue;
+        }
 
-                    LOGDEBUG(
-                        "failed to connect to SOCKS target (error {})",
-                        wsaerror);
+        // wait for the next event: an attempt to complete or to time out, or
+        // the next attempt to be started
+        cix::ticks_t wait_time = socks_proxy::socket_connect_timeout;
+        fd_set fds_write;
+        fd_set fds_except;
+        TIMEVAL tv;
 
-                    closesocket(client.conn);
-                    client.conn = INVALID_SOCKET;
+        FD_ZERO(&fds_write);
+        FD_ZERO(&fds_except);
 
-                    if (status == socks_reply_success)
-                        status = socks_proxy::wsaerror_to_socks_reply(wsaerror);
+        for (const auto& attempt : attempts)
+        {
+            wait_time = std::min(
+                wait_time,
+                cix::ticks_to_go(
+                    attempt.start,
+                    attempt.start + socks_proxy::socket_connect_timeout,
+                    now));
+
+            FD_SET(attempt.conn, &fds_write);
+            FD_SET(attempt.conn, &fds_except);
+        }
 
-                    continue;
-                }
-                else if (FD_ISSET(client.conn, &fds_except))
-                {
-                    int optlen = sizeof(wsaerror);
+        if (next_addr < addrs.size())
+        {
+            wait_time = std::min(
+                wait_time,
+                cix::ticks_to_go(
+                    last_start,
+                    last_start + socks_proxy::connect_attempt_delay,
+                    now));
+        }
 
-                    getsockopt(
-                        client.conn, SOL_SOCKET, SO_ERROR,
-                        reinterpret_cast<char*>(&wsaerror), &optlen);
+        socketio::milliseconds_to_timeval(static_cast<long>(wait_time), tv);
 
-                    closesocket(client.conn);
-                    client.conn = INVALID_SOCKET;
+        const int selres = select(0, nullptr, &fds_write, &fds_except, &tv);
+        if (selres == SOCKET_ERROR)
+        {
+            wsaerror = WSAGetLastError();
 
-                    WSASetLastError(wsaerror);
+            LOGDEBUG(
+                "failed to wait for SOCKS target connection (error {})",
+                wsaerror);
 
-                    if (status == socks_reply_success)
-                        status = socks_proxy::wsaerror_to_socks_reply(wsaerror);
+            if (status == socks_reply_success)
+                status = socks_proxy::wsaerror_to_socks_reply(wsaerror);
 
-                    continue;
-                }
+            break;
+        }
+        else if (selres == 0)
+        {
+            continue;
+        }
 
-                // connect succeeded, set socket back to blocking mode
-                wsaerror = socketio::enable_socket_nonblocking_mode(
-                    client.conn, false);
-                if (wsaerror != 0)
-                {
-                    closesocket(client.conn);
-                    client.conn = INVALID_SOCKET;
+        for (auto it = attempts.begin(); it != attempts.end(); )
+        {
+            if (FD_ISSET(it->conn, &fds_except))
+            {
+                int optlen = sizeof(wsaerror);
 
-                    LOGDEBUG(
-                        "failed to set SOCKS socket back to blocking mode "
-                        "(error {})",
-                        wsaerror);
+                getsockopt(
+                    it->conn, SOL_SOCKET, SO_ERROR,
+                    reinterpret_cast<char*>(&wsaerror), &optlen);
 
-                    if (status == socks_reply_success)
-                        status = socks_proxy::wsaerror_to_socks_reply(wsaerror);
+                closesocket(it->conn);
+                it = attempts.erase(it);
 
-                    continue;
-                }
+                if (status == socks_reply_success)
+                    status = socks_proxy::wsaerror_to_socks_reply(wsaerror);
 
-                return socks_reply_success;
+                start_now = true;
+            }
+            else if (FD_ISSET(it->conn, &fds_write))
+            {
+                winner = it->conn;
+                attempts.erase(it);
+                break;
+            }
+            else
+            {
+                ++it;
             }
         }
+
+        if (winner != INVALID_SOCKET)
+            break;
+    }
+
+    // cancel pending attempts
+    for (const auto& attempt : attempts)
+        closesocket(attempt.conn);
+    attempts.clear();
+
+    // left in non-blocking mode, see socketio::register_socket()
+    if (winner != INVALID_SOCKET)
+    {
+        out_conn = winner;
+        return socks_reply_success;
     }
 
-    assert(client.conn == INVALID_SOCKET);
+    assert(out_conn == INVALID_SOCKET);
 
     if (status == socks_reply_success)
         status = socks_reply_general_failure;
@@ -8,13 +8,44 @@
 //
 // Properties:
 // * SOCKS5 only
-// * TCP only
-// * Only CONNECT command supported
+// * CONNECT command supported, and UDP ASSOCIATE for the clients created with
+//   *udp_allowed* (see create_client()); no BIND
 // * IPv4, IPv6 and domain name addressing supported
 //
-// TODO / FIXME: push_request() assumes the *packet* arg contains exactly one
-// SOCKS request. That is, the content of *packet* is assumed not to be
-// truncated.
+// Requests are handled by a set of worker threads (shards). Each client is
+// bound to a shard by its token so that its requests are always handled in
+// order, by the same thread.
+//
+// The data passed to push_request() forms a stream: handshake messages
+// (method selection, authentication, CONNECT) are reassembled per client so
+// that they can be split over several packets, or pipelined in a single one
+// along with the first bytes of payload. Such payload, and any received until
+// the connection with the target is established, is buffered (up to
+// *connect_backlog_capacity* bytes) and forwarded as soon as connected.
+//
+// A UDP association gets a UDP socket of its own, bound to an ephemeral port
+// and served by socketio. Its datagrams are pushed with push_datagram() and
+// notified through listener_t::on_socks_udp(), with their SOCKS5 UDP request
+// header in both directions. The SOCKS reply of the command is left to the
+// listener (see listener_t::on_socks_udp_associated()) since only the client
+// side knows the address the SOCKS client has to send its datagrams to. The
+// association lasts as long as its TCP connection, which carries nothing else.
+//
+// With a memory budget (see set_mem_budget()), a session whose target does
+// not keep up gets closed once its write queue goes above the session budget,
+// and CONNECT commands are refused while the global budget is exhausted.
+//
+// Before it comes to that, the listener is told once the write queue of a
+// session goes above *target_write_watermark*, and once it drained, so that it
+// can have the client side stop sending meanwhile (see
+// listener_t::on_socks_target_flow()).
+//
+// With rate limits (see set_rate_limits()), a session that reads its target
+// faster than its client's share, or its own limit, gets its reads paused for
+// as long as it went over, see rate_limiter_t.
+//
+// With a session trace (see set_session_trace()), the stages the data of a
+// session goes through are recorded to it, see session_trace_t.
 //
 class socks_proxy :
     public std::enable_shared_from_this<socks_proxy>,
@@ -26,6 +57,18 @@ public:
 
     enum : token_t { invalid_token = 0 };
 
+    // max number of request workers; the default is one per CPU, capped to
+    // this value
+    enum : std::size_t { max_workers_count = 16 };
+
+    // granularity of the session timeouts in milliseconds, see
+    // expire_sessions()
+    enum : DWORD { session_timer_resolution = 1000 };
+
+    // granularity of the resume of the sessions throttled by their rate, in
+    // milliseconds, see throttle_thread()
+    enum : DWORD { throttle_timer_resolution = 10 };
+
     enum socks_auth_t : bytes_t::value_type
     {
         socks_noauth = 0,
@@ -38,7 +81,7 @@ public:
     {
         socks_cmd_connect = 1,
         // socks_cmd_bind = 2,
-        // socks_cmd_udp_associate = 3,
+        socks_cmd_udp_associate = 3,
     };
 
     enum socks_addr_t : bytes_t::value_type
@@ -61,18 +104,79 @@ public:
         socks_reply_addr_type_not_supported = 8, // address type not supported
     };
 
+    // data of a SOCKS client, see push_request() and push_datagram()
+    // * *data* may be a slice of a bigger buffer, it is forwarded as is to the
+    //   target once connected
+    struct socks_request_t
+    {
+        socks_request_t() = delete;
+        socks_request_t(
+                token_t token, cix::shared_buffer&& data_,
+                bool is_datagram_=false)
+            : client_token{token}
+            , data(std::move(data_))
+            , is_datagram{is_datagram_}
+            , when{cix::ticks_now()}
+            , stamp{cix::hrticks_now()}
+            { }
+
+        token_t client_token;
+        cix::shared_buffer data;
+        bool is_datagram;  // a whole datagram, header included
+        cix::ticks_t when;
+        cix::hrticks_t stamp;  // for latency stats
+    };
+
+    // data of a SOCKS target, or reply to a SOCKS client, see listener_t
     struct socks_packet_t
     {
         socks_packet_t() = delete;
-        socks_packet_t(token_t token, bytes_t&& packet_)
+        socks_packet_t(
+                token_t token, bytes_t&& packet_, std::size_t headroom_=0)
             : client_token{token}
             , packet(std::move(packet_))
+            , headroom{headroom_}
             , when{cix::ticks_now()}
+            , stamp{cix::hrticks_now()}
             { }
 
         token_t client_token;
         bytes_t packet;
+        std::size_t headroom;  // leading bytes of *packet* that are not data
         cix::ticks_t when;
+        cix::hrticks_t stamp;  // for latency stats
+    };
+
+    struct stats_t
+    {
+        std::size_t sessions;           // current clients
+        std::uint64_t sessions_total;   // clients created so far
+        std::size_t pending_requests;   // pushed, not handled yet
+        std::uint64_t connects_ok;
+        std::uint64_t connects_failed;
+        std::uint64_t connects_refused;    // memory budget exhausted
+        std::uint64_t connects_fast_failed;  // see connect_failure_cache
+        std::size_t connects_inflight;       // see set_connect_limits()
+        std::size_t connects_queued;
+        std::uint64_t connects_throttled;    // queue was full
+        std::uint64_t connects_warm;         // see set_warm_pool()
+        std::size_t warm_sockets;            // pooled, see set_warm_pool()
+        std::uint64_t warm_misses;           // to a warm target, none ready
+        std::uint64_t dns_hits;              // negative ones included
+        std::uint64_t dns_misses;
+        resolver_t::stats_t resolver;      // see set_resolve_timeout()
+        std::uint64_t connect_time_total;  // ms taken by *connects_ok*
+        std::uint64_t connect_time_max;    // ms
+        std::uint64_t rate_throttles;      // see set_rate_limits()
+        std::size_t rate_throttled;        // sessions paused by their rate
+        socketio::stats_t socketio;        // SOCKS targets
+
+        // stages of the data path, measured from the time push_request() got
+        // called (socks_request_t::stamp), and CONNECT duration
+        latency_histogram_t::summary_t request_queue_latency;  // dequeued
+        latency_histogram_t::summary_t request_send_latency;   // to socketio
+        latency_histogram_t::summary_t connect_latency;
+        latency_histogram_t::summary_t connect_queue_latency;  // admitted
     };
 
     struct listener_t
@@ -93,80 +197,419 @@ public:
         virtual void on_socks_disconnected(
             std::shared_ptr<socks_proxy> socks_proxy,
             socks_proxy::token_t socks_token) = 0;
+
+        // UDP ASSOCIATE command succeeded, the SOCKS reply to the client is
+        // up to the listener in that case
+        virtual void on_socks_udp_associated(
+            std::shared_ptr<socks_proxy> socks_proxy,
+            socks_proxy::token_t socks_token) = 0;
+
+        // the write queue of the target of *socks_token* went above
+        // *target_write_watermark* (*full*), or drained back down; the last
+        // call for a session tells its current state
+        virtual void on_socks_target_flow(
+            std::shared_ptr<socks_proxy> socks_proxy,
+            socks_proxy::token_t socks_token,
+            bool full) = 0;
+
+        // datagrams received by the UDP socket of an association, each one
+        // prefixed with a SOCKS5 UDP request header whose DST.ADDR and
+        // DST.PORT are its source, at most socketio::datagram_batch_max
+        virtual void on_socks_udp(
+            std::shared_ptr<socks_proxy> socks_proxy,
+            socks_proxy::token_t socks_token,
+            std::vector<bytes_t>&& datagrams) = 0;
     };
 
 private:
     enum : DWORD
     {
         socket_connect_timeout = 6000,
-        socket_io_timeout = 4000,
+
+        // delay between two concurrent connection attempts; see
+        // connect_socket_racing()
+        connect_attempt_delay = 250,
+
+        // the connect jobs start on *m_pool*, so that a slow target does not
+        // stall other clients; the refills of m_warm_pool, and the resolves
+        // where resolver_t is not available, block a thread of it, hence
+        // at least this many threads whatever the number of cores
+        connect_threads_count = 8,
+
+        // delay between two keep-alive probes once the first one got no
+        // answer, see set_socket_tcp_options()
+        keepalive_interval = 5000,
+    };
+
+    // bytes queued to a target past which its session is flow controlled,
+    // or half the session budget if lower; see
+    // socketio::set_write_queue_watermark()
+    static constexpr std::size_t target_write_watermark = 1024 * 1024;
+
+    // SIO_LOOPBACK_FAST_PATH, Windows 8 / Server 2012 and above; not visible
+    // to our WINVER target, same as rio.h
+    static constexpr DWORD sio_loopback_fast_path = _WSAIOW(IOC_VENDOR, 16);
+
+    enum : std::size_t
+    {
+        // max number of requests pushed by push_request() and not yet picked
+        // up by the worker of a shard; the next ones go to shard_t::overflow
+        request_queue_capacity = 4096,
+
+        // max number of payload bytes a client can send before the connection
+        // with its target is established, see client_t::backlog
+        connect_backlog_capacity = 256 * 1024,
     };
 
+    struct shard_t
+    {
+        shard_t();
+        ~shard_t() = default;
+
+        std::unique_ptr<std::thread> thread;
+
+        // requests from push_request(); lock-free so that the parsing thread
+        // of svc_worker does not contend with the worker on m_mutex
+        cix::mpsc_queue<std::unique_ptr<socks_request_t>> request_queue;
+        cix::win_queue_event request_event;
+
+        // requests pushed while *request_queue* was full, and the ones that
+        // came after, so that they stay in order; see queue_request()
+        std::mutex overflow_mutex;
+        std::deque<std::unique_ptr<socks_request_t>> overflow;
+        std::atomic<bool> overflowing;  // *overflow* is not empty
+    };
+
+    // lifecycle of a session; none of the steps blocks a thread:
+    // * the handshake is parsed as requests come, incomplete messages wait in
+    //   client_t::handshake_buffer for the next request
+    // * resolve and connect are a connect job, started on m_pool once
+    //   admitted by m_connect_limiter, unless m_warm_pool has a socket ready
+    //   for the target already; the job only starts the resolve
+    //   (resolve_target_async()), whose completion starts the connect
+    //   attempts (connect_next()), whose completions either race the next
+    //   address or conclude (on_connect_attempt()); see connect_op_t
+    // * meanwhile the session stays in socks_state_connecting (buffering its
+    //   payload in client_t::backlog) until finish_connect() replies and
+    //   moves it to socks_state_connected
+    // * sends to the target are queued to socketio, which calls us back with
+    //   the data it receives
     enum socks_state_t
     {
         socks_state_newclient,
         socks_state_needauth,
-        socks_state_needcmd,    // (no)auth'ed, now waiting for CONNECT command
-        socks_state_connected,  // passed CONNECT command handling
+        socks_state_needcmd,     // (no)auth'ed, now waiting for CONNECT command
+        socks_state_connecting,  // CONNECT command queued, see connect_op_t
+        socks_state_connected,   // passed CONNECT command handling
+        socks_state_udp,         // passed UDP ASSOCIATE command handling
     };
 
     struct client_t
     {
         token_t token;
         socks_state_t socks_state;
-        SOCKET conn;  // client connection with SOCKS target
+        SOCKET conn;  // client connection with SOCKS target, or UDP socket
+        bool udp_allowed;  // see create_client()
+        connect_limiter_t::group_t group;  // see create_client()
+        int udp_family;  // of *conn* in socks_state_udp state
         std::string remote_label;
-        cix::ticks_t last_activity;
+        std::atomic<cix::ticks_t> last_activity;  // request or target data
+        bool recv_paused;  // stop reading from SOCKS target, see pause_client()
+        bool throttled;  // went over its rate, see rate_limit_client()
+        bool target_full;  // as last notified, see update_target_flow()
+
+        // incomplete handshake message; worker thread only
+        bytes_t handshake_buffer;
+
+        // payload received while in socks_state_connecting state, sent to
+        // target by finish_connect() as soon as connected, so that a client
+        // does not have to wait for the CONNECT reply; CAUTION: m_mutex
+        std::list<cix::shared_buffer> backlog;
+        std::size_t backlog_size;  // bytes
+    };
+
+    // options of target sockets
+    struct socket_opts_t
+    {
+        int rcvbuf;   // SO_RCVBUF; 0 for system default
+        int sndbuf;   // SO_SNDBUF; 0 for system default
+        DWORD flags;  // WSASocket() flags, see socketio::socket_flags()
+        bool nodelay;  // TCP_NODELAY
+        DWORD keepalive;  // ms of idleness before probes; 0: system default
+        bool loopback_fast_path;  // SIO_LOOPBACK_FAST_PATH, loopback only
+    };
+
+    struct connect_job_t
+    {
+        token_t client_token;
+        connect_limiter_t::group_t group;  // of the client
+        socks_addr_t addr_type;
+        std::string host;
+        unsigned short port;
+        cix::ticks_t queued;  // see stats_t::connect_time_total
+        cix::hrticks_t queued_stamp;  // see stats_t::connect_latency
+
+        // UDP association: datagram to send to *host* once resolved, whose
+        // data starts at *datagram_offset*; 0 for a CONNECT
+        cix::shared_buffer datagram;
+        std::size_t datagram_offset;
+    };
+
+    // a connect job in progress, from handle_connect_job() to finish_connect(),
+    // held by the completion routines of its resolve and of its connect
+    // attempts
+    // * a "Happy Eyeballs" (RFC 8305) flavored connect, as
+    //   connect_socket_racing(): a new attempt is started once the pending
+    //   one did not complete within connect_attempt_delay milliseconds, or as
+    //   soon as it failed; the first attempt to succeed wins, others are
+    //   cancelled
+    // * the connect jobs in progress are counted, see stop()
+    // * releases the admission of a CONNECT once destroyed
+    struct connect_op_t
+    {
+        connect_op_t(socks_proxy& proxy, const connect_job_t& job);
+        ~connect_op_t();
+
+        connect_op_t(const connect_op_t&) = delete;
+        connect_op_t& operator=(const connect_op_t&) = delete;
+
+        socks_proxy& proxy;
+        const connect_job_t job;
+        socket_opts_t opts;
+        std::shared_ptr<socketio> sockio;  // as of handle_connect_job()
+        dns_cache::addrinfo_ptr ai_remote;  // owns *addrs*
+
+        // CAUTION: protected by *mutex*
+        std::mutex mutex;
+        std::vector<struct addrinfo*> addrs;  // interleaved by family
+        std::size_t next_addr;
+        std::vector<SOCKET> attempts;  // pending socketio::connect() calls
+        socks_reply_code_t status;  // first failure, if any
+        bool done;  // concluded, see on_connect_attempt()
     };
 
 public:
-    socks_proxy();
+    // *workers_count* is the number of request shards, 0 for default
+    explicit socks_proxy(std::size_t workers_count=0);
     ~socks_proxy();
 
     void set_listener(std::shared_ptr<listener_t> listener);
+    void set_buffer_pool(std::shared_ptr<cix::buffer_pool> pool);
+
+    // must be called before launch(); see socketio::set_input_buffer_size()
+    void set_input_buffer_size(std::size_t size);
+
+    // must be called before launch(); see socketio::set_recv_headroom()
+    // * the responses of the SOCKS targets are then notified with such a
+    //   headroom, see socks_packet_t
+    void set_recv_headroom(std::size_t size);
+
+    // applied to target sockets created afterwards, before they connect so
+    // that the TCP window is sized accordingly; 0 for system default
+    void set_socket_buffer_sizes(int rcvbuf, int sndbuf);
+
+    // applied to target sockets created afterwards, before they connect;
+    // failures are not fatal, all disabled by default
+    // * *nodelay*: TCP_NODELAY, i.e. no Nagle delay on interactive sessions;
+    //   socketio gathers the queued data of a socket in a single send anyway
+    // * *keepalive*: milliseconds of idleness before keep-alive probes get
+    //   sent every *keepalive_interval*, so that a dead target gets noticed
+    //   before the idle timeout of its session (see set_session_timeouts())
+    // * *loopback_fast_path*: SIO_LOOPBACK_FAST_PATH for loopback targets,
+    //   only effective if the target's socket has it too, and where supported
+    void set_socket_tcp_options(
+        bool nodelay, cix::ticks_t keepalive, bool loopback_fast_path);
+
+    // must be called before launch(); socketio::default_engine by default
+    // * engine_rio falls back to engine_iocp where not available, see
+    //   socketio::engine_rio
+    void set_socketio_engine(socketio::engine_t engine);
+
+    // must be called before launch(); none by default, see mem_budget_t
+    void set_mem_budget(std::shared_ptr<mem_budget_t> budget);
+
+    // in milliseconds, 0 to disable; must be called before launch()
+    // * *handshake* applies to a client that does not complete its SOCKS
+    //   handshake, i.e. without any request for that long; *idle* is used
+    //   instead if null
+    // * *idle* applies to a connected client that has no traffic in either
+    //   direction for that long
+    void set_session_timeouts(cix::ticks_t handshake, cix::ticks_t idle);
+
+    // see connect_failure_cache; *ttl* in milliseconds, a null *ttl* or
+    // *max_entries* disables it
+    // * a CONNECT to a target whose addresses all failed to connect within
+    //   the last *ttl* is replied the same failure straight away
+    // * only failures that tell about the target are cached (i.e. refused,
+    //   unreachable or timed out), not the local ones
+    void set_connect_failure_cache(cix::ticks_t ttl, std::size_t max_entries);
+
+    // see dns_cache; *ttl* and *negative_ttl* in milliseconds
+    // * *ttl* applies to the names resolved, *negative_ttl* to the names that
+    //   definitely failed to (e.g. no such host); a null value disables the
+    //   caching of either
+    // * a null *max_entries* disables the cache
+    void set_dns_cache(
+        cix::ticks_t ttl, cix::ticks_t negative_ttl, std::size_t max_entries);
+
+    // see resolver_t; in milliseconds, 0 for no limit
+    // * applies to each name a connect job resolves, through m_dns_cache;
+    //   the resolution of an erased session gets cancelled
+    void set_resolve_timeout(DWORD timeout);
+
+    // see connect_limiter_t, a null value means no limit
+    // * at most *max_inflight* CONNECT commands are resolved and connected at
+    //   once, and at most *max_group_inflight* per group of clients (see
+    //   create_client()); the others wait, up to *max_queued* of them
+    // * one that would not fit in the queue is replied a general failure
+    // * a CONNECT holds no thread while in flight, see connect_op_t
+    void set_connect_limits(
+        std::size_t max_inflight,
+        std::size_t max_group_inflight,
+        std::size_t max_queued);
+
+    // see warm_pool_t, disabled by default; must be called before launch()
+    // * up to *per_target* sockets are kept connected to each of *targets*,
+    //   with the options of set_socket_buffer_sizes() and
+    //   set_socket_tcp_options(), and handed over to the CONNECTs to them
+    // * *max_idle* in milliseconds, 0 for no limit
+    void set_warm_pool(
+        std::vector<warm_pool_t::target_t>&& targets,
+        std::size_t per_target,
+        cix::ticks_t max_idle);
+
+    // see rate_limiter_t, in bytes per second, 0 for no limit; must be called
+    // before launch()
+    // * *group_rate* is the share of a group of clients (see create_client())
+    //   of the data read from the targets, *session_rate* the cap of a single
+    //   client
+    void set_rate_limits(std::uint64_t group_rate, std::uint64_t session_rate);
+
+    // must be called before launch(); none by default, see session_trace_t
+    // * sessions are opened and closed in it along with their client, and
+    //   recorded stage_pipe_recv to stage_target_recv
+    void set_session_trace(std::shared_ptr<session_trace_t> trace);
 
     void launch();
 
-    token_t create_client();
-    void push_request(token_t client_token, bytes_t&& packet);
+    // *udp_allowed*: the client may issue a UDP ASSOCIATE command, i.e. the
+    // listener is able to reply to it and to relay its datagrams
+    // *group*: caller-defined, the clients of a same group share the connect
+    // limit of a group (see set_connect_limits())
+    token_t create_client(
+        bool udp_allowed=false, connect_limiter_t::group_t group=0);
+    void push_request(token_t client_token, cix::shared_buffer&& data);
+
+    // a datagram of a UDP association, made of its SOCKS5 UDP request header
+    // followed by its data; dropped if malformed, fragmented, or if the
+    // client is not associated
+    void push_datagram(token_t client_token, cix::shared_buffer&& datagram);
     void disconnect_client(token_t client_token);
 
+    // same as disconnect_client() for each of *client_tokens* (e.g. all the
+    // sessions of a proto client), with the locks taken once, and their
+    // sockets handed over to socketio at once
+    void disconnect_clients(const std::vector<token_t>& client_tokens);
+
+    // pause or resume reading from the SOCKS target of a client; can be called
+    // before the connection with the target is established
+    void pause_client(token_t client_token, bool paused);
+
+    // close the clients that timed out, see set_session_timeouts(); to be
+    // called once next_session_due() is reached; return false if there is no
+    // timer left, in which case there is no need to call it again until a
+    // client gets created
+    bool expire_sessions();
+
+    // when expire_sessions() has something to do next, see
+    // timer_wheel_t::next_due(); 0 if no timer
+    cix::ticks_t next_session_due() const;
+
+    stats_t stats() const;
+
     void stop();
 
 public:
-    void maintenance_thread();
-    void handle_requests();
+    void maintenance_thread(shard_t& shard);
+    void throttle_thread();
+    void rate_limit_client(client_t& client, std::size_t bytes);
+    bool queue_connect_job(connect_job_t&& job);  // false if throttled
+    void handle_connect_job(const connect_job_t& job);
+    dns_cache::addrinfo_ptr resolve_target(
+        const std::string& host, unsigned short port, bool use_cache,
+        token_t client_token, int& out_gai_error);
+    void resolve_target_async(
+        const std::string& host, unsigned short port, bool use_cache,
+        token_t client_token, resolver_t::on_resolved_t&& on_resolved);
+    void on_target_resolved(
+        const std::shared_ptr<connect_op_t>& op,
+        int gai_error, dns_cache::addrinfo_ptr&& ai_remote);
+    bool connect_next(const std::shared_ptr<connect_op_t>& op);
+    void on_connect_attempt(
+        const std::shared_ptr<connect_op_t>& op, SOCKET conn, int error);
+    void conclude_connect(
+        const connect_op_t& op, socks_reply_code_t reply_code, SOCKET conn);
+    SOCKET connect_warm(const std::string& host, unsigned short port);
+    void finish_connect(
+        const connect_job_t& job, socks_reply_code_t reply_code, SOCKET conn);
+    void handle_requests(shard_t& shard);
     void handle_socks_request(
         std::shared_ptr<client_t> client,
-        socks_packet_t& request);
+        socks_request_t& request);
+    bool handle_socks_handshake(
+        client_t& client,
+        socks_request_t& request);
     bool handle_socks_request__newclient(
         client_t& client,
-        const socks_packet_t& request);
+        const bytes_t& packet);
     bool handle_socks_request__needauth(
         client_t& client,
-        const socks_packet_t& request);
+        const bytes_t& packet);
     bool handle_socks_request__needcmd(
         client_t& client,
-        const socks_packet_t& request);
+        const bytes_t& packet);
     bool handle_socks_request__connected(
         const client_t& client,
-        socks_packet_t& request);
+        socks_request_t& request);
+    socks_reply_code_t handle_socks_request__udp_associate(client_t& client);
+    void handle_datagram(const client_t& client, socks_request_t& request);
+    void queue_request(std::unique_ptr<socks_request_t> request);
 
-    void send_to_client(client_t& client, bytes_t&& packet);
+    void send_to_client(
+        client_t& client, bytes_t&& packet, std::size_t headroom=0);
     void send_reply_to_client(
         client_t& client, socks_reply_code_t code, socks_addr_t addr_type);
-    bool send_to_target(const client_t& client, bytes_t&& packet);
-    std::shared_ptr<client_t> find_client(SOCKET socket) const;
+    bool send_to_target(const client_t& client, cix::shared_buffer&& data);
+    void send_datagram(
+        const client_t& client, const struct addrinfo* ai,
+        const cix::shared_buffer& datagram, std::size_t data_offset);
+    void send_datagram(
+        const client_t& client, const struct sockaddr* to, int to_len,
+        const cix::shared_buffer& datagram, std::size_t data_offset);
+    std::shared_ptr<client_t> find_client(SOCKET socket) const;  // lock-free
+    bool session_deadline(
+        const client_t& client, cix::ticks_t& out_deadline) const;
     void erase_client(token_t client_token);
+    void erase_clients(const token_t* client_tokens, std::size_t count);
     void disconnect_socket(SOCKET socket);
+    shard_t& shard_of(token_t client_token) const;
     void notify_response(std::shared_ptr<socks_packet_t> response);
     void request_close(token_t client_token);
     void notify_disconnected(token_t client_token);
+    void update_target_flow(token_t client_token);
 
     // socketio::listener_t
     void on_socketio_recv(SOCKET socket, bytes_t&& packet);
+    void on_socketio_recvfrom(
+        SOCKET socket, std::vector<socketio::datagram_t>&& datagrams);
     void on_socketio_disconnected(SOCKET socket);
+    void on_socketio_write_drained(SOCKET socket);
 
+    static std::size_t handshake_message_size(
+        socks_state_t socks_state, const std::uint8_t* data, std::size_t size);
+    static std::size_t udp_header_size(
+        const std::uint8_t* data, std::size_t size);
+    static SOCKET create_udp_socket(int& out_family);
     static socks_reply_code_t wsaerror_to_socks_reply(int error);
 
     static int resolve(
@@ -176,20 +619,91 @@ public:
         int ai_family=AF_UNSPEC,
         int ai_flags=0);  // AI_PASSIVE
 
+    static bool is_loopback(const struct sockaddr* addr);
+    static void apply_tcp_options(
+        SOCKET conn, const socket_opts_t& opts,
+        const struct sockaddr* remote_addr);
+
+    static socks_reply_code_t create_target_socket(
+        const struct addrinfo* ai, const socket_opts_t& opts,
+        SOCKET& out_conn);
+    static socks_reply_code_t start_connect(
+        struct addrinfo* ai, const socket_opts_t& opts,
+        SOCKET& out_conn, bool& out_connected);
+    static void interleave_families(
+        struct addrinfo* remote_addr, std::vector<struct addrinfo*>& out_addrs);
+
     static socks_reply_code_t connect_socket(
-        client_t& client, struct addrinfo* remote_addr);
+        SOCKET& out_conn, struct addrinfo* remote_addr,
+        const socket_opts_t& opts);
+    static socks_reply_code_t connect_socket_racing(
+        SOCKET& out_conn, struct addrinfo* remote_addr,
+        const socket_opts_t& opts);
 
 public:
     mutable std::recursive_mutex m_mutex;
-    cix::random::fast m_rand;
-    std::unique_ptr<std::thread> m_thread;
+    std::atomic<token_t> m_last_token;  // see create_client()
     HANDLE m_stop_event;
-    HANDLE m_request_event;
+    cix::thread_pool m_pool;  // connect jobs, warm refills, blocking resolves
+    connect_limiter_t m_connect_limiter;  // CONNECT jobs to m_pool
+
+    // connect_op_t instances, waited for by stop(); a lock of its own since an
+    // instance may be released by m_pool with its lock held
+    std::mutex m_connect_ops_mutex;
+    std::size_t m_connect_ops;
+    HANDLE m_connect_ops_idle;  // manual-reset, set while m_connect_ops is 0
 
     std::shared_ptr<socketio> m_socketio;
+    socketio::engine_t m_socketio_engine;
+
+    // serializes update_target_flow(), so that the flow of a session is
+    // notified in order; CAUTION: locked before m_mutex
+    std::mutex m_flow_mutex;
     std::weak_ptr<listener_t> m_listener;
+    std::shared_ptr<cix::buffer_pool> m_buffer_pool;
+    std::shared_ptr<mem_budget_t> m_mem_budget;
+    std::shared_ptr<session_trace_t> m_session_trace;  // constant once launched
+    std::size_t m_input_buffer_size;
+    std::size_t m_recv_headroom;
+    socket_opts_t m_socket_opts;
+    dns_cache m_dns_cache;
+    resolver_t m_resolver;  // names missing from m_dns_cache
+    connect_failure_cache m_connect_failures;
+    warm_pool_t m_warm_pool;  // connects on m_pool, see connect_warm()
+    std::vector<warm_pool_t::target_t> m_warm_targets;  // see launch()
+    std::size_t m_warm_per_target;
+    cix::ticks_t m_warm_max_idle;
+
+    // one timer per client, checked against client_t::last_activity only once
+    // it fires, so that activity itself does not have to touch the wheel
+    cix::ticks_t m_handshake_timeout;
+    cix::ticks_t m_idle_timeout;
+    timer_wheel_t m_session_timers;
+
+    // the clients throttled by m_rate_limiter, resumed by m_throttle_thread
+    // once their timer fires
+    rate_limiter_t m_rate_limiter;
+    timer_wheel_t m_throttle_timers;
+    HANDLE m_throttle_event;  // auto-reset, m_throttle_timers got a first one
+    std::unique_ptr<std::thread> m_throttle_thread;
+    std::size_t m_throttled;  // clients with client_t::throttled set
+
+    // CAUTION: the vector itself is never modified after construction so
+    // that push_request() can access it without locking
+    std::vector<std::unique_ptr<shard_t>> m_shards;
+
+    cix::flat_hash_map<token_t, std::shared_ptr<client_t>> m_clients;
+    stats_t m_stats;  // counters only, see stats()
 
-    std::list<std::shared_ptr<socks_packet_t>> m_pending_requests;
+    // lock-free, see stats_t
+    latency_histogram_t m_request_queue_latency;
+    latency_histogram_t m_request_send_latency;
+    latency_histogram_t m_connect_latency;
 
-    std::map<token_t, std::shared_ptr<client_t>> m_clients;
+    // index of the connected clients by client_t::conn, looked up for every
+    // chunk received from a SOCKS target, so it has its own lock in order
+    // not to contend on m_mutex; CAUTION: m_mutex, if needed, must be locked
+    // first
+    mutable std::shared_mutex m_sockets_mutex;
+    cix::flat_hash_map<SOCKET, std::shared_ptr<client_t>> m_sockets;
 };
@@ -0,0 +1,708 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "main.h"
+
+namespace detail
+{
+    static std::atomic<std::uint64_t> spool_files{0};
+    static std::atomic<std::uint64_t> spool_bytes{0};
+    static std::atomic<std::uint64_t> spool_appended{0};
+    static std::atomic<std::uint64_t> spool_rejects{0};
+
+    static DWORD high_dword(std::size_t value)
+    {
+        return static_cast<DWORD>(static_cast<std::uint64_t>(value) >> 32);
+    }
+
+    static DWORD low_dword(std::size_t value)
+    {
+        return static_cast<DWORD>(value & 0xffffffff);
+    }
+}
+
+
+spool_t::spool_t(std::size_t max_size)
+    : m_max_size{(max_size + view_size - 1) / view_size * view_size}
+    , m_file{INVALID_HANDLE_VALUE}
+    , m_mapping{nullptr}
+    , m_failed{false}
+    , m_file_size{0}
+    , m_read{0}
+    , m_write{0}
+    , m_read_view{nullptr, 0, 0}
+    , m_write_view{nullptr, 0, 0}
+{
+    assert(max_size > 0);
+}
+
+
+spool_t::~spool_t()
+{
+    detail::spool_bytes.fetch_sub(this->size(), std::memory_order_relaxed);
+    this->close();
+}
+
+
+bool spool_t::append(const byte_t* data, std::size_t size)
+{
+    if (size == 0)
+        return true;
+
+    if (m_failed ||
+        size > m_max_size - m_write ||
+        (m_write + size > m_file_size && !this->grow(m_write + size)))
+    {
+        detail::spool_rejects.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // views are only mapped within the file, which is big enough already, so
+    // that a failure here leaves nothing appended
+    auto offset = m_write;
+    auto remaining = size;
+
+    while (remaining > 0)
+    {
+        std::size_t avail;
+        auto* const dest = this->map(m_write_view, offset, avail);
+
+        if (!dest)
+        {
+            detail::spool_rejects.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        const auto len = std::min(avail, remaining);
+
+        std::memcpy(dest, data, len);
+        data += len;
+        offset += len;
+        remaining -= len;
+    }
+
+    m_write = offset;
+
+    detail::spool_bytes.fetch_add(size, std::memory_order_relaxed);
+    detail::spool_appended.fetch_add(size, std::memory_order_relaxed);
+
+    return true;
+}
+
+
+std::size_t spool_t::read(byte_t* out, std::size_t size)
+{
+    size = std::min(size, this->size());
+
+    std::size_t done = 0;
+
+    while (done < size)
+    {
+        std::size_t avail;
+        const auto* const src = this->map(m_read_view, m_read + done, avail);
+
+        if (!src)
+        {
+            // what is left cannot be read back, the stream is cut anyway
+            LOGERROR("dropping {} bytes of SOCKS data spooled", this->size());
+            detail::spool_bytes.fetch_sub(
+                this->size(), std::memory_order_relaxed);
+            m_read = 0;
+            m_write = 0;
+            return 0;
+        }
+
+        const auto len = std::min(avail, size - done);
+
+        std::memcpy(out + done, src, len);
+        done += len;
+    }
+
+    m_read += done;
+
+    detail::spool_bytes.fetch_sub(done, std::memory_order_relaxed);
+
+    // caught up, the file gets reused from its start
+    if (m_read == m_write)
+    {
+        m_read = 0;
+        m_write = 0;
+    }
+
+    return done;
+}
+
+
+spool_t::stats_t spool_t::stats()
+{
+    stats_t stats;
+
+    stats.files = detail::spool_files.load(std::memory_order_relaxed);
+    stats.bytes = detail::spool_bytes.load(std::memory_order_relaxed);
+    stats.appended = detail::spool_appended.load(std::memory_order_relaxed);
+    stats.rejects = detail::spool_rejects.load(std::memory_order_relaxed);
+
+    return stats;
+}
+
+
+bool spool_t::open()
+{
+    assert(m_file == INVALID_HANDLE_VALUE);
+
+    wchar_t dir[MAX_PATH + 1];
+    wchar_t path[MAX_PATH];
+
+    const auto dir_len = GetTempPathW(
+        static_cast<DWORD>(std::size(dir)), dir);
+
+    if (dir_len == 0 || dir_len >= std::size(dir))
+    {
+        LOGERROR("GetTempPath failed (error {})", GetLastError());
+        return false;
+    }
+
+    if (!GetTempFileNameW(dir, L"r2s", 0, path))
+    {
+        LOGERROR(L"failed to create spool file in {} (error {})",
+            dir, GetLastError());
+        return false;
+    }
+
+    m_file = CreateFileW(
+        path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+        FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+
+    if (m_file == INVALID_HANDLE_VALUE)
+    {
+        LOGERROR(L"failed to open spool file {} (error {})",
+            path, GetLastError());
+        DeleteFileW(path);
+        return false;
+    }
+
+    detail::spool_files.fetch_add(1, std::memory_order_relaxed);
+
+    return true;
+}
+
+
+bool spool_t::grow(std::size_t min_size)
+{
+    assert(min_size <= m_max_size);
+
+    if (m_file == INVALID_HANDLE_VALUE && !this->open())
+    {
+        m_failed = true;
+        return false;
+    }
+
+    auto new_size = std::max<std::size_t>(m_file_size, initial_size);
+
+    while (new_size < min_size)
+        new_size *= 2;
+
+    new_size = std::min(new_size, m_max_size);
+
+    // a mapping cannot grow, a bigger one extends the file instead
+    this->unmap(m_read_view);
+    this->unmap(m_write_view);
+
+    if (m_mapping)
+    {
+        CloseHandle(m_mapping);
+        m_mapping = nullptr;
+    }
+
+    m_mapping = CreateFileMappingW(
+        m_file, nullptr, PAGE_READWRITE,
+        detail::high_dword(new_size), detail::low_dword(new_size), nullptr);
+
+    if (!m_mapping)
+    {
+        LOGERROR("failed to map spool file to {} bytes (error {})",
+            new_size, GetLastError());
+
+        // the one that got closed is still valid
+        if (m_file_size > 0)
+        {
+            m_mapping = CreateFileMappingW(
+                m_file, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+        }
+
+        if (!m_mapping)
+            m_file_size = 0;
+
+        return false;
+    }
+
+    m_file_size = new_size;
+
+    return true;
+}
+
+
+spool_t::byte_t* spool_t::map(
+    view_t& view, std::size_t offset, std::size_t& out_size)
+{
+    // pointer to *offset*, and the number of bytes mapped from there
+
+    const auto view_offset = offset - (offset % view_size);
+
+    if (!view.data || view.offset != view_offset)
+    {
+        this->unmap(view);
+
+        if (!m_mapping || offset >= m_file_size)
+            return nullptr;
+
+        const auto size = std::min<std::size_t>(
+            view_size, m_file_size - view_offset);
+
+        auto* const data = MapViewOfFile(
+            m_mapping, FILE_MAP_WRITE,
+            detail::high_dword(view_offset), detail::low_dword(view_offset),
+            size);
+
+        if (!data)
+        {
+            LOGERROR("failed to map view of spool file (error {})",
+                GetLastError());
+            return nullptr;
+        }
+
+        view.data = static_cast<byte_t*>(data);
+        view.offset = view_offset;
+        view.size = size;
+    }
+
+    out_size = view.offset + view.size - offset;
+
+    return view.data + (offset - view.offset);
+}
+
+
+void spool_t::unmap(view_t& view)
+{
+    if (view.data)
+    {
+        UnmapViewOfFile(view.data);
+        view.data = nullptr;
+    }
+}
+
+
+void spool_t::close()
+{
+    this->unmap(m_read_view);
+    this->unmap(m_write_view);
+
+    if (m_mapping)
+    {
+        CloseHandle(m_mapping);
+        m_mapping = nullptr;
+    }
+
+    // deletes it, see FILE_FLAG_DELETE_ON_CLOSE
+    if (m_file != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(m_file);
+        m_file = INVALID_HANDLE_VALUE;
+        detail::spool_files.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    m_file_size = 0;
+}
+
+
+
+//******************************************************************************
+
+
+
+spool_queue_t::spool_queue_t(
+        std::shared_ptr<spool_thread_t> thread,
+        std::shared_ptr<cix::buffer_pool> pool,
+        std::size_t max_size,
+        std::size_t headroom,
+        std::size_t chunk_size,
+        on_ready_t&& on_ready)
+    : m_thread(std::move(thread))
+    , m_pool(std::move(pool))
+    , m_headroom{headroom}
+    , m_chunk_size{chunk_size}
+    , m_on_ready(std::move(on_ready))
+    , m_file(max_size)
+    , m_closed{false}
+    , m_scheduled{false}
+    , m_waiting{false}
+    , m_full{false}
+    , m_queue_size{0}
+    , m_ready_size{0}
+    , m_file_size{0}
+{
+    assert(m_thread);
+    assert(m_pool);
+    assert(chunk_size > 0);
+}
+
+
+bool spool_queue_t::push(bytes_t& buffer)
+{
+    assert(buffer.size() >= m_headroom);
+
+    bool wake;
+
+    {
+        std::scoped_lock lock(m_mutex);
+
+        if (m_closed || m_full || m_queue_size >= queue_max_size)
+            return false;
+
+        m_queue_size += buffer.size() - m_headroom;
+        m_queue.push_back(std::move(buffer));
+
+        wake = this->schedule();
+    }
+
+    if (wake)
+        m_thread->wake(this->shared_from_this());
+
+    return true;
+}
+
+
+bool spool_queue_t::pop(bytes_t& out_buffer)
+{
+    bool popped = false;
+    bool wake = false;
+
+    {
+        std::scoped_lock lock(m_mutex);
+
+        if (!m_ready.empty())
+        {
+            out_buffer = std::move(m_ready.front());
+            m_ready.pop_front();
+            m_ready_size -= out_buffer.size() - m_headroom;
+            popped = true;
+
+            // read ahead again
+            if (m_file_size > 0)
+                wake = this->schedule();
+        }
+        else if (m_file_size == 0)
+        {
+            // none of the data pushed before them is left on disk
+            if (!m_queue.empty())
+            {
+                out_buffer = std::move(m_queue.front());
+                m_queue.pop_front();
+                m_queue_size -= out_buffer.size() - m_headroom;
+                popped = true;
+            }
+        }
+        else if (!m_closed)
+        {
+            m_waiting = true;
+            wake = this->schedule();
+        }
+    }
+
+    if (wake)
+        m_thread->wake(this->shared_from_this());
+
+    return popped;
+}
+
+
+bool spool_queue_t::empty() const
+{
+    std::scoped_lock lock(m_mutex);
+
+    return m_ready.empty() && m_queue.empty() && m_file_size == 0;
+}
+
+
+void spool_queue_t::close()
+{
+    std::deque<bytes_t> queue;
+    std::deque<bytes_t> ready;
+
+    {
+        std::scoped_lock lock(m_mutex);
+
+        m_closed = true;
+        m_waiting = false;
+        m_queue.swap(queue);
+        m_queue_size = 0;
+        m_ready.swap(ready);
+        m_ready_size = 0;
+    }
+
+    // the file goes with the last reference, which the thread may hold
+    for (auto& buffer : queue)
+        m_pool->release(std::move(buffer));
+
+    for (auto& buffer : ready)
+        m_pool->release(std::move(buffer));
+}
+
+
+bool spool_queue_t::step()
+{
+    // spool thread only, which is the only one to access m_file, the lock is
+    // released while it does
+
+    std::unique_lock lock(m_mutex);
+
+    if (!m_closed && m_ready_size < m_chunk_size * read_ahead_chunks &&
+        !m_file.empty())
+    {
+        const auto avail = m_file.size();
+
+        lock.unlock();
+
+        auto buffer = m_pool->acquire(
+            m_headroom + std::min(m_chunk_size, avail));
+
+        const auto len = m_file.read(
+            buffer.data() + m_headroom, buffer.size() - m_headroom);
+
+        lock.lock();
+
+        if (len > 0 && !m_closed)
+        {
+            buffer.resize(m_headroom + len);
+            m_file_size -= len;
+            m_ready_size += len;
+            m_ready.push_back(std::move(buffer));
+        }
+        else
+        {
+            // what was left got dropped on failure, see spool_t::read()
+            m_file_size -= (len > 0) ? len : avail;
+            m_pool->release(std::move(buffer));
+        }
+
+        // rewound, see spool_t::read()
+        if (m_file.empty())
+            m_full = false;
+    }
+    else if (!m_closed && !m_full && !m_queue.empty())
+    {
+        auto buffer = std::move(m_queue.front());
+        const auto len = buffer.size() - m_headroom;
+
+        m_queue.pop_front();
+        m_queue_size -= len;
+        m_file_size += len;
+
+        lock.unlock();
+
+        const auto appended = m_file.append(buffer.data() + m_headroom, len);
+
+        lock.lock();
+
+        if (appended)
+        {
+            m_pool->release(std::move(buffer));
+        }
+        else
+        {
+            // back in front, pop() takes it from there once the file got
+            // read back
+            m_file_size -= len;
+            m_full = true;
+
+            if (m_closed)
+            {
+                m_pool->release(std::move(buffer));
+            }
+            else
+            {
+                m_queue_size += len;
+                m_queue.push_front(std::move(buffer));
+            }
+        }
+    }
+    else
+    {
+        m_scheduled = false;
+        return false;
+    }
+
+    const bool notify = m_waiting && this->is_ready();
+
+    if (notify)
+        m_waiting = false;
+
+    lock.unlock();
+
+    if (notify)
+        m_on_ready();
+
+    return true;
+}
+
+
+bool spool_queue_t::is_ready() const
+{
+    // CAUTION: m_mutex must be locked by caller
+    return !m_ready.empty() || m_file_size == 0;
+}
+
+
+bool spool_queue_t::schedule()
+{
+    // CAUTION: m_mutex must be locked by caller
+    // true if the caller has to wake the thread, once m_mutex is released
+
+    if (m_scheduled)
+        return false;
+
+    m_scheduled = true;
+
+    return true;
+}
+
+
+
+//******************************************************************************
+
+
+
+spool_thread_t::spool_thread_t(std::shared_ptr<cix::buffer_pool> pool)
+    : m_pool(std::move(pool))
+    , m_stop_event{nullptr}
+    , m_wake_event{nullptr}
+    , m_stopped{false}
+{
+    assert(m_pool);
+
+    m_stop_event = CreateEvent(nullptr, TRUE, FALSE, nullptr);  // manual reset
+    if (!m_stop_event)
+        CIX_THROW_WINERR("failed to create spool stop event");
+
+    m_wake_event = CreateEvent(nullptr, FALSE, FALSE, nullptr);  // auto reset
+    if (!m_wake_event)
+    {
+        CloseHandle(m_stop_event);
+        CIX_THROW_WINERR("failed to create spool wake event");
+    }
+}
+
+
+spool_thread_t::~spool_thread_t()
+{
+    this->stop();
+
+    CloseHandle(m_wake_event);
+    CloseHandle(m_stop_event);
+}
+
+
+void spool_thread_t::launch()
+{
+    assert(!m_thread);
+
+    m_thread = std::make_unique<std::thread>(
+        std::bind(&spool_thread_t::thread_main, this));
+}
+
+
+void spool_thread_t::stop()
+{
+    SetEvent(m_stop_event);
+
+    if (m_thread)
+    {
+        if (m_thread->joinable())
+            m_thread->join();
+
+        m_thread.reset();
+    }
+
+    // the queues hold a reference to us
+    std::deque<std::shared_ptr<spool_queue_t>> pending;
+
+    {
+        std::scoped_lock lock(m_mutex);
+
+        m_stopped = true;
+        m_pending.swap(pending);
+    }
+}
+
+
+std::shared_ptr<spool_queue_t> spool_thread_t::open(
+    std::size_t max_size,
+    std::size_t headroom,
+    std::size_t chunk_size,
+    spool_queue_t::on_ready_t&& on_ready)
+{
+    return std::make_shared<spool_queue_t>(
+        this->shared_from_this(), m_pool, max_size, headroom, chunk_size,
+        std::move(on_ready));
+}
+
+
+void spool_thread_t::wake(std::shared_ptr<spool_queue_t> queue)
+{
+    {
+        std::scoped_lock lock(m_mutex);
+
+        if (m_stopped)
+            return;
+
+        m_pending.push_back(std::move(queue));
+    }
+
+    SetEvent(m_wake_event);
+}
+
+
+void spool_thread_t::thread_main()
+{
+    const HANDLE events[] = { m_stop_event, m_wake_event };
+
+    CIX_THREAD_SET_NAME_STATIC(GetCurrentThreadId(), "spool");
+    alloc_profile::set_thread_stage(alloc_profile::stage_response);
+
+    for (;;)
+    {
+        const auto wait_res = WaitForMultipleObjects(
+            static_cast<DWORD>(cix::countof(events)), events, FALSE, INFINITE);
+
+        wakeups::count();
+
+        if (wait_res != WAIT_OBJECT_0 + 1)
+            break;  // stop event, or failure
+
+        for (;;)
+        {
+            std::shared_ptr<spool_queue_t> queue;
+
+            {
+                std::scoped_lock lock(m_mutex);
+
+                if (m_pending.empty())
+                    break;
+
+                queue = std::move(m_pending.front());
+                m_pending.pop_front();
+            }
+
+            // one step per turn, so that a big spool does not hold up the
+            // others
+            if (queue->step())
+            {
+                std::scoped_lock lock(m_mutex);
+                m_pending.push_back(std::move(queue));
+            }
+
+            if (WaitForSingleObject(m_stop_event, 0) == WAIT_OBJECT_0)
+                return;
+        }
+    }
+}
@@ -0,0 +1,213 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// A FIFO of bytes backed by a temporary file, so that the SOCKS data of a
+// connection whose client does not keep up can wait on disk rather than in
+// memory (see svc_worker::socks_spool_t)
+//
+// * the file is created in the temporary directory on first append(), with
+//   FILE_ATTRIBUTE_TEMPORARY so that the cache manager does not flush it unless
+//   memory is short, and FILE_FLAG_DELETE_ON_CLOSE so that it never outlives
+//   the process
+// * it is accessed through views of its mapping, *view_size* bytes at most,
+//   one for append() and one for read(), so that address space stays bounded
+//   whatever the number of spools
+// * data is appended at the end and read from the front; both are rewound once
+//   all of it got read, so that the file only grows as long as the reader lags
+//   behind
+// * the file grows by doubling from *initial_size*, up to *max_size* bytes, at
+//   which point append() fails until all of it got read
+// * not thread-safe
+class spool_t
+{
+public:
+    typedef std::uint8_t byte_t;
+
+    enum : std::size_t
+    {
+        initial_size = 1024 * 1024,
+        view_size = 1024 * 1024,  // a multiple of the allocation granularity
+    };
+
+    // all the spools of the process
+    struct stats_t
+    {
+        std::uint64_t files;     // gauge; files open
+        std::uint64_t bytes;     // gauge; bytes to be read
+        std::uint64_t appended;  // bytes ever appended
+        std::uint64_t rejects;   // append() calls that failed
+    };
+
+public:
+    explicit spool_t(std::size_t max_size);
+    ~spool_t();
+
+    spool_t(const spool_t&) = delete;
+    spool_t& operator=(const spool_t&) = delete;
+
+    bool empty() const { return m_read == m_write; }
+    std::size_t size() const { return m_write - m_read; }
+
+    // false if *data* does not fit, or if file could not be created or grown,
+    // in which case nothing is appended
+    bool append(const byte_t* data, std::size_t size);
+
+    // up to *size* bytes to *out*, return the number of bytes read; 0 either if
+    // empty or on failure, in which case the spool is emptied
+    std::size_t read(byte_t* out, std::size_t size);
+
+    static stats_t stats();
+
+private:
+    struct view_t
+    {
+        byte_t* data;  // null if not mapped
+        std::size_t offset;  // in file
+        std::size_t size;
+    };
+
+private:
+    bool open();
+    bool grow(std::size_t min_size);
+    byte_t* map(view_t& view, std::size_t offset, std::size_t& out_size);
+    void unmap(view_t& view);
+    void close();
+
+private:
+    const std::size_t m_max_size;
+    HANDLE m_file;
+    HANDLE m_mapping;
+    bool m_failed;  // could not create the file, do not try again
+    std::size_t m_file_size;
+    std::size_t m_read;   // offset of the next byte to read
+    std::size_t m_write;  // offset of the next byte to append
+    view_t m_read_view;
+    view_t m_write_view;
+};
+
+
+class spool_thread_t;
+
+// A spool_t whose file is only ever accessed by a spool_thread_t, so that the
+// threads feeding the pipes never wait on the disk (e.g. the completion
+// threads of socketio, with a channel locked)
+//
+// * buffers are made of *headroom* bytes followed by the data to spool, the
+//   thread appends the data of the ones push() queued to the file, and reads
+//   it back ahead of pop(), *chunk_size* bytes per buffer, in buffers of the
+//   pool it was given
+// * pop() returns them in the order they got pushed, straight from the
+//   queue if none of the data before them is still on disk
+// * push() refuses buffers once *queue_max_size* bytes wait for the thread,
+//   or once the file is full or failed, until all of it got read back; the
+//   caller has to keep them in order behind this spool meanwhile
+// * once pop() found nothing ready, the thread calls *on_ready* as soon as
+//   something is, from its own thread and with no lock held
+// * its mutex is the last one to be locked, after the ones of its owner
+class spool_queue_t : public std::enable_shared_from_this<spool_queue_t>
+{
+public:
+    typedef cix::buffer_pool::bytes_t bytes_t;
+    typedef std::function<void()> on_ready_t;
+
+    enum : std::size_t
+    {
+        queue_max_size = 1024 * 1024,  // bytes in memory, waiting for the disk
+        read_ahead_chunks = 2,
+    };
+
+public:
+    spool_queue_t(
+        std::shared_ptr<spool_thread_t> thread,
+        std::shared_ptr<cix::buffer_pool> pool,
+        std::size_t max_size,
+        std::size_t headroom,
+        std::size_t chunk_size,
+        on_ready_t&& on_ready);
+
+    spool_queue_t(const spool_queue_t&) = delete;
+    spool_queue_t& operator=(const spool_queue_t&) = delete;
+
+    // owner side
+    // * push() returns false if *buffer* was refused, which is then left as is
+    // * pop() returns false if nothing is ready yet, in which case *on_ready*
+    //   follows unless empty()
+    // * close() drops everything, the thread leaves it alone from now on
+    bool push(bytes_t& buffer);
+    bool pop(bytes_t& out_buffer);
+    bool empty() const;
+    void close();
+
+private:
+    friend class spool_thread_t;
+
+    // spool thread side, one write or read at a time; false once there is
+    // nothing left to do until the next push() or pop()
+    bool step();
+
+    // CAUTION: m_mutex must be locked by caller
+    bool is_ready() const;
+    bool schedule();
+
+private:
+    const std::shared_ptr<spool_thread_t> m_thread;
+    const std::shared_ptr<cix::buffer_pool> m_pool;
+    const std::size_t m_headroom;
+    const std::size_t m_chunk_size;
+    const on_ready_t m_on_ready;
+    spool_t m_file;  // spool thread only
+
+    // protected by m_mutex
+    mutable std::mutex m_mutex;
+    bool m_closed;
+    bool m_scheduled;  // in the queue of the thread, or being worked on
+    bool m_waiting;  // pop() found nothing, see *on_ready*
+    bool m_full;  // last append failed, until the file got read back
+    std::deque<bytes_t> m_queue;  // not appended yet
+    std::size_t m_queue_size;  // bytes of data in *m_queue*
+    std::deque<bytes_t> m_ready;  // read back, ready to pop()
+    std::size_t m_ready_size;  // bytes of data in *m_ready*
+    std::size_t m_file_size;  // bytes in *m_file*, or being appended to it
+};
+
+
+// The thread of the spool_queue_t objects it opens, which get their turn one
+// write or read at a time, round robin
+class spool_thread_t : public std::enable_shared_from_this<spool_thread_t>
+{
+public:
+    explicit spool_thread_t(std::shared_ptr<cix::buffer_pool> pool);
+    ~spool_thread_t();
+
+    spool_thread_t(const spool_thread_t&) = delete;
+    spool_thread_t& operator=(const spool_thread_t&) = delete;
+
+    void launch();
+    void stop();  // the spools still open are not worked on anymore
+
+    std::shared_ptr<spool_queue_t> open(
+        std::size_t max_size,
+        std::size_t headroom,
+        std::size_t chunk_size,
+        spool_queue_t::on_ready_t&& on_ready);
+
+private:
+    friend class spool_queue_t;
+
+    void wake(std::shared_ptr<spool_queue_t> queue);
+    void thread_main();
+
+private:
+    const std::shared_ptr<cix::buffer_pool> m_pool;
+    HANDLE m_stop_event;
+    HANDLE m_wake_event;
+    std::unique_ptr<std::thread> m_thread;
+
+    // protected by m_mutex
+    std::mutex m_mutex;
+    bool m_stopped;
+    std::deque<std::shared_ptr<spool_queue_t>> m_pending;
+};
@@ -18,7 +18,7 @@ std::weak_ptr<svc> svc::ms_instance;
 
 
 svc::svc()
-    : m_thread{nullptr}
+    : m_threads{}
     , m_stop_event{nullptr}
 #ifdef APP_ENABLE_SERVICE
     , m_status_handle{nullptr}
@@ -35,6 +35,12 @@ svc::~svc()
 }
 
 
+void svc::set_config(const config_t& config)
+{
+    m_config = config;
+}
+
+
 exit_t svc::init()
 {
     std::wstring module_path;
@@ -88,25 +94,11 @@ exit_t svc::run()
 #endif
 #if !defined(APP_ENABLE_SERVICE) || defined(_DEBUG)
     {
-        const auto exit_code = this->launch_worker_thread();
+        const auto exit_code = this->launch_worker_threads();
         if (exit_code != APP_EXITCODE_OK)
             return exit_code;
 
-        // wait for worker thread to terminate
-        WaitForSingleObject(m_thread, INFINITE);
-
-        // get thread exit code
-        DWORD thread_exit_code = 0;
-        if (m_thread)
-        {
-            if (!GetExitCodeThread(m_thread, &thread_exit_code))
-                thread_exit_code = 0;
-
-            CloseHandle(m_thread);
-            m_thread = nullptr;
-        }
-
-        return static_cast<exit_t>(thread_exit_code);
+        return this->wait_worker_threads();
     }
 #endif
 }
@@ -189,48 +181,145 @@ bool svc::commit_status(state_t new_state, DWORD exit_code, DWORD wait_hint)
 #endif  // #ifdef APP_ENABLE_SERVICE
 
 
-exit_t svc::launch_worker_thread()
+exit_t svc::launch_worker_threads()
 {
-    HANDLE start_event = CreateEvent(nullptr, FALSE, FALSE, nullptr);
-    if (!start_event)
+    assert(m_threads.empty());
+
+    if (m_config.workers > 1 && !m_config.capture_path.empty())
     {
-        LOGERROR("CreateEvent failed (code {})", GetLastError());
-        assert(0);
-        return APP_EXITCODE_API;
+        LOGERROR("traffic capture requires a single worker");
+        return APP_EXITCODE_ARG;
     }
 
+    // process-wide, before any thread gets launched
+    thread_tuning::configure(
+        thread_tuning::role_pipe,
+        {static_cast<thread_tuning::priority_t>(m_config.pipe_thread_priority),
+            m_config.pipe_thread_affinity, m_config.pipe_thread_mmcss != 0});
+    thread_tuning::configure(
+        thread_tuning::role_socks,
+        {static_cast<thread_tuning::priority_t>(m_config.socks_thread_priority),
+            m_config.socks_thread_affinity, m_config.socks_thread_mmcss != 0});
+    thread_tuning::configure(
+        thread_tuning::role_socketio,
+        {static_cast<thread_tuning::priority_t>(
+                m_config.socket_thread_priority),
+            m_config.socket_thread_affinity,
+            m_config.socket_thread_mmcss != 0});
+
     // ensure stop flag is not raised before we start
     ResetEvent(m_stop_event);
 
+    const auto start_time = cix::hrticks_now();
+
+    for (std::size_t index = 0; index < m_config.workers; ++index)
+    {
+        const auto exit_code = this->launch_worker_thread(index);
+
+        // stop the ones launched already, if any
+        if (exit_code != APP_EXITCODE_OK)
+        {
+            SetEvent(m_stop_event);
+            this->wait_worker_threads();
+            return exit_code;
+        }
+
+#ifdef APP_ENABLE_SERVICE
+        // one check point per worker, each of them may take a while
+        if (this->running_as_service())
+            this->commit_status(
+                state_start_pending, 0, svc::worker_start_timeout);
+#endif
+    }
+
+    LOGINFO(
+        "{} worker(s) started in {} ms",
+        m_config.workers,
+        (cix::hrticks_now() - start_time) / cix::hrticks_millisecond);
+    CIX_UNVAR(start_time);  // logging may be compiled out
+
+    return APP_EXITCODE_OK;
+}
+
+
+exit_t svc::launch_worker_thread(std::size_t index)
+{
+    worker_start_t start{nullptr, index, APP_EXITCODE_ERROR};
+
+    start.start_event = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    if (!start.start_event)
+    {
+        LOGERROR("CreateEvent failed (code {})", GetLastError());
+        assert(0);
+        return APP_EXITCODE_API;
+    }
+
     // create and launch thread
-    m_thread = reinterpret_cast<HANDLE>(_beginthreadex(
-        NULL, 0, svc::worker_entry_point, start_event, 0, nullptr));
-    if (!m_thread)
+    const auto thread = reinterpret_cast<HANDLE>(_beginthreadex(
+        NULL, 0, svc::worker_entry_point, &start, 0, nullptr));
+    if (!thread)
     {
         LOGERROR("_beginthreadex failed (code {})", errno);
         assert(0);
-        CloseHandle(start_event);
+        CloseHandle(start.start_event);
         return APP_EXITCODE_API;
     }
 
-    // wait for its bootstrap code to complete
-    const auto wait_res = WaitForSingleObject(start_event, 3000);
+    m_threads.push_back(thread);
+
+    // wait for the worker to be launched; CAUTION: *start* lives on our stack
+    // so the thread must be done with it once we return
+    const auto wait_res = WaitForSingleObject(
+        start.start_event, svc::worker_start_timeout);
     if (wait_res != WAIT_OBJECT_0)
     {
         LOGERROR(
             "failed to start worker thread (result {}; code {})",
             wait_res, GetLastError());
         assert(0);
-        CloseHandle(start_event);
+        SetEvent(m_stop_event);
+        WaitForSingleObject(thread, INFINITE);
+        CloseHandle(start.start_event);
         return APP_EXITCODE_API;
     }
 
-    // wait for some extra time to let the worker thread warming up
-    Sleep(150);
+    CloseHandle(start.start_event);
 
-    CloseHandle(start_event);
+    // the thread exits on its own, see wait_worker_threads()
+    return start.exit_code;
+}
 
-    return APP_EXITCODE_OK;
+
+exit_t svc::wait_worker_threads()
+{
+    DWORD thread_exit_code = 0;
+
+    if (m_threads.empty())
+        return APP_EXITCODE_OK;
+
+    // MAXIMUM_WAIT_OBJECTS is way above the max number of workers, see
+    // config_t::workers
+    WaitForMultipleObjects(
+        static_cast<DWORD>(m_threads.size()), m_threads.data(), TRUE,
+        INFINITE);
+
+    // the exit code of the first worker that failed, if any
+    for (const auto thread : m_threads)
+    {
+        DWORD code = 0;
+
+        if (!GetExitCodeThread(thread, &code))
+            code = 0;
+
+        if (thread_exit_code == 0)
+            thread_exit_code = code;
+
+        CloseHandle(thread);
+    }
+
+    m_threads.clear();
+
+    return static_cast<exit_t>(thread_exit_code);
 }
 
 
@@ -238,24 +327,65 @@ unsigned __stdcall svc::worker_entry_point(void* context)
 {
     CIX_THREAD_SET_NAME_STATIC(GetCurrentThreadId(), "svc");
 
+    const auto index = reinterpret_cast<worker_start_t*>(context)->index;
+
     auto self = svc::instance();  // CAUTION: this means worker owns self too!
     if (!self)
+    {
+        SetEvent(reinterpret_cast<worker_start_t*>(context)->start_event);
         return static_cast<unsigned>(APP_EXITCODE_ERROR);
+    }
 
+    const auto start_time = cix::hrticks_now();
     auto worker = std::make_shared<svc_worker>();
 
-    // notify we are up
-    // handle will be closed by service_main()
+    // the first worker is the one of a single-worker service
+    auto pipe_name = self->m_name;
+    auto config = self->m_config;
+
+    if (index > 0)
     {
-        auto start_event = reinterpret_cast<HANDLE>(context);
-        SetEvent(start_event);
+        pipe_name += L"-" + std::to_wstring(index);
+
+        if (config.channel_tcp_port != 0)
+        {
+            config.channel_tcp_port += static_cast<DWORD>(index);
+
+            if (config.channel_tcp_port > 0xffff)
+            {
+                LOGWARNING(
+                    "no TCP channels for worker {}, port out of range", index);
+                config.channel_tcp_port = 0;
+            }
+        }
     }
 
-    auto exit_code = worker->init(self->m_stop_event, self->m_name);
+    auto exit_code = worker->init(self->m_stop_event, pipe_name, config);
+
+    if (exit_code == APP_EXITCODE_OK)
+        exit_code = worker->launch();
+
+    if (exit_code == APP_EXITCODE_OK)
+    {
+        LOGINFO(
+            "worker {} listening in {} ms",
+            index,
+            (cix::hrticks_now() - start_time) / cix::hrticks_millisecond);
+    }
+    CIX_UNVAR(start_time);  // logging may be compiled out
+
+    // notify launch_worker_thread(), *context* must not be used past this
+    // point; handle will be closed by launch_worker_thread()
+    reinterpret_cast<worker_start_t*>(context)->exit_code = exit_code;
+    SetEvent(reinterpret_cast<worker_start_t*>(context)->start_event);
+    context = nullptr;
 
     if (exit_code == APP_EXITCODE_OK)
         exit_code = worker->main_loop();
 
+    // the others go with it
+    SetEvent(self->m_stop_event);
+
     // explicit release so that correct order is honored
     worker.reset();
     self.reset();
@@ -274,7 +404,7 @@ void WINAPI svc::service_main(DWORD, LPWSTR*)
         return;
     }
 
-    assert(!self->m_thread);
+    assert(self->m_threads.empty());
 
     self->m_status_handle = RegisterServiceCtrlHandlerExW(
         self->m_name.c_str(), svc::service_control, nullptr);
@@ -284,14 +414,15 @@ void WINAPI svc::service_main(DWORD, LPWSTR*)
         return;
     }
 
-    if (!self->commit_status(state_start_pending))
+    if (!self->commit_status(
+            state_start_pending, 0, svc::worker_start_timeout))
     {
         assert(0);
         return;
     }
 
-    // launch worker thread and wait for it to start
-    const auto exit_code = self->launch_worker_thread();
+    // launch worker threads and wait for them to start
+    const auto exit_code = self->launch_worker_threads();
     if (exit_code != APP_EXITCODE_OK)
     {
         self->commit_status(state_stopped, static_cast<DWORD>(exit_code));
@@ -306,21 +437,10 @@ void WINAPI svc::service_main(DWORD, LPWSTR*)
         return;
     }
 
-    // wait for worker thread to terminate
-    WaitForSingleObject(self->m_thread, INFINITE);
-
-    // get thread exit code
-    DWORD thread_exit_code = 0;
-    if (self->m_thread)
-    {
-        if (!GetExitCodeThread(self->m_thread, &thread_exit_code))
-            thread_exit_code = 0;
-
-        CloseHandle(self->m_thread);
-        self->m_thread = nullptr;
-    }
+    // wait for worker threads to terminate
+    const auto thread_exit_code = self->wait_worker_threads();
 
-    self->commit_status(state_stopped, thread_exit_code);
+    self->commit_status(state_stopped, static_cast<DWORD>(thread_exit_code));
 }
 #endif  // #ifdef APP_ENABLE_SERVICE
 
@@ -337,7 +457,8 @@ DWORD WINAPI svc::service_control(DWORD control, DWORD, LPVOID, LPVOID)
         case SERVICE_CONTROL_SHUTDOWN:
         {
             auto instance = svc::instance();
-            if (instance && instance->m_stop_event && instance->m_thread)
+            if (instance && instance->m_stop_event &&
+                !instance->m_threads.empty())
             {
                 instance->commit_status(state_stop_pending);
                 SetEvent(instance->m_stop_event);
@@ -401,7 +522,7 @@ bool svc::auto_name(std::wstring& out_path, std::wstring& out_name)
 
 
 #ifdef APP_ENABLE_SERVICE
-exit_t svc::install(bool start)
+exit_t svc::install(bool start, const config_t& config)
 {
     cix::unique_sc_handle mgr_handle;
     cix::unique_sc_handle svc_handle;
@@ -440,6 +561,16 @@ exit_t svc::install(bool start)
         }
     }
 
+    // has to be done before starting the service
+    if (!config.save_registry(svc_name))
+        return APP_EXITCODE_API;
+
+#ifdef APP_PERF_ENABLED
+    // not fatal, the service runs the same without them
+    if (!perf_counters::install(svc_path))
+        LOGWARNING("performance counters will not be available");
+#endif
+
     if (start && !StartServiceW(svc_handle.get(), 0, nullptr))
     {
         LOGERROR("StartService failed (error {})", GetLastError());
@@ -545,6 +676,17 @@ exit_t svc::uninstall(std::wstring svc_name, bool stop_first)
         }
     }
 
+#ifdef APP_PERF_ENABLED
+    {
+        // registered by install(), from this very executable
+        std::wstring svc_path;
+        std::wstring auto_svc_name;
+
+        if (svc::auto_name(svc_path, auto_svc_name))
+            perf_counters::uninstall(svc_path);
+    }
+#endif
+
     // explicit release so order is correct
     svc_handle.reset();
     mgr_handle.reset();
@@ -4,6 +4,17 @@
 #pragma once
 
 
+// The service, or the console application, hosting *config_t::workers*
+// svc_worker instances, each on a thread of its own
+//
+// * a worker has its own named pipe, socks_proxy and socketio so that workers
+//   share no lock; the first one serves the pipe named after the service, the
+//   next ones get a "-<index>" suffix (e.g. "winlfo32-1"), and the TCP port of
+//   the first one plus their index if *channel_tcp_port* is set
+// * traffic capture (see capture.h) requires a single worker, its records
+//   would not tell the workers apart
+// * other options apply to each worker, the memory budgets included
+// * the service stops as soon as any of its workers does
 class svc : public std::enable_shared_from_this<svc>
 {
 private:
@@ -22,6 +33,9 @@ public:
     svc();
     ~svc();
 
+    // must be called before init()
+    void set_config(const config_t& config);
+
     exit_t init();
     exit_t run();
     void uninit();
@@ -38,14 +52,33 @@ public:
 
     // static utils - service
 #ifdef APP_ENABLE_SERVICE
-    static exit_t install(bool start);
+    // non-default values of *config* are stored in the registry
+    static exit_t install(bool start, const config_t& config);
     static exit_t uninstall(std::wstring name, bool stop_first);
     // static exit_t start();
 #endif
 
 private:
-    // worker thread
-    exit_t launch_worker_thread();
+    // signaled once the worker is launched and listening, or failed to, so
+    // that the service is not reported running before it can serve clients
+    struct worker_start_t
+    {
+        HANDLE start_event;
+        std::size_t index;
+        exit_t exit_code;  // of svc_worker::init() and launch()
+    };
+
+    // how long launch_worker_thread() waits for a worker to start
+    enum : DWORD
+    {
+        worker_start_timeout = 15000,  // milliseconds
+    };
+
+private:
+    // worker threads
+    exit_t launch_worker_threads();
+    exit_t launch_worker_thread(std::size_t index);
+    exit_t wait_worker_threads();
     static unsigned __stdcall worker_entry_point(void* context);
 
     // service manager interface
@@ -63,10 +96,11 @@ private:
 private:
     // service properties
     std::wstring m_name;
+    config_t m_config;
 
-    // worker thread
-    HANDLE m_thread;
-    HANDLE m_stop_event;
+    // worker threads
+    std::vector<HANDLE> m_threads;
+    HANDLE m_stop_event;  // all the workers
 
     // service state
 #ifdef APP_ENABLE_SERVICE
@@ -7,8 +7,27 @@
 svc_worker::svc_worker()
     : m_stop_event{nullptr}
     , m_recv_event{nullptr}
-    , m_pipe(std::make_shared<cix::win_namedpipe_server>())
+    , m_pipe(std::make_shared<pipe_transport>())
     , m_socks_proxy(std::make_shared<socks_proxy>())
+    , m_buffer_pool(std::make_shared<cix::buffer_pool>())
+    , m_mem_budget(std::make_shared<mem_budget_t>())
+    , m_setup_timeout{0}
+    , m_resume_timeout{0}
+    , m_message_mode{false}
+    , m_replay_size{0}
+    , m_spool_max_size{0}
+    , m_last_timers{0}
+    , m_socks_timers{false}
+    , m_start_time{cix::ticks_now()}
+    , m_counters{}
+    , m_response_latency()
+#ifdef APP_PERF_ENABLED
+    , m_perf_instance{0}
+#endif
+    , m_setup_timers(svc_worker::timer_resolution)
+    , m_resume_timers(svc_worker::timer_resolution)
+    , m_ping_timers(svc_worker::timer_resolution)
+    , m_timers_due{0}
 {
     m_recv_event = CreateEvent(nullptr, TRUE, FALSE, nullptr);  // manual reset
     if (!m_recv_event)
@@ -18,14 +37,28 @@ svc_worker::svc_worker()
 
 svc_worker::~svc_worker()
 {
+#ifdef APP_PERF_ENABLED
+    perf_counters::remove_instance(m_perf_instance);
+#endif
+
     m_socks_proxy->set_listener(nullptr);
     m_pipe->set_listener(nullptr);
 
+    if (m_tcp)
+        m_tcp->set_listener(nullptr);
+
     m_socks_proxy->stop();
     m_pipe->stop();
 
+    if (m_tcp)
+        m_tcp->stop();
+
+    if (m_spool_thread)
+        m_spool_thread->stop();
+
     m_socks_proxy.reset();
     m_pipe.reset();
+    m_tcp.reset();
 
     CloseHandle(m_recv_event);
 
@@ -33,11 +66,109 @@ svc_worker::~svc_worker()
 }
 
 
-exit_t svc_worker::init(HANDLE stop_event, const std::wstring& pipe_base_name_)
+exit_t svc_worker::init(
+    HANDLE stop_event,
+    const std::wstring& pipe_base_name_,
+    const config_t& config)
 {
     assert(stop_event);
     m_stop_event = stop_event;
 
+    // in message mode, a read must hold a whole frame, see
+    // proto::chansetup_message_frames
+    m_message_mode = config.pipe_message_mode != 0;
+
+    m_pipe->server()->set_io_buffer_size(config.pipe_buffer_size);
+    m_pipe->server()->set_max_read_size(
+        m_message_mode ?
+            std::max(
+                config.pipe_max_read_size,
+                static_cast<DWORD>(proto::max_frame_size)) :
+            config.pipe_max_read_size);
+    m_pipe->server()->set_max_pending_writes(config.pipe_pending_writes);
+    m_pipe->server()->set_max_write_size(config.pipe_max_write_size);
+    m_pipe->server()->set_thread_init([]() {
+        thread_tuning::apply(thread_tuning::role_pipe);
+        alloc_profile::set_thread_stage(alloc_profile::stage_pipe);
+    });
+
+    if (config.channel_tcp_port != 0)
+    {
+        m_tcp = std::make_shared<tcp_transport>();
+        m_tcp->set_port(static_cast<std::uint16_t>(config.channel_tcp_port));
+        m_tcp->set_io_buffer_size(config.pipe_buffer_size);
+        m_tcp->set_socket_buffer_sizes(
+            static_cast<int>(config.socket_rcvbuf),
+            static_cast<int>(config.socket_sndbuf));
+    }
+
+    m_socks_proxy->set_input_buffer_size(config.socket_input_buffer_size);
+    m_socks_proxy->set_recv_headroom(proto::socks_headroom);
+    m_socks_proxy->set_socket_buffer_sizes(
+        static_cast<int>(config.socket_rcvbuf),
+        static_cast<int>(config.socket_sndbuf));
+    m_socks_proxy->set_socket_tcp_options(
+        config.socket_nodelay != 0,
+        config.socket_keepalive * cix::ticks_second,
+        config.socket_loopback_fast_path != 0);
+    m_socks_proxy->set_socketio_engine(
+        config.socket_rio ? socketio::engine_rio : socketio::default_engine);
+    m_socks_proxy->set_session_timeouts(
+        config.socks_handshake_timeout * cix::ticks_second,
+        config.socks_idle_timeout * cix::ticks_second);
+    m_socks_proxy->set_connect_failure_cache(
+        config.connect_failure_ttl * cix::ticks_second,
+        config.connect_failure_entries);
+    m_socks_proxy->set_dns_cache(
+        config.dns_cache_ttl * cix::ticks_second,
+        config.dns_negative_ttl * cix::ticks_second,
+        config.dns_cache_entries);
+    m_socks_proxy->set_resolve_timeout(config.dns_timeout * 1000);
+    m_socks_proxy->set_connect_limits(
+        config.connect_max_inflight,
+        config.connect_max_per_client,
+        config.connect_max_queued);
+
+    if (!config.warm_targets.empty())
+    {
+        std::vector<warm_pool_t::target_t> targets;
+
+        // validated by config_t already
+        if (warm_pool_t::parse_targets(
+            xstr::narrow_to_utf8_lenient(config.warm_targets), targets))
+        {
+            m_socks_proxy->set_warm_pool(
+                std::move(targets), config.warm_pool_size,
+                config.warm_pool_idle * cix::ticks_second);
+        }
+    }
+
+    // config values are in KiB per second
+    m_socks_proxy->set_rate_limits(
+        std::uint64_t(config.rate_client_limit) * 1024,
+        std::uint64_t(config.rate_session_limit) * 1024);
+
+    // config values are in MiB
+    m_mem_budget->set_budgets(
+        std::size_t(config.mem_session_budget) * 1024 * 1024,
+        std::size_t(config.mem_client_budget) * 1024 * 1024,
+        std::size_t(config.mem_global_budget) * 1024 * 1024);
+    m_socks_proxy->set_mem_budget(m_mem_budget);
+
+    // config value is in milliseconds
+    if (config.slow_stage_threshold > 0)
+    {
+        m_session_trace = std::make_shared<session_trace_t>();
+        m_session_trace->configure(config.slow_stage_threshold);
+        m_socks_proxy->set_session_trace(m_session_trace);
+    }
+
+    m_setup_timeout = config.channel_setup_timeout * cix::ticks_second;
+    m_resume_timeout = config.session_resume_timeout * cix::ticks_second;
+    m_replay_size = config.session_replay_size;
+    m_spool_max_size = std::size_t(config.spool_session_max) * 1024 * 1024;
+    m_capture_path = config.capture_path;
+
     m_pipe_path = L"\\\\.\\pipe\\";
 
     if (!pipe_base_name_.empty())
@@ -66,34 +197,105 @@ exit_t svc_worker::init(HANDLE stop_event, const std::wstring& pipe_base_name_)
         }
     }
 
+    m_buffer_pool->reserve(
+        config.pipe_buffer_size, svc_worker::warm_pipe_buffers);
+    m_buffer_pool->reserve(
+        proto::socks_headroom + config.socket_input_buffer_size,
+        svc_worker::warm_socket_buffers);
+    m_buffer_pool->reserve(
+        socks_batch_max_size, svc_worker::warm_batch_buffers);
+    m_buffer_pool->reserve(
+        proto::control_packet_max_size, svc_worker::warm_control_buffers);
+
     return APP_EXITCODE_OK;
 }
 
 
-exit_t svc_worker::main_loop()
+exit_t svc_worker::launch()
 {
     assert(m_stop_event);
-    assert(m_recv_event);
-
-    const HANDLE events[] = { m_stop_event, m_recv_event };
 
     m_socks_proxy->set_listener(this->shared_from_this());
+    m_socks_proxy->set_buffer_pool(m_buffer_pool);
 
-    m_pipe->set_flags(
+    // APP_NAMEDPIPE_APC can be defined at build time to fall back to the
+    // completion routines mode of the pipe server
+    m_pipe->server()->set_flags(
         cix::win_namedpipe_server::flag_accept_remote |
-        cix::win_namedpipe_server::flag_impersonate);
-    m_pipe->set_path(m_pipe_path);
+#ifndef APP_NAMEDPIPE_APC
+        cix::win_namedpipe_server::flag_iocp |
+#endif
+        cix::win_namedpipe_server::flag_impersonate |
+        (m_message_mode ?
+            cix::win_namedpipe_server::flag_message :
+            cix::win_namedpipe_server::flag_default));
+    m_pipe->server()->set_path(m_pipe_path);
+    m_pipe->server()->set_buffer_pool(m_buffer_pool);
     m_pipe->set_listener(this->shared_from_this());
 
+    if (m_tcp)
+    {
+        m_tcp->set_buffer_pool(m_buffer_pool);
+        m_tcp->set_listener(this->shared_from_this());
+    }
+
+    // before any traffic so that a capture is complete
+    if (!m_capture_path.empty() && !capture::start(m_capture_path))
+        return APP_EXITCODE_ERROR;
+
+    // explicitly enabled, better fail than silently go without it
+    if (m_tcp && !m_tcp->launch())
+    {
+        if (!m_capture_path.empty())
+            capture::stop();
+
+        return APP_EXITCODE_ERROR;
+    }
+
+    // before the pipe, channels get it at creation
+    if (m_spool_max_size != 0)
+    {
+        m_spool_thread = std::make_shared<spool_thread_t>(m_buffer_pool);
+        m_spool_thread->launch();
+    }
+
     m_socks_proxy->launch();
     m_pipe->launch();
 
+#ifdef APP_PERF_ENABLED
+    // the instance is named after the pipe, which is unique to the worker
+    m_perf_instance = perf_counters::add_instance(
+        std::wstring(xpath::name(m_pipe_path)),
+        [this](perf_counters::values_t& values) {
+            this->collect_perf_counters(values);
+        });
+#endif
+
+    // not fatal, instances that failed are retried by the pipe server
+    if (!m_pipe->server()->wait_listening(svc_worker::listen_wait_timeout))
+        LOGWARNING(
+            "pipe {} is not fully listening yet",
+            xstr::narrow_to_utf8_lenient(m_pipe_path));
+
+    return APP_EXITCODE_OK;
+}
+
+
+exit_t svc_worker::main_loop()
+{
+    assert(m_stop_event);
+    assert(m_recv_event);
+
+    const HANDLE events[] = { m_stop_event, m_recv_event };
+
     for (;;)
     {
         const auto wait_res = WaitForMultipleObjects(
             static_cast<DWORD>(cix::countof(events)),
             reinterpret_cast<const HANDLE*>(&events),
-            FALSE, INFINITE);
+            FALSE, this->timers_wait_timeout());
+
+        wakeups::count();
 
         if (wait_res == WAIT_OBJECT_0 + 0)  // stop event
         {
@@ -103,60 +305,329 @@ exit_t svc_worker::main_loop()
         {
             this->process_received_data();
         }
-        // else if (wait_res == WAIT_TIMEOUT)
-        // {
-        //     // TODO: disconnect expired non-setup channels
-        // }
-        else
+        else if (wait_res != WAIT_TIMEOUT)
         {
             LOGERROR(
                 "worker failed to enter in waiting mode (result {}; error {})",
                 wait_res, GetLastError());
             return APP_EXITCODE_API;
         }
+
+        // even if busy, timers are not to wait for the pipe to be idle
+        this->expire_timers();
+    }
+
+#ifdef APP_PERF_ENABLED
+    perf_counters::remove_instance(m_perf_instance);
+    m_perf_instance = 0;
+#endif
+
+#ifdef APP_LOGGING_ENABLED
+    {
+        std::scoped_lock lock(m_mutex);
+
+        for (const auto& chan_it : m_channels)
+        {
+            const auto& transport = chan_it.second->transport;
+            channel_transport::instance_stats_t pipe_stats;
+
+            if (!transport->get_instance_stats(chan_it.first, pipe_stats))
+                continue;
+
+            LOGDEBUG(
+                "{} instance {}: {} writes completed, window {} "
+                "({} pending, {} bytes in flight, {} queued), "
+                "latency {}us (base {}us)",
+                transport->name(), chan_it.first, pipe_stats.writes_completed,
+                pipe_stats.pending_writes_limit, pipe_stats.pending_writes,
+                pipe_stats.bytes_in_flight, pipe_stats.output_queue_size,
+                pipe_stats.write_latency_us, pipe_stats.write_latency_min_us);
+        }
     }
+#endif
 
-    // close pipe and its instances
+    // close transports and their instances
     this->disconnect_all();
     m_pipe->set_listener(nullptr);
     m_pipe->stop();
 
+    if (m_tcp)
+    {
+        m_tcp->set_listener(nullptr);
+        m_tcp->stop();
+    }
+
+    // spools got closed along with their channels
+    if (m_spool_thread)
+        m_spool_thread->stop();
+
+    if (!m_capture_path.empty())
+        capture::stop();
+
     // reset internal state
     {
         std::scoped_lock lock(m_mutex);
 
         m_channels.clear();
+        m_ready_channels.clear();
         m_clients.clear();
+        m_setup_timers.clear();
+        m_resume_timers.clear();
+        m_ping_timers.clear();
+    }
+
+#ifdef APP_LOGGING_ENABLED
+    {
+        const auto pool_stats = m_buffer_pool->stats();
+
+        LOGDEBUG(
+            "buffer pool: {} hits, {} misses, {} recycled, {} dropped, "
+            "{} pooled ({} bytes; peak {} bytes)",
+            pool_stats.hits, pool_stats.misses, pool_stats.recycled,
+            pool_stats.dropped, pool_stats.pooled, pool_stats.pooled_bytes,
+            pool_stats.peak_bytes);
+    }
+
+    {
+        const auto socks_stats = m_socks_proxy->stats();
+
+        const std::pair<const char*, latency_histogram_t::summary_t>
+        latencies[] = {
+            { "request queue", socks_stats.request_queue_latency },
+            { "request send", socks_stats.request_send_latency },
+            { "response", m_response_latency.summary() },
+            { "connect", socks_stats.connect_latency },
+        };
+
+        for (const auto& [name, summary] : latencies)
+        {
+            LOGDEBUG(
+                "{} latency: {} samples, p50 {}us, p90 {}us, p99 {}us, "
+                "p99.9 {}us, max {}us",
+                name, summary.count, summary.p50, summary.p90, summary.p99,
+                summary.p999, summary.max);
+        }
     }
+#endif
 
     return APP_EXITCODE_OK;
 }
 
 
+DWORD svc_worker::timers_wait_timeout()
+{
+    // no wake up at all while there is no timer to check, and none until the
+    // next one is due otherwise; a timer scheduled by another thread in the
+    // meantime wakes main_loop() up if it is due earlier, see wake_timers()
+
+    cix::ticks_t due = 0;
+
+    const auto earliest =
+        [&due](cix::ticks_t next) {
+            if (next != 0 && (due == 0 || next < due))
+                due = next;
+        };
+
+    // before m_mutex, socks_proxy locks its own
+    if (m_socks_timers)
+        earliest(m_socks_proxy->next_session_due());
+
+    {
+        std::scoped_lock lock(m_mutex);
+
+        earliest(m_setup_timers.next_due());
+        earliest(m_resume_timers.next_due());
+        earliest(m_ping_timers.next_due());
+
+        m_timers_due = due;
+    }
+
+    if (due == 0)
+        return INFINITE;
+
+    // see expire_timers()
+    due = std::max(due, m_last_timers + svc_worker::timer_resolution);
+
+    const auto now = cix::ticks_now();
+
+    return (due > now) ? static_cast<DWORD>(due - now) : 0;
+}
+
+
+void svc_worker::expire_timers()
+{
+    const auto now = cix::ticks_now();
+
+    if (cix::ticks_elapsed(m_last_timers, now) < svc_worker::timer_resolution)
+        return;
+
+    m_last_timers = now;
+
+    std::vector<timer_wheel_t::key_t> fired;
+    std::vector<std::pair<pipe_token_t, bool>> expired;  // has channel
+    std::vector<timer_wheel_t::key_t> expired_clients;
+    std::vector<std::shared_ptr<channel_t>> ping_channels;
+
+    {
+        std::scoped_lock lock(m_mutex);
+
+        m_setup_timers.advance(now, fired);
+
+        for (const auto pipe_token : fired)
+        {
+            const auto chan_it = m_channels.find(pipe_token);
+
+            // pipe instance did not even send anything
+            if (chan_it == m_channels.end())
+                expired.emplace_back(pipe_token, false);
+            else if (chan_it->second->client_id == proto::invalid_client_id)
+                expired.emplace_back(pipe_token, true);
+        }
+
+        m_resume_timers.advance(now, expired_clients);
+
+        // a write channel that is still there gets pinged, and so on
+        fired.clear();
+        m_ping_timers.advance(now, fired);
+
+        for (const auto pipe_token : fired)
+        {
+            const auto chan_it = m_channels.find(pipe_token);
+
+            if (chan_it != m_channels.end())
+            {
+                ping_channels.push_back(chan_it->second);
+                m_ping_timers.schedule(
+                    pipe_token, now + svc_worker::ping_interval);
+            }
+        }
+    }
+
+    for (const auto& channel : ping_channels)
+    {
+        std::scoped_lock chan_lock(channel->mutex);
+
+        channel->send_ping();
+    }
+
+    for (const auto& [ pipe_token, has_channel ] : expired)
+    {
+        LOGTRACE("PIPE INSTANCE SETUP TIMEOUT");
+
+        if (has_channel)
+            this->erase_channel_and_client(pipe_token, true);
+        else
+            this->transport_of(pipe_token)->disconnect_instance(pipe_token);
+    }
+
+    for (const auto client_id : expired_clients)
+    {
+        std::shared_ptr<client_t> client;
+
+        {
+            std::scoped_lock lock(m_mutex);
+
+            const auto client_it = m_clients.find(client_id);
+            if (client_it != m_clients.end())
+                client = client_it->second;
+        }
+
+        if (!client)
+            continue;
+
+        // may have been resumed in the meantime
+        {
+            std::scoped_lock client_lock(client->mutex);
+
+            if (!client->detached)
+                continue;
+        }
+
+        LOGTRACE("CLIENT {:#x} RESUME TIMEOUT", client_id);
+
+        this->erase_client(client_id, true);
+    }
+
+    if (m_socks_timers)
+        m_socks_timers = m_socks_proxy->expire_sessions();
+}
+
+
+void svc_worker::wake_timers(cix::ticks_t deadline)
+{
+    // CAUTION: m_mutex must be locked by caller
+    // main loop may be waiting for a later deadline, or with no timeout
+    if (m_timers_due == 0 || deadline < m_timers_due)
+    {
+        m_timers_due = deadline;
+        SetEvent(m_recv_event);
+    }
+}
+
+
 void svc_worker::process_received_data()
 {
-    std::scoped_lock lock(m_mutex);
+    ALLOCSCOPE(stage_parse);
 
+    std::vector<std::shared_ptr<channel_t>> ready_channels;
     std::set<pipe_token_t> channels_to_erase;
-    bytes_t packet;
 
-    ResetEvent(m_recv_event);
+    // only visit the channels that received data since last call, as queued by
+    // on_transport_recv()
+    {
+        std::scoped_lock lock(m_mutex);
 
-    packet.reserve(cix::win_namedpipe_server::io_buffer_default_size);
+        ResetEvent(m_recv_event);
 
-    for (auto& [ pipe_token, channel ] : m_channels)
-    {
-        if (channel->data_recv && !channel->input_buffer.empty())
+        ready_channels.reserve(m_ready_channels.size());
+
+        for (const auto& pipe_token : m_ready_channels)
         {
-            bool must_erase = false;
+            auto chan_it = m_channels.find(pipe_token);
+            if (chan_it != m_channels.end())  // not erased in the meantime
+                ready_channels.push_back(chan_it->second);
+        }
+
+        m_ready_channels.clear();
+    }
 
+    // m_mutex is not held while parsing, so the pipe can keep feeding the
+    // channels, and SOCKS data keep flowing the other way
+    for (const auto& channel : ready_channels)
+    {
+        channel->pull_recv(*m_buffer_pool);
+
+        bool must_erase = false;
+
+        if (!channel->input_buffer.empty())
+        {
             while (this->process_channel_received_data(
-                channel, packet, &must_erase) && !must_erase)
+                channel, false, &must_erase) && !must_erase)
             { ; }
+        }
+
+        // one packet per message, parsed in place since the stream is empty
+        // by now, unless client did not keep its word
+        for (auto& message : channel->recv_messages)
+        {
+            if (!must_erase)
+            {
+                m_buffer_pool->release(
+                    channel->input_buffer.feed(std::move(message)));
 
-            if (must_erase)
-                channels_to_erase.insert(pipe_token);
+                this->process_channel_received_data(
+                    channel, true, &must_erase);
+            }
+            else
+            {
+                m_buffer_pool->release(std::move(message));
+            }
         }
+
+        channel->recv_messages.clear();
+
+        if (must_erase)
+            channels_to_erase.insert(channel->pipe_token);
     }
 
     for (const auto& pipe_token : channels_to_erase)
@@ -165,13 +636,48 @@ void svc_worker::process_received_data()
 
 
 bool svc_worker::process_channel_received_data(
-    std::shared_ptr<channel_t> channel, bytes_t& packet, bool* out_must_erase)
+    std::shared_ptr<channel_t> channel,
+    bool whole_message,
+    bool* out_must_erase)
 {
-    packet.clear();
+    // CAUTION: *packet* points to channel's input buffer, which must not be
+    // fed until we are done with this packet
+    proto::packet_view_t packet;
+
     *out_must_erase = false;
 
-    const auto proto_error = proto::extract_next_packet(
-        channel->input_buffer, packet);
+    // *whole_message*: the input buffer is exactly one packet, see
+    // proto::chansetup_message_frames
+    const auto proto_error = whole_message ?
+        proto::extract_whole_packet(
+            channel->input_buffer, packet, nullptr, channel->crc_mode,
+            proto::max_packet_size_of(channel->caps)) :
+        proto::extract_next_packet(
+            channel->input_buffer, packet, nullptr, channel->crc_mode,
+            proto::max_packet_size_of(channel->caps));
+
+    if (proto_error == proto::ok)
+    {
+        m_counters.pipe_packets_in.fetch_add(1, std::memory_order_relaxed);
+
+        ETWTRACE("PacketParsed", etw::keyword_proto,
+            etw::u64(channel->pipe_token, "PipeToken"),
+            etw::u8(
+                static_cast<std::uint8_t>(packet.header->opcode), "Opcode"),
+            etw::u32(packet.header->uid, "Uid"),
+            etw::u32(packet.header->len, "Length"));
+    }
+    else if (proto_error != proto::error_incomplete &&
+        proto_error < m_counters.proto_errors.size())
+    {
+        m_counters.proto_errors[proto_error].fetch_add(
+            1, std::memory_order_relaxed);
+
+        ETWTRACE("PacketError", etw::keyword_proto,
+            etw::u64(channel->pipe_token, "PipeToken"),
+            etw::u32(
+                static_cast<std::uint32_t>(proto_error), "Error"));
+    }
 
     switch (proto_error)
     {
@@ -192,7 +698,7 @@ bool svc_worker::process_channel_received_data(
             return false;  // stop processing
     }
 
-    const auto& header = *reinterpret_cast<proto::header_t*>(packet.data());
+    const auto& header = *packet.header;
 
     this->process_channel_received_packet(
         channel, packet, header, out_must_erase);
@@ -204,7 +710,7 @@ bool svc_worker::process_channel_received_data(
 
 void svc_worker::process_channel_received_packet(
     std::shared_ptr<channel_t> channel,
-    const bytes_t& packet,
+    const proto::packet_view_t& packet,
     const proto::header_t& header,
     bool* out_must_erase)
 {
@@ -239,6 +745,9 @@ void svc_worker::process_channel_received_packet(
             return;
 
         case proto::op_channel_setup_ack:
+        case proto::op_socks_batch:
+        case proto::op_socks_lz4:
+        case proto::op_socks_udp_associated:
             // client should not send this
             *out_must_erase = true;
             return;
@@ -247,9 +756,14 @@ void svc_worker::process_channel_received_packet(
             assert(0);  // server-side does not need to handle this
             return;
 
+        case proto::op_stats:
+            this->process_channel_received_stats_packet(
+                channel, packet, header, out_must_erase);
+            return;
+
         case proto::op_ping:
             this->process_channel_received_ping_packet(
-                channel, header, out_must_erase);
+                channel, packet, header, out_must_erase);
             return;
 
         case proto::op_socks:
@@ -263,19 +777,38 @@ void svc_worker::process_channel_received_packet(
                 channel, packet, header, out_must_erase);
             return;
 
+        case proto::op_socks_flow:
+            this->process_channel_received_socks_flow_packet(
+                channel, packet, header, out_must_erase);
+            return;
+
+        case proto::op_socks_udp:
+            this->process_channel_received_socks_udp_packet(
+                channel, packet, header, out_must_erase);
+            return;
+
+        case proto::op_socks_resume:
+            this->process_channel_received_socks_resume_packet(
+                channel, packet, header, out_must_erase);
+            return;
+
         case proto::op_uninstall_self:
             this->process_channel_received_uninstall_self_packet();
             return;
 
         default:
         {
-            assert(0);
+            // unknown opcode, passed through by proto::extract_next_packet()
             auto write_channel = this->find_write_channel(channel);
             if (write_channel)
             {
+                std::scoped_lock chan_lock(write_channel->mutex);
+
                 write_channel->send(
-                    m_pipe,
-                    proto::make_status(header.uid, proto::status_unsupported));
+                    proto::make_status(
+                        header.uid, proto::status_unsupported,
+                        m_buffer_pool->acquire(
+                            proto::control_packet_max_size)));
             }
             else
             {
@@ -289,14 +822,14 @@ void svc_worker::process_channel_received_packet(
 
 void svc_worker::process_channel_setup(
     std::shared_ptr<channel_t> channel,
-    const bytes_t& packet,
+    const proto::packet_view_t& packet,
     const proto::header_t& header,
     bool* out_must_erase)
 {
     assert(channel->is_just_connected());
 
     auto _configure_channel =
-        [](std::shared_ptr<channel_t> channel,
+        [this](std::shared_ptr<channel_t> channel,
             clientid_t client_id,
             proto::channel_setup_flags_t flags)
         {
@@ -306,114 +839,536 @@ void svc_worker::process_channel_setup(
             channel->client_id = client_id;
             channel->config_flags = chanconfig_none;
 
+            // requested capabilities we do not know are silently dropped, and
+            // so is chansetup_resume if disabled
+            channel->caps = flags & proto::chansetup_caps_supported;
+            if (m_resume_timeout == 0)
+                channel->caps &= ~proto::chansetup_resume;
+
+            // messages only exist on a named pipe in message mode, and only
+            // fit in a read once capped
+            if (!m_message_mode ||
+                tcp_transport::is_tcp_token(channel->pipe_token) ||
+                !(channel->caps & proto::chansetup_frame_cap))
+            {
+                channel->caps &= ~proto::chansetup_message_frames;
+            }
+
             if (flags & proto::chansetup_read)  // client-side
                 channel->config_flags |= chanconfig_write;  // server-side
 
             if (flags & proto::chansetup_write)
                 channel->config_flags |= chanconfig_read;
+
+            // a channel client reads from gets pinged as soon as it is set
+            // up, so that its windows get sized early
+            if ((channel->caps & proto::chansetup_ping_rtt) &&
+                (channel->config_flags & chanconfig_write))
+            {
+                m_ping_timers.schedule(channel->pipe_token, cix::ticks_now());
+            }
         };
 
     // note: proto::payload_channel_setup_t values already net2host()'ed by
     // proto::extract_next_packet()
-    const auto& payload = *reinterpret_cast<
-        const proto::payload_channel_setup_t*>(
-            packet.data() + sizeof(proto::header_t));
+    const auto& payload =
+        packet.payload_as<proto::payload_channel_setup_t>();
+
+    // the pipe instance may have been closed while its data got parsed, in
+    // which case channel must not be attached to anything
+    auto _is_channel_registered =
+        [this](const std::shared_ptr<channel_t>& channel) -> bool
+        {
+            // CAUTION: m_mutex must be locked by caller
+            const auto chan_it = m_channels.find(channel->pipe_token);
+            return chan_it != m_channels.end() && chan_it->second == channel;
+        };
+
+    // chansetup_resume along with a former client id: that client is resumed,
+    // or a new one is made if it is gone already
+    const bool resume =
+        (payload.flags & proto::chansetup_resume) && m_resume_timeout != 0;
 
     clientid_t client_id = proto::invalid_client_id;
+    std::shared_ptr<client_t> client;
+    std::vector<bytes_t> resume_packets;
+
+    if (payload.client_id != 0)
+    {
+        std::scoped_lock lock(m_mutex);
+
+        auto client_it = m_clients.find(payload.client_id);
+        if (client_it != m_clients.end())
+            client = client_it->second;
+    }
 
-    if (payload.client_id == 0)  // new client
+    if (!client && (payload.client_id == 0 || resume))  // new client
     {
+        std::scoped_lock lock(m_mutex);
+
+        if (!_is_channel_registered(channel))
+        {
+            *out_must_erase = true;
+            return;
+        }
+
         do { client_id = proto::generate_client_id(); }
         while (m_clients.find(client_id) != m_clients.end());
 
         _configure_channel(channel, client_id, payload.flags);
+        m_setup_timers.cancel(channel->pipe_token);
 
         // create client object (client id was null)
-        auto chan_read =
-            (channel->config_flags & chanconfig_read) ? channel : nullptr;
-        auto chan_write =
-            (channel->config_flags & chanconfig_write) ? channel : nullptr;
         m_clients.emplace(
-            client_id,
-            std::make_shared<client_t>(client_id, chan_read, chan_write));
+            client_id, std::make_shared<client_t>(client_id, channel));
     }
     else
     {
-        auto client_it = m_clients.find(payload.client_id);
-
-        if (client_it == m_clients.end())
+        if (!client)
         {
             *out_must_erase = true;
             return;
         }
-        else
+
+        assert(client->id == payload.client_id);
+        client_id = payload.client_id;
+
+        // the former channels of a resuming client may not all be closed yet
+        if (resume)
+            this->detach_client(client_id);
+
+        std::scoped_lock client_lock(client->mutex);
+
+        // an additional channel for this client, as long as it does not
+        // have too many already
+        if (client->erased ||
+            (payload.flags & proto::chansetup_read &&
+                client->chans_write.size() >= max_client_channels) ||
+            (payload.flags & proto::chansetup_write &&
+                client->chans_read.size() >= max_client_channels))
         {
-            auto client = client_it->second;
+            *out_must_erase = true;
+            return;
+        }
 
-            assert(client->id == client_it->first);
-            client_id = payload.client_id;
+        {
+            std::scoped_lock lock(m_mutex);
 
-            // ensure client is not already setup, or that there is no setup
-            // collision
-            if ((payload.flags & proto::chansetup_read && client->chan_write) ||
-                (payload.flags & proto::chansetup_write && client->chan_read))
+            if (!_is_channel_registered(channel))
             {
                 *out_must_erase = true;
                 return;
             }
 
             _configure_channel(channel, payload.client_id, payload.flags);
+            m_setup_timers.cancel(channel->pipe_token);
 
-            if (channel->config_flags & chanconfig_read)
+            if (client->detached)
             {
-                assert(!client->chan_read);
-                client->chan_read = channel;
+                client->detached = false;
+                m_resume_timers.cancel(client_id);
             }
+        }
+
+        if (!client->resumable)
+            channel->caps &= ~proto::chansetup_resume;
+
+        client->add_channel(channel);
+
+        // the SOCKS connections held, listed on the first write channel
+        if (client->resume_pending &&
+            channel->config_flags & chanconfig_write)
+        {
+            client->resume_pending = false;
 
-            if (channel->config_flags & chanconfig_write)
+            for (const auto& [ socks_id, socks_resume ] : client->socks_resume)
             {
-                assert(!client->chan_write);
-                client->chan_write = channel;
+                resume_packets.push_back(
+                    proto::make_socks_resume(
+                        socks_id, socks_resume.rx_offset));
             }
+
+            resume_packets.push_back(
+                proto::make_socks_resume(proto::invalid_socks_id, 0));
         }
     }
 
     assert(client_id != proto::invalid_client_id);
     if (client_id != proto::invalid_client_id)
     {
+        // reply with the agreed capabilities only if client asked for them,
+        // older clients expect the short flavor
+        auto ack = (payload.flags & proto::chansetup_ext_ack) ?
+            proto::make_channel_setup_ack_ext(
+                header.uid, client_id, channel->caps,
+                m_buffer_pool->acquire(proto::control_packet_max_size)) :
+            proto::make_channel_setup_ack(
+                header.uid, client_id,
+                m_buffer_pool->acquire(proto::control_packet_max_size));
+
+        LOGTRACE(
+            "CHANNEL SETUP client {:#x} flags {:#x} caps {:#x}",
+            client_id, static_cast<std::uint32_t>(payload.flags),
+            static_cast<std::uint32_t>(channel->caps));
+
+        if (capture::is_enabled())
+        {
+            const auto captured_id = cix::native_to_little(client_id);
+
+            capture::record(
+                capture::kind_channel_setup, channel->pipe_token,
+                &captured_id, sizeof(captured_id));
+        }
+
+        std::scoped_lock chan_lock(channel->mutex);
+
         // bypass config flags validation for this one time because the client
         // expects an ack from us
-        channel->send(
-            m_pipe,
-            proto::make_channel_setup_ack(header.uid, client_id),
-            false);  // bypass config flags
+        channel->send(std::move(ack), false);  // bypass config flags
+
+        // the ack itself has a full CRC, client switches upon receiving it
+        if (channel->caps & proto::chansetup_crc_header)
+            channel->crc_mode = proto::crc_header;
+
+        for (auto& resume_packet : resume_packets)
+            channel->send(std::move(resume_packet));
     }
 }
 
 
 void svc_worker::process_channel_received_ping_packet(
     std::shared_ptr<channel_t> channel,
+    const proto::packet_view_t& packet,
     const proto::header_t& header,
     bool* out_must_erase)
 {
-    auto write_channel = this->find_write_channel(channel);
-
-    if (write_channel)
-    {
-        write_channel->send(
-            m_pipe,
-            proto::make_status(header.uid, proto::status_ok));
-    }
-    else
+    // the reply to one of ours, which may come from any channel of client
+    // (see chansetup_ping_rtt)
+    if (packet.payload_size() != 0 &&
+        packet.payload_as<proto::payload_ping_t>().kind == proto::ping_reply)
+    {
+        const auto& ping = packet.payload_as<proto::payload_ping_t>();
+        auto client = this->find_client_by_channel(channel);
+
+        if (!client)
+        {
+            *out_must_erase = true;
+            return;
+        }
+
+        std::scoped_lock client_lock(client->mutex);
+
+        for (const auto& write_channel : client->chans_write)
+        {
+            std::scoped_lock chan_lock(write_channel->mutex);
+
+            if (write_channel->on_ping_reply(header.uid, ping.stamp))
+            {
+                m_counters.rtt_samples.fetch_add(
+                    1, std::memory_order_relaxed);
+                break;
+            }
+        }
+
+        return;
+    }
+
+    auto write_channel = this->find_write_channel(channel);
+
+    if (!write_channel)
+    {
+        *out_must_erase = true;
+        return;
+    }
+
+    std::scoped_lock chan_lock(write_channel->mutex);
+
+    // an empty ping is answered the way older versions do; either way, the
+    // reply does not wait behind the SOCKS data queued already
+    if (packet.payload_size() == 0)
+    {
+        write_channel->send_expedited(
+            proto::make_status(
+                header.uid, proto::status_ok,
+                m_buffer_pool->acquire(proto::control_packet_max_size)));
+    }
+    else
+    {
+        write_channel->send_expedited(
+            proto::make_ping(
+                header.uid,
+                packet.payload_as<proto::payload_ping_t>().stamp,
+                proto::ping_reply,
+                m_buffer_pool->acquire(proto::control_packet_max_size)));
+    }
+}
+
+
+void svc_worker::process_channel_received_stats_packet(
+    std::shared_ptr<channel_t> channel,
+    const proto::packet_view_t& packet,
+    const proto::header_t& header,
+    bool* out_must_erase)
+{
+    // server side does not need to handle a reply
+    if (packet.payload_size() != 0)
+        return;
+
+    auto write_channel = this->find_write_channel(channel);
+
+    if (!write_channel)
     {
         *out_must_erase = true;
+        return;
+    }
+
+    proto::payload_stats_t stats{};
+    socks_proxy::stats_t socks_stats;
+
+    this->collect_stats(stats, socks_stats);
+
+#ifdef APP_LOGGING_ENABLED
+    // the timelines of the slow connections do not fit in the reply
+    if (m_session_trace)
+    {
+        const auto timelines = m_session_trace->slow_timelines(
+            session_trace_t::dump_max_count);
+
+        for (const auto& timeline : timelines)
+            LOGWARNING("slow session: {}", session_trace_t::format(timeline));
+    }
+#endif
+
+    std::scoped_lock chan_lock(write_channel->mutex);
+
+    write_channel->send(proto::make_stats(header.uid, stats));
+}
+
+
+void svc_worker::collect_stats(
+    proto::payload_stats_t& out_stats,
+    socks_proxy::stats_t& out_socks_stats)
+{
+    // CAUTION: no lock must be held by caller, see channel_t
+    auto& stats = out_stats;
+    auto& socks_stats = out_socks_stats;
+    std::vector<pipe_token_t> pipe_tokens;
+    std::vector<std::shared_ptr<channel_t>> channels;
+
+    stats = proto::payload_stats_t{};
+    stats.uptime_ms = cix::ticks_now() - m_start_time;
+
+    {
+        std::scoped_lock lock(m_mutex);
+
+        stats.channels = m_channels.size();
+        stats.clients = m_clients.size();
+
+        pipe_tokens.reserve(m_channels.size());
+        channels.reserve(m_channels.size());
+        for (const auto& chan_it : m_channels)
+        {
+            pipe_tokens.push_back(chan_it.first);
+            channels.push_back(chan_it.second);
+        }
     }
+
+    for (const auto& chan : channels)
+    {
+        std::scoped_lock chan_lock(chan->mutex);
+
+        if (!chan->rtt.has_sample())
+            continue;
+
+        const auto srtt = chan->rtt.srtt();
+        const auto min_rtt = chan->rtt.min_rtt();
+
+        ++stats.rtt_channels;
+        stats.rtt_srtt_avg_us += srtt;
+        stats.rtt_srtt_max_us = std::max(stats.rtt_srtt_max_us, srtt);
+
+        if (stats.rtt_min_us == 0 || min_rtt < stats.rtt_min_us)
+            stats.rtt_min_us = min_rtt;
+    }
+
+    if (stats.rtt_channels > 0)
+        stats.rtt_srtt_avg_us /= stats.rtt_channels;
+
+    stats.rtt_samples =
+        m_counters.rtt_samples.load(std::memory_order_relaxed);
+
+    for (const auto pipe_token : pipe_tokens)
+    {
+        channel_transport::instance_stats_t pipe_stats;
+
+        if (this->transport_of(pipe_token)->get_instance_stats(
+                pipe_token, pipe_stats))
+        {
+            stats.pipe_output_queue += pipe_stats.output_queue_size;
+            stats.pipe_bytes_in_flight += pipe_stats.bytes_in_flight;
+        }
+    }
+
+    stats.pipe_bytes_in =
+        m_counters.pipe_bytes_in.load(std::memory_order_relaxed);
+    stats.pipe_bytes_out =
+        m_counters.pipe_bytes_out.load(std::memory_order_relaxed);
+    stats.pipe_packets_in =
+        m_counters.pipe_packets_in.load(std::memory_order_relaxed);
+    stats.pipe_packets_out =
+        m_counters.pipe_packets_out.load(std::memory_order_relaxed);
+
+    for (std::size_t idx = 0; idx < m_counters.proto_errors.size(); ++idx)
+    {
+        stats.proto_errors[idx] =
+            m_counters.proto_errors[idx].load(std::memory_order_relaxed);
+    }
+
+    socks_stats = m_socks_proxy->stats();
+
+    stats.socks_sessions = socks_stats.sessions;
+    stats.socks_sessions_total = socks_stats.sessions_total;
+    stats.socks_pending_requests = socks_stats.pending_requests;
+    stats.connects_ok = socks_stats.connects_ok;
+    stats.connects_failed = socks_stats.connects_failed;
+    stats.connect_time_total_ms = socks_stats.connect_time_total;
+    stats.connect_time_max_ms = socks_stats.connect_time_max;
+    stats.target_sockets = socks_stats.socketio.sockets;
+    stats.target_bytes_in = socks_stats.socketio.bytes_received;
+    stats.target_bytes_out = socks_stats.socketio.bytes_sent;
+    stats.target_write_queue_bytes = socks_stats.socketio.write_queue_bytes;
+    stats.mem_used = m_mem_budget->used();
+    stats.mem_peak = m_mem_budget->peak();
+    stats.mem_global_budget = m_mem_budget->global_budget();
+    stats.mem_exhausted = m_mem_budget->is_exhausted() ? 1 : 0;
+    stats.connects_refused = socks_stats.connects_refused;
+    stats.sessions_shed = socks_stats.socketio.write_queue_overflows;
+    stats.connects_fast_failed = socks_stats.connects_fast_failed;
+    stats.connects_inflight = socks_stats.connects_inflight;
+    stats.connects_queued = socks_stats.connects_queued;
+    stats.connects_throttled = socks_stats.connects_throttled;
+    stats.connects_warm = socks_stats.connects_warm;
+    stats.warm_sockets = socks_stats.warm_sockets;
+    stats.rate_throttles = socks_stats.rate_throttles;
+    stats.rate_throttled = socks_stats.rate_throttled;
+    stats.dns_queries = socks_stats.resolver.queries;
+    stats.dns_timeouts = socks_stats.resolver.timeouts;
+    stats.dns_cancelled = socks_stats.resolver.cancelled;
+    stats.dns_fallbacks = socks_stats.resolver.fallbacks;
+
+    stats.wakeups = wakeups::total();
+
+    {
+        const auto spool_stats = spool_t::stats();
+
+        stats.spool_files = spool_stats.files;
+        stats.spool_bytes = spool_stats.bytes;
+        stats.spool_bytes_total = spool_stats.appended;
+        stats.spool_rejects = spool_stats.rejects;
+    }
+
+    if (m_session_trace)
+    {
+        static_assert(
+            session_trace_t::stage_count ==
+            std::extent_v<decltype(proto::payload_stats_t::slow_events)>);
+
+        const auto trace_stats = m_session_trace->stats();
+
+        stats.slow_threshold_ms = m_session_trace->threshold();
+        stats.slow_sessions = trace_stats.slow_sessions;
+        stats.slow_worst_client_id = trace_stats.worst_client_id;
+        stats.slow_worst_socks_id = trace_stats.worst_socks_id;
+
+        for (std::size_t idx = 0; idx < session_trace_t::stage_count; ++idx)
+        {
+            stats.slow_events[idx] = trace_stats.slow_events[idx];
+            stats.slow_worst_delay_us[idx] = trace_stats.worst_delay[idx];
+        }
+    }
+
+    {
+        static_assert(
+            alloc_profile::stage_count <=
+            std::extent_v<decltype(proto::payload_stats_t::alloc_count)>);
+
+        const auto alloc_stats = alloc_profile::stats();
+
+        for (std::size_t idx = 0; idx < alloc_profile::stage_count; ++idx)
+        {
+            stats.alloc_count[idx] = alloc_stats.count[idx];
+            stats.alloc_bytes[idx] = alloc_stats.bytes[idx];
+        }
+    }
+
+    svc_worker::to_stats_latency(
+        socks_stats.request_queue_latency, stats.latency_request_queue);
+    svc_worker::to_stats_latency(
+        socks_stats.request_send_latency, stats.latency_request_send);
+    svc_worker::to_stats_latency(
+        m_response_latency.summary(), stats.latency_response);
+    svc_worker::to_stats_latency(
+        socks_stats.connect_latency, stats.latency_connect);
+    svc_worker::to_stats_latency(
+        socks_stats.connect_queue_latency, stats.latency_connect_queue);
+}
+
+
+void svc_worker::to_stats_latency(
+    const latency_histogram_t::summary_t& summary,
+    proto::payload_stats_latency_t& out_latency)
+{
+    out_latency.count = summary.count;
+    out_latency.p50 = summary.p50;
+    out_latency.p90 = summary.p90;
+    out_latency.p99 = summary.p99;
+    out_latency.p999 = summary.p999;
+    out_latency.max = summary.max;
+}
+
+
+#ifdef APP_PERF_ENABLED
+void svc_worker::collect_perf_counters(perf_counters::values_t& out_values)
+{
+    // CAUTION: called from a thread of PerfLib, see perf_counters; same as an
+    // op_stats request otherwise
+    proto::payload_stats_t stats;
+    socks_proxy::stats_t socks_stats;
+
+    this->collect_stats(stats, socks_stats);
+
+    const auto pool_stats = m_buffer_pool->stats();
+
+    out_values.clients = stats.clients;
+    out_values.channels = stats.channels;
+    out_values.sessions = stats.socks_sessions;
+    out_values.pipe_output_queue = stats.pipe_output_queue;
+    out_values.target_write_queue = stats.target_write_queue_bytes;
+    out_values.pending_requests = stats.socks_pending_requests;
+    out_values.connects_queued = stats.connects_queued;
+    out_values.mem_used = stats.mem_used;
+
+    out_values.pipe_bytes_in = stats.pipe_bytes_in;
+    out_values.pipe_bytes_out = stats.pipe_bytes_out;
+    out_values.target_bytes_in = stats.target_bytes_in;
+    out_values.target_bytes_out = stats.target_bytes_out;
+    out_values.connects = stats.connects_ok + stats.connects_failed;
+    out_values.connects_failed = stats.connects_failed;
+    out_values.buffer_pool_hits = pool_stats.hits;
+    out_values.buffer_pool_lookups = pool_stats.hits + pool_stats.misses;
+    out_values.warm_pool_hits = socks_stats.connects_warm;
+    out_values.warm_pool_lookups =
+        socks_stats.connects_warm + socks_stats.warm_misses;
+    out_values.dns_cache_hits = socks_stats.dns_hits;
+    out_values.dns_cache_lookups =
+        socks_stats.dns_hits + socks_stats.dns_misses;
 }
+#endif  // #ifdef APP_PERF_ENABLED
 
 
 void svc_worker::process_channel_received_socks_packet(
     std::shared_ptr<channel_t> channel,
-    const bytes_t& packet,
+    const proto::packet_view_t& packet,
     const proto::header_t& header,
     bool* out_must_erase)
 {
@@ -422,19 +1377,18 @@ void svc_worker::process_channel_received_socks_packet(
     // note: proto::payload_socks_header_t values already net2host()'ed by
     // proto::extract_next_packet()
     const auto socks_id =
-        reinterpret_cast<const proto::payload_socks_header_t*>(
-            packet.data() + sizeof(proto::header_t))->socks_id;
+        packet.payload_as<proto::payload_socks_header_t>().socks_id;
 
     if (socks_id == proto::invalid_socks_id)
         return;  // noop
 
     const auto socks_payload_size =
-        packet.size() -
+        packet.size -
         sizeof(proto::header_t) -
         sizeof(proto::payload_socks_header_t);
 
     // paranoid check
-    if (socks_payload_size == 0 || socks_payload_size >= packet.size())
+    if (socks_payload_size == 0 || socks_payload_size >= packet.size)
     {
         // this is a *proto*-related error so disconnect client
         *out_must_erase = true;
@@ -442,11 +1396,7 @@ void svc_worker::process_channel_received_socks_packet(
     }
 
     const auto* socks_payload =
-        packet.data() +
-        sizeof(proto::header_t) +
-        sizeof(proto::payload_socks_header_t);
-
-    cix::lock_guard lock(m_mutex);
+        packet.payload() + sizeof(proto::payload_socks_header_t);
 
     auto client = this->find_client_by_channel(channel);
     if (!client)
@@ -462,8 +1412,8 @@ void svc_worker::process_channel_received_socks_packet(
     //   purpose
     // * *socks_id* is the ID provided by the remote client-side to identify a
     //   given SOCKS connection on its side
-    // * *socks_token* is the ID of this same SOCKS connection, as randomly
-    //   generated and managed by the socks_proxy object
+    // * *socks_token* is the ID of this same SOCKS connection, as generated
+    //   and managed by the socks_proxy object
     // * in other words, *socks_id* identifies a SOCKS connection on the
     //   client-side while *socks_token* identifies this same SOCKS connection
     //   on the server-side, so that there is always one *socks_id* for one
@@ -472,12 +1422,32 @@ void svc_worker::process_channel_received_socks_packet(
     //   can be connected to this svc_worker and we must to ensure a same ID of
     //   SOCKS connection IS NOT shared among multiple clients
     socks_proxy::token_t socks_token;
+    bool pause_socks_token = false;
+
+    cix::lock_guard lock(client->mutex);
+
+    if (client->erased)
+    {
+        *out_must_erase = true;
+        return;
+    }
+
+    socks_token = client->find_socks_token_by_id(socks_id);
+
+    // what client sends again once resumed starts from there
+    auto socks_resume = client->find_socks_resume(socks_id);
+    if (socks_resume)
+        socks_resume->rx_offset += socks_payload_size;
 
-    auto socks_token_it = client->socks_id_to_token.find(socks_id);
-    if (socks_token_it == client->socks_id_to_token.end())
+    lock.unlock();
+
+    if (socks_token == socks_proxy::invalid_token)
     {
         // here, this is a new SOCKS ID so a new connection must be opened
-        socks_token = m_socks_proxy->create_client();
+        // UDP ASSOCIATE is up to client side, see on_socks_udp_associated()
+        // the connect limit of a group is the one of a proto client
+        socks_token = m_socks_proxy->create_client(
+            (channel->caps & proto::chansetup_socks_udp) != 0, client->id);
         if (socks_token == socks_proxy::invalid_token)
         {
             // socks_proxy failed to create a new connection
@@ -487,43 +1457,98 @@ void svc_worker::process_channel_received_socks_packet(
             return;
         }
 
-        assert(
-            m_socks_token_to_client.find(socks_token) ==
-            m_socks_token_to_client.end());
+        // SOCKS IDs are only mapped by this thread, but client may have been
+        // erased in the meantime
+        lock.lock();
+
+        if (client->erased)
+        {
+            lock.unlock();
+            m_socks_proxy->disconnect_client(socks_token);
+            *out_must_erase = true;
+            return;
+        }
 
         // map socks_id to its socks_token counterpart
-        client->socks_id_to_token[socks_id] = socks_token;
-        m_socks_token_to_client[socks_token] = client;
+        client->map_socks(socks_id, socks_token);
+
+        if (m_session_trace)
+            m_session_trace->bind(socks_token, client->id, socks_id);
+
+        if (client->resumable)
+        {
+            client->prune_socks_resume(cix::ticks_now(), m_resume_timeout);
+
+            client->socks_resume.try_emplace(
+                socks_id, m_replay_size, m_buffer_pool, m_mem_budget)
+                    .first->second.rx_offset = socks_payload_size;
+        }
+
+        if (capture::is_enabled())
+        {
+            const capture::socks_mapped_t mapped{
+                cix::native_to_little(client->id),
+                cix::native_to_little(socks_id)};
+
+            capture::record(
+                capture::kind_socks_mapped, socks_token,
+                &mapped, sizeof(mapped));
+        }
+        m_socks_timers = true;  // see expire_timers()
+
+        {
+            std::scoped_lock index_lock(m_mutex);
+
+            assert(
+                m_socks_token_to_client.find(socks_token) ==
+                m_socks_token_to_client.end());
+
+            m_socks_token_to_client[socks_token] = client;
+        }
+
+        // output of its write channel may be above watermark already
+        const auto write_channel = client->socks_write_channel(socks_id);
+
+        if (write_channel)
+        {
+            std::scoped_lock chan_lock(write_channel->mutex);
+            pause_socks_token = write_channel->flow_paused;
+        }
+
+        lock.unlock();
+    }
+
+    // *packet* points to channel's input buffer, see slice_min_size
+    cix::shared_buffer socks_data;
+
+    if (socks_payload_size >= slice_min_size)
+    {
+        socks_data = channel->input_buffer.slice(
+            socks_payload, socks_payload_size);
     }
     else
     {
-        socks_token = socks_token_it->second;
+        socks_data = cix::shared_buffer(
+            bytes_t(socks_payload, socks_payload + socks_payload_size));
     }
 
-    bytes_t socks_packet;
+    if (pause_socks_token)
+        m_socks_proxy->pause_client(socks_token, true);
 
-    socks_packet.resize(socks_payload_size);
-    std::memcpy(socks_packet.data(), socks_payload, socks_payload_size);
-
-    lock.unlock();
-
-    m_socks_proxy->push_request(socks_token, std::move(socks_packet));
+    m_socks_proxy->push_request(socks_token, std::move(socks_data));
 }
 
 
 void svc_worker::process_channel_received_socks_close_packet(
     std::shared_ptr<channel_t> channel,
-    const bytes_t& packet,
+    const proto::packet_view_t& packet,
     const proto::header_t& header,
     bool* out_must_erase)
 {
     // note: proto::payload_socks_header_t values already net2host()'ed by
     // proto::extract_next_packet()
     const auto socks_id =
-        reinterpret_cast<const proto::payload_socks_header_t*>(
-            packet.data() + sizeof(proto::header_t))->socks_id;
-
-    cix::lock_guard lock(m_mutex);
+        packet.payload_as<proto::payload_socks_header_t>().socks_id;
 
     auto client = this->find_client_by_channel(channel);
     if (!client)
@@ -532,97 +1557,326 @@ void svc_worker::process_channel_received_socks_close_packet(
         return;
     }
 
+    cix::lock_guard lock(client->mutex);
+
     const auto socks_token = client->find_socks_token_by_id(socks_id);
+    const auto write_channel = client->main_write_channel();
 
-    if (client->chan_write)
-    {
-        client->chan_write->send(
-            m_pipe,
-            proto::make_status(header.uid, proto::status_ok));
-    }
+    // client is done with it, nothing to resume anymore
+    client->socks_resume.erase(socks_id);
 
     lock.unlock();
 
+    if (write_channel)
+    {
+        std::scoped_lock chan_lock(write_channel->mutex);
+
+        write_channel->send(
+            proto::make_status(
+                header.uid, proto::status_ok,
+                m_buffer_pool->acquire(proto::control_packet_max_size)));
+    }
+
     if (socks_token != socks_proxy::invalid_token)
         m_socks_proxy->disconnect_client(socks_token);
 }
 
 
-void svc_worker::process_channel_received_uninstall_self_packet()
+void svc_worker::process_channel_received_socks_flow_packet(
+    std::shared_ptr<channel_t> channel,
+    const proto::packet_view_t& packet,
+    const proto::header_t& header,
+    bool* out_must_erase)
 {
-#ifdef APP_ENABLE_SERVICE
-    auto owner = svc::instance();
-    const auto uninstall_svc = !owner || owner->running_as_service();
-    owner.reset();
+    CIX_UNVAR(header);
 
-    if (uninstall_svc)
-        svc::uninstall({}, false);
-#endif
+    // note: proto::payload_socks_flow_t values already net2host()'ed and
+    // validated by proto::extract_next_packet()
+    const auto& payload = packet.payload_as<proto::payload_socks_flow_t>();
 
-    // TODO: enable a self-erase flag to be read by wmain()???
+    auto client = this->find_client_by_channel(channel);
+    if (!client)
+    {
+        *out_must_erase = true;
+        return;
+    }
 
-    SetEvent(m_stop_event);
-}
+    cix::lock_guard lock(client->mutex);
+
+    // SOCKS connection may have been closed in the meantime
+    const auto socks_token = client->find_socks_token_by_id(payload.socks_id);
+    if (socks_token == socks_proxy::invalid_token)
+        return;
 
+    if (payload.flow == proto::socks_flow_pause)
+        client->socks_paused.insert(payload.socks_id);
+    else
+        client->socks_paused.erase(payload.socks_id);
 
-#if 0
-std::shared_ptr<svc_worker::client_t>
-svc_worker::find_client_by_pipe_token(pipe_token_t pipe_token) const
-{
-    std::scoped_lock lock(m_mutex);
+    const auto paused = client->is_socks_paused(payload.socks_id);
 
-    auto chan_it = m_channels.find(pipe_instance_token);
-    if (chan_it != m_channels.end())
-    {
-        auto& channel = chan_it->second;
-        return this->find_client_by_channel(channel);
-    }
+    lock.unlock();
 
-    return nullptr;
+    m_socks_proxy->pause_client(socks_token, paused);
 }
-#endif
 
 
-std::shared_ptr<svc_worker::client_t>
-svc_worker::find_client_by_channel(std::shared_ptr<channel_t> channel) const
+void svc_worker::process_channel_received_socks_udp_packet(
+    std::shared_ptr<channel_t> channel,
+    const proto::packet_view_t& packet,
+    const proto::header_t& header,
+    bool* out_must_erase)
 {
-    if (!channel)
+    CIX_UNVAR(header);
+
+    // note: header and record lengths already net2host()'ed and validated by
+    // proto::extract_next_packet()
+    const auto socks_id =
+        packet.payload_as<proto::payload_socks_header_t>().socks_id;
+
+    auto client = this->find_client_by_channel(channel);
+    if (!client)
     {
-        assert(0);
-        return nullptr;
+        *out_must_erase = true;
+        return;
     }
 
-    // channel+client not configured yet?
-    if (channel->client_id == proto::invalid_client_id)
-        return nullptr;
+    cix::lock_guard lock(client->mutex);
 
-    std::scoped_lock lock(m_mutex);
+    // unlike op_socks, a datagram never opens a SOCKS connection: it is only
+    // valid once associated, and may be late
+    const auto socks_token = client->find_socks_token_by_id(socks_id);
 
-    auto client_it = m_clients.find(channel->client_id);
-    if (client_it == m_clients.end())
-        return nullptr;
+    lock.unlock();
 
-    return client_it->second;
-}
+    if (socks_token == socks_proxy::invalid_token)
+        return;
 
+    const auto* record_ptr =
+        packet.payload() + sizeof(proto::payload_socks_header_t);
+    const auto* const end = packet.data + packet.size;
 
-std::shared_ptr<svc_worker::client_t>
-svc_worker::find_client_by_socks_token(socks_proxy::token_t socks_token)
-{
-    std::scoped_lock lock(m_mutex);
+    while (record_ptr < end)
+    {
+        const std::size_t len =
+            reinterpret_cast<const proto::payload_socks_udp_record_t*>(
+                record_ptr)->len;
 
-    auto it = m_socks_token_to_client.find(socks_token);
-    if (it == m_socks_token_to_client.end())
-        return nullptr;
+        record_ptr += sizeof(proto::payload_socks_udp_record_t);
 
-    auto client = it->second.lock();
-    if (!client)
-    {
-        m_socks_token_to_client.erase(it);
-        return nullptr;
-    }
+        // same as op_socks, see slice_min_size
+        cix::shared_buffer datagram;
 
-    return client;
+        if (len >= slice_min_size)
+            datagram = channel->input_buffer.slice(record_ptr, len);
+        else
+            datagram =
+                cix::shared_buffer(bytes_t(record_ptr, record_ptr + len));
+
+        m_socks_proxy->push_datagram(socks_token, std::move(datagram));
+
+        record_ptr += len;
+    }
+}
+
+
+void svc_worker::process_channel_received_socks_resume_packet(
+    std::shared_ptr<channel_t> channel,
+    const proto::packet_view_t& packet,
+    const proto::header_t& header,
+    bool* out_must_erase)
+{
+    CIX_UNVAR(header);
+
+    // note: proto::payload_socks_resume_t values already net2host()'ed by
+    // proto::extract_next_packet()
+    const auto& payload = packet.payload_as<proto::payload_socks_resume_t>();
+
+    auto client = this->find_client_by_channel(channel);
+    if (!client)
+    {
+        *out_must_erase = true;
+        return;
+    }
+
+    std::vector<socks_proxy::token_t> socks_tokens;
+    std::vector<bytes_t> socks_buffers;
+
+    cix::lock_guard lock(client->mutex);
+
+    if (payload.socks_id == proto::invalid_socks_id)
+    {
+        // end of client's list, the connections it did not reply for are not
+        // known to it anymore
+        for (auto it = client->socks_resume.begin();
+            it != client->socks_resume.end(); )
+        {
+            if (!it->second.held)
+            {
+                ++it;
+                continue;
+            }
+
+            const auto socks_token = client->find_socks_token_by_id(it->first);
+            if (socks_token != socks_proxy::invalid_token)
+                socks_tokens.push_back(socks_token);
+
+            it = client->socks_resume.erase(it);
+        }
+
+        lock.unlock();
+
+        // IMPORTANT: no lock held, see erase_client()
+        m_socks_proxy->disconnect_clients(socks_tokens);
+
+        return;
+    }
+
+    // late, or not resumable at all
+    auto socks_resume = client->find_socks_resume(payload.socks_id);
+    if (!socks_resume || !socks_resume->held)
+        return;
+
+    const auto socks_token = client->find_socks_token_by_id(payload.socks_id);
+    const auto write_channel = client->socks_write_channel(payload.socks_id);
+    if (!write_channel)
+        return;  // detached again, still held
+
+    if (!socks_resume->replay.copy_from(
+        payload.offset, proto::socks_headroom, socks_buffers))
+    {
+        // what client missed is not held anymore, the connection is lost; its
+        // target may be gone already, so that client is told right away
+        client->socks_resume.erase(payload.socks_id);
+
+        lock.unlock();
+
+        {
+            std::scoped_lock chan_lock(write_channel->mutex);
+
+            write_channel->send_socks_packet(
+                payload.socks_id,
+                proto::make_socks_disconnected(
+                    payload.socks_id,
+                    m_buffer_pool->acquire(proto::control_packet_max_size)));
+        }
+
+        if (socks_token != socks_proxy::invalid_token)
+            m_socks_proxy->disconnect_client(socks_token);
+
+        return;
+    }
+
+    socks_resume->held = false;
+    socks_resume->sent = socks_resume->replay.end_offset();
+    socks_resume->replay.trim(socks_resume->sent);
+
+    const auto paused = client->is_socks_paused(payload.socks_id);
+
+    // CAUTION: queued before releasing the client, so that nothing sent by
+    // on_socks_response() for this connection can get ahead
+    {
+        std::scoped_lock chan_lock(write_channel->mutex);
+
+        for (auto& socks_buffer : socks_buffers)
+        {
+            write_channel->send_socks(
+                *m_buffer_pool, payload.socks_id, std::move(socks_buffer), 0);
+        }
+
+        // kept, the connection may have to be resumed again
+        for (const auto& tail_packet : socks_resume->tail_packets)
+        {
+            write_channel->send_socks_packet(
+                payload.socks_id, bytes_t(tail_packet));
+        }
+
+        write_channel->charge_pending();
+    }
+
+    lock.unlock();
+
+    // held since detach_client(), unless client paused it
+    if (socks_token != socks_proxy::invalid_token && !paused)
+        m_socks_proxy->pause_client(socks_token, false);
+}
+
+
+void svc_worker::process_channel_received_uninstall_self_packet()
+{
+#ifdef APP_ENABLE_SERVICE
+    auto owner = svc::instance();
+    const auto uninstall_svc = !owner || owner->running_as_service();
+    owner.reset();
+
+    if (uninstall_svc)
+        svc::uninstall({}, false);
+#endif
+
+    // TODO: enable a self-erase flag to be read by wmain()???
+
+    SetEvent(m_stop_event);
+}
+
+
+#if 0
+std::shared_ptr<svc_worker::client_t>
+svc_worker::find_client_by_pipe_token(pipe_token_t pipe_token) const
+{
+    std::scoped_lock lock(m_mutex);
+
+    auto chan_it = m_channels.find(pipe_instance_token);
+    if (chan_it != m_channels.end())
+    {
+        auto& channel = chan_it->second;
+        return this->find_client_by_channel(channel);
+    }
+
+    return nullptr;
+}
+#endif
+
+
+std::shared_ptr<svc_worker::client_t>
+svc_worker::find_client_by_channel(std::shared_ptr<channel_t> channel) const
+{
+    if (!channel)
+    {
+        assert(0);
+        return nullptr;
+    }
+
+    std::scoped_lock lock(m_mutex);
+
+    // channel+client not configured yet?
+    if (channel->client_id == proto::invalid_client_id)
+        return nullptr;
+
+    auto client_it = m_clients.find(channel->client_id);
+    if (client_it == m_clients.end())
+        return nullptr;
+
+    return client_it->second;
+}
+
+
+std::shared_ptr<svc_worker::client_t>
+svc_worker::find_client_by_socks_token(socks_proxy::token_t socks_token)
+{
+    std::scoped_lock lock(m_mutex);
+
+    auto it = m_socks_token_to_client.find(socks_token);
+    if (it == m_socks_token_to_client.end())
+        return nullptr;
+
+    auto client = it->second.lock();
+    if (!client)
+    {
+        m_socks_token_to_client.erase(it);
+        return nullptr;
+    }
+
+    return client;
 }
 
 
@@ -635,13 +1889,13 @@ svc_worker::find_write_channel(std::shared_ptr<channel_t> channel) const
         return nullptr;
     }
 
-    std::scoped_lock lock(m_mutex);
+    // worker thread only, as the one that sets up channels
 
     if (channel->client_id == proto::invalid_client_id)
         return channel;  // if channel is not setup yet
 
-    const auto client_it = m_clients.find(channel->client_id);
-    if (client_it == m_clients.end())
+    const auto client = this->find_client_by_channel(channel);
+    if (!client)
     {
         assert(0);
         // if (channel->config_flags & chanconfig_write)
@@ -649,12 +1903,14 @@ svc_worker::find_write_channel(std::shared_ptr<channel_t> channel) const
         return nullptr;
     }
 
-    const auto client = client_it->second;
+    // reply on the same channel if possible
+    if (channel->config_flags & chanconfig_write)
+        return channel;
 
-    assert(channel == client->chan_write || channel == client->chan_read);
+    std::scoped_lock client_lock(client->mutex);
 
-    if (client->chan_write)
-        return client->chan_write;
+    if (!client->chans_write.empty())
+        return client->main_write_channel();
 
     assert(0);
     // return channel;
@@ -663,13 +1919,16 @@ svc_worker::find_write_channel(std::shared_ptr<channel_t> channel) const
 
 
 void svc_worker::erase_channel_and_client(
-    pipe_token_t pipe_token, bool disconnect)
+    pipe_token_t pipe_token, bool disconnect, bool may_resume)
 {
     // erase a channel as well as its parent client_t object and related channel
-    // if any
+    // if any; with *may_resume*, a resumable client is only detached instead
 
     cix::lock_guard lock(m_mutex);
 
+    m_setup_timers.cancel(pipe_token);
+    m_ping_timers.cancel(pipe_token);
+
     auto chan_it = m_channels.find(pipe_token);
     if (chan_it != m_channels.end())
     {
@@ -678,15 +1937,16 @@ void svc_worker::erase_channel_and_client(
         if (client_id == proto::invalid_client_id)
         {
             // here, channel was still pending to be setup so it is not attached
-            // yet to a client_t object
-
-            if (disconnect && m_pipe)
-                chan_it->second->disconnect(m_pipe);
+            // yet to a client_t object, see process_channel_setup()
+            auto channel = chan_it->second;
 
             m_channels.erase(chan_it);
             chan_it = m_channels.end();
 
-            lock.unlock();  // symmetry with block below
+            lock.unlock();
+
+            if (disconnect)
+                channel->disconnect();
         }
         else
         {
@@ -695,6 +1955,9 @@ void svc_worker::erase_channel_and_client(
 
             lock.unlock();
 
+            if (may_resume && this->detach_client(client_id))
+                return;
+
             this->erase_client(
                 client_id,
                 disconnect,
@@ -714,275 +1977,1851 @@ void svc_worker::erase_client(
     if (client_id == proto::invalid_client_id)
         return;
 
-    cix::lock_guard lock(m_mutex);
+    std::shared_ptr<client_t> client;
+    std::vector<socks_proxy::token_t> socks_tokens_to_disconnect;
+    std::set<pipe_token_t> pipe_tokens;
+
+    // unindex client first so that no channel can join it anymore, see
+    // process_channel_setup()
+    {
+        std::scoped_lock lock(m_mutex);
+
+        auto client_it = m_clients.find(client_id);
+        if (client_it == m_clients.end())
+            return;
+
+        client = client_it->second;
+        m_clients.erase(client_it);
+        m_resume_timers.cancel(client_id);
+    }
+
+    {
+        std::scoped_lock client_lock(client->mutex);
+
+        client->erased = true;
+
+        // hold the list of related SOCKS IDs locally so we can
+        // m_socks_proxy->disconnect_client() separately later on, without
+        // any lock held, to avoid any stall due to the on_socks_disconnected()
+        // callback being called during a disconnect_client() call
+        socks_tokens_to_disconnect.reserve(client->socks_id_to_token.size());
+
+        for (auto it : client->socks_id_to_token)
+            socks_tokens_to_disconnect.push_back(it.second);
+
+        client->clear_socks();
+
+        for (const auto& channel : client->chans_read)
+            pipe_tokens.insert(channel->pipe_token);
+
+        for (const auto& channel : client->chans_write)
+            pipe_tokens.insert(channel->pipe_token);
+
+#ifdef APP_LOGGING_ENABLED
+        {
+            compress_stats_t stats{};
+
+            for (const auto& channel : client->chans_write)
+            {
+                std::scoped_lock chan_lock(channel->mutex);
+                const auto& chan_stats = channel->compress_stats;
+
+                stats.raw_bytes += chan_stats.raw_bytes;
+                stats.compressed_bytes += chan_stats.compressed_bytes;
+                stats.packets += chan_stats.packets;
+                stats.skipped_entropy += chan_stats.skipped_entropy;
+                stats.skipped_ratio += chan_stats.skipped_ratio;
+            }
+
+            if (stats.packets > 0 || stats.skipped_entropy > 0)
+            {
+                LOGDEBUG(
+                    "client {:#x} compression: {} -> {} bytes ({:.1f}%) in {} "
+                    "packets; {} chunks skipped (entropy), {} (ratio)",
+                    client->id, stats.raw_bytes, stats.compressed_bytes,
+                    stats.raw_bytes ?
+                        100.0 * static_cast<double>(stats.compressed_bytes) /
+                            static_cast<double>(stats.raw_bytes) :
+                        0.0,
+                    stats.packets, stats.skipped_entropy, stats.skipped_ratio);
+            }
+        }
+#endif
+
+        if (disconnect)
+            client->disconnect(disconnect_except_pipe_token);
+    }
+
+    {
+        std::scoped_lock lock(m_mutex);
+
+        for (const auto pipe_token : pipe_tokens)
+            m_channels.erase(pipe_token);
+
+        for (const auto socks_token : socks_tokens_to_disconnect)
+            m_socks_token_to_client.erase(socks_token);
+    }
+
+    client.reset();
+
+    // IMPORTANT: no lock held, see explanation above; all at once so that
+    // a client with thousands of sessions does not take the locks of
+    // socks_proxy and socketio thousands of times
+    auto socks_proxy = m_socks_proxy;
+
+    socks_proxy->disconnect_clients(socks_tokens_to_disconnect);
+}
+
+
+bool svc_worker::detach_client(clientid_t client_id)
+{
+    // a resumable client loses its channels but keeps its SOCKS connections,
+    // until it is resumed by process_channel_setup() or its resume timer
+    // expires; false if client is not resumable, in which case it is left
+    // untouched
+
+    std::shared_ptr<client_t> client;
+    std::set<pipe_token_t> pipe_tokens;
+    std::vector<socks_proxy::token_t> socks_tokens;
+
+    {
+        std::scoped_lock lock(m_mutex);
+
+        auto client_it = m_clients.find(client_id);
+        if (client_it == m_clients.end())
+            return false;
+
+        client = client_it->second;
+    }
+
+    {
+        std::scoped_lock client_lock(client->mutex);
+
+        if (client->erased || !client->resumable)
+            return false;
+
+        if (client->detached)
+            return true;
+
+        for (const auto& channel : client->chans_read)
+            pipe_tokens.insert(channel->pipe_token);
+
+        for (const auto& channel : client->chans_write)
+            pipe_tokens.insert(channel->pipe_token);
+
+        client->disconnect();
+        client->socks_write_chan.clear();
+        client->next_write_chan = 0;
+        client->detached = true;
+        client->resume_pending = true;
+
+        // targets are not read until resumed, what they sent in the meantime
+        // goes to the replay buffers
+        for (auto& [ socks_id, socks_resume ] : client->socks_resume)
+        {
+            const auto socks_token = client->find_socks_token_by_id(socks_id);
+
+            socks_resume.held = true;
+
+            if (socks_token != socks_proxy::invalid_token)
+                socks_tokens.push_back(socks_token);
+        }
+
+        std::scoped_lock lock(m_mutex);
+
+        for (const auto pipe_token : pipe_tokens)
+            m_channels.erase(pipe_token);
+
+        const auto deadline = cix::ticks_now() + m_resume_timeout;
+
+        m_resume_timers.schedule(client_id, deadline);
+        this->wake_timers(deadline);
+    }
+
+    LOGTRACE("CLIENT {:#x} DETACHED", client_id);
+
+    // IMPORTANT: no lock held, see erase_client()
+    this->pause_socks(socks_tokens, true);
+
+    return true;
+}
+
+
+void svc_worker::disconnect_all()
+{
+    std::vector<std::shared_ptr<channel_t>> channels;
+
+    {
+        std::scoped_lock lock(m_mutex);
+
+        channels.reserve(m_channels.size());
+        for (auto& chan_it : m_channels)
+            channels.push_back(chan_it.second);
+    }
+
+    for (auto& channel : channels)
+        channel->disconnect();
+}
+
+
+std::shared_ptr<channel_transport> svc_worker::transport_of(
+    pipe_token_t pipe_token) const
+{
+    // tokens are unique among transports, see channel_transport
+    if (m_tcp && tcp_transport::is_tcp_token(pipe_token))
+        return m_tcp;
+
+    return m_pipe;
+}
+
+
+bool svc_worker::update_client_flow(
+    client_t& client,
+    channel_t& channel,
+    bool& out_paused,
+    std::vector<socks_proxy::token_t>& out_socks_tokens)
+{
+    // CAUTION: client.mutex must be locked by caller, channel.mutex must not
+    //
+    // match the output size of one of client's write channels against
+    // watermarks, return true if channel's flow state changed, in which case
+    // *out_socks_tokens* gets the SOCKS tokens assigned to this channel, to be
+    // paused or resumed according to *out_paused*
+
+    if (!(channel.config_flags & chanconfig_write))
+        return false;
+
+    {
+        std::scoped_lock chan_lock(channel.mutex);
+
+        if (!channel.is_flow_change_due())
+            return false;
+
+        channel.flow_paused = !channel.flow_paused;
+        out_paused = channel.flow_paused;
+
+        LOGTRACE(
+            "{} SOCKS flow of client {:#x} on pipe instance {} "
+            "({} bytes queued)",
+            channel.flow_paused ? "PAUSE" : "RESUME", client.id,
+            channel.pipe_token, channel.pending_size());
+    }
+
+    // SOCKS connections paused by client side remain paused anyway
+    out_socks_tokens.clear();
+    for (const auto& [ socks_id, socks_token ] : client.socks_id_to_token)
+    {
+        const auto chan_it = client.socks_write_chan.find(socks_id);
+
+        if (chan_it == client.socks_write_chan.end() ||
+            client.chans_write[chan_it->second].get() != &channel)
+        {
+            continue;
+        }
+
+        if (client.socks_paused.find(socks_id) == client.socks_paused.end())
+            out_socks_tokens.push_back(socks_token);
+    }
+
+    return true;
+}
+
+
+void svc_worker::pause_socks(
+    const std::vector<socks_proxy::token_t>& socks_tokens, bool paused)
+{
+    // CAUTION: no lock should be held by caller, see erase_client()
+
+    for (const auto socks_token : socks_tokens)
+        m_socks_proxy->pause_client(socks_token, paused);
+}
+
+
+void svc_worker::on_transport_connected(
+    std::shared_ptr<channel_transport> transport,
+    channel_transport::token_t pipe_instance_token)
+{
+    assert(transport);
+    assert(pipe_instance_token);
+    assert(transport == this->transport_of(pipe_instance_token));
+
+    CIX_UNVAR(transport);
+
+    LOGTRACE("PIPE INSTANCE CONNECTED");
+
+    // force-cleanup any existing channel with a same token, as well as any
+    // client object that depends on it
+    this->erase_channel_and_client(pipe_instance_token, false);
+
+    if (m_setup_timeout > 0)
+    {
+        std::scoped_lock lock(m_mutex);
+
+        const auto deadline = cix::ticks_now() + m_setup_timeout;
+
+        m_setup_timers.schedule(pipe_instance_token, deadline);
+        this->wake_timers(deadline);
+    }
+}
+
+
+void svc_worker::on_transport_recv(
+    std::shared_ptr<channel_transport> transport,
+    channel_transport::token_t pipe_instance_token,
+    channel_transport::bytes_t&& packet)
+{
+    assert(transport);
+    assert(!packet.empty());
+    assert(transport == this->transport_of(pipe_instance_token));
+
+    LOGTRACE("PIPE INSTANCE RECV {} bytes", packet.size());
+    ETWTRACE("PipeRecv", etw::keyword_pipe,
+        etw::u64(pipe_instance_token, "PipeToken"),
+        etw::u64(packet.size(), "Bytes"));
+
+    m_counters.pipe_bytes_in.fetch_add(
+        packet.size(), std::memory_order_relaxed);
+
+    capture::record(
+        capture::kind_pipe_recv, pipe_instance_token,
+        packet.data(), packet.size());
+
+    // this is a callback method, it must be executed as fast as possible so
+    // just (create and) feed the channel_t object here but leave the parsing
+    // and other actions to the maintenance thread
+
+    if (!packet.empty())
+    {
+        std::scoped_lock lock(m_mutex);
+
+        auto chan_it = m_channels.find(pipe_instance_token);
+        if (chan_it != m_channels.end())
+        {
+            // serialized by m_mutex, see channel_t::push_recv()
+            chan_it->second->push_recv(std::move(packet));
+        }
+        else
+        {
+            auto channel = std::make_shared<channel_t>(
+                transport, m_mem_budget, m_spool_max_size,
+                pipe_instance_token, std::move(packet));
+
+            channel->input_buffer.set_buffer_pool(m_buffer_pool);
+
+            if (m_spool_thread)
+            {
+                channel->spool_thread = m_spool_thread;
+                channel->spool_ready = [
+                        weak_self = this->weak_from_this(),
+                        weak_channel = std::weak_ptr<channel_t>(channel)]() {
+                    auto self = weak_self.lock();
+                    auto spooled = weak_channel.lock();
+
+                    if (self && spooled)
+                        self->on_spool_ready(std::move(spooled));
+                };
+            }
+
+            m_channels.insert(std::make_pair(pipe_instance_token, channel));
+        }
+
+        // process_received_data() resets the event and clears
+        // m_ready_channels all at once, with m_mutex held, so the event is
+        // still signaled if some channels are still waiting
+        const auto was_empty = m_ready_channels.empty();
+
+        m_ready_channels.insert(pipe_instance_token);
+
+        if (was_empty)
+            SetEvent(m_recv_event);
+    }
+}
+
+
+void svc_worker::on_transport_sent(
+    std::shared_ptr<channel_transport> transport,
+    channel_transport::token_t pipe_instance_token,
+    channel_transport::bytes_t&& packet,
+    std::size_t output_queue_size)
+{
+    CIX_UNVAR(transport);
+    CIX_UNVAR(output_queue_size);
+
+    assert(transport);
+    assert(!packet.empty());
+    assert(transport == this->transport_of(pipe_instance_token));
+
+    LOGTRACE("PIPE INSTANCE WROTE {} bytes", packet.size());
+    ETWTRACE("PipeWritten", etw::keyword_pipe,
+        etw::u64(pipe_instance_token, "PipeToken"),
+        etw::u64(packet.size(), "Bytes"),
+        etw::u64(output_queue_size, "OutputQueue"));
+
+    const auto packet_size = packet.size();
+
+    m_counters.pipe_bytes_out.fetch_add(
+        packet_size, std::memory_order_relaxed);
+    m_counters.pipe_packets_out.fetch_add(1, std::memory_order_relaxed);
+
+    // packet has been written, recycle it
+    m_buffer_pool->release(std::move(packet));
+
+    // *output_queue_size* is a number of packets, and it does not account for
+    // the ones pending at kernel level, so track the written bytes instead
+
+    std::shared_ptr<channel_t> channel;
+
+    {
+        std::scoped_lock lock(m_mutex);
+
+        auto chan_it = m_channels.find(pipe_instance_token);
+        if (chan_it == m_channels.end())
+            return;
+
+        channel = chan_it->second;
+    }
+
+    {
+        std::scoped_lock chan_lock(channel->mutex);
+
+        channel->output_size -= std::min(channel->output_size, packet_size);
+        channel->bytes_written += packet_size;
+
+        // the pipe completes writes in order, this one is the oldest
+        if (!channel->write_origins.empty())
+        {
+            const auto origin = channel->write_origins.front();
+
+            channel->write_origins.pop_front();
+
+            if (origin.stamp != 0)
+            {
+                m_response_latency.record(cix::hrticks_elapsed(origin.stamp));
+
+                // CAUTION: constant since init()
+                if (m_session_trace)
+                {
+                    m_session_trace->record_written(
+                        channel->client_id, origin.socks_id, origin.stamp);
+                }
+            }
+        }
+
+        // a write completed, feed the pipe with the SOCKS data that got
+        // queued or spooled, then whatever got coalesced in the meantime can
+        // go
+        if (!channel->sched.empty() || !channel->spools.empty())
+            channel->drain_sched(*m_buffer_pool);
+
+        if (!channel->batch.empty())
+            channel->flush_batch();
+
+        channel->charge_pending();
+
+        // client state is needed only if flow is to be resumed
+        if (!channel->is_flow_change_due())
+            return;
+    }
+
+    auto client = this->find_client_by_channel(channel);
+    if (!client)
+        return;
+
+    cix::lock_guard client_lock(client->mutex);
+
+    std::vector<socks_proxy::token_t> socks_tokens;
+    bool paused;
+
+    // resume reading from SOCKS targets once client caught up
+    if (this->update_client_flow(*client, *channel, paused, socks_tokens))
+    {
+        client_lock.unlock();
+        this->pause_socks(socks_tokens, paused);
+    }
+}
+
+
+void svc_worker::on_transport_closed(
+    std::shared_ptr<channel_transport> transport,
+    channel_transport::token_t pipe_instance_token)
+{
+    CIX_UNVAR(transport);
+
+    assert(transport);
+    assert(pipe_instance_token);
+    assert(transport == this->transport_of(pipe_instance_token));
+
+    LOGTRACE("PIPE INSTANCE DISCONNECTED");
+
+    capture::record(capture::kind_pipe_closed, pipe_instance_token);
+
+    // a transport that went away is what chansetup_resume is about, not a
+    // protocol error
+    this->erase_channel_and_client(pipe_instance_token, true, true);
+}
+
+
+void svc_worker::on_spool_ready(std::shared_ptr<channel_t> channel)
+{
+    // called by the spool thread once a spool of *channel* got read back, or
+    // emptied, after drain_spools() found nothing ready in it; as in
+    // on_transport_sent(), the pipe gets fed if it has room
+
+    {
+        std::scoped_lock chan_lock(channel->mutex);
+
+        if (channel->disconnected)
+            return;
+
+        if (!channel->sched.empty() || !channel->spools.empty())
+            channel->drain_sched(*m_buffer_pool);
+
+        if (!channel->batch.empty())
+            channel->flush_batch();
+
+        channel->charge_pending();
+
+        if (!channel->is_flow_change_due())
+            return;
+    }
+
+    auto client = this->find_client_by_channel(channel);
+    if (!client)
+        return;
+
+    cix::lock_guard client_lock(client->mutex);
+
+    std::vector<socks_proxy::token_t> socks_tokens;
+    bool paused;
+
+    if (this->update_client_flow(*client, *channel, paused, socks_tokens))
+    {
+        client_lock.unlock();
+        this->pause_socks(socks_tokens, paused);
+    }
+}
+
+
+void svc_worker::on_socks_response(
+    std::shared_ptr<socks_proxy> socks_proxy,
+    std::shared_ptr<socks_proxy::socks_packet_t> response)
+{
+    CIX_UNVAR(socks_proxy);
+    ALLOCSCOPE(stage_response);
+
+    const auto socks_token = response->client_token;
+
+    auto client = this->find_client_by_socks_token(socks_token);
+    if (!client)
+    {
+        // no client found, disconnect from SOCKS target
+        m_socks_proxy->disconnect_client(socks_token);
+        return;
+    }
+
+    cix::lock_guard client_lock(client->mutex);
+
+    const auto socks_id = client->find_socks_id_by_token(socks_token);
+    if (socks_id == proto::invalid_socks_id)
+    {
+        // erase_client() may have been called in the meantime
+        assert(client->erased);
+        client_lock.unlock();
+        m_socks_proxy->disconnect_client(socks_token);
+        return;
+    }
+
+    bool assigned = false;
+    auto write_channel = client->socks_write_channel(socks_id, &assigned);
+
+    // a resumable client may have to be sent it again, see socks_resume_t
+    auto socks_resume = client->find_socks_resume(socks_id);
+    if (socks_resume && response->packet.size() > response->headroom)
+    {
+        socks_resume->replay.append(
+            response->packet.data() + response->headroom,
+            response->packet.size() - response->headroom);
+
+        if (socks_resume->held || !write_channel)
+            return;
+
+        socks_resume->sent = socks_resume->replay.end_offset();
+        socks_resume->replay.trim(socks_resume->sent);
+    }
+
+    // the data of other clients, and of the other channels of this client, is
+    // not held by this one
+    client_lock.unlock();
+
+    if (response->packet.size() <= response->headroom || !write_channel)
+        return;
+
+    // SOCKS data goes with room for its op_socks header in front; only the
+    // replies made by socks_proxy itself come without, and they are tiny
+    auto socks_buffer = std::move(response->packet);
+    const bool is_reply = response->headroom != proto::socks_headroom;
+
+    if (is_reply)
+    {
+        const auto size = socks_buffer.size() - response->headroom;
+        auto framed = m_buffer_pool->acquire(proto::socks_headroom + size);
+
+        std::memcpy(
+            framed.data() + proto::socks_headroom,
+            socks_buffer.data() + response->headroom,
+            size);
+
+        socks_buffer = std::move(framed);
+    }
+
+    bool flow_change_due;
+    bool channel_paused;
+
+    {
+        std::scoped_lock chan_lock(write_channel->mutex);
+
+        // forward packet to the client side
+        // both the proto packet and the response buffer are pooled
+        if (is_reply)
+        {
+            write_channel->send_socks_reply(
+                *m_buffer_pool, socks_id, std::move(socks_buffer),
+                response->stamp);
+        }
+        else
+        {
+            write_channel->send_socks(
+                *m_buffer_pool, socks_id, std::move(socks_buffer),
+                response->stamp);
+        }
+
+        write_channel->charge_pending();
+        flow_change_due = write_channel->is_flow_change_due();
+        channel_paused = write_channel->flow_paused;
+    }
+
+    // stop reading from SOCKS targets if client does not keep up
+    if (flow_change_due)
+    {
+        std::vector<socks_proxy::token_t> socks_tokens;
+        bool paused;
+
+        client_lock.lock();
+
+        if (this->update_client_flow(
+            *client, *write_channel, paused, socks_tokens))
+        {
+            client_lock.unlock();
+            this->pause_socks(socks_tokens, paused);
+            return;
+        }
+
+        client_lock.unlock();
+    }
+
+    if (assigned && channel_paused)
+    {
+        // just assigned to a channel that was paused already
+        m_socks_proxy->pause_client(socks_token, true);
+    }
+}
+
+
+void svc_worker::on_socks_close_client(
+    std::shared_ptr<socks_proxy> socks_proxy,
+    socks_proxy::token_t socks_token)
+{
+    CIX_UNVAR(socks_proxy);
+
+    auto client = this->find_client_by_socks_token(socks_token);
+    if (!client)
+        return;
+
+    cix::lock_guard client_lock(client->mutex);
+
+    const auto socks_id = client->find_socks_id_by_token(socks_token);
+    if (socks_id == proto::invalid_socks_id)
+    {
+        assert(client->erased);
+        return;
+    }
+
+    // same channel as its data, which must be received first
+    auto write_channel = client->socks_write_channel(socks_id);
+    auto packet = proto::make_socks_close(
+        socks_id, m_buffer_pool->acquire(proto::control_packet_max_size));
+
+    // sent again after the data once resumed, see socks_resume_t
+    auto socks_resume = client->find_socks_resume(socks_id);
+    if (socks_resume)
+    {
+        socks_resume->tail_packets.push_back(packet);
+
+        if (socks_resume->held)
+            return;
+    }
+
+    client_lock.unlock();
+
+    if (write_channel)
+    {
+        std::scoped_lock chan_lock(write_channel->mutex);
+
+        write_channel->send_socks_packet(socks_id, std::move(packet));
+    }
+}
+
+
+void svc_worker::on_socks_disconnected(
+    std::shared_ptr<socks_proxy> socks_proxy,
+    socks_proxy::token_t socks_token)
+{
+    CIX_UNVAR(socks_proxy);
+
+    capture::record(capture::kind_target_closed, socks_token);
+
+    auto client = this->find_client_by_socks_token(socks_token);
+    if (!client)
+        return;
+
+    cix::lock_guard client_lock(client->mutex);
+
+    const auto socks_id = client->find_socks_id_by_token(socks_token);
+    if (socks_id == proto::invalid_socks_id)
+    {
+        assert(client->erased);
+        return;
+    }
+
+    auto write_channel = client->socks_write_channel(socks_id);
+    auto packet = proto::make_socks_disconnected(
+        socks_id, m_buffer_pool->acquire(proto::control_packet_max_size));
+
+    // same as on_socks_close_client(); kept until it could not be asked again
+    // anyway (see client_t::prune_socks_resume())
+    auto socks_resume = client->find_socks_resume(socks_id);
+    if (socks_resume)
+    {
+        socks_resume->tail_packets.push_back(packet);
+        socks_resume->ended = cix::ticks_now();
+
+        if (socks_resume->held)
+            return;
+    }
+
+    client_lock.unlock();
+
+    if (write_channel)
+    {
+        std::scoped_lock chan_lock(write_channel->mutex);
+
+        write_channel->send_socks_packet(socks_id, std::move(packet));
+    }
+}
+
+
+void svc_worker::on_socks_udp_associated(
+    std::shared_ptr<socks_proxy> socks_proxy,
+    socks_proxy::token_t socks_token)
+{
+    CIX_UNVAR(socks_proxy);
+
+    auto client = this->find_client_by_socks_token(socks_token);
+    if (!client)
+    {
+        m_socks_proxy->disconnect_client(socks_token);
+        return;
+    }
+
+    cix::lock_guard client_lock(client->mutex);
+
+    const auto socks_id = client->find_socks_id_by_token(socks_token);
+    if (socks_id == proto::invalid_socks_id)
+    {
+        assert(client->erased);
+        client_lock.unlock();
+        m_socks_proxy->disconnect_client(socks_token);
+        return;
+    }
+
+    // in place of the SOCKS reply, so on the same channel as the stream
+    auto write_channel = client->socks_write_channel(socks_id);
+    auto packet = proto::make_socks_udp_associated(socks_id);
+
+    // same as on_socks_close_client()
+    auto socks_resume = client->find_socks_resume(socks_id);
+    if (socks_resume)
+    {
+        socks_resume->tail_packets.push_back(packet);
+
+        if (socks_resume->held)
+            return;
+    }
+
+    client_lock.unlock();
+
+    if (write_channel)
+    {
+        std::scoped_lock chan_lock(write_channel->mutex);
+
+        write_channel->send_socks_packet(socks_id, std::move(packet));
+    }
+}
+
+
+void svc_worker::on_socks_target_flow(
+    std::shared_ptr<socks_proxy> socks_proxy,
+    socks_proxy::token_t socks_token,
+    bool full)
+{
+    CIX_UNVAR(socks_proxy);
+
+    auto client = this->find_client_by_socks_token(socks_token);
+    if (!client)
+        return;
+
+    cix::lock_guard client_lock(client->mutex);
+
+    const auto socks_id = client->find_socks_id_by_token(socks_token);
+    if (socks_id == proto::invalid_socks_id)
+        return;
+
+    // flow packets are not replayed: client side resumes reading anyway once
+    // the session is resumed, a lost pause only means more data queued here
+    auto socks_resume = client->find_socks_resume(socks_id);
+    if (socks_resume && socks_resume->held)
+        return;
+
+    auto write_channel = client->socks_write_channel(socks_id);
+
+    client_lock.unlock();
+
+    if (write_channel)
+    {
+        std::scoped_lock chan_lock(write_channel->mutex);
+
+        write_channel->send_socks_packet(
+            socks_id,
+            proto::make_socks_flow(
+                socks_id,
+                full ? proto::socks_flow_pause : proto::socks_flow_resume));
+    }
+}
+
+
+void svc_worker::on_socks_udp(
+    std::shared_ptr<socks_proxy> socks_proxy,
+    socks_proxy::token_t socks_token,
+    std::vector<socks_proxy::bytes_t>&& datagrams)
+{
+    CIX_UNVAR(socks_proxy);
+    ALLOCSCOPE(stage_response);
+
+    auto client = this->find_client_by_socks_token(socks_token);
+    if (!client)
+    {
+        m_socks_proxy->disconnect_client(socks_token);
+        return;
+    }
+
+    cix::lock_guard client_lock(client->mutex);
+
+    const auto socks_id = client->find_socks_id_by_token(socks_token);
+    if (socks_id == proto::invalid_socks_id)
+    {
+        assert(client->erased);
+        client_lock.unlock();
+        m_socks_proxy->disconnect_client(socks_token);
+        return;
+    }
+
+    auto write_channel = client->socks_write_channel(socks_id);
+
+    // datagrams are not replayed, see proto::chansetup_resume
+    const auto socks_resume = client->find_socks_resume(socks_id);
+    if (socks_resume && socks_resume->held)
+        return;
+
+    client_lock.unlock();
+
+    if (!write_channel)
+        return;
+
+    // a batch of socks_proxy is at most socketio::datagram_batch_max records
+    // of 64KB, way below proto::max_packet_size, but it may have to be spread
+    // over several packets if frames are capped (see chansetup_frame_cap)
+    const auto max_size = proto::max_packet_size_of(write_channel->caps);
+    std::vector<bytes_t> packets;
+    std::vector<socks_proxy::bytes_t> group;
+    std::size_t size = proto::socks_headroom;
+
+    for (auto& datagram : datagrams)
+    {
+        const auto record_size =
+            sizeof(proto::payload_socks_udp_record_t) + datagram.size();
+
+        if (!group.empty() && size + record_size > max_size)
+        {
+            packets.push_back(proto::make_socks_udp(socks_id, group));
+            group.clear();
+            size = proto::socks_headroom;
+        }
+
+        group.push_back(std::move(datagram));
+        size += record_size;
+    }
+
+    if (!group.empty())
+        packets.push_back(proto::make_socks_udp(socks_id, group));
+
+    bool flow_change_due;
+
+    {
+        std::scoped_lock chan_lock(write_channel->mutex);
+
+        for (auto& packet : packets)
+            write_channel->send_socks_packet(socks_id, std::move(packet));
+
+        write_channel->charge_pending();
+        flow_change_due = write_channel->is_flow_change_due();
+    }
+
+    // same as on_socks_response()
+    if (flow_change_due)
+    {
+        std::vector<socks_proxy::token_t> socks_tokens;
+        bool paused;
+
+        client_lock.lock();
+
+        if (this->update_client_flow(
+            *client, *write_channel, paused, socks_tokens))
+        {
+            client_lock.unlock();
+            this->pause_socks(socks_tokens, paused);
+            return;
+        }
+    }
+}
+
+
+//******************************************************************************
+
+
+
+svc_worker::channel_t::channel_t(
+        std::shared_ptr<channel_transport> transport_,
+        std::shared_ptr<mem_budget_t> mem_budget_,
+        std::size_t spool_max_size_,
+        pipe_token_t pipe_token_,
+        bytes_t&& packet)
+    : transport(std::move(transport_))
+    , mem_budget(std::move(mem_budget_))
+    , spool_max_size{spool_max_size_}
+    , pipe_token{pipe_token_}
+    , client_id{proto::invalid_client_id}
+    , config_flags{chanconfig_none}
+    , caps{static_cast<proto::channel_setup_flags_t>(0)}
+    , input_buffer(std::move(packet))
+    , recv_ring(recv_ring_capacity)
+    , recv_charged{0}
+    , last_recv{0}
+    , data_recv{false}
+    , recv_overflowing{false}
+    , disconnected{false}
+    , output_size{0}
+    , charged{0}
+    , crc_mode{proto::crc_full}
+    , flow_paused{false}
+    , sched(sched_quantum, sched_new_flows_first)
+    , spool_tail_size{0}
+    , batch_origin{0}
+    , compress_stats{}
+    , bytes_written{0}
+    , bytes_sent{0}
+    , bytes_expedited{0}
+    , rtt()
+    , ping_uid{0}
+    , ping_stamp{0}
+    , ping_written{0}
+{
+    assert(transport);
+    assert(mem_budget);
+    assert(pipe_token_ != 0);
+
+    if (!input_buffer.empty())
+    {
+        last_recv = cix::ticks_now();
+        data_recv = true;
+    }
+}
+
+
+svc_worker::channel_t::~channel_t()
+{
+    // in case it did not go through disconnect()
+    // in case it did not go through disconnect(), or data is still in
+    // *recv_ring*
+    mem_budget->discharge(
+        charged + recv_charged.load(std::memory_order_relaxed));
+}
+
+
+bool svc_worker::channel_t::is_just_connected() const
+{
+    return
+        client_id == proto::invalid_client_id ||
+        config_flags == chanconfig_none;
+}
+
+
+void svc_worker::channel_t::push_recv(bytes_t&& packet)
+{
+    // called by the pipe thread, the worker thread takes it from there, see
+    // pull_recv()
+
+    if (packet.empty())
+        return;
+
+    last_recv.store(cix::ticks_now(), std::memory_order_relaxed);
+    data_recv.store(true, std::memory_order_relaxed);
+
+    recv_charged.fetch_add(packet.size(), std::memory_order_relaxed);
+    mem_budget->charge(packet.size());
+
+    // try_push() leaves *packet* untouched if the ring is full
+    if (!recv_overflowing.load(std::memory_order_acquire) &&
+        recv_ring.try_push(std::move(packet)))
+    {
+        return;
+    }
+
+    std::scoped_lock recv_lock(recv_mutex);
+
+    // overflow may have been drained in the meantime
+    if (!recv_overflowing.load(std::memory_order_relaxed) &&
+        recv_ring.try_push(std::move(packet)))
+    {
+        return;
+    }
+
+    // CAUTION: from now on, and until pull_recv() drained the overflow, every
+    // packet must go to the overflow so that order is preserved
+    recv_overflowing.store(true, std::memory_order_release);
+    recv_overflow.push_back(std::move(packet));
+}
+
+
+void svc_worker::channel_t::pull_recv(cix::buffer_pool& pool)
+{
+    // input_stream_t adopts a packet when it has no pending data, and only
+    // copies it otherwise; the returned buffer can be recycled
+    const auto feed = [&](bytes_t&& packet) {
+        const auto size = packet.size();
+
+        if (caps & proto::chansetup_message_frames)
+            recv_messages.push_back(std::move(packet));
+        else
+            pool.release(input_buffer.feed(std::move(packet)));
+
+        recv_charged.fetch_sub(size, std::memory_order_relaxed);
+        mem_budget->discharge(size);
+    };
+
+    bytes_t packet;
+
+    while (recv_ring.try_pop(packet))
+        feed(std::move(packet));
+
+    if (!recv_overflowing.load(std::memory_order_acquire))
+        return;
+
+    {
+        std::scoped_lock recv_lock(recv_mutex);
+
+        // the pipe thread cannot push to the ring while the overflow flag is
+        // raised, so what is left in it is older than the overflow
+        while (recv_ring.try_pop(packet))
+            feed(std::move(packet));
+
+        recv_spare.swap(recv_overflow);
+        recv_overflowing.store(false, std::memory_order_release);
+    }
+
+    for (auto& spare : recv_spare)
+        feed(std::move(spare));
+
+    recv_spare.clear();
+}
+
+
+bool svc_worker::channel_t::send(
+    bytes_t&& packet,
+    bool validate_config_first,
+    cix::hrticks_t origin,
+    proto::socksid_t origin_socks_id)
+{
+    // *origin* is when the SOCKS data in *packet* was received from the
+    // target, if any, and *origin_socks_id* its connection; see
+    // on_transport_sent()
+
+    if (disconnected)
+        return false;
+
+    if (packet.empty())
+        return true;  // not an error per se
+
+    if (validate_config_first &&
+        config_flags != chanconfig_none &&
+        !(config_flags & chanconfig_write))
+    {
+        assert(0);  // not supposed to send anything through this channel
+        return false;
+    }
+
+    // pending SOCKS data must go first, the client expects it before an
+    // op_socks_close for instance
+    if (!batch.empty() && !this->flush_batch())
+        return false;
+
+    // the make_socks* packets are built in this mode already, this only costs
+    // a header-long CRC for them
+    if (crc_mode != proto::crc_full)
+        proto::update_crc(packet, crc_mode);
+
+    const auto packet_size = packet.size();
+
+    ETWTRACE("PipeSend", etw::keyword_pipe,
+        etw::u64(pipe_token, "PipeToken"),
+        etw::u64(packet_size, "Bytes"),
+        etw::u64(output_size, "PendingBytes"));
+
+    if (!transport->send(pipe_token, std::move(packet)))
+        return false;
+
+    output_size += packet_size;
+    bytes_sent += packet_size;
+    write_origins.push_back(write_origin_t{origin, origin_socks_id});
+
+    return true;
+}
+
+
+bool svc_worker::channel_t::send_expedited(bytes_t&& packet)
+{
+    // same as send(), minus the batch flush, which is the point
+
+    if (disconnected)
+        return false;
+
+    if (packet.empty())
+        return true;
+
+    if (config_flags != chanconfig_none && !(config_flags & chanconfig_write))
+    {
+        assert(0);
+        return false;
+    }
+
+    if (crc_mode != proto::crc_full)
+        proto::update_crc(packet, crc_mode);
+
+    const auto packet_size = packet.size();
+
+    if (!transport->send_expedited(pipe_token, std::move(packet)))
+        return false;
+
+    output_size += packet_size;
+    bytes_sent += packet_size;
+    bytes_expedited += packet_size;
+
+    // it is likely to be written before the queued packets
+    write_origins.push_front(write_origin_t{0, proto::invalid_socks_id});
+
+    return true;
+}
+
+
+std::size_t svc_worker::channel_t::pending_size() const
+{
+    // bytes not written to the pipe yet, whether the pipe got them or not;
+    // the spooled ones are on disk, only the tails of the spools count
+    return output_size + batch.size() + sched.size() + spool_tail_size;
+}
+
+
+bool svc_worker::channel_t::is_flow_change_due() const
+{
+    // whether update_client_flow() has something to do with this channel,
+    // which saves locking its client most of the time
+    const auto size = this->pending_size();
+    auto high_watermark = this->flow_high_watermark();
+    auto low_watermark = high_watermark / svc_worker::flow_low_ratio;
+
+    if (mem_budget->is_exhausted())
+    {
+        high_watermark = low_watermark;
+        low_watermark /= svc_worker::flow_low_ratio;
+    }
+
+    return flow_paused ?
+        size <= low_watermark :
+        size > high_watermark;
+}
+
+
+void svc_worker::channel_t::charge_pending()
+{
+    // CAUTION: mutex must be locked by caller
+    // only called where flow is checked, which is after every write
+    // completion, so that the charge does not lag for long
+
+    const auto size = this->pending_size();
+
+    if (size > charged)
+        mem_budget->charge(size - charged);
+    else
+        mem_budget->discharge(charged - size);
+
+    charged = size;
+}
+
+
+std::size_t svc_worker::channel_t::sched_budget() const
+{
+    const auto bdp = rtt.bdp();
+
+    if (bdp == 0)
+        return sched_pipe_budget;
+
+    return std::clamp<std::size_t>(
+        2 * bdp, sched_min_budget, sched_max_budget);
+}
+
+
+std::size_t svc_worker::channel_t::batch_max_size() const
+{
+    const auto bdp = rtt.bdp();
+
+    if (bdp == 0)
+        return socks_batch_max_size;
+
+    return std::clamp<std::size_t>(
+        bdp / 4, socks_batch_min_size, socks_batch_max_size);
+}
+
+
+std::size_t svc_worker::channel_t::flow_high_watermark() const
+{
+    const auto client_budget = mem_budget->client_budget();
+    const auto bdp = rtt.bdp();
+
+    if (bdp == 0)
+        return client_budget;
+
+    return std::min<std::size_t>(
+        client_budget, std::max<std::size_t>(4 * bdp, flow_min_watermark));
+}
+
+
+std::size_t svc_worker::channel_t::spool_watermark() const
+{
+    // half the high flow watermark, as adjusted by is_flow_change_due(), so
+    // that connections get spooled before their channel is paused
+
+    auto watermark = this->flow_high_watermark();
+
+    if (mem_budget->is_exhausted())
+        watermark /= svc_worker::flow_low_ratio;
+
+    return watermark / 2;
+}
+
+
+bool svc_worker::channel_t::send_ping()
+{
+    // CAUTION: mutex must be locked by caller
+    // a ping still in flight is superseded, its reply will not match
+
+    const auto uid = proto::generate_uid();
+    const auto stamp = cix::hrticks_now();
+
+    if (!this->send_expedited(
+            proto::make_ping(uid, stamp, proto::ping_request)))
+        return false;
+
+    ping_uid = uid;
+    ping_stamp = stamp;
+    ping_written = bytes_written;
+
+    return true;
+}
+
+
+bool svc_worker::channel_t::on_ping_reply(
+    std::uint32_t uid,
+    std::uint64_t stamp)
+{
+    // CAUTION: mutex must be locked by caller
+
+    if (ping_uid == 0 || uid != ping_uid || stamp != ping_stamp)
+        return false;
+
+    const auto sample = cix::hrticks_elapsed(ping_stamp);
+
+    rtt.on_sample(sample, bytes_written - ping_written);
+    ping_uid = 0;
+
+    LOGTRACE(
+        "CHANNEL RTT {}us (srtt {}us, min {}us), {} bytes/s, bdp {} bytes",
+        sample, rtt.srtt(), rtt.min_rtt(), rtt.delivery_rate(), rtt.bdp());
+
+    return true;
+}
+
+
+bool svc_worker::channel_t::send_socks(
+    cix::buffer_pool& pool,
+    proto::socksid_t socks_id,
+    bytes_t&& socks_buffer,
+    cix::hrticks_t origin)
+{
+    // a chunk bigger than what channel agreed on goes as several op_socks
+    // packets, so that the scheduler can interleave other connections between
+    // them (see chansetup_frame_cap)
+    const auto max_size = proto::max_packet_size_of(caps);
+
+    if (socks_buffer.size() > max_size)
+    {
+        const auto max_data = max_size - proto::socks_headroom;
+        const auto* const data = socks_buffer.data() + proto::socks_headroom;
+        const auto size = socks_buffer.size() - proto::socks_headroom;
+        std::vector<bytes_t> fragments;
+
+        for (std::size_t offset = max_data; offset < size; offset += max_data)
+        {
+            const auto len = std::min(max_data, size - offset);
+            auto fragment = pool.acquire(proto::socks_headroom + len);
+
+            std::memcpy(
+                fragment.data() + proto::socks_headroom, data + offset, len);
+            fragments.push_back(std::move(fragment));
+        }
+
+        socks_buffer.resize(max_size);
+
+        bool result = this->send_socks(
+            pool, socks_id, std::move(socks_buffer), origin);
+
+        for (auto& fragment : fragments)
+        {
+            if (result)
+            {
+                result = this->send_socks(
+                    pool, socks_id, std::move(fragment), origin);
+            }
+            else
+            {
+                pool.release(std::move(fragment));
+            }
+        }
+
+        return result;
+    }
+
+    // client does not keep up, this connection waits on disk rather than in
+    // memory
+    if (spool_max_size != 0 &&
+        this->spool_socks(socks_id, socks_buffer, origin))
+    {
+        return true;
+    }
+
+    // pipe is busy, SOCKS connections get their fair share of it from now on
+    // CAUTION: the scheduler then counts the headroom of the buffers too
+    if (!sched.empty() || output_size + batch.size() >= this->sched_budget())
+    {
+        sched.push(
+            socks_id, std::move(socks_buffer), sched_socks_data, origin);
+        return this->drain_sched(pool);
+    }
+
+    return this->write_socks(
+        pool, socks_id, std::move(socks_buffer), origin);
+}
+
+
+bool svc_worker::channel_t::send_socks_packet(
+    proto::socksid_t socks_id,
+    bytes_t&& packet)
+{
+    // behind the data of this connection that is still spooled or queued, if
+    // any
+    auto spool_it = spools.find(socks_id);
+    if (spool_it != spools.end())
+    {
+        spool_tail_size += packet.size();
+        spool_it->second.tail.push_back(
+            fair_queue_t::item_t{std::move(packet), sched_packet, 0});
+        return true;
+    }
+
+    if (sched.flow_size(socks_id) > 0)
+    {
+        sched.push(socks_id, std::move(packet), sched_packet);
+        return true;
+    }
+
+    // ahead of the data of the other connections otherwise, as long as its
+    // own is all written
+    if (this->is_socks_idle(socks_id))
+        return this->send_expedited(std::move(packet));
+
+    if (!this->send(std::move(packet)))
+        return false;
+
+    this->mark_socks_sent(socks_id);
+
+    return true;
+}
+
+
+bool svc_worker::channel_t::send_socks_reply(
+    cix::buffer_pool& pool,
+    proto::socksid_t socks_id,
+    bytes_t&& socks_buffer,
+    cix::hrticks_t origin)
+{
+    // a reply of socks_proxy itself (e.g. CONNECT) is tiny, and typically the
+    // first packet of its connection, so it does not wait behind bulk data
+
+    if (!this->is_socks_idle(socks_id))
+    {
+        return this->send_socks(
+            pool, socks_id, std::move(socks_buffer), origin);
+    }
+
+    auto packet = proto::frame_socks(
+        socks_id, std::move(socks_buffer), crc_mode);
+
+    return this->send_expedited(std::move(packet));
+}
+
+
+bool svc_worker::channel_t::drain_sched(cix::buffer_pool& pool)
+{
+    fair_queue_t::flowid_t socks_id;
+    fair_queue_t::item_t item;
+
+    const auto budget = this->sched_budget();
+
+    for (;;)
+    {
+        while (output_size + batch.size() < budget && sched.pop(socks_id, item))
+        {
+            bool result;
+
+            if (item.tag == sched_packet)
+            {
+                result = this->send(std::move(item.data));
+
+                if (result)
+                    this->mark_socks_sent(socks_id);
+            }
+            else
+            {
+                result = this->write_socks(
+                    pool, socks_id, std::move(item.data), item.stamp);
+            }
+
+            if (!result)
+                return false;
+        }
+
+        // spooled data goes once the rest did, see socks_spool_t; the tails
+        // of the spools that got drained come back to the scheduler
+        if (spools.empty() ||
+            !sched.empty() ||
+            output_size + batch.size() >= budget)
+        {
+            return true;
+        }
+
+        if (!this->drain_spools(pool, budget))
+            return false;
+
+        if (sched.empty())
+            return true;
+    }
+}
+
+
+bool svc_worker::channel_t::spool_socks(
+    proto::socksid_t socks_id,
+    bytes_t& socks_buffer,
+    cix::hrticks_t origin)
+{
+    // CAUTION: mutex must be locked by caller
+    // true if *socks_buffer* got spooled, or queued behind its spool, in which
+    // case it got moved from
+
+    auto spool_it = spools.find(socks_id);
+
+    if (spool_it == spools.end())
+    {
+        if (this->pending_size() < this->spool_watermark())
+            return false;
+
+        assert(spool_thread);
+
+        const auto max_chunk = std::min<std::size_t>(
+            spool_chunk_size,
+            proto::max_packet_size_of(caps) - proto::socks_headroom);
+
+        spool_it = spools.try_emplace(
+            socks_id,
+            spool_thread->open(
+                spool_max_size, proto::socks_headroom, max_chunk,
+                spool_queue_t::on_ready_t(spool_ready))).first;
+
+        LOGTRACE(
+            "SPOOL SOCKS connection {:#x} on pipe instance {} "
+            "({} bytes queued)",
+            socks_id, pipe_token, this->pending_size());
+    }
+
+    auto& spool = spool_it->second;
+
+    // appended by the spool thread, see spool_queue_t
+    if (spool.tail.empty() && spool.file->push(socks_buffer))
+        return true;
+
+    // refused
+    spool_tail_size += socks_buffer.size();
+    spool.tail.push_back(fair_queue_t::item_t{
+        std::move(socks_buffer), sched_socks_data, origin});
+
+    return true;
+}
+
+
+bool svc_worker::channel_t::drain_spools(
+    cix::buffer_pool& pool,
+    std::size_t budget)
+{
+    // CAUTION: mutex must be locked by caller
+    // one chunk per connection per round, so that spooled connections share
+    // the pipe too; the ones whose next chunk is not read back yet are
+    // skipped, on_spool_ready() comes back for them
+
+    bool progress = true;
+
+    while (progress && output_size + batch.size() < budget && !spools.empty())
+    {
+        progress = false;
+
+        for (auto it = spools.begin();
+            it != spools.end() && output_size + batch.size() < budget; )
+        {
+            const auto socks_id = it->first;
+            auto& spool = it->second;
+            bytes_t socks_buffer;
+
+            if (spool.file->pop(socks_buffer))
+            {
+                progress = true;
+
+                // latency is not recorded for spooled data, its origin is not
+                // kept
+                if (!this->write_socks(
+                        pool, socks_id, std::move(socks_buffer), 0))
+                {
+                    return false;
+                }
+
+                ++it;
+                continue;
+            }
+
+            if (!spool.file->empty())
+            {
+                ++it;
+                continue;
+            }
+
+            // caught up, this connection is back to the scheduler
+            for (auto& item : spool.tail)
+            {
+                spool_tail_size -= item.data.size();
+                sched.push(
+                    socks_id, std::move(item.data), item.tag, item.stamp);
+            }
+
+            LOGTRACE(
+                "UNSPOOL SOCKS connection {:#x} on pipe instance {}",
+                socks_id, pipe_token);
+
+            progress = true;
+            it = spools.erase(it);
+        }
+    }
+
+    return true;
+}
+
 
-    std::set<socks_proxy::token_t> socks_tokens_to_disconnect;
+bool svc_worker::channel_t::write_socks(
+    cix::buffer_pool& pool,
+    proto::socksid_t socks_id,
+    bytes_t&& socks_buffer,
+    cix::hrticks_t origin)
+{
+    const auto* const data = socks_buffer.data() + proto::socks_headroom;
+    const auto size = socks_buffer.size() - proto::socks_headroom;
 
-    auto client_it = m_clients.find(client_id);
-    if (client_it != m_clients.end())
+    // compressed chunks are not batched, they are big enough already
+    if ((caps & proto::chansetup_socks_lz4) && size >= compress_min_size)
     {
-        auto client = client_it->second;
-        pipe_token_t read_token = 0;
-        pipe_token_t write_token = 0;
+        auto packet = this->compress_socks(pool, socks_id, data, size);
 
-        if (!client->socks_id_to_token.empty())
+        if (!packet.empty())
         {
-            // hold the list of related SOCKS IDs locally so we can
-            // m_socks_proxy->disconnect_client() separately later on,
-            // so that we can unlock our mutex to avoid any stall due to the
-            // on_socks_disconnected() callback being called during a
-            // disconnect_client() call
-
-            assert(socks_tokens_to_disconnect.empty());
-            for (auto it : client->socks_id_to_token)
-            {
-                const auto socks_token = it.second;
+            pool.release(std::move(socks_buffer));
 
-                socks_tokens_to_disconnect.insert(socks_token);
-                m_socks_token_to_client.erase(socks_token);
-            }
+            if (!this->send(std::move(packet), true, origin, socks_id))
+                return false;
 
-            client->socks_id_to_token.clear();
+            this->mark_socks_sent(socks_id);
+            return true;
         }
+    }
 
-        if (client->chan_read)
-            read_token = client->chan_read->pipe_token;
-
-        if (client->chan_write)
-            write_token = client->chan_write->pipe_token;
-
-        if (disconnect && m_pipe)
-            client->disconnect(m_pipe, disconnect_except_pipe_token);
+    const auto record_size =
+        sizeof(proto::payload_socks_batch_record_t) + size;
+    const auto batch_max = this->batch_max_size();
 
-        if (read_token != 0)
-            m_channels.erase(read_token);
+    // plain op_socks if client does not support batches, if there is nothing
+    // to coalesce with since pipe is idle, or if chunk is too big anyway
+    if (!(caps & proto::chansetup_socks_batch) ||
+        (batch.empty() && output_size == 0) ||
+        sizeof(proto::header_t) + record_size > batch_max)
+    {
+        // framed in place, the data is not copied
+        auto packet = proto::frame_socks(
+            socks_id, std::move(socks_buffer), crc_mode);
 
-        if (write_token != 0 && write_token != read_token)
-            m_channels.erase(write_token);
+        if (!this->send(std::move(packet), true, origin, socks_id))
+            return false;
 
-        client.reset();
-        m_clients.erase(client_it);
-        client_it = m_clients.end();
+        this->mark_socks_sent(socks_id);
+        return true;
     }
 
-    if (!socks_tokens_to_disconnect.empty())
+    // keep the capacity of the pooled buffer, flush first if full
+    if (!batch.empty() && batch.size() + record_size > batch_max)
     {
-        auto socks_proxy = m_socks_proxy;
-
-        lock.unlock();  // IMPORTANT, see explanation above
-
-        for (const auto socks_id : socks_tokens_to_disconnect)
-            socks_proxy->disconnect_client(socks_id);
+        if (!this->flush_batch())
+        {
+            pool.release(std::move(socks_buffer));
+            return false;
+        }
     }
-    else
+
+    if (batch.empty())
     {
-        lock.unlock();  // just for symmetry with the if() block above
+        batch = pool.acquire(socks_batch_max_size);
+        batch.clear();
+        batch_origin = origin;
     }
-}
 
+    const bool appended =
+        proto::append_socks_batch_record(batch, socks_id, data, size);
 
-void svc_worker::disconnect_all()
-{
-    std::scoped_lock lock(m_mutex);
+    pool.release(std::move(socks_buffer));
 
-    if (m_pipe)
+    if (!appended)
     {
-        for (auto& chan_it : m_channels)
-            chan_it.second->disconnect(m_pipe);
+        assert(0);  // not supposed to happen, see above
+        return false;
     }
-}
 
+    if (batch_socks.empty() || batch_socks.back() != socks_id)
+        batch_socks.push_back(socks_id);
 
-void svc_worker::on_namedpipe_connected(
-    std::shared_ptr<cix::win_namedpipe_server> pipe,
-    cix::win_namedpipe_server::instance_token_t pipe_instance_token)
-{
-    assert(pipe);
-    assert(pipe_instance_token);
-    assert(pipe == m_pipe || !m_pipe);
-
-    CIX_UNVAR(pipe);
-
-    LOGTRACE("PIPE INSTANCE CONNECTED");
+    if (batch.size() >= batch_max)
+        return this->flush_batch();
 
-    // force-cleanup any existing channel with a same token, as well as any
-    // client object that depends on it
-    this->erase_channel_and_client(pipe_instance_token, false);
+    return true;
 }
 
 
-void svc_worker::on_namedpipe_recv(
-    std::shared_ptr<cix::win_namedpipe_server> pipe,
-    cix::win_namedpipe_server::instance_token_t pipe_instance_token,
-    cix::win_namedpipe_server::bytes_t&& packet)
+bool svc_worker::channel_t::flush_batch()
 {
-    assert(pipe);
-    assert(!packet.empty());
-    assert(pipe == m_pipe || !m_pipe);
+    if (batch.empty())
+        return true;
 
-    LOGTRACE("PIPE INSTANCE RECV {} bytes", packet.size());
+    auto packet = proto::make_socks_batch(std::move(batch), crc_mode);
+    batch.clear();  // moved-from state is unspecified
 
-    // this is a callback method, it must be executed as fast as possible so
-    // just (create and) feed the channel_t object here but leave the parsing
-    // and other actions to the maintenance thread
+    // *batch_origin* is the one of the first record
+    const auto origin_socks_id =
+        batch_socks.empty() ? proto::invalid_socks_id : batch_socks.front();
 
-    if (!packet.empty())
+    if (!this->send(std::move(packet), true, batch_origin, origin_socks_id))
     {
-        std::scoped_lock lock(m_mutex);
+        batch_socks.clear();
+        return false;
+    }
 
-        auto chan_it = m_channels.find(pipe_instance_token);
-        if (chan_it != m_channels.end())
-        {
-            auto& channel = chan_it->second;
-            channel->feed(std::move(packet));
-        }
-        else
-        {
-            auto channel = std::make_shared<channel_t>(
-                pipe_instance_token, std::move(packet));
+    for (const auto socks_id : batch_socks)
+        this->mark_socks_sent(socks_id);
 
-            m_channels.insert(std::make_pair(pipe_instance_token, channel));
-        }
+    batch_socks.clear();
 
-        SetEvent(m_recv_event);
-    }
+    return true;
 }
 
 
-void svc_worker::on_namedpipe_sent(
-    std::shared_ptr<cix::win_namedpipe_server> pipe,
-    cix::win_namedpipe_server::instance_token_t pipe_instance_token,
-    cix::win_namedpipe_server::bytes_t&& packet,
-    std::size_t output_queue_size)
+bool svc_worker::channel_t::is_socks_idle(proto::socksid_t socks_id) const
 {
-    CIX_UNVAR(pipe);
-    CIX_UNVAR(pipe_instance_token);
-    CIX_UNVAR(packet);
-    CIX_UNVAR(output_queue_size);
+    // CAUTION: mutex must be locked by caller
+    // whether all that was sent for *socks_id* got written, i.e. whether its
+    // next packet can be expedited without being received out of order
 
-    assert(pipe);
-    assert(!packet.empty());
-    assert(pipe == m_pipe || !m_pipe);
+    if (sched.flow_size(socks_id) > 0 || spools.find(socks_id) != spools.end())
+        return false;
 
-    LOGTRACE("PIPE INSTANCE WROTE {} bytes", packet.size());
+    if (std::find(batch_socks.begin(), batch_socks.end(), socks_id) !=
+        batch_socks.end())
+    {
+        return false;
+    }
+
+    const auto it = socks_marks.find(socks_id);
+    if (it == socks_marks.end())
+        return true;
+
+    // writes complete in order, except for the expedited ones sent since,
+    // which may have been written first
+    const auto& mark = it->second;
+
+    return bytes_written >= mark.sent + (bytes_expedited - mark.expedited);
 }
 
 
-void svc_worker::on_namedpipe_closed(
-    std::shared_ptr<cix::win_namedpipe_server> pipe,
-    cix::win_namedpipe_server::instance_token_t pipe_instance_token)
+void svc_worker::channel_t::mark_socks_sent(proto::socksid_t socks_id)
 {
-    CIX_UNVAR(pipe);
+    // CAUTION: mutex must be locked by caller
 
-    assert(pipe);
-    assert(pipe_instance_token);
-    assert(pipe == m_pipe || !m_pipe);
+    if (socks_marks.size() >= socks_marks_prune_size &&
+        socks_marks.find(socks_id) == socks_marks.end())
+    {
+        for (auto it = socks_marks.begin(); it != socks_marks.end(); )
+        {
+            const auto& mark = it->second;
 
-    LOGTRACE("PIPE INSTANCE DISCONNECTED");
+            if (bytes_written >= mark.sent + (bytes_expedited - mark.expedited))
+                it = socks_marks.erase(it);
+            else
+                ++it;
+        }
+    }
 
-    this->erase_channel_and_client(pipe_instance_token, true);
+    socks_marks[socks_id] = socks_mark_t{bytes_sent, bytes_expedited};
 }
 
 
-void svc_worker::on_socks_response(
-    std::shared_ptr<socks_proxy> socks_proxy,
-    std::shared_ptr<socks_proxy::socks_packet_t> response)
+svc_worker::bytes_t svc_worker::channel_t::compress_socks(
+    cix::buffer_pool& pool,
+    proto::socksid_t socks_id,
+    const proto::byte_t* data,
+    std::size_t size)
 {
-    CIX_UNVAR(socks_proxy);
-
-    const auto socks_token = response->client_token;
-
-    cix::lock_guard lock(m_mutex);
+    // returns an empty packet if *data* is to be sent raw
 
-    auto client = this->find_client_by_socks_token(socks_token);
-    if (!client)
+    if (compress::entropy(data, size) > compress_max_entropy)
     {
-        // no client found, disconnect from SOCKS target
-        lock.unlock();
-        m_socks_proxy->disconnect_client(socks_token);
-        return;
+        ++compress_stats.skipped_entropy;
+        return bytes_t();
     }
 
-    const auto socks_id = client->find_socks_id_by_token(socks_token);
-    if (socks_id == proto::invalid_socks_id)
-    {
-        assert(0);
-        lock.unlock();
-        m_socks_proxy->disconnect_client(socks_token);
-        return;
-    }
+    auto storage = pool.acquire(proto::socks_headroom + size);
 
-    if (!response->packet.empty() && client->chan_write)
+    auto packet = proto::make_socks_lz4(
+        socks_id, data, size, storage, crc_mode);
+    if (packet.empty())
     {
-        // forward packet to the client side
-        client->chan_write->send(
-            m_pipe, proto::make_socks(socks_id, response->packet));
+        pool.release(std::move(storage));
+        ++compress_stats.skipped_ratio;
+        return bytes_t();
     }
-}
 
+    ++compress_stats.packets;
+    compress_stats.raw_bytes += size;
+    compress_stats.compressed_bytes +=
+        packet.size() -
+        sizeof(proto::header_t) -
+        sizeof(proto::payload_socks_lz4_header_t);
 
-void svc_worker::on_socks_close_client(
-    std::shared_ptr<socks_proxy> socks_proxy,
-    socks_proxy::token_t socks_token)
-{
-    std::scoped_lock lock(m_mutex);
+    return packet;
+}
 
-    CIX_UNVAR(socks_proxy);
 
-    auto it = m_socks_token_to_client.find(socks_token);
-    if (it == m_socks_token_to_client.end())
-        return;
+void svc_worker::channel_t::disconnect()
+{
+    // *input_buffer* belongs to the worker thread, which may be parsing it,
+    // it goes away with this object
 
-    auto client = it->second.lock();
-    if (!client)
     {
-        m_socks_token_to_client.erase(it);
-        return;
+        std::scoped_lock chan_lock(mutex);
+
+        // does not call us back, the transport does once disconnected
+        if (!disconnected)
+            transport->disconnect_instance(pipe_token);
+
+        disconnected = true;
+        output_size = 0;
+        batch.clear();
+        sched.clear();
+        spools.clear();
+        spool_tail_size = 0;
+        write_origins.clear();
+        this->charge_pending();
     }
 
-    const auto socks_id = client->find_socks_id_by_token(socks_token);
-    if (socks_id == proto::invalid_socks_id)
+    // *recv_ring* can only be popped by the worker thread, it is left to the
+    // destructor
     {
-        assert(0);
-        return;
-    }
+        std::scoped_lock recv_lock(recv_mutex);
 
-    if (client->chan_write)
-        client->chan_write->send(m_pipe, proto::make_socks_close(socks_id));
-}
+        std::size_t size = 0;
 
+        for (const auto& packet : recv_overflow)
+            size += packet.size();
 
-void svc_worker::on_socks_disconnected(
-    std::shared_ptr<socks_proxy> socks_proxy,
-    socks_proxy::token_t socks_token)
-{
-    std::scoped_lock lock(m_mutex);
+        recv_overflow.clear();
+        recv_charged.fetch_sub(size, std::memory_order_relaxed);
+        mem_budget->discharge(size);
+        data_recv.store(false, std::memory_order_relaxed);
+    }
+}
 
-    CIX_UNVAR(socks_proxy);
 
-    auto it = m_socks_token_to_client.find(socks_token);
-    if (it == m_socks_token_to_client.end())
-        return;
 
-    auto client = it->second.lock();
-    if (!client)
-    {
-        m_socks_token_to_client.erase(it);
-        return;
-    }
+//******************************************************************************
 
-    const auto socks_id = client->find_socks_id_by_token(socks_token);
-    if (socks_id == proto::invalid_socks_id)
-    {
-        assert(0);
-        return;
-    }
 
-    if (client->chan_write)
-    {
-        client->chan_write->send(
-            m_pipe, proto::make_socks_disconnected(socks_id));
-    }
+
+svc_worker::socks_resume_t::socks_resume_t(
+        std::size_t replay_size,
+        std::shared_ptr<cix::buffer_pool> pool,
+        std::shared_ptr<mem_budget_t> mem_budget)
+    : replay(replay_size, std::move(pool), std::move(mem_budget))
+    , sent{0}
+    , rx_offset{0}
+    , held{false}
+    , ended{0}
+{
 }
 
 
@@ -991,138 +3830,139 @@ void svc_worker::on_socks_disconnected(
 
 
 
-svc_worker::channel_t::channel_t(pipe_token_t pipe_token_, bytes_t&& packet)
-    : client_id{proto::invalid_client_id}
-    , config_flags{chanconfig_none}
-    , pipe_token{pipe_token_}
-    , input_buffer(std::move(packet))
-    , last_recv{0}
-    , data_recv{false}
+svc_worker::socks_spool_t::socks_spool_t(
+        std::shared_ptr<spool_queue_t> file_)
+    : file(std::move(file_))
 {
-    assert(pipe_token_ != 0);
+    assert(file);
+}
 
-    if (!input_buffer.empty())
-    {
-        last_recv = cix::ticks_now();
-        data_recv = true;
-    }
+
+svc_worker::socks_spool_t::~socks_spool_t()
+{
+    file->close();
 }
 
 
-bool svc_worker::channel_t::is_just_connected() const
+
+//******************************************************************************
+
+
+
+svc_worker::client_t::client_t(
+    clientid_t id_, std::shared_ptr<channel_t> channel)
+: id{id_}
+, resumable{(channel->caps & proto::chansetup_resume) != 0}
+, erased{false}
+, next_write_chan{0}
+, detached{false}
+, resume_pending{false}
 {
-    return
-        client_id == proto::invalid_client_id ||
-        config_flags == chanconfig_none;
+    assert(id_ != proto::invalid_client_id);
+    assert(channel);
+
+    this->add_channel(channel);
 }
 
 
-void svc_worker::channel_t::feed(bytes_t&& packet)
+void svc_worker::client_t::add_channel(std::shared_ptr<channel_t> channel)
 {
-    // CAUTION: favor copy() here, instead of any seemingly more optimized way,
-    // like swap for instance, so that we keep the benefit of any potential
-    // input_buffer alloc made by previous calls
+    assert(channel->client_id == id);
+    assert(channel->config_flags != chanconfig_none);
 
-    if (!packet.empty())
-    {
-        // if (input_buffer.empty())
-        // {
-        //     input_buffer.swap(packet);
-        // }
-        // else
-        // {
-            input_buffer.reserve(input_buffer.size() + packet.size());
-            std::copy(
-                packet.begin(), packet.end(),
-                std::back_inserter(input_buffer));
-        // }
+    // a duplex channel goes in both
+    if (channel->config_flags & chanconfig_read)
+        chans_read.push_back(channel);
 
-        last_recv = cix::ticks_now();
-        data_recv = true;
-    }
+    if (channel->config_flags & chanconfig_write)
+        chans_write.push_back(channel);
 }
 
 
-bool svc_worker::channel_t::send(
-    std::shared_ptr<cix::win_namedpipe_server> pipe,
-    bytes_t&& packet,
-    bool validate_config_first)
+void svc_worker::client_t::disconnect(pipe_token_t except_pipe_token)
 {
-    if (pipe_token == 0 || !pipe)
-        return false;
+    // a duplex channel is in both vectors
+    std::set<pipe_token_t> visited;
 
-    if (packet.empty())
-        return true;  // not an error per se
+    for (const auto& channel : chans_read)
+    {
+        if (visited.insert(channel->pipe_token).second &&
+            channel->pipe_token != except_pipe_token)
+        {
+            channel->disconnect();
+        }
+    }
 
-    if (validate_config_first &&
-        config_flags != chanconfig_none &&
-        !(config_flags & chanconfig_write))
+    for (const auto& channel : chans_write)
     {
-        assert(0);  // not supposed to send anything through this channel
-        return false;
+        if (visited.insert(channel->pipe_token).second &&
+            channel->pipe_token != except_pipe_token)
+        {
+            channel->disconnect();
+        }
     }
 
-    return pipe->send(pipe_token, std::move(packet));
+    chans_read.clear();
+    chans_write.clear();
 }
 
 
-void svc_worker::channel_t::disconnect(
-    std::shared_ptr<cix::win_namedpipe_server> pipe)
+std::shared_ptr<svc_worker::channel_t>
+svc_worker::client_t::main_write_channel() const
 {
-    if (pipe && pipe_token != 0)
-        pipe->disconnect_instance(pipe_token);
-
-    pipe_token = 0;
-    input_buffer.clear();
-    data_recv = false;
+    return chans_write.empty() ? nullptr : chans_write.front();
 }
 
 
+std::shared_ptr<svc_worker::channel_t>
+svc_worker::client_t::socks_write_channel(
+    proto::socksid_t socks_id, bool* out_assigned)
+{
+    if (out_assigned)
+        *out_assigned = false;
 
-//******************************************************************************
-
+    if (chans_write.empty())
+        return nullptr;
 
+    auto it = socks_write_chan.find(socks_id);
+    if (it != socks_write_chan.end())
+        return chans_write[it->second];
 
-svc_worker::client_t::client_t(
-    clientid_t id_,
-    std::shared_ptr<channel_t> chan_read_,
-    std::shared_ptr<channel_t> chan_write_)
-: id{id_}
-, chan_read{chan_read_}
-, chan_write{chan_write_}
-{
-    assert(id_ != proto::invalid_client_id);
-    assert(chan_read_ || chan_write_);
-}
+    // least loaded channel, round robin among the equally loaded ones so that
+    // idle connections get spread too
+    auto best = next_write_chan % chans_write.size();
 
+    auto _pending_size = [](channel_t& channel) -> std::size_t
+        {
+            std::scoped_lock chan_lock(channel.mutex);
+            return channel.pending_size();
+        };
 
-void svc_worker::client_t::disconnect(
-    std::shared_ptr<cix::win_namedpipe_server> pipe,
-    pipe_token_t except_pipe_token)
-{
-    if (pipe)
+    if (chans_write.size() > 1)
     {
-        pipe_token_t read_token = 0;
+        auto best_size = _pending_size(*chans_write[best]);
 
-        if (chan_read &&
-            (except_pipe_token == 0 ||
-                except_pipe_token != chan_read->pipe_token))
+        for (std::size_t idx = 1; idx < chans_write.size(); ++idx)
         {
-            read_token = chan_read->pipe_token;
-            chan_read->disconnect(pipe);
-        }
+            const auto candidate =
+                (next_write_chan + idx) % chans_write.size();
+            const auto size = _pending_size(*chans_write[candidate]);
 
-        if (chan_write &&
-            chan_write->pipe_token != read_token &&
-            (except_pipe_token == 0 ||
-                except_pipe_token != chan_write->pipe_token))
-        {
-            chan_write->disconnect(pipe);
+            if (size < best_size)
+            {
+                best = candidate;
+                best_size = size;
+            }
         }
     }
 
-    chan_read.reset();
-    chan_write.reset();
+    next_write_chan = best + 1;
+    socks_write_chan.emplace(socks_id, best);
+
+    if (out_assigned)
+        *out_assigned = true;
+
+    return chans_write[best];
 }
 
 
@@ -1142,19 +3982,84 @@ proto::socksid_t
 svc_worker::client_t::find_socks_id_by_token(
     socks_proxy::token_t socks_token) const
 {
-    // for (const auto& pair : socks_id_to_token)
-    // {
-    //     if (pair.second == socks_token)
-    //         return pair.first;
-    // }
-    // return proto::invalid_socks_id;
-
-    auto it = std::find_if(
-        socks_id_to_token.begin(), socks_id_to_token.end(),
-        [&socks_token](const auto& pair) { return pair.second == socks_token; });
+    // called for every chunk of data received from a SOCKS target so this
+    // has to be a direct lookup
+    auto it = socks_token_to_id.find(socks_token);
 
     return
-        it == socks_id_to_token.end() ?
+        it == socks_token_to_id.end() ?
         proto::invalid_socks_id :
-        it->first;
+        it->second;
+}
+
+
+void svc_worker::client_t::map_socks(
+    proto::socksid_t socks_id, socks_proxy::token_t socks_token)
+{
+    assert(socks_id != proto::invalid_socks_id);
+    assert(socks_token != socks_proxy::invalid_token);
+    assert(socks_id_to_token.find(socks_id) == socks_id_to_token.end());
+    assert(socks_token_to_id.find(socks_token) == socks_token_to_id.end());
+
+    socks_id_to_token[socks_id] = socks_token;
+    socks_token_to_id[socks_token] = socks_id;
+}
+
+
+void svc_worker::client_t::clear_socks()
+{
+    socks_id_to_token.clear();
+    socks_token_to_id.clear();
+    socks_write_chan.clear();
+    socks_paused.clear();
+    socks_resume.clear();
+}
+
+
+bool svc_worker::client_t::is_socks_paused(proto::socksid_t socks_id) const
+{
+    const auto it = socks_write_chan.find(socks_id);
+
+    if (it != socks_write_chan.end())
+    {
+        auto& channel = *chans_write[it->second];
+        std::scoped_lock chan_lock(channel.mutex);
+
+        if (channel.flow_paused)
+            return true;
+    }
+
+    return socks_paused.find(socks_id) != socks_paused.end();
+}
+
+
+svc_worker::socks_resume_t*
+svc_worker::client_t::find_socks_resume(proto::socksid_t socks_id)
+{
+    if (!resumable)
+        return nullptr;
+
+    auto it = socks_resume.find(socks_id);
+
+    return it == socks_resume.end() ? nullptr : &it->second;
+}
+
+
+void svc_worker::client_t::prune_socks_resume(
+    cix::ticks_t now, cix::ticks_t max_age)
+{
+    for (auto it = socks_resume.begin(); it != socks_resume.end(); )
+    {
+        const auto& entry = it->second;
+
+        if (entry.ended != 0 && !entry.held &&
+            cix::ticks_elapsed(entry.ended, now) > max_age)
+        {
+            it = socks_resume.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
 }
@@ -5,7 +5,7 @@
 
 
 class svc_worker :
-    public cix::win_namedpipe_server::listener_t,
+    public channel_transport::listener_t,
     public socks_proxy::listener_t,
     public std::enable_shared_from_this<svc_worker>
 {
@@ -21,42 +21,435 @@ public:
 private:
     typedef proto::clientid_t clientid_t;
     typedef proto::bytes_t bytes_t;
-    typedef cix::win_namedpipe_server::instance_token_t pipe_token_t;
 
+    // token of the instance of a channel, whatever its transport (i.e. not
+    // necessarily a pipe instance anymore, see channel_transport)
+    typedef channel_transport::token_t pipe_token_t;
+
+    // watermarks of the output of a client's write channel, derived from the
+    // client budget of m_mem_budget (see channel_t::is_flow_change_due())
+    // * server stops reading from all the SOCKS targets assigned to a write
+    //   channel once its output goes above the budget
+    // * reading is resumed once output went back below *flow_low_ratio* of it
+    // * both are divided by *flow_low_ratio* again while the global budget is
+    //   exhausted, so that the channels that hold the most back off first
+    static constexpr std::size_t flow_low_ratio = 4;  // i.e. a quarter
+
+    // op_socks_batch: maximum size of a batch packet, header included
+    // * SOCKS data sent to a client that supports op_socks_batch is coalesced
+    //   while the previous writes to its write channel are pending; a batch is
+    //   flushed as soon as one of them completes, or once it is full
+    // * chunks bigger than this are sent as op_socks
+    enum : std::size_t
+    {
+        socks_batch_max_size = 64 * 1024,
+    };
+
+    // fair scheduling of the SOCKS data sent to a write channel
+    // * as long as the output of a write channel is below *sched_pipe_budget*
+    //   bytes, SOCKS data goes to the pipe straight away
+    // * past that, it is queued per SOCKS connection and fed to the pipe as
+    //   writes complete, in deficit round robin order, *sched_quantum* bytes
+    //   per connection per round (see fair_queue_t)
+    // * connections that were idle are served first if
+    //   *sched_new_flows_first* is set, so that interactive sessions do not
+    //   wait behind bulk transfers
+    enum : std::size_t
+    {
+        sched_pipe_budget = 256 * 1024,
+        sched_quantum = 16 * 1024,
+    };
+    static constexpr bool sched_new_flows_first = true;
+
+    // windows of a write channel once its RTT is known, see rtt_estimator_t
+    // and chansetup_ping_rtt
+    // * server pings the client every *ping_interval* milliseconds on each of
+    //   its write channels that agreed on chansetup_ping_rtt
+    // * the scheduler budget becomes twice the BDP of the channel, within
+    //   *sched_min_budget* and *sched_max_budget*, instead of
+    //   *sched_pipe_budget*; twice so that a channel that is busy can get a
+    //   higher delivery rate measured, and its budget can grow accordingly
+    // * a batch is flushed once a quarter of the BDP, within
+    //   *socks_batch_min_size* and *socks_batch_max_size*, so that a batch
+    //   does not wait behind more than the link can carry in an RTT
+    // * the high flow watermark becomes four times the BDP, at least
+    //   *flow_min_watermark*, and at most the client budget
+    enum : std::size_t
+    {
+        ping_interval = 2000,
+        sched_min_budget = 64 * 1024,
+        sched_max_budget = 4 * 1024 * 1024,
+        socks_batch_min_size = 16 * 1024,
+        flow_min_watermark = 1024 * 1024,
+    };
+
+    // tag of the items of channel_t::sched
+    enum sched_item_t : std::uint32_t
+    {
+        sched_socks_data = 0,  // SOCKS data buffer, see channel_t::send_socks()
+        sched_packet = 1,      // ready-made packet (e.g. op_socks_close)
+    };
+
+    // disk spool of a SOCKS connection whose client does not keep up, see
+    // config_t::spool_session_max
+    // * the data of a connection goes to *file* rather than to the scheduler
+    //   once the output of its write channel is past half its high flow
+    //   watermark, so that its target keeps being read instead of getting
+    //   paused along with the channel (see channel_t::spool_socks())
+    // * *file* is written and read back by m_spool_thread, never with a lock
+    //   of the worker held, so that a slow disk does not hold up the pipes
+    // * it is fed back to the pipe *spool_chunk_size* bytes at a time, round
+    //   robin among the spooled connections, once the scheduler is empty and
+    //   as it gets read back (see on_spool_ready())
+    // * whatever *file* refuses (i.e. full, failed, or too far behind the
+    //   disk), or comes after a packet of the connection (e.g.
+    //   op_socks_close), waits in *tail*, in memory, so that it is received in
+    //   order; *tail* counts in the output of the channel, which gets paused
+    //   once it goes above its watermark, as it would without a spool
+    // * the connection is back to the scheduler once all of it got sent
+    struct socks_spool_t
+    {
+        explicit socks_spool_t(std::shared_ptr<spool_queue_t> file_);
+        ~socks_spool_t();
+
+        socks_spool_t(const socks_spool_t&) = delete;
+        socks_spool_t& operator=(const socks_spool_t&) = delete;
+
+        const std::shared_ptr<spool_queue_t> file;
+        std::deque<fair_queue_t::item_t> tail;  // tagged as in *sched*
+    };
+
+    enum : std::size_t
+    {
+        spool_chunk_size = 64 * 1024,
+    };
+
+    // maximum number of channels a client may attach per direction, by
+    // repeating op_channel_setup with its client id
+    // * every SOCKS connection is assigned to one of the write channels of its
+    //   client, the least loaded one at the time, and sticks to it so that its
+    //   data is always received in order by client side
+    // * the channels of a client are all erased as soon as one of them closes,
+    //   and so is the client unless it is resumable (see detach_client())
+    enum : std::size_t
+    {
+        max_client_channels = 8,
+    };
+
+    // startup warm-up, see init(): idle buffers pre-allocated per size class
+    // of m_buffer_pool, so that the first clients after a start do not pay
+    // for their allocation nor their page faults
+    // * pipe and TCP channel reads (config_t::pipe_buffer_size)
+    // * SOCKS target reads (config_t::socket_input_buffer_size)
+    // * op_socks_batch packets (socks_batch_max_size)
+    // * control packets (proto::control_packet_max_size)
+    enum : std::size_t
+    {
+        warm_pipe_buffers = 16,
+        warm_socket_buffers = 32,
+        warm_batch_buffers = 8,
+        warm_control_buffers = 64,
+    };
+
+    // how long launch() waits for the pipe to be listening
+    enum : DWORD
+    {
+        listen_wait_timeout = 5000,  // milliseconds
+    };
+
+    // op_socks_lz4: SOCKS data sent to a client that supports op_socks_lz4 is
+    // compressed unless:
+    // * chunk is smaller than *compress_min_size*
+    // * its estimated entropy is above *compress_max_entropy* bits per byte,
+    //   i.e. it is very likely compressed or encrypted already
+    // * compressed data is not smaller
+    enum : std::size_t
+    {
+        compress_min_size = 256,
+    };
+    static constexpr double compress_max_entropy = 7.0;
+
+    // op_socks: SOCKS data received from a client is forwarded to its target
+    // as a slice of the channel's input buffer, without copying, as long as it
+    // is at least *slice_min_size* bytes; smaller chunks are copied so that
+    // they do not keep a whole pipe buffer alive until they are sent
+    enum : std::size_t
+    {
+        slice_min_size = 4 * 1024,
+    };
+
+    // number of received packets a channel can hold in its lock-free ring
+    // before the pipe thread falls back to its locked overflow queue (see
+    // channel_t::push_recv())
+    enum : std::size_t
+    {
+        recv_ring_capacity = 256,
+    };
+
+    // a pipe instance that does not set its channel up within
+    // config_t::channel_setup_timeout gets disconnected
+    // * these timers, and the session ones of socks_proxy, are checked by
+    //   main_loop() when the next one of them is due (see
+    //   timer_wheel_t::next_due()), every *timer_resolution* milliseconds at
+    //   most; it does not wake up at all while there are none
+    enum : DWORD
+    {
+        timer_resolution = socks_proxy::session_timer_resolution,
+    };
+
+    // expedited lane of a write channel (channel_transport::send_expedited())
+    // * pings, and their replies, always go ahead of the queued data
+    // * so do the packets of a SOCKS connection (e.g. op_socks_close, the
+    //   CONNECT reply) once all the data it was sent got written already, so
+    //   that they are still received in order; see channel_t::is_socks_idle()
+    // * the marks of the connections that got idle are pruned once there are
+    //   more than *socks_marks_prune_size* of them
+    enum : std::size_t
+    {
+        socks_marks_prune_size = 1024,
+    };
+
+    // output of a SOCKS connection to a write channel, see is_socks_idle()
+    struct socks_mark_t
+    {
+        std::uint64_t sent;       // channel_t::bytes_sent after its last packet
+        std::uint64_t expedited;  // channel_t::bytes_expedited at that time
+    };
+
+    // a pipe write pending, see on_transport_sent()
+    struct write_origin_t
+    {
+        cix::hrticks_t stamp;  // SOCKS data received from target; 0 if none
+        proto::socksid_t socks_id;  // connection of that data
+    };
+
+    // op_socks_lz4 counters of a write channel
+    struct compress_stats_t
+    {
+        std::uint64_t raw_bytes;         // data sent compressed, uncompressed
+        std::uint64_t compressed_bytes;  // same data, as sent
+        std::uint64_t packets;           // op_socks_lz4 packets sent
+        std::uint64_t skipped_entropy;   // chunks sent raw, see entropy check
+        std::uint64_t skipped_ratio;     // chunks sent raw, not compressible
+    };
+
+    // counters reported by op_stats, along with the gauges computed on demand
+    // by process_channel_received_stats_packet()
+    struct counters_t
+    {
+        std::atomic<std::uint64_t> pipe_bytes_in;
+        std::atomic<std::uint64_t> pipe_bytes_out;
+        std::atomic<std::uint64_t> pipe_packets_in;
+        std::atomic<std::uint64_t> pipe_packets_out;
+        std::array<
+            std::atomic<std::uint64_t>,
+            std::extent_v<decltype(proto::payload_stats_t::proto_errors)>>
+                proto_errors;
+        std::atomic<std::uint64_t> rtt_samples;
+    };
+
+    // locking
+    // * m_mutex only protects the indexes of svc_worker (m_channels, m_clients,
+    //   m_ready_channels, m_socks_token_to_client, m_setup_timers,
+    //   m_resume_timers and m_ping_timers), it is held just long enough to
+    //   look up or update them
+    // * client_t::mutex protects the state of a client: its channels and its
+    //   SOCKS connections
+    // * channel_t::mutex protects the output of a channel; its input is handed
+    //   from the pipe thread to the worker thread through a lock-free ring, so
+    //   that parsing never blocks the pipe; channel_t::recv_mutex only
+    //   protects the overflow of the ring
+    // * if more than one is needed, they must be locked in this order:
+    //   client_t::mutex, channel_t::mutex, m_mutex, channel_t::recv_mutex
+    // * none of them is to be held while calling socks_proxy, which calls us
+    //   back from its own threads
     struct channel_t
     {
         channel_t() = delete;
-        channel_t(pipe_token_t pipe_token_, bytes_t&& packet);
-        ~channel_t() = default;
+        channel_t(
+            std::shared_ptr<channel_transport> transport_,
+            std::shared_ptr<mem_budget_t> mem_budget_,
+            std::size_t spool_max_size_,
+            pipe_token_t pipe_token_,
+            bytes_t&& packet);
+        ~channel_t();
 
+        // worker thread only
         bool is_just_connected() const;
-        void feed(bytes_t&& packet);
+        void pull_recv(cix::buffer_pool& pool);
+
+        // CAUTION: calls must be serialized by caller (i.e. m_mutex), since
+        // this is the producer side of *recv_ring*
+        void push_recv(bytes_t&& packet);
+
+        // CAUTION: mutex must be locked by caller
         bool send(
-            std::shared_ptr<cix::win_namedpipe_server> pipe,
             bytes_t&& packet,
-            bool validate_config_first=true);
-        void disconnect(std::shared_ptr<cix::win_namedpipe_server> pipe);
+            bool validate_config_first=true,
+            cix::hrticks_t origin=0,
+            proto::socksid_t origin_socks_id=proto::invalid_socks_id);
+        bool send_expedited(bytes_t&& packet);
+        std::size_t pending_size() const;
+        bool is_flow_change_due() const;
+        void charge_pending();  // pending_size() to *mem_budget*
+
+        // windows, sized out of *rtt* once known (see ping_interval)
+        std::size_t sched_budget() const;
+        std::size_t batch_max_size() const;
+        std::size_t flow_high_watermark() const;
+        std::size_t spool_watermark() const;
+
+        // a ping_request to measure *rtt*, and its reply
+        bool send_ping();
+        bool on_ping_reply(std::uint32_t uid, std::uint64_t stamp);
+
+        // SOCKS data and packets are sent through the scheduler
+        // * *socks_buffer* is pooled, made of proto::socks_headroom bytes
+        //   followed by the SOCKS data, so that write_socks() can frame it in
+        //   place; it is recycled once sent
+        // * a buffer bigger than the frame cap of the channel is split first
+        //   (see proto::max_packet_size_of())
+        // * send_socks_packet() and send_socks_reply() (replies of socks_proxy
+        //   itself) expedite theirs when the connection is idle
+        // * connections may go through a spool instead, see socks_spool_t
+        bool send_socks(
+            cix::buffer_pool& pool,
+            proto::socksid_t socks_id,
+            bytes_t&& socks_buffer,
+            cix::hrticks_t origin);
+        bool send_socks_packet(proto::socksid_t socks_id, bytes_t&& packet);
+        bool send_socks_reply(
+            cix::buffer_pool& pool,
+            proto::socksid_t socks_id,
+            bytes_t&& socks_buffer,
+            cix::hrticks_t origin);
+        bool drain_sched(cix::buffer_pool& pool);
+        bool spool_socks(
+            proto::socksid_t socks_id,
+            bytes_t& socks_buffer,
+            cix::hrticks_t origin);
+        bool drain_spools(cix::buffer_pool& pool, std::size_t budget);
+        bool write_socks(
+            cix::buffer_pool& pool,
+            proto::socksid_t socks_id,
+            bytes_t&& socks_buffer,
+            cix::hrticks_t origin);
+        bool flush_batch();
+        bool is_socks_idle(proto::socksid_t socks_id) const;
+        void mark_socks_sent(proto::socksid_t socks_id);
+        bytes_t compress_socks(
+            cix::buffer_pool& pool,
+            proto::socksid_t socks_id,
+            const proto::byte_t* data,
+            std::size_t size);
+
+        // CAUTION: mutex and recv_mutex must not be locked by caller
+        void disconnect();
+
+        const std::shared_ptr<channel_transport> transport;
+        const std::shared_ptr<mem_budget_t> mem_budget;
+        const std::size_t spool_max_size;  // 0: spooling is disabled
+        const pipe_token_t pipe_token;
 
+        // set once at creation, see socks_spool_t; null if spooling is
+        // disabled
+        std::shared_ptr<spool_thread_t> spool_thread;
+        spool_queue_t::on_ready_t spool_ready;
+
+        // set once by the worker thread at setup, with m_mutex locked
         clientid_t client_id;
         channel_config_t config_flags;
-        pipe_token_t pipe_token;
-        bytes_t input_buffer;
-        cix::ticks_t last_recv;
-        bool data_recv;
+        proto::channel_setup_flags_t caps;  // agreed at channel setup
+
+        // worker thread only
+        input_stream_t input_buffer;
+        std::vector<bytes_t> recv_spare;  // swapped with *recv_overflow*
+
+        // pulled instead of fed to *input_buffer* once
+        // proto::chansetup_message_frames is agreed, so that each may go
+        // through input_buffer on its own, see process_received_data()
+        std::vector<bytes_t> recv_messages;
+
+        // received, not in *input_buffer* yet; pushed by the pipe thread,
+        // popped by the worker thread
+        // * packets go to *recv_ring* unless it is full, in which case they go
+        //   to *recv_overflow* until the worker thread drained both, so that
+        //   they are always pulled in order
+        // * *recv_charged* is the size of both, see *mem_budget*
+        cix::spsc_queue<bytes_t> recv_ring;
+        std::atomic<std::size_t> recv_charged;
+        std::atomic<cix::ticks_t> last_recv;
+        std::atomic<bool> data_recv;
+
+        // protected by *recv_mutex*
+        std::mutex recv_mutex;
+        std::vector<bytes_t> recv_overflow;
+        std::atomic<bool> recv_overflowing;  // written with the lock held
+
+        // protected by *mutex*
+        std::mutex mutex;
+        bool disconnected;
+        std::size_t output_size;  // bytes sent to pipe but not written yet
+        std::size_t charged;  // see charge_pending()
+        proto::crc_mode_t crc_mode;  // switched once setup is acked
+        bool flow_paused;  // output above watermark, see update_client_flow()
+        bytes_t batch;  // pending op_socks_batch records, see write_socks()
+        std::vector<proto::socksid_t> batch_socks;  // connections in *batch*
+        fair_queue_t sched;  // SOCKS data waiting for the pipe, see send_socks()
+        std::unordered_map<proto::socksid_t, socks_spool_t> spools;
+        std::size_t spool_tail_size;  // bytes, all the tails of *spools*
+        cix::hrticks_t batch_origin;  // of the oldest record in *batch*
+        std::deque<write_origin_t> write_origins;  // one per pipe write pending
+        compress_stats_t compress_stats;
+        std::uint64_t bytes_written;  // so far, see on_transport_sent()
+        std::uint64_t bytes_sent;  // to the transport so far, expedited or not
+        std::uint64_t bytes_expedited;  // through send_expedited() so far
+        cix::flat_hash_map<proto::socksid_t, socks_mark_t> socks_marks;
+        rtt_estimator_t rtt;
+        std::uint32_t ping_uid;  // of the ping in flight; 0 if none
+        std::uint64_t ping_stamp;
+        std::uint64_t ping_written;  // *bytes_written* when it got sent
+    };
+
+    // a SOCKS connection of a resumable client, see proto::chansetup_resume
+    // * whatever is sent to client goes to *replay* first, so that the part
+    //   client missed can be sent again once resumed; data that comes from
+    //   the target while *held* is only appended to it
+    // * *tail_packets* are the other packets of this connection sent to
+    //   client, sent again after the data
+    struct socks_resume_t
+    {
+        socks_resume_t() = delete;
+        socks_resume_t(
+            std::size_t replay_size,
+            std::shared_ptr<cix::buffer_pool> pool,
+            std::shared_ptr<mem_budget_t> mem_budget);
+
+        replay_buffer_t replay;
+        std::uint64_t sent;       // offset of *replay* sent to client so far
+        std::uint64_t rx_offset;  // bytes of SOCKS data received from client
+        bool held;  // client detached, or connection not resumed yet
+        cix::ticks_t ended;  // when the target disconnected; 0 if it did not
+        std::vector<bytes_t> tail_packets;
     };
 
     struct client_t
     {
         client_t() = delete;
-        client_t(
-            clientid_t id_,
-            std::shared_ptr<channel_t> chan_read_,
-            std::shared_ptr<channel_t> chan_write_);
+        client_t(clientid_t id_, std::shared_ptr<channel_t> channel);
         ~client_t() = default;
 
-        void disconnect(
-            std::shared_ptr<cix::win_namedpipe_server> pipe,
-            pipe_token_t except_pipe_token=0);
+        // CAUTION: all the methods below expect *mutex* to be locked by caller
+        void add_channel(std::shared_ptr<channel_t> channel);
+        void disconnect(pipe_token_t except_pipe_token=0);
+
+        // the first write channel, for replies that are not SOCKS related
+        std::shared_ptr<channel_t> main_write_channel() const;
+
+        // the write channel of a SOCKS connection, which gets assigned on
+        // first call, in which case *out_assigned* is set
+        std::shared_ptr<channel_t> socks_write_channel(
+            proto::socksid_t socks_id, bool* out_assigned=nullptr);
 
         socks_proxy::token_t find_socks_token_by_id(
             proto::socksid_t socks_id) const;
@@ -64,48 +457,122 @@ private:
         proto::socksid_t find_socks_id_by_token(
             socks_proxy::token_t socks_token) const;
 
-        clientid_t id;
-        std::shared_ptr<channel_t> chan_read;
-        std::shared_ptr<channel_t> chan_write;
+        void map_socks(
+            proto::socksid_t socks_id, socks_proxy::token_t socks_token);
+        void clear_socks();
+
+        bool is_socks_paused(proto::socksid_t socks_id) const;
+
+        // null if client is not resumable, or connection is not known
+        socks_resume_t* find_socks_resume(proto::socksid_t socks_id);
+
+        // forget the connections whose target disconnected more than
+        // *max_age* ago, a resume would not need them anymore
+        void prune_socks_resume(cix::ticks_t now, cix::ticks_t max_age);
+
+        const clientid_t id;
+        const bool resumable;  // first channel agreed on chansetup_resume
+
+        // protected by *mutex*
+        std::mutex mutex;
+        bool erased;  // by erase_client(), no channel can be attached anymore
+        std::vector<std::shared_ptr<channel_t>> chans_read;   // setup order
+        std::vector<std::shared_ptr<channel_t>> chans_write;  // setup order
+
+        // CAUTION: both maps must be kept in sync, see map_socks() and
+        // clear_socks()
         std::map<proto::socksid_t, socks_proxy::token_t> socks_id_to_token;
+        std::unordered_map<socks_proxy::token_t, proto::socksid_t>
+            socks_token_to_id;
+
+        // index in *chans_write*, see socks_write_channel()
+        std::unordered_map<proto::socksid_t, std::size_t> socks_write_chan;
+        std::size_t next_write_chan;
+
+        std::set<proto::socksid_t> socks_paused;  // paused by op_socks_flow
+
+        // see detach_client()
+        bool detached;  // lost its channels, see m_resume_timers
+        bool resume_pending;  // op_socks_resume list not sent yet
+        std::unordered_map<proto::socksid_t, socks_resume_t> socks_resume;
     };
 
 public:
     svc_worker();
     ~svc_worker();
 
-    exit_t init(HANDLE stop_event, const std::wstring& pipe_base_name);
+    exit_t init(
+        HANDLE stop_event,
+        const std::wstring& pipe_base_name,
+        const config_t& config);
+
+    // start the transports and the threads of the worker, and wait for its
+    // pipe to be listening; main_loop() must follow unless it failed
+    exit_t launch();
     exit_t main_loop();
 
 private:
     // main loop subs
+    DWORD timers_wait_timeout();
+    void expire_timers();
+    void wake_timers(cix::ticks_t deadline);
     void process_received_data();
     bool process_channel_received_data(
         std::shared_ptr<channel_t> channel,
-        bytes_t& packet,
+        bool whole_message,
         bool* out_must_erase);
     void process_channel_received_packet(
         std::shared_ptr<channel_t> channel,
-        const bytes_t& packet,
+        const proto::packet_view_t& packet,
         const proto::header_t& header,
         bool* out_must_erase);
     void process_channel_setup(
         std::shared_ptr<channel_t> channel,
-        const bytes_t& packet,
+        const proto::packet_view_t& packet,
         const proto::header_t& header,
         bool* out_must_erase);
     void process_channel_received_ping_packet(
         std::shared_ptr<channel_t> channel,
+        const proto::packet_view_t& packet,
+        const proto::header_t& header,
+        bool* out_must_erase);
+    void process_channel_received_stats_packet(
+        std::shared_ptr<channel_t> channel,
+        const proto::packet_view_t& packet,
         const proto::header_t& header,
         bool* out_must_erase);
+    void collect_stats(
+        proto::payload_stats_t& out_stats,
+        socks_proxy::stats_t& out_socks_stats);
+    static void to_stats_latency(
+        const latency_histogram_t::summary_t& summary,
+        proto::payload_stats_latency_t& out_latency);
+#ifdef APP_PERF_ENABLED
+    void collect_perf_counters(perf_counters::values_t& out_values);
+#endif
     void process_channel_received_socks_packet(
         std::shared_ptr<channel_t> channel,
-        const bytes_t& packet,
+        const proto::packet_view_t& packet,
         const proto::header_t& header,
         bool* out_must_erase);
     void process_channel_received_socks_close_packet(
         std::shared_ptr<channel_t> channel,
-        const bytes_t& packet,
+        const proto::packet_view_t& packet,
+        const proto::header_t& header,
+        bool* out_must_erase);
+    void process_channel_received_socks_flow_packet(
+        std::shared_ptr<channel_t> channel,
+        const proto::packet_view_t& packet,
+        const proto::header_t& header,
+        bool* out_must_erase);
+    void process_channel_received_socks_udp_packet(
+        std::shared_ptr<channel_t> channel,
+        const proto::packet_view_t& packet,
+        const proto::header_t& header,
+        bool* out_must_erase);
+    void process_channel_received_socks_resume_packet(
+        std::shared_ptr<channel_t> channel,
+        const proto::packet_view_t& packet,
         const proto::header_t& header,
         bool* out_must_erase);
     void process_channel_received_uninstall_self_packet();
@@ -119,29 +586,44 @@ private:
         socks_proxy::token_t socks_token);
     std::shared_ptr<channel_t> find_write_channel(
         std::shared_ptr<channel_t> channel) const;
-    void erase_channel_and_client(pipe_token_t pipe_token, bool disconnect);
+    void erase_channel_and_client(
+        pipe_token_t pipe_token, bool disconnect, bool may_resume=false);
     void erase_client(
         clientid_t client_id,
         bool disconnect,
         pipe_token_t disconnect_except_pipe_token=0);
+    bool detach_client(clientid_t client_id);
     void disconnect_all();
+    std::shared_ptr<channel_transport> transport_of(
+        pipe_token_t pipe_token) const;
+    bool update_client_flow(
+        client_t& client,
+        channel_t& channel,
+        bool& out_paused,
+        std::vector<socks_proxy::token_t>& out_socks_tokens);
+    void pause_socks(
+        const std::vector<socks_proxy::token_t>& socks_tokens,
+        bool paused);
 
-    // cix::win_namedpipe_server::listener_t
-    void on_namedpipe_connected(
-        std::shared_ptr<cix::win_namedpipe_server> pipe,
-        cix::win_namedpipe_server::instance_token_t pipe_instance_token);
-    void on_namedpipe_recv(
-        std::shared_ptr<cix::win_namedpipe_server> pipe,
-        cix::win_namedpipe_server::instance_token_t pipe_instance_token,
-        cix::win_namedpipe_server::bytes_t&& packet);
-    void on_namedpipe_sent(
-        std::shared_ptr<cix::win_namedpipe_server> pipe,
-        cix::win_namedpipe_server::instance_token_t pipe_instance_token,
-        cix::win_namedpipe_server::bytes_t&& packet,
+    // channel_transport::listener_t
+    void on_transport_connected(
+        std::shared_ptr<channel_transport> transport,
+        channel_transport::token_t pipe_instance_token);
+    void on_transport_recv(
+        std::shared_ptr<channel_transport> transport,
+        channel_transport::token_t pipe_instance_token,
+        channel_transport::bytes_t&& packet);
+    void on_transport_sent(
+        std::shared_ptr<channel_transport> transport,
+        channel_transport::token_t pipe_instance_token,
+        channel_transport::bytes_t&& packet,
         std::size_t output_queue_size);
-    void on_namedpipe_closed(
-        std::shared_ptr<cix::win_namedpipe_server> pipe,
-        cix::win_namedpipe_server::instance_token_t pipe_instance_token);
+    void on_transport_closed(
+        std::shared_ptr<channel_transport> transport,
+        channel_transport::token_t pipe_instance_token);
+
+    // spool_queue_t::on_ready_t
+    void on_spool_ready(std::shared_ptr<channel_t> channel);
 
     // socks_proxy::listener_t
     void on_socks_response(
@@ -153,19 +635,55 @@ private:
     void on_socks_disconnected(
         std::shared_ptr<socks_proxy> socks_proxy,
         socks_proxy::token_t socks_token);
+    void on_socks_udp_associated(
+        std::shared_ptr<socks_proxy> socks_proxy,
+        socks_proxy::token_t socks_token);
+    void on_socks_target_flow(
+        std::shared_ptr<socks_proxy> socks_proxy,
+        socks_proxy::token_t socks_token,
+        bool full);
+    void on_socks_udp(
+        std::shared_ptr<socks_proxy> socks_proxy,
+        socks_proxy::token_t socks_token,
+        std::vector<socks_proxy::bytes_t>&& datagrams);
 
 private:
-    mutable std::recursive_mutex m_mutex;
+    mutable std::mutex m_mutex;  // indexes only, see channel_t
 
     HANDLE m_stop_event;
     HANDLE m_recv_event;
     std::wstring m_pipe_path;
-    std::shared_ptr<cix::win_namedpipe_server> m_pipe;
+    std::wstring m_capture_path;  // capture disabled if empty
+    std::shared_ptr<pipe_transport> m_pipe;
+    std::shared_ptr<tcp_transport> m_tcp;  // null unless enabled
     std::shared_ptr<socks_proxy> m_socks_proxy;
+    std::shared_ptr<cix::buffer_pool> m_buffer_pool;  // pipe and socket I/O
+    std::shared_ptr<mem_budget_t> m_mem_budget;  // shared with socks_proxy
+    std::shared_ptr<session_trace_t> m_session_trace;  // same; null: disabled
+    cix::ticks_t m_setup_timeout;
+    cix::ticks_t m_resume_timeout;  // 0: chansetup_resume is not agreed
+    bool m_message_mode;  // pipes are messages, see chansetup_message_frames
+    std::size_t m_replay_size;  // see socks_resume_t
+    std::size_t m_spool_max_size;  // see socks_spool_t
+    std::shared_ptr<spool_thread_t> m_spool_thread;  // null unless spooling
+    cix::ticks_t m_last_timers;  // last expire_timers() pass
+    bool m_socks_timers;  // socks_proxy may have session timers pending
+    const cix::ticks_t m_start_time;
+    counters_t m_counters;
+    latency_histogram_t m_response_latency;  // SOCKS target -> pipe written
+#ifdef APP_PERF_ENABLED
+    perf_counters::instance_t m_perf_instance;  // from launch()
+#endif
 
-    std::map<pipe_token_t, std::shared_ptr<channel_t>> m_channels;
-    std::map<clientid_t, std::shared_ptr<client_t>> m_clients;
-    std::map<socks_proxy::token_t, std::weak_ptr<client_t>> m_socks_token_to_client;
+    cix::flat_hash_map<pipe_token_t, std::shared_ptr<channel_t>> m_channels;
+    std::set<pipe_token_t> m_ready_channels;  // channels with received data
+    cix::flat_hash_map<clientid_t, std::shared_ptr<client_t>> m_clients;
+    cix::flat_hash_map<socks_proxy::token_t, std::weak_ptr<client_t>>
+        m_socks_token_to_client;
+    timer_wheel_t m_setup_timers;  // by pipe token, see timer_resolution
+    timer_wheel_t m_resume_timers;  // by client id, see detach_client()
+    timer_wheel_t m_ping_timers;  // by pipe token, see ping_interval
+    cix::ticks_t m_timers_due;  // main_loop() waits until then; 0: no timer
 };
 
 CIX_IMPLEMENT_ENUM_BITOPS(svc_worker::channel_config_t)
@@ -0,0 +1,515 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "main.h"
+
+
+tcp_transport::instance_t::instance_t(token_t token_, SOCKET socket_)
+    : token{token_}
+    , socket{socket_}
+    , write_event{CreateEvent(nullptr, FALSE, FALSE, nullptr)}  // auto reset
+    , closing{false}
+    , bytes_in_flight{0}
+    , writes_completed{0}
+{
+    if (!write_event)
+        CIX_THROW_WINERR("failed to create tcp write event");
+}
+
+
+tcp_transport::instance_t::~instance_t()
+{
+    CloseHandle(write_event);
+}
+
+
+//******************************************************************************
+
+
+
+tcp_transport::tcp_transport()
+    : m_port{0}
+    , m_io_buffer_size{io_buffer_default_size}
+    , m_rcvbuf{0}
+    , m_sndbuf{0}
+    , m_listen{INVALID_SOCKET}
+    , m_next_token{1}
+{
+}
+
+
+tcp_transport::~tcp_transport()
+{
+    // threads cannot call back anymore, shared_from_this() is not usable
+    this->set_listener(nullptr);
+    this->stop();
+}
+
+
+void tcp_transport::set_port(std::uint16_t port)
+{
+    m_port = port;
+}
+
+
+void tcp_transport::set_io_buffer_size(DWORD size)
+{
+    m_io_buffer_size = std::max<DWORD>(size, 1);
+}
+
+
+void tcp_transport::set_socket_buffer_sizes(int rcvbuf, int sndbuf)
+{
+    m_rcvbuf = rcvbuf;
+    m_sndbuf = sndbuf;
+}
+
+
+void tcp_transport::set_buffer_pool(std::shared_ptr<cix::buffer_pool> pool)
+{
+    m_pool = pool;
+}
+
+
+void tcp_transport::set_listener(std::shared_ptr<listener_t> listener)
+{
+    std::scoped_lock lock(m_mutex);
+    m_listener = listener;
+}
+
+
+bool tcp_transport::launch()
+{
+    assert(!m_accept_thread);
+    assert(m_listen == INVALID_SOCKET);
+
+    sockaddr_in addr{};
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(m_port);
+
+    const auto listen_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listen_socket == INVALID_SOCKET)
+    {
+        LOGERROR("failed to create channels socket (error {})",
+            WSAGetLastError());
+        return false;
+    }
+
+    // do not let another process steal the port
+    const BOOL exclusive = TRUE;
+    setsockopt(
+        listen_socket, SOL_SOCKET, SO_EXCLUSIVEADDRUSE,
+        reinterpret_cast<const char*>(&exclusive),
+        static_cast<int>(sizeof(exclusive)));
+
+    if (0 != bind(
+            listen_socket, reinterpret_cast<const sockaddr*>(&addr),
+            static_cast<int>(sizeof(addr))) ||
+        0 != listen(listen_socket, SOMAXCONN))
+    {
+        LOGERROR("failed to listen for channels on TCP port {} (error {})",
+            m_port, WSAGetLastError());
+        closesocket(listen_socket);
+        return false;
+    }
+
+    m_listen = listen_socket;
+    m_accept_thread = std::make_unique<std::thread>(
+        &tcp_transport::accept_thread, this);
+
+    LOGINFO("listening for channels on TCP port {}", m_port);
+
+    return true;
+}
+
+
+void tcp_transport::stop()
+{
+    // accept() fails once the socket is closed
+    if (m_listen != INVALID_SOCKET)
+    {
+        closesocket(m_listen);
+        m_listen = INVALID_SOCKET;
+    }
+
+    if (m_accept_thread)
+    {
+        m_accept_thread->join();
+        m_accept_thread.reset();
+    }
+
+    // only this thread joins from now on, no new instance can show up either
+    std::vector<std::shared_ptr<instance_t>> instances;
+
+    {
+        std::scoped_lock lock(m_mutex);
+
+        // read threads have their recv() call fail, then clean up by
+        // themselves, see read_thread()
+        for (const auto& inst_it : m_instances)
+        {
+            shutdown(inst_it.second->socket, SD_BOTH);
+            instances.push_back(inst_it.second);
+        }
+
+        instances.insert(instances.end(), m_finished.begin(), m_finished.end());
+        m_finished.clear();
+    }
+
+    for (auto& instance : instances)
+    {
+        if (instance->read_thread && instance->read_thread->joinable())
+            instance->read_thread->join();
+    }
+
+    // moved there by their read thread in the meantime, joined already
+    std::scoped_lock lock(m_mutex);
+
+    assert(m_instances.empty());
+    m_finished.clear();
+}
+
+
+bool tcp_transport::send(token_t token, bytes_t&& packet)
+{
+    return this->send_impl(token, std::move(packet), false);
+}
+
+
+bool tcp_transport::send_expedited(token_t token, bytes_t&& packet)
+{
+    return this->send_impl(token, std::move(packet), true);
+}
+
+
+bool tcp_transport::send_impl(token_t token, bytes_t&& packet, bool expedite)
+{
+    auto instance = this->find_instance(token);
+    if (!instance)
+        return false;
+
+    {
+        std::scoped_lock inst_lock(instance->mutex);
+
+        if (instance->closing)
+            return false;
+
+        if (expedite)
+            instance->output_expedited.push_back(std::move(packet));
+        else
+            instance->output.push_back(std::move(packet));
+    }
+
+    SetEvent(instance->write_event);
+
+    return true;
+}
+
+
+bool tcp_transport::get_instance_stats(
+    token_t token, instance_stats_t& out_stats) const
+{
+    auto instance = this->find_instance(token);
+    if (!instance)
+        return false;
+
+    std::scoped_lock inst_lock(instance->mutex);
+
+    out_stats = instance_stats_t{};
+    out_stats.output_queue_size =
+        instance->output.size() + instance->output_expedited.size();
+    out_stats.pending_writes = instance->bytes_in_flight > 0 ? 1 : 0;
+    out_stats.bytes_in_flight = instance->bytes_in_flight;
+    out_stats.writes_completed = instance->writes_completed;
+
+    return true;
+}
+
+
+bool tcp_transport::disconnect_instance(token_t token)
+{
+    // CAUTION: m_mutex is held so that the read thread cannot close the socket
+    // in the meantime
+    std::scoped_lock lock(m_mutex);
+
+    auto it = m_instances.find(token);
+    if (it == m_instances.end())
+        return false;
+
+    // read thread takes it from there
+    shutdown(it->second->socket, SD_BOTH);
+
+    return true;
+}
+
+
+std::shared_ptr<tcp_transport::listener_t> tcp_transport::listener() const
+{
+    std::scoped_lock lock(m_mutex);
+    return m_listener.lock();
+}
+
+
+std::shared_ptr<tcp_transport::instance_t> tcp_transport::find_instance(
+    token_t token) const
+{
+    std::scoped_lock lock(m_mutex);
+
+    auto it = m_instances.find(token);
+    if (it == m_instances.end())
+        return nullptr;
+
+    return it->second;
+}
+
+
+void tcp_transport::accept_thread()
+{
+    CIX_THREAD_SET_NAME_STATIC(GetCurrentThreadId(), "tcp_transport[accept]");
+    thread_tuning::apply(thread_tuning::role_pipe);
+    alloc_profile::set_thread_stage(alloc_profile::stage_pipe);
+
+    for (;;)
+    {
+        const auto conn = accept(m_listen, nullptr, nullptr);
+        if (conn == INVALID_SOCKET)
+            break;
+
+        this->join_finished();
+
+        // proto does its own coalescing, see op_socks_batch
+        const BOOL nodelay = TRUE;
+        setsockopt(
+            conn, IPPROTO_TCP, TCP_NODELAY,
+            reinterpret_cast<const char*>(&nodelay),
+            static_cast<int>(sizeof(nodelay)));
+
+        if (m_rcvbuf > 0)
+        {
+            setsockopt(
+                conn, SOL_SOCKET, SO_RCVBUF,
+                reinterpret_cast<const char*>(&m_rcvbuf),
+                static_cast<int>(sizeof(m_rcvbuf)));
+        }
+
+        if (m_sndbuf > 0)
+        {
+            setsockopt(
+                conn, SOL_SOCKET, SO_SNDBUF,
+                reinterpret_cast<const char*>(&m_sndbuf),
+                static_cast<int>(sizeof(m_sndbuf)));
+        }
+
+        std::shared_ptr<instance_t> instance;
+
+        {
+            std::scoped_lock lock(m_mutex);
+
+            const auto token = token_tag | m_next_token++;
+
+            instance = std::make_shared<instance_t>(token, conn);
+            m_instances[token] = instance;
+        }
+
+        LOGTRACE("TCP CHANNEL CONNECTED");
+
+        // connected first, before anything got received
+        auto listener = this->listener();
+        if (listener)
+        {
+            listener->on_transport_connected(
+                this->shared_from_this(), instance->token);
+        }
+
+        instance->write_thread = std::make_unique<std::thread>(
+            &tcp_transport::write_thread, this, instance);
+        instance->read_thread = std::make_unique<std::thread>(
+            &tcp_transport::read_thread, this, instance);
+    }
+}
+
+
+void tcp_transport::read_thread(std::shared_ptr<instance_t> instance)
+{
+    CIX_THREAD_SET_NAME_STATIC(GetCurrentThreadId(), "tcp_transport[read]");
+    thread_tuning::apply(thread_tuning::role_pipe);
+    alloc_profile::set_thread_stage(alloc_profile::stage_pipe);
+
+    for (;;)
+    {
+        auto packet = m_pool ?
+            m_pool->acquire(m_io_buffer_size) :
+            bytes_t(m_io_buffer_size);
+
+        const auto received = recv(
+            instance->socket, reinterpret_cast<char*>(packet.data()),
+            static_cast<int>(packet.size()), 0);
+
+        if (received <= 0)
+        {
+            if (m_pool)
+                m_pool->release(std::move(packet));
+            break;
+        }
+
+        packet.resize(static_cast<std::size_t>(received));
+
+        auto listener = this->listener();
+        if (listener)
+        {
+            listener->on_transport_recv(
+                this->shared_from_this(), instance->token, std::move(packet));
+        }
+    }
+
+    // from now on, disconnect_instance() and send() cannot find it anymore
+    {
+        std::scoped_lock lock(m_mutex);
+
+        m_instances.erase(instance->token);
+        m_finished.push_back(instance);
+    }
+
+    {
+        std::scoped_lock inst_lock(instance->mutex);
+
+        instance->closing = true;
+
+        if (m_pool)
+        {
+            for (auto& packet : instance->output)
+                m_pool->release(std::move(packet));
+
+            for (auto& packet : instance->output_expedited)
+                m_pool->release(std::move(packet));
+        }
+
+        instance->output.clear();
+        instance->output_expedited.clear();
+    }
+
+    shutdown(instance->socket, SD_BOTH);
+    SetEvent(instance->write_event);
+    instance->write_thread->join();
+
+    closesocket(instance->socket);
+
+    LOGTRACE("TCP CHANNEL DISCONNECTED");
+
+    // closed last, once nothing more can be sent nor received
+    auto listener = this->listener();
+    if (listener)
+    {
+        listener->on_transport_closed(
+            this->shared_from_this(), instance->token);
+    }
+}
+
+
+void tcp_transport::write_thread(std::shared_ptr<instance_t> instance)
+{
+    CIX_THREAD_SET_NAME_STATIC(GetCurrentThreadId(), "tcp_transport[write]");
+    thread_tuning::apply(thread_tuning::role_pipe);
+    alloc_profile::set_thread_stage(alloc_profile::stage_pipe);
+
+    for (;;)
+    {
+        WaitForSingleObject(instance->write_event, INFINITE);
+        wakeups::count();
+
+        for (;;)
+        {
+            bytes_t packet;
+
+            {
+                std::scoped_lock inst_lock(instance->mutex);
+
+                if (instance->closing)
+                    return;
+
+                // expedited packets first, see send_expedited()
+                auto& output = instance->output_expedited.empty() ?
+                    instance->output : instance->output_expedited;
+
+                if (output.empty())
+                    break;
+
+                packet = std::move(output.front());
+                output.pop_front();
+                instance->bytes_in_flight = packet.size();
+            }
+
+            if (!tcp_transport::send_all(instance->socket, packet))
+            {
+                // read thread takes it from there
+                shutdown(instance->socket, SD_BOTH);
+
+                std::scoped_lock inst_lock(instance->mutex);
+                instance->closing = true;
+                instance->bytes_in_flight = 0;
+                return;
+            }
+
+            std::size_t output_queue_size;
+
+            {
+                std::scoped_lock inst_lock(instance->mutex);
+
+                instance->bytes_in_flight = 0;
+                ++instance->writes_completed;
+                output_queue_size =
+                    instance->output.size() +
+                    instance->output_expedited.size();
+            }
+
+            auto listener = this->listener();
+            if (listener)
+            {
+                listener->on_transport_sent(
+                    this->shared_from_this(), instance->token,
+                    std::move(packet), output_queue_size);
+            }
+        }
+    }
+}
+
+
+void tcp_transport::join_finished()
+{
+    std::vector<std::shared_ptr<instance_t>> finished;
+
+    {
+        std::scoped_lock lock(m_mutex);
+        finished.swap(m_finished);
+    }
+
+    // read threads are about to return, if not already
+    for (auto& instance : finished)
+        instance->read_thread->join();
+}
+
+
+bool tcp_transport::send_all(SOCKET socket, const bytes_t& packet)
+{
+    std::size_t offset = 0;
+
+    while (offset < packet.size())
+    {
+        const auto chunk = std::min<std::size_t>(
+            packet.size() - offset,
+            static_cast<std::size_t>(std::numeric_limits<int>::max()));
+
+        const auto sent = ::send(
+            socket, reinterpret_cast<const char*>(packet.data() + offset),
+            static_cast<int>(chunk), 0);
+
+        if (sent <= 0)
+            return false;
+
+        offset += static_cast<std::size_t>(sent);
+    }
+
+    return true;
+}
@@ -0,0 +1,107 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// Proto channels over plain TCP connections, see channel_transport
+//
+// * a faster path than named pipes on flat networks, since it avoids the SMB
+//   framing, signing and request/response round trips; only enabled if a port
+//   is configured (see config_t::channel_tcp_port)
+// * CAUTION: unlike a named pipe reached through SMB, the connection is not
+//   authenticated, anyone who can reach the port can set up a channel
+// * one thread accepts connections, then each instance gets a read thread and
+//   a write thread of its own, doing blocking I/O; proto channels are few,
+//   long-lived and busy, so this is cheaper than an I/O engine would be
+// * the threads of a closed instance are joined by the accept thread, once it
+//   got a new connection, or by stop()
+// * tokens are made from a counter with *token_tag* set, so they never collide
+//   with a handle value (i.e. a token of pipe_transport)
+class tcp_transport :
+    public channel_transport,
+    public std::enable_shared_from_this<tcp_transport>
+{
+public:
+    static constexpr token_t token_tag =
+        token_t(1) << (sizeof(token_t) * CHAR_BIT - 1);
+
+    // default size of the recv() buffer of an instance; also the max size of
+    // the packets passed to listener_t::on_transport_recv()
+    static constexpr DWORD io_buffer_default_size = 64 * 1024;
+
+private:
+    struct instance_t
+    {
+        instance_t() = delete;
+        instance_t(token_t token_, SOCKET socket_);
+        ~instance_t();
+
+        const token_t token;
+        const SOCKET socket;
+        HANDLE write_event;  // auto-reset
+
+        // set by the accept thread before the threads of the instance start
+        std::unique_ptr<std::thread> read_thread;
+        std::unique_ptr<std::thread> write_thread;
+
+        // protected by *mutex*
+        std::mutex mutex;
+        bool closing;
+        std::deque<bytes_t> output;
+        std::deque<bytes_t> output_expedited;  // sent first
+        std::size_t bytes_in_flight;  // size of the packet being sent
+        std::uint64_t writes_completed;
+    };
+
+public:
+    tcp_transport();
+    ~tcp_transport();
+
+    static bool is_tcp_token(token_t token) { return (token & token_tag) != 0; }
+
+    // must be called before launch()
+    void set_port(std::uint16_t port);
+    void set_io_buffer_size(DWORD size);
+    void set_socket_buffer_sizes(int rcvbuf, int sndbuf);  // 0: system default
+    void set_buffer_pool(std::shared_ptr<cix::buffer_pool> pool);
+
+    // channel_transport
+    const char* name() const { return "tcp"; }
+    void set_listener(std::shared_ptr<listener_t> listener);
+    bool launch();
+    void stop();
+    bool send(token_t token, bytes_t&& packet);
+    bool send_expedited(token_t token, bytes_t&& packet);
+    bool get_instance_stats(token_t token, instance_stats_t& out_stats) const;
+    bool disconnect_instance(token_t token);
+
+private:
+    std::shared_ptr<listener_t> listener() const;
+    std::shared_ptr<instance_t> find_instance(token_t token) const;
+
+    void accept_thread();
+    void read_thread(std::shared_ptr<instance_t> instance);
+    void write_thread(std::shared_ptr<instance_t> instance);
+    void join_finished();
+    bool send_impl(token_t token, bytes_t&& packet, bool expedite);
+
+    static bool send_all(SOCKET socket, const bytes_t& packet);
+
+private:
+    mutable std::mutex m_mutex;
+    std::weak_ptr<listener_t> m_listener;
+    std::shared_ptr<cix::buffer_pool> m_pool;
+    std::uint16_t m_port;
+    DWORD m_io_buffer_size;
+    int m_rcvbuf;
+    int m_sndbuf;
+
+    SOCKET m_listen;
+    std::unique_ptr<std::thread> m_accept_thread;
+
+    // protected by m_mutex
+    token_t m_next_token;
+    cix::flat_hash_map<token_t, std::shared_ptr<instance_t>> m_instances;
+    std::vector<std::shared_ptr<instance_t>> m_finished;  // threads to join
+};
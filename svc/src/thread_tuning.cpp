@@ -0,0 +1,138 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "main.h"
+
+namespace thread_tuning {
+
+namespace detail
+{
+    typedef HANDLE (WINAPI* av_set_t)(LPCWSTR, LPDWORD);
+    typedef BOOL (WINAPI* av_revert_t)(HANDLE);
+
+    struct avrt_t
+    {
+        av_set_t set;
+        av_revert_t revert;
+    };
+
+    // reverts the MMCSS registration of its thread when it exits
+    struct mmcss_registration_t
+    {
+        HANDLE handle = nullptr;
+        av_revert_t revert = nullptr;
+
+        ~mmcss_registration_t()
+        {
+            if (handle && revert)
+                revert(handle);
+        }
+    };
+
+    static settings_t settings[role_count] = {};
+    static thread_local mmcss_registration_t mmcss_registration;
+
+    static const char* const role_names[role_count] = {
+        "pipe", "socks", "socketio" };
+
+    static const avrt_t& avrt()
+    {
+        // never unloaded, the registrations may outlive any owner
+        static const auto table = []() -> avrt_t
+        {
+            avrt_t out{nullptr, nullptr};
+            const auto module = LoadLibraryW(L"avrt.dll");
+
+            if (!module)
+                return out;
+
+            out.set = reinterpret_cast<av_set_t>(
+                GetProcAddress(module, "AvSetMmThreadCharacteristicsW"));
+            out.revert = reinterpret_cast<av_revert_t>(
+                GetProcAddress(module, "AvRevertMmThreadCharacteristics"));
+
+            if (!out.set || !out.revert)
+                out = avrt_t{nullptr, nullptr};
+
+            return out;
+        }();
+
+        return table;
+    }
+
+    static int to_win_priority(priority_t priority)
+    {
+        switch (priority)
+        {
+            case priority_above_normal:
+                return THREAD_PRIORITY_ABOVE_NORMAL;
+            case priority_highest:
+                return THREAD_PRIORITY_HIGHEST;
+            case priority_time_critical:
+                return THREAD_PRIORITY_TIME_CRITICAL;
+            case priority_normal:
+            default:
+                return THREAD_PRIORITY_NORMAL;
+        }
+    }
+}
+
+
+void configure(role_t role, const settings_t& settings)
+{
+    assert(role < role_count);
+    detail::settings[role] = settings;
+}
+
+
+void apply(role_t role)
+{
+    assert(role < role_count);
+
+    const auto& settings = detail::settings[role];
+    const auto thread = GetCurrentThread();
+
+    if (settings.priority != priority_normal &&
+        !SetThreadPriority(
+            thread, detail::to_win_priority(settings.priority)))
+    {
+        LOGWARNING(
+            "failed to set the priority of a {} thread (error {})",
+            detail::role_names[role], GetLastError());
+    }
+
+    if (settings.affinity != 0 &&
+        !SetThreadAffinityMask(thread, settings.affinity))
+    {
+        LOGWARNING(
+            "failed to set the affinity of a {} thread (error {})",
+            detail::role_names[role], GetLastError());
+    }
+
+    if (settings.mmcss && !detail::mmcss_registration.handle)
+    {
+        const auto& avrt = detail::avrt();
+        DWORD task_index = 0;
+
+        if (!avrt.set)
+        {
+            LOGWARNING(
+                "MMCSS not available for a {} thread",
+                detail::role_names[role]);
+            return;
+        }
+
+        detail::mmcss_registration.handle =
+            avrt.set(L"Pro Audio", &task_index);
+        detail::mmcss_registration.revert = avrt.revert;
+
+        if (!detail::mmcss_registration.handle)
+        {
+            LOGWARNING(
+                "failed to register a {} thread with MMCSS (error {})",
+                detail::role_names[role], GetLastError());
+        }
+    }
+}
+
+}  // namespace thread_tuning
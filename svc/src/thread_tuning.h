@@ -0,0 +1,51 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// Scheduling of the I/O threads of the service, by role, so that the tunnel
+// keeps a low latency on a busy host
+//
+// * configured once at startup (see config_t), then applied by each thread to
+//   itself as soon as it starts, see apply()
+// * a null affinity mask leaves the affinity of the thread alone
+// * MMCSS registers the thread with the "Pro Audio" task of the multimedia
+//   class scheduler (AvSetMmThreadCharacteristics()), which boosts it above
+//   regular threads as long as it does not hog the CPU; avrt.dll is loaded on
+//   first use, and the registration is reverted when the thread exits
+// * best effort: a thread that cannot be tuned runs untuned, with a warning
+// * process-wide, i.e. shared by all the workers of the service
+namespace thread_tuning
+{
+    enum role_t : std::size_t
+    {
+        role_pipe,      // pipe server and TCP channel threads
+        role_socks,     // socks_proxy shard threads
+        role_socketio,  // socketio threads, whatever the engine
+        role_count,
+    };
+
+    // the values of the *-thread-priority options, see config_t
+    enum priority_t : DWORD
+    {
+        priority_normal = 0,
+        priority_above_normal = 1,
+        priority_highest = 2,
+        priority_time_critical = 3,
+    };
+
+    struct settings_t
+    {
+        priority_t priority;
+        DWORD_PTR affinity;  // 0 for no change
+        bool mmcss;
+    };
+
+    // must be called before the threads of *role* get launched; not
+    // thread-safe
+    void configure(role_t role, const settings_t& settings);
+
+    // tune the calling thread as configured for *role*; no-op by default
+    void apply(role_t role);
+}
@@ -0,0 +1,291 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "main.h"
+
+
+timer_wheel_t::timer_wheel_t(cix::ticks_t resolution)
+    : m_resolution{std::max<cix::ticks_t>(resolution, 1)}
+    , m_current{0}
+    , m_level_sizes{}
+{
+    m_current = this->to_tickno(cix::ticks_now(), false);
+}
+
+
+cix::ticks_t timer_wheel_t::resolution() const
+{
+    return m_resolution;
+}
+
+
+bool timer_wheel_t::empty() const
+{
+    return m_entries.empty();
+}
+
+
+std::size_t timer_wheel_t::size() const
+{
+    return m_entries.size();
+}
+
+
+bool timer_wheel_t::contains(key_t key) const
+{
+    return m_entries.find(key) != m_entries.end();
+}
+
+
+void timer_wheel_t::schedule(key_t key, cix::ticks_t deadline)
+{
+    auto expires = this->to_tickno(deadline, true);
+
+    // overdue already, fire on next tick
+    if (expires <= m_current)
+        expires = m_current + 1;
+
+    auto [entry_it, inserted] = m_entries.try_emplace(key);
+    auto& entry = entry_it->second;
+
+    if (!inserted)
+    {
+        if (entry.expires == expires)
+            return;
+
+        this->unplace(entry);
+    }
+
+    entry.expires = expires;
+    this->place(key, entry);
+}
+
+
+bool timer_wheel_t::cancel(key_t key)
+{
+    auto entry_it = m_entries.find(key);
+    if (entry_it == m_entries.end())
+        return false;
+
+    this->unplace(entry_it->second);
+    m_entries.erase(entry_it);
+
+    return true;
+}
+
+
+void timer_wheel_t::advance(cix::ticks_t now, std::vector<key_t>& out_expired)
+{
+    const auto target = this->to_tickno(now, false);
+
+    while (m_current < target)
+    {
+        // nothing to turn, jump straight to *target*
+        if (m_entries.empty())
+        {
+            m_current = target;
+            break;
+        }
+
+        // no timer in the lower levels, nothing can happen before the next
+        // slot of the lowest busy level
+        std::size_t lowest = 0;
+
+        while (lowest < levels - 1 && m_level_sizes[lowest] == 0)
+            ++lowest;
+
+        if (lowest > 0)
+        {
+            const auto mask = (tickno_t(1) << (slot_bits * lowest)) - 1;
+            m_current = std::min(target - 1, m_current | mask);
+        }
+
+        ++m_current;
+
+        // upper levels first so that a timer can go down several levels at
+        // once
+        for (std::size_t level = levels - 1; level > 0; --level)
+        {
+            const auto mask =
+                (tickno_t(1) << (slot_bits * level)) - 1;
+
+            if ((m_current & mask) == 0)
+                this->cascade(level);
+        }
+
+        this->expire_current(out_expired);
+    }
+}
+
+
+cix::ticks_t timer_wheel_t::next_due() const
+{
+    if (m_entries.empty())
+        return 0;
+
+    auto due = std::numeric_limits<tickno_t>::max();
+
+    // level 0 spans the next *slots_per_level* ticks
+    if (m_level_sizes[0] > 0)
+    {
+        for (tickno_t tick = m_current + 1;
+            tick <= m_current + slots_per_level; ++tick)
+        {
+            if (!m_wheels[0][tick & (slots_per_level - 1)].empty())
+            {
+                due = tick;
+                break;
+            }
+        }
+    }
+
+    // a timer of an upper level cannot expire before its slot cascades, i.e.
+    // before that level turns next
+    for (std::size_t level = 1; level < levels; ++level)
+    {
+        if (m_level_sizes[level] == 0)
+            continue;
+
+        const auto shift = slot_bits * level;
+
+        due = std::min(due, ((m_current >> shift) + 1) << shift);
+    }
+
+    return static_cast<cix::ticks_t>(due * m_resolution);
+}
+
+
+void timer_wheel_t::clear()
+{
+    m_entries.clear();
+
+    for (auto& wheel : m_wheels)
+    {
+        for (auto& slot : wheel)
+            slot.clear();
+    }
+
+    m_level_sizes.fill(0);
+}
+
+
+timer_wheel_t::tickno_t
+timer_wheel_t::to_tickno(cix::ticks_t ticks, bool round_up) const
+{
+    const auto tickno = static_cast<tickno_t>(ticks);
+
+    return round_up ?
+        (tickno + m_resolution - 1) / m_resolution :
+        tickno / m_resolution;
+}
+
+
+void timer_wheel_t::place(key_t key, entry_t& entry)
+{
+    constexpr auto span = tickno_t(1) << (slot_bits * levels);
+
+    // *expires* may be m_current itself when cascading, in which case timer
+    // lands in the slot about to be expired
+    assert(entry.expires >= m_current);
+
+    const auto delta = entry.expires - m_current;
+    auto expires = entry.expires;
+    std::size_t level = 0;
+
+    while (level < levels - 1 &&
+        delta >= (tickno_t(1) << (slot_bits * (level + 1))))
+    {
+        ++level;
+    }
+
+    // beyond the end of the wheel, park it as far as possible
+    if (delta >= span)
+        expires = m_current + span - 1;
+
+    auto& slot = m_wheels[level][
+        (expires >> (slot_bits * level)) & (slots_per_level - 1)];
+
+    entry.level = static_cast<std::uint8_t>(level);
+    entry.slot = static_cast<std::uint8_t>(
+        (expires >> (slot_bits * level)) & (slots_per_level - 1));
+    entry.index = static_cast<std::uint32_t>(slot.size());
+
+    slot.push_back(key);
+    ++m_level_sizes[level];
+}
+
+
+void timer_wheel_t::unplace(const entry_t& entry)
+{
+    // swap with the last key of the slot so that removal is O(1)
+    auto& slot = m_wheels[entry.level][entry.slot];
+
+    assert(entry.index < slot.size());
+
+    if (entry.index + 1 < slot.size())
+    {
+        const auto last_key = slot.back();
+
+        slot[entry.index] = last_key;
+        m_entries[last_key].index = entry.index;
+    }
+
+    slot.pop_back();
+    --m_level_sizes[entry.level];
+}
+
+
+void timer_wheel_t::cascade(std::size_t level)
+{
+    slot_t keys;
+
+    keys.swap(
+        m_wheels[level][
+            (m_current >> (slot_bits * level)) & (slots_per_level - 1)]);
+
+    m_level_sizes[level] -= keys.size();
+
+    for (const auto key : keys)
+    {
+        auto entry_it = m_entries.find(key);
+
+        if (entry_it == m_entries.end())
+        {
+            assert(0);
+            continue;
+        }
+
+        this->place(key, entry_it->second);
+    }
+}
+
+
+void timer_wheel_t::expire_current(std::vector<key_t>& out_expired)
+{
+    slot_t keys;
+
+    keys.swap(m_wheels[0][m_current & (slots_per_level - 1)]);
+
+    m_level_sizes[0] -= keys.size();
+
+    for (const auto key : keys)
+    {
+        auto entry_it = m_entries.find(key);
+
+        if (entry_it == m_entries.end())
+        {
+            assert(0);
+            continue;
+        }
+
+        if (entry_it->second.expires <= m_current)
+        {
+            out_expired.push_back(key);
+            m_entries.erase(entry_it);
+        }
+        else
+        {
+            this->place(key, entry_it->second);
+        }
+    }
+}
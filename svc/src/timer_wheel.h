@@ -0,0 +1,86 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// A hierarchical timer wheel, to expire a large number of keys
+//
+// * time is divided in ticks of *resolution* milliseconds; a timer never fires
+//   early, and at most one tick late
+// * *levels* wheels of *slots_per_level* slots each: level 0 spans 64 ticks,
+//   level 1 spans 64 slots of 64 ticks, and so on; a timer goes in the level
+//   that matches how far its deadline is, and is moved down a level each time
+//   the wheel above turns (cascading), until it lands into level 0
+// * deadlines further than the span of the whole wheel (about 194 days at a
+//   1 second resolution) are parked in the last level and re-placed when it
+//   turns
+// * schedule(), cancel() and advancing one tick are O(1), cascading aside;
+//   ticks that have nothing to expire nor to cascade are skipped, so that
+//   catching up after a long sleep is cheap
+// * next_due() tells when advance() has something to do next, so that a
+//   caller can sleep until then instead of waking up every tick
+// * a key has at most one timer, schedule() replaces it
+// * not thread-safe
+class timer_wheel_t
+{
+public:
+    typedef std::uint64_t key_t;
+
+    enum : std::size_t
+    {
+        levels = 4,
+        slot_bits = 6,
+        slots_per_level = std::size_t(1) << slot_bits,
+    };
+
+public:
+    explicit timer_wheel_t(cix::ticks_t resolution);
+    ~timer_wheel_t() = default;
+
+    cix::ticks_t resolution() const;
+    bool empty() const;
+    std::size_t size() const;
+    bool contains(key_t key) const;
+
+    void schedule(key_t key, cix::ticks_t deadline);
+    bool cancel(key_t key);
+
+    // move time forward up to *now*, and append the keys of the timers that
+    // expired to *out_expired*; these are forgotten
+    void advance(cix::ticks_t now, std::vector<key_t>& out_expired);
+
+    // the earliest time advance() has something to do at: a timer to expire,
+    // or to cascade down, in which case it may be early; 0 if empty
+    cix::ticks_t next_due() const;
+
+    void clear();
+
+private:
+    typedef std::uint64_t tickno_t;
+
+    struct entry_t
+    {
+        tickno_t expires;
+        std::uint8_t level;
+        std::uint8_t slot;
+        std::uint32_t index;  // in its slot
+    };
+
+    typedef std::vector<key_t> slot_t;
+
+private:
+    tickno_t to_tickno(cix::ticks_t ticks, bool round_up) const;
+    void place(key_t key, entry_t& entry);
+    void unplace(const entry_t& entry);
+    void cascade(std::size_t level);
+    void expire_current(std::vector<key_t>& out_expired);
+
+private:
+    cix::ticks_t m_resolution;
+    tickno_t m_current;  // the last tick processed by advance()
+
+    std::unordered_map<key_t, entry_t> m_entries;
+    std::array<std::array<slot_t, slots_per_level>, levels> m_wheels;
+    std::array<std::size_t, levels> m_level_sizes;  // timers per level
+};
@@ -0,0 +1,25 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "main.h"
+
+namespace wakeups {
+
+namespace detail
+{
+    static std::atomic<std::uint64_t> count{0};
+}
+
+
+void count()
+{
+    detail::count.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+std::uint64_t total()
+{
+    return detail::count.load(std::memory_order_relaxed);
+}
+
+}  // namespace wakeups
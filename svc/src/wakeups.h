@@ -0,0 +1,22 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// How many times the threads of the service woke up from a wait, so that the
+// cost of an idle service (e.g. on a host crowded with mostly idle VMs) shows
+// in its stats
+//
+// * counted by the waiting loops of the service itself (svc_worker, socketio,
+//   socks_proxy, logging), whatever woke them: I/O, a timer, a stop request,
+//   or the time out of a wait
+// * an idle service is not supposed to wake up at all, short of the timers it
+//   has to run (e.g. the pings of the connected channels)
+// * cumulative, reported by op_stats (*wakeups*); a relaxed atomic increment
+//   each
+namespace wakeups
+{
+    void count();
+    std::uint64_t total();
+}
@@ -0,0 +1,354 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "main.h"
+
+
+warm_pool_t::warm_pool_t(connector_t&& connector, runner_t&& runner)
+    : m_connector(std::move(connector))
+    , m_runner(std::move(runner))
+    , m_generation{0}
+    , m_per_target{0}
+    , m_max_idle{default_max_idle}
+    , m_stats{}
+{
+    assert(m_connector);
+    assert(m_runner);
+}
+
+
+warm_pool_t::~warm_pool_t()
+{
+    this->clear();
+}
+
+
+bool warm_pool_t::parse_targets(
+    std::string_view str, std::vector<target_t>& out_targets)
+{
+    out_targets.clear();
+
+    while (!str.empty())
+    {
+        const auto sep = str.find(',');
+        auto item = str.substr(0, sep);
+
+        str = (sep == str.npos) ? std::string_view{} : str.substr(sep + 1);
+
+        while (!item.empty() && item.front() == ' ')
+            item.remove_prefix(1);
+        while (!item.empty() && item.back() == ' ')
+            item.remove_suffix(1);
+
+        const auto colon = item.rfind(':');
+        if (colon == item.npos || colon == 0 || colon + 1 == item.size())
+            return false;
+
+        auto host = item.substr(0, colon);
+        const auto port_str = item.substr(colon + 1);
+        unsigned long port = 0;
+
+        if (host.front() == '[')
+        {
+            if (host.size() < 3 || host.back() != ']')
+                return false;
+
+            host = host.substr(1, host.size() - 2);
+        }
+        else if (host.find(':') != host.npos)
+        {
+            return false;  // IPv6 address without brackets
+        }
+
+        for (const auto c : port_str)
+        {
+            if (c < '0' || c > '9')
+                return false;
+
+            port = (port * 10) + static_cast<unsigned long>(c - '0');
+            if (port > 0xffff)
+                return false;
+        }
+
+        if (port == 0)
+            return false;
+
+        out_targets.push_back(
+            target_t{std::string(host), static_cast<unsigned short>(port)});
+    }
+
+    return true;
+}
+
+
+void warm_pool_t::configure(
+    std::vector<target_t>&& targets,
+    std::size_t per_target,
+    cix::ticks_t max_idle)
+{
+    const auto now = cix::ticks_now();
+    std::vector<SOCKET> dropped;
+    std::vector<refill_t> refills;
+
+    cix::lock_guard lock(m_mutex);
+
+    // late connects of the former targets get closed, see on_connected()
+    ++m_generation;
+
+    for (auto& pool_it : m_pools)
+    {
+        for (const auto& idle : pool_it.second.idle)
+            dropped.push_back(idle.conn);
+    }
+
+    m_pools.clear();
+    m_per_target = std::min<std::size_t>(per_target, max_per_target);
+    m_max_idle = max_idle;
+
+    if (m_per_target > 0)
+    {
+        for (auto& target : targets)
+        {
+            auto key = warm_pool_t::make_key(target.host, target.port);
+            auto [pool_it, inserted] = m_pools.try_emplace(std::move(key));
+
+            if (!inserted)
+                continue;  // listed twice
+
+            auto& pool = pool_it->second;
+
+            pool.target = std::move(target);
+            pool.pending = 0;
+            pool.retry_after = 0;
+
+            this->refill(pool_it->first, pool, now, refills);
+        }
+    }
+
+    const auto generation = m_generation;
+
+    lock.unlock();
+
+    for (const auto conn : dropped)
+        closesocket(conn);
+
+    this->run(generation, refills);
+}
+
+
+SOCKET warm_pool_t::acquire(const std::string& host, unsigned short port)
+{
+    const auto now = cix::ticks_now();
+    std::vector<SOCKET> dropped;
+    std::vector<refill_t> refills;
+    SOCKET conn = INVALID_SOCKET;
+
+    cix::lock_guard lock(m_mutex);
+
+    if (m_pools.empty())
+        return INVALID_SOCKET;
+
+    const auto pool_it = m_pools.find(warm_pool_t::make_key(host, port));
+    if (pool_it == m_pools.end())
+        return INVALID_SOCKET;
+
+    auto& pool = pool_it->second;
+
+    while (!pool.idle.empty())
+    {
+        const auto idle = pool.idle.front();
+
+        pool.idle.pop_front();
+
+        if ((!m_max_idle || cix::ticks_elapsed(idle.since, now) < m_max_idle) &&
+            warm_pool_t::is_alive(idle.conn))
+        {
+            conn = idle.conn;
+            break;
+        }
+
+        dropped.push_back(idle.conn);
+        ++m_stats.dropped;
+    }
+
+    if (conn != INVALID_SOCKET)
+        ++m_stats.hits;
+    else
+        ++m_stats.misses;
+
+    this->refill(pool_it->first, pool, now, refills);
+
+    const auto generation = m_generation;
+
+    lock.unlock();
+
+    for (const auto dropped_conn : dropped)
+        closesocket(dropped_conn);
+
+    this->run(generation, refills);
+
+    return conn;
+}
+
+
+void warm_pool_t::clear()
+{
+    std::vector<SOCKET> dropped;
+
+    {
+        std::scoped_lock lock(m_mutex);
+
+        ++m_generation;
+
+        for (auto& pool_it : m_pools)
+        {
+            for (const auto& idle : pool_it.second.idle)
+                dropped.push_back(idle.conn);
+        }
+
+        m_pools.clear();
+    }
+
+    for (const auto conn : dropped)
+        closesocket(conn);
+}
+
+
+warm_pool_t::stats_t warm_pool_t::stats() const
+{
+    std::scoped_lock lock(m_mutex);
+
+    auto stats = m_stats;
+
+    stats.idle = 0;
+    for (const auto& pool_it : m_pools)
+        stats.idle += pool_it.second.idle.size();
+
+    return stats;
+}
+
+
+std::string warm_pool_t::make_key(
+    const std::string& host, unsigned short port)
+{
+    // the port goes last, so that the key of an IPv6 address is unambiguous
+    std::string key;
+
+    key.reserve(host.size() + 6);
+
+    for (const auto c : host)
+    {
+        key.push_back(static_cast<char>(
+            std::tolower(static_cast<unsigned char>(c))));
+    }
+
+    key.push_back(':');
+    key.append(std::to_string(port));
+
+    return key;
+}
+
+
+bool warm_pool_t::is_alive(SOCKET conn)
+{
+    // non-blocking, see connector_t
+    char c;
+    const int res = recv(conn, &c, 1, MSG_PEEK);
+
+    if (res > 0)
+        return true;  // target spoke first, left for the client to read
+    if (res == 0)
+        return false;  // closed by peer
+
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+}
+
+
+void warm_pool_t::refill(
+    const std::string& key, pool_t& pool, cix::ticks_t now,
+    std::vector<refill_t>& out_refills)
+{
+    // CAUTION: m_mutex must be locked by caller
+
+    if (pool.retry_after != 0)
+    {
+        if (now < pool.retry_after)
+            return;
+
+        pool.retry_after = 0;
+    }
+
+    while (pool.idle.size() + pool.pending < m_per_target)
+    {
+        ++pool.pending;
+        out_refills.emplace_back(key, pool.target);
+    }
+}
+
+
+void warm_pool_t::run(std::uint64_t generation, std::vector<refill_t>& refills)
+{
+    // CAUTION: m_mutex must not be locked by caller
+
+    for (auto& refill : refills)
+    {
+        const auto submitted = m_runner(
+            [this, generation, refill]() {
+                const auto conn = m_connector(
+                    refill.second.host, refill.second.port);
+
+                this->on_connected(generation, refill.first, conn);
+            });
+
+        if (submitted)
+            continue;
+
+        // dropped by runner (e.g. being stopped)
+        std::scoped_lock lock(m_mutex);
+
+        if (generation != m_generation)
+            continue;
+
+        const auto pool_it = m_pools.find(refill.first);
+        if (pool_it != m_pools.end() && pool_it->second.pending > 0)
+            --pool_it->second.pending;
+    }
+}
+
+
+void warm_pool_t::on_connected(
+    std::uint64_t generation, const std::string& key, SOCKET conn)
+{
+    const auto now = cix::ticks_now();
+
+    cix::lock_guard lock(m_mutex);
+
+    const auto pool_it = (generation == m_generation) ?
+        m_pools.find(key) : m_pools.end();
+
+    // reconfigured or cleared in the meantime
+    if (pool_it == m_pools.end())
+    {
+        lock.unlock();
+
+        if (conn != INVALID_SOCKET)
+            closesocket(conn);
+
+        return;
+    }
+
+    auto& pool = pool_it->second;
+
+    assert(pool.pending > 0);
+    --pool.pending;
+
+    if (conn == INVALID_SOCKET)
+    {
+        ++m_stats.connect_failures;
+        pool.retry_after = now + retry_delay;
+        return;
+    }
+
+    ++m_stats.connects;
+    pool.idle.push_back(idle_t{conn, now});
+}
@@ -0,0 +1,130 @@
+// Copyright (c) Lexfo
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+
+// Sockets connected ahead of time to a few allowlisted SOCKS targets, so that
+// a CONNECT to one of them gets a ready socket instead of waiting for resolve
+// and connect
+//
+// * opt-in: a target is a host and a port as sent by SOCKS clients, i.e. a
+//   name is matched as is (case-insensitive), not by its addresses
+// * up to *per_target* sockets are kept connected per target; acquire() hands
+//   one over if any, and the pool of the target gets refilled in the
+//   background by *connector*, through *runner* (e.g.
+//   cix::thread_pool::submit())
+// * a pooled socket is not read from, so acquire() checks it first: one that
+//   got closed by its peer is dropped; data received meanwhile (a target that
+//   speaks first) stays in the socket for the client to read
+// * a socket pooled for more than *max_idle* is dropped too, since the target
+//   may have forgotten about it silently (e.g. idle timeout, NAT)
+// * once a connect fails, a target does not get refilled before
+//   *retry_delay*
+// * thread-safe; neither *connector* nor *runner* are called with the lock
+//   held
+class warm_pool_t
+{
+public:
+    typedef std::function<void()> task_t;
+    typedef std::function<bool(task_t&&)> runner_t;  // false if dropped
+
+    // INVALID_SOCKET if failed; the socket is left as is, non-blocking
+    typedef std::function<SOCKET(const std::string&, unsigned short)>
+        connector_t;
+
+    enum : std::size_t
+    {
+        default_per_target = 2,
+        max_per_target = 64,
+    };
+
+    enum : cix::ticks_t
+    {
+        default_max_idle = 30 * cix::ticks_second,
+        retry_delay = 5 * cix::ticks_second,
+    };
+
+    struct target_t
+    {
+        std::string host;
+        unsigned short port;
+    };
+
+    struct stats_t
+    {
+        std::uint64_t hits;     // CONNECTs that got a pooled socket
+        std::uint64_t misses;   // to a target whose pool was empty
+        std::uint64_t connects;
+        std::uint64_t connect_failures;
+        std::uint64_t dropped;  // closed by peer, or idle for too long
+        std::size_t idle;       // pooled sockets
+    };
+
+private:
+    struct idle_t
+    {
+        SOCKET conn;
+        cix::ticks_t since;
+    };
+
+    struct pool_t
+    {
+        target_t target;
+        std::deque<idle_t> idle;
+        std::size_t pending;  // connects running for this pool
+        cix::ticks_t retry_after;  // 0 if no connect failed recently
+    };
+
+    typedef std::pair<std::string, target_t> refill_t;  // key, target
+
+public:
+    warm_pool_t(connector_t&& connector, runner_t&& runner);
+    ~warm_pool_t();
+
+    warm_pool_t(const warm_pool_t&) = delete;
+    warm_pool_t& operator=(const warm_pool_t&) = delete;
+
+    // a comma-separated list of host:port, with IPv6 addresses enclosed in
+    // brackets (e.g. "intranet:80,10.0.0.1:443,[fd00::1]:8080")
+    static bool parse_targets(
+        std::string_view str, std::vector<target_t>& out_targets);
+
+    // replace the targets, dropping the sockets of the former ones, and start
+    // filling the new ones; no target or a null *per_target* disables it
+    void configure(
+        std::vector<target_t>&& targets,
+        std::size_t per_target,
+        cix::ticks_t max_idle);
+
+    // a socket connected to *host*:*port* if one is ready, INVALID_SOCKET
+    // otherwise; the pool of the target, if any, gets refilled either way
+    SOCKET acquire(const std::string& host, unsigned short port);
+
+    // drop all the pooled sockets, and stop refilling until configure()
+    void clear();
+
+    stats_t stats() const;
+
+private:
+    static std::string make_key(const std::string& host, unsigned short port);
+    static bool is_alive(SOCKET conn);
+
+    void refill(
+        const std::string& key, pool_t& pool, cix::ticks_t now,
+        std::vector<refill_t>& out_refills);
+    void run(std::uint64_t generation, std::vector<refill_t>& refills);
+    void on_connected(
+        std::uint64_t generation, const std::string& key, SOCKET conn);
+
+private:
+    const connector_t m_connector;
+    const runner_t m_runner;
+
+    mutable std::mutex m_mutex;
+    std::uint64_t m_generation;  // bumped by configure() and clear()
+    std::size_t m_per_target;
+    cix::ticks_t m_max_idle;
+    std::unordered_map<std::string, pool_t> m_pools;  // see make_key()
+    stats_t m_stats;  // counters only, see stats()
+};
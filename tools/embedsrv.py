@@ -8,6 +8,7 @@ import binascii
 import bz2
 import datetime
 import hashlib
+import lzma
 import os.path
 import re
 import subprocess
@@ -23,19 +24,32 @@ INPUT_FILES = {
     "EXE32SVC": os.path.join(PROJECT_DIR, "svc", "_bin", "rpc2socks32svc.exe"),
     "EXE64SVC": os.path.join(PROJECT_DIR, "svc", "_bin", "rpc2socks64svc.exe")}
 
+# xz decompresses several times faster than bz2, for smaller output; bz2 only
+# remains for the data files generated before, see embexe.py
+CODECS = ("lzma", "bz2")
+DEFAULT_CODEC = "lzma"
+
 
 def die(*msg, exit_code=1, file=sys.stderr, flush=True, **kwargs):
     print("ERROR:", *msg, file=file, flush=flush, **kwargs)
     sys.exit(exit_code)
 
 
-def bin2python(infile, *, columns=70, prefix=b"    ", sep=b"\n", compress=True):
+def bin2python(infile, *, columns=70, prefix=b"    ", sep=b"\n",
+               codec=DEFAULT_CODEC):
     data_raw = infile.read()  # slurp all
     data_size = len(data_raw)
     data_md5 = hashlib.md5(data_raw).hexdigest()
 
-    if compress:
+    if codec == "lzma":
+        # the md5 is checked after decompression already
+        data_raw = lzma.compress(
+            data_raw, format=lzma.FORMAT_XZ, check=lzma.CHECK_NONE,
+            preset=9 | lzma.PRESET_EXTREME)
+    elif codec == "bz2":
         data_raw = bz2.compress(data_raw, compresslevel=9)
+    elif codec is not None:
+        raise ValueError("codec")
     data_b64 = binascii.b2a_base64(data_raw, newline=False)
 
     del data_raw
@@ -165,7 +179,8 @@ def generate_python_script(context):
 
         for name, infile in INPUT_FILES.items():
             with open(infile, mode="rb") as fin:
-                textified, data_size, data_md5 = bin2python(fin)
+                textified, data_size, data_md5 = bin2python(
+                    fin, codec=context.codec)
 
             header = (
                 "\n"
@@ -173,7 +188,8 @@ def generate_python_script(context):
                 f"# {os.path.basename(infile)}\n"
                 f"{name}_SIZE = {data_size}  # uncompressed size\n"
                 f"{name}_MD5 = \"{data_md5}\"  # on uncompressed data\n"
-                f"{name}_DATA = (  # compressed with bz2 and encoded in base64\n")
+                f"{name}_CODEC = \"{context.codec}\"\n"
+                f"{name}_DATA = (  # compressed, and encoded in base64\n")
 
             fout.write(header.encode())
             fout.write(textified)
@@ -194,6 +210,10 @@ def parse_args(args):
     #     "--ignoredirty", action="store_true",
     #     help="Bypass the dirty git repo check")
 
+    parser.add_argument(
+        "--codec", choices=CODECS, default=DEFAULT_CODEC,
+        help="Compression of the embedded executables (default: %(default)s)")
+
     parser.add_argument(
         "--help", "-h", action="help", default=argparse.SUPPRESS,
         help="Show this help message and leave")
@@ -205,6 +225,7 @@ def parse_args(args):
     # context.ignoredirty = opts.ignoredirty
     context.repodir = PROJECT_DIR
     context.outfile = OUTPUT_SCRIPT
+    context.codec = opts.codec
 
     return context
 